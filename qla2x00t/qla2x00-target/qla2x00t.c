@@ -4063,6 +4063,8 @@ static int q24_do_send_cmd_to_scst(struct q2t_cmd *cmd)
 		break;
 	}
 
+	scst_cmd_set_prio(&cmd->scst_cmd, atio->fcp_cmnd.priority);
+
 #ifdef CONFIG_QLA_TGT_DEBUG_WORK_IN_THREAD
 	context = SCST_CONTEXT_THREAD;
 #else
@@ -421,9 +421,11 @@ typedef struct {
 	uint8_t  cmnd_ref;
 #ifdef __LITTLE_ENDIAN
 	uint8_t  task_attr:3;
-	uint8_t  reserved:5;
+	uint8_t  priority:4;
+	uint8_t  reserved:1;
 #else
-	uint8_t  reserved:5;
+	uint8_t  reserved:1;
+	uint8_t  priority:4;
 	uint8_t  task_attr:3;
 #endif
 	uint8_t  task_mgmt_flags;
@@ -227,6 +227,22 @@ static inline int vfs_fsync_backport(struct file *file, int datasync)
 #define vfs_fsync vfs_fsync_backport
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+/*
+ * See also patch "new helpers: inode_lock()/inode_unlock()/inode_lock_nested()/
+ * inode_trylock()" (commit ID 5955102c9984).
+ */
+static inline void inode_lock(struct inode *inode)
+{
+	mutex_lock(&inode->i_mutex);
+}
+
+static inline void inode_unlock(struct inode *inode)
+{
+	mutex_unlock(&inode->i_mutex);
+}
+#endif
+
 /* <linux/kernel.h> */
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 19)
@@ -476,6 +492,26 @@ static inline void *kmalloc_array(size_t n, size_t size, gfp_t flags)
 }
 #endif
 
+/* <linux/string.h> */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 2, 0)
+/*
+ * See also patch "lib/string.c: introduce memchr_inv()" (commit ID
+ * 798248206b59acc6e1238c778281419c041891a7).
+ */
+static inline void *memchr_inv(const void *start, int c, size_t bytes)
+{
+	const u8 *p = start;
+
+	while (bytes-- > 0) {
+		if (*p != (u8)c)
+			return (void *)p;
+		p++;
+	}
+	return NULL;
+}
+#endif
+
 /* <linux/t10-pi.h> */
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 18, 0)
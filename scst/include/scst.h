@@ -39,6 +39,8 @@
 #include <linux/wait.h>
 #include <linux/cpumask.h>
 #include <linux/dlm.h>
+#include <linux/rbtree.h>
+#include <linux/hrtimer.h>
 #ifdef CONFIG_SCST_MEASURE_LATENCY
 #include <linux/log2.h>
 #endif
@@ -48,6 +50,15 @@
 #define CONFIG_SCST_PER_DEVICE_CMD_COUNT_LIMIT
 #endif
 
+/*
+ * Interval trees are available starting from kernel 3.7. On older kernels
+ * overlaps with SCSI atomic commands are found by scanning all being
+ * executed on the device commands.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0)
+#define SCST_EXEC_LBA_TREE
+#endif
+
 /* #define CONFIG_SCST_PROC */
 
 #ifdef CONFIG_SCST_PROC
@@ -679,6 +690,7 @@ struct scst_cmd;
 struct scst_mgmt_cmd;
 struct scst_device;
 struct scst_tgt_dev;
+struct scst_iopat;
 struct scst_dev_type;
 struct scst_acg;
 struct scst_acg_dev;
@@ -727,11 +739,34 @@ struct scst_tgt_template {
 	 * hardware, i.e. after rdy_to_xfer() and xmit_response(), before
 	 * on_hw_pending_cmd_timeout() will be called, if defined.
 	 *
-	 * In the current implementation a cmd will be aborted in time t
-	 * max_hw_pending_time <= t < 2*max_hw_pending_time.
+	 * In the current implementation a cmd will be aborted as soon as
+	 * max_hw_pending_time passed since it entered rdy_to_xfer() or
+	 * xmit_response(), with accuracy of the delayed work scheduling.
 	 */
 	int max_hw_pending_time;
 
+	/*
+	 * Number of commands SCST should preallocate for each session of
+	 * this target, usually the queue depth the target advertises. The
+	 * pool is allocated with GFP_KERNEL on the session registration.
+	 * scst_rx_cmd() takes commands from this pool and allocates new ones
+	 * only if the pool is exhausted.
+	 *
+	 * OPTIONAL
+	 */
+	int sess_cmd_pool_size;
+
+	/*
+	 * Size of the target driver's private area, which SCST should
+	 * allocate together with each command returned by scst_rx_cmd(), so
+	 * the target driver doesn't need to allocate its per-command object
+	 * separately. It is zeroed on each scst_rx_cmd() and accessible via
+	 * scst_cmd_get_tgt_priv_area().
+	 *
+	 * OPTIONAL
+	 */
+	int cmd_priv_size;
+
 	/*
 	 * SG tablesize allows to check whether scatter/gather can be used
 	 * or not.
@@ -1864,6 +1899,113 @@ struct scst_io_stat_entry {
 	uint64_t unaligned_cmd_count;
 };
 
+/*
+ * Token bucket, implemented as GCRA (virtual scheduling): a command
+ * conforms, if it arrives not earlier than tau ns before the theoretical
+ * arrival time tat.
+ */
+struct scst_qos_bucket {
+	/* Units (commands or bytes) per second, 0 means no limit */
+	uint64_t rate;
+
+	/* Burst tolerance in ns */
+	uint64_t tau;
+
+	/* Theoretical arrival time in ns */
+	uint64_t tat;
+};
+
+/*
+ * IOPS and bandwidth limits of a session, tgt_dev or device. Commands over
+ * the limits are deferred on qos_throttled_cmd_list until qos_timer fires.
+ */
+struct scst_qos {
+	/* Set if any limit is configured, checked locklessly */
+	bool qos_enabled;
+
+	/* Protects all fields below */
+	spinlock_t qos_lock;
+
+	/* Limits as set by the user, 0 means no limit */
+	unsigned int qos_iops, qos_iops_burst;
+	unsigned int qos_bw_mb, qos_bw_burst_mb;
+
+	struct scst_qos_bucket qos_iops_bucket;
+	struct scst_qos_bucket qos_bw_bucket;
+
+	struct list_head qos_throttled_cmd_list;
+	struct hrtimer qos_timer;
+
+	/* Set if qos_throttled_cmd_list might contain aborted cmds */
+	bool qos_abort_pending;
+
+	/* Statistics */
+	uint64_t qos_throttled_cmds;
+	uint64_t qos_throttled_ns;
+};
+
+/*
+ * Adaptive queue depth of a device: max number of the device's commands in
+ * SCST, which is changed AIMD-style depending on the device's latency.
+ * Commands over it are rejected with TASK SET FULL or BUSY status.
+ */
+struct scst_aqd {
+	/* Target latency in us, 0 means disabled. Checked locklessly. */
+	unsigned int aqd_target_lat_us;
+
+	/* Current depth limit, checked locklessly */
+	int aqd_depth;
+
+	/* Number of the device's commands in SCST, counted by this limit */
+	atomic_t aqd_cmd_count;
+
+	/* Set if aqd_depth was reached in the current period */
+	bool aqd_limited;
+
+	/* Protects the fields below */
+	spinlock_t aqd_lock;
+
+	unsigned int aqd_min_depth, aqd_max_depth;
+
+	/* Current control period */
+	unsigned long aqd_period_start;
+	uint64_t aqd_period_lat_us;
+	unsigned int aqd_period_cmds;
+	unsigned int aqd_period_rejected;
+
+	/* Ends the periods, in which no commands finished, while enabled */
+	struct timer_list aqd_timer;
+
+	/* Statistics */
+	unsigned int aqd_last_lat_us;
+	unsigned int aqd_last_rejected_rate;
+	uint64_t aqd_rejected_cmds;
+};
+
+/*
+ * Strict priority lanes of the device scheduler. Commands in a lower lane
+ * are dispatched only if there are no queued commands in the higher lanes.
+ */
+enum scst_sched_lane {
+	SCST_SCHED_LANE_HIGH = 0,
+	SCST_SCHED_LANE_NORMAL,
+	SCST_SCHED_LANE_LOW,
+	SCST_SCHED_LANES,
+};
+
+/* Queue of a tgt_dev's cmds in one lane of the device scheduler */
+struct scst_sched_queue {
+	struct list_head sched_cmd_list;
+
+	/* Entry in dev's sched_flow_list, if sched_cmd_list isn't empty */
+	struct list_head sched_flow_list_entry;
+
+	/* Virtual finish time of the last queued cmd */
+	uint64_t sched_vfinish;
+
+	struct scst_tgt_dev *sched_tgt_dev;
+};
+
 /*
  * SCST session, analog of SCSI I_T nexus
  */
@@ -1902,6 +2044,14 @@ struct scst_session {
 
 	spinlock_t sess_list_lock; /* protects sess_cmd_list, etc */
 
+	/*
+	 * List of cmds from sess_cmd_list, which haven't been moved to
+	 * their tgt_dev->tgt_dev_cmd_list yet. Protected by sess_list_lock.
+	 * Cmds are moved lazily by scst_sort_sess_cmds() from TM
+	 * processing, so some of them may already have tgt_dev assigned.
+	 */
+	struct list_head sess_no_tgt_dev_cmd_list;
+
 	atomic_t refcnt;		/* get/put counter */
 
 	/*
@@ -1910,9 +2060,19 @@ struct scst_session {
 	 */
 	atomic_t sess_cmd_count;
 
+	/*
+	 * Free preallocated cmds, see tgtt->sess_cmd_pool_size. Protected
+	 * by sess_cmd_pool_lock.
+	 */
+	struct list_head sess_cmd_pool_list;
+	spinlock_t sess_cmd_pool_lock;
+
 	/* Some statistics. Protected by sess_list_lock. */
 	struct scst_io_stat_entry io_stats[SCST_DATA_DIR_MAX];
 
+	/* IOPS and bandwidth limits of this session */
+	struct scst_qos sess_qos;
+
 	/* Access control for this session and list entry there */
 	struct scst_acg *acg;
 
@@ -2184,6 +2344,9 @@ struct scst_cmd {
 	/* Set if cmd is on dev's exec_cmd_list */
 	unsigned int on_dev_exec_list:1;
 
+	/* Set if cmd is in dev's dev_exec_lba_tree */
+	unsigned int on_dev_exec_lba_tree:1;
+
 	/* Set if this cmd passed check for SCSI atomicity */
 	unsigned int scsi_atomicity_checked:1;
 
@@ -2193,6 +2356,15 @@ struct scst_cmd {
 	/* Set if cmd has NACA bit set in CDB */
 	unsigned int cmd_naca:1;
 
+	/* Set if cmd passed the QoS limits and the device scheduler */
+	unsigned int exec_admitted:1;
+
+	/* Set if cmd is counted in dev->sched_dispatched */
+	unsigned int sched_counted:1;
+
+	/* Set if cmd is counted in dev->dev_aqd.aqd_cmd_count */
+	unsigned int aqd_counted:1;
+
 	/*
 	 * Set if the target driver wants to alloc data buffers on its own.
 	 * In this case tgt_alloc_data_buf() must be provided in the target
@@ -2279,6 +2451,18 @@ struct scst_cmd {
 	/* Set if cmd was pre-alloced by target driver */
 	unsigned int pre_alloced:1;
 
+	/* Set if cmd was taken from sess's sess_cmd_pool_list */
+	unsigned int sess_pooled:1;
+
+	/* Set if cmd was allocated by kmalloc() together with tgt priv area */
+	unsigned int cmd_kmalloced:1;
+
+	/*
+	 * Set if cmd has the target driver's private area of
+	 * tgtt->cmd_priv_size bytes right after it
+	 */
+	unsigned int has_tgt_priv_area:1;
+
 	/* Set if cmd was already ALUA checked in TRANSITIONING state */
 	unsigned int already_transitioning:1;
 
@@ -2337,6 +2521,12 @@ struct scst_cmd {
 	/* List entry for sess's sess_cmd_list */
 	struct list_head sess_cmd_list_entry;
 
+	/*
+	 * List entry for tgt_dev's tgt_dev_cmd_list or, until
+	 * scst_sort_sess_cmds() moves it, for sess's sess_no_tgt_dev_cmd_list
+	 */
+	struct list_head tgt_dev_cmd_list_entry;
+
 	/*
 	 * Used to found the cmd by scst_find_cmd_by_tag(). Set by the
 	 * target driver on the cmd's initialization time
@@ -2352,6 +2542,13 @@ struct scst_cmd {
 	/* List entry for dev's dev_exec_cmd_list */
 	struct list_head dev_exec_cmd_list_entry;
 
+#ifdef SCST_EXEC_LBA_TREE
+	/* Node in dev's dev_exec_lba_tree with its interval tree data */
+	struct rb_node dev_exec_lba_node;
+	uint64_t dev_exec_lba_last;
+	uint64_t dev_exec_lba_subtree_last;
+#endif
+
 	/*
 	 * Array of blocked by this cmd SCSI atomic cmds with size
 	 * scsi_atomic_blocked_cmds_count. Protected by dev->dev_lock.
@@ -2367,6 +2564,12 @@ struct scst_cmd {
 
 	enum scst_cmd_queue_type queue_type;
 
+	/*
+	 * SAM command priority: 0 - not specified, 1 - the highest, 15 - the
+	 * lowest. Set by the target driver, if its transport delivers it.
+	 */
+	uint8_t cmd_prio;
+
 	int timeout; /* CDB execution timeout in seconds */
 	int retries; /* Amount of retries that will be done by SCSI mid-level */
 
@@ -2504,6 +2707,27 @@ struct scst_cmd {
 	/* List entry for dev's blocked_cmd_list */
 	struct list_head blocked_cmd_list_entry;
 
+	/* List entry for qos_throttled_cmd_list and when it was added there */
+	struct list_head qos_list_entry;
+	ktime_t qos_throttle_start;
+
+	/*
+	 * Bitmask of the QoS levels, which already charged cmd, when their
+	 * timer released it, see __scst_qos_throttle()
+	 */
+	unsigned int qos_charged;
+
+	/*
+	 * Entry in tgt_dev's sched_cmd_list, virtual start time of this cmd
+	 * and when it was queued there. Protected by dev->sched_lock.
+	 */
+	struct list_head sched_list_entry;
+	uint64_t sched_vstart;
+	ktime_t sched_queue_start;
+
+	/* When cmd was sent to the device, if it's aqd_counted */
+	ktime_t aqd_exec_start;
+
 	/* Used to retry commands in case of double UA */
 	int dbl_ua_orig_resp_data_len, dbl_ua_orig_data_direction;
 
@@ -2891,11 +3115,19 @@ struct scst_device {
 	int dev_scsi_atomic_cmd_active;
 
 	/*
-	 * List of all being executed on the dev commands.
-	 * Protected by dev_lock.
+	 * List of all being executed on the dev commands, which are not in
+	 * dev_exec_lba_tree. Protected by dev_lock.
 	 */
 	struct list_head dev_exec_cmd_list;
 
+#ifdef SCST_EXEC_LBA_TREE
+	/*
+	 * Interval tree of LBA ranges of being executed on the dev commands
+	 * with valid LBA range. Protected by dev_lock.
+	 */
+	struct rb_root dev_exec_lba_tree;
+#endif
+
 	/* Memory limits for this device */
 	struct scst_mem_lim dev_mem_lim;
 
@@ -2996,6 +3228,41 @@ struct scst_device {
 
 	struct scst_order_data dev_order_data;
 
+	/* IOPS and bandwidth limits of this device */
+	struct scst_qos dev_qos;
+
+	/*
+	 * Device scheduler. Commands over sched_depth dispatched ones are
+	 * queued per tgt_dev and per priority lane, then dispatched by
+	 * weighted fair queuing between tgt_devs. Protects the fields below
+	 * as well as the scheduler fields of the tgt_devs and cmds.
+	 */
+	spinlock_t sched_lock;
+
+	/* Max number of dispatched cmds, 0 - the scheduler is disabled */
+	int sched_depth;
+
+	int sched_dispatched;
+	int sched_queued;
+
+	/* Non-empty tgt_dev's queues of each lane and the lane's virtual time */
+	struct list_head sched_flow_list[SCST_SCHED_LANES];
+	uint64_t sched_vtime[SCST_SCHED_LANES];
+
+	/* Adaptive queue depth of this device */
+	struct scst_aqd dev_aqd;
+
+	/* I/O pattern statistics, if enabled. RCU protected. */
+	struct scst_iopat *dev_iopat;
+
+	/*
+	 * Serializes dev_iopat changes and protects the snapshot of it,
+	 * being read from sysfs.
+	 */
+	struct mutex dev_iopat_mutex;
+	void *dev_iopat_snap;
+	size_t dev_iopat_snap_len;
+
 	/*
 	 * Where to save persistent reservation information. Protected by
 	 * dev_pr_mutex.
@@ -3131,6 +3398,13 @@ struct scst_tgt_dev {
 	/* How many cmds alive on this dev in this session */
 	atomic_t tgt_dev_cmd_count ____cacheline_aligned_in_smp;
 
+	/*
+	 * List of this session's cmds with tgt_dev set to this tgt_dev,
+	 * i.e. the subset of sess_cmd_list TM functions for this LUN are
+	 * interested in. Protected by sess->sess_list_lock.
+	 */
+	struct list_head tgt_dev_cmd_list;
+
 	/* ALUA command filter */
 #define SCST_ALUA_CHECK_OK	0
 #define SCST_ALUA_CHECK_DELAYED 1
@@ -3181,6 +3455,27 @@ struct scst_tgt_dev {
 	atomic_t tgt_dev_dif_app_failed_scst, tgt_dev_dif_ref_failed_scst, tgt_dev_dif_guard_failed_scst;
 	atomic_t tgt_dev_dif_app_failed_dev, tgt_dev_dif_ref_failed_dev, tgt_dev_dif_guard_failed_dev;
 
+	/* IOPS and bandwidth limits of this tgt_dev */
+	struct scst_qos tgt_dev_qos;
+
+	/* Device scheduler data, protected by dev->sched_lock */
+	unsigned int sched_weight;
+	struct scst_sched_queue sched_queues[SCST_SCHED_LANES];
+
+	/* Device scheduler statistics, protected by dev->sched_lock */
+	uint64_t sched_queued_cmds;
+	uint64_t sched_wait_ns;
+	uint64_t sched_max_wait_ns;
+
+	/*
+	 * I/O pattern statistics: the LBA following the last command and
+	 * how many commands were sequential to their previous one. Updated
+	 * without locking, so they are approximate.
+	 */
+	uint64_t iopat_next_lba;
+	uint64_t iopat_seq_cmds;
+	uint64_t iopat_rand_cmds;
+
 	/*
 	 * Stored Unit Attention sense and its length for possible
 	 * subsequent REQUEST SENSE. Both protected by tgt_dev_lock.
@@ -4354,6 +4649,19 @@ static inline void scst_cmd_set_queue_type(struct scst_cmd *cmd,
 	cmd->queue_type = queue_type;
 }
 
+/*
+ * Get/Set functions for cmd's SAM command priority
+ */
+static inline uint8_t scst_cmd_get_prio(struct scst_cmd *cmd)
+{
+	return cmd->cmd_prio;
+}
+
+static inline void scst_cmd_set_prio(struct scst_cmd *cmd, uint8_t prio)
+{
+	cmd->cmd_prio = prio & 0xF;
+}
+
 /*
  * Get/Set functions for cmd's target SN
  */
@@ -4383,6 +4691,20 @@ static inline void scst_cmd_set_tgt_priv(struct scst_cmd *cmd, void *val)
 	cmd->tgt_i_priv = val;
 }
 
+/*
+ * Returns the target driver's private area of tgtt->cmd_priv_size bytes
+ * allocated together with cmd by scst_rx_cmd(). Must not be called for
+ * cmds without it, i.e. for internal cmds, cmds passed to
+ * scst_rx_cmd_prealloced() and cmds of targets with zero cmd_priv_size.
+ */
+static inline void *scst_cmd_get_tgt_priv_area(struct scst_cmd *cmd)
+{
+#ifdef CONFIG_SCST_EXTRACHECKS
+	BUG_ON(!cmd->has_tgt_priv_area);
+#endif
+	return cmd + 1;
+}
+
 /*
  * Get/Set functions for tgt_need_alloc_data_buf flag
  */
@@ -342,6 +342,7 @@ static inline int scst_sense_response_code(const uint8_t *sense)
 
 /* DATA_PROTECT is 7 */
 #define scst_sense_data_protect			DATA_PROTECT,    0x27, 0
+#define scst_sense_space_alloc_failed		DATA_PROTECT,    0x27, 0x07
 
 /* ABORTED_COMMAND is 0xb */
 #define scst_sense_aborted_command		ABORTED_COMMAND, 0x00, 0
@@ -735,6 +736,43 @@ enum scst_tg_sup {
 #define SCST_THREADS_POOL_PER_INITIATOR_STR	"per_initiator"
 #define SCST_THREADS_POOL_SHARED_STR		"shared"
 
+/*************************************************************
+ ** Layout of the binary "io_pattern_data" sysfs attribute of
+ ** devices: struct scst_iopat_hdr, then lba_buckets uint64_t
+ ** heat counters, then "initiators" struct scst_iopat_initiator.
+ ** All fields are in the host byte order.
+ *************************************************************/
+#define SCST_IOPAT_MAGIC			0x54415049 /* "IPAT" */
+#define SCST_IOPAT_VERSION			1
+
+/*
+ * Size histograms buckets: bucket i counts commands with data length
+ * from 512 << i to (512 << (i + 1)) - 1 bytes, the first and the last
+ * buckets are open-ended.
+ */
+#define SCST_IOPAT_SIZE_BUCKETS			16
+
+struct scst_iopat_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t hdr_len;
+	uint32_t lba_buckets;
+	uint32_t initiators;
+	uint32_t half_life_s;
+	uint64_t lba_bucket_size;	/* in bytes */
+	uint64_t read_cmds;
+	uint64_t write_cmds;
+	uint64_t read_size_hist[SCST_IOPAT_SIZE_BUCKETS];
+	uint64_t write_size_hist[SCST_IOPAT_SIZE_BUCKETS];
+};
+
+struct scst_iopat_initiator {
+	char initiator_name[SCST_MAX_EXTERNAL_NAME];
+	uint64_t lun;
+	uint64_t seq_cmds;
+	uint64_t rand_cmds;
+};
+
 /*************************************************************
  ** Misc constants
  *************************************************************/
@@ -84,6 +84,7 @@ void sgv_pool_flush(struct sgv_pool *pool);
 void sgv_pool_set_allocator(struct sgv_pool *pool,
 	struct page *(*alloc_pages_fn)(struct scatterlist *, gfp_t, void *),
 	void (*free_pages_fn)(struct scatterlist *, int, void *));
+int sgv_pool_set_max_page_kb(struct sgv_pool *pool, int max_page_kb);
 
 struct scatterlist *sgv_pool_alloc(struct sgv_pool *pool, unsigned int size,
 	gfp_t gfp_mask, int flags, int *count,
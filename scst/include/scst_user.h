@@ -357,6 +357,45 @@ struct scst_user_get_multi {
 	struct scst_user_get_cmd cmds[0]; /* out */
 };
 
+/*
+ * Shared memory rings, see SCST_USER_RING_SETUP. Each index is written
+ * only by one side and lives in its own cache line.
+ */
+#define SCST_USER_RING_ALIGN		128
+#define SCST_USER_RING_MAX_ENTRIES	32768
+
+/* Values for scst_user_ring_hdr.kernel_flags */
+#define SCST_USER_RING_KERNEL_IDLE	1
+
+/* Values for scst_user_ring_hdr.user_flags */
+#define SCST_USER_RING_USER_IDLE	1
+
+struct scst_user_ring_hdr {
+	/* SQ: subcommands from the kernel to the user space handler */
+	uint32_t sq_tail __attribute__((aligned(SCST_USER_RING_ALIGN)));
+	uint32_t sq_head __attribute__((aligned(SCST_USER_RING_ALIGN)));
+	/* CQ: replies from the user space handler to the kernel */
+	uint32_t cq_tail __attribute__((aligned(SCST_USER_RING_ALIGN)));
+	uint32_t cq_head __attribute__((aligned(SCST_USER_RING_ALIGN)));
+	uint32_t kernel_flags __attribute__((aligned(SCST_USER_RING_ALIGN)));
+	uint32_t user_flags __attribute__((aligned(SCST_USER_RING_ALIGN)));
+};
+
+/* Be careful adding new members here, this structure is allocated on stack! */
+struct scst_user_ring_setup {
+	/* in */
+	uint32_t sq_entries;
+	uint32_t cq_entries;
+	int32_t eventfd;
+	uint32_t poll_usecs;
+	uint32_t flags;
+
+	/* out */
+	uint32_t sq_off;
+	uint32_t cq_off;
+	uint32_t mmap_size;
+};
+
 #define SCST_USER_REGISTER_DEVICE	_IOW('u', 1, struct scst_user_dev_desc)
 #define SCST_USER_UNREGISTER_DEVICE	_IO('u', 2)
 #define SCST_USER_SET_OPTIONS		_IOW('u', 3, struct scst_user_opt)
@@ -368,6 +407,8 @@ struct scst_user_get_multi {
 #define SCST_USER_GET_EXTENDED_CDB	_IOWR('u', 9, struct scst_user_get_ext_cdb)
 #define SCST_USER_PREALLOC_BUFFER	_IOWR('u', 10, union scst_user_prealloc_buffer)
 #define SCST_USER_REPLY_AND_GET_MULTI	_IOWR('u', 11, struct scst_user_get_multi)
+#define SCST_USER_RING_SETUP		_IOWR('u', 12, struct scst_user_ring_setup)
+#define SCST_USER_RING_WAKEUP		_IO('u', 13)
 
 /* Values for scst_user_get_cmd.subcode */
 #define SCST_USER_ATTACH_SESS		\
@@ -42,6 +42,13 @@
 
 #define DISK_DEF_BLOCK_SHIFT	9
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)
+static unsigned int disk_split_depth = 8;
+module_param_named(split_depth, disk_split_depth, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(split_depth, "Max number of pieces of a split command "
+	"submitted at once (1 - one by one)");
+#endif
+
 static int disk_attach(struct scst_device *dev);
 static void disk_detach(struct scst_device *dev);
 static int disk_parse(struct scst_cmd *cmd);
@@ -340,15 +347,32 @@ static bool disk_on_sg_tablesize_low(struct scst_cmd *cmd)
 
 struct disk_work {
 	struct scst_cmd *cmd;
-	struct completion disk_work_cmpl;
+
+	/* Number of submitted, but not yet completed pieces */
+	atomic_t inflight;
+	wait_queue_head_t inflight_waitQ;
+
+	/* Protects the failed piece info and serializes wake ups */
+	spinlock_t lock;
+	/* The failed piece with the lowest offset, if any */
+	bool failed;
+	unsigned int fail_offset;
 	int result;
-	unsigned int left;
+	int resid;
+	uint8_t sense[SCST_SENSE_BUFFERSIZE];
+
 	int64_t save_lba;
 	int save_len;
 	struct scatterlist *save_sg;
 	int save_sg_cnt;
 };
 
+struct disk_piece {
+	struct disk_work *work;
+	unsigned int offset;	/* in bytes */
+	unsigned int len;	/* in bytes */
+};
+
 static void disk_restore_sg(struct disk_work *work)
 {
 	scst_set_cdb_lba(work->cmd, work->save_lba);
@@ -358,31 +382,61 @@ static void disk_restore_sg(struct disk_work *work)
 	return;
 }
 
+/* Called in the atomic context */
 static void disk_cmd_done(void *data, char *sense, int result, int resid)
 {
-	struct disk_work *work = data;
+	struct disk_piece *piece = data;
+	struct disk_work *work = piece->work;
+	unsigned long flags;
 
 	TRACE_ENTRY();
 
-	TRACE_DBG("work %p, cmd %p, left %d, result %d, sense %p, resid %d",
-		work, work->cmd, work->left, result, sense, resid);
+	TRACE_DBG("work %p, cmd %p, offset %u, len %u, result %d, sense %p, "
+		"resid %d", work, work->cmd, piece->offset, piece->len, result,
+		sense, resid);
 
-	work->result = result;
+	spin_lock_irqsave(&work->lock, flags);
 
-	if (result == SAM_STAT_GOOD)
-		goto out_complete;
+	/*
+	 * If several pieces failed, report the first one in the LBA order
+	 * with everything after it as not transferred, the same as if the
+	 * pieces were executed one by one.
+	 */
+	if ((result != SAM_STAT_GOOD) &&
+	    (!work->failed || (piece->offset < work->fail_offset))) {
+		work->failed = true;
+		work->fail_offset = piece->offset;
+		work->result = result;
+		work->resid = resid + work->save_len -
+				(piece->offset + piece->len);
+		if (sense != NULL)
+			memcpy(work->sense, sense, sizeof(work->sense));
+		else
+			memset(work->sense, 0, sizeof(work->sense));
+	}
 
-	disk_restore_sg(work);
+	/* Under lock, so disk_exec() can't return before we are done */
+	atomic_dec(&work->inflight);
+	wake_up(&work->inflight_waitQ);
 
-	scst_pass_through_cmd_done(work->cmd, sense, result, resid + work->left);
+	spin_unlock_irqrestore(&work->lock, flags);
 
-out_complete:
-	complete_all(&work->disk_work_cmpl);
+	kfree(piece);
 
 	TRACE_EXIT();
 	return;
 }
 
+static void disk_wait_inflight(struct disk_work *work, int max)
+{
+	wait_event(work->inflight_waitQ, atomic_read(&work->inflight) <= max);
+
+	/* Wait for disk_cmd_done() to leave the lock */
+	spin_lock_irq(&work->lock);
+	spin_unlock_irq(&work->lock);
+	return;
+}
+
 /* Executes command and split CDB, if necessary */
 static int disk_exec(struct scst_cmd *cmd)
 {
@@ -395,6 +449,7 @@ static int disk_exec(struct scst_cmd *cmd)
 	int sg_tablesize = cmd->dev->scsi_dev->host->sg_tablesize;
 	unsigned int max_sectors;
 	int num, j, block_shift = dev->block_shift;
+	int depth;
 
 	TRACE_ENTRY();
 
@@ -439,6 +494,9 @@ split:
 
 	memset(&work, 0, sizeof(work));
 	work.cmd = cmd;
+	atomic_set(&work.inflight, 0);
+	init_waitqueue_head(&work.inflight_waitQ);
+	spin_lock_init(&work.lock);
 	work.save_sg = cmd->sg;
 	work.save_sg_cnt = cmd->sg_cnt;
 	work.save_lba = cmd->lba;
@@ -458,10 +516,19 @@ split:
 		sg_tablesize, max_sectors, block_shift, sizeof(*sg));
 
 	/*
-	 * If we submit all chunks async'ly, it will be very not trivial what
-	 * to do if several of them finish with sense or residual. So, let's
-	 * do it synchronously.
+	 * Up to depth pieces are submitted at once. If several of them finish
+	 * with sense or residual, disk_cmd_done() keeps the lowest failed
+	 * one, so the result is the same as if the pieces were executed one
+	 * by one. ORDERED commands must keep their pieces ordered as well,
+	 * so submit them one by one. So must commands with CDBs longer than
+	 * SCST_MAX_CDB_SIZE (== BLK_MAX_CDB): scst_scsi_exec_async() doesn't
+	 * copy such CDBs, but points the request to cmd->cdb, which is
+	 * rewritten for each piece.
 	 */
+	depth = max_t(int, ACCESS_ONCE(disk_split_depth), 1);
+	if ((cmd->queue_type == SCST_CMD_QUEUE_ORDERED) ||
+	    (cmd->cdb_len > SCST_MAX_CDB_SIZE))
+		depth = 1;
 
 	num = 1;
 	j = 0;
@@ -493,28 +560,42 @@ split:
 		if (((num % sg_tablesize) == 0) ||
 		     (num == work.save_sg_cnt) ||
 		     (cur_len >= max_sectors)) {
+			struct disk_piece *piece;
+
 			TRACE_DBG("%s", "Execing...");
 
+			disk_wait_inflight(&work, depth - 1);
+			if (work.failed)
+				goto out_failed;
+
+			piece = kmalloc(sizeof(*piece), cmd->cmd_gfp_mask);
+			if (unlikely(piece == NULL)) {
+				PRINT_ERROR("Unable to allocate split piece "
+					"(cmd %p)", cmd);
+				goto out_err_drain;
+			}
+			piece->work = &work;
+			piece->offset = offset << block_shift;
+			piece->len = cur_len << block_shift;
+
+			/*
+			 * scst_scsi_exec_async() maps sg and copies CDB, if
+			 * it isn't longer than SCST_MAX_CDB_SIZE, otherwise
+			 * depth is 1. So they can be changed for the next
+			 * piece right after.
+			 */
 			scst_set_cdb_lba(work.cmd, work.save_lba + offset);
 			scst_set_cdb_transf_len(work.cmd, cur_len);
 			cmd->sg = start_sg;
 			cmd->sg_cnt = cur_sg_cnt;
 
-			work.left = work.save_len - (offset + cur_len);
-			init_completion(&work.disk_work_cmpl);
-
-			rc = scst_scsi_exec_async(cmd, &work, disk_cmd_done);
+			atomic_inc(&work.inflight);
+			rc = scst_scsi_exec_async(cmd, piece, disk_cmd_done);
 			if (unlikely(rc != 0)) {
 				PRINT_ERROR("scst_scsi_exec_async() failed: %d", rc);
-				goto out_err_restore;
-			}
-
-			wait_for_completion(&work.disk_work_cmpl);
-
-			if (work.result != SAM_STAT_GOOD) {
-				/* cmd can be already dead */
-				res = SCST_EXEC_COMPLETED;
-				goto out;
+				atomic_dec(&work.inflight);
+				kfree(piece);
+				goto out_err_drain;
 			}
 
 			offset += cur_len;
@@ -529,6 +610,10 @@ split:
 		j++;
 	}
 
+	disk_wait_inflight(&work, 0);
+	if (work.failed)
+		goto out_failed;
+
 	cmd->completed = 1;
 
 out_restore:
@@ -542,7 +627,18 @@ out:
 	TRACE_EXIT_RES(res);
 	return res;
 
-out_err_restore:
+out_failed:
+	disk_wait_inflight(&work, 0);
+	disk_restore_sg(&work);
+	scst_pass_through_cmd_done(cmd, work.sense, work.result, work.resid);
+	/* cmd can be already dead */
+	res = SCST_EXEC_COMPLETED;
+	goto out;
+
+out_err_drain:
+	disk_wait_inflight(&work, 0);
+	if (work.failed)
+		goto out_failed;
 	scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_internal_failure));
 	goto out_restore;
 
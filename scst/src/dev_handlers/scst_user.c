@@ -22,6 +22,15 @@
 #include <linux/poll.h>
 #include <linux/stddef.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/hash.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 32)
+#include <linux/eventfd.h>
+#include <linux/mmu_context.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/mm.h>
+#endif
 
 #define LOG_PREFIX		DEV_USER_NAME
 
@@ -46,6 +55,62 @@
 #define DEV_USER_CMD_HASH_ORDER		6
 #define DEV_USER_ATTACH_TIMEOUT		(5*HZ)
 
+/* Values of scst_user_dev.steering, see dev_user_steer() */
+enum {
+	DEV_USER_STEER_NONE,
+	DEV_USER_STEER_CPU,
+	DEV_USER_STEER_LBA,
+};
+
+/*
+ * Per-CPU ready queue. All fields protected by lock. If taken together with
+ * udev_cmd_threads.cmd_list_lock, it nests inside it. Queues are locked
+ * one at a time, walks over all of them go in the index order.
+ */
+struct scst_user_queue {
+	spinlock_t lock;
+	struct list_head cmd_list;
+	unsigned int depth;
+	unsigned int max_depth;
+
+	/* Statistics */
+	uint64_t queued;
+	uint64_t dequeued;
+	uint64_t stolen;
+	uint64_t wait_ns;
+	uint64_t max_wait_ns;
+} ____cacheline_aligned_in_smp;
+
+/* Shared memory rings of a device, see dev_user_ring_setup() */
+struct scst_user_ring {
+	void *mem;
+	unsigned int mem_size;
+
+	/* All in mem, hence shared with the user space */
+	struct scst_user_ring_hdr *hdr;
+	struct scst_user_get_cmd *sq;
+	struct scst_user_reply_cmd *cq;
+
+	uint32_t sq_mask;
+	uint32_t cq_mask;
+
+	/* Private copies of the indexes only the ring thread updates */
+	uint32_t sq_tail;
+	uint32_t cq_head;
+
+	/* Current and max busy poll windows of the ring thread */
+	u64 poll_ns;
+	u64 max_poll_ns;
+
+	struct task_struct *thread;
+	struct mm_struct *mm;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0)
+	mm_segment_t old_fs;
+#endif
+	struct eventfd_ctx *eventfd;
+	wait_queue_head_t user_waitQ;
+};
+
 struct scst_user_dev {
 	/*
 	 * Must be kept here, because it's needed on the cleanup time,
@@ -53,8 +118,26 @@ struct scst_user_dev {
 	 */
 	struct scst_cmd_threads udev_cmd_threads;
 
-	/* Protected by udev_cmd_threads.cmd_list_lock */
+	/*
+	 * Ready PARSING, BUF_ALLOCING, HEAD OF QUEUE and mgmt ucmds, which are
+	 * always served first. Protected by udev_cmd_threads.cmd_list_lock.
+	 * Other ucmds are steered to the per-CPU queues, which have their own
+	 * locks, so queueing them doesn't need cmd_list_lock.
+	 */
 	struct list_head ready_cmd_list;
+	struct scst_user_queue *queues;
+	int queues_num;
+	/* Number of ucmds in all the per-CPU queues */
+	atomic_t queued_cnt;
+	/* Read locklessly */
+	int steering;
+
+	/*
+	 * Set by the ring thread under udev_cmd_threads.cmd_list_lock, read
+	 * locklessly. Here, not in the ring, so the readers don't need to
+	 * care about the ring being freed.
+	 */
+	bool ring_idle;
 
 	/*
 	 * Don't need any protection or assignment in SCST_USER_SET_OPTIONS
@@ -94,6 +177,9 @@ struct scst_user_dev {
 
 	struct scst_device *sdev;
 
+	/* Set once, cleared on release under udev_cmd_threads.cmd_list_lock */
+	struct scst_user_ring *ring;
+
 	int virt_id;
 	struct list_head dev_list_entry;
 	char name[SCST_MAX_NAME];
@@ -135,12 +221,21 @@ struct scst_user_cmd {
 	 */
 	unsigned long sent_to_user:1;
 	unsigned long jammed:1;
-	unsigned long this_state_unjammed:1;
 	unsigned long seen_by_user:1; /* here only as a small optimization */
 
+	/*
+	 * Not a bit field, because it is cleared by dev_user_add_to_ready()
+	 * without cmd_list_lock for ucmds going to the per-CPU queues.
+	 */
+	bool this_state_unjammed;
+
 	unsigned int state;
 
 	struct list_head ready_cmd_list_entry;
+	/* Per-CPU queue, where the ucmd is, or NULL */
+	struct scst_user_queue *queue;
+	/* Set only if queue steering is on, otherwise 0 */
+	ktime_t ready_time;
 
 	unsigned int h;
 	struct list_head hash_list_entry;
@@ -184,6 +279,7 @@ static int dev_user_set_opt(struct file *file, const struct scst_user_opt *opt);
 static int dev_user_get_opt(struct file *file, void __user *arg);
 
 static unsigned int dev_user_poll(struct file *filp, poll_table *wait);
+static int dev_user_mmap(struct file *file, struct vm_area_struct *vma);
 static long dev_user_ioctl(struct file *file, unsigned int cmd,
 	unsigned long arg);
 static int dev_user_release(struct inode *inode, struct file *file);
@@ -201,11 +297,25 @@ static int dev_user_read_proc(struct seq_file *seq,
 static ssize_t dev_user_sysfs_commands_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf);
 
+static ssize_t dev_user_sysfs_steering_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t dev_user_sysfs_steering_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count);
+static ssize_t dev_user_sysfs_queues_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+
 static struct kobj_attribute dev_user_commands_attr =
 	__ATTR(commands, S_IRUGO, dev_user_sysfs_commands_show, NULL);
+static struct kobj_attribute dev_user_steering_attr =
+	__ATTR(queue_steering, S_IWUSR|S_IRUGO, dev_user_sysfs_steering_show,
+		dev_user_sysfs_steering_store);
+static struct kobj_attribute dev_user_queues_attr =
+	__ATTR(queues, S_IRUGO, dev_user_sysfs_queues_show, NULL);
 
 static const struct attribute *dev_user_dev_attrs[] = {
 	&dev_user_commands_attr.attr,
+	&dev_user_steering_attr.attr,
+	&dev_user_queues_attr.attr,
 	NULL,
 };
 
@@ -221,6 +331,7 @@ static struct kmem_cache *user_cmd_cachep;
 
 static const struct file_operations dev_user_fops = {
 	.poll		= dev_user_poll,
+	.mmap		= dev_user_mmap,
 	.unlocked_ioctl	= dev_user_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl	= dev_user_ioctl,
@@ -1138,6 +1249,147 @@ static inline bool dev_user_mgmt_ucmd(struct scst_user_cmd *ucmd)
 	       (ucmd->state == UCMD_STATE_DETACH_SESS);
 }
 
+/* Can be called in any context */
+static int dev_user_home_queue(const struct scst_user_dev *dev, int steering)
+{
+	if ((steering == DEV_USER_STEER_NONE) || dev->has_own_order_mgmt)
+		return 0;
+	/* Just a hint, so no need to disable preemption */
+	return raw_smp_processor_id() % dev->queues_num;
+}
+
+/*
+ * Returns index of the queue for ucmd. Submitting CPU keeps a command on
+ * the CPU, where it was processed so far, LBA hash sends commands to the
+ * same 1MB region to the same queue. Handlers with own order management
+ * get a single queue to keep the order of commands.
+ */
+static int dev_user_steer(const struct scst_user_dev *dev,
+	const struct scst_user_cmd *ucmd, int steering)
+{
+	const struct scst_cmd *cmd = ucmd->cmd;
+
+	if ((steering == DEV_USER_STEER_LBA) && (cmd != NULL) &&
+	    (ucmd->state == UCMD_STATE_EXECING) && !dev->has_own_order_mgmt) {
+		uint64_t region;
+
+		region = ((uint64_t)cmd->lba << cmd->dev->block_shift) >> 20;
+
+		return (uint32_t)hash_64(region, 32) % dev->queues_num;
+	}
+
+	return dev_user_home_queue(dev, steering);
+}
+
+/* Called with IRQ off, takes the queue's lock */
+static void dev_user_add_to_queue(struct scst_user_cmd *ucmd)
+{
+	struct scst_user_dev *dev = ucmd->dev;
+	int steering = ACCESS_ONCE(dev->steering);
+	struct scst_user_queue *q = &dev->queues[dev_user_steer(dev, ucmd,
+							steering)];
+
+	TRACE_DBG("Adding ucmd %p to ready queue %d", ucmd,
+		(int)(q - dev->queues));
+
+	/* Wait time statistics only if steering is on */
+	if (steering != DEV_USER_STEER_NONE)
+		ucmd->ready_time = ktime_get();
+	else
+		ucmd->ready_time = ktime_set(0, 0);
+
+	spin_lock(&q->lock);
+	list_add_tail(&ucmd->ready_cmd_list_entry, &q->cmd_list);
+	ucmd->queue = q;
+	q->depth++;
+	if (q->depth > q->max_depth)
+		q->max_depth = q->depth;
+	q->queued++;
+	atomic_inc(&dev->queued_cnt);
+	spin_unlock(&q->lock);
+	return;
+}
+
+/*
+ * Removes ucmd from the ready list it is on. Called under cmd_list_lock for
+ * the head list or under the queue's lock for a per-CPU queue.
+ */
+static void dev_user_del_from_ready(struct scst_user_cmd *ucmd)
+{
+	struct scst_user_queue *q = ucmd->queue;
+
+	list_del(&ucmd->ready_cmd_list_entry);
+
+	if (q != NULL) {
+		if (ktime_to_ns(ucmd->ready_time) != 0) {
+			uint64_t wait;
+
+			wait = ktime_to_ns(ktime_sub(ktime_get(),
+						ucmd->ready_time));
+			q->wait_ns += wait;
+			if (wait > q->max_wait_ns)
+				q->max_wait_ns = wait;
+		}
+		q->dequeued++;
+		q->depth--;
+		atomic_dec(&ucmd->dev->queued_cnt);
+		ucmd->queue = NULL;
+	}
+	return;
+}
+
+/* Can be called without any locks as a hint */
+static inline bool dev_user_has_ready(const struct scst_user_dev *dev)
+{
+	return !list_empty(&dev->ready_cmd_list) ||
+	       (atomic_read(&dev->queued_cnt) != 0);
+}
+
+/*
+ * Removes from its list and returns the first ready ucmd: from the head
+ * list, if any, else from the home queue of the current CPU, else stolen
+ * from another queue. The queues are locked one by one.
+ *
+ * Called under cmd_list_lock and IRQ off.
+ */
+static struct scst_user_cmd *dev_user_dequeue_ready(struct scst_user_dev *dev)
+{
+	struct scst_user_cmd *u;
+	struct scst_user_queue *q;
+	int home, i;
+
+	if (!list_empty(&dev->ready_cmd_list)) {
+		u = list_first_entry(&dev->ready_cmd_list,
+			struct scst_user_cmd, ready_cmd_list_entry);
+		dev_user_del_from_ready(u);
+		return u;
+	}
+
+	if (atomic_read(&dev->queued_cnt) == 0)
+		return NULL;
+
+	home = dev_user_home_queue(dev, ACCESS_ONCE(dev->steering));
+	for (i = 0; i < dev->queues_num; i++) {
+		q = &dev->queues[(home + i) % dev->queues_num];
+		if (list_empty(&q->cmd_list))
+			continue;
+		spin_lock(&q->lock);
+		if (likely(!list_empty(&q->cmd_list))) {
+			u = list_first_entry(&q->cmd_list,
+				struct scst_user_cmd, ready_cmd_list_entry);
+			if (i != 0)
+				q->stolen++;
+			dev_user_del_from_ready(u);
+			spin_unlock(&q->lock);
+			return u;
+		}
+		spin_unlock(&q->lock);
+	}
+
+	/* Another thread took them meanwhile */
+	return NULL;
+}
+
 /* Supposed to be called under cmd_list_lock */
 static inline void dev_user_add_to_ready_head(struct scst_user_cmd *ucmd)
 {
@@ -1173,6 +1425,21 @@ out:
 	return;
 }
 
+/*
+ * Returns true, if ucmd goes to a per-CPU queue, i.e. it isn't a PARSING,
+ * BUF_ALLOCING, mgmt or HEAD OF QUEUE one.
+ */
+static inline bool dev_user_steered_ucmd(struct scst_user_cmd *ucmd)
+{
+	if ((ucmd->state == UCMD_STATE_PARSING) ||
+	    (ucmd->state == UCMD_STATE_BUF_ALLOCING) ||
+	    unlikely(dev_user_mgmt_ucmd(ucmd)))
+		return false;
+
+	return (ucmd->cmd == NULL) ||
+	       likely(ucmd->cmd->queue_type != SCST_CMD_QUEUE_HEAD_OF_QUEUE);
+}
+
 static void dev_user_add_to_ready(struct scst_user_cmd *ucmd)
 {
 	struct scst_user_dev *dev = ucmd->dev;
@@ -1189,9 +1456,33 @@ static void dev_user_add_to_ready(struct scst_user_cmd *ucmd)
 	if (ucmd->cmd)
 		do_wake |= ucmd->cmd->preprocessing_only;
 
+	/* ucmd isn't on any ready list yet, so nobody else looks at it */
+	ucmd->this_state_unjammed = 0;
+
+	if (likely(dev_user_steered_ucmd(ucmd))) {
+		/* Per-CPU queues have own locks, so no cmd_list_lock here */
+		local_irq_save(flags);
+		dev_user_add_to_queue(ucmd);
+		local_irq_restore(flags);
+
+		do_wake |= ((ucmd->state == UCMD_STATE_ON_CACHE_FREEING) ||
+			    (ucmd->state == UCMD_STATE_ON_FREEING) ||
+			    (ucmd->state == UCMD_STATE_EXT_COPY_REMAPPING));
+
+		/* Pairs with the barrier in dev_user_ring_sleep() */
+		smp_mb();
+		do_wake |= ACCESS_ONCE(dev->ring_idle);
+
+		if (do_wake) {
+			TRACE_DBG("Waking up dev %p", dev);
+			wake_up(&dev->udev_cmd_threads.cmd_list_waitQ);
+		}
+		goto out;
+	}
+
 	spin_lock_irqsave(&dev->udev_cmd_threads.cmd_list_lock, flags);
 
-	ucmd->this_state_unjammed = 0;
+	do_wake |= dev->ring_idle;
 
 	if ((ucmd->state == UCMD_STATE_PARSING) ||
 	    (ucmd->state == UCMD_STATE_BUF_ALLOCING)) {
@@ -1209,16 +1500,8 @@ static void dev_user_add_to_ready(struct scst_user_cmd *ucmd)
 		dev_user_add_to_ready_head(ucmd);
 		do_wake = 1;
 	} else {
-		if ((ucmd->cmd != NULL) &&
-		    unlikely((ucmd->cmd->queue_type == SCST_CMD_QUEUE_HEAD_OF_QUEUE))) {
-			TRACE_DBG("Adding HQ ucmd %p to head of ready cmd list",
-				ucmd);
-			dev_user_add_to_ready_head(ucmd);
-		} else {
-			TRACE_DBG("Adding ucmd %p to ready cmd list", ucmd);
-			list_add_tail(&ucmd->ready_cmd_list_entry,
-				      &dev->ready_cmd_list);
-		}
+		TRACE_DBG("Adding HQ ucmd %p to head of ready cmd list", ucmd);
+		dev_user_add_to_ready_head(ucmd);
 		do_wake |= ((ucmd->state == UCMD_STATE_ON_CACHE_FREEING) ||
 			    (ucmd->state == UCMD_STATE_ON_FREEING) ||
 			    (ucmd->state == UCMD_STATE_EXT_COPY_REMAPPING));
@@ -1231,6 +1514,7 @@ static void dev_user_add_to_ready(struct scst_user_cmd *ucmd)
 
 	spin_unlock_irqrestore(&dev->udev_cmd_threads.cmd_list_lock, flags);
 
+out:
 	TRACE_EXIT();
 	return;
 }
@@ -2150,26 +2434,21 @@ static int dev_user_process_scst_commands(struct scst_user_dev *dev)
 }
 
 /* Called under udev_cmd_threads.cmd_list_lock and IRQ off */
-static struct scst_user_cmd *__dev_user_get_next_cmd(struct list_head *cmd_list)
+static struct scst_user_cmd *__dev_user_get_next_cmd(struct scst_user_dev *dev)
 	__releases(&dev->udev_cmd_threads.cmd_list_lock)
 	__acquires(&dev->udev_cmd_threads.cmd_list_lock)
 {
 	struct scst_user_cmd *u;
 
 again:
-	u = NULL;
-	if (!list_empty(cmd_list)) {
-		u = list_first_entry(cmd_list, typeof(*u),
-			       ready_cmd_list_entry);
-
+	u = dev_user_dequeue_ready(dev);
+	if (u != NULL) {
 		TRACE_DBG("Found ready ucmd %p", u);
-		list_del(&u->ready_cmd_list_entry);
 
 		EXTRACHECKS_BUG_ON(u->this_state_unjammed);
 
 		if (u->cmd != NULL) {
 			if (u->state == UCMD_STATE_EXECING) {
-				struct scst_user_dev *dev = u->dev;
 				int rc;
 
 				EXTRACHECKS_BUG_ON(u->jammed);
@@ -2213,7 +2492,7 @@ again:
 static inline int test_cmd_threads(struct scst_user_dev *dev, bool can_block)
 {
 	int res = !list_empty(&dev->udev_cmd_threads.active_cmd_list) ||
-		  !list_empty(&dev->ready_cmd_list) ||
+		  dev_user_has_ready(dev) ||
 		  !can_block || !dev->blocking || dev->cleanup_done ||
 		  signal_pending(current);
 	return res;
@@ -2234,7 +2513,7 @@ static int dev_user_get_next_cmd(struct scst_user_dev *dev,
 
 		dev_user_process_scst_commands(dev);
 
-		*ucmd = __dev_user_get_next_cmd(&dev->ready_cmd_list);
+		*ucmd = __dev_user_get_next_cmd(dev);
 		if (*ucmd != NULL)
 			break;
 
@@ -2264,6 +2543,12 @@ static int dev_user_get_cmd_to_user(struct scst_user_dev *dev,
 
 	TRACE_ENTRY();
 
+	if (unlikely(dev->ring != NULL)) {
+		TRACE_DBG("Dev %s uses rings, can't get commands", dev->name);
+		res = -EBUSY;
+		goto out;
+	}
+
 	spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
 again:
 	res = dev_user_get_next_cmd(dev, &ucmd, can_block);
@@ -2306,6 +2591,7 @@ again:
 	} else
 		spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
 
+out:
 	TRACE_EXIT_RES(res);
 	return res;
 }
@@ -2461,6 +2747,556 @@ out_part_replies_done:
 	goto out;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 32)
+
+/*
+ * Shared memory rings. A per device kernel thread moves ready subcommands
+ * to the SQ and feeds replies from the CQ to dev_user_process_reply() in
+ * the context of the handler's mm, so a busy handler doesn't need any
+ * syscall per command. Each side notifies the other only if that one
+ * has announced in the ring header that it's going to sleep.
+ */
+
+/* Min busy poll window, which we grow from, if it turned out too short */
+#define DEV_USER_RING_MIN_POLL_NS	1000
+#define DEV_USER_RING_MAX_POLL_USECS	1000000
+
+static inline bool dev_user_ring_sq_full(const struct scst_user_ring *ring)
+{
+	return ring->sq_tail - ACCESS_ONCE(ring->hdr->sq_head) > ring->sq_mask;
+}
+
+/* Can be called without any locks as a hint */
+static inline bool dev_user_ring_test(struct scst_user_dev *dev)
+{
+	struct scst_user_ring *ring = dev->ring;
+
+	return !list_empty(&dev->udev_cmd_threads.active_cmd_list) ||
+	       (dev_user_has_ready(dev) && !dev_user_ring_sq_full(ring)) ||
+	       (ACCESS_ONCE(ring->hdr->cq_tail) != ring->cq_head) ||
+	       kthread_should_stop();
+}
+
+static bool dev_user_ring_use_mm(struct scst_user_ring *ring)
+{
+	/* The handler is exiting, if there are no users left */
+	if (!atomic_inc_not_zero(&ring->mm->mm_users))
+		return false;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	kthread_use_mm(ring->mm);
+#else
+	use_mm(ring->mm);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0)
+	ring->old_fs = get_fs();
+	set_fs(USER_DS);
+#endif
+	return true;
+}
+
+static void dev_user_ring_unuse_mm(struct scst_user_ring *ring)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0)
+	set_fs(ring->old_fs);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	kthread_unuse_mm(ring->mm);
+#else
+	unuse_mm(ring->mm);
+#endif
+	mmput(ring->mm);
+}
+
+static void dev_user_ring_notify(struct scst_user_ring *ring)
+{
+	/* Pairs with the barrier between setting user_flags and sleeping */
+	smp_mb();
+	if (!(ACCESS_ONCE(ring->hdr->user_flags) & SCST_USER_RING_USER_IDLE))
+		return;
+
+	TRACE_DBG("Waking up idle handler (ring %p)", ring);
+	if (ring->eventfd != NULL)
+		eventfd_signal(ring->eventfd, 1);
+	wake_up(&ring->user_waitQ);
+}
+
+/* Called under udev_cmd_threads.cmd_list_lock and IRQ off */
+static int dev_user_ring_reap_cq(struct scst_user_dev *dev)
+	__releases(&dev->udev_cmd_threads.cmd_list_lock)
+	__acquires(&dev->udev_cmd_threads.cmd_list_lock)
+{
+	struct scst_user_ring *ring = dev->ring;
+	uint32_t head = ring->cq_head, tail;
+	int res = 0;
+
+	TRACE_ENTRY();
+
+	tail = ACCESS_ONCE(ring->hdr->cq_tail);
+	if (tail == head)
+		goto out;
+
+	if (unlikely(tail - head > ring->cq_mask + 1)) {
+		PRINT_ERROR("Invalid CQ tail %u (head %u, dev %s)", tail,
+			head, dev->name);
+		tail = head + ring->cq_mask + 1;
+	}
+
+	/* Read entries only after the tail */
+	smp_rmb();
+
+	spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+
+	if (unlikely(!dev_user_ring_use_mm(ring))) {
+		TRACE_MGMT_DBG("Handler of dev %s exiting, dropping %d replies",
+			dev->name, tail - head);
+		head = tail;
+		goto publish;
+	}
+
+	while (head != tail) {
+		/* User space can change it under us, so work on a copy */
+		struct scst_user_reply_cmd reply;
+		int rc;
+
+		memcpy(&reply, &ring->cq[head & ring->cq_mask], sizeof(reply));
+		head++;
+
+		TRACE_BUFFER("Reply", &reply, sizeof(reply));
+
+		rc = dev_user_process_reply(dev, &reply);
+		if (unlikely(rc < 0))
+			TRACE_MGMT_DBG("Reply for cmd_h %d failed: %d",
+				reply.cmd_h, rc);
+		res++;
+	}
+
+	dev_user_ring_unuse_mm(ring);
+
+publish:
+	/* Entries must be read before their slots are given back */
+	smp_mb();
+	ring->cq_head = head;
+	ACCESS_ONCE(ring->hdr->cq_head) = head;
+
+	spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* Called under udev_cmd_threads.cmd_list_lock and IRQ off */
+static int dev_user_ring_fill_sq(struct scst_user_dev *dev)
+	__releases(&dev->udev_cmd_threads.cmd_list_lock)
+	__acquires(&dev->udev_cmd_threads.cmd_list_lock)
+{
+	struct scst_user_ring *ring = dev->ring;
+	uint32_t tail = ring->sq_tail;
+	int res = 0;
+
+	TRACE_ENTRY();
+
+	/* Slots must be given back before we reuse them */
+	smp_mb();
+
+	while (tail - ACCESS_ONCE(ring->hdr->sq_head) <= ring->sq_mask) {
+		struct scst_user_cmd *ucmd;
+
+		ucmd = __dev_user_get_next_cmd(dev);
+		if (ucmd == NULL)
+			break;
+
+		/* See comment in dev_user_get_cmd_to_user() */
+		if (unlikely(ucmd_get_check(ucmd)))
+			continue;
+
+		spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+
+		EXTRACHECKS_BUG_ON(ucmd->user_cmd_payload_len == 0);
+
+		TRACE_DBG("ucmd %p to SQ slot %u (dev %s)", ucmd, tail,
+			dev->name);
+		memcpy(&ring->sq[tail & ring->sq_mask], &ucmd->user_cmd,
+			ucmd->user_cmd_payload_len);
+#ifdef CONFIG_SCST_EXTRACHECKS
+		ucmd->user_cmd_payload_len = 0;
+#endif
+		ucmd_put(ucmd);
+
+		spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+
+		tail++;
+		res++;
+	}
+
+	if (res != 0) {
+		/* Entries must be visible before the tail */
+		smp_wmb();
+		ring->sq_tail = tail;
+		ACCESS_ONCE(ring->hdr->sq_tail) = tail;
+		dev_user_ring_notify(ring);
+	}
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * Called under udev_cmd_threads.cmd_list_lock and IRQ off. Returns
+ * true, if there is new work.
+ */
+static bool dev_user_ring_poll(struct scst_user_dev *dev)
+	__releases(&dev->udev_cmd_threads.cmd_list_lock)
+	__acquires(&dev->udev_cmd_threads.cmd_list_lock)
+{
+	struct scst_user_ring *ring = dev->ring;
+	s64 start;
+	bool res;
+
+	if (ring->poll_ns == 0)
+		return false;
+
+	spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+
+	start = ktime_to_ns(ktime_get());
+	while (1) {
+		res = dev_user_ring_test(dev);
+		if (res || (ktime_to_ns(ktime_get()) - start >= ring->poll_ns))
+			break;
+		cpu_relax();
+		cond_resched();
+	}
+
+	spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+	return res;
+}
+
+/* Called under udev_cmd_threads.cmd_list_lock and IRQ off */
+static void dev_user_ring_sleep(struct scst_user_dev *dev)
+	__releases(&dev->udev_cmd_threads.cmd_list_lock)
+	__acquires(&dev->udev_cmd_threads.cmd_list_lock)
+{
+	struct scst_user_ring *ring = dev->ring;
+	s64 start;
+
+	dev->ring_idle = true;
+	ACCESS_ONCE(ring->hdr->kernel_flags) = SCST_USER_RING_KERNEL_IDLE;
+	/*
+	 * Pairs with the barrier between CQ tail update and flags check and
+	 * with the one in dev_user_add_to_ready()
+	 */
+	smp_mb();
+
+	start = ktime_to_ns(ktime_get());
+	TRACE_DBG("Ring of dev %s going to sleep", dev->name);
+	wait_event_locked(dev->udev_cmd_threads.cmd_list_waitQ,
+			  dev_user_ring_test(dev), lock_irq,
+			  dev->udev_cmd_threads.cmd_list_lock);
+
+	ACCESS_ONCE(ring->hdr->kernel_flags) = 0;
+	dev->ring_idle = false;
+
+	/*
+	 * If we were woken up earlier than the max poll window, polling
+	 * would have caught it, so poll longer next time. Otherwise we are
+	 * wasting CPU on polling, so poll shorter.
+	 */
+	if (ktime_to_ns(ktime_get()) - start < ring->max_poll_ns)
+		ring->poll_ns = min_t(u64, max_t(u64, ring->poll_ns << 1,
+			DEV_USER_RING_MIN_POLL_NS), ring->max_poll_ns);
+	else
+		ring->poll_ns >>= 1;
+}
+
+static int dev_user_ring_thread(void *arg)
+{
+	struct scst_user_dev *dev = arg;
+
+	TRACE_ENTRY();
+
+	PRINT_INFO("Ring thread for dev %s started", dev->name);
+
+	current->flags |= PF_NOFREEZE;
+
+	spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+	while (!kthread_should_stop()) {
+		int cnt;
+
+		cnt = dev_user_process_scst_commands(dev);
+		cnt += dev_user_ring_reap_cq(dev);
+		cnt += dev_user_ring_fill_sq(dev);
+		if (cnt != 0)
+			continue;
+
+		if (dev_user_ring_poll(dev))
+			continue;
+
+		dev_user_ring_sleep(dev);
+	}
+	spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+
+	PRINT_INFO("Ring thread for dev %s finished", dev->name);
+
+	TRACE_EXIT();
+	return 0;
+}
+
+static void dev_user_ring_free(struct scst_user_ring *ring)
+{
+	if (ring->eventfd != NULL)
+		eventfd_ctx_put(ring->eventfd);
+	if (ring->mm != NULL)
+		mmdrop(ring->mm);
+	vfree(ring->mem);
+	kfree(ring);
+}
+
+static int dev_user_ring_setup(struct file *file, void __user *arg)
+{
+	int res, rc;
+	struct scst_user_dev *dev;
+	struct scst_user_ring_setup setup;
+	struct scst_user_ring *ring;
+	struct task_struct *t;
+	unsigned int hdr_size, sq_size, cq_size;
+
+	TRACE_ENTRY();
+
+	dev = file->private_data;
+	res = dev_user_check_reg(dev);
+	if (unlikely(res != 0))
+		goto out;
+
+	rc = copy_from_user(&setup, arg, sizeof(setup));
+	if (unlikely(rc != 0)) {
+		PRINT_ERROR("Failed to copy %d user's bytes", rc);
+		res = -EFAULT;
+		goto out;
+	}
+
+	TRACE_BUFFER("Ring setup", &setup, sizeof(setup));
+
+	if (!is_power_of_2(setup.sq_entries) ||
+	    (setup.sq_entries > SCST_USER_RING_MAX_ENTRIES) ||
+	    !is_power_of_2(setup.cq_entries) ||
+	    (setup.cq_entries > SCST_USER_RING_MAX_ENTRIES) ||
+	    (setup.poll_usecs > DEV_USER_RING_MAX_POLL_USECS) ||
+	    (setup.flags != 0)) {
+		PRINT_ERROR("Invalid ring parameters: SQ %u, CQ %u entries, "
+			"poll %u usecs, flags %x (dev %s)", setup.sq_entries,
+			setup.cq_entries, setup.poll_usecs, setup.flags,
+			dev->name);
+		res = -EINVAL;
+		goto out;
+	}
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (ring == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	hdr_size = PAGE_ALIGN(sizeof(*ring->hdr));
+	sq_size = PAGE_ALIGN(setup.sq_entries * sizeof(*ring->sq));
+	cq_size = PAGE_ALIGN(setup.cq_entries * sizeof(*ring->cq));
+	ring->mem_size = hdr_size + sq_size + cq_size;
+
+	ring->mem = vmalloc_user(ring->mem_size);
+	if (ring->mem == NULL) {
+		PRINT_ERROR("Unable to allocate ring (size %d)",
+			ring->mem_size);
+		res = -ENOMEM;
+		goto out_free;
+	}
+
+	ring->hdr = ring->mem;
+	ring->sq = ring->mem + hdr_size;
+	ring->cq = ring->mem + hdr_size + sq_size;
+	ring->sq_mask = setup.sq_entries - 1;
+	ring->cq_mask = setup.cq_entries - 1;
+	ring->max_poll_ns = setup.poll_usecs * 1000ULL;
+	ring->poll_ns = ring->max_poll_ns;
+	init_waitqueue_head(&ring->user_waitQ);
+
+	if (setup.eventfd >= 0) {
+		ring->eventfd = eventfd_ctx_fdget(setup.eventfd);
+		if (IS_ERR(ring->eventfd)) {
+			res = PTR_ERR(ring->eventfd);
+			ring->eventfd = NULL;
+			PRINT_ERROR("Invalid eventfd %d (dev %s)",
+				setup.eventfd, dev->name);
+			goto out_free;
+		}
+	}
+
+	ring->mm = current->mm;
+	atomic_inc(&ring->mm->mm_count);
+
+	setup.sq_off = hdr_size;
+	setup.cq_off = hdr_size + sq_size;
+	setup.mmap_size = ring->mem_size;
+
+	rc = copy_to_user(arg, &setup, sizeof(setup));
+	if (unlikely(rc != 0)) {
+		PRINT_ERROR("Failed to copy %d user's bytes", rc);
+		res = -EFAULT;
+		goto out_free;
+	}
+
+	t = kthread_create(dev_user_ring_thread, dev, "scst_ur%d",
+		dev->virt_id);
+	if (IS_ERR(t)) {
+		res = PTR_ERR(t);
+		PRINT_ERROR("kthread_create() failed: %d", res);
+		goto out_free;
+	}
+	ring->thread = t;
+
+	spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+	if (dev->ring != NULL) {
+		spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+		PRINT_ERROR("Ring for dev %s already set up", dev->name);
+		res = -EBUSY;
+		goto out_stop;
+	}
+	dev->ring = ring;
+	spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+
+	wake_up_process(t);
+
+	PRINT_INFO("Ring for dev %s set up: SQ %u, CQ %u entries, poll %u "
+		"usecs, eventfd %d", dev->name, setup.sq_entries,
+		setup.cq_entries, setup.poll_usecs, setup.eventfd);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_stop:
+	kthread_stop(t);
+
+out_free:
+	dev_user_ring_free(ring);
+	goto out;
+}
+
+static int dev_user_ring_wakeup(struct file *file)
+{
+	int res;
+	struct scst_user_dev *dev;
+
+	TRACE_ENTRY();
+
+	dev = file->private_data;
+	res = dev_user_check_reg(dev);
+	if (unlikely(res != 0))
+		goto out;
+
+	if (unlikely(dev->ring == NULL)) {
+		res = -EINVAL;
+		goto out;
+	}
+
+	wake_up(&dev->udev_cmd_threads.cmd_list_waitQ);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* Must be called before the cleanup, because the ring thread serves dev */
+static void dev_user_ring_release(struct scst_user_dev *dev)
+{
+	struct scst_user_ring *ring = dev->ring;
+
+	TRACE_ENTRY();
+
+	if (ring == NULL)
+		goto out;
+
+	kthread_stop(ring->thread);
+
+	spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+	dev->ring = NULL;
+	spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+
+	dev_user_ring_free(ring);
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+static int dev_user_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int res;
+	struct scst_user_dev *dev;
+	struct scst_user_ring *ring;
+
+	TRACE_ENTRY();
+
+	dev = file->private_data;
+	res = dev_user_check_reg(dev);
+	if (unlikely(res != 0))
+		goto out;
+
+	ring = dev->ring;
+	if ((ring == NULL) || (vma->vm_pgoff != 0) ||
+	    (vma->vm_end - vma->vm_start > ring->mem_size)) {
+		res = -EINVAL;
+		goto out;
+	}
+
+	res = remap_vmalloc_range(vma, ring->mem, 0);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static unsigned int dev_user_ring_poll_user(struct file *file,
+	struct scst_user_ring *ring, poll_table *wait)
+{
+	poll_wait(file, &ring->user_waitQ, wait);
+
+	if (ACCESS_ONCE(ring->hdr->sq_head) != ACCESS_ONCE(ring->hdr->sq_tail))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+#else /* LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 32) */
+
+static int dev_user_ring_setup(struct file *file, void __user *arg)
+{
+	PRINT_ERROR("%s", "Shared memory rings require kernel 2.6.32+");
+	return -EOPNOTSUPP;
+}
+
+static int dev_user_ring_wakeup(struct file *file)
+{
+	return -EOPNOTSUPP;
+}
+
+static void dev_user_ring_release(struct scst_user_dev *dev)
+{
+}
+
+static int dev_user_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	return -ENODEV;
+}
+
+static unsigned int dev_user_ring_poll_user(struct file *file,
+	struct scst_user_ring *ring, poll_table *wait)
+{
+	sBUG();
+	return 0;
+}
+
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 32) */
+
 static long dev_user_ioctl(struct file *file, unsigned int cmd,
 	unsigned long arg)
 {
@@ -2556,6 +3392,16 @@ static long dev_user_ioctl(struct file *file, unsigned int cmd,
 		res = dev_user_prealloc_buffer(file, (void __user *)arg);
 		break;
 
+	case SCST_USER_RING_SETUP:
+		TRACE_DBG("%s", "RING_SETUP");
+		res = dev_user_ring_setup(file, (void __user *)arg);
+		break;
+
+	case SCST_USER_RING_WAKEUP:
+		TRACE_DBG("%s", "RING_WAKEUP");
+		res = dev_user_ring_wakeup(file);
+		break;
+
 	default:
 		PRINT_ERROR("Invalid ioctl cmd %x", cmd);
 		res = -EINVAL;
@@ -2579,9 +3425,14 @@ static unsigned int dev_user_poll(struct file *file, poll_table *wait)
 	if (unlikely(res != 0))
 		goto out;
 
+	if (dev->ring != NULL) {
+		res = dev_user_ring_poll_user(file, dev->ring, wait);
+		goto out;
+	}
+
 	spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
 
-	if (!list_empty(&dev->ready_cmd_list) ||
+	if (dev_user_has_ready(dev) ||
 	    !list_empty(&dev->udev_cmd_threads.active_cmd_list)) {
 		res |= POLLIN | POLLRDNORM;
 		goto out_unlock;
@@ -2595,7 +3446,7 @@ static unsigned int dev_user_poll(struct file *file, poll_table *wait)
 
 	spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
 
-	if (!list_empty(&dev->ready_cmd_list) ||
+	if (dev_user_has_ready(dev) ||
 	    !list_empty(&dev->udev_cmd_threads.active_cmd_list)) {
 		res |= POLLIN | POLLRDNORM;
 		goto out_unlock;
@@ -2831,28 +3682,60 @@ static int dev_user_process_reply_tm_exec(struct scst_user_cmd *ucmd,
 	return res;
 }
 
+/* Returns true, if ucmd is ready and should be aborted */
+static inline bool dev_user_abort_ready(const struct scst_user_cmd *ucmd)
+{
+	if ((ucmd->cmd == NULL) || ucmd->seen_by_user ||
+	    !test_bit(SCST_CMD_ABORTED, &ucmd->cmd->cmd_flags))
+		return false;
+
+	switch (ucmd->state) {
+	case UCMD_STATE_PARSING:
+	case UCMD_STATE_BUF_ALLOCING:
+	case UCMD_STATE_EXECING:
+		return true;
+	}
+	return false;
+}
+
+/*
+ * The per-CPU queues are locked one by one in the index order under
+ * cmd_list_lock, each aborted ucmd is unjammed after its queue is unlocked.
+ */
 static void dev_user_abort_ready_commands(struct scst_user_dev *dev)
 {
 	struct scst_user_cmd *ucmd;
+	struct scst_user_queue *q;
 	unsigned long flags;
+	int i;
 
 	TRACE_ENTRY();
 
 	spin_lock_irqsave(&dev->udev_cmd_threads.cmd_list_lock, flags);
 again:
 	list_for_each_entry(ucmd, &dev->ready_cmd_list, ready_cmd_list_entry) {
-		if ((ucmd->cmd != NULL) && !ucmd->seen_by_user &&
-		    test_bit(SCST_CMD_ABORTED, &ucmd->cmd->cmd_flags)) {
-			switch (ucmd->state) {
-			case UCMD_STATE_PARSING:
-			case UCMD_STATE_BUF_ALLOCING:
-			case UCMD_STATE_EXECING:
-				TRACE_MGMT_DBG("Aborting ready ucmd %p", ucmd);
-				list_del(&ucmd->ready_cmd_list_entry);
+		if (dev_user_abort_ready(ucmd)) {
+			TRACE_MGMT_DBG("Aborting ready ucmd %p", ucmd);
+			dev_user_del_from_ready(ucmd);
+			dev_user_unjam_cmd(ucmd, 0, &flags);
+			goto again;
+		}
+	}
+
+	for (i = 0; i < dev->queues_num; i++) {
+		q = &dev->queues[i];
+		spin_lock(&q->lock);
+		list_for_each_entry(ucmd, &q->cmd_list, ready_cmd_list_entry) {
+			if (dev_user_abort_ready(ucmd)) {
+				TRACE_MGMT_DBG("Aborting ready ucmd %p (queue "
+					"%d)", ucmd, i);
+				dev_user_del_from_ready(ucmd);
+				spin_unlock(&q->lock);
 				dev_user_unjam_cmd(ucmd, 0, &flags);
 				goto again;
 			}
 		}
+		spin_unlock(&q->lock);
 	}
 
 	spin_unlock_irqrestore(&dev->udev_cmd_threads.cmd_list_lock, flags);
@@ -3379,6 +4262,17 @@ static int dev_user_register_dev(struct file *file,
 	}
 
 	INIT_LIST_HEAD(&dev->ready_cmd_list);
+	dev->queues_num = nr_cpu_ids;
+	dev->queues = kcalloc(dev->queues_num, sizeof(*dev->queues),
+			      GFP_KERNEL);
+	if (dev->queues == NULL) {
+		res = -ENOMEM;
+		goto out_free_dev;
+	}
+	for (i = 0; i < dev->queues_num; i++) {
+		spin_lock_init(&dev->queues[i].lock);
+		INIT_LIST_HEAD(&dev->queues[i].cmd_list);
+	}
 	if (file->f_flags & O_NONBLOCK) {
 		TRACE_DBG("%s", "Non-blocking operations");
 		dev->blocking = 0;
@@ -3524,6 +4418,8 @@ out_free0:
 out_deinit_threads:
 	scst_deinit_threads(&dev->udev_cmd_threads);
 
+out_free_dev:
+	kfree(dev->queues);
 	kmem_cache_free(user_dev_cachep, dev);
 
 out_put:
@@ -3847,6 +4743,8 @@ static int dev_user_exit_dev(struct scst_user_dev *dev)
 
 	TRACE(TRACE_MGMT, "Releasing dev %s", dev->name);
 
+	dev_user_ring_release(dev);
+
 	spin_lock(&dev_list_lock);
 	list_del(&dev->dev_list_entry);
 	spin_unlock(&dev_list_lock);
@@ -3893,6 +4791,7 @@ static int __dev_user_release(void *arg)
 	struct scst_user_dev *dev = arg;
 
 	dev_user_exit_dev(dev);
+	kfree(dev->queues);
 	kmem_cache_free(user_dev_cachep, dev);
 	return 0;
 }
@@ -4030,6 +4929,111 @@ static ssize_t dev_user_sysfs_commands_show(struct kobject *kobj,
 	return pos;
 }
 
+static const char *const dev_user_steering_names[] = {
+	[DEV_USER_STEER_NONE] = "none",
+	[DEV_USER_STEER_CPU] = "cpu",
+	[DEV_USER_STEER_LBA] = "lba",
+};
+
+static ssize_t dev_user_sysfs_steering_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev;
+	struct scst_user_dev *udev;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	udev = dev->dh_priv;
+
+	return sprintf(buf, "%s\n",
+		dev_user_steering_names[ACCESS_ONCE(udev->steering)]);
+}
+
+static ssize_t dev_user_sysfs_steering_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct scst_device *dev;
+	struct scst_user_dev *udev;
+	int i;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	udev = dev->dh_priv;
+
+	for (i = 0; i < (int)ARRAY_SIZE(dev_user_steering_names); i++)
+		if (sysfs_streq(buf, dev_user_steering_names[i]))
+			break;
+	if (i == ARRAY_SIZE(dev_user_steering_names)) {
+		PRINT_ERROR("Unknown queue steering %.*s (dev %s)",
+			(int)strcspn(buf, "\n"), buf, udev->name);
+		count = -EINVAL;
+		goto out;
+	}
+
+	/* Already queued ucmds stay where they are and get stolen */
+	ACCESS_ONCE(udev->steering) = i;
+
+	PRINT_INFO("Queue steering of dev %s set to %s", udev->name,
+		dev_user_steering_names[i]);
+
+out:
+	TRACE_EXIT_RES(count);
+	return count;
+}
+
+static ssize_t dev_user_sysfs_queues_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos, i;
+	struct scst_device *dev;
+	struct scst_user_dev *udev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	udev = dev->dh_priv;
+
+	pos = scnprintf(buf, SCST_SYSFS_BLOCK_SIZE, "%-6s %-6s %-9s %-12s "
+		"%-12s %-12s %s\n", "queue", "depth", "max_depth", "queued",
+		"stolen", "avg_wait_us", "max_wait_us");
+
+	for (i = 0; i < udev->queues_num; i++) {
+		struct scst_user_queue *q = &udev->queues[i];
+		unsigned int depth, max_depth;
+		uint64_t queued, dequeued, stolen, wait_ns, max_wait_ns;
+
+		/* Take a snapshot, so the queue isn't locked for long */
+		spin_lock_irq(&q->lock);
+		depth = q->depth;
+		max_depth = q->max_depth;
+		queued = q->queued;
+		dequeued = q->dequeued;
+		stolen = q->stolen;
+		wait_ns = q->wait_ns;
+		max_wait_ns = q->max_wait_ns;
+		spin_unlock_irq(&q->lock);
+
+		/* Only queues, which have been ever used */
+		if (queued == 0)
+			continue;
+
+		if (dequeued != 0)
+			do_div(wait_ns, dequeued);
+
+		pos += scnprintf(&buf[pos], SCST_SYSFS_BLOCK_SIZE - pos,
+			"%-6d %-6u %-9u %-12llu %-12llu %-12llu %llu\n", i,
+			depth, max_depth, (unsigned long long)queued,
+			(unsigned long long)stolen,
+			(unsigned long long)wait_ns / 1000,
+			(unsigned long long)max_wait_ns / 1000);
+		if (pos >= SCST_SYSFS_BLOCK_SIZE - 1)
+			break;
+	}
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
 #else /* CONFIG_SCST_PROC */
 
 #ifdef CONFIG_SCST_DEBUG
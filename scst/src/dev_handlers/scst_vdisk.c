@@ -48,6 +48,10 @@
 #include <linux/bio.h>
 #include <linux/crc32c.h>
 #include <linux/swap.h>
+#include <linux/radix-tree.h>
+#include <linux/hash.h>
+#include <linux/sort.h>
+#include <linux/hrtimer.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
 #include <linux/falloc.h>
 #endif
@@ -115,6 +119,73 @@ static struct scst_trace_log vdisk_local_trace_tbl[] = {
 #define DEF_EXPL_ALUA			0
 
 #define VDISK_NULLIO_SIZE		(5LL*1024*1024*1024*1024/2)
+/* Max vdisk_nullio completion delay and its jitter, 10 seconds */
+#define VDISK_NULLIO_MAX_DELAY_US	10000000
+/* Distributions of the vdisk_nullio delay jitter, see nullio_jitter() */
+#define VDISK_NULLIO_DIST_UNIFORM	0
+#define VDISK_NULLIO_DIST_EXP		1
+#define VDISK_NULLIO_DIST_NORMAL	2
+
+/* vdisk_ramdisk devices allocate their memory by chunks of this size */
+#define VDISK_RAMDISK_CHUNK_SHIFT	21
+#define VDISK_RAMDISK_CHUNK_SIZE	(1UL << VDISK_RAMDISK_CHUNK_SHIFT)
+#define VDISK_RAMDISK_CHUNK_ORDER	(VDISK_RAMDISK_CHUNK_SHIFT - PAGE_SHIFT)
+/* Step of the allocation order fallback, if a whole chunk can't be got */
+#define VDISK_RAMDISK_ORDER_STEP	3
+
+/* Copy-on-write images, see the description of struct vdisk_cow_image */
+#define VDISK_COW_MAGIC			0x31574f4354534353ULL /* "SCSTCOW1" */
+#define VDISK_COW_VERSION		1
+#define VDISK_COW_CLUSTER_SHIFT		16
+#define VDISK_COW_MIN_CLUSTER_SHIFT	12
+#define VDISK_COW_MAX_CLUSTER_SHIFT	21
+#define VDISK_COW_PARENT_LEN		1024
+#define VDISK_COW_MAX_CHAIN		16
+#define VDISK_COW_FLUSH_DELAY		(5 * HZ)
+/* Max size of clean L2 tables cached for each COW image */
+#define VDISK_COW_L2_CACHE_SIZE		(64 * 1024 * 1024)
+#define VDISK_COW_MIN_L2_CACHED		16
+/* Max clusters examined by a single GET LBA STATUS command */
+#define VDISK_COW_LBA_STATUS_MAX	8192
+
+/* Special L2 entry values, all others are offsets of the data clusters */
+#define VDISK_COW_UNALLOCATED		0
+#define VDISK_COW_ZERO			1
+
+/* GET LBA STATUS provisioning status */
+#define VDISK_LBA_MAPPED		0
+#define VDISK_LBA_DEALLOCATED		1
+
+/* Striped vdisk_blockio devices */
+#define VDISK_STRIPE_MAX_MEMBERS	16
+#define DEF_STRIPE_CHUNK_KB		128
+
+/* SSD cache of vdisk_fileio devices, see the description of struct vdisk_cache */
+#define VDISK_CACHE_MAGIC		0x3143414354534353ULL /* "SCSTCAC1" */
+#define VDISK_CACHE_VERSION		1
+#define VDISK_CACHE_META_OFFSET		4096
+#define VDISK_CACHE_ORIGIN_LEN		1024
+#define VDISK_CACHE_MIN_BLOCKS		64
+#define VDISK_CACHE_MAX_BLOCKS		(1U << 28)
+#define VDISK_CACHE_STREAMS		8
+/* Max clean blocks examined looking for a reusable one */
+#define VDISK_CACHE_RECLAIM_SCAN	64
+#define VDISK_CACHE_DESTAGE_BATCH	64
+#define VDISK_CACHE_DESTAGE_DELAY	HZ
+/* Destaging runs without delays as long as more than this % is dirty */
+#define VDISK_CACHE_DIRTY_HIGH		10
+#define DEF_CACHE_BLOCK_KB		128
+#define DEF_CACHE_SEQ_CUTOFF_KB		4096
+
+/* vdisk_blockio readahead */
+#define VDISK_RA_EXTENT_SHIFT		19
+#define VDISK_RA_EXTENT_SIZE		(1 << VDISK_RA_EXTENT_SHIFT)
+#define VDISK_RA_STREAMS		8
+/* Sequential READs of a stream needed to start readahead */
+#define VDISK_RA_MIN_SEQ		2
+/* Extents read ahead of a stream */
+#define VDISK_RA_WINDOW			4
+#define VDISK_RA_MAX_CACHE_MB		(1024 * 1024)
 
 #define DEF_TST				SCST_TST_1_SEP_TASK_SETS
 #define DEF_TMF_ONLY			0
@@ -162,6 +233,8 @@ struct scst_vdisk_dev {
 	unsigned int media_changed:1;
 	unsigned int prevent_allow_medium_removal:1;
 	unsigned int nullio:1;
+	unsigned int ramdisk:1; /* nullio is set for ramdisk devices as well */
+	unsigned int cow:1;
 	unsigned int blockio:1;
 	unsigned int blk_integrity:1;
 	unsigned int cdrom_empty:1;
@@ -176,6 +249,7 @@ struct scst_vdisk_dev {
 	unsigned int tst:3;
 	unsigned int format_active:1;
 	unsigned int discard_zeroes_data:1;
+	unsigned int zero_detect:1;
 	unsigned int expl_alua:1;
 	unsigned int reexam_pending:1;
 	unsigned int size_key:1;
@@ -187,6 +261,109 @@ struct scst_vdisk_dev {
 	struct bio_set *vdisk_bioset;
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+	/*
+	 * BLOCKIO flush coalescing, protected by flush_lock. flush_cmds are
+	 * cmds waiting for the running FLUSH, flush_next_cmds - cmds arrived
+	 * after it was submitted, which will be completed by the next one.
+	 */
+	spinlock_t flush_lock;
+	struct list_head flush_cmds;
+	struct list_head flush_next_cmds;
+	bool flush_running;
+	/* FLUSH bios of the running FLUSH, one per stripe member */
+	atomic_t flush_bios_inflight;
+	int flush_error;
+#endif
+
+	/*
+	 * FILEIO fsync coalescing, see vdisk_fsync_fileio_coalesced().
+	 * fsync_mutex serializes fsyncs of fd. fsync_gen_started,
+	 * fsync_start and fsync_end are protected by flags_lock,
+	 * fsync_gen_done and fsync_res - by fsync_mutex.
+	 */
+	struct mutex fsync_mutex;
+	uint64_t fsync_gen_started;
+	uint64_t fsync_gen_done;
+	loff_t fsync_start, fsync_end;
+	int fsync_res;
+
+	/*
+	 * Striped vdisk_blockio device: filename is a comma separated list
+	 * of stripe_cnt members, over which the LBA space is distributed
+	 * round-robin by chunks of 1 << stripe_shift bytes. stripe_cnt is 0
+	 * for not striped devices. Members' fd and bdev are protected the
+	 * same way as fd, which, as well as bdev, points to the first member.
+	 */
+	int stripe_cnt;
+	int stripe_shift;
+	struct vdisk_stripe_member *stripe;
+
+	/*
+	 * vdisk_ramdisk storage: struct vdisk_ramdisk_chunk's of
+	 * VDISK_RAMDISK_CHUNK_SIZE bytes indexed by offset >>
+	 * VDISK_RAMDISK_CHUNK_SHIFT, allocated on the first write and freed
+	 * by UNMAP. The tree and ramdisk_chunks_cnt are
+	 * protected by ramdisk_lock. ramdisk_max_chunks 0 means no limit.
+	 */
+	spinlock_t ramdisk_lock;
+	struct radix_tree_root ramdisk_chunks;
+	unsigned long ramdisk_chunks_cnt;
+	unsigned long ramdisk_max_chunks;
+	int ramdisk_numa_node;
+
+	/* Open chain of COW images, protected the same way as fd */
+	struct vdisk_cow_image *cow_img;
+
+	/*
+	 * SSD cache in front of the file, protected the same way as fd.
+	 * cache_stats outlive it to be shown in sysfs at any time.
+	 */
+	struct vdisk_cache *cache;
+	char *cache_filename;
+	int cache_block_shift;
+	unsigned int cache_seq_cutoff_kb;
+	struct vdisk_cache_stats {
+		u64 read_hits, read_misses;
+		u64 write_hits, write_misses;
+		u64 bypassed, destaged;
+		unsigned int blocks, used_blocks, dirty_blocks;
+	} cache_stats;
+
+	/* Bytes of zero WRITEs deallocated instead, protected by flags_lock */
+	u64 zero_bytes_saved;
+
+	/*
+	 * BLOCKIO readahead cache, exists between attach and detach. Flushed,
+	 * when fd is closed.
+	 */
+	struct vdisk_ra *ra;
+	unsigned int ra_cache_mb;
+	struct vdisk_ra_stats {
+		u64 hits, misses;
+		u64 extents, unused, invalidated;
+	} ra_stats;
+
+	/*
+	 * vdisk_nullio completion delay, bandwidth cap, data pattern and
+	 * error injection, see nullio_complete(). The settings can be changed
+	 * at any time, the state after them is protected by nullio_lock.
+	 */
+	unsigned int nullio_delay_us;
+	unsigned int nullio_jitter_us;
+	unsigned int nullio_delay_dist;
+	unsigned int nullio_bw_mb;
+	unsigned int nullio_error_interval;
+	unsigned int nullio_pattern;
+	spinlock_t nullio_lock;
+	/* Time in ns, when the bandwidth capped "link" gets idle */
+	u64 nullio_bw_next;
+	u32 nullio_rnd;
+	unsigned int nullio_cmd_cnt;
+	struct vdisk_nullio_stats {
+		u64 delayed, injected, miscompares;
+	} nullio_stats;
+
 	uint64_t format_progress_to_do, format_progress_done;
 
 	int virt_id;
@@ -238,6 +415,27 @@ struct scst_vdisk_dev {
 	enum scst_dif_mode dif_mode;
 	int dif_type;
 	__be64 dif_static_app_tag_combined;
+
+	/* Parent of the COW image to create, used only by add_device() */
+	char *cow_parent;
+};
+
+/*
+ * vdisk_ramdisk chunk. Normally it is a single page of
+ * VDISK_RAMDISK_CHUNK_ORDER, but, if memory is too fragmented for that,
+ * it is made of (1 << (VDISK_RAMDISK_CHUNK_ORDER - order)) parts of the
+ * same smaller order, down to order-0 pages.
+ */
+struct vdisk_ramdisk_chunk {
+	unsigned long idx;
+	unsigned int order;
+	struct page *parts[0];
+};
+
+struct vdisk_stripe_member {
+	char *filename;
+	struct file *fd;
+	struct block_device *bdev;
 };
 
 struct vdisk_cmd_params {
@@ -249,6 +447,12 @@ struct vdisk_cmd_params {
 	loff_t loff;
 	int fua;
 	bool use_zero_copy;
+	/* Granules of a BLOCKIO WRITE, which are already deallocated */
+	const struct vdisk_zero_map *zero_map;
+	/* Readahead extent a BLOCKIO READ is served from */
+	struct vdisk_ra_extent *ra_ext;
+	/* Delayed completion of a NULLIO command */
+	struct vdisk_nullio_timer *nullio_timer;
 };
 
 static bool vdev_saved_mode_pages_enabled = true;
@@ -300,28 +504,52 @@ static int fileio_exec(struct scst_cmd *cmd);
 static int vcdrom_exec(struct scst_cmd *cmd);
 static int blockio_exec(struct scst_cmd *cmd);
 static int nullio_exec(struct scst_cmd *cmd);
+static void nullio_on_free_cmd(struct scst_cmd *cmd);
+static int ramdisk_alloc_data_buf(struct scst_cmd *cmd);
 static void blockio_on_alua_state_change_start(struct scst_device *dev,
 	enum scst_tg_state old_state, enum scst_tg_state new_state);
 static void blockio_on_alua_state_change_finish(struct scst_device *dev,
 	enum scst_tg_state old_state, enum scst_tg_state new_state);
 static void fileio_on_free_cmd(struct scst_cmd *cmd);
+static int blockio_alloc_data_buf(struct scst_cmd *cmd);
+static int blockio_dev_done(struct scst_cmd *cmd);
+static void blockio_on_free_cmd(struct scst_cmd *cmd);
 static enum compl_status_e nullio_exec_read(struct vdisk_cmd_params *p);
+static enum compl_status_e ramdisk_exec_read(struct vdisk_cmd_params *p);
 static enum compl_status_e blockio_exec_read(struct vdisk_cmd_params *p);
 static enum compl_status_e fileio_exec_read(struct vdisk_cmd_params *p);
 static enum compl_status_e nullio_exec_write(struct vdisk_cmd_params *p);
+static enum compl_status_e ramdisk_exec_write(struct vdisk_cmd_params *p);
 static enum compl_status_e blockio_exec_write(struct vdisk_cmd_params *p);
 static enum compl_status_e fileio_exec_write(struct vdisk_cmd_params *p);
 static enum compl_status_e nullio_exec_var_len_cmd(struct vdisk_cmd_params *p);
+static enum compl_status_e ramdisk_exec_var_len_cmd(struct vdisk_cmd_params *p);
 static enum compl_status_e blockio_exec_var_len_cmd(struct vdisk_cmd_params *p);
 static enum compl_status_e fileio_exec_var_len_cmd(struct vdisk_cmd_params *p);
 static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua);
 static int vdisk_blockio_flush(struct block_device *bdev, gfp_t gfp_mask,
 	bool report_error, struct scst_cmd *cmd, bool async);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+static void vdisk_blockio_flush_coalesced(struct scst_vdisk_dev *virt_dev,
+	gfp_t gfp_mask, struct scst_cmd *cmd);
+#endif
+static bool vdisk_stripe_check_discard(struct scst_vdisk_dev *virt_dev);
+static int vdisk_ra_create(struct scst_vdisk_dev *virt_dev);
+static void vdisk_ra_flush(struct vdisk_ra *ra);
+static void vdisk_ra_destroy(struct vdisk_ra *ra);
+static void vdisk_ra_read(struct scst_vdisk_dev *virt_dev, loff_t off,
+	unsigned int len, bool hit);
+static void vdisk_ra_invalidate_cmd(struct scst_vdisk_dev *virt_dev,
+	struct scst_cmd *cmd);
+static bool vdisk_ra_extent_stale(struct vdisk_ra_extent *ext);
+static struct vdisk_ra_extent *vdisk_ra_rebind(struct scst_cmd *cmd,
+	struct vdisk_ra_extent *ext);
 static enum compl_status_e vdev_exec_verify(struct vdisk_cmd_params *p);
 static enum compl_status_e blockio_exec_write_verify(struct vdisk_cmd_params *p);
 static enum compl_status_e fileio_exec_write_verify(struct vdisk_cmd_params *p);
 static enum compl_status_e nullio_exec_write_verify(struct vdisk_cmd_params *p);
 static enum compl_status_e nullio_exec_verify(struct vdisk_cmd_params *p);
+static enum compl_status_e ramdisk_exec_write_verify(struct vdisk_cmd_params *p);
 static enum compl_status_e vdisk_exec_read_capacity(struct vdisk_cmd_params *p);
 static enum compl_status_e vdisk_exec_read_capacity16(struct vdisk_cmd_params *p);
 static enum compl_status_e vdisk_exec_get_lba_status(struct vdisk_cmd_params *p);
@@ -352,6 +580,7 @@ static int vcdrom_write_proc(char *buffer, char **start, off_t offset,
 static ssize_t vdisk_add_fileio_device(const char *device_name, char *params);
 static ssize_t vdisk_add_blockio_device(const char *device_name, char *params);
 static ssize_t vdisk_add_nullio_device(const char *device_name, char *params);
+static ssize_t vdisk_add_ramdisk_device(const char *device_name, char *params);
 static ssize_t vdisk_del_device(const char *device_name);
 static ssize_t vcdrom_add_device(const char *device_name, char *params);
 static ssize_t vcdrom_del_device(const char *device_name);
@@ -362,9 +591,15 @@ static uint64_t vdisk_gen_dev_id_num(const char *virt_dev_name);
 #ifdef CONFIG_DEBUG_EXT_COPY_REMAP
 static void vdev_ext_copy_remap(struct scst_cmd *cmd,
 	struct scst_ext_copy_seg_descr *descr);
+#else
+static void vdisk_cow_ext_copy_remap(struct scst_cmd *cmd,
+	struct scst_ext_copy_seg_descr *descr);
 #endif
 static int vdisk_unmap_range(struct scst_cmd *cmd,
 	struct scst_vdisk_dev *virt_dev, uint64_t start_lba, uint32_t blocks);
+static int vdisk_unmap_file_range(struct scst_cmd *cmd,
+	struct scst_vdisk_dev *virt_dev, loff_t off, loff_t len,
+	struct file *fd);
 
 /** SYSFS **/
 
@@ -460,6 +695,40 @@ static ssize_t vdev_zero_copy_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf);
 static ssize_t vdev_dif_filename_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf);
+static ssize_t vdev_ramdisk_mem_used_mb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdev_ramdisk_mem_limit_mb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdev_ramdisk_numa_node_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_cow_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_snapshot_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count);
+static ssize_t vdisk_sysfs_stripe_chunk_kb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_cache_filename_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_cache_block_kb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_cache_seq_cutoff_kb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_cache_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_zero_detect_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_zero_bytes_saved_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_ra_cache_mb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_ra_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdev_sysfs_nullio_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdev_sysfs_nullio_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count);
+static ssize_t vdev_sysfs_nullio_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
 
 static ssize_t vcdrom_sysfs_filename_store(struct kobject *kobj,
 	struct kobj_attribute *attr, const char *buf, size_t count);
@@ -544,6 +813,56 @@ static struct kobj_attribute vdev_zero_copy_attr =
 	__ATTR(zero_copy, S_IRUGO, vdev_zero_copy_show, NULL);
 static struct kobj_attribute vdev_dif_filename_attr =
 	__ATTR(dif_filename, S_IRUGO, vdev_dif_filename_show, NULL);
+static struct kobj_attribute vdev_ramdisk_mem_used_mb_attr =
+	__ATTR(mem_used_mb, S_IRUGO, vdev_ramdisk_mem_used_mb_show, NULL);
+static struct kobj_attribute vdev_ramdisk_mem_limit_mb_attr =
+	__ATTR(mem_limit_mb, S_IRUGO, vdev_ramdisk_mem_limit_mb_show, NULL);
+static struct kobj_attribute vdev_ramdisk_numa_node_attr =
+	__ATTR(numa_node, S_IRUGO, vdev_ramdisk_numa_node_show, NULL);
+static struct kobj_attribute vdisk_cow_attr =
+	__ATTR(cow, S_IRUGO, vdisk_sysfs_cow_show, NULL);
+static struct kobj_attribute vdisk_snapshot_attr =
+	__ATTR(snapshot, S_IWUSR, NULL, vdisk_sysfs_snapshot_store);
+static struct kobj_attribute vdisk_stripe_chunk_kb_attr =
+	__ATTR(stripe_chunk_kb, S_IRUGO, vdisk_sysfs_stripe_chunk_kb_show, NULL);
+static struct kobj_attribute vdisk_cache_filename_attr =
+	__ATTR(cache_filename, S_IRUGO, vdisk_sysfs_cache_filename_show, NULL);
+static struct kobj_attribute vdisk_cache_block_kb_attr =
+	__ATTR(cache_block_kb, S_IRUGO, vdisk_sysfs_cache_block_kb_show, NULL);
+static struct kobj_attribute vdisk_cache_seq_cutoff_kb_attr =
+	__ATTR(cache_seq_cutoff_kb, S_IRUGO,
+	       vdisk_sysfs_cache_seq_cutoff_kb_show, NULL);
+static struct kobj_attribute vdisk_cache_stats_attr =
+	__ATTR(cache_stats, S_IRUGO, vdisk_sysfs_cache_stats_show, NULL);
+static struct kobj_attribute vdisk_zero_detect_attr =
+	__ATTR(zero_detect, S_IRUGO, vdisk_sysfs_zero_detect_show, NULL);
+static struct kobj_attribute vdisk_zero_bytes_saved_attr =
+	__ATTR(zero_bytes_saved, S_IRUGO, vdisk_sysfs_zero_bytes_saved_show,
+	       NULL);
+static struct kobj_attribute vdisk_ra_cache_mb_attr =
+	__ATTR(ra_cache_mb, S_IRUGO, vdisk_sysfs_ra_cache_mb_show, NULL);
+static struct kobj_attribute vdisk_ra_stats_attr =
+	__ATTR(ra_stats, S_IRUGO, vdisk_sysfs_ra_stats_show, NULL);
+static struct kobj_attribute vdev_nullio_delay_us_attr =
+	__ATTR(delay_us, S_IWUSR|S_IRUGO, vdev_sysfs_nullio_show,
+	       vdev_sysfs_nullio_store);
+static struct kobj_attribute vdev_nullio_delay_jitter_us_attr =
+	__ATTR(delay_jitter_us, S_IWUSR|S_IRUGO, vdev_sysfs_nullio_show,
+	       vdev_sysfs_nullio_store);
+static struct kobj_attribute vdev_nullio_delay_dist_attr =
+	__ATTR(delay_dist, S_IWUSR|S_IRUGO, vdev_sysfs_nullio_show,
+	       vdev_sysfs_nullio_store);
+static struct kobj_attribute vdev_nullio_bw_mb_attr =
+	__ATTR(bw_mb, S_IWUSR|S_IRUGO, vdev_sysfs_nullio_show,
+	       vdev_sysfs_nullio_store);
+static struct kobj_attribute vdev_nullio_error_interval_attr =
+	__ATTR(error_interval, S_IWUSR|S_IRUGO, vdev_sysfs_nullio_show,
+	       vdev_sysfs_nullio_store);
+static struct kobj_attribute vdev_nullio_pattern_attr =
+	__ATTR(pattern, S_IWUSR|S_IRUGO, vdev_sysfs_nullio_show,
+	       vdev_sysfs_nullio_store);
+static struct kobj_attribute vdev_nullio_stats_attr =
+	__ATTR(nullio_stats, S_IRUGO, vdev_sysfs_nullio_stats_show, NULL);
 
 static struct kobj_attribute vcdrom_filename_attr =
 	__ATTR(filename, S_IRUGO|S_IWUSR, vdev_sysfs_filename_show,
@@ -577,6 +896,10 @@ static const struct attribute *vdisk_fileio_attrs[] = {
 	&vdev_usn_attr.attr,
 	&vdev_inq_vend_specific_attr.attr,
 	&vdev_zero_copy_attr.attr,
+	&vdisk_cow_attr.attr,
+	&vdisk_snapshot_attr.attr,
+	&vdisk_zero_detect_attr.attr,
+	&vdisk_zero_bytes_saved_attr.attr,
 	NULL,
 };
 
@@ -606,6 +929,11 @@ static const struct attribute *vdisk_blockio_attrs[] = {
 	&vdev_usn_attr.attr,
 	&vdev_inq_vend_specific_attr.attr,
 	&vdisk_tp_attr.attr,
+	&vdisk_stripe_chunk_kb_attr.attr,
+	&vdisk_zero_detect_attr.attr,
+	&vdisk_zero_bytes_saved_attr.attr,
+	&vdisk_ra_cache_mb_attr.attr,
+	&vdisk_ra_stats_attr.attr,
 	NULL,
 };
 
@@ -617,6 +945,13 @@ static const struct attribute *vdisk_nullio_attrs[] = {
 	&vdisk_tst_attr.attr,
 	&vdev_dummy_attr.attr,
 	&vdev_read_zero_attr.attr,
+	&vdev_nullio_delay_us_attr.attr,
+	&vdev_nullio_delay_jitter_us_attr.attr,
+	&vdev_nullio_delay_dist_attr.attr,
+	&vdev_nullio_bw_mb_attr.attr,
+	&vdev_nullio_error_interval_attr.attr,
+	&vdev_nullio_pattern_attr.attr,
+	&vdev_nullio_stats_attr.attr,
 	&vdisk_removable_attr.attr,
 	&vdev_t10_vend_id_attr.attr,
 	&vdev_vend_specific_id_attr.attr,
@@ -632,6 +967,32 @@ static const struct attribute *vdisk_nullio_attrs[] = {
 	NULL,
 };
 
+static const struct attribute *vdisk_ramdisk_attrs[] = {
+	&vdev_size_rw_attr.attr,
+	&vdev_size_mb_rw_attr.attr,
+	&vdisk_blocksize_attr.attr,
+	&vdisk_rd_only_attr.attr,
+	&vdisk_tst_attr.attr,
+	&vdisk_removable_attr.attr,
+	&vdisk_rotational_attr.attr,
+	&vdisk_tp_attr.attr,
+	&vdev_zero_copy_attr.attr,
+	&vdev_ramdisk_mem_used_mb_attr.attr,
+	&vdev_ramdisk_mem_limit_mb_attr.attr,
+	&vdev_ramdisk_numa_node_attr.attr,
+	&vdev_t10_vend_id_attr.attr,
+	&vdev_vend_specific_id_attr.attr,
+	&vdev_prod_id_attr.attr,
+	&vdev_prod_rev_lvl_attr.attr,
+	&vdev_scsi_device_name_attr.attr,
+	&vdev_t10_dev_id_attr.attr,
+	&vdev_naa_id_attr.attr,
+	&vdev_eui64_id_attr.attr,
+	&vdev_usn_attr.attr,
+	&vdev_inq_vend_specific_attr.attr,
+	NULL,
+};
+
 static const struct attribute *vcdrom_attrs[] = {
 	&vdev_size_ro_attr.attr,
 	&vdev_size_mb_ro_attr.attr,
@@ -670,6 +1031,7 @@ static struct kmem_cache *vdisk_cmd_param_cachep;
 static vdisk_op_fn fileio_ops[256];
 static vdisk_op_fn blockio_ops[256];
 static vdisk_op_fn nullio_ops[256];
+static vdisk_op_fn ramdisk_ops[256];
 
 /*
  * Be careful changing "name" field, since it is the name of the corresponding
@@ -695,6 +1057,8 @@ static struct scst_dev_type vdisk_file_devtype = {
 	.task_mgmt_fn_done =	vdisk_task_mgmt_fn_done,
 #ifdef CONFIG_DEBUG_EXT_COPY_REMAP
 	.ext_copy_remap =	vdev_ext_copy_remap,
+#else
+	.ext_copy_remap =	vdisk_cow_ext_copy_remap,
 #endif
 	.get_supported_opcodes = vdisk_get_supported_opcodes,
 	.devt_priv =		(void *)fileio_ops,
@@ -708,6 +1072,11 @@ static struct scst_dev_type vdisk_file_devtype = {
 	.add_device_parameters =
 		"blocksize, "
 		"filename, "
+		"cow, "
+		"cow_parent, "
+		"cache_filename, "
+		"cache_block_kb, "
+		"cache_seq_cutoff_kb, "
 		"nv_cache, "
 		"o_direct, "
 		"cluster_mode, "
@@ -718,6 +1087,7 @@ static struct scst_dev_type vdisk_file_devtype = {
 		"tst, "
 		"write_through, "
 		"zero_copy, "
+		"zero_detect, "
 		"dif_mode, "
 		"dif_type, "
 		"dif_static_app_tag, "
@@ -734,12 +1104,14 @@ static struct scst_dev_type vdisk_file_devtype = {
 };
 
 static struct kmem_cache *blockio_work_cachep;
+static struct kmem_cache *nullio_timer_cachep;
 
 static struct scst_dev_type vdisk_blk_devtype = {
 	.name =			"vdisk_blockio",
 	.type =			TYPE_DISK,
 	.threads_num =		1,
 	.parse_atomic =		1,
+	.dev_alloc_data_buf_atomic = 1,
 	.dev_done_atomic =	1,
 #ifdef CONFIG_SCST_PROC
 	.no_proc =		1,
@@ -750,7 +1122,10 @@ static struct scst_dev_type vdisk_blk_devtype = {
 	.attach_tgt =		vdisk_attach_tgt,
 	.detach_tgt =		vdisk_detach_tgt,
 	.parse =		non_fileio_parse,
+	.dev_alloc_data_buf =	blockio_alloc_data_buf,
 	.exec =			blockio_exec,
+	.dev_done =		blockio_dev_done,
+	.on_free_cmd =		blockio_on_free_cmd,
 	.on_alua_state_change_start = blockio_on_alua_state_change_start,
 	.on_alua_state_change_finish = blockio_on_alua_state_change_finish,
 	.task_mgmt_fn_done =	vdisk_task_mgmt_fn_done,
@@ -769,12 +1144,15 @@ static struct scst_dev_type vdisk_blk_devtype = {
 		"filename, "
 		"nv_cache, "
 		"cluster_mode, "
+		"ra_cache_mb, "
 		"read_only, "
 		"removable, "
 		"rotational, "
+		"stripe_chunk_kb, "
 		"thin_provisioned, "
 		"tst, "
-		"write_through",
+		"write_through, "
+		"zero_detect",
 #endif
 #if defined(CONFIG_SCST_DEBUG) || defined(CONFIG_SCST_TRACING)
 	.default_trace_flags =	SCST_DEFAULT_DEV_LOG_FLAGS,
@@ -802,6 +1180,7 @@ static struct scst_dev_type vdisk_null_devtype = {
 	.detach_tgt =		vdisk_detach_tgt,
 	.parse =		non_fileio_parse,
 	.exec =			nullio_exec,
+	.on_free_cmd =		nullio_on_free_cmd,
 	.task_mgmt_fn_done =	vdisk_task_mgmt_fn_done,
 	.devt_priv =		(void *)nullio_ops,
 	.get_supported_opcodes = vdisk_get_supported_opcodes,
@@ -811,10 +1190,16 @@ static struct scst_dev_type vdisk_null_devtype = {
 	.dev_attrs =		vdisk_nullio_attrs,
 	.add_device_parameters =
 		"blocksize, "
+		"bw_mb, "
+		"delay_dist, "
+		"delay_jitter_us, "
+		"delay_us, "
 		"dummy, "
 		"dif_mode, "
 		"dif_type, "
-		"dif_static_app_tag, ",
+		"dif_static_app_tag, "
+		"error_interval, "
+		"pattern, "
 		"read_only, "
 		"removable, "
 		"rotational, "
@@ -832,6 +1217,55 @@ static struct scst_dev_type vdisk_null_devtype = {
 #endif
 };
 
+static struct scst_dev_type vdisk_ramdisk_devtype = {
+	.name =			"vdisk_ramdisk",
+	.type =			TYPE_DISK,
+	.exec_sync =		1,
+	.threads_num =		0,
+	.parse_atomic =		1,
+	.dev_done_atomic =	1,
+#ifdef CONFIG_SCST_PROC
+	.no_proc =		1,
+#endif
+	.auto_cm_assignment_possible = 1,
+	.attach =		vdisk_attach,
+	.detach =		vdisk_detach,
+	.attach_tgt =		vdisk_attach_tgt,
+	.detach_tgt =		vdisk_detach_tgt,
+	.parse =		vdisk_parse,
+	.dev_alloc_data_buf =	ramdisk_alloc_data_buf,
+	.exec =			fileio_exec,
+	.on_free_cmd =		fileio_on_free_cmd,
+	.task_mgmt_fn_done =	vdisk_task_mgmt_fn_done,
+	.devt_priv =		(void *)ramdisk_ops,
+	.get_supported_opcodes = vdisk_get_supported_opcodes,
+#ifndef CONFIG_SCST_PROC
+	.add_device =		vdisk_add_ramdisk_device,
+	.del_device =		vdisk_del_device,
+	.dev_attrs =		vdisk_ramdisk_attrs,
+	.add_device_parameters =
+		"blocksize, "
+		"mem_limit_mb, "
+		"numa_node, "
+		"read_only, "
+		"removable, "
+		"rotational, "
+		"size, "
+		"size_mb, "
+		"thin_provisioned, "
+		"tst, "
+		"zero_copy",
+#endif
+#if defined(CONFIG_SCST_DEBUG) || defined(CONFIG_SCST_TRACING)
+	.default_trace_flags =	SCST_DEFAULT_DEV_LOG_FLAGS,
+	.trace_flags =		&trace_flag,
+	.trace_tbl =		vdisk_local_trace_tbl,
+#ifndef CONFIG_SCST_PROC
+	.trace_tbl_help =	VDISK_TRACE_TBL_HELP,
+#endif
+#endif
+};
+
 static struct scst_dev_type vcdrom_devtype = {
 	.name =			"vcdrom",
 	.type =			TYPE_ROM,
@@ -931,38 +1365,36 @@ static struct file *vdev_open_fd(const struct scst_vdisk_dev *virt_dev,
 	return fd;
 }
 
-static void vdisk_blockio_check_flush_support(struct scst_vdisk_dev *virt_dev)
+static void __vdisk_blockio_check_flush_support(struct scst_vdisk_dev *virt_dev,
+	const char *filename)
 {
 	struct inode *inode;
 	struct file *fd;
 
 	TRACE_ENTRY();
 
-	if (!virt_dev->blockio || virt_dev->rd_only || virt_dev->nv_cache || virt_dev->wt_flag)
-		goto out;
-
-	fd = filp_open(virt_dev->filename, O_LARGEFILE, 0600);
+	fd = filp_open(filename, O_LARGEFILE, 0600);
 	if (IS_ERR(fd)) {
 		if ((PTR_ERR(fd) == -EMEDIUMTYPE) && virt_dev->blockio)
 			TRACE(TRACE_MINOR, "Unable to open %s with EMEDIUMTYPE, "
-				"DRBD passive?", virt_dev->filename);
+				"DRBD passive?", filename);
 		else
 			PRINT_ERROR("filp_open(%s) failed: %ld",
-				virt_dev->filename, PTR_ERR(fd));
+				filename, PTR_ERR(fd));
 		goto out;
 	}
 
 	inode = file_inode(fd);
 
 	if (!S_ISBLK(inode->i_mode)) {
-		PRINT_ERROR("%s is NOT a block device", virt_dev->filename);
+		PRINT_ERROR("%s is NOT a block device", filename);
 		goto out_close;
 	}
 
 	if (vdisk_blockio_flush(inode->i_bdev, GFP_KERNEL, false, NULL, false) != 0) {
 		PRINT_WARNING("Device %s doesn't support barriers, switching "
 			"to NV_CACHE mode. Read README for more details.",
-			virt_dev->filename);
+			filename);
 		virt_dev->nv_cache = 1;
 	}
 
@@ -974,6 +1406,25 @@ out:
 	return;
 }
 
+static void vdisk_blockio_check_flush_support(struct scst_vdisk_dev *virt_dev)
+{
+	int i;
+
+	if (!virt_dev->blockio || virt_dev->rd_only || virt_dev->nv_cache || virt_dev->wt_flag)
+		return;
+
+	if (virt_dev->stripe_cnt == 0) {
+		__vdisk_blockio_check_flush_support(virt_dev, virt_dev->filename);
+		return;
+	}
+
+	/* NV_CACHE for the whole device, if any member doesn't support it */
+	for (i = 0; (i < virt_dev->stripe_cnt) && !virt_dev->nv_cache; i++)
+		__vdisk_blockio_check_flush_support(virt_dev,
+			virt_dev->stripe[i].filename);
+	return;
+}
+
 static void vdisk_check_tp_support(struct scst_vdisk_dev *virt_dev)
 {
 	struct file *fd = NULL;
@@ -983,9 +1434,28 @@ static void vdisk_check_tp_support(struct scst_vdisk_dev *virt_dev)
 
 	virt_dev->dev_thin_provisioned = 0;
 
+	if (virt_dev->ramdisk) {
+		/* Unallocated chunks read as zeroes and UNMAP frees them */
+		virt_dev->dev_thin_provisioned = 1;
+		goto check;
+	}
+
+	if (virt_dev->cow) {
+		/* Deallocation only changes the mapping of the image */
+		virt_dev->dev_thin_provisioned = 1;
+		goto check;
+	}
+
 	if (virt_dev->rd_only || (virt_dev->filename == NULL))
 		goto check;
 
+	if (virt_dev->stripe_cnt != 0) {
+		/* Sets unmap parameters as well */
+		virt_dev->dev_thin_provisioned =
+			vdisk_stripe_check_discard(virt_dev);
+		goto check;
+	}
+
 	fd = filp_open(virt_dev->filename, O_LARGEFILE, 0600);
 	if (IS_ERR(fd)) {
 		if ((PTR_ERR(fd) == -EMEDIUMTYPE) && virt_dev->blockio)
@@ -1026,18 +1496,21 @@ check:
 				virt_dev->filename);
 			virt_dev->thin_provisioned = 0;
 		}
-	} else if (virt_dev->blockio) {
+	} else if (virt_dev->blockio || virt_dev->ramdisk || virt_dev->cow) {
 		virt_dev->thin_provisioned = virt_dev->dev_thin_provisioned;
 		if (virt_dev->thin_provisioned)
 			PRINT_INFO("Auto enable thin provisioning for device "
-				"%s", virt_dev->filename);
+				"%s", virt_dev->blockio ? virt_dev->filename :
+				virt_dev->name);
 
 	}
 
 	if (virt_dev->thin_provisioned) {
 		int block_shift = virt_dev->dev->block_shift;
 
-		if (virt_dev->blockio) {
+		if (virt_dev->stripe_cnt != 0) {
+			/* Already set by vdisk_stripe_check_discard() */
+		} else if (virt_dev->blockio) {
 			struct request_queue *q;
 
 			sBUG_ON(!fd_open);
@@ -1051,6 +1524,18 @@ check:
 #else
 			sBUG();
 #endif
+		} else if (virt_dev->ramdisk) {
+			virt_dev->unmap_opt_gran = VDISK_RAMDISK_CHUNK_SIZE >> block_shift;
+			virt_dev->unmap_align = 0;
+			/* 256 MB */
+			virt_dev->unmap_max_lba_cnt = (256 * 1024 * 1024) >> block_shift;
+			virt_dev->discard_zeroes_data = 1;
+		} else if (virt_dev->cow) {
+			virt_dev->unmap_opt_gran = (1 << VDISK_COW_CLUSTER_SHIFT) >> block_shift;
+			virt_dev->unmap_align = 0;
+			/* 256 MB */
+			virt_dev->unmap_max_lba_cnt = (256 * 1024 * 1024) >> block_shift;
+			virt_dev->discard_zeroes_data = 1;
 		} else {
 			virt_dev->unmap_opt_gran = 1;
 			virt_dev->unmap_align = 0;
@@ -1131,5536 +1616,11003 @@ out:
 	return res;
 }
 
-/* scst_vdisk_mutex supposed to be held */
-static struct scst_vdisk_dev *vdev_find(const char *name)
+/*
+ * Copy-on-write image of a vdisk_fileio "cow" device.
+ *
+ * The image file is divided into clusters of 1 << cluster_shift bytes.
+ * Cluster 0 holds struct vdisk_cow_header, the L1 table starts at l1_offset.
+ * Each L1 entry is the file offset of an L2 table, which occupies a single
+ * cluster, or 0 if there is no such table yet. Each L2 entry is the file
+ * offset of a data cluster, VDISK_COW_UNALLOCATED or VDISK_COW_ZERO.
+ * Unallocated clusters are read from the parent image, if any, otherwise as
+ * zeroes. Zero clusters are deallocated ones, which read as zeroes without
+ * looking in the parent. All on-disk values are little endian.
+ *
+ * The parent is either another COW image or a plain image file, so
+ * snapshots and clones are made by starting an empty image on top of an
+ * existing one. Parents are never modified.
+ *
+ * New clusters are always appended at the end of the file and deallocated
+ * ones are never reused, so a stale mapping can't point to another
+ * cluster's data.
+ *
+ * The L1 table and up to VDISK_COW_L2_CACHE_SIZE bytes of not dirty L2
+ * tables are cached in memory. Dirty tables are written back by flush_work:
+ * first the data, then the dirty L2 tables, then the L1 table, each step
+ * followed by fsync(). Hence the on-disk mapping never refers to unwritten
+ * data or tables. SYNCHRONIZE CACHE, FUA writes and write-through devices
+ * flush them synchronously.
+ */
+struct vdisk_cow_header {
+	__le64 magic;
+	__le32 version;
+	__le32 cluster_shift;
+	__le64 size;
+	__le64 l1_offset;
+	__le32 l1_entries;
+	__le32 reserved;
+	char parent[VDISK_COW_PARENT_LEN];
+} __packed;
+
+struct vdisk_cow_l2 {
+	loff_t offset;
+	unsigned int idx;
+
+	/* Set on each lookup, cleared by the eviction */
+	bool referenced;
+
+	/* Pinned tables are never evicted */
+	atomic_t pin;
+
+	/* Entry in l2_lru_list */
+	struct list_head lru_list_entry;
+
+	/* Entry in dirty_l2_list, empty if the table is clean */
+	struct list_head dirty_list_entry;
+
+	/* Entry in the list of tables being flushed and their snapshot */
+	struct list_head flush_list_entry;
+	__le64 *flush_entries;
+
+	__le64 entries[0];
+};
+
+struct vdisk_cow_image {
+	struct file *fd;
+	unsigned int fd_owned:1;
+	unsigned int raw:1;
+	unsigned int read_only:1;
+	int cluster_shift;
+	loff_t size;
+	unsigned int l1_entries;
+	loff_t l1_offset;
+	char *filename;
+
+	/*
+	 * Protects all below as well as the content of the L2 tables. Only
+	 * lookups in memory are done under it, never I/O.
+	 */
+	struct rw_semaphore lock;
+	__le64 *l1;
+	struct vdisk_cow_l2 **l2;
+	struct list_head l2_lru_list;
+	unsigned int l2_cached;
+	unsigned int l2_max_cached;
+	struct list_head dirty_l2_list;
+	bool l1_dirty;
+
+	/* Protects next_free */
+	spinlock_t alloc_lock;
+	loff_t next_free;
+
+	/* Serializes flushes and protects l1_snap */
+	struct mutex flush_mutex;
+	__le64 *l1_snap;
+
+	struct delayed_work flush_work;
+
+	struct vdisk_cow_image *parent;
+};
+
+/* Returns 0 on success or error code. Reading beyond EOF returns zeroes. */
+static int vdisk_file_rw_sync(struct file *fd, void *buf, size_t len,
+	loff_t off, bool write)
 {
-	struct scst_vdisk_dev *res, *vv;
+	mm_segment_t old_fs;
+	ssize_t rc;
+	int res = 0;
 
-	TRACE_ENTRY();
+	old_fs = get_fs();
+	set_fs(get_ds());
 
-	res = NULL;
-	list_for_each_entry(vv, &vdev_list, vdev_list_entry) {
-		if (strcmp(vv->name, name) == 0) {
-			res = vv;
+	while (len > 0) {
+		if (write)
+			rc = vfs_write(fd, (const char __force __user *)buf,
+				len, &off);
+		else
+			rc = vfs_read(fd, (char __force __user *)buf, len, &off);
+		if (rc < 0) {
+			res = rc;
+			break;
+		} else if (rc == 0) {
+			if (write)
+				res = -EIO;
+			else
+				memset(buf, 0, len);
 			break;
 		}
+		buf += rc;
+		len -= rc;
 	}
 
-	TRACE_EXIT_HRES((unsigned long)res);
+	set_fs(old_fs);
 	return res;
 }
 
-#define VDEV_WT_LABEL			"WRITE_THROUGH"
-#define VDEV_MODE_PAGES_BUF_SIZE	(64*1024)
-#define VDEV_MODE_PAGES_DIR		(SCST_VAR_DIR "/vdev_mode_pages")
-
-static int __vdev_save_mode_pages(const struct scst_vdisk_dev *virt_dev,
-	uint8_t *buf, int size)
+static inline unsigned int vdisk_cow_l1_idx(const struct vdisk_cow_image *img,
+	loff_t off)
 {
-	int res = 0;
+	/* Each L2 table maps 1 << (cluster_shift - 3) clusters */
+	return off >> (2 * img->cluster_shift - 3);
+}
 
-	TRACE_ENTRY();
+static inline unsigned int vdisk_cow_l2_idx(const struct vdisk_cow_image *img,
+	loff_t off)
+{
+	return (off >> img->cluster_shift) &
+		((1 << (img->cluster_shift - 3)) - 1);
+}
 
-	if (virt_dev->wt_flag != DEF_WRITE_THROUGH) {
-		res += scnprintf(&buf[res], size - res, "%s=%d\n",
-			VDEV_WT_LABEL, virt_dev->wt_flag);
-		if (res >= size-1)
-			goto out_overflow;
-	}
+/* img->alloc_lock supposed to be held */
+static loff_t vdisk_cow_alloc_cluster(struct vdisk_cow_image *img)
+{
+	loff_t res = img->next_free;
 
-out:
-	TRACE_EXIT_RES(res);
+	img->next_free += 1 << img->cluster_shift;
 	return res;
+}
 
-out_overflow:
-	PRINT_ERROR("Mode pages buffer overflow (size %d)", size);
-	res = -EOVERFLOW;
-	goto out;
+static loff_t vdisk_cow_reserve_cluster(struct vdisk_cow_image *img)
+{
+	loff_t res;
+
+	spin_lock(&img->alloc_lock);
+	res = vdisk_cow_alloc_cluster(img);
+	spin_unlock(&img->alloc_lock);
+	return res;
 }
 
-static int vdev_save_mode_pages(const struct scst_vdisk_dev *virt_dev)
+/* img->lock supposed to be write locked */
+static void vdisk_cow_l2_set_dirty(struct vdisk_cow_image *img,
+	struct vdisk_cow_l2 *l2)
 {
-	int res, rc, offs;
-	uint8_t *buf;
-	int size;
-	char *name, *name1;
+	if (list_empty(&l2->dirty_list_entry))
+		list_add_tail(&l2->dirty_list_entry, &img->dirty_l2_list);
+}
 
-	TRACE_ENTRY();
+/* img->lock supposed to be held, read locked is enough */
+static struct vdisk_cow_l2 *vdisk_cow_find_l2(struct vdisk_cow_image *img,
+	unsigned int idx)
+{
+	struct vdisk_cow_l2 *l2 = img->l2[idx];
 
-	size = VDEV_MODE_PAGES_BUF_SIZE;
+	/* Racy, but it's only a hint for the eviction */
+	if ((l2 != NULL) && !ACCESS_ONCE(l2->referenced))
+		l2->referenced = true;
+	return l2;
+}
 
-	buf = vzalloc(size);
-	if (buf == NULL) {
-		PRINT_ERROR("Unable to alloc mode pages buffer (size %d)", size);
-		res = -ENOMEM;
-		goto out;
+/*
+ * Evicts not recently used clean L2 tables, while there are more than
+ * img->l2_max_cached ones cached, by the CLOCK algorithm over l2_lru_list.
+ * img->lock supposed to be write locked.
+ */
+static void vdisk_cow_evict_l2(struct vdisk_cow_image *img)
+{
+	struct vdisk_cow_l2 *l2;
+	unsigned int scanned = 0, max_scan = 2 * img->l2_cached;
+
+	lockdep_assert_held(&img->lock);
+
+	while ((img->l2_cached > img->l2_max_cached) &&
+	       (scanned++ < max_scan)) {
+		l2 = list_first_entry(&img->l2_lru_list, typeof(*l2),
+				lru_list_entry);
+		if (l2->referenced || (atomic_read(&l2->pin) != 0) ||
+		    !list_empty(&l2->dirty_list_entry)) {
+			l2->referenced = false;
+			list_move_tail(&l2->lru_list_entry, &img->l2_lru_list);
+			continue;
+		}
+		TRACE_DBG("Evicting L2 table %u of COW image %s", l2->idx,
+			img->filename);
+		list_del(&l2->lru_list_entry);
+		img->l2[l2->idx] = NULL;
+		img->l2_cached--;
+		vfree(l2);
 	}
+	return;
+}
 
-	name = kasprintf(GFP_KERNEL, "%s/%s", VDEV_MODE_PAGES_DIR, virt_dev->name);
-	if (name == NULL) {
-		PRINT_ERROR("Unable to create name %s/%s", VDEV_MODE_PAGES_DIR,
-			virt_dev->name);
-		res = -ENOMEM;
-		goto out_vfree;
-	}
+static void vdisk_cow_put_l2(struct vdisk_cow_l2 *l2)
+{
+	atomic_dec(&l2->pin);
+}
 
-	name1 = kasprintf(GFP_KERNEL, "%s/%s1", VDEV_MODE_PAGES_DIR, virt_dev->name);
-	if (name1 == NULL) {
-		PRINT_ERROR("Unable to create name %s/%s1", VDEV_MODE_PAGES_DIR,
-			virt_dev->name);
-		res = -ENOMEM;
-		goto out_free_name;
-	}
+/*
+ * Returns in *res_l2 the L2 table mapping @off pinned in the cache, reading
+ * it, if needed, without img->lock held. If there's no such table yet,
+ * allocates it if @alloc is true, otherwise returns NULL. The table must be
+ * unpinned by vdisk_cow_put_l2().
+ */
+static int vdisk_cow_get_l2(struct vdisk_cow_image *img, loff_t off,
+	bool alloc, struct vdisk_cow_l2 **res_l2)
+{
+	unsigned int idx = vdisk_cow_l1_idx(img, off);
+	size_t cluster_size = 1 << img->cluster_shift;
+	struct vdisk_cow_l2 *l2, *new;
+	loff_t l1e;
+	int res = 0;
 
-	offs = scst_save_global_mode_pages(virt_dev->dev, buf, size);
-	if (offs < 0) {
-		res = offs;
-		goto out_free_name1;
-	}
+	EXTRACHECKS_BUG_ON(idx >= img->l1_entries);
 
-	rc = __vdev_save_mode_pages(virt_dev, &buf[offs], size - offs);
-	if (rc < 0) {
-		res = rc;
-		goto out_free_name1;
-	}
+again:
+	new = NULL;
 
-	offs += rc;
-	if (offs == 0) {
-		res = 0;
-		scst_remove_file(name);
-		scst_remove_file(name1);
-		goto out_free_name1;
-	}
+	down_read(&img->lock);
+	l2 = vdisk_cow_find_l2(img, idx);
+	if (l2 != NULL)
+		atomic_inc(&l2->pin);
+	l1e = le64_to_cpu(img->l1[idx]);
+	up_read(&img->lock);
 
-	res = scst_write_file_transactional(name, name1,
-			virt_dev->name, strlen(virt_dev->name), buf, offs);
+	if ((l2 != NULL) || ((l1e == 0) && !alloc))
+		goto out;
 
-out_free_name1:
-	kfree(name1);
+	new = vmalloc(sizeof(*new) + cluster_size);
+	if (new == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+	INIT_LIST_HEAD(&new->dirty_list_entry);
+	new->flush_entries = NULL;
+	new->idx = idx;
+	new->referenced = true;
+	atomic_set(&new->pin, 1);
+
+	if (l1e != 0) {
+		/* L2 tables never move, so l1e can't become stale */
+		new->offset = l1e;
+		res = vdisk_file_rw_sync(img->fd, new->entries, cluster_size,
+				l1e, false);
+		if (res != 0) {
+			PRINT_ERROR("Reading L2 table at %lld of COW image %s "
+				"failed: %d", (long long)l1e, img->filename, res);
+			goto out_free;
+		}
+	} else
+		memset(new->entries, 0, cluster_size);
+
+	down_write(&img->lock);
+
+	l2 = img->l2[idx];
+	if (l2 != NULL) {
+		/* Somebody else loaded or allocated it in the meantime */
+		atomic_inc(&l2->pin);
+	} else if (le64_to_cpu(img->l1[idx]) != l1e) {
+		/* Allocated, written back and evicted in the meantime */
+		up_write(&img->lock);
+		vfree(new);
+		goto again;
+	} else {
+		if (l1e == 0) {
+			new->offset = vdisk_cow_reserve_cluster(img);
+			img->l1[idx] = cpu_to_le64(new->offset);
+			img->l1_dirty = true;
+			vdisk_cow_l2_set_dirty(img, new);
+		}
+		img->l2[idx] = new;
+		list_add_tail(&new->lru_list_entry, &img->l2_lru_list);
+		img->l2_cached++;
+		vdisk_cow_evict_l2(img);
+		l2 = new;
+		new = NULL;
+	}
 
-out_free_name:
-	kfree(name);
+	up_write(&img->lock);
 
-out_vfree:
-	vfree(buf);
+out_free:
+	vfree(new);
 
 out:
-	TRACE_EXIT_RES(res);
+	*res_l2 = l2;
 	return res;
 }
 
-static int vdev_restore_wt(struct scst_vdisk_dev *virt_dev, unsigned int val)
+/* Returns in *entry the L2 entry mapping @off */
+static int vdisk_cow_lookup(struct vdisk_cow_image *img, loff_t off,
+	u64 *entry)
 {
-	int res;
+	unsigned int idx = vdisk_cow_l1_idx(img, off);
+	struct vdisk_cow_l2 *l2;
+	loff_t l1e;
+	int res = 0;
 
-	TRACE_ENTRY();
+	/* Fast path: the table is cached or doesn't exist */
+	down_read(&img->lock);
+	l2 = vdisk_cow_find_l2(img, idx);
+	if (l2 != NULL)
+		*entry = le64_to_cpu(l2->entries[vdisk_cow_l2_idx(img, off)]);
+	l1e = le64_to_cpu(img->l1[idx]);
+	up_read(&img->lock);
 
-	if (val > 1) {
-		PRINT_ERROR("Invalid value %d for parameter %s (device %s)",
-			val, VDEV_WT_LABEL, virt_dev->name);
-		res = -EINVAL;
+	if (l2 != NULL)
+		goto out;
+	if (l1e == 0) {
+		*entry = VDISK_COW_UNALLOCATED;
 		goto out;
 	}
 
-	virt_dev->wt_flag = val;
-	virt_dev->wt_flag_saved = val;
-
-	PRINT_INFO("WT_FLAG restored to %d for vdev %s", virt_dev->wt_flag,
-		virt_dev->name);
+	res = vdisk_cow_get_l2(img, off, false, &l2);
+	if (res != 0)
+		goto out;
 
-	res = 0;
+	if (l2 != NULL) {
+		down_read(&img->lock);
+		*entry = le64_to_cpu(l2->entries[vdisk_cow_l2_idx(img, off)]);
+		up_read(&img->lock);
+		vdisk_cow_put_l2(l2);
+	} else
+		*entry = VDISK_COW_UNALLOCATED;
 
 out:
-	TRACE_EXIT_RES(res);
 	return res;
 }
 
-/* Params are NULL-terminated */
-static int __vdev_load_mode_pages(struct scst_vdisk_dev *virt_dev, char *params)
+static void vdisk_cow_punch_cluster(struct vdisk_cow_image *img, loff_t off)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
+	struct file *fd = img->fd;
+	int rc;
+
+	if (fd->f_op->fallocate == NULL)
+		return;
+
+	/* Only to return the space, the cluster is not referenced anymore */
+	rc = fd->f_op->fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		off, 1 << img->cluster_shift);
+	if (rc != 0)
+		TRACE_DBG("Punching cluster %lld of %s failed: %d",
+			(long long)off, img->filename, rc);
+#endif
+	return;
+}
+
+/* Reads @len bytes at @off as seen through @img and its parents */
+static int vdisk_cow_read(struct vdisk_cow_image *img, void *buf,
+	size_t len, loff_t off)
 {
+	size_t cluster_size = 1 << img->cluster_shift;
 	int res = 0;
-	char *param, *p, *pp;
-	unsigned long val;
 
-	TRACE_ENTRY();
+	while (len > 0) {
+		loff_t cluster_off;
+		size_t n;
+		u64 entry;
 
-	while (1) {
-		param = scst_get_next_token_str(&params);
-		if (param == NULL)
+		if (off >= img->size) {
+			/* The parent can be smaller than its children */
+			memset(buf, 0, len);
 			break;
+		}
 
-		p = scst_get_next_lexem(&param);
-		if (*p == '\0')
-			break;
+		n = min_t(loff_t, len, img->size - off);
 
-		pp = scst_get_next_lexem(&param);
-		if (*pp == '\0')
-			goto out_need_param;
+		if (img->raw) {
+			res = vdisk_file_rw_sync(img->fd, buf, n, off, false);
+			if (res != 0)
+				goto out;
+			goto next;
+		}
 
-		if (scst_get_next_lexem(&param)[0] != '\0')
-			goto out_too_many;
+		cluster_off = off & (cluster_size - 1);
+		n = min_t(size_t, n, cluster_size - cluster_off);
 
-		res = kstrtoul(pp, 0, &val);
+		res = vdisk_cow_lookup(img, off, &entry);
 		if (res != 0)
-			goto out_strtoul_failed;
+			goto out;
 
-		if (strcasecmp(VDEV_WT_LABEL, p) == 0)
-			res = vdev_restore_wt(virt_dev, val);
-		else {
-			TRACE_DBG("Unknown parameter %s", p);
-			res = -EINVAL;
-		}
+		if (entry > VDISK_COW_ZERO)
+			res = vdisk_file_rw_sync(img->fd, buf, n,
+				entry + cluster_off, false);
+		else if ((entry == VDISK_COW_UNALLOCATED) && (img->parent != NULL))
+			res = vdisk_cow_read(img->parent, buf, n, off);
+		else
+			memset(buf, 0, n);
 		if (res != 0)
-			break;
+			goto out;
+
+next:
+		buf += n;
+		off += n;
+		len -= n;
 	}
 
 out:
-	TRACE_EXIT_RES(res);
 	return res;
+}
 
-out_strtoul_failed:
-	PRINT_ERROR("strtoul() for %s failed: %d (device %s)", pp, res,
-		virt_dev->name);
-	goto out;
+/*
+ * Writes @len bytes at @off to the top image @img. Clusters not allocated
+ * yet are allocated, copying up the not overwritten parts of them from the
+ * parents. Sets *allocated if the mapping changed.
+ */
+static int vdisk_cow_write(struct vdisk_cow_image *img, const void *buf,
+	size_t len, loff_t off, bool *allocated)
+{
+	size_t cluster_size = 1 << img->cluster_shift;
+	void *cluster_buf = NULL;
+	int res = 0;
 
-out_need_param:
-	PRINT_ERROR("Parameter %s value missed for device %s", p, virt_dev->name);
-	res = -EINVAL;
-	goto out;
+	EXTRACHECKS_BUG_ON(img->read_only);
 
-out_too_many:
-	PRINT_ERROR("Too many parameter's %s values (device %s)", p, virt_dev->name);
-	res = -EINVAL;
-	goto out;
-}
+	while (len > 0) {
+		loff_t cluster_off = off & (cluster_size - 1);
+		size_t n = min_t(size_t, len, cluster_size - cluster_off);
+		struct vdisk_cow_l2 *l2;
+		const void *data;
+		loff_t new;
+		__le64 *e;
+		u64 entry;
 
-static int vdev_load_mode_pages(struct scst_vdisk_dev *virt_dev)
-{
-	int res;
-	struct scst_device *dev = virt_dev->dev;
-	uint8_t *buf;
-	int size;
-	char *name, *name1, *params;
+		res = vdisk_cow_get_l2(img, off, true, &l2);
+		if (res != 0)
+			goto out;
+		/* Pinned, so stays in memory */
+		e = &l2->entries[vdisk_cow_l2_idx(img, off)];
 
-	TRACE_ENTRY();
+		down_read(&img->lock);
+		entry = le64_to_cpu(*e);
+		up_read(&img->lock);
 
-	size = VDEV_MODE_PAGES_BUF_SIZE;
+		if (entry > VDISK_COW_ZERO) {
+			vdisk_cow_put_l2(l2);
+			res = vdisk_file_rw_sync(img->fd, (void *)buf, n,
+				entry + cluster_off, true);
+			if (res != 0)
+				goto out;
+			goto next;
+		}
 
-	buf = vzalloc(size);
-	if (buf == NULL) {
-		PRINT_ERROR("Unable to alloc mode pages buffer (size %d)", size);
-		res = -ENOMEM;
-		goto out;
-	}
+		if (n != cluster_size) {
+			/*
+			 * Copy up without img->lock held. Parents are
+			 * immutable, so only the entry must be rechecked.
+			 */
+			if (cluster_buf == NULL) {
+				cluster_buf = vmalloc(cluster_size);
+				if (cluster_buf == NULL) {
+					res = -ENOMEM;
+					goto out_put;
+				}
+			}
+			if ((entry == VDISK_COW_UNALLOCATED) && (img->parent != NULL))
+				res = vdisk_cow_read(img->parent, cluster_buf,
+					cluster_size, off - cluster_off);
+			else
+				memset(cluster_buf, 0, cluster_size);
+			if (res != 0)
+				goto out_put;
+			memcpy(cluster_buf + cluster_off, buf, n);
+			data = cluster_buf;
+		} else
+			data = buf;
+
+		/* Write the new cluster without img->lock held as well */
+		new = vdisk_cow_reserve_cluster(img);
+		res = vdisk_file_rw_sync(img->fd, (void *)data, cluster_size,
+			new, true);
+		if (res != 0)
+			goto out_put;
 
-	name = kasprintf(GFP_KERNEL, "%s/%s", VDEV_MODE_PAGES_DIR, virt_dev->name);
-	if (name == NULL) {
-		PRINT_ERROR("Unable to create name %s/%s", VDEV_MODE_PAGES_DIR,
-			virt_dev->name);
-		res = -ENOMEM;
-		goto out_vfree;
-	}
+		down_write(&img->lock);
 
-	name1 = kasprintf(GFP_KERNEL, "%s/%s1", VDEV_MODE_PAGES_DIR, virt_dev->name);
-	if (name1 == NULL) {
-		PRINT_ERROR("Unable to create name %s/%s1", VDEV_MODE_PAGES_DIR,
-			virt_dev->name);
-		res = -ENOMEM;
-		goto out_free_name;
-	}
+		if (unlikely(le64_to_cpu(*e) != entry)) {
+			/* Raced with another writer or deallocation */
+			up_write(&img->lock);
+			vdisk_cow_put_l2(l2);
+			vdisk_cow_punch_cluster(img, new);
+			continue;
+		}
 
-	size = scst_read_file_transactional(name, name1,
-			virt_dev->name, strlen(virt_dev->name), buf, size-1);
-	if (size <= 0) {
-		res = size;
-		goto out_free_name1;
+		*e = cpu_to_le64(new);
+		vdisk_cow_l2_set_dirty(img, l2);
+		*allocated = true;
+
+		up_write(&img->lock);
+		vdisk_cow_put_l2(l2);
+
+next:
+		buf += n;
+		off += n;
+		len -= n;
 	}
 
-	buf[size-1] = '\0';
+out:
+	vfree(cluster_buf);
+	return res;
 
-	res = scst_restore_global_mode_pages(dev, &buf[strlen(virt_dev->name)+1],
-				&params);
-	if ((res != 0) || (params == NULL))
-		goto out_free_name1;
+out_put:
+	vdisk_cow_put_l2(l2);
+	goto out;
+}
 
-	res = __vdev_load_mode_pages(virt_dev, params);
+/*
+ * Deallocates [off, off + len) of the top image @img. Whole clusters are
+ * only unmapped, partial ones are overwritten by zeroes. Sets *dirty if the
+ * mapping changed.
+ */
+static int vdisk_cow_discard(struct vdisk_cow_image *img, loff_t off,
+	loff_t len, bool *dirty)
+{
+	size_t cluster_size = 1 << img->cluster_shift;
+	/* Deallocated clusters must not be looked up in the parent */
+	u64 new = img->parent ? VDISK_COW_ZERO : VDISK_COW_UNALLOCATED;
+	void *zero_buf = NULL;
+	int res = 0;
 
-out_free_name1:
-	kfree(name1);
+	EXTRACHECKS_BUG_ON(img->read_only);
 
-out_free_name:
-	kfree(name);
+	while (len > 0) {
+		loff_t cluster_off = off & (cluster_size - 1);
+		size_t n = min_t(loff_t, len, cluster_size - cluster_off);
+		struct vdisk_cow_l2 *l2;
+		__le64 *e;
+		u64 entry;
 
-out_vfree:
-	vfree(buf);
+		if (n != cluster_size) {
+			if (zero_buf == NULL) {
+				zero_buf = vzalloc(cluster_size);
+				if (zero_buf == NULL) {
+					res = -ENOMEM;
+					goto out;
+				}
+			}
+			res = vdisk_cow_write(img, zero_buf, n, off, dirty);
+			if (res != 0)
+				goto out;
+			goto next;
+		}
+
+		res = vdisk_cow_get_l2(img, off, img->parent != NULL, &l2);
+		if (res != 0)
+			goto out;
+		if (l2 == NULL) {
+			/* No L2 table and no parent, nothing to deallocate */
+			goto next;
+		}
+
+		down_write(&img->lock);
+		e = &l2->entries[vdisk_cow_l2_idx(img, off)];
+		entry = le64_to_cpu(*e);
+		if (entry != new) {
+			*e = cpu_to_le64(new);
+			vdisk_cow_l2_set_dirty(img, l2);
+			*dirty = true;
+		}
+		up_write(&img->lock);
+
+		vdisk_cow_put_l2(l2);
+
+		if (entry > VDISK_COW_ZERO)
+			vdisk_cow_punch_cluster(img, entry);
+
+next:
+		off += n;
+		len -= n;
+	}
 
 out:
-	TRACE_EXIT_RES(res);
+	vfree(zero_buf);
 	return res;
 }
 
-#if defined(CONFIG_BLK_DEV_INTEGRITY)
-static int vdisk_init_block_integrity(struct scst_vdisk_dev *virt_dev)
+/*
+ * Writes back the metadata of @img. img->lock is held only to take
+ * snapshots of the dirty tables, all I/O and fsync()'s are done on the
+ * snapshots without it.
+ */
+static int vdisk_cow_flush(struct vdisk_cow_image *img)
 {
+	size_t cluster_size = 1 << img->cluster_shift;
+	struct vdisk_cow_l2 *l2, *t;
+	LIST_HEAD(flush_list);
+	bool l1_dirty;
 	int res;
-	struct scst_device *dev = virt_dev->dev;
-	struct inode *inode;
-	struct file *fd;
-	struct blk_integrity *bi;
-	const char *bi_profile_name;
 
 	TRACE_ENTRY();
 
-	fd = vdev_open_fd(virt_dev, virt_dev->filename, virt_dev->rd_only);
-	if (IS_ERR(fd)) {
-		res = -EINVAL;
+	if (img->read_only) {
+		res = 0;
 		goto out;
 	}
 
-	inode = file_inode(fd);
+	mutex_lock(&img->flush_mutex);
 
-	if (!S_ISBLK(inode->i_mode)) {
-		PRINT_ERROR("%s is NOT a block device!", virt_dev->filename);
-		res = -EINVAL;
-		goto out_close;
+	/*
+	 * Tables modified after this point are dirtied again and written
+	 * by the next flush. The L1 snapshot refers only to tables, which
+	 * are either already on disk or in flush_list.
+	 */
+	down_write(&img->lock);
+	list_for_each_entry_safe(l2, t, &img->dirty_l2_list, dirty_list_entry) {
+		list_del_init(&l2->dirty_list_entry);
+		list_add_tail(&l2->flush_list_entry, &flush_list);
+		atomic_inc(&l2->pin);
+	}
+	l1_dirty = img->l1_dirty;
+	img->l1_dirty = false;
+	if (l1_dirty)
+		memcpy(img->l1_snap, img->l1,
+			img->l1_entries * sizeof(*img->l1));
+	up_write(&img->lock);
+
+	/*
+	 * Entries are set only after their data clusters are written, so
+	 * snapshots taken before the data fsync() never refer to unwritten
+	 * clusters.
+	 */
+	res = 0;
+	list_for_each_entry(l2, &flush_list, flush_list_entry) {
+		l2->flush_entries = vmalloc(cluster_size);
+		if (l2->flush_entries == NULL) {
+			res = -ENOMEM;
+			goto out_redirty;
+		}
+		down_read(&img->lock);
+		memcpy(l2->flush_entries, l2->entries, cluster_size);
+		up_read(&img->lock);
 	}
 
-	bi = bdev_get_integrity(inode->i_bdev);
-	if (bi == NULL) {
-		TRACE_DBG("Block integrity not supported");
-		goto out_no_bi;
-	}
+	/* Data first, so the mapping never refers to unwritten clusters */
+	res = vfs_fsync(img->fd, 0);
+	if ((res != 0) || (list_empty(&flush_list) && !l1_dirty))
+		goto out_redirty;
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
-	bi_profile_name = bi->name;
-#else
-	bi_profile_name = bi->profile->name;
-#endif
-	TRACE_DBG("BI name %s", bi_profile_name);
+	list_for_each_entry(l2, &flush_list, flush_list_entry) {
+		res = vdisk_file_rw_sync(img->fd, l2->flush_entries,
+			cluster_size, l2->offset, true);
+		if (res != 0)
+			goto out_redirty;
+	}
 
-	if (!strcmp(bi_profile_name, "T10-DIF-TYPE1-CRC")) {
-		dev->dev_dif_ip_not_supported = 1;
-		if (virt_dev->dif_type != 1) {
-			PRINT_ERROR("Integrity type mismatch, %d expected, "
-				"but block device has 1 (dev %s)",
-				virt_dev->dif_type, dev->virt_name);
-			res = -EINVAL;
-			goto out_close;
-		}
-	} else if (!strcmp(bi_profile_name, "T10-DIF-TYPE1-IP")) {
-		if (virt_dev->dif_type != 1) {
-			PRINT_ERROR("Integrity type mismatch, %d expected, "
-				"but block device has 1 (dev %s)",
-				virt_dev->dif_type, dev->virt_name);
-			res = -EINVAL;
-			goto out_close;
-		}
-	} else if (!strcmp(bi_profile_name, "T10-DIF-TYPE3-CRC")) {
-		dev->dev_dif_ip_not_supported = 1;
-		if (virt_dev->dif_type != 3) {
-			PRINT_ERROR("Integrity type mismatch, %d expected, "
-				"but block device has 1 (dev %s)",
-				virt_dev->dif_type, dev->virt_name);
-			res = -EINVAL;
-			goto out_close;
-		}
-	} else if (!strcmp(bi_profile_name, "T10-DIF-TYPE3-IP")) {
-		if (virt_dev->dif_type != 3) {
-			PRINT_ERROR("Integrity type mismatch, %d expected, "
-				"but block device has 3 (dev %s)",
-				virt_dev->dif_type, dev->virt_name);
-			res = -EINVAL;
-			goto out_close;
-		}
-	} else {
-		PRINT_ERROR("Unable to understand integrity name %s"
-			"(dev %s)", bi_profile_name, dev->virt_name);
-		res = -EINVAL;
-		goto out_close;
+	if (l1_dirty) {
+		res = vfs_fsync(img->fd, 1);
+		if (res != 0)
+			goto out_redirty;
+		res = vdisk_file_rw_sync(img->fd, img->l1_snap,
+			img->l1_entries * sizeof(*img->l1), img->l1_offset, true);
+		if (res != 0)
+			goto out_redirty;
 	}
 
-	virt_dev->blk_integrity = 1;
+	res = vfs_fsync(img->fd, 1);
 
-	if ((virt_dev->dif_mode & SCST_DIF_MODE_DEV_CHECK) &&
-	    !(virt_dev->dif_mode & SCST_DIF_MODE_DEV_STORE)) {
-		PRINT_ERROR("Blockio dev_check is not possible without "
-			"dev_store (dev %s)", dev->virt_name);
-		res = -EINVAL;
-		goto out_close;
+out_redirty:
+	if ((res != 0) || !list_empty(&flush_list)) {
+		down_write(&img->lock);
+		list_for_each_entry_safe(l2, t, &flush_list, flush_list_entry) {
+			list_del(&l2->flush_list_entry);
+			vfree(l2->flush_entries);
+			l2->flush_entries = NULL;
+			/* Retried by the next flush */
+			if (res != 0)
+				vdisk_cow_l2_set_dirty(img, l2);
+			atomic_dec(&l2->pin);
+		}
+		if ((res != 0) && l1_dirty)
+			img->l1_dirty = true;
+		vdisk_cow_evict_l2(img);
+		up_write(&img->lock);
 	}
 
-	if (!(virt_dev->dif_mode & SCST_DIF_MODE_DEV_CHECK))
-		PRINT_WARNING("Blk integrity implies dev_check (dev %s)",
-			dev->virt_name);
-
-out_no_bi:
-	res = 0;
+	mutex_unlock(&img->flush_mutex);
 
-out_close:
-	filp_close(fd, NULL);
+	if (res != 0)
+		PRINT_ERROR("Flushing COW image %s failed: %d", img->filename,
+			res);
 
 out:
 	TRACE_EXIT_RES(res);
 	return res;
 }
-#else /* defined(CONFIG_BLK_DEV_INTEGRITY) */
-static int vdisk_init_block_integrity(struct scst_vdisk_dev *virt_dev)
+
+static void vdisk_cow_flush_work_fn(struct work_struct *work)
 {
-	PRINT_ERROR("Kernel does not support block device integrity");
-	return -EINVAL;
+	struct vdisk_cow_image *img = container_of(work,
+		struct vdisk_cow_image, flush_work.work);
+
+	vdisk_cow_flush(img);
+	return;
 }
-#endif /* defined(CONFIG_BLK_DEV_INTEGRITY) */
 
-/*
- * Reexamine size, flush support and thin provisioning support for
- * vdisk_fileio, vdisk_blockio and vdisk_cdrom devices. Do not modify the size
- * of vdisk_nullio devices.
- */
-static int vdisk_reexamine(struct scst_vdisk_dev *virt_dev)
+/* Called after the mapping of the top image of virt_dev changed */
+static int vdisk_cow_mapping_changed(struct scst_vdisk_dev *virt_dev)
 {
+	struct vdisk_cow_image *img = virt_dev->cow_img;
 	int res = 0;
 
-	if (!virt_dev->nullio && !virt_dev->cdrom_empty) {
-		loff_t file_size;
+	if (virt_dev->wt_flag && !virt_dev->nv_cache)
+		res = vdisk_cow_flush(img);
+	else
+		schedule_delayed_work(&img->flush_work, VDISK_COW_FLUSH_DELAY);
 
-		res = vdisk_get_file_size(virt_dev->filename, virt_dev->blockio,
-					  &file_size);
-		if (res < 0) {
-			if ((res == -EMEDIUMTYPE) && virt_dev->blockio) {
-				TRACE_DBG("Reexam pending (dev %s)", virt_dev->name);
-				virt_dev->reexam_pending = 1;
-				res = 0;
-			}
-			goto out;
-		}
-		virt_dev->file_size = file_size;
-		vdisk_blockio_check_flush_support(virt_dev);
-		vdisk_check_tp_support(virt_dev);
-	} else if (virt_dev->cdrom_empty) {
-		virt_dev->file_size = 0;
+	return res;
+}
+
+/* Frees @img and its parents without writing back anything */
+static void vdisk_cow_release_image(struct vdisk_cow_image *img)
+{
+	unsigned int i;
+
+	if (img->parent != NULL)
+		vdisk_cow_release_image(img->parent);
+
+	if (img->l2 != NULL) {
+		for (i = 0; i < img->l1_entries; i++)
+			vfree(img->l2[i]);
+		vfree(img->l2);
 	}
+	vfree(img->l1);
+	vfree(img->l1_snap);
 
-	virt_dev->nblocks = virt_dev->file_size >> virt_dev->blk_shift;
+	if (img->fd_owned)
+		filp_close(img->fd, NULL);
 
-out:
-	return res;
+	kfree(img->filename);
+	kfree(img);
+	return;
 }
 
-static int vdisk_attach(struct scst_device *dev)
+/*
+ * Opens COW image @filename and its parents. If @fd isn't NULL, it's used
+ * to access the image and remains owned by the caller. @depth is the
+ * position of the image in the chain. Returns the image or ERR_PTR().
+ */
+static struct vdisk_cow_image *vdisk_cow_open_image(const char *filename,
+	struct file *fd, bool read_only, int depth)
 {
-	int res = 0;
-	struct scst_vdisk_dev *virt_dev;
+	struct vdisk_cow_image *img;
+	struct vdisk_cow_header *hdr = NULL;
+	size_t cluster_size, l1_size;
+	u64 l1_entries;
+	int res;
 
 	TRACE_ENTRY();
 
-	TRACE_DBG("virt_id %d (%s)", dev->virt_id, dev->virt_name);
+	img = kzalloc(sizeof(*img), GFP_KERNEL);
+	if (img == NULL) {
+		res = -ENOMEM;
+		goto out_err;
+	}
 
-	if (dev->virt_id == 0) {
-		PRINT_ERROR("%s", "Not a virtual device");
-		res = -EINVAL;
-		goto out;
+	init_rwsem(&img->lock);
+	INIT_LIST_HEAD(&img->l2_lru_list);
+	INIT_LIST_HEAD(&img->dirty_l2_list);
+	spin_lock_init(&img->alloc_lock);
+	mutex_init(&img->flush_mutex);
+	INIT_DELAYED_WORK(&img->flush_work, vdisk_cow_flush_work_fn);
+	img->read_only = read_only;
+
+	img->filename = kstrdup(filename, GFP_KERNEL);
+	hdr = kmalloc(sizeof(*hdr), GFP_KERNEL);
+	if ((img->filename == NULL) || (hdr == NULL)) {
+		res = -ENOMEM;
+		goto out_release;
 	}
 
-	/*
-	 * scst_vdisk_mutex must be already taken before
-	 * scst_register_virtual_device()
-	 */
-	virt_dev = vdev_find(dev->virt_name);
-	if (virt_dev == NULL) {
-		PRINT_ERROR("Device %s not found", dev->virt_name);
-		res = -EINVAL;
-		goto out;
+	if (fd == NULL) {
+		fd = filp_open(filename, O_LARGEFILE |
+			(read_only ? O_RDONLY : O_RDWR), 0600);
+		if (IS_ERR(fd)) {
+			res = PTR_ERR(fd);
+			PRINT_ERROR("filp_open(%s) failed: %d", filename, res);
+			goto out_release;
+		}
+		img->fd_owned = 1;
 	}
+	img->fd = fd;
 
-	virt_dev->dev = dev;
+	res = vdisk_file_rw_sync(fd, hdr, sizeof(*hdr), 0, false);
+	if (res != 0) {
+		PRINT_ERROR("Reading header of %s failed: %d", filename, res);
+		goto out_release;
+	}
 
-	dev->block_shift = virt_dev->blk_shift;
-	dev->block_size = 1 << dev->block_shift;
-	dev->cluster_mode = virt_dev->initial_cluster_mode;
+	if (le64_to_cpu(hdr->magic) != VDISK_COW_MAGIC) {
+		if (depth == 0) {
+			PRINT_ERROR("%s is not a COW image", filename);
+			res = -EINVAL;
+			goto out_release;
+		}
+		/* Plain image file at the bottom of the chain */
+		img->raw = 1;
+		img->size = i_size_read(fd->f_mapping->host);
+		goto out;
+	}
 
-	if ((virt_dev->dif_type == 0) &&
-	    ((virt_dev->dif_mode != SCST_DIF_MODE_NONE) ||
-	     (virt_dev->dif_filename != NULL))) {
-		PRINT_ERROR("Device %s cannot have DIF TYPE 0 if DIF MODE is "
-			"not NONE or DIF FILENAME is not NULL", virt_dev->name);
+	img->cluster_shift = le32_to_cpu(hdr->cluster_shift);
+	img->size = le64_to_cpu(hdr->size);
+	img->l1_offset = le64_to_cpu(hdr->l1_offset);
+	l1_entries = le32_to_cpu(hdr->l1_entries);
+	if ((le32_to_cpu(hdr->version) != VDISK_COW_VERSION) ||
+	    (img->cluster_shift < VDISK_COW_MIN_CLUSTER_SHIFT) ||
+	    (img->cluster_shift > VDISK_COW_MAX_CLUSTER_SHIFT) ||
+	    (img->size <= 0) ||
+	    (l1_entries != ((img->size - 1) >> (2 * img->cluster_shift - 3)) + 1) ||
+	    (img->l1_offset < (1 << img->cluster_shift))) {
+		PRINT_ERROR("Invalid or unsupported COW image %s", filename);
 		res = -EINVAL;
-		goto out;
+		goto out_release;
 	}
 
-	if (virt_dev->blockio) {
-		if (!(virt_dev->dif_mode & SCST_DIF_MODE_DEV))
-			goto next;
+	cluster_size = 1 << img->cluster_shift;
+	img->l1_entries = l1_entries;
+	img->l2_max_cached = max(VDISK_COW_L2_CACHE_SIZE >> img->cluster_shift,
+				 VDISK_COW_MIN_L2_CACHED);
+	l1_size = l1_entries * sizeof(*img->l1);
 
-		res = vdisk_init_block_integrity(virt_dev);
-		if (res != 0)
-			goto out;
-	} else if (virt_dev->dif_mode & SCST_DIF_MODE_DEV_CHECK) {
-		PRINT_ERROR("dev_check supported only for BLOCKIO devices "
-			"(dev %s)!", dev->virt_name);
-		res = -EINVAL;
-		goto out;
+	img->l1 = vmalloc(l1_size);
+	img->l2 = vzalloc(l1_entries * sizeof(*img->l2));
+	if (!read_only)
+		img->l1_snap = vmalloc(l1_size);
+	if ((img->l1 == NULL) || (img->l2 == NULL) ||
+	    (!read_only && (img->l1_snap == NULL))) {
+		res = -ENOMEM;
+		goto out_release;
 	}
 
-next:
-	if ((virt_dev->dif_mode & SCST_DIF_MODE_DEV_STORE) &&
-	    (virt_dev->dif_filename == NULL) && !virt_dev->blk_integrity) {
-		virt_dev->dif_filename = kasprintf(GFP_KERNEL,
-				DEF_DIF_FILENAME_TMPL, dev->virt_name);
-		if (virt_dev->dif_filename == NULL) {
-			PRINT_ERROR("Allocation of default dif_filename "
-				"failed (dev %s)", dev->virt_name);
-			res = -ENOMEM;
-			goto out;
-		}
+	res = vdisk_file_rw_sync(fd, img->l1, l1_size, img->l1_offset, false);
+	if (res != 0) {
+		PRINT_ERROR("Reading L1 table of %s failed: %d", filename, res);
+		goto out_release;
 	}
 
-	if (virt_dev->dif_filename != NULL) {
-		/* Check if it can be used */
-		struct file *dfd = vdev_open_fd(virt_dev, virt_dev->dif_filename,
-					virt_dev->rd_only);
-		if (IS_ERR(dfd)) {
-			res = PTR_ERR(dfd);
-			goto out;
+	img->next_free = max_t(loff_t,
+		ALIGN(i_size_read(file_inode(fd)), (loff_t)cluster_size),
+		ALIGN(img->l1_offset + l1_size, (loff_t)cluster_size));
+
+	if (hdr->parent[0] != '\0') {
+		hdr->parent[sizeof(hdr->parent) - 1] = '\0';
+		if (depth + 1 >= VDISK_COW_MAX_CHAIN) {
+			PRINT_ERROR("Too long chain of COW images at %s",
+				filename);
+			res = -ELOOP;
+			goto out_release;
+		}
+		img->parent = vdisk_cow_open_image(hdr->parent, NULL, true,
+					depth + 1);
+		if (IS_ERR(img->parent)) {
+			res = PTR_ERR(img->parent);
+			img->parent = NULL;
+			goto out_release;
 		}
-		filp_close(dfd, NULL);
 	}
 
-	res = scst_set_dif_params(dev, virt_dev->dif_mode, virt_dev->dif_type);
-	if (res != 0)
+	TRACE_DBG("Opened COW image %s (size %lld, cluster shift %d, "
+		"parent %s)", filename, (long long)img->size,
+		img->cluster_shift, img->parent ? img->parent->filename : "none");
+
+out:
+	kfree(hdr);
+	TRACE_EXIT();
+	return img;
+
+out_release:
+	vdisk_cow_release_image(img);
+
+out_err:
+	img = ERR_PTR(res);
+	goto out;
+}
+
+/* Writes back the metadata of @img and frees it with its parents */
+static void vdisk_cow_close_image(struct vdisk_cow_image *img)
+{
+	cancel_delayed_work_sync(&img->flush_work);
+	vdisk_cow_flush(img);
+	vdisk_cow_release_image(img);
+	return;
+}
+
+/* Switches the top image to @fd, reopened by vdisk_set_wt() */
+static void vdisk_cow_set_fd(struct vdisk_cow_image *img, struct file *fd)
+{
+	/* Flushes use the fd without img->lock held */
+	mutex_lock(&img->flush_mutex);
+	down_write(&img->lock);
+	img->fd = fd;
+	up_write(&img->lock);
+	mutex_unlock(&img->flush_mutex);
+	return;
+}
+
+/*
+ * Returns 0 on success and in *size the size of COW image @filename or, if
+ * @raw_allowed, of a plain image file. Error code otherwise.
+ */
+static int vdisk_cow_get_size(const char *filename, bool raw_allowed,
+	loff_t *size)
+{
+	struct vdisk_cow_header *hdr;
+	struct file *fd;
+	int res;
+
+	TRACE_ENTRY();
+
+	hdr = kmalloc(sizeof(*hdr), GFP_KERNEL);
+	if (hdr == NULL) {
+		res = -ENOMEM;
 		goto out;
+	}
 
-	if (virt_dev->dif_type != 2)
-		scst_dev_set_dif_static_app_tag_combined(dev,
-			virt_dev->dif_static_app_tag_combined);
-	else if (virt_dev->dif_static_app_tag_combined != SCST_DIF_NO_CHECK_APP_TAG)
-		PRINT_WARNING("Device %s: static app tag is ignored for DIF "
-			"mode 2", dev->virt_name);
+	fd = filp_open(filename, O_LARGEFILE | O_RDONLY, 0600);
+	if (IS_ERR(fd)) {
+		res = PTR_ERR(fd);
+		PRINT_ERROR("filp_open(%s) failed: %d", filename, res);
+		goto out_free;
+	}
 
-#ifndef CONFIG_SCST_PROC
-	if (virt_dev->dif_filename != NULL) {
-		res = scst_create_dev_attr(dev, &vdev_dif_filename_attr);
-		if (res != 0) {
-			PRINT_ERROR("Can't create attr %s for dev %s",
-				vdev_dif_filename_attr.attr.name,
-				dev->virt_name);
-			goto out;
-		}
+	res = vdisk_file_rw_sync(fd, hdr, sizeof(*hdr), 0, false);
+	if (res != 0) {
+		PRINT_ERROR("Reading header of %s failed: %d", filename, res);
+		goto out_close;
 	}
-#endif
 
-	if (virt_dev->zero_copy && virt_dev->o_direct_flag) {
-		PRINT_ERROR("%s: combining zero_copy with o_direct is not"
-			    " supported", virt_dev->filename);
+	if (le64_to_cpu(hdr->magic) == VDISK_COW_MAGIC)
+		*size = le64_to_cpu(hdr->size);
+	else if (raw_allowed)
+		*size = i_size_read(fd->f_mapping->host);
+	else {
+		PRINT_ERROR("%s is not a COW image", filename);
 		res = -EINVAL;
-		goto out;
 	}
 
-	dev->dev_rd_only = virt_dev->rd_only;
+out_close:
+	filp_close(fd, NULL);
 
-	res = vdisk_reexamine(virt_dev);
-	if (res < 0)
-		goto out;
-
-	if (!virt_dev->cdrom_empty) {
-		PRINT_INFO("Attached SCSI target virtual %s %s "
-		      "(file=\"%s\", fs=%lldMB, bs=%d, nblocks=%lld,"
-		      " cyln=%lld%s)",
-		      (dev->type == TYPE_DISK) ? "disk" : "cdrom",
-		      virt_dev->name, vdev_get_filename(virt_dev),
-		      virt_dev->file_size >> 20, dev->block_size,
-		      (unsigned long long int)virt_dev->nblocks,
-		      (unsigned long long int)virt_dev->nblocks/64/32,
-		      virt_dev->nblocks < 64*32
-		      ? " !WARNING! cyln less than 1" : "");
-	} else {
-		PRINT_INFO("Attached empty SCSI target virtual cdrom %s",
-			virt_dev->name);
-	}
-
-	dev->dh_priv = virt_dev;
-
-	dev->tst = virt_dev->tst;
-	dev->tmf_only = DEF_TMF_ONLY;
-	dev->tmf_only_saved = DEF_TMF_ONLY;
-	dev->tmf_only_default = DEF_TMF_ONLY;
-	dev->d_sense = DEF_DSENSE;
-	dev->d_sense_saved = DEF_DSENSE;
-	dev->d_sense_default = DEF_DSENSE;
-	if (virt_dev->wt_flag && !virt_dev->nv_cache)
-		dev->queue_alg = DEF_QUEUE_ALG_WT;
-	else
-		dev->queue_alg = DEF_QUEUE_ALG;
-	dev->queue_alg_saved = dev->queue_alg;
-	dev->queue_alg_default = dev->queue_alg;
-	dev->qerr = DEF_QERR;
-	dev->qerr_saved = DEF_QERR;
-	dev->qerr_default = DEF_QERR;
-	dev->swp = DEF_SWP;
-	dev->swp_saved = DEF_SWP;
-	dev->swp_default = DEF_SWP;
-	dev->tas = DEF_TAS;
-	dev->tas_saved = DEF_TAS;
-	dev->tas_default = DEF_TAS;
-	dev->dpicz = DEF_DPICZ;
-	dev->dpicz_saved = DEF_DPICZ;
-	dev->dpicz_default = DEF_DPICZ;
-	if ((virt_dev->dif_filename == NULL) && !virt_dev->blk_integrity)
-		dev->ato = SCST_ATO_0_MODIFIED_BY_STORAGE;
-	else
-		dev->ato = SCST_ATO_1_NOT_MODIFIED_BY_STORAGE;
-
-	if (vdev_saved_mode_pages_enabled)
-		vdev_load_mode_pages(virt_dev);
-
-	res = scst_pr_set_cluster_mode(dev, dev->cluster_mode,
-				       virt_dev->t10_dev_id);
+out_free:
+	kfree(hdr);
 
 out:
-	TRACE_EXIT();
+	TRACE_EXIT_RES(res);
 	return res;
 }
 
-/* scst_mutex supposed to be held */
-static void vdisk_detach(struct scst_device *dev)
+#ifndef CONFIG_SCST_PROC
+/*
+ * Creates a new empty COW image @filename of @size bytes on top of @parent,
+ * which can be NULL. If @size is 0, the size of the parent is used.
+ */
+static int vdisk_cow_create_image(const char *filename, loff_t size,
+	const char *parent)
 {
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	const int shift = VDISK_COW_CLUSTER_SHIFT;
+	const size_t cluster_size = 1 << shift;
+	struct vdisk_cow_header *hdr;
+	struct file *fd;
+	loff_t off, l1_end;
+	u64 l1_entries;
+	void *buf;
+	int res;
 
 	TRACE_ENTRY();
 
-	lockdep_assert_held(&scst_mutex);
+	if (parent != NULL) {
+		loff_t parent_size;
 
-	TRACE_DBG("virt_id %d", dev->virt_id);
+		if (strlen(parent) >= VDISK_COW_PARENT_LEN) {
+			PRINT_ERROR("Parent file name %s is too long", parent);
+			res = -EINVAL;
+			goto out;
+		}
+		res = vdisk_cow_get_size(parent, true, &parent_size);
+		if (res != 0)
+			goto out;
+		if (size == 0)
+			size = parent_size;
+	}
 
-	scst_pr_set_cluster_mode(dev, false, virt_dev->t10_dev_id);
+	if (size <= 0) {
+		PRINT_ERROR("Size of new COW image %s is not specified",
+			filename);
+		res = -EINVAL;
+		goto out;
+	}
 
-	PRINT_INFO("Detached virtual device %s (\"%s\")",
-		      virt_dev->name, vdev_get_filename(virt_dev));
+	buf = vzalloc(cluster_size);
+	if (buf == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
 
-	/* virt_dev will be freed by the caller */
-	dev->dh_priv = NULL;
+	l1_entries = ((size - 1) >> (2 * shift - 3)) + 1;
 
-	TRACE_EXIT();
-	return;
-}
+	hdr = buf;
+	hdr->magic = cpu_to_le64(VDISK_COW_MAGIC);
+	hdr->version = cpu_to_le32(VDISK_COW_VERSION);
+	hdr->cluster_shift = cpu_to_le32(shift);
+	hdr->size = cpu_to_le64(size);
+	hdr->l1_offset = cpu_to_le64(cluster_size);
+	hdr->l1_entries = cpu_to_le32(l1_entries);
+	if (parent != NULL)
+		strlcpy(hdr->parent, parent, sizeof(hdr->parent));
 
-static int vdisk_open_fd(struct scst_vdisk_dev *virt_dev, bool read_only)
-{
-	int res;
+	fd = filp_open(filename, O_LARGEFILE | O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (IS_ERR(fd)) {
+		res = PTR_ERR(fd);
+		PRINT_ERROR("Unable to create COW image %s: %d", filename, res);
+		goto out_free;
+	}
 
-	sBUG_ON(!virt_dev->filename);
+	res = vdisk_file_rw_sync(fd, buf, cluster_size, 0, true);
 
-	virt_dev->fd = vdev_open_fd(virt_dev, virt_dev->filename, read_only);
-	if (IS_ERR(virt_dev->fd)) {
-		res = PTR_ERR(virt_dev->fd);
-		virt_dev->fd = NULL;
-		goto out;
-	}
-	virt_dev->bdev = virt_dev->blockio ? file_inode(virt_dev->fd)->i_bdev :
-		NULL;
-	res = 0;
+	/* Empty L1 table */
+	memset(buf, 0, sizeof(*hdr));
+	l1_end = cluster_size + ALIGN(l1_entries * sizeof(__le64), cluster_size);
+	for (off = cluster_size; (res == 0) && (off < l1_end); off += cluster_size)
+		res = vdisk_file_rw_sync(fd, buf, cluster_size, off, true);
 
-	if (virt_dev->dif_filename != NULL) {
-		virt_dev->dif_fd = vdev_open_fd(virt_dev,
-			virt_dev->dif_filename, read_only);
-		if (IS_ERR(virt_dev->dif_fd)) {
-			res = PTR_ERR(virt_dev->dif_fd);
-			virt_dev->dif_fd = NULL;
-			goto out_close_fd;
-		}
-	}
+	if (res == 0)
+		res = vfs_fsync(fd, 0);
+
+	filp_close(fd, NULL);
+
+	if (res != 0)
+		PRINT_ERROR("Writing new COW image %s failed: %d", filename,
+			res);
+	else
+		PRINT_INFO("Created COW image %s (size %lld, parent %s)",
+			filename, (long long)size, parent ? parent : "none");
+
+out_free:
+	vfree(buf);
 
 out:
+	TRACE_EXIT_RES(res);
 	return res;
-
-out_close_fd:
-	filp_close(virt_dev->fd, NULL);
-	virt_dev->fd = NULL;
-	goto out;
 }
+#endif
 
-static void vdisk_close_fd(struct scst_vdisk_dev *virt_dev)
+/* READ and WRITE of COW devices. Returns 0 on success, sense set otherwise. */
+static int vdisk_cow_exec_rw(struct vdisk_cmd_params *p, bool write)
 {
-	if (virt_dev->fd) {
-		filp_close(virt_dev->fd, NULL);
-		virt_dev->fd = NULL;
-		virt_dev->bdev = NULL;
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct vdisk_cow_image *img = virt_dev->cow_img;
+	loff_t loff = p->loff;
+	bool allocated = false;
+	uint8_t *address;
+	int length, res = 0;
+
+	TRACE_ENTRY();
+
+	length = scst_get_buf_first(cmd, &address);
+	while (length > 0) {
+		if (write)
+			res = vdisk_cow_write(img, address, length, loff,
+				&allocated);
+		else
+			res = vdisk_cow_read(img, address, length, loff);
+		scst_put_buf(cmd, address);
+		if (unlikely(res != 0))
+			break;
+		loff += length;
+		length = scst_get_buf_next(cmd, &address);
 	}
-	if (virt_dev->dif_fd) {
-		filp_close(virt_dev->dif_fd, NULL);
-		virt_dev->dif_fd = NULL;
+
+	if (allocated) {
+		int rc = vdisk_cow_mapping_changed(virt_dev);
+
+		if (res == 0)
+			res = rc;
+	}
+
+	if (unlikely(length < 0)) {
+		PRINT_ERROR("scst_get_buf_() failed: %d", length);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_internal_failure));
+		res = length;
+	} else if (unlikely(res != 0)) {
+		PRINT_ERROR("%s COW device %s at %lld failed: %d",
+			write ? "Writing" : "Reading", virt_dev->name,
+			(long long)loff, res);
+		if (res == -ENOMEM)
+			scst_set_busy(cmd);
+		else if (write)
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
+		else
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_read_error));
 	}
+
+	TRACE_EXIT_RES(res);
+	return res;
 }
 
-/* Invoked with scst_mutex held, so no further locking is necessary here. */
-static int vdisk_attach_tgt(struct scst_tgt_dev *tgt_dev)
+/* Deallocates [off, off + len). Returns 0 on success, sense set otherwise. */
+static int vdisk_cow_unmap(struct scst_cmd *cmd,
+	struct scst_vdisk_dev *virt_dev, loff_t off, loff_t len)
 {
-	struct scst_vdisk_dev *virt_dev = tgt_dev->dev->dh_priv;
-	int res = 0;
+	bool dirty = false;
+	int res, rc;
 
 	TRACE_ENTRY();
 
-	lockdep_assert_held(&scst_mutex);
-
-	virt_dev->tgt_dev_cnt++;
+	TRACE_DBG("Deallocating range %lld, len %lld of COW device %s",
+		(long long)off, (long long)len, virt_dev->name);
 
-	if (virt_dev->fd != NULL)
-		goto out;
+	res = vdisk_cow_discard(virt_dev->cow_img, off, len, &dirty);
+	if (dirty) {
+		rc = vdisk_cow_mapping_changed(virt_dev);
+		if (res == 0)
+			res = rc;
+	}
 
-	if (!virt_dev->nullio && !virt_dev->cdrom_empty) {
-		res = vdisk_open_fd(virt_dev, tgt_dev->dev->dev_rd_only);
-		if (res != 0) {
-			if ((res == -EMEDIUMTYPE) && virt_dev->blockio) {
-				/* It's OK, it will be reopen on exec */
-				res = 0;
-			} else {
-				virt_dev->tgt_dev_cnt--;
-				goto out;
-			}
-		}
-	} else {
-		virt_dev->fd = NULL;
-		virt_dev->dif_fd = NULL;
+	if (unlikely(res != 0)) {
+		PRINT_ERROR("Deallocating %lld, len %lld of COW device %s "
+			"failed: %d", (long long)off, (long long)len,
+			virt_dev->name, res);
+		if (res == -ENOMEM)
+			scst_set_busy(cmd);
+		else
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
 	}
 
-out:
 	TRACE_EXIT_RES(res);
 	return res;
 }
 
-/* Invoked with scst_mutex held, so no further locking is necessary here. */
-static void vdisk_detach_tgt(struct scst_tgt_dev *tgt_dev)
+/* Returns provisioning status of the cluster at @off, or error code */
+static int vdisk_cow_cluster_status(struct vdisk_cow_image *img, loff_t off,
+	int cluster_shift)
 {
-	struct scst_vdisk_dev *virt_dev = tgt_dev->dev->dh_priv;
+	u64 entry;
+	int res;
 
-	TRACE_ENTRY();
+	if (off >= img->size)
+		return VDISK_LBA_DEALLOCATED;
 
-	lockdep_assert_held(&scst_mutex);
+	/* Plain files and different geometry are considered fully mapped */
+	if (img->raw || (img->cluster_shift != cluster_shift))
+		return VDISK_LBA_MAPPED;
 
-	if (--virt_dev->tgt_dev_cnt == 0)
-		vdisk_close_fd(virt_dev);
+	res = vdisk_cow_lookup(img, off, &entry);
+	if (res != 0)
+		return res;
 
-	TRACE_EXIT();
-	return;
+	if (entry > VDISK_COW_ZERO)
+		return VDISK_LBA_MAPPED;
+	else if ((entry == VDISK_COW_UNALLOCATED) && (img->parent != NULL))
+		return vdisk_cow_cluster_status(img->parent, off, cluster_shift);
+	else
+		return VDISK_LBA_DEALLOCATED;
 }
 
-static enum compl_status_e vdisk_synchronize_cache(struct vdisk_cmd_params *p)
+/*
+ * Returns provisioning status of @lba and in *blocks the number of blocks
+ * starting from @lba with the same status, or error code.
+ */
+static int vdisk_cow_lba_status(struct scst_vdisk_dev *virt_dev,
+	uint64_t lba, uint64_t *blocks)
 {
-	struct scst_cmd *cmd = p->cmd;
-	const uint8_t *cdb = cmd->cdb;
-	struct scst_device *dev = cmd->dev;
-	const loff_t loff = p->loff;
-	int64_t data_len = scst_cmd_get_data_len(cmd);
-	int immed = cdb[1] & 0x2;
-	enum compl_status_e res;
-
-	TRACE_ENTRY();
+	struct vdisk_cow_image *img = virt_dev->cow_img;
+	int block_shift = virt_dev->dev->block_shift;
+	loff_t cluster_size = 1 << img->cluster_shift;
+	loff_t off = lba << block_shift;
+	int res, i;
 
-	TRACE(TRACE_ORDER, "SYNCHRONIZE_CACHE: "
-	      "loff=%lld, data_len=%lld, immed=%d",
-	      (unsigned long long int)loff,
-	      (unsigned long long int)data_len, immed);
+	res = vdisk_cow_cluster_status(img, off, img->cluster_shift);
+	if (res < 0)
+		goto out;
 
-	if (data_len == 0) {
-		struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	off = (off | (cluster_size - 1)) + 1;
+	for (i = 0; (i < VDISK_COW_LBA_STATUS_MAX) &&
+		    (off < virt_dev->file_size); i++) {
+		int rc = vdisk_cow_cluster_status(img, off, img->cluster_shift);
 
-		data_len = virt_dev->file_size -
-			((loff_t)scst_cmd_get_lba(cmd) << dev->block_shift);
+		if (rc < 0) {
+			res = rc;
+			goto out;
+		}
+		if (rc != res)
+			break;
+		off += cluster_size;
 	}
 
-	if (immed) {
-		scst_cmd_get(cmd); /* to protect dev */
-		cmd->completed = 1;
-		cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
-				   SCST_CONTEXT_SAME);
-		vdisk_fsync(loff, data_len, dev, cmd->cmd_gfp_mask, NULL, true);
-		/* ToDo: vdisk_fsync() error processing */
-		scst_cmd_put(cmd);
-		res = RUNNING_ASYNC;
-	} else {
-		vdisk_fsync(loff, data_len, dev, cmd->cmd_gfp_mask, cmd, true);
-		res = RUNNING_ASYNC;
-	}
+	off = min(off, virt_dev->file_size);
+	*blocks = (off >> block_shift) - lba;
 
-	TRACE_EXIT_RES(res);
+out:
 	return res;
 }
 
-static enum compl_status_e vdisk_exec_start_stop(struct vdisk_cmd_params *p)
+#ifndef CONFIG_DEBUG_EXT_COPY_REMAP
+/*
+ * EXTENDED COPY between COW devices: destination clusters, which are copied
+ * from clusters without data, are deallocated, so only the mapping changes.
+ * Everything else is left to the copy manager.
+ */
+static void vdisk_cow_ext_copy_remap(struct scst_cmd *cmd,
+	struct scst_ext_copy_seg_descr *seg)
 {
-	struct scst_cmd *cmd = p->cmd;
-	struct scst_device *dev = cmd->dev;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	struct scst_ext_copy_data_descr *dd = &seg->data_descr;
+	struct scst_device *src_dev = seg->src_tgt_dev->dev;
+	struct scst_device *dst_dev = seg->dst_tgt_dev->dev;
+	struct scst_vdisk_dev *dst_virt_dev;
+	struct vdisk_cow_image *src_img, *dst_img;
+	struct scst_ext_copy_data_descr *left;
+	loff_t src_off, dst_off, cluster_size;
+	int len, left_cnt = 0, res = 0, rc;
+	bool dirty = false, prev_left = false;
 
 	TRACE_ENTRY();
 
-	vdisk_fsync(0, virt_dev->file_size, dev, cmd->cmd_gfp_mask, cmd, false);
+	if ((src_dev->handler != &vdisk_file_devtype) ||
+	    (dst_dev->handler != &vdisk_file_devtype))
+		goto out_copy_all;
+
+	dst_virt_dev = dst_dev->dh_priv;
+	src_img = ((struct scst_vdisk_dev *)src_dev->dh_priv)->cow_img;
+	dst_img = dst_virt_dev->cow_img;
+	if ((src_img == NULL) || (dst_img == NULL) || dst_img->read_only ||
+	    (src_img->cluster_shift != dst_img->cluster_shift))
+		goto out_copy_all;
+
+	cluster_size = 1 << dst_img->cluster_shift;
+	src_off = dd->src_lba << src_dev->block_shift;
+	dst_off = dd->dst_lba << dst_dev->block_shift;
+	len = dd->data_len;
+	if (((src_off | dst_off) & (cluster_size - 1)) || (len < cluster_size))
+		goto out_copy_all;
+
+	left = kcalloc((len >> dst_img->cluster_shift) + 1, sizeof(*left),
+			GFP_KERNEL);
+	if (left == NULL)
+		goto out_copy_all;
+
+	while (len > 0) {
+		int n = min_t(int, len, cluster_size);
+		int status = VDISK_LBA_MAPPED;
+
+		if (n == cluster_size) {
+			status = vdisk_cow_cluster_status(src_img, src_off,
+					src_img->cluster_shift);
+			if (status < 0) {
+				res = status;
+				goto out_err;
+			}
+		}
 
+		if (status == VDISK_LBA_DEALLOCATED) {
+			res = vdisk_cow_discard(dst_img, dst_off, n, &dirty);
+			if (res != 0)
+				goto out_err;
+			prev_left = false;
+		} else if (prev_left) {
+			left[left_cnt - 1].data_len += n;
+		} else {
+			left[left_cnt].src_lba = src_off >> src_dev->block_shift;
+			left[left_cnt].dst_lba = dst_off >> dst_dev->block_shift;
+			left[left_cnt].data_len = n;
+			left_cnt++;
+			prev_left = true;
+		}
+
+		src_off += n;
+		dst_off += n;
+		len -= n;
+	}
+
+	if (dirty) {
+		res = vdisk_cow_mapping_changed(dst_virt_dev);
+		if (res != 0)
+			goto out_err;
+	}
+
+	TRACE_DBG("ec_cmd %p: %d leftover descriptors", cmd, left_cnt);
+
+	if (left_cnt == 0) {
+		kfree(left);
+		left = NULL;
+	}
+	scst_ext_copy_remap_done(cmd, left, left_cnt);
+
+out:
 	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	return;
+
+out_copy_all:
+	scst_ext_copy_remap_done(cmd, dd, 1);
+	goto out;
+
+out_err:
+	if (dirty) {
+		rc = vdisk_cow_mapping_changed(dst_virt_dev);
+		if (rc != 0)
+			PRINT_ERROR("Flushing COW device %s failed: %d",
+				dst_virt_dev->name, rc);
+	}
+	kfree(left);
+	PRINT_ERROR("Remapping of EXTENDED COPY segment failed: %d", res);
+	if (res == -ENOMEM)
+		scst_set_busy(cmd);
+	else
+		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_write_error));
+	scst_ext_copy_remap_done(cmd, NULL, 0);
+	goto out;
 }
+#endif
 
-static enum compl_status_e vdisk_nop(struct vdisk_cmd_params *p)
+/*
+ * SSD cache of vdisk_fileio devices
+ */
+
+/*
+ * Write-back cache of a vdisk_fileio device on a fast file or block device.
+ *
+ * The device's file, the origin, is divided into blocks of 1 << block_shift
+ * bytes, each of which can be stored in any of nr_blocks slots of the cache
+ * file. The cache file starts with struct vdisk_cache_header, followed at
+ * VDISK_CACHE_META_OFFSET by the table of struct vdisk_cache_entry, one per
+ * slot, and then by the slots themselves starting at data_offset. All
+ * on-disk values are little endian.
+ *
+ * Only dirty slots, i.e. ones newer than the origin, are recorded in the
+ * table, so only they survive restart. The table entries are written by
+ * vdisk_cache_commit() after the data they refer to are synced, and a slot
+ * is reused only after its free entry is synced, so after a crash the table
+ * never refers to unwritten or stale data. Dirty slots are copied to the
+ * origin (destaged) by destage_work in the origin's order, then the origin
+ * is synced and only then the slots are marked clean.
+ *
+ * Reads of not cached blocks promote them into the cache, writes allocate
+ * slots for them. Both are skipped for sequential streams longer than
+ * seq_cutoff bytes, which go directly to the origin, as well as when there
+ * is no free or reusable clean slot. Clean slots are reused in LRU order.
+ */
+struct vdisk_cache_header {
+	__le64 magic;
+	__le32 version;
+	__le32 block_shift;
+	__le64 nr_blocks;
+	__le64 data_offset;
+	char origin[VDISK_CACHE_ORIGIN_LEN];
+} __packed;
+
+struct vdisk_cache_entry {
+	__le64 origin_blk;
+	__le32 state;
+	__le32 reserved;
+} __packed;
+
+/* Slot states, clean slots are recorded on disk as free */
+enum {
+	VDISK_CACHE_FREE = 0,
+	VDISK_CACHE_CLEAN = 1,
+	VDISK_CACHE_DIRTY = 2,
+};
+
+/* Slot flags. Filling and invalidated slots can't be accessed at all. */
+#define VDISK_CACHE_FILLING		1
+#define VDISK_CACHE_DESTAGING		2 /* can be read, but not written */
+#define VDISK_CACHE_INVALIDATING	4
+
+/* State of the table entry of a slot */
+enum {
+	VDISK_CACHE_META_SYNCED = 0,
+	VDISK_CACHE_META_PENDING,	/* on meta_list */
+	VDISK_CACHE_META_COMMITTING,	/* being written by vdisk_cache_commit() */
+};
+
+struct vdisk_cache_block {
+	/* Entry in the hash, if the slot is mapped */
+	struct hlist_node hash_entry;
+	/* Entry in free_list, clean_list or dirty_list */
+	struct list_head list_entry;
+	/* Entry in meta_list, if the table entry of the slot is not synced */
+	struct list_head meta_entry;
+	u64 origin_blk;
+	/* Number of reads and writes of the slot data in progress */
+	unsigned short pin;
+	u8 state;
+	u8 flags;
+	u8 meta;
+};
+
+struct vdisk_cache_stream {
+	loff_t end;
+	loff_t len;
+	unsigned long last_access;
+};
+
+/* Blocks written or deallocated in the origin bypassing the cache */
+struct vdisk_cache_range {
+	struct list_head range_entry;
+	u64 first, last;
+};
+
+struct vdisk_cache {
+	struct file *fd;
+	/* Reopened by vdisk_set_wt(), changes under destage_mutex */
+	struct file *origin_fd;
+	char *filename;
+	int block_shift;
+	unsigned int nr_blocks;
+	loff_t data_offset;
+	loff_t seq_cutoff;
+	struct vdisk_cache_stats *stats;
+
+	/* Protects all below as well as the fields of the blocks */
+	struct mutex mutex;
+	struct vdisk_cache_block *blocks;
+	struct hlist_head *hash;
+	int hash_bits;
+	struct list_head free_list;
+	/* Least recently used first */
+	struct list_head clean_list;
+	/* In the order the blocks were dirtied */
+	struct list_head dirty_list;
+	struct list_head meta_list;
+	struct list_head range_list;
+	struct vdisk_cache_stream streams[VDISK_CACHE_STREAMS];
+
+	/* Woken up after flags or pin of a block are cleared */
+	wait_queue_head_t wq;
+
+	/* Serializes vdisk_cache_commit() */
+	struct mutex commit_mutex;
+	/* Serializes destaging */
+	struct mutex destage_mutex;
+	struct delayed_work destage_work;
+};
+
+static inline loff_t vdisk_cache_slot_off(const struct vdisk_cache *cache,
+	const struct vdisk_cache_block *b)
 {
-	return CMD_SUCCEEDED;
+	return cache->data_offset +
+		((loff_t)(b - cache->blocks) << cache->block_shift);
 }
 
-static enum compl_status_e vdisk_exec_sai_16(struct vdisk_cmd_params *p)
+/* cache->mutex supposed to be held */
+static struct vdisk_cache_block *vdisk_cache_find(struct vdisk_cache *cache,
+	u64 blk)
 {
-	switch (p->cmd->cdb[1] & 0x1f) {
-	case SAI_READ_CAPACITY_16:
-		vdisk_exec_read_capacity16(p);
-		return CMD_SUCCEEDED;
-	case SAI_GET_LBA_STATUS:
-		return vdisk_exec_get_lba_status(p);
+	struct hlist_node *n;
+
+	for (n = cache->hash[hash_64(blk, cache->hash_bits)].first; n != NULL;
+	     n = n->next) {
+		struct vdisk_cache_block *b = hlist_entry(n,
+			struct vdisk_cache_block, hash_entry);
+
+		if (b->origin_blk == blk)
+			return b;
 	}
-	scst_set_invalid_field_in_cdb(p->cmd, 1,
-			0 | SCST_INVAL_FIELD_BIT_OFFS_VALID);
-	return CMD_SUCCEEDED;
+	return NULL;
 }
 
-static enum compl_status_e vdisk_exec_maintenance_in(struct vdisk_cmd_params *p)
+/*
+ * Maps not mapped slot @b to origin block @blk. The slot is marked filling,
+ * the caller is supposed to put it on a list when done. cache->mutex
+ * supposed to be held.
+ */
+static void vdisk_cache_insert(struct vdisk_cache *cache,
+	struct vdisk_cache_block *b, u64 blk, int state)
 {
-	switch (p->cmd->cdb[1] & 0x1f) {
-	case MI_REPORT_TARGET_PGS:
-		vdisk_exec_report_tpgs(p);
-		return CMD_SUCCEEDED;
-	}
-	scst_set_invalid_field_in_cdb(p->cmd, 1,
-			0 | SCST_INVAL_FIELD_BIT_OFFS_VALID);
-	return CMD_SUCCEEDED;
+	b->origin_blk = blk;
+	b->state = state;
+	b->flags = VDISK_CACHE_FILLING;
+	hlist_add_head(&b->hash_entry,
+		&cache->hash[hash_64(blk, cache->hash_bits)]);
+	cache->stats->used_blocks++;
+	return;
 }
 
-static enum compl_status_e vdisk_exec_maintenance_out(struct vdisk_cmd_params *p)
+/*
+ * Unmaps slot @b and puts it on the free list. Its table entry must be
+ * synced free already. cache->mutex supposed to be held.
+ */
+static void vdisk_cache_drop(struct vdisk_cache *cache,
+	struct vdisk_cache_block *b)
 {
-	switch (p->cmd->cdb[1] & 0x1f) {
-	case MO_SET_TARGET_PGS:
-		return vdisk_exec_set_tpgs(p);
+	EXTRACHECKS_BUG_ON(b->meta != VDISK_CACHE_META_SYNCED);
+	hlist_del(&b->hash_entry);
+	cache->stats->used_blocks--;
+	b->state = VDISK_CACHE_FREE;
+	list_move(&b->list_entry, &cache->free_list);
+	return;
+}
+
+/* The table entry of @b needs writing. cache->mutex supposed to be held. */
+static void vdisk_cache_meta_changed(struct vdisk_cache *cache,
+	struct vdisk_cache_block *b)
+{
+	if (b->meta != VDISK_CACHE_META_PENDING) {
+		list_move_tail(&b->meta_entry, &cache->meta_list);
+		b->meta = VDISK_CACHE_META_PENDING;
 	}
-	scst_set_invalid_field_in_cdb(p->cmd, 1,
-			0 | SCST_INVAL_FIELD_BIT_OFFS_VALID);
-	return CMD_SUCCEEDED;
+	return;
 }
 
-static enum compl_status_e vdisk_exec_send_diagnostic(struct vdisk_cmd_params *p)
+/* cache->mutex supposed to be held */
+static void vdisk_cache_set_dirty(struct vdisk_cache *cache,
+	struct vdisk_cache_block *b)
 {
-	return CMD_SUCCEEDED;
+	b->state = VDISK_CACHE_DIRTY;
+	list_move_tail(&b->list_entry, &cache->dirty_list);
+	cache->stats->dirty_blocks++;
+	vdisk_cache_meta_changed(cache, b);
+	schedule_delayed_work(&cache->destage_work, VDISK_CACHE_DESTAGE_DELAY);
+	return;
 }
 
-static int vdisk_format_dif(struct scst_cmd *cmd, uint64_t start_lba,
-	uint64_t blocks)
+/*
+ * Returns a free slot or NULL, if there are neither free nor reusable clean
+ * slots. cache->mutex supposed to be held.
+ */
+static struct vdisk_cache_block *vdisk_cache_alloc(struct vdisk_cache *cache)
 {
-	int res = 0;
-	struct scst_device *dev = cmd->dev;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
-	loff_t loff;
-	mm_segment_t old_fs;
-	loff_t err = 0;
-	ssize_t full_len;
-	struct file *fd = virt_dev->dif_fd;
-	struct iovec *iv;
-	int max_iv_count, iv_count, i;
-	struct page *iv_page, *data_page;
-	uint8_t *data_buf;
-	int64_t left, done;
+	struct vdisk_cache_block *b;
+	int scanned = 0;
 
-	TRACE_ENTRY();
+	if (!list_empty(&cache->free_list)) {
+		b = list_first_entry(&cache->free_list, struct vdisk_cache_block,
+			list_entry);
+		goto found;
+	}
 
-	if (virt_dev->dif_fd == NULL)
-		goto out;
+	list_for_each_entry(b, &cache->clean_list, list_entry) {
+		/* Clean slots are free on disk, once their entry is synced */
+		if ((b->pin == 0) && (b->meta == VDISK_CACHE_META_SYNCED)) {
+			hlist_del(&b->hash_entry);
+			cache->stats->used_blocks--;
+			goto found;
+		}
+		if (++scanned == VDISK_CACHE_RECLAIM_SCAN)
+			break;
+	}
+	return NULL;
 
-	EXTRACHECKS_BUG_ON(!(dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE));
+found:
+	list_del_init(&b->list_entry);
+	return b;
+}
 
-	iv_page = alloc_page(GFP_KERNEL);
-	if (iv_page == NULL) {
-		PRINT_ERROR("Unable to allocate iv page");
-		scst_set_busy(cmd);
-		res = -ENOMEM;
-		goto out;
+static void vdisk_cache_unpin(struct vdisk_cache *cache,
+	struct vdisk_cache_block *b)
+{
+	int pin;
+
+	mutex_lock(&cache->mutex);
+	pin = --b->pin;
+	mutex_unlock(&cache->mutex);
+
+	if (pin == 0)
+		wake_up_all(&cache->wq);
+	return;
+}
+
+/* cache->mutex supposed to be held */
+static bool vdisk_cache_origin_busy(struct vdisk_cache *cache, u64 blk)
+{
+	struct vdisk_cache_range *r;
+
+	list_for_each_entry(r, &cache->range_list, range_entry) {
+		if ((blk >= r->first) && (blk <= r->last))
+			return true;
 	}
+	return false;
+}
 
-	data_page = alloc_page(GFP_KERNEL);
-	if (data_page == NULL) {
-		PRINT_ERROR("Unable to allocate tags data page");
-		scst_set_busy(cmd);
-		res = -ENOMEM;
-		goto out_free_iv;
+/*
+ * Returns true if the command accessing [off, off + len) continues a
+ * sequential stream longer than seq_cutoff, so it should bypass the cache.
+ */
+static bool vdisk_cache_check_seq(struct vdisk_cache *cache, loff_t off,
+	loff_t len)
+{
+	struct vdisk_cache_stream *s, *lru = NULL;
+	bool res;
+	int i;
+
+	if (cache->seq_cutoff == 0)
+		return false;
+
+	mutex_lock(&cache->mutex);
+
+	for (i = 0; i < ARRAY_SIZE(cache->streams); i++) {
+		s = &cache->streams[i];
+		if (s->end == off)
+			goto found;
+		if ((lru == NULL) || time_before(s->last_access, lru->last_access))
+			lru = s;
 	}
+	s = lru;
+	s->len = 0;
 
-	data_buf = page_address(data_page);
-	memset(data_buf, 0xFF, PAGE_SIZE);
+found:
+	s->end = off + len;
+	s->len += len;
+	s->last_access = jiffies;
 
-	iv = page_address(iv_page);
-	max_iv_count = min_t(int, UIO_MAXIOV, (int)PAGE_SIZE/sizeof(*iv));
+	res = (s->len > cache->seq_cutoff);
+	if (res)
+		cache->stats->bypassed++;
 
-	for (i = 0; i < max_iv_count; i++)
-		iv[i].iov_base = (uint8_t __force __user *)data_buf;
+	mutex_unlock(&cache->mutex);
+	return res;
+}
 
-	old_fs = get_fs();
-	set_fs(get_ds());
+static int vdisk_cache_get_bounce(struct vdisk_cache *cache, void **bounce)
+{
+	if (*bounce == NULL) {
+		*bounce = vmalloc(1 << cache->block_shift);
+		if (*bounce == NULL)
+			return -ENOMEM;
+	}
+	return 0;
+}
 
-	loff = start_lba << SCST_DIF_TAG_SHIFT;
-	left = blocks << SCST_DIF_TAG_SHIFT;
-	done = 0;
-	while (left > 0) {
-		iv_count = 0;
-		full_len = 0;
-		i = -1;
-		while (1) {
-			int len = min_t(size_t, (size_t)left, PAGE_SIZE);
+/*
+ * Reads @len bytes at @off, which don't cross a block boundary. If the block
+ * isn't cached, promotes it, unless @bypass.
+ */
+static int vdisk_cache_read_block(struct vdisk_cache *cache, void *buf,
+	size_t len, loff_t off, bool bypass, void **bounce)
+{
+	const size_t block_size = 1 << cache->block_shift;
+	const size_t block_off = off & (block_size - 1);
+	u64 blk = off >> cache->block_shift;
+	struct vdisk_cache_block *b;
+	void *data;
+	int res;
 
-			full_len += len;
-			i++;
-			iv_count++;
-			iv[i].iov_len = len;
-			left -= len;
-			done += len;
-			EXTRACHECKS_BUG_ON(left < 0);
-			if ((iv_count == max_iv_count) || (left == 0))
-				break;
+again:
+	mutex_lock(&cache->mutex);
+
+	b = vdisk_cache_find(cache, blk);
+	if (b != NULL) {
+		if (b->flags & (VDISK_CACHE_FILLING | VDISK_CACHE_INVALIDATING)) {
+			mutex_unlock(&cache->mutex);
+			wait_event(cache->wq, !(b->flags &
+				(VDISK_CACHE_FILLING | VDISK_CACHE_INVALIDATING)));
+			goto again;
 		}
+		b->pin++;
+		if (b->state == VDISK_CACHE_CLEAN)
+			list_move_tail(&b->list_entry, &cache->clean_list);
+		cache->stats->read_hits++;
+		mutex_unlock(&cache->mutex);
+
+		res = vdisk_file_rw_sync(cache->fd, buf, len,
+			vdisk_cache_slot_off(cache, b) + block_off, false);
+		vdisk_cache_unpin(cache, b);
+		goto out;
+	}
 
-		TRACE_DBG("Formatting DIF: full_len %zd, off %lld",
-			full_len, (long long)loff);
+	cache->stats->read_misses++;
 
-		/* WRITE */
-		err = vfs_writev(fd, (struct iovec __force __user *)iv, iv_count,
-				 &loff);
-		if (err < 0) {
-			PRINT_ERROR("Formatting DIF write() returned %lld from "
-				"%zd", (long long)err, full_len);
-			if (err == -EAGAIN)
-				scst_set_busy(cmd);
-			else
-				scst_set_cmd_error(cmd,
-				    SCST_LOAD_SENSE(scst_sense_write_error));
-			res = err;
-			goto out_set_fs;
-		} else if (err < full_len) {
-			/*
-			 * Probably that's wrong, but sometimes write() returns
-			 * value less, than requested. Let's restart.
-			 */
-			left += full_len - err;
-			done -= full_len - err;
-		}
+	/* Data being written to the origin must not be cached */
+	if (!bypass && !vdisk_cache_origin_busy(cache, blk))
+		b = vdisk_cache_alloc(cache);
+	if (b == NULL) {
+		mutex_unlock(&cache->mutex);
+		res = vdisk_file_rw_sync(cache->origin_fd, buf, len, off, false);
+		goto out;
+	}
 
-		virt_dev->format_progress_done = done;
-	};
+	vdisk_cache_insert(cache, b, blk, VDISK_CACHE_CLEAN);
+	mutex_unlock(&cache->mutex);
 
-out_set_fs:
-	set_fs(old_fs);
+	if (len == block_size)
+		data = buf;
+	else {
+		res = vdisk_cache_get_bounce(cache, bounce);
+		if (res != 0)
+			goto out_drop;
+		data = *bounce;
+	}
 
-	__free_page(data_page);
+	res = vdisk_file_rw_sync(cache->origin_fd, data, block_size,
+		off - block_off, false);
+	if (res != 0)
+		goto out_drop;
 
-out_free_iv:
-	__free_page(iv_page);
+	if (data != buf)
+		memcpy(buf, data + block_off, len);
+
+	if (vdisk_file_rw_sync(cache->fd, data, block_size,
+			vdisk_cache_slot_off(cache, b), true) != 0) {
+		/* The data are read, only the promotion failed */
+		goto out_drop;
+	}
+
+	mutex_lock(&cache->mutex);
+	list_add_tail(&b->list_entry, &cache->clean_list);
+	b->flags = 0;
+	mutex_unlock(&cache->mutex);
+	wake_up_all(&cache->wq);
 
 out:
-	TRACE_EXIT_RES(res);
 	return res;
+
+out_drop:
+	mutex_lock(&cache->mutex);
+	vdisk_cache_drop(cache, b);
+	b->flags = 0;
+	mutex_unlock(&cache->mutex);
+	wake_up_all(&cache->wq);
+	goto out;
 }
 
-static enum compl_status_e vdisk_exec_format_unit(struct vdisk_cmd_params *p)
+/*
+ * Writes @len bytes at @off, which don't cross a block boundary. If the
+ * block isn't cached, allocates a slot for it, unless @bypass.
+ */
+static int vdisk_cache_write_block(struct vdisk_cache *cache, const void *buf,
+	size_t len, loff_t off, bool bypass, void **bounce)
 {
-	int res = CMD_SUCCEEDED;
-	struct scst_cmd *cmd = p->cmd;
-	struct scst_device *dev = cmd->dev;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
-	uint8_t *buf;
-	int prot_type = dev->dev_dif_type, pinfo;
-	bool immed = false;
+	const size_t block_size = 1 << cache->block_shift;
+	const size_t block_off = off & (block_size - 1);
+	u64 blk = off >> cache->block_shift;
+	struct vdisk_cache_block *b;
+	struct vdisk_cache_range r;
+	const void *data;
+	int res;
 
-	TRACE_ENTRY();
+again:
+	mutex_lock(&cache->mutex);
 
-	pinfo = (cmd->cdb[1] & 0xC0) >> 6;
-	if (((cmd->cdb[1] & 0x10) == 0) && (pinfo != 0)) {
-		/* FMTDATA zero and FMTPINFO not zero are illegal */
-		scst_set_invalid_field_in_cdb(cmd, 1,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 6);
+	b = vdisk_cache_find(cache, blk);
+	if (b != NULL) {
+		if (b->flags != 0) {
+			mutex_unlock(&cache->mutex);
+			wait_event(cache->wq, b->flags == 0);
+			goto again;
+		}
+		b->pin++;
+		if (b->state == VDISK_CACHE_CLEAN)
+			vdisk_cache_set_dirty(cache, b);
+		cache->stats->write_hits++;
+		mutex_unlock(&cache->mutex);
+
+		res = vdisk_file_rw_sync(cache->fd, (void *)buf, len,
+			vdisk_cache_slot_off(cache, b) + block_off, true);
+		vdisk_cache_unpin(cache, b);
 		goto out;
 	}
 
-	if (cmd->cdb[1] & 0x10) { /* FMTDATA */
-		int length, prot_usage;
+	cache->stats->write_misses++;
 
-		length = scst_get_buf_full_sense(cmd, &buf);
-		TRACE_DBG("length %d", length);
-		if (unlikely(length <= 0))
-			goto out;
+	if (!bypass && !vdisk_cache_origin_busy(cache, blk))
+		b = vdisk_cache_alloc(cache);
+	if (b == NULL) {
+		/* Keep the block from being cached until it's written */
+		r.first = blk;
+		r.last = blk;
+		list_add_tail(&r.range_entry, &cache->range_list);
+		mutex_unlock(&cache->mutex);
 
-		TRACE_BUFF_FLAG(TRACE_DEBUG, "Format buf", buf, 64);
+		res = vdisk_file_rw_sync(cache->origin_fd, (void *)buf, len,
+			off, true);
 
-		if (length < 4) {
-			PRINT_ERROR("FORMAT UNIT: too small parameters list "
-				"header %d (dev %s)", length, dev->virt_name);
-			scst_set_cmd_error(cmd,
-				SCST_LOAD_SENSE(scst_sense_parameter_list_length_invalid));
-			goto out_put;
-		}
+		mutex_lock(&cache->mutex);
+		list_del(&r.range_entry);
+		mutex_unlock(&cache->mutex);
+		goto out;
+	}
 
-		prot_usage = buf[0] & 7;
-		immed = buf[1] & 2;
+	vdisk_cache_insert(cache, b, blk, VDISK_CACHE_DIRTY);
+	mutex_unlock(&cache->mutex);
 
-		if ((buf[1] & 8) != 0) {
-			PRINT_ERROR("FORMAT UNIT: initialization pattern not "
-				"supported");
-			scst_set_invalid_field_in_parm_list(cmd, 1,
-				SCST_INVAL_FIELD_BIT_OFFS_VALID | 3);
-			goto out_put;
-		}
+	if (len == block_size)
+		data = buf;
+	else {
+		/* Read-modify-write, the origin can't change under us */
+		res = vdisk_cache_get_bounce(cache, bounce);
+		if (res != 0)
+			goto out_drop;
+		res = vdisk_file_rw_sync(cache->origin_fd, *bounce, block_size,
+			off - block_off, false);
+		if (res != 0)
+			goto out_drop;
+		memcpy(*bounce + block_off, buf, len);
+		data = *bounce;
+	}
 
-		if (cmd->cdb[1] & 0x20) { /* LONGLIST */
-			if (length < 8) {
-				PRINT_ERROR("FORMAT UNIT: too small long "
-					"parameters list header %d (dev %s)",
-					length, dev->virt_name);
-				scst_set_invalid_field_in_cdb(cmd, 1,
-					SCST_INVAL_FIELD_BIT_OFFS_VALID | 5);
-				goto out_put;
-			}
-			if ((buf[3] & 0xF0) != 0) {
-				PRINT_ERROR("FORMAT UNIT: P_I_INFORMATION must "
-					"be 0 (dev %s)", dev->virt_name);
-				scst_set_invalid_field_in_parm_list(cmd, 3,
-					SCST_INVAL_FIELD_BIT_OFFS_VALID | 4);
-				goto out_put;
-			}
-			if ((buf[3] & 0xF) != 0) {
-				PRINT_ERROR("FORMAT UNIT: PROTECTION INTERVAL "
-					"EXPONENT %d not supported (dev %s)",
-					buf[3] & 0xF, dev->virt_name);
-				scst_set_invalid_field_in_parm_list(cmd, 3,
-					SCST_INVAL_FIELD_BIT_OFFS_VALID | 4);
-				goto out_put;
-			}
-		} else {
-			/* Nothing to do */
-		}
+	res = vdisk_file_rw_sync(cache->fd, (void *)data, block_size,
+		vdisk_cache_slot_off(cache, b), true);
+	if (res != 0)
+		goto out_drop;
 
-		scst_put_buf_full(cmd, buf);
+	mutex_lock(&cache->mutex);
+	vdisk_cache_set_dirty(cache, b);
+	b->flags = 0;
+	mutex_unlock(&cache->mutex);
+	wake_up_all(&cache->wq);
 
-		switch (pinfo) {
-		case 0:
-			switch (prot_usage) {
-			case 0:
-				prot_type = 0;
-				break;
-			default:
-				scst_set_invalid_field_in_parm_list(cmd, 0,
-					SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
-				goto out;
-			}
-			break;
-		case 1:
-			switch (prot_usage) {
-			default:
-				scst_set_invalid_field_in_parm_list(cmd, 0,
-					SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
-				goto out;
-			}
-			break;
-		case 2:
-			switch (prot_usage) {
-			case 0:
-				prot_type = 1;
-				break;
-			default:
-				scst_set_invalid_field_in_parm_list(cmd, 0,
-					SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
-				goto out;
-			}
-			break;
-		case 3:
-			switch (prot_usage) {
-			case 0:
-				prot_type = 2;
-				break;
-			case 1:
-				prot_type = 3;
-				break;
-			default:
-				scst_set_invalid_field_in_parm_list(cmd, 0,
-					SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
-				goto out;
-			}
-			break;
-		default:
-			sBUG();
+out:
+	return res;
+
+out_drop:
+	mutex_lock(&cache->mutex);
+	vdisk_cache_drop(cache, b);
+	b->flags = 0;
+	mutex_unlock(&cache->mutex);
+	wake_up_all(&cache->wq);
+	goto out;
+}
+
+/*
+ * Reads or writes @len bytes at @off through the cache. *bounce is a block
+ * sized buffer allocated on demand, which the caller must vfree().
+ */
+static int vdisk_cache_rw(struct vdisk_cache *cache, void *buf, size_t len,
+	loff_t off, bool write, bool bypass, void **bounce)
+{
+	const size_t block_size = 1 << cache->block_shift;
+	int res = 0;
+
+	while (len > 0) {
+		size_t n = min_t(size_t, len,
+			block_size - (off & (block_size - 1)));
+
+		if (write)
+			res = vdisk_cache_write_block(cache, buf, n, off,
+				bypass, bounce);
+		else
+			res = vdisk_cache_read_block(cache, buf, n, off,
+				bypass, bounce);
+		if (res != 0)
 			break;
-		}
+
+		buf += n;
+		off += n;
+		len -= n;
 	}
 
-	TRACE_DBG("prot_type %d, pinfo %d, immed %d (cmd %p)", prot_type,
-		pinfo, immed, cmd);
+	return res;
+}
 
-	if (prot_type != dev->dev_dif_type) {
-		PRINT_ERROR("FORMAT UNIT: DIF type %d not supported (dev %s)",
-			prot_type, dev->virt_name);
-		scst_set_invalid_field_in_cdb(cmd, 1,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 6);
-		goto out;
-	}
+/*
+ * Makes the data written to the cache so far and the table entries stable.
+ * The data are synced before the entries referring to them are written.
+ */
+static int vdisk_cache_commit(struct vdisk_cache *cache)
+{
+	struct vdisk_cache_block *b, *t;
+	struct vdisk_cache_entry e;
+	LIST_HEAD(commit_list);
+	int res;
 
-	if (immed) {
-		scst_cmd_get(cmd); /* to protect dev */
-		cmd->completed = 1;
-		cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
-		res = RUNNING_ASYNC;
-	}
+	TRACE_ENTRY();
 
-	spin_lock(&virt_dev->flags_lock);
-	virt_dev->format_active = 1;
-	spin_unlock(&virt_dev->flags_lock);
+	mutex_lock(&cache->commit_mutex);
 
-	virt_dev->format_progress_done = 0;
-	virt_dev->format_progress_to_do = virt_dev->nblocks << SCST_DIF_TAG_SHIFT;
+	/* Entries changed from now on are moved back to meta_list */
+	mutex_lock(&cache->mutex);
+	list_for_each_entry_safe(b, t, &cache->meta_list, meta_entry) {
+		list_move_tail(&b->meta_entry, &commit_list);
+		b->meta = VDISK_CACHE_META_COMMITTING;
+	}
+	mutex_unlock(&cache->mutex);
 
-	if (virt_dev->thin_provisioned) {
-		int rc = vdisk_unmap_range(cmd, virt_dev, 0, virt_dev->nblocks);
+	res = vfs_fsync(cache->fd, 1);
+	if (res != 0)
+		goto out_done;
 
-		if (rc != 0)
-			goto finished;
+	mutex_lock(&cache->mutex);
+	if (list_empty(&commit_list)) {
+		mutex_unlock(&cache->mutex);
+		goto out_unlock;
+	}
+	memset(&e, 0, sizeof(e));
+	list_for_each_entry(b, &commit_list, meta_entry) {
+		e.origin_blk = cpu_to_le64(b->origin_blk);
+		e.state = cpu_to_le32((b->state == VDISK_CACHE_DIRTY) ?
+				VDISK_CACHE_DIRTY : VDISK_CACHE_FREE);
+		res = vdisk_file_rw_sync(cache->fd, &e, sizeof(e),
+			VDISK_CACHE_META_OFFSET + (b - cache->blocks) * sizeof(e),
+			true);
+		if (res != 0)
+			break;
 	}
+	mutex_unlock(&cache->mutex);
 
-	if (pinfo != 0)
-		vdisk_format_dif(cmd, 0, virt_dev->nblocks);
+	if (res == 0)
+		res = vfs_fsync(cache->fd, 1);
 
-finished:
-	spin_lock(&virt_dev->flags_lock);
-	virt_dev->format_active = 0;
-	spin_unlock(&virt_dev->flags_lock);
+out_done:
+	mutex_lock(&cache->mutex);
+	list_for_each_entry_safe(b, t, &commit_list, meta_entry) {
+		if (res == 0) {
+			list_del_init(&b->meta_entry);
+			b->meta = VDISK_CACHE_META_SYNCED;
+		} else {
+			list_move_tail(&b->meta_entry, &cache->meta_list);
+			b->meta = VDISK_CACHE_META_PENDING;
+		}
+	}
+	mutex_unlock(&cache->mutex);
 
-	if (immed)
-		scst_cmd_put(cmd);
+out_unlock:
+	mutex_unlock(&cache->commit_mutex);
+
+	if (res != 0)
+		PRINT_ERROR("Committing cache %s failed: %d", cache->filename,
+			res);
 
-out:
 	TRACE_EXIT_RES(res);
 	return res;
-
-out_put:
-	scst_put_buf_full(cmd, buf);
-	goto out;
 }
 
-static enum compl_status_e vdisk_invalid_opcode(struct vdisk_cmd_params *p)
+static int vdisk_cache_blk_cmp(const void *a, const void *b)
 {
-	TRACE_DBG("Invalid opcode %s", scst_get_opcode_name(p->cmd));
-	return INVALID_OPCODE;
+	const struct vdisk_cache_block *ba = *(struct vdisk_cache_block **)a;
+	const struct vdisk_cache_block *bb = *(struct vdisk_cache_block **)b;
+
+	if (ba->origin_blk < bb->origin_blk)
+		return -1;
+	return ba->origin_blk > bb->origin_blk;
 }
 
-#define VDEV_DEF_RDPROTECT	0xE0
-#define VDEV_DEF_WRPROTECT	0xE0
-#define VDEV_DEF_VRPROTECT	0xE0
+/*
+ * Copies up to VDISK_CACHE_DESTAGE_BATCH oldest dirty blocks to the origin
+ * and marks them clean. @buf is a block sized buffer. Returns the number of
+ * destaged blocks or error code. cache->destage_mutex supposed to be held.
+ */
+static int vdisk_cache_destage(struct vdisk_cache *cache, void *buf)
+{
+	struct vdisk_cache_block *batch[VDISK_CACHE_DESTAGE_BATCH];
+	const size_t block_size = 1 << cache->block_shift;
+	struct file *origin_fd = cache->origin_fd;
+	struct vdisk_cache_block *b;
+	loff_t size;
+	int i, cnt = 0, res = 0;
 
-#define VDEF_DEF_GROUP_NUM	0
+	TRACE_ENTRY();
 
-static const struct scst_opcode_descriptor scst_op_descr_cwr = {
-	.od_opcode = COMPARE_AND_WRITE,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 16,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { COMPARE_AND_WRITE, VDEV_DEF_WRPROTECT | 0x18,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0, 0, 0, 0xFF, VDEF_DEF_GROUP_NUM,
-			       SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	lockdep_assert_held(&cache->destage_mutex);
 
-static const struct scst_opcode_descriptor scst_op_descr_format_unit = {
-	.od_opcode = FORMAT_UNIT,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 6,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_LONG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { FORMAT_UNIT, 0xF0, 0, 0, 0, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	mutex_lock(&cache->mutex);
+	list_for_each_entry(b, &cache->dirty_list, list_entry) {
+		/* Blocks being written will be destaged next time */
+		if ((b->pin != 0) || (b->flags != 0))
+			continue;
+		b->flags = VDISK_CACHE_DESTAGING;
+		batch[cnt++] = b;
+		if (cnt == ARRAY_SIZE(batch))
+			break;
+	}
+	mutex_unlock(&cache->mutex);
 
-static const struct scst_opcode_descriptor scst_op_descr_get_lba_status = {
-	.od_opcode = SERVICE_ACTION_IN_16,
-	.od_serv_action = SAI_GET_LBA_STATUS,
-	.od_serv_action_valid = 1,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 16,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_SMALL_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { SERVICE_ACTION_IN_16, SAI_GET_LBA_STATUS,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0,
-			       SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	if (cnt == 0)
+		goto out;
 
-static const struct scst_opcode_descriptor scst_op_descr_allow_medium_removal = {
-	.od_opcode = ALLOW_MEDIUM_REMOVAL,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 6,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_SMALL_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { ALLOW_MEDIUM_REMOVAL, 0, 0, 0, 3, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	sort(batch, cnt, sizeof(batch[0]), vdisk_cache_blk_cmp, NULL);
 
-static const struct scst_opcode_descriptor scst_op_descr_read6 = {
-	.od_opcode = READ_6,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 6,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { READ_6, 0x1F,
-			       0xFF, 0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	size = i_size_read(file_inode(origin_fd));
+	for (i = 0; i < cnt; i++) {
+		loff_t off = batch[i]->origin_blk << cache->block_shift;
+		size_t n;
 
-static const struct scst_opcode_descriptor scst_op_descr_read10 = {
-	.od_opcode = READ_10,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 10,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { READ_10, VDEV_DEF_RDPROTECT | 0x18,
-			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
-			       0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+		/* The origin could shrink since the block was written */
+		if (off >= size)
+			continue;
+		n = min_t(loff_t, block_size, size - off);
 
-static const struct scst_opcode_descriptor scst_op_descr_read12 = {
-	.od_opcode = READ_12,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 12,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { READ_12, VDEV_DEF_RDPROTECT | 0x18,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       VDEF_DEF_GROUP_NUM, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+		res = vdisk_file_rw_sync(cache->fd, buf, n,
+			vdisk_cache_slot_off(cache, batch[i]), false);
+		if (res != 0)
+			break;
+		res = vdisk_file_rw_sync(origin_fd, buf, n, off, true);
+		if (res != 0)
+			break;
+	}
 
-static const struct scst_opcode_descriptor scst_op_descr_read16 = {
-	.od_opcode = READ_16,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 16,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { READ_16, VDEV_DEF_RDPROTECT | 0x18,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
-			       SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	if (res == 0)
+		res = vfs_fsync(origin_fd, 1);
 
-static const struct scst_opcode_descriptor scst_op_descr_read32 = {
-	.od_opcode = VARIABLE_LENGTH_CMD,
-	.od_serv_action = SUBCODE_READ_32,
-	.od_serv_action_valid = 1,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 32,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { VARIABLE_LENGTH_CMD, SCST_OD_DEFAULT_CONTROL_BYTE,
-			       0, 0, 0, 0, VDEF_DEF_GROUP_NUM, 0x18, 0,
-			       SUBCODE_READ_32, VDEV_DEF_RDPROTECT | 0x18, 0,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF },
-};
+	mutex_lock(&cache->mutex);
+	for (i = 0; i < cnt; i++) {
+		b = batch[i];
+		b->flags = 0;
+		if (res != 0)
+			continue;
+		b->state = VDISK_CACHE_CLEAN;
+		list_move_tail(&b->list_entry, &cache->clean_list);
+		cache->stats->dirty_blocks--;
+		vdisk_cache_meta_changed(cache, b);
+	}
+	if (res == 0)
+		cache->stats->destaged += cnt;
+	mutex_unlock(&cache->mutex);
+	wake_up_all(&cache->wq);
 
-static const struct scst_opcode_descriptor scst_op_descr_read_capacity = {
-	.od_opcode = READ_CAPACITY,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 10,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_SMALL_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { READ_CAPACITY, 0, 0, 0, 0, 0, 0,
-			       0, 0, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	if (res != 0)
+		PRINT_ERROR("Destaging cache %s failed: %d", cache->filename,
+			res);
+	else
+		res = cnt;
 
-static const struct scst_opcode_descriptor scst_op_descr_read_capacity16 = {
-	.od_opcode = SERVICE_ACTION_IN_16,
-	.od_serv_action = SAI_READ_CAPACITY_16,
-	.od_serv_action_valid = 1,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 16,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_SMALL_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { SERVICE_ACTION_IN_16, SAI_READ_CAPACITY_16,
-			       0, 0, 0, 0, 0, 0, 0, 0,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0,
-			       SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
 
-static const struct scst_opcode_descriptor scst_op_descr_start_stop_unit = {
-	.od_opcode = START_STOP,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 6,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_SMALL_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { START_STOP, 1, 0, 0xF, 0xF7, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+static void vdisk_cache_destage_work_fn(struct work_struct *work)
+{
+	struct vdisk_cache *cache = container_of(work, struct vdisk_cache,
+		destage_work.work);
+	struct vdisk_cache_stats *stats = cache->stats;
+	unsigned long delay = VDISK_CACHE_DESTAGE_DELAY;
+	void *buf;
+	int res;
 
-static const struct scst_opcode_descriptor scst_op_descr_sync_cache10 = {
-	.od_opcode = SYNCHRONIZE_CACHE,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 10,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { SYNCHRONIZE_CACHE, 2,
-			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
-			       0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	TRACE_ENTRY();
 
-static const struct scst_opcode_descriptor scst_op_descr_sync_cache16 = {
-	.od_opcode = SYNCHRONIZE_CACHE_16,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 16,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { SYNCHRONIZE_CACHE_16, 2,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
-			       SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	buf = vmalloc(1 << cache->block_shift);
+	if (buf == NULL)
+		goto out_resched;
 
-static const struct scst_opcode_descriptor scst_op_descr_unmap = {
-	.od_opcode = UNMAP,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 10,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { UNMAP, 0, 0, 0, 0, 0, VDEF_DEF_GROUP_NUM,
-			       0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	mutex_lock(&cache->destage_mutex);
+	res = vdisk_cache_destage(cache, buf);
+	/* Makes the destaged blocks reusable */
+	if (res > 0)
+		vdisk_cache_commit(cache);
+	mutex_unlock(&cache->destage_mutex);
 
-static const struct scst_opcode_descriptor scst_op_descr_verify10 = {
-	.od_opcode = VERIFY,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 10,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { VERIFY, VDEV_DEF_VRPROTECT | 0x16,
-			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
-			       0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	vfree(buf);
 
-static const struct scst_opcode_descriptor scst_op_descr_verify12 = {
-	.od_opcode = VERIFY_12,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 12,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { VERIFY_12, VDEV_DEF_VRPROTECT | 0x16,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       VDEF_DEF_GROUP_NUM, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	if ((res > 0) && (stats->dirty_blocks >
+			  stats->blocks / 100 * VDISK_CACHE_DIRTY_HIGH))
+		delay = 0;
 
-static const struct scst_opcode_descriptor scst_op_descr_verify16 = {
-	.od_opcode = VERIFY_16,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 16,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { VERIFY_16, VDEV_DEF_VRPROTECT | 0x16,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
-			       SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+out_resched:
+	if (stats->dirty_blocks != 0)
+		schedule_delayed_work(&cache->destage_work, delay);
 
-static const struct scst_opcode_descriptor scst_op_descr_verify32 = {
-	.od_opcode = VARIABLE_LENGTH_CMD,
-	.od_serv_action = SUBCODE_VERIFY_32,
-	.od_serv_action_valid = 1,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 32,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { VARIABLE_LENGTH_CMD, SCST_OD_DEFAULT_CONTROL_BYTE,
-			       0, 0, 0, 0, VDEF_DEF_GROUP_NUM, 0x18, 0,
-			       SUBCODE_VERIFY_32, VDEV_DEF_VRPROTECT | 0x16, 0,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF },
-};
+	TRACE_EXIT();
+	return;
+}
 
-static const struct scst_opcode_descriptor scst_op_descr_write6 = {
-	.od_opcode = WRITE_6,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 6,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { WRITE_6, 0x1F,
-			       0xFF, 0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+/*
+ * Destages all dirty blocks, which aren't being written, and commits the
+ * cache.
+ */
+static int vdisk_cache_sync(struct vdisk_cache *cache)
+{
+	unsigned int left = cache->stats->dirty_blocks;
+	void *buf;
+	int res = 0;
 
-static const struct scst_opcode_descriptor scst_op_descr_write10 = {
-	.od_opcode = WRITE_10,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 10,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { WRITE_10, VDEV_DEF_WRPROTECT | 0x1A,
-			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
-			       0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	TRACE_ENTRY();
 
-static const struct scst_opcode_descriptor scst_op_descr_write12 = {
-	.od_opcode = WRITE_12,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 12,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { WRITE_12, VDEV_DEF_WRPROTECT | 0x1A,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       VDEF_DEF_GROUP_NUM, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	buf = vmalloc(1 << cache->block_shift);
+	if (buf == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
 
-static const struct scst_opcode_descriptor scst_op_descr_write16 = {
-	.od_opcode = WRITE_16,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 16,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { WRITE_16, VDEV_DEF_WRPROTECT | 0x1A,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
-			       SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	mutex_lock(&cache->destage_mutex);
+	/* Not chasing new writes */
+	while (left > 0) {
+		res = vdisk_cache_destage(cache, buf);
+		if (res <= 0)
+			break;
+		left -= min_t(unsigned int, left, res);
+	}
+	if (res >= 0)
+		res = vdisk_cache_commit(cache);
+	mutex_unlock(&cache->destage_mutex);
 
-static const struct scst_opcode_descriptor scst_op_descr_write32 = {
-	.od_opcode = VARIABLE_LENGTH_CMD,
-	.od_serv_action = SUBCODE_WRITE_32,
-	.od_serv_action_valid = 1,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 32,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { VARIABLE_LENGTH_CMD, SCST_OD_DEFAULT_CONTROL_BYTE,
-			       0, 0, 0, 0, VDEF_DEF_GROUP_NUM, 0x18, 0,
-			       SUBCODE_WRITE_32, VDEV_DEF_WRPROTECT | 0x1A, 0,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF },
-};
+	vfree(buf);
 
-static const struct scst_opcode_descriptor scst_op_descr_write_verify10 = {
-	.od_opcode = WRITE_VERIFY,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 10,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { WRITE_VERIFY, VDEV_DEF_WRPROTECT | 0x16,
-			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
-			       0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
 
-static const struct scst_opcode_descriptor scst_op_descr_write_verify12 = {
-	.od_opcode = WRITE_VERIFY_12,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 12,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { WRITE_VERIFY_12, VDEV_DEF_WRPROTECT | 0x16,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       VDEF_DEF_GROUP_NUM, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+/*
+ * Returns the cached block @blk with VDISK_CACHE_INVALIDATING set and taken
+ * off its list, after all its users are gone, or NULL if it isn't cached.
+ */
+static struct vdisk_cache_block *vdisk_cache_get_excl(
+	struct vdisk_cache *cache, u64 blk)
+{
+	struct vdisk_cache_block *b;
+
+again:
+	mutex_lock(&cache->mutex);
+
+	b = vdisk_cache_find(cache, blk);
+	if (b == NULL)
+		goto out_unlock;
+
+	if ((b->flags != 0) || (b->pin != 0)) {
+		mutex_unlock(&cache->mutex);
+		wait_event(cache->wq, (b->flags == 0) && (b->pin == 0));
+		goto again;
+	}
+
+	b->flags = VDISK_CACHE_INVALIDATING;
+	list_del_init(&b->list_entry);
+	if (b->state == VDISK_CACHE_DIRTY)
+		cache->stats->dirty_blocks--;
+
+out_unlock:
+	mutex_unlock(&cache->mutex);
+	return b;
+}
+
+/*
+ * Deallocates [off, off + len) of the origin. Cached blocks fully covered
+ * by the range are dropped, partially covered dirty blocks are zeroed in
+ * the cache. Returns 0 on success, sense set otherwise.
+ */
+static int vdisk_cache_unmap(struct scst_cmd *cmd,
+	struct scst_vdisk_dev *virt_dev, loff_t off, loff_t len)
+{
+	struct vdisk_cache *cache = virt_dev->cache;
+	const int shift = cache->block_shift;
+	const size_t block_size = 1 << shift;
+	struct vdisk_cache_block *b, *t;
+	struct vdisk_cache_range r;
+	LIST_HEAD(inval_list);
+	bool commit = false;
+	void *zero_buf = NULL;
+	u64 blk;
+	int res, rc;
+
+	TRACE_ENTRY();
+
+	r.first = off >> shift;
+	r.last = (off + len - 1) >> shift;
+
+	/* Keep the blocks from being cached till the origin is deallocated */
+	mutex_lock(&cache->mutex);
+	list_add_tail(&r.range_entry, &cache->range_list);
+	mutex_unlock(&cache->mutex);
+
+	for (blk = r.first; blk <= r.last; blk++) {
+		b = vdisk_cache_get_excl(cache, blk);
+		if (b != NULL)
+			list_add_tail(&b->list_entry, &inval_list);
+	}
+
+	res = vdisk_unmap_file_range(cmd, virt_dev, off, len,
+		cache->origin_fd);
+	if (res != 0)
+		goto out_restore;
+
+	list_for_each_entry(b, &inval_list, list_entry) {
+		loff_t b_off = b->origin_blk << shift;
+		loff_t start = max_t(loff_t, off, b_off);
+		loff_t end = min_t(loff_t, off + len, b_off + block_size);
+
+		if ((end - start != block_size) &&
+		    (b->state == VDISK_CACHE_DIRTY)) {
+			/* The rest of the block is newer than the origin */
+			if (zero_buf == NULL) {
+				zero_buf = vzalloc(block_size);
+				if (zero_buf == NULL) {
+					res = -ENOMEM;
+					break;
+				}
+			}
+			res = vdisk_file_rw_sync(cache->fd, zero_buf,
+				end - start, vdisk_cache_slot_off(cache, b) +
+				start - b_off, true);
+			if (res != 0)
+				break;
+			continue;
+		}
+
+		mutex_lock(&cache->mutex);
+		/* Dirty and not yet committed clean ones are dirty on disk */
+		if ((b->state == VDISK_CACHE_DIRTY) ||
+		    (b->meta != VDISK_CACHE_META_SYNCED)) {
+			vdisk_cache_meta_changed(cache, b);
+			commit = true;
+		}
+		b->state = VDISK_CACHE_FREE;
+		mutex_unlock(&cache->mutex);
+	}
+
+	if (commit) {
+		rc = vdisk_cache_commit(cache);
+		if (res == 0)
+			res = rc;
+	}
+
+	if (res != 0) {
+		PRINT_ERROR("Deallocating %lld, len %lld of cached device %s "
+			"failed: %d", (long long)off, (long long)len,
+			virt_dev->name, res);
+		if (res == -ENOMEM)
+			scst_set_busy(cmd);
+		else
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
+	}
+
+out_restore:
+	mutex_lock(&cache->mutex);
+	list_for_each_entry_safe(b, t, &inval_list, list_entry) {
+		b->flags = 0;
+		if ((b->state == VDISK_CACHE_FREE) &&
+		    (b->meta == VDISK_CACHE_META_SYNCED))
+			vdisk_cache_drop(cache, b);
+		else {
+			/*
+			 * Partially zeroed or, if anything failed, possibly
+			 * newer than the already deallocated origin.
+			 */
+			vdisk_cache_set_dirty(cache, b);
+		}
+	}
+	list_del(&r.range_entry);
+	mutex_unlock(&cache->mutex);
+	wake_up_all(&cache->wq);
+
+	vfree(zero_buf);
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* READ and WRITE of cached devices. Returns 0 on success, sense set otherwise. */
+static int vdisk_cache_exec_rw(struct vdisk_cmd_params *p, bool write)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct vdisk_cache *cache = virt_dev->cache;
+	loff_t loff = p->loff;
+	void *bounce = NULL;
+	uint8_t *address;
+	int length, res = 0;
+	bool bypass;
+
+	TRACE_ENTRY();
+
+	bypass = vdisk_cache_check_seq(cache, loff, scst_cmd_get_data_len(cmd));
+
+	length = scst_get_buf_first(cmd, &address);
+	while (length > 0) {
+		res = vdisk_cache_rw(cache, address, length, loff, write,
+			bypass, &bounce);
+		scst_put_buf(cmd, address);
+		if (unlikely(res != 0))
+			break;
+		loff += length;
+		length = scst_get_buf_next(cmd, &address);
+	}
+
+	vfree(bounce);
+
+	/* The cache is non-volatile, so committing it is enough for WT */
+	if (write && (res == 0) && (length == 0) && virt_dev->wt_flag &&
+	    !virt_dev->nv_cache)
+		res = vdisk_cache_commit(cache);
+
+	if (unlikely(length < 0)) {
+		PRINT_ERROR("scst_get_buf_() failed: %d", length);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_internal_failure));
+		res = length;
+	} else if (unlikely(res != 0)) {
+		PRINT_ERROR("%s cached device %s at %lld failed: %d",
+			write ? "Writing" : "Reading", virt_dev->name,
+			(long long)loff, res);
+		if (res == -ENOMEM)
+			scst_set_busy(cmd);
+		else if (write)
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
+		else
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_read_error));
+	}
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* Reads the table of @cache and maps the dirty slots */
+static int vdisk_cache_load(struct vdisk_cache *cache)
+{
+	const size_t chunk = PAGE_SIZE * 16;
+	const int per_chunk = chunk / sizeof(struct vdisk_cache_entry);
+	struct vdisk_cache_entry *entries;
+	unsigned int i;
+	int res = 0;
+
+	TRACE_ENTRY();
+
+	entries = vmalloc(chunk);
+	if (entries == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < cache->nr_blocks; i++) {
+		struct vdisk_cache_block *b = &cache->blocks[i];
+		struct vdisk_cache_entry *e = &entries[i % per_chunk];
+		u64 blk;
+
+		if ((i % per_chunk) == 0) {
+			res = vdisk_file_rw_sync(cache->fd, entries, chunk,
+				VDISK_CACHE_META_OFFSET + (loff_t)i * sizeof(*e),
+				false);
+			if (res != 0) {
+				PRINT_ERROR("Reading table of cache %s failed: "
+					"%d", cache->filename, res);
+				goto out_free;
+			}
+		}
+
+		if (le32_to_cpu(e->state) != VDISK_CACHE_DIRTY) {
+			list_add_tail(&b->list_entry, &cache->free_list);
+			continue;
+		}
+
+		blk = le64_to_cpu(e->origin_blk);
+		if (vdisk_cache_find(cache, blk) != NULL) {
+			PRINT_ERROR("Block %lld is mapped twice in cache %s",
+				(long long)blk, cache->filename);
+			res = -EINVAL;
+			goto out_free;
+		}
+
+		vdisk_cache_insert(cache, b, blk, VDISK_CACHE_DIRTY);
+		b->flags = 0;
+		list_add_tail(&b->list_entry, &cache->dirty_list);
+		cache->stats->dirty_blocks++;
+	}
+
+out_free:
+	vfree(entries);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* Initializes an empty cache for @origin */
+static int vdisk_cache_format(struct vdisk_cache *cache, const char *origin)
+{
+	const size_t chunk = PAGE_SIZE * 16;
+	struct vdisk_cache_header *hdr;
+	loff_t off, end;
+	void *buf;
+	int res;
+
+	TRACE_ENTRY();
+
+	buf = vzalloc(chunk);
+	if (buf == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	/* Empty table first, the header makes it valid */
+	end = VDISK_CACHE_META_OFFSET +
+		(loff_t)cache->nr_blocks * sizeof(struct vdisk_cache_entry);
+	for (off = VDISK_CACHE_META_OFFSET, res = 0; (res == 0) && (off < end);
+	     off += chunk)
+		res = vdisk_file_rw_sync(cache->fd, buf,
+			min_t(loff_t, chunk, end - off), off, true);
+	if (res == 0)
+		res = vfs_fsync(cache->fd, 1);
+	if (res != 0)
+		goto out_err;
+
+	hdr = buf;
+	hdr->magic = cpu_to_le64(VDISK_CACHE_MAGIC);
+	hdr->version = cpu_to_le32(VDISK_CACHE_VERSION);
+	hdr->block_shift = cpu_to_le32(cache->block_shift);
+	hdr->nr_blocks = cpu_to_le64(cache->nr_blocks);
+	hdr->data_offset = cpu_to_le64(cache->data_offset);
+	strlcpy(hdr->origin, origin, sizeof(hdr->origin));
+
+	res = vdisk_file_rw_sync(cache->fd, hdr, sizeof(*hdr), 0, true);
+	if (res == 0)
+		res = vfs_fsync(cache->fd, 1);
+	if (res != 0)
+		goto out_err;
+
+	PRINT_INFO("Formatted cache %s for %s (%u blocks of %dKB)",
+		cache->filename, origin, cache->nr_blocks,
+		1 << (cache->block_shift - 10));
+
+out_free:
+	vfree(buf);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_err:
+	PRINT_ERROR("Formatting cache %s failed: %d", cache->filename, res);
+	goto out_free;
+}
+
+static void vdisk_cache_release(struct vdisk_cache *cache)
+{
+	vfree(cache->hash);
+	vfree(cache->blocks);
+	if (cache->fd != NULL)
+		filp_close(cache->fd, NULL);
+	kfree(cache->filename);
+	kfree(cache);
+	return;
+}
+
+/*
+ * Opens the cache of @virt_dev, whose file is already open. Returns the
+ * cache or ERR_PTR().
+ */
+static struct vdisk_cache *vdisk_cache_open(struct scst_vdisk_dev *virt_dev)
+{
+	const int shift = virt_dev->cache_block_shift;
+	struct vdisk_cache_header *hdr = NULL;
+	struct vdisk_cache *cache;
+	struct file *fd;
+	bool format = true;
+	loff_t size, data_offset;
+	u64 nr;
+	unsigned int i;
+	int res;
+
+	TRACE_ENTRY();
+
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (cache == NULL) {
+		res = -ENOMEM;
+		goto out_err;
+	}
+
+	cache->origin_fd = virt_dev->fd;
+	cache->block_shift = shift;
+	cache->seq_cutoff = (loff_t)virt_dev->cache_seq_cutoff_kb << 10;
+	cache->stats = &virt_dev->cache_stats;
+	memset(cache->stats, 0, sizeof(*cache->stats));
+	mutex_init(&cache->mutex);
+	INIT_LIST_HEAD(&cache->free_list);
+	INIT_LIST_HEAD(&cache->clean_list);
+	INIT_LIST_HEAD(&cache->dirty_list);
+	INIT_LIST_HEAD(&cache->meta_list);
+	INIT_LIST_HEAD(&cache->range_list);
+	init_waitqueue_head(&cache->wq);
+	mutex_init(&cache->commit_mutex);
+	mutex_init(&cache->destage_mutex);
+	INIT_DELAYED_WORK(&cache->destage_work, vdisk_cache_destage_work_fn);
+
+	cache->filename = kstrdup(virt_dev->cache_filename, GFP_KERNEL);
+	hdr = kmalloc(sizeof(*hdr), GFP_KERNEL);
+	if ((cache->filename == NULL) || (hdr == NULL)) {
+		res = -ENOMEM;
+		goto out_release;
+	}
+
+	fd = filp_open(cache->filename, O_LARGEFILE | O_RDWR, 0600);
+	if (IS_ERR(fd)) {
+		res = PTR_ERR(fd);
+		PRINT_ERROR("filp_open(%s) failed: %d", cache->filename, res);
+		goto out_release;
+	}
+	cache->fd = fd;
+
+	/* Fits as many slots with their entries as possible */
+	size = i_size_read(fd->f_mapping->host);
+	nr = max_t(loff_t, size - VDISK_CACHE_META_OFFSET, 0);
+	do_div(nr, (1 << shift) + sizeof(struct vdisk_cache_entry));
+	nr = min_t(u64, nr, VDISK_CACHE_MAX_BLOCKS);
+	for (;;) {
+		data_offset = ALIGN(VDISK_CACHE_META_OFFSET +
+			nr * sizeof(struct vdisk_cache_entry), 1ULL << shift);
+		if ((nr == 0) || (data_offset + (nr << shift) <= size))
+			break;
+		nr--;
+	}
+	if (nr < VDISK_CACHE_MIN_BLOCKS) {
+		PRINT_ERROR("Cache %s is too small for %dKB blocks",
+			cache->filename, 1 << (shift - 10));
+		res = -EINVAL;
+		goto out_release;
+	}
+	cache->nr_blocks = nr;
+	cache->data_offset = data_offset;
+
+	res = vdisk_file_rw_sync(fd, hdr, sizeof(*hdr), 0, false);
+	if (res != 0) {
+		PRINT_ERROR("Reading header of cache %s failed: %d",
+			cache->filename, res);
+		goto out_release;
+	}
+
+	if (le64_to_cpu(hdr->magic) == VDISK_CACHE_MAGIC) {
+		nr = le64_to_cpu(hdr->nr_blocks);
+		data_offset = le64_to_cpu(hdr->data_offset);
+		if ((le32_to_cpu(hdr->version) != VDISK_CACHE_VERSION) ||
+		    (le32_to_cpu(hdr->block_shift) != shift) ||
+		    (nr < VDISK_CACHE_MIN_BLOCKS) ||
+		    (nr > VDISK_CACHE_MAX_BLOCKS) ||
+		    (data_offset < VDISK_CACHE_META_OFFSET +
+				nr * sizeof(struct vdisk_cache_entry)) ||
+		    (data_offset + (nr << shift) > size)) {
+			PRINT_ERROR("Cache %s is invalid or has another block "
+				"size than %dKB", cache->filename,
+				1 << (shift - 10));
+			res = -EINVAL;
+			goto out_release;
+		}
+		cache->nr_blocks = nr;
+		cache->data_offset = data_offset;
+		format = false;
+	}
+
+	cache->stats->blocks = cache->nr_blocks;
+	cache->hash_bits = ilog2(cache->nr_blocks);
+	cache->blocks = vzalloc(cache->nr_blocks * sizeof(*cache->blocks));
+	cache->hash = vzalloc(sizeof(*cache->hash) << cache->hash_bits);
+	if ((cache->blocks == NULL) || (cache->hash == NULL)) {
+		res = -ENOMEM;
+		goto out_release;
+	}
+	for (i = 0; i < cache->nr_blocks; i++) {
+		INIT_LIST_HEAD(&cache->blocks[i].list_entry);
+		INIT_LIST_HEAD(&cache->blocks[i].meta_entry);
+	}
+
+	if (!format) {
+		res = vdisk_cache_load(cache);
+		if (res != 0)
+			goto out_release;
+
+		hdr->origin[sizeof(hdr->origin) - 1] = '\0';
+		if (strncmp(hdr->origin, virt_dev->filename,
+			    sizeof(hdr->origin) - 1) != 0) {
+			if (cache->stats->dirty_blocks != 0) {
+				PRINT_ERROR("Cache %s holds dirty data of %s, "
+					"not of %s", cache->filename,
+					hdr->origin, virt_dev->filename);
+				res = -EINVAL;
+				goto out_release;
+			}
+			/* Not needed anymore, reuse it */
+			format = true;
+		}
+	}
+
+	if (format) {
+		res = vdisk_cache_format(cache, virt_dev->filename);
+		if (res != 0)
+			goto out_release;
+	}
+
+	PRINT_INFO("Opened cache %s of %s (%u blocks of %dKB, %u dirty)",
+		cache->filename, virt_dev->filename, cache->nr_blocks,
+		1 << (shift - 10), cache->stats->dirty_blocks);
+
+	if (cache->stats->dirty_blocks != 0)
+		schedule_delayed_work(&cache->destage_work, 0);
+
+out:
+	kfree(hdr);
+	TRACE_EXIT();
+	return cache;
+
+out_release:
+	vdisk_cache_release(cache);
+
+out_err:
+	cache = ERR_PTR(res);
+	goto out;
+}
+
+/* Commits and frees @cache. Dirty blocks remain in it till the next open. */
+static void vdisk_cache_close(struct vdisk_cache *cache)
+{
+	cancel_delayed_work_sync(&cache->destage_work);
+	vdisk_cache_commit(cache);
+	vdisk_cache_release(cache);
+	return;
+}
+
+/* Switches the origin to @fd, reopened by vdisk_set_wt() */
+static void vdisk_cache_set_origin_fd(struct vdisk_cache *cache,
+	struct file *fd)
+{
+	mutex_lock(&cache->destage_mutex);
+	cache->origin_fd = fd;
+	mutex_unlock(&cache->destage_mutex);
+	return;
+}
+
+/*
+ * Striped vdisk_blockio devices
+ */
+
+/*
+ * Maps byte offset @loff of striped device @virt_dev. Returns index of the
+ * member storing it, the offset on that member in *member_off and the number
+ * of bytes left till the end of the chunk in *chunk_left.
+ */
+static inline int vdisk_stripe_map(const struct scst_vdisk_dev *virt_dev,
+	loff_t loff, loff_t *member_off, loff_t *chunk_left)
+{
+	const int shift = virt_dev->stripe_shift;
+	const loff_t in_chunk = loff & ((1LL << shift) - 1);
+	u64 row = loff >> shift;
+	int idx;
+
+	idx = do_div(row, virt_dev->stripe_cnt);
+	*member_off = ((loff_t)row << shift) + in_chunk;
+	*chunk_left = (1LL << shift) - in_chunk;
+	return idx;
+}
+
+/*
+ * Returns 0 on success and the capacity of striped device @virt_dev in
+ * *file_size: the size of the smallest member rounded down to the chunk
+ * size, multiplied by the number of members. Error code otherwise.
+ */
+static int vdisk_stripe_get_size(const struct scst_vdisk_dev *virt_dev,
+	loff_t *file_size)
+{
+	loff_t size, min_size = 0;
+	int i, res = 0;
+
+	TRACE_ENTRY();
+
+	for (i = 0; i < virt_dev->stripe_cnt; i++) {
+		res = vdisk_get_file_size(virt_dev->stripe[i].filename, true,
+				&size);
+		if (res != 0)
+			goto out;
+		if ((i == 0) || (size < min_size))
+			min_size = size;
+	}
+
+	min_size &= ~((1LL << virt_dev->stripe_shift) - 1);
+	*file_size = min_size * virt_dev->stripe_cnt;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static void vdisk_stripe_close(struct scst_vdisk_dev *virt_dev)
+{
+	int i;
+
+	for (i = 0; i < virt_dev->stripe_cnt; i++) {
+		struct vdisk_stripe_member *m = &virt_dev->stripe[i];
+
+		if (m->fd != NULL) {
+			filp_close(m->fd, NULL);
+			m->fd = NULL;
+			m->bdev = NULL;
+		}
+	}
+	virt_dev->fd = NULL;
+	virt_dev->bdev = NULL;
+	return;
+}
+
+static int vdisk_stripe_open(struct scst_vdisk_dev *virt_dev, bool read_only)
+{
+	int i, res = 0;
+
+	TRACE_ENTRY();
+
+	for (i = 0; i < virt_dev->stripe_cnt; i++) {
+		struct vdisk_stripe_member *m = &virt_dev->stripe[i];
+		struct file *fd;
+
+		fd = vdev_open_fd(virt_dev, m->filename, read_only);
+		if (IS_ERR(fd)) {
+			res = PTR_ERR(fd);
+			goto out_close;
+		}
+		m->fd = fd;
+
+		if (!S_ISBLK(file_inode(fd)->i_mode)) {
+			PRINT_ERROR("%s is NOT a block device", m->filename);
+			res = -EINVAL;
+			goto out_close;
+		}
+		m->bdev = file_inode(fd)->i_bdev;
+	}
+
+	virt_dev->fd = virt_dev->stripe[0].fd;
+	virt_dev->bdev = virt_dev->stripe[0].bdev;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_close:
+	vdisk_stripe_close(virt_dev);
+	goto out;
+}
+
+/* Synchronously flushes caches of all members of @virt_dev */
+static int vdisk_stripe_flush(struct scst_vdisk_dev *virt_dev, gfp_t gfp_mask)
+{
+	int i, rc, res = 0;
+
+	for (i = 0; i < virt_dev->stripe_cnt; i++) {
+		rc = vdisk_blockio_flush(virt_dev->stripe[i].bdev, gfp_mask,
+				true, NULL, false);
+		if (rc != 0)
+			res = rc;
+	}
+	return res;
+}
+
+/*
+ * Returns true, if all members of @virt_dev support discards, and sets
+ * unmap parameters of @virt_dev suitable for all of them.
+ */
+static bool vdisk_stripe_check_discard(struct scst_vdisk_dev *virt_dev)
+{
+	bool res = false;
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 32) || \
+	(defined(RHEL_MAJOR) && RHEL_MAJOR -0 >= 6)
+	int block_shift = virt_dev->dev->block_shift;
+	uint32_t gran = 1, max_lba_cnt = UINT_MAX;
+	bool zeroes = true;
+	int i;
+
+	TRACE_ENTRY();
+
+	for (i = 0; i < virt_dev->stripe_cnt; i++) {
+		const char *name = virt_dev->stripe[i].filename;
+		struct request_queue *q;
+		struct inode *inode;
+		struct file *fd;
+
+		fd = filp_open(name, O_LARGEFILE, 0600);
+		if (IS_ERR(fd)) {
+			PRINT_ERROR("filp_open(%s) failed: %ld", name,
+				PTR_ERR(fd));
+			goto out;
+		}
+
+		inode = file_inode(fd);
+		if (!S_ISBLK(inode->i_mode)) {
+			PRINT_ERROR("%s is NOT a block device", name);
+			filp_close(fd, NULL);
+			goto out;
+		}
+
+		q = bdev_get_queue(inode->i_bdev);
+		if (!blk_queue_discard(q)) {
+			filp_close(fd, NULL);
+			goto out;
+		}
+
+		gran = max_t(uint32_t, gran,
+			q->limits.discard_granularity >> block_shift);
+		/* Each member gets at most the whole range */
+		max_lba_cnt = min_t(uint32_t, max_lba_cnt,
+			q->limits.max_discard_sectors >> (block_shift - 9));
+		zeroes &= q->limits.discard_zeroes_data;
+
+		filp_close(fd, NULL);
+	}
+
+	virt_dev->unmap_opt_gran = gran;
+	virt_dev->unmap_align = 0;
+	virt_dev->unmap_max_lba_cnt = max_lba_cnt;
+	virt_dev->discard_zeroes_data = zeroes;
+	res = true;
+
+out:
+	TRACE_EXIT_RES(res);
+#endif
+	return res;
+}
+
+#ifndef CONFIG_SCST_PROC
+/*
+ * Splits the comma separated members list in the file name of striped device
+ * @virt_dev. The chunk size must be already set.
+ */
+static int vdisk_stripe_init(struct scst_vdisk_dev *virt_dev)
+{
+	const char *p, *e;
+	int i, cnt, res;
+
+	TRACE_ENTRY();
+
+	for (p = virt_dev->filename, cnt = 1; *p != '\0'; p++)
+		if (*p == ',')
+			cnt++;
+
+	if ((cnt < 2) || (cnt > VDISK_STRIPE_MAX_MEMBERS)) {
+		PRINT_ERROR("Striped device %s must have from 2 to %d members, "
+			"%d specified", virt_dev->name,
+			VDISK_STRIPE_MAX_MEMBERS, cnt);
+		res = -EINVAL;
+		goto out;
+	}
+
+	if (virt_dev->stripe_shift < virt_dev->blk_shift) {
+		PRINT_ERROR("Stripe chunk size %d must not be less than block "
+			"size %d (device %s)", 1 << virt_dev->stripe_shift,
+			1 << virt_dev->blk_shift, virt_dev->name);
+		res = -EINVAL;
+		goto out;
+	}
+
+	virt_dev->stripe = kcalloc(cnt, sizeof(*virt_dev->stripe),
+				GFP_KERNEL);
+	if (virt_dev->stripe == NULL) {
+		PRINT_ERROR("Unable to allocate stripe members (device %s)",
+			virt_dev->name);
+		res = -ENOMEM;
+		goto out;
+	}
+	virt_dev->stripe_cnt = cnt;
+
+	for (p = virt_dev->filename, i = 0; i < cnt; i++, p = e + 1) {
+		e = strchr(p, ',');
+		if (e == NULL)
+			e = p + strlen(p);
+		if (*p != '/') {
+			PRINT_ERROR("Stripe member %.*s must be global "
+				"(device %s)", (int)(e - p), p, virt_dev->name);
+			res = -EINVAL;
+			goto out;
+		}
+		virt_dev->stripe[i].filename = kstrndup(p, e - p, GFP_KERNEL);
+		if (virt_dev->stripe[i].filename == NULL) {
+			res = -ENOMEM;
+			goto out;
+		}
+	}
+
+	res = 0;
+
+out:
+	/* On error members freed by vdev_destroy() */
+	TRACE_EXIT_RES(res);
+	return res;
+}
+#endif
+
+/* scst_vdisk_mutex supposed to be held */
+static struct scst_vdisk_dev *vdev_find(const char *name)
+{
+	struct scst_vdisk_dev *res, *vv;
+
+	TRACE_ENTRY();
+
+	res = NULL;
+	list_for_each_entry(vv, &vdev_list, vdev_list_entry) {
+		if (strcmp(vv->name, name) == 0) {
+			res = vv;
+			break;
+		}
+	}
+
+	TRACE_EXIT_HRES((unsigned long)res);
+	return res;
+}
+
+#define VDEV_WT_LABEL			"WRITE_THROUGH"
+#define VDEV_MODE_PAGES_BUF_SIZE	(64*1024)
+#define VDEV_MODE_PAGES_DIR		(SCST_VAR_DIR "/vdev_mode_pages")
+
+static int __vdev_save_mode_pages(const struct scst_vdisk_dev *virt_dev,
+	uint8_t *buf, int size)
+{
+	int res = 0;
+
+	TRACE_ENTRY();
+
+	if (virt_dev->wt_flag != DEF_WRITE_THROUGH) {
+		res += scnprintf(&buf[res], size - res, "%s=%d\n",
+			VDEV_WT_LABEL, virt_dev->wt_flag);
+		if (res >= size-1)
+			goto out_overflow;
+	}
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_overflow:
+	PRINT_ERROR("Mode pages buffer overflow (size %d)", size);
+	res = -EOVERFLOW;
+	goto out;
+}
+
+static int vdev_save_mode_pages(const struct scst_vdisk_dev *virt_dev)
+{
+	int res, rc, offs;
+	uint8_t *buf;
+	int size;
+	char *name, *name1;
+
+	TRACE_ENTRY();
+
+	size = VDEV_MODE_PAGES_BUF_SIZE;
+
+	buf = vzalloc(size);
+	if (buf == NULL) {
+		PRINT_ERROR("Unable to alloc mode pages buffer (size %d)", size);
+		res = -ENOMEM;
+		goto out;
+	}
+
+	name = kasprintf(GFP_KERNEL, "%s/%s", VDEV_MODE_PAGES_DIR, virt_dev->name);
+	if (name == NULL) {
+		PRINT_ERROR("Unable to create name %s/%s", VDEV_MODE_PAGES_DIR,
+			virt_dev->name);
+		res = -ENOMEM;
+		goto out_vfree;
+	}
+
+	name1 = kasprintf(GFP_KERNEL, "%s/%s1", VDEV_MODE_PAGES_DIR, virt_dev->name);
+	if (name1 == NULL) {
+		PRINT_ERROR("Unable to create name %s/%s1", VDEV_MODE_PAGES_DIR,
+			virt_dev->name);
+		res = -ENOMEM;
+		goto out_free_name;
+	}
+
+	offs = scst_save_global_mode_pages(virt_dev->dev, buf, size);
+	if (offs < 0) {
+		res = offs;
+		goto out_free_name1;
+	}
+
+	rc = __vdev_save_mode_pages(virt_dev, &buf[offs], size - offs);
+	if (rc < 0) {
+		res = rc;
+		goto out_free_name1;
+	}
+
+	offs += rc;
+	if (offs == 0) {
+		res = 0;
+		scst_remove_file(name);
+		scst_remove_file(name1);
+		goto out_free_name1;
+	}
+
+	res = scst_write_file_transactional(name, name1,
+			virt_dev->name, strlen(virt_dev->name), buf, offs);
+
+out_free_name1:
+	kfree(name1);
+
+out_free_name:
+	kfree(name);
+
+out_vfree:
+	vfree(buf);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static int vdev_restore_wt(struct scst_vdisk_dev *virt_dev, unsigned int val)
+{
+	int res;
+
+	TRACE_ENTRY();
+
+	if (val > 1) {
+		PRINT_ERROR("Invalid value %d for parameter %s (device %s)",
+			val, VDEV_WT_LABEL, virt_dev->name);
+		res = -EINVAL;
+		goto out;
+	}
+
+	virt_dev->wt_flag = val;
+	virt_dev->wt_flag_saved = val;
+
+	PRINT_INFO("WT_FLAG restored to %d for vdev %s", virt_dev->wt_flag,
+		virt_dev->name);
+
+	res = 0;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* Params are NULL-terminated */
+static int __vdev_load_mode_pages(struct scst_vdisk_dev *virt_dev, char *params)
+{
+	int res = 0;
+	char *param, *p, *pp;
+	unsigned long val;
+
+	TRACE_ENTRY();
+
+	while (1) {
+		param = scst_get_next_token_str(&params);
+		if (param == NULL)
+			break;
+
+		p = scst_get_next_lexem(&param);
+		if (*p == '\0')
+			break;
+
+		pp = scst_get_next_lexem(&param);
+		if (*pp == '\0')
+			goto out_need_param;
+
+		if (scst_get_next_lexem(&param)[0] != '\0')
+			goto out_too_many;
+
+		res = kstrtoul(pp, 0, &val);
+		if (res != 0)
+			goto out_strtoul_failed;
+
+		if (strcasecmp(VDEV_WT_LABEL, p) == 0)
+			res = vdev_restore_wt(virt_dev, val);
+		else {
+			TRACE_DBG("Unknown parameter %s", p);
+			res = -EINVAL;
+		}
+		if (res != 0)
+			break;
+	}
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_strtoul_failed:
+	PRINT_ERROR("strtoul() for %s failed: %d (device %s)", pp, res,
+		virt_dev->name);
+	goto out;
+
+out_need_param:
+	PRINT_ERROR("Parameter %s value missed for device %s", p, virt_dev->name);
+	res = -EINVAL;
+	goto out;
+
+out_too_many:
+	PRINT_ERROR("Too many parameter's %s values (device %s)", p, virt_dev->name);
+	res = -EINVAL;
+	goto out;
+}
+
+static int vdev_load_mode_pages(struct scst_vdisk_dev *virt_dev)
+{
+	int res;
+	struct scst_device *dev = virt_dev->dev;
+	uint8_t *buf;
+	int size;
+	char *name, *name1, *params;
+
+	TRACE_ENTRY();
+
+	size = VDEV_MODE_PAGES_BUF_SIZE;
+
+	buf = vzalloc(size);
+	if (buf == NULL) {
+		PRINT_ERROR("Unable to alloc mode pages buffer (size %d)", size);
+		res = -ENOMEM;
+		goto out;
+	}
+
+	name = kasprintf(GFP_KERNEL, "%s/%s", VDEV_MODE_PAGES_DIR, virt_dev->name);
+	if (name == NULL) {
+		PRINT_ERROR("Unable to create name %s/%s", VDEV_MODE_PAGES_DIR,
+			virt_dev->name);
+		res = -ENOMEM;
+		goto out_vfree;
+	}
+
+	name1 = kasprintf(GFP_KERNEL, "%s/%s1", VDEV_MODE_PAGES_DIR, virt_dev->name);
+	if (name1 == NULL) {
+		PRINT_ERROR("Unable to create name %s/%s1", VDEV_MODE_PAGES_DIR,
+			virt_dev->name);
+		res = -ENOMEM;
+		goto out_free_name;
+	}
+
+	size = scst_read_file_transactional(name, name1,
+			virt_dev->name, strlen(virt_dev->name), buf, size-1);
+	if (size <= 0) {
+		res = size;
+		goto out_free_name1;
+	}
+
+	buf[size-1] = '\0';
+
+	res = scst_restore_global_mode_pages(dev, &buf[strlen(virt_dev->name)+1],
+				&params);
+	if ((res != 0) || (params == NULL))
+		goto out_free_name1;
+
+	res = __vdev_load_mode_pages(virt_dev, params);
+
+out_free_name1:
+	kfree(name1);
+
+out_free_name:
+	kfree(name);
+
+out_vfree:
+	vfree(buf);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+#if defined(CONFIG_BLK_DEV_INTEGRITY)
+static int vdisk_init_block_integrity(struct scst_vdisk_dev *virt_dev)
+{
+	int res;
+	struct scst_device *dev = virt_dev->dev;
+	struct inode *inode;
+	struct file *fd;
+	struct blk_integrity *bi;
+	const char *bi_profile_name;
+
+	TRACE_ENTRY();
+
+	fd = vdev_open_fd(virt_dev, virt_dev->filename, virt_dev->rd_only);
+	if (IS_ERR(fd)) {
+		res = -EINVAL;
+		goto out;
+	}
+
+	inode = file_inode(fd);
+
+	if (!S_ISBLK(inode->i_mode)) {
+		PRINT_ERROR("%s is NOT a block device!", virt_dev->filename);
+		res = -EINVAL;
+		goto out_close;
+	}
+
+	bi = bdev_get_integrity(inode->i_bdev);
+	if (bi == NULL) {
+		TRACE_DBG("Block integrity not supported");
+		goto out_no_bi;
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+	bi_profile_name = bi->name;
+#else
+	bi_profile_name = bi->profile->name;
+#endif
+	TRACE_DBG("BI name %s", bi_profile_name);
+
+	if (!strcmp(bi_profile_name, "T10-DIF-TYPE1-CRC")) {
+		dev->dev_dif_ip_not_supported = 1;
+		if (virt_dev->dif_type != 1) {
+			PRINT_ERROR("Integrity type mismatch, %d expected, "
+				"but block device has 1 (dev %s)",
+				virt_dev->dif_type, dev->virt_name);
+			res = -EINVAL;
+			goto out_close;
+		}
+	} else if (!strcmp(bi_profile_name, "T10-DIF-TYPE1-IP")) {
+		if (virt_dev->dif_type != 1) {
+			PRINT_ERROR("Integrity type mismatch, %d expected, "
+				"but block device has 1 (dev %s)",
+				virt_dev->dif_type, dev->virt_name);
+			res = -EINVAL;
+			goto out_close;
+		}
+	} else if (!strcmp(bi_profile_name, "T10-DIF-TYPE3-CRC")) {
+		dev->dev_dif_ip_not_supported = 1;
+		if (virt_dev->dif_type != 3) {
+			PRINT_ERROR("Integrity type mismatch, %d expected, "
+				"but block device has 1 (dev %s)",
+				virt_dev->dif_type, dev->virt_name);
+			res = -EINVAL;
+			goto out_close;
+		}
+	} else if (!strcmp(bi_profile_name, "T10-DIF-TYPE3-IP")) {
+		if (virt_dev->dif_type != 3) {
+			PRINT_ERROR("Integrity type mismatch, %d expected, "
+				"but block device has 3 (dev %s)",
+				virt_dev->dif_type, dev->virt_name);
+			res = -EINVAL;
+			goto out_close;
+		}
+	} else {
+		PRINT_ERROR("Unable to understand integrity name %s"
+			"(dev %s)", bi_profile_name, dev->virt_name);
+		res = -EINVAL;
+		goto out_close;
+	}
+
+	virt_dev->blk_integrity = 1;
+
+	if ((virt_dev->dif_mode & SCST_DIF_MODE_DEV_CHECK) &&
+	    !(virt_dev->dif_mode & SCST_DIF_MODE_DEV_STORE)) {
+		PRINT_ERROR("Blockio dev_check is not possible without "
+			"dev_store (dev %s)", dev->virt_name);
+		res = -EINVAL;
+		goto out_close;
+	}
+
+	if (!(virt_dev->dif_mode & SCST_DIF_MODE_DEV_CHECK))
+		PRINT_WARNING("Blk integrity implies dev_check (dev %s)",
+			dev->virt_name);
+
+out_no_bi:
+	res = 0;
+
+out_close:
+	filp_close(fd, NULL);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+#else /* defined(CONFIG_BLK_DEV_INTEGRITY) */
+static int vdisk_init_block_integrity(struct scst_vdisk_dev *virt_dev)
+{
+	PRINT_ERROR("Kernel does not support block device integrity");
+	return -EINVAL;
+}
+#endif /* defined(CONFIG_BLK_DEV_INTEGRITY) */
+
+/*
+ * Reexamine size, flush support and thin provisioning support for
+ * vdisk_fileio, vdisk_blockio and vdisk_cdrom devices. Do not modify the size
+ * of vdisk_nullio and vdisk_ramdisk devices.
+ */
+static int vdisk_reexamine(struct scst_vdisk_dev *virt_dev)
+{
+	int res = 0;
+
+	if (!virt_dev->nullio && !virt_dev->cdrom_empty) {
+		loff_t file_size;
+
+		if (virt_dev->cow)
+			res = vdisk_cow_get_size(virt_dev->filename, false,
+						 &file_size);
+		else if (virt_dev->stripe_cnt != 0)
+			res = vdisk_stripe_get_size(virt_dev, &file_size);
+		else
+			res = vdisk_get_file_size(virt_dev->filename,
+						  virt_dev->blockio, &file_size);
+		if (res < 0) {
+			if ((res == -EMEDIUMTYPE) && virt_dev->blockio) {
+				TRACE_DBG("Reexam pending (dev %s)", virt_dev->name);
+				virt_dev->reexam_pending = 1;
+				res = 0;
+			}
+			goto out;
+		}
+		virt_dev->file_size = file_size;
+		vdisk_blockio_check_flush_support(virt_dev);
+		vdisk_check_tp_support(virt_dev);
+	} else if (virt_dev->ramdisk) {
+		vdisk_check_tp_support(virt_dev);
+	} else if (virt_dev->cdrom_empty) {
+		virt_dev->file_size = 0;
+	}
+
+	virt_dev->nblocks = virt_dev->file_size >> virt_dev->blk_shift;
+
+out:
+	return res;
+}
+
+static int vdisk_attach(struct scst_device *dev)
+{
+	int res = 0;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	TRACE_DBG("virt_id %d (%s)", dev->virt_id, dev->virt_name);
+
+	if (dev->virt_id == 0) {
+		PRINT_ERROR("%s", "Not a virtual device");
+		res = -EINVAL;
+		goto out;
+	}
+
+	/*
+	 * scst_vdisk_mutex must be already taken before
+	 * scst_register_virtual_device()
+	 */
+	virt_dev = vdev_find(dev->virt_name);
+	if (virt_dev == NULL) {
+		PRINT_ERROR("Device %s not found", dev->virt_name);
+		res = -EINVAL;
+		goto out;
+	}
+
+	virt_dev->dev = dev;
+
+	dev->block_shift = virt_dev->blk_shift;
+	dev->block_size = 1 << dev->block_shift;
+	dev->cluster_mode = virt_dev->initial_cluster_mode;
+
+	if ((virt_dev->dif_type == 0) &&
+	    ((virt_dev->dif_mode != SCST_DIF_MODE_NONE) ||
+	     (virt_dev->dif_filename != NULL))) {
+		PRINT_ERROR("Device %s cannot have DIF TYPE 0 if DIF MODE is "
+			"not NONE or DIF FILENAME is not NULL", virt_dev->name);
+		res = -EINVAL;
+		goto out;
+	}
+
+	if (virt_dev->blockio) {
+		if (!(virt_dev->dif_mode & SCST_DIF_MODE_DEV))
+			goto next;
+
+		if (virt_dev->stripe_cnt != 0) {
+			if (virt_dev->dif_mode & SCST_DIF_MODE_DEV_CHECK) {
+				PRINT_ERROR("dev_check not supported for "
+					"striped devices (dev %s)!",
+					dev->virt_name);
+				res = -EINVAL;
+				goto out;
+			}
+			/* DIF tags can only be stored in dif_filename */
+			goto next;
+		}
+
+		res = vdisk_init_block_integrity(virt_dev);
+		if (res != 0)
+			goto out;
+	} else if (virt_dev->dif_mode & SCST_DIF_MODE_DEV_CHECK) {
+		PRINT_ERROR("dev_check supported only for BLOCKIO devices "
+			"(dev %s)!", dev->virt_name);
+		res = -EINVAL;
+		goto out;
+	}
+
+next:
+	if ((virt_dev->dif_mode & SCST_DIF_MODE_DEV_STORE) &&
+	    (virt_dev->dif_filename == NULL) && !virt_dev->blk_integrity) {
+		virt_dev->dif_filename = kasprintf(GFP_KERNEL,
+				DEF_DIF_FILENAME_TMPL, dev->virt_name);
+		if (virt_dev->dif_filename == NULL) {
+			PRINT_ERROR("Allocation of default dif_filename "
+				"failed (dev %s)", dev->virt_name);
+			res = -ENOMEM;
+			goto out;
+		}
+	}
+
+	if (virt_dev->dif_filename != NULL) {
+		/* Check if it can be used */
+		struct file *dfd = vdev_open_fd(virt_dev, virt_dev->dif_filename,
+					virt_dev->rd_only);
+		if (IS_ERR(dfd)) {
+			res = PTR_ERR(dfd);
+			goto out;
+		}
+		filp_close(dfd, NULL);
+	}
+
+	res = scst_set_dif_params(dev, virt_dev->dif_mode, virt_dev->dif_type);
+	if (res != 0)
+		goto out;
+
+	if (virt_dev->dif_type != 2)
+		scst_dev_set_dif_static_app_tag_combined(dev,
+			virt_dev->dif_static_app_tag_combined);
+	else if (virt_dev->dif_static_app_tag_combined != SCST_DIF_NO_CHECK_APP_TAG)
+		PRINT_WARNING("Device %s: static app tag is ignored for DIF "
+			"mode 2", dev->virt_name);
+
+#ifndef CONFIG_SCST_PROC
+	if (virt_dev->dif_filename != NULL) {
+		res = scst_create_dev_attr(dev, &vdev_dif_filename_attr);
+		if (res != 0) {
+			PRINT_ERROR("Can't create attr %s for dev %s",
+				vdev_dif_filename_attr.attr.name,
+				dev->virt_name);
+			goto out;
+		}
+	}
+#endif
+
+	if (virt_dev->zero_copy && virt_dev->o_direct_flag) {
+		PRINT_ERROR("%s: combining zero_copy with o_direct is not"
+			    " supported", virt_dev->filename);
+		res = -EINVAL;
+		goto out;
+	}
+
+	if (virt_dev->cow && (virt_dev->zero_copy || virt_dev->o_direct_flag)) {
+		PRINT_ERROR("%s: zero_copy and o_direct are not supported for"
+			    " COW images", virt_dev->filename);
+		res = -EINVAL;
+		goto out;
+	}
+
+	if ((virt_dev->cache_filename != NULL) &&
+	    (virt_dev->zero_copy || virt_dev->o_direct_flag)) {
+		PRINT_ERROR("%s: zero_copy and o_direct are not supported for"
+			    " cached devices", virt_dev->filename);
+		res = -EINVAL;
+		goto out;
+	}
+
+#ifndef CONFIG_SCST_PROC
+	if (virt_dev->cache_filename != NULL) {
+		static struct kobj_attribute *cache_attrs[] = {
+			&vdisk_cache_filename_attr,
+			&vdisk_cache_block_kb_attr,
+			&vdisk_cache_seq_cutoff_kb_attr,
+			&vdisk_cache_stats_attr,
+		};
+		int i;
+
+		for (i = 0; i < ARRAY_SIZE(cache_attrs); i++) {
+			res = scst_create_dev_attr(dev, cache_attrs[i]);
+			if (res != 0) {
+				PRINT_ERROR("Can't create attr %s for dev %s",
+					cache_attrs[i]->attr.name,
+					dev->virt_name);
+				goto out;
+			}
+		}
+	}
+#endif
+
+	dev->dev_rd_only = virt_dev->rd_only;
+
+	res = vdisk_reexamine(virt_dev);
+	if (res < 0)
+		goto out;
+
+	if (!virt_dev->cdrom_empty) {
+		PRINT_INFO("Attached SCSI target virtual %s %s "
+		      "(file=\"%s\", fs=%lldMB, bs=%d, nblocks=%lld,"
+		      " cyln=%lld%s)",
+		      (dev->type == TYPE_DISK) ? "disk" : "cdrom",
+		      virt_dev->name, vdev_get_filename(virt_dev),
+		      virt_dev->file_size >> 20, dev->block_size,
+		      (unsigned long long int)virt_dev->nblocks,
+		      (unsigned long long int)virt_dev->nblocks/64/32,
+		      virt_dev->nblocks < 64*32
+		      ? " !WARNING! cyln less than 1" : "");
+	} else {
+		PRINT_INFO("Attached empty SCSI target virtual cdrom %s",
+			virt_dev->name);
+	}
+
+	if (virt_dev->blockio) {
+		res = vdisk_ra_create(virt_dev);
+		if (res != 0)
+			goto out;
+	}
+
+	dev->dh_priv = virt_dev;
+
+	dev->tst = virt_dev->tst;
+	dev->tmf_only = DEF_TMF_ONLY;
+	dev->tmf_only_saved = DEF_TMF_ONLY;
+	dev->tmf_only_default = DEF_TMF_ONLY;
+	dev->d_sense = DEF_DSENSE;
+	dev->d_sense_saved = DEF_DSENSE;
+	dev->d_sense_default = DEF_DSENSE;
+	if (virt_dev->wt_flag && !virt_dev->nv_cache)
+		dev->queue_alg = DEF_QUEUE_ALG_WT;
+	else
+		dev->queue_alg = DEF_QUEUE_ALG;
+	dev->queue_alg_saved = dev->queue_alg;
+	dev->queue_alg_default = dev->queue_alg;
+	dev->qerr = DEF_QERR;
+	dev->qerr_saved = DEF_QERR;
+	dev->qerr_default = DEF_QERR;
+	dev->swp = DEF_SWP;
+	dev->swp_saved = DEF_SWP;
+	dev->swp_default = DEF_SWP;
+	dev->tas = DEF_TAS;
+	dev->tas_saved = DEF_TAS;
+	dev->tas_default = DEF_TAS;
+	dev->dpicz = DEF_DPICZ;
+	dev->dpicz_saved = DEF_DPICZ;
+	dev->dpicz_default = DEF_DPICZ;
+	if ((virt_dev->dif_filename == NULL) && !virt_dev->blk_integrity)
+		dev->ato = SCST_ATO_0_MODIFIED_BY_STORAGE;
+	else
+		dev->ato = SCST_ATO_1_NOT_MODIFIED_BY_STORAGE;
+
+	if (vdev_saved_mode_pages_enabled)
+		vdev_load_mode_pages(virt_dev);
+
+	res = scst_pr_set_cluster_mode(dev, dev->cluster_mode,
+				       virt_dev->t10_dev_id);
+	if ((res != 0) && (virt_dev->ra != NULL)) {
+		vdisk_ra_destroy(virt_dev->ra);
+		virt_dev->ra = NULL;
+	}
+
+out:
+	TRACE_EXIT();
+	return res;
+}
+
+/* scst_mutex supposed to be held */
+static void vdisk_detach(struct scst_device *dev)
+{
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+
+	TRACE_ENTRY();
+
+	lockdep_assert_held(&scst_mutex);
+
+	TRACE_DBG("virt_id %d", dev->virt_id);
+
+	scst_pr_set_cluster_mode(dev, false, virt_dev->t10_dev_id);
+
+	PRINT_INFO("Detached virtual device %s (\"%s\")",
+		      virt_dev->name, vdev_get_filename(virt_dev));
+
+	if (virt_dev->ra != NULL) {
+		vdisk_ra_destroy(virt_dev->ra);
+		virt_dev->ra = NULL;
+	}
+
+	/* virt_dev will be freed by the caller */
+	dev->dh_priv = NULL;
+
+	TRACE_EXIT();
+	return;
+}
+
+static int vdisk_open_fd(struct scst_vdisk_dev *virt_dev, bool read_only)
+{
+	int res;
+
+	sBUG_ON(!virt_dev->filename);
+
+	if (virt_dev->stripe_cnt != 0) {
+		res = vdisk_stripe_open(virt_dev, read_only);
+		if (res != 0)
+			goto out;
+		goto open_dif;
+	}
+
+	virt_dev->fd = vdev_open_fd(virt_dev, virt_dev->filename, read_only);
+	if (IS_ERR(virt_dev->fd)) {
+		res = PTR_ERR(virt_dev->fd);
+		virt_dev->fd = NULL;
+		goto out;
+	}
+	virt_dev->bdev = virt_dev->blockio ? file_inode(virt_dev->fd)->i_bdev :
+		NULL;
+	res = 0;
+
+open_dif:
+	if (virt_dev->dif_filename != NULL) {
+		virt_dev->dif_fd = vdev_open_fd(virt_dev,
+			virt_dev->dif_filename, read_only);
+		if (IS_ERR(virt_dev->dif_fd)) {
+			res = PTR_ERR(virt_dev->dif_fd);
+			virt_dev->dif_fd = NULL;
+			goto out_close_fd;
+		}
+	}
+
+	if (virt_dev->cow) {
+		virt_dev->cow_img = vdisk_cow_open_image(virt_dev->filename,
+					virt_dev->fd, read_only, 0);
+		if (IS_ERR(virt_dev->cow_img)) {
+			res = PTR_ERR(virt_dev->cow_img);
+			virt_dev->cow_img = NULL;
+			goto out_close_dif_fd;
+		}
+	}
+
+	if (virt_dev->cache_filename != NULL) {
+		virt_dev->cache = vdisk_cache_open(virt_dev);
+		if (IS_ERR(virt_dev->cache)) {
+			res = PTR_ERR(virt_dev->cache);
+			virt_dev->cache = NULL;
+			goto out_close_dif_fd;
+		}
+	}
+
+out:
+	return res;
+
+out_close_dif_fd:
+	if (virt_dev->dif_fd != NULL) {
+		filp_close(virt_dev->dif_fd, NULL);
+		virt_dev->dif_fd = NULL;
+	}
+
+out_close_fd:
+	if (virt_dev->stripe_cnt != 0) {
+		vdisk_stripe_close(virt_dev);
+		goto out;
+	}
+	filp_close(virt_dev->fd, NULL);
+	virt_dev->fd = NULL;
+	goto out;
+}
+
+static void vdisk_close_fd(struct scst_vdisk_dev *virt_dev)
+{
+	if (virt_dev->ra)
+		vdisk_ra_flush(virt_dev->ra);
+	if (virt_dev->cache) {
+		vdisk_cache_close(virt_dev->cache);
+		virt_dev->cache = NULL;
+	}
+	if (virt_dev->cow_img) {
+		vdisk_cow_close_image(virt_dev->cow_img);
+		virt_dev->cow_img = NULL;
+	}
+	if (virt_dev->stripe_cnt != 0)
+		vdisk_stripe_close(virt_dev);
+	else if (virt_dev->fd) {
+		filp_close(virt_dev->fd, NULL);
+		virt_dev->fd = NULL;
+		virt_dev->bdev = NULL;
+	}
+	if (virt_dev->dif_fd) {
+		filp_close(virt_dev->dif_fd, NULL);
+		virt_dev->dif_fd = NULL;
+	}
+}
+
+/* Invoked with scst_mutex held, so no further locking is necessary here. */
+static int vdisk_attach_tgt(struct scst_tgt_dev *tgt_dev)
+{
+	struct scst_vdisk_dev *virt_dev = tgt_dev->dev->dh_priv;
+	int res = 0;
+
+	TRACE_ENTRY();
+
+	lockdep_assert_held(&scst_mutex);
+
+	virt_dev->tgt_dev_cnt++;
+
+	if (virt_dev->fd != NULL)
+		goto out;
+
+	if (!virt_dev->nullio && !virt_dev->cdrom_empty) {
+		res = vdisk_open_fd(virt_dev, tgt_dev->dev->dev_rd_only);
+		if (res != 0) {
+			if ((res == -EMEDIUMTYPE) && virt_dev->blockio) {
+				/* It's OK, it will be reopen on exec */
+				res = 0;
+			} else {
+				virt_dev->tgt_dev_cnt--;
+				goto out;
+			}
+		}
+	} else {
+		virt_dev->fd = NULL;
+		virt_dev->dif_fd = NULL;
+	}
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* Invoked with scst_mutex held, so no further locking is necessary here. */
+static void vdisk_detach_tgt(struct scst_tgt_dev *tgt_dev)
+{
+	struct scst_vdisk_dev *virt_dev = tgt_dev->dev->dh_priv;
+
+	TRACE_ENTRY();
+
+	lockdep_assert_held(&scst_mutex);
+
+	if (--virt_dev->tgt_dev_cnt == 0)
+		vdisk_close_fd(virt_dev);
+
+	TRACE_EXIT();
+	return;
+}
+
+static enum compl_status_e vdisk_synchronize_cache(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	const uint8_t *cdb = cmd->cdb;
+	struct scst_device *dev = cmd->dev;
+	const loff_t loff = p->loff;
+	int64_t data_len = scst_cmd_get_data_len(cmd);
+	int immed = cdb[1] & 0x2;
+	enum compl_status_e res;
+
+	TRACE_ENTRY();
+
+	TRACE(TRACE_ORDER, "SYNCHRONIZE_CACHE: "
+	      "loff=%lld, data_len=%lld, immed=%d",
+	      (unsigned long long int)loff,
+	      (unsigned long long int)data_len, immed);
+
+	if (data_len == 0) {
+		struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+
+		data_len = virt_dev->file_size -
+			((loff_t)scst_cmd_get_lba(cmd) << dev->block_shift);
+	}
+
+	if (immed) {
+		scst_cmd_get(cmd); /* to protect dev */
+		cmd->completed = 1;
+		cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
+				   SCST_CONTEXT_SAME);
+		vdisk_fsync(loff, data_len, dev, cmd->cmd_gfp_mask, NULL, true);
+		/* ToDo: vdisk_fsync() error processing */
+		scst_cmd_put(cmd);
+		res = RUNNING_ASYNC;
+	} else {
+		vdisk_fsync(loff, data_len, dev, cmd->cmd_gfp_mask, cmd, true);
+		res = RUNNING_ASYNC;
+	}
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static enum compl_status_e vdisk_exec_start_stop(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+
+	TRACE_ENTRY();
+
+	vdisk_fsync(0, virt_dev->file_size, dev, cmd->cmd_gfp_mask, cmd, false);
+
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
+}
+
+static enum compl_status_e vdisk_nop(struct vdisk_cmd_params *p)
+{
+	return CMD_SUCCEEDED;
+}
+
+static enum compl_status_e vdisk_exec_sai_16(struct vdisk_cmd_params *p)
+{
+	switch (p->cmd->cdb[1] & 0x1f) {
+	case SAI_READ_CAPACITY_16:
+		vdisk_exec_read_capacity16(p);
+		return CMD_SUCCEEDED;
+	case SAI_GET_LBA_STATUS:
+		return vdisk_exec_get_lba_status(p);
+	}
+	scst_set_invalid_field_in_cdb(p->cmd, 1,
+			0 | SCST_INVAL_FIELD_BIT_OFFS_VALID);
+	return CMD_SUCCEEDED;
+}
+
+static enum compl_status_e vdisk_exec_maintenance_in(struct vdisk_cmd_params *p)
+{
+	switch (p->cmd->cdb[1] & 0x1f) {
+	case MI_REPORT_TARGET_PGS:
+		vdisk_exec_report_tpgs(p);
+		return CMD_SUCCEEDED;
+	}
+	scst_set_invalid_field_in_cdb(p->cmd, 1,
+			0 | SCST_INVAL_FIELD_BIT_OFFS_VALID);
+	return CMD_SUCCEEDED;
+}
+
+static enum compl_status_e vdisk_exec_maintenance_out(struct vdisk_cmd_params *p)
+{
+	switch (p->cmd->cdb[1] & 0x1f) {
+	case MO_SET_TARGET_PGS:
+		return vdisk_exec_set_tpgs(p);
+	}
+	scst_set_invalid_field_in_cdb(p->cmd, 1,
+			0 | SCST_INVAL_FIELD_BIT_OFFS_VALID);
+	return CMD_SUCCEEDED;
+}
+
+static enum compl_status_e vdisk_exec_send_diagnostic(struct vdisk_cmd_params *p)
+{
+	return CMD_SUCCEEDED;
+}
+
+static int vdisk_format_dif(struct scst_cmd *cmd, uint64_t start_lba,
+	uint64_t blocks)
+{
+	int res = 0;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	loff_t loff;
+	mm_segment_t old_fs;
+	loff_t err = 0;
+	ssize_t full_len;
+	struct file *fd = virt_dev->dif_fd;
+	struct iovec *iv;
+	int max_iv_count, iv_count, i;
+	struct page *iv_page, *data_page;
+	uint8_t *data_buf;
+	int64_t left, done;
+
+	TRACE_ENTRY();
+
+	if (virt_dev->dif_fd == NULL)
+		goto out;
+
+	EXTRACHECKS_BUG_ON(!(dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE));
+
+	iv_page = alloc_page(GFP_KERNEL);
+	if (iv_page == NULL) {
+		PRINT_ERROR("Unable to allocate iv page");
+		scst_set_busy(cmd);
+		res = -ENOMEM;
+		goto out;
+	}
+
+	data_page = alloc_page(GFP_KERNEL);
+	if (data_page == NULL) {
+		PRINT_ERROR("Unable to allocate tags data page");
+		scst_set_busy(cmd);
+		res = -ENOMEM;
+		goto out_free_iv;
+	}
+
+	data_buf = page_address(data_page);
+	memset(data_buf, 0xFF, PAGE_SIZE);
+
+	iv = page_address(iv_page);
+	max_iv_count = min_t(int, UIO_MAXIOV, (int)PAGE_SIZE/sizeof(*iv));
+
+	for (i = 0; i < max_iv_count; i++)
+		iv[i].iov_base = (uint8_t __force __user *)data_buf;
+
+	old_fs = get_fs();
+	set_fs(get_ds());
+
+	loff = start_lba << SCST_DIF_TAG_SHIFT;
+	left = blocks << SCST_DIF_TAG_SHIFT;
+	done = 0;
+	while (left > 0) {
+		iv_count = 0;
+		full_len = 0;
+		i = -1;
+		while (1) {
+			int len = min_t(size_t, (size_t)left, PAGE_SIZE);
+
+			full_len += len;
+			i++;
+			iv_count++;
+			iv[i].iov_len = len;
+			left -= len;
+			done += len;
+			EXTRACHECKS_BUG_ON(left < 0);
+			if ((iv_count == max_iv_count) || (left == 0))
+				break;
+		}
+
+		TRACE_DBG("Formatting DIF: full_len %zd, off %lld",
+			full_len, (long long)loff);
+
+		/* WRITE */
+		err = vfs_writev(fd, (struct iovec __force __user *)iv, iv_count,
+				 &loff);
+		if (err < 0) {
+			PRINT_ERROR("Formatting DIF write() returned %lld from "
+				"%zd", (long long)err, full_len);
+			if (err == -EAGAIN)
+				scst_set_busy(cmd);
+			else
+				scst_set_cmd_error(cmd,
+				    SCST_LOAD_SENSE(scst_sense_write_error));
+			res = err;
+			goto out_set_fs;
+		} else if (err < full_len) {
+			/*
+			 * Probably that's wrong, but sometimes write() returns
+			 * value less, than requested. Let's restart.
+			 */
+			left += full_len - err;
+			done -= full_len - err;
+		}
+
+		virt_dev->format_progress_done = done;
+	};
+
+out_set_fs:
+	set_fs(old_fs);
+
+	__free_page(data_page);
+
+out_free_iv:
+	__free_page(iv_page);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static enum compl_status_e vdisk_exec_format_unit(struct vdisk_cmd_params *p)
+{
+	int res = CMD_SUCCEEDED;
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	uint8_t *buf;
+	int prot_type = dev->dev_dif_type, pinfo;
+	bool immed = false;
+
+	TRACE_ENTRY();
+
+	pinfo = (cmd->cdb[1] & 0xC0) >> 6;
+	if (((cmd->cdb[1] & 0x10) == 0) && (pinfo != 0)) {
+		/* FMTDATA zero and FMTPINFO not zero are illegal */
+		scst_set_invalid_field_in_cdb(cmd, 1,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 6);
+		goto out;
+	}
+
+	if (cmd->cdb[1] & 0x10) { /* FMTDATA */
+		int length, prot_usage;
+
+		length = scst_get_buf_full_sense(cmd, &buf);
+		TRACE_DBG("length %d", length);
+		if (unlikely(length <= 0))
+			goto out;
+
+		TRACE_BUFF_FLAG(TRACE_DEBUG, "Format buf", buf, 64);
+
+		if (length < 4) {
+			PRINT_ERROR("FORMAT UNIT: too small parameters list "
+				"header %d (dev %s)", length, dev->virt_name);
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_parameter_list_length_invalid));
+			goto out_put;
+		}
+
+		prot_usage = buf[0] & 7;
+		immed = buf[1] & 2;
+
+		if ((buf[1] & 8) != 0) {
+			PRINT_ERROR("FORMAT UNIT: initialization pattern not "
+				"supported");
+			scst_set_invalid_field_in_parm_list(cmd, 1,
+				SCST_INVAL_FIELD_BIT_OFFS_VALID | 3);
+			goto out_put;
+		}
+
+		if (cmd->cdb[1] & 0x20) { /* LONGLIST */
+			if (length < 8) {
+				PRINT_ERROR("FORMAT UNIT: too small long "
+					"parameters list header %d (dev %s)",
+					length, dev->virt_name);
+				scst_set_invalid_field_in_cdb(cmd, 1,
+					SCST_INVAL_FIELD_BIT_OFFS_VALID | 5);
+				goto out_put;
+			}
+			if ((buf[3] & 0xF0) != 0) {
+				PRINT_ERROR("FORMAT UNIT: P_I_INFORMATION must "
+					"be 0 (dev %s)", dev->virt_name);
+				scst_set_invalid_field_in_parm_list(cmd, 3,
+					SCST_INVAL_FIELD_BIT_OFFS_VALID | 4);
+				goto out_put;
+			}
+			if ((buf[3] & 0xF) != 0) {
+				PRINT_ERROR("FORMAT UNIT: PROTECTION INTERVAL "
+					"EXPONENT %d not supported (dev %s)",
+					buf[3] & 0xF, dev->virt_name);
+				scst_set_invalid_field_in_parm_list(cmd, 3,
+					SCST_INVAL_FIELD_BIT_OFFS_VALID | 4);
+				goto out_put;
+			}
+		} else {
+			/* Nothing to do */
+		}
+
+		scst_put_buf_full(cmd, buf);
+
+		switch (pinfo) {
+		case 0:
+			switch (prot_usage) {
+			case 0:
+				prot_type = 0;
+				break;
+			default:
+				scst_set_invalid_field_in_parm_list(cmd, 0,
+					SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
+				goto out;
+			}
+			break;
+		case 1:
+			switch (prot_usage) {
+			default:
+				scst_set_invalid_field_in_parm_list(cmd, 0,
+					SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
+				goto out;
+			}
+			break;
+		case 2:
+			switch (prot_usage) {
+			case 0:
+				prot_type = 1;
+				break;
+			default:
+				scst_set_invalid_field_in_parm_list(cmd, 0,
+					SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
+				goto out;
+			}
+			break;
+		case 3:
+			switch (prot_usage) {
+			case 0:
+				prot_type = 2;
+				break;
+			case 1:
+				prot_type = 3;
+				break;
+			default:
+				scst_set_invalid_field_in_parm_list(cmd, 0,
+					SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
+				goto out;
+			}
+			break;
+		default:
+			sBUG();
+			break;
+		}
+	}
+
+	TRACE_DBG("prot_type %d, pinfo %d, immed %d (cmd %p)", prot_type,
+		pinfo, immed, cmd);
+
+	if (prot_type != dev->dev_dif_type) {
+		PRINT_ERROR("FORMAT UNIT: DIF type %d not supported (dev %s)",
+			prot_type, dev->virt_name);
+		scst_set_invalid_field_in_cdb(cmd, 1,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 6);
+		goto out;
+	}
+
+	if (immed) {
+		scst_cmd_get(cmd); /* to protect dev */
+		cmd->completed = 1;
+		cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
+		res = RUNNING_ASYNC;
+	}
+
+	spin_lock(&virt_dev->flags_lock);
+	virt_dev->format_active = 1;
+	spin_unlock(&virt_dev->flags_lock);
+
+	virt_dev->format_progress_done = 0;
+	virt_dev->format_progress_to_do = virt_dev->nblocks << SCST_DIF_TAG_SHIFT;
+
+	if (virt_dev->thin_provisioned) {
+		int rc = vdisk_unmap_range(cmd, virt_dev, 0, virt_dev->nblocks);
+
+		if (rc != 0)
+			goto finished;
+	}
+
+	if (pinfo != 0)
+		vdisk_format_dif(cmd, 0, virt_dev->nblocks);
+
+finished:
+	spin_lock(&virt_dev->flags_lock);
+	virt_dev->format_active = 0;
+	spin_unlock(&virt_dev->flags_lock);
+
+	if (immed)
+		scst_cmd_put(cmd);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_put:
+	scst_put_buf_full(cmd, buf);
+	goto out;
+}
+
+static enum compl_status_e vdisk_invalid_opcode(struct vdisk_cmd_params *p)
+{
+	TRACE_DBG("Invalid opcode %s", scst_get_opcode_name(p->cmd));
+	return INVALID_OPCODE;
+}
+
+#define VDEV_DEF_RDPROTECT	0xE0
+#define VDEV_DEF_WRPROTECT	0xE0
+#define VDEV_DEF_VRPROTECT	0xE0
+
+#define VDEF_DEF_GROUP_NUM	0
+
+static const struct scst_opcode_descriptor scst_op_descr_cwr = {
+	.od_opcode = COMPARE_AND_WRITE,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 16,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { COMPARE_AND_WRITE, VDEV_DEF_WRPROTECT | 0x18,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0, 0, 0, 0xFF, VDEF_DEF_GROUP_NUM,
+			       SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_format_unit = {
+	.od_opcode = FORMAT_UNIT,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 6,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_LONG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { FORMAT_UNIT, 0xF0, 0, 0, 0, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_get_lba_status = {
+	.od_opcode = SERVICE_ACTION_IN_16,
+	.od_serv_action = SAI_GET_LBA_STATUS,
+	.od_serv_action_valid = 1,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 16,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_SMALL_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { SERVICE_ACTION_IN_16, SAI_GET_LBA_STATUS,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0,
+			       SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_allow_medium_removal = {
+	.od_opcode = ALLOW_MEDIUM_REMOVAL,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 6,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_SMALL_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { ALLOW_MEDIUM_REMOVAL, 0, 0, 0, 3, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_read6 = {
+	.od_opcode = READ_6,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 6,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { READ_6, 0x1F,
+			       0xFF, 0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_read10 = {
+	.od_opcode = READ_10,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 10,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { READ_10, VDEV_DEF_RDPROTECT | 0x18,
+			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
+			       0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_read12 = {
+	.od_opcode = READ_12,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 12,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { READ_12, VDEV_DEF_RDPROTECT | 0x18,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       VDEF_DEF_GROUP_NUM, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_read16 = {
+	.od_opcode = READ_16,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 16,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { READ_16, VDEV_DEF_RDPROTECT | 0x18,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
+			       SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_read32 = {
+	.od_opcode = VARIABLE_LENGTH_CMD,
+	.od_serv_action = SUBCODE_READ_32,
+	.od_serv_action_valid = 1,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 32,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { VARIABLE_LENGTH_CMD, SCST_OD_DEFAULT_CONTROL_BYTE,
+			       0, 0, 0, 0, VDEF_DEF_GROUP_NUM, 0x18, 0,
+			       SUBCODE_READ_32, VDEV_DEF_RDPROTECT | 0x18, 0,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_read_capacity = {
+	.od_opcode = READ_CAPACITY,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 10,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_SMALL_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { READ_CAPACITY, 0, 0, 0, 0, 0, 0,
+			       0, 0, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_read_capacity16 = {
+	.od_opcode = SERVICE_ACTION_IN_16,
+	.od_serv_action = SAI_READ_CAPACITY_16,
+	.od_serv_action_valid = 1,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 16,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_SMALL_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { SERVICE_ACTION_IN_16, SAI_READ_CAPACITY_16,
+			       0, 0, 0, 0, 0, 0, 0, 0,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0,
+			       SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_start_stop_unit = {
+	.od_opcode = START_STOP,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 6,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_SMALL_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { START_STOP, 1, 0, 0xF, 0xF7, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_sync_cache10 = {
+	.od_opcode = SYNCHRONIZE_CACHE,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 10,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { SYNCHRONIZE_CACHE, 2,
+			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
+			       0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_sync_cache16 = {
+	.od_opcode = SYNCHRONIZE_CACHE_16,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 16,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { SYNCHRONIZE_CACHE_16, 2,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
+			       SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_unmap = {
+	.od_opcode = UNMAP,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 10,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { UNMAP, 0, 0, 0, 0, 0, VDEF_DEF_GROUP_NUM,
+			       0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_verify10 = {
+	.od_opcode = VERIFY,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 10,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { VERIFY, VDEV_DEF_VRPROTECT | 0x16,
+			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
+			       0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_verify12 = {
+	.od_opcode = VERIFY_12,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 12,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { VERIFY_12, VDEV_DEF_VRPROTECT | 0x16,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       VDEF_DEF_GROUP_NUM, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_verify16 = {
+	.od_opcode = VERIFY_16,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 16,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { VERIFY_16, VDEV_DEF_VRPROTECT | 0x16,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
+			       SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_verify32 = {
+	.od_opcode = VARIABLE_LENGTH_CMD,
+	.od_serv_action = SUBCODE_VERIFY_32,
+	.od_serv_action_valid = 1,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 32,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { VARIABLE_LENGTH_CMD, SCST_OD_DEFAULT_CONTROL_BYTE,
+			       0, 0, 0, 0, VDEF_DEF_GROUP_NUM, 0x18, 0,
+			       SUBCODE_VERIFY_32, VDEV_DEF_VRPROTECT | 0x16, 0,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_write6 = {
+	.od_opcode = WRITE_6,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 6,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { WRITE_6, 0x1F,
+			       0xFF, 0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_write10 = {
+	.od_opcode = WRITE_10,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 10,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { WRITE_10, VDEV_DEF_WRPROTECT | 0x1A,
+			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
+			       0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_write12 = {
+	.od_opcode = WRITE_12,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 12,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { WRITE_12, VDEV_DEF_WRPROTECT | 0x1A,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       VDEF_DEF_GROUP_NUM, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_write16 = {
+	.od_opcode = WRITE_16,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 16,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { WRITE_16, VDEV_DEF_WRPROTECT | 0x1A,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
+			       SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_write32 = {
+	.od_opcode = VARIABLE_LENGTH_CMD,
+	.od_serv_action = SUBCODE_WRITE_32,
+	.od_serv_action_valid = 1,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 32,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { VARIABLE_LENGTH_CMD, SCST_OD_DEFAULT_CONTROL_BYTE,
+			       0, 0, 0, 0, VDEF_DEF_GROUP_NUM, 0x18, 0,
+			       SUBCODE_WRITE_32, VDEV_DEF_WRPROTECT | 0x1A, 0,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_write_verify10 = {
+	.od_opcode = WRITE_VERIFY,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 10,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { WRITE_VERIFY, VDEV_DEF_WRPROTECT | 0x16,
+			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
+			       0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_write_verify12 = {
+	.od_opcode = WRITE_VERIFY_12,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 12,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { WRITE_VERIFY_12, VDEV_DEF_WRPROTECT | 0x16,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       VDEF_DEF_GROUP_NUM, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_write_verify16 = {
+	.od_opcode = WRITE_VERIFY_16,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 16,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { WRITE_VERIFY_16, VDEV_DEF_WRPROTECT | 0x16,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
+			       SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_write_verify32 = {
+	.od_opcode = VARIABLE_LENGTH_CMD,
+	.od_serv_action = SUBCODE_WRITE_VERIFY_32,
+	.od_serv_action_valid = 1,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 32,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { VARIABLE_LENGTH_CMD, SCST_OD_DEFAULT_CONTROL_BYTE,
+			       0, 0, 0, 0, VDEF_DEF_GROUP_NUM, 0x18, 0,
+			       SUBCODE_WRITE_VERIFY_32, VDEV_DEF_WRPROTECT | 0x16, 0,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_write_same10 = {
+	.od_opcode = WRITE_SAME,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 10,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { WRITE_SAME, VDEV_DEF_WRPROTECT | 0x8,
+			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
+			       0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_write_same16 = {
+	.od_opcode = WRITE_SAME_16,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 16,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { WRITE_SAME_16, VDEV_DEF_WRPROTECT | 0x8,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
+			       SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_write_same32 = {
+	.od_opcode = VARIABLE_LENGTH_CMD,
+	.od_serv_action = SUBCODE_WRITE_SAME_32,
+	.od_serv_action_valid = 1,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 32,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { VARIABLE_LENGTH_CMD, SCST_OD_DEFAULT_CONTROL_BYTE,
+			       0, 0, 0, 0, VDEF_DEF_GROUP_NUM, 0x18, 0,
+			       SUBCODE_WRITE_SAME_32, VDEV_DEF_WRPROTECT | 0x8, 0,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			       0xFF, 0xFF, 0xFF, 0xFF },
+};
+
+static const struct scst_opcode_descriptor scst_op_descr_read_toc = {
+	.od_opcode = READ_TOC,
+	.od_support = 3, /* supported as in the standard */
+	.od_cdb_size = 10,
+	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
+	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
+	.od_cdb_usage_bits = { READ_TOC, 0, 0xF, 0, 0, 0, 0xFF,
+			       0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
+};
+
+#define SHARED_OPS							\
+	[SYNCHRONIZE_CACHE] = vdisk_synchronize_cache,			\
+	[SYNCHRONIZE_CACHE_16] = vdisk_synchronize_cache,		\
+	[MODE_SENSE] = vdisk_exec_mode_sense,				\
+	[MODE_SENSE_10] = vdisk_exec_mode_sense,			\
+	[MODE_SELECT] = vdisk_exec_mode_select,				\
+	[MODE_SELECT_10] = vdisk_exec_mode_select,			\
+	[LOG_SELECT] = vdisk_exec_log,					\
+	[LOG_SENSE] = vdisk_exec_log,					\
+	[ALLOW_MEDIUM_REMOVAL] = vdisk_exec_prevent_allow_medium_removal, \
+	[READ_TOC] = vdisk_exec_read_toc,				\
+	[START_STOP] = vdisk_exec_start_stop,				\
+	[RESERVE] = vdisk_nop,						\
+	[RESERVE_10] = vdisk_nop,					\
+	[RELEASE] = vdisk_nop,						\
+	[RELEASE_10] = vdisk_nop,					\
+	[TEST_UNIT_READY] = vdisk_nop,					\
+	[INQUIRY] = vdisk_exec_inquiry,					\
+	[REQUEST_SENSE] = vdisk_exec_request_sense,			\
+	[READ_CAPACITY] = vdisk_exec_read_capacity,			\
+	[SERVICE_ACTION_IN_16] = vdisk_exec_sai_16,			\
+	[UNMAP] = vdisk_exec_unmap,					\
+	[WRITE_SAME] = vdisk_exec_write_same,				\
+	[WRITE_SAME_16] = vdisk_exec_write_same,			\
+	[MAINTENANCE_IN] = vdisk_exec_maintenance_in,			\
+	[MAINTENANCE_OUT] = vdisk_exec_maintenance_out,			\
+	[SEND_DIAGNOSTIC] = vdisk_exec_send_diagnostic,			\
+	[FORMAT_UNIT] = vdisk_exec_format_unit,
+
+#define SHARED_OPCODE_DESCRIPTORS					\
+	&scst_op_descr_sync_cache10,					\
+	&scst_op_descr_sync_cache16,					\
+	&scst_op_descr_mode_sense6,					\
+	&scst_op_descr_mode_sense10,					\
+	&scst_op_descr_mode_select6,					\
+	&scst_op_descr_mode_select10,					\
+	&scst_op_descr_log_select,					\
+	&scst_op_descr_log_sense,					\
+	&scst_op_descr_start_stop_unit,					\
+	&scst_op_descr_read_capacity,					\
+	&scst_op_descr_send_diagnostic,					\
+	&scst_op_descr_rtpg,						\
+	&scst_op_descr_read6,						\
+	&scst_op_descr_read10,						\
+	&scst_op_descr_read12,						\
+	&scst_op_descr_read16,						\
+	&scst_op_descr_write6,						\
+	&scst_op_descr_write10,						\
+	&scst_op_descr_write12,						\
+	&scst_op_descr_write16,						\
+	&scst_op_descr_write_verify10,					\
+	&scst_op_descr_write_verify12,					\
+	&scst_op_descr_write_verify16,					\
+	&scst_op_descr_verify10,					\
+	&scst_op_descr_verify12,					\
+	&scst_op_descr_verify16,
+
+static const vdisk_op_fn blockio_var_len_ops[] = {
+	[SUBCODE_READ_32] = blockio_exec_read,
+	[SUBCODE_WRITE_32] = blockio_exec_write,
+	[SUBCODE_WRITE_VERIFY_32] = blockio_exec_write_verify,
+	[SUBCODE_VERIFY_32] = vdev_exec_verify,
+	[SUBCODE_WRITE_SAME_32] = vdisk_exec_write_same,
+};
+
+static vdisk_op_fn blockio_ops[256] = {
+	[READ_6] = blockio_exec_read,
+	[READ_10] = blockio_exec_read,
+	[READ_12] = blockio_exec_read,
+	[READ_16] = blockio_exec_read,
+	[WRITE_6] = blockio_exec_write,
+	[WRITE_10] = blockio_exec_write,
+	[WRITE_12] = blockio_exec_write,
+	[WRITE_16] = blockio_exec_write,
+	[WRITE_VERIFY] = blockio_exec_write_verify,
+	[WRITE_VERIFY_12] = blockio_exec_write_verify,
+	[WRITE_VERIFY_16] = blockio_exec_write_verify,
+	[VARIABLE_LENGTH_CMD] = blockio_exec_var_len_cmd,
+	[VERIFY] = vdev_exec_verify,
+	[VERIFY_12] = vdev_exec_verify,
+	[VERIFY_16] = vdev_exec_verify,
+	SHARED_OPS
+};
+
+static const vdisk_op_fn fileio_var_len_ops[] = {
+	[SUBCODE_READ_32] = fileio_exec_read,
+	[SUBCODE_WRITE_32] = fileio_exec_write,
+	[SUBCODE_WRITE_VERIFY_32] = fileio_exec_write_verify,
+	[SUBCODE_VERIFY_32] = vdev_exec_verify,
+	[SUBCODE_WRITE_SAME_32] = vdisk_exec_write_same,
+};
+
+static vdisk_op_fn fileio_ops[256] = {
+	[READ_6] = fileio_exec_read,
+	[READ_10] = fileio_exec_read,
+	[READ_12] = fileio_exec_read,
+	[READ_16] = fileio_exec_read,
+	[WRITE_6] = fileio_exec_write,
+	[WRITE_10] = fileio_exec_write,
+	[WRITE_12] = fileio_exec_write,
+	[WRITE_16] = fileio_exec_write,
+	[WRITE_VERIFY] = fileio_exec_write_verify,
+	[WRITE_VERIFY_12] = fileio_exec_write_verify,
+	[WRITE_VERIFY_16] = fileio_exec_write_verify,
+	[VARIABLE_LENGTH_CMD] = fileio_exec_var_len_cmd,
+	[VERIFY] = vdev_exec_verify,
+	[VERIFY_12] = vdev_exec_verify,
+	[VERIFY_16] = vdev_exec_verify,
+	SHARED_OPS
+};
+
+static const vdisk_op_fn nullio_var_len_ops[] = {
+	[SUBCODE_READ_32] = nullio_exec_read,
+	[SUBCODE_WRITE_32] = nullio_exec_write,
+	[SUBCODE_WRITE_VERIFY_32] = nullio_exec_write_verify,
+	[SUBCODE_WRITE_SAME_32] = vdisk_exec_write_same,
+};
+
+static vdisk_op_fn nullio_ops[256] = {
+	[READ_6] = nullio_exec_read,
+	[READ_10] = nullio_exec_read,
+	[READ_12] = nullio_exec_read,
+	[READ_16] = nullio_exec_read,
+	[WRITE_6] = nullio_exec_write,
+	[WRITE_10] = nullio_exec_write,
+	[WRITE_12] = nullio_exec_write,
+	[WRITE_16] = nullio_exec_write,
+	[WRITE_VERIFY] = nullio_exec_write_verify,
+	[WRITE_VERIFY_12] = nullio_exec_write_verify,
+	[WRITE_VERIFY_16] = nullio_exec_write_verify,
+	[VARIABLE_LENGTH_CMD] = nullio_exec_var_len_cmd,
+	[VERIFY] = nullio_exec_verify,
+	[VERIFY_12] = nullio_exec_verify,
+	[VERIFY_16] = nullio_exec_verify,
+	SHARED_OPS
+};
+
+static const vdisk_op_fn ramdisk_var_len_ops[] = {
+	[SUBCODE_READ_32] = ramdisk_exec_read,
+	[SUBCODE_WRITE_32] = ramdisk_exec_write,
+	[SUBCODE_WRITE_VERIFY_32] = ramdisk_exec_write_verify,
+	[SUBCODE_VERIFY_32] = vdev_exec_verify,
+	[SUBCODE_WRITE_SAME_32] = vdisk_exec_write_same,
+};
+
+static vdisk_op_fn ramdisk_ops[256] = {
+	[READ_6] = ramdisk_exec_read,
+	[READ_10] = ramdisk_exec_read,
+	[READ_12] = ramdisk_exec_read,
+	[READ_16] = ramdisk_exec_read,
+	[WRITE_6] = ramdisk_exec_write,
+	[WRITE_10] = ramdisk_exec_write,
+	[WRITE_12] = ramdisk_exec_write,
+	[WRITE_16] = ramdisk_exec_write,
+	[WRITE_VERIFY] = ramdisk_exec_write_verify,
+	[WRITE_VERIFY_12] = ramdisk_exec_write_verify,
+	[WRITE_VERIFY_16] = ramdisk_exec_write_verify,
+	[VARIABLE_LENGTH_CMD] = ramdisk_exec_var_len_cmd,
+	[VERIFY] = vdev_exec_verify,
+	[VERIFY_12] = vdev_exec_verify,
+	[VERIFY_16] = vdev_exec_verify,
+	SHARED_OPS
+};
+
+#define VDISK_OPCODE_DESCRIPTORS					\
+	&scst_op_descr_get_lba_status,					\
+	&scst_op_descr_read_capacity16,					\
+	&scst_op_descr_write_same10,					\
+	&scst_op_descr_write_same16,					\
+	&scst_op_descr_unmap,						\
+	&scst_op_descr_format_unit,					\
+	&scst_op_descr_extended_copy,					\
+	&scst_op_descr_cwr,
+
+static const struct scst_opcode_descriptor *vdisk_opcode_descriptors[] = {
+	SHARED_OPCODE_DESCRIPTORS
+	VDISK_OPCODE_DESCRIPTORS
+	SCST_OPCODE_DESCRIPTORS
+	&scst_op_descr_stpg, /* must be last, see vdisk_get_supported_opcodes()! */
+};
+
+static const struct scst_opcode_descriptor *vdisk_opcode_descriptors_type2[] = {
+	SHARED_OPCODE_DESCRIPTORS
+	VDISK_OPCODE_DESCRIPTORS
+	&scst_op_descr_read32,
+	&scst_op_descr_write32,
+	&scst_op_descr_verify32,
+	&scst_op_descr_write_verify32,
+	&scst_op_descr_write_same32,
+	SCST_OPCODE_DESCRIPTORS
+	&scst_op_descr_stpg, /* must be last, see vdisk_get_supported_opcodes()! */
+};
+
+static const struct scst_opcode_descriptor *vcdrom_opcode_descriptors[] = {
+	SHARED_OPCODE_DESCRIPTORS
+	&scst_op_descr_allow_medium_removal,
+	&scst_op_descr_read_toc,
+	SCST_OPCODE_DESCRIPTORS
+};
+
+static int vdisk_get_supported_opcodes(struct scst_cmd *cmd,
+	const struct scst_opcode_descriptor ***out_supp_opcodes,
+	int *out_supp_opcodes_cnt)
+{
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+
+	if (cmd->dev->dev_dif_type != 2) {
+		*out_supp_opcodes = vdisk_opcode_descriptors;
+		*out_supp_opcodes_cnt = ARRAY_SIZE(vdisk_opcode_descriptors);
+	} else {
+		*out_supp_opcodes = vdisk_opcode_descriptors_type2;
+		*out_supp_opcodes_cnt = ARRAY_SIZE(vdisk_opcode_descriptors_type2);
+	}
+	if (!virt_dev->expl_alua) {
+		(*out_supp_opcodes_cnt)--;
+		sBUG_ON((*out_supp_opcodes)[*out_supp_opcodes_cnt]->od_serv_action != MO_SET_TARGET_PGS);
+	}
+	return 0;
+}
+
+static int vcdrom_get_supported_opcodes(struct scst_cmd *cmd,
+	const struct scst_opcode_descriptor ***out_supp_opcodes,
+	int *out_supp_opcodes_cnt)
+{
+	*out_supp_opcodes = vcdrom_opcode_descriptors;
+	*out_supp_opcodes_cnt = ARRAY_SIZE(vcdrom_opcode_descriptors);
+	return 0;
+}
+
+static bool vdisk_use_zero_copy(const struct scst_cmd *cmd)
+{
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+
+	if (!virt_dev->zero_copy)
+		return false;
+
+	switch (cmd->cdb[0]) {
+	case VARIABLE_LENGTH_CMD:
+		if (cmd->cdb[9] != SUBCODE_READ_32)
+			break;
+		/* else go througth */
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		return true;
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+		/* vdisk_ramdisk writes into its chunks directly anyway */
+		return !virt_dev->ramdisk;
+	}
+
+	return false;
+}
+
+/*
+ * Compute p->loff and p->fua.
+ * Returns true for success or false otherwise and set error in the commeand.
+ */
+static bool vdisk_parse_offset(struct vdisk_cmd_params *p, struct scst_cmd *cmd)
+{
+	uint64_t lba_start;
+	int64_t data_len;
+	uint8_t *cdb = cmd->cdb;
+	int opcode = cdb[0];
+	loff_t loff;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	bool res;
+	int fua = 0;
+
+	TRACE_ENTRY();
+
+	if (unlikely(!(cmd->op_flags & SCST_INFO_VALID))) {
+		TRACE(TRACE_MINOR, "Unknown opcode %s", scst_get_opcode_name(cmd));
+		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_invalid_opcode));
+		res = false;
+		goto out;
+	}
+
+	p->cmd = cmd;
+
+	cmd->status = 0;
+	cmd->msg_status = 0;
+	cmd->host_status = DID_OK;
+	cmd->driver_status = 0;
+
+	switch (cmd->queue_type) {
+	case SCST_CMD_QUEUE_ORDERED:
+		TRACE(TRACE_ORDER, "ORDERED cmd %p (op %s)", cmd,
+			scst_get_opcode_name(cmd));
+		break;
+	case SCST_CMD_QUEUE_HEAD_OF_QUEUE:
+		TRACE(TRACE_ORDER, "HQ cmd %p (op %s)", cmd,
+			scst_get_opcode_name(cmd));
+		break;
+	default:
+		break;
+	}
+
+	lba_start = scst_cmd_get_lba(cmd);
+	data_len = scst_cmd_get_data_len(cmd);
+
+	loff = (loff_t)lba_start << dev->block_shift;
+	TRACE_DBG("cmd %p, lba_start %lld, loff %lld, data_len %lld", cmd,
+		  (unsigned long long int)lba_start,
+		  (unsigned long long int)loff,
+		  (unsigned long long int)data_len);
+
+	EXTRACHECKS_BUG_ON(((loff < 0) && !(cmd->op_flags & SCST_LBA_NOT_VALID)) ||
+			   unlikely(data_len < 0));
+
+	if (unlikely((loff + data_len) > virt_dev->file_size) &&
+	    (!(cmd->op_flags & SCST_LBA_NOT_VALID))) {
+		if (virt_dev->cdrom_empty) {
+			TRACE_DBG("%s", "CDROM empty");
+			scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_no_medium));
+		} else {
+			PRINT_INFO("Access beyond the end of device %s "
+				"(%lld of %lld, data len %lld)", virt_dev->name,
+				(unsigned long long int)loff,
+				(unsigned long long int)virt_dev->file_size,
+				(unsigned long long int)data_len);
+			scst_set_cmd_error(cmd, SCST_LOAD_SENSE(
+					scst_sense_block_out_range_error));
+		}
+		res = false;
+		goto out;
+	}
+
+	switch (opcode) {
+	case VARIABLE_LENGTH_CMD:
+		if (cmd->cdb[9] == SUBCODE_WRITE_32) {
+			fua = (cdb[10] & 0x8);
+			if (fua)
+				TRACE(TRACE_ORDER, "FUA: loff=%lld, data_len=%lld",
+					(unsigned long long)loff,
+					(unsigned long long)data_len);
+		}
+		break;
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+		fua = (cdb[1] & 0x8);
+		if (fua) {
+			TRACE(TRACE_ORDER, "FUA: loff=%lld, "
+				"data_len=%lld", (unsigned long long int)loff,
+				(unsigned long long int)data_len);
+		}
+		break;
+	}
+
+	p->loff = loff;
+	p->fua = fua;
+	p->use_zero_copy = vdisk_use_zero_copy(cmd);
+
+	res = true;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static int fileio_alloc_and_parse(struct scst_cmd *cmd)
+{
+	struct vdisk_cmd_params *p;
+	int res = SCST_CMD_STATE_DEFAULT;
+
+	TRACE_ENTRY();
+
+	p = kmem_cache_zalloc(vdisk_cmd_param_cachep, cmd->cmd_gfp_mask);
+	if (!p) {
+		scst_set_busy(cmd);
+		goto out_err;
+	}
+
+	if (unlikely(!vdisk_parse_offset(p, cmd)))
+		goto out_err_free_cmd_params;
+
+	cmd->dh_priv = p;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_err_free_cmd_params:
+	kmem_cache_free(vdisk_cmd_param_cachep, p);
+
+out_err:
+	res = scst_get_cmd_abnormal_done_state(cmd);
+	goto out;
+}
+
+static int vdisk_parse(struct scst_cmd *cmd)
+{
+	int res, rc;
+
+	rc = scst_sbc_generic_parse(cmd);
+	if (rc != 0) {
+		res = scst_get_cmd_abnormal_done_state(cmd);
+		goto out;
+	}
+
+	res = fileio_alloc_and_parse(cmd);
+out:
+	return res;
+}
+
+static int vcdrom_parse(struct scst_cmd *cmd)
+{
+	int res, rc;
+
+	rc = scst_cdrom_generic_parse(cmd);
+	if (rc != 0) {
+		res = scst_get_cmd_abnormal_done_state(cmd);
+		goto out;
+	}
+
+	res = fileio_alloc_and_parse(cmd);
+out:
+	return res;
+}
+
+/* blockio and nullio */
+static int non_fileio_parse(struct scst_cmd *cmd)
+{
+	int res = SCST_CMD_STATE_DEFAULT, rc;
+
+	rc = scst_sbc_generic_parse(cmd);
+	if (rc != 0) {
+		res = scst_get_cmd_abnormal_done_state(cmd);
+		goto out;
+	}
+out:
+	return res;
+}
+
+static void vdisk_ramdisk_free_chunk(struct vdisk_ramdisk_chunk *chunk)
+{
+	int i;
+
+	for (i = 0; i < (1 << (VDISK_RAMDISK_CHUNK_ORDER - chunk->order)); i++)
+		if (chunk->parts[i] != NULL)
+			put_page(chunk->parts[i]);
+	kfree(chunk);
+	return;
+}
+
+/*
+ * Allocates new zeroed chunk. Tries a single page of the chunk size first
+ * and, if memory is fragmented, falls back to parts of smaller orders down
+ * to order-0, so writes to not yet allocated ranges don't fail just
+ * because there are no free high order pages.
+ */
+static struct vdisk_ramdisk_chunk *vdisk_ramdisk_alloc_chunk(
+	struct scst_vdisk_dev *virt_dev, unsigned long idx, gfp_t gfp_mask)
+{
+	struct vdisk_ramdisk_chunk *chunk;
+	int order = VDISK_RAMDISK_CHUNK_ORDER, i, n;
+	gfp_t gfp;
+
+	while (1) {
+		n = 1 << (VDISK_RAMDISK_CHUNK_ORDER - order);
+		chunk = kzalloc(sizeof(*chunk) + n * sizeof(chunk->parts[0]),
+				gfp_mask);
+		if (chunk == NULL)
+			goto out;
+		chunk->idx = idx;
+		chunk->order = order;
+
+		/* Don't try hard for high orders, there are lower ones */
+		gfp = gfp_mask | __GFP_ZERO | __GFP_NOWARN;
+		if (order != 0)
+			gfp |= __GFP_COMP | __GFP_NORETRY;
+
+		for (i = 0; i < n; i++) {
+			chunk->parts[i] = alloc_pages_node(
+				virt_dev->ramdisk_numa_node, gfp, order);
+			if (chunk->parts[i] == NULL)
+				break;
+		}
+		if (i == n)
+			goto out;
+
+		vdisk_ramdisk_free_chunk(chunk);
+		chunk = NULL;
+		if (order == 0)
+			goto out;
+
+		order = max(order - VDISK_RAMDISK_ORDER_STEP, 0);
+		TRACE_DBG("Dev %s: falling back to order %d for RAM disk chunk "
+			"%lu", virt_dev->name, order, idx);
+	}
+
+out:
+	return chunk;
+}
+
+/*
+ * Returns the page of the RAM disk chunk containing @off with a reference
+ * taken on it. It is a compound page, if the chunk's order isn't 0, and
+ * covers PAGE_SIZE << compound_order() bytes of the RAM disk aligned on
+ * its size. If there is no such chunk yet, allocates it if @alloc is true
+ * or returns NULL otherwise. Returns ERR_PTR(-ENOSPC) if the device's
+ * memory limit is reached and ERR_PTR(-ENOMEM) if the allocation failed.
+ */
+static struct page *vdisk_ramdisk_get_page(struct scst_vdisk_dev *virt_dev,
+	loff_t off, bool alloc, gfp_t gfp_mask)
+{
+	unsigned long idx = off >> VDISK_RAMDISK_CHUNK_SHIFT;
+	size_t coff = off & (VDISK_RAMDISK_CHUNK_SIZE - 1);
+	struct vdisk_ramdisk_chunk *chunk, *new_chunk = NULL;
+	struct page *page = NULL;
+	int rc;
+
+	spin_lock(&virt_dev->ramdisk_lock);
+	chunk = radix_tree_lookup(&virt_dev->ramdisk_chunks, idx);
+	if (chunk != NULL) {
+		page = chunk->parts[coff >> (PAGE_SHIFT + chunk->order)];
+		get_page(page);
+	}
+	spin_unlock(&virt_dev->ramdisk_lock);
+
+	if ((page != NULL) || !alloc)
+		goto out;
+
+	new_chunk = vdisk_ramdisk_alloc_chunk(virt_dev, idx, gfp_mask);
+	if (new_chunk == NULL) {
+		page = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+
+	rc = radix_tree_preload(gfp_mask);
+	if (rc != 0) {
+		page = ERR_PTR(rc);
+		goto out_free;
+	}
+
+	spin_lock(&virt_dev->ramdisk_lock);
+	chunk = radix_tree_lookup(&virt_dev->ramdisk_chunks, idx);
+	if (chunk != NULL) {
+		/* Somebody else allocated it in the meantime */
+	} else if ((virt_dev->ramdisk_max_chunks != 0) &&
+		   (virt_dev->ramdisk_chunks_cnt >= virt_dev->ramdisk_max_chunks)) {
+		page = ERR_PTR(-ENOSPC);
+	} else {
+		rc = radix_tree_insert(&virt_dev->ramdisk_chunks, idx,
+				new_chunk);
+		sBUG_ON(rc != 0);
+		virt_dev->ramdisk_chunks_cnt++;
+		chunk = new_chunk;
+		new_chunk = NULL;
+	}
+	if (chunk != NULL) {
+		page = chunk->parts[coff >> (PAGE_SHIFT + chunk->order)];
+		get_page(page);
+	}
+	spin_unlock(&virt_dev->ramdisk_lock);
+	radix_tree_preload_end();
+
+out_free:
+	if (new_chunk != NULL)
+		vdisk_ramdisk_free_chunk(new_chunk);
+
+out:
+	return page;
+}
+
+/* Size of a RAM disk page returned by vdisk_ramdisk_get_page() */
+static inline size_t vdisk_ramdisk_page_size(struct page *page)
+{
+	return PAGE_SIZE << compound_order(page);
+}
+
+/*
+ * Copies @len bytes between @buf and the RAM disk starting at @off. Not yet
+ * allocated chunks read as zeroes and get allocated on write.
+ */
+static int vdisk_ramdisk_rw(struct scst_vdisk_dev *virt_dev, void *buf,
+	size_t len, loff_t off, bool write, gfp_t gfp_mask)
+{
+	struct page *page;
+	size_t poff, l;
+
+	while (len > 0) {
+		page = vdisk_ramdisk_get_page(virt_dev, off, write, gfp_mask);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+
+		if (page == NULL) {
+			poff = off & (VDISK_RAMDISK_CHUNK_SIZE - 1);
+			l = min_t(size_t, len, VDISK_RAMDISK_CHUNK_SIZE - poff);
+			memset(buf, 0, l);
+		} else {
+			poff = off & (vdisk_ramdisk_page_size(page) - 1);
+			l = min_t(size_t, len,
+				vdisk_ramdisk_page_size(page) - poff);
+			if (write)
+				memcpy(page_address(page) + poff, buf, l);
+			else
+				memcpy(buf, page_address(page) + poff, l);
+			put_page(page);
+		}
+
+		buf += l;
+		off += l;
+		len -= l;
+	}
+
+	return 0;
+}
+
+/*
+ * Deallocates the RAM disk range [@off, @off + @len). Chunks fully covered
+ * by the range are freed, the rest of the range is zeroed.
+ */
+static void vdisk_ramdisk_unmap(struct scst_vdisk_dev *virt_dev, loff_t off,
+	loff_t len)
+{
+	struct vdisk_ramdisk_chunk *chunk;
+	struct page *page;
+	size_t poff, l;
+
+	while (len > 0) {
+		poff = off & (VDISK_RAMDISK_CHUNK_SIZE - 1);
+		l = min_t(loff_t, len, VDISK_RAMDISK_CHUNK_SIZE - poff);
+
+		if (l == VDISK_RAMDISK_CHUNK_SIZE) {
+			spin_lock(&virt_dev->ramdisk_lock);
+			chunk = radix_tree_delete(&virt_dev->ramdisk_chunks,
+					off >> VDISK_RAMDISK_CHUNK_SHIFT);
+			if (chunk != NULL)
+				virt_dev->ramdisk_chunks_cnt--;
+			spin_unlock(&virt_dev->ramdisk_lock);
+			/*
+			 * Pages still referenced by zero copy READs are freed
+			 * when those commands are done.
+			 */
+			if (chunk != NULL)
+				vdisk_ramdisk_free_chunk(chunk);
+		} else {
+			page = vdisk_ramdisk_get_page(virt_dev, off, false, 0);
+			if (page != NULL) {
+				poff = off & (vdisk_ramdisk_page_size(page) - 1);
+				l = min_t(loff_t, len,
+					vdisk_ramdisk_page_size(page) - poff);
+				memset(page_address(page) + poff, 0, l);
+				put_page(page);
+			}
+		}
+
+		off += l;
+		len -= l;
+	}
+
+	return;
+}
+
+#define VDISK_RAMDISK_FREE_BATCH	16
+
+/* Frees all chunks of the RAM disk. No other users supposed to be. */
+static void vdisk_ramdisk_free_all(struct scst_vdisk_dev *virt_dev)
+{
+	struct vdisk_ramdisk_chunk *chunks[VDISK_RAMDISK_FREE_BATCH];
+	unsigned long pos = 0;
+	int i, nr;
+
+	do {
+		nr = radix_tree_gang_lookup(&virt_dev->ramdisk_chunks,
+				(void **)chunks, pos, ARRAY_SIZE(chunks));
+		for (i = 0; i < nr; i++) {
+			pos = chunks[i]->idx;
+			radix_tree_delete(&virt_dev->ramdisk_chunks, pos);
+			vdisk_ramdisk_free_chunk(chunks[i]);
+		}
+		pos++;
+	} while (nr == ARRAY_SIZE(chunks));
+
+	virt_dev->ramdisk_chunks_cnt = 0;
+	return;
+}
+
+static void vdisk_ramdisk_set_error(struct scst_cmd *cmd, int err)
+{
+	if (err == -ENOSPC)
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_space_alloc_failed));
+	else
+		scst_set_busy(cmd);
+	return;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)
+/**
+ * finish_read - Release the pages referenced by prepare_read().
+ */
+static void finish_read(struct scatterlist *sg, int sg_cnt)
+{
+	struct page *page;
+	int i;
+
+	TRACE_ENTRY();
+
+	for (i = 0; i < sg_cnt; ++i) {
+		page = sg_page(&sg[i]);
+		EXTRACHECKS_BUG_ON(!page);
+		page_cache_release(page);
+	}
+
+	TRACE_EXIT();
+	return;
+}
+
+/**
+ * prepare_read_page - Bring a single page into the page cache.
+ *
+ * @filp: file pointer
+ * @len: number of bytes to read from the file
+ * @offset: offset of first byte to read (from start of file)
+ * @last: offset of first byte that will not be read - used for readahead
+ * @pageptr: page pointer output variable.
+ *
+ * Returns a negative number if an error occurred, zero upon EOF or a positive
+ * number - the number of bytes that can be read from the file via the returned
+ * page. If a positive number is returned, it is the responsibility of the
+ * caller to release the returned page.
+ *
+ * Based on do_generic_file_read().
+ */
+static int prepare_read_page(struct file *filp, int len,
+			     loff_t offset, loff_t last, struct page **pageptr)
+{
+	struct address_space *mapping = filp->f_mapping;
+	struct inode *inode = mapping->host;
+	struct file_ra_state *ra = &filp->f_ra;
+	struct page *page;
+	unsigned long index, last_index;
+	long end_index, nr;
+	loff_t isize;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 15, 0)
+	read_descriptor_t desc = { .count = len };
+#endif
+	int error;
+
+	TRACE_ENTRY();
+
+	WARN((offset & ~PAGE_CACHE_MASK) + len > PAGE_CACHE_SIZE,
+	     "offset = %lld + %lld, len = %d\n", offset & PAGE_CACHE_MASK,
+	     offset & ~PAGE_CACHE_MASK, len);
+	sBUG_ON(!mapping->a_ops);
+
+	index = offset >> PAGE_CACHE_SHIFT;
+	last_index = (last + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+
+find_page:
+	page = find_get_page(mapping, index);
+	if (!page) {
+		page_cache_sync_readahead(mapping, ra, filp, index,
+					  last_index - index);
+		page = find_get_page(mapping, index);
+		if (unlikely(!page)) {
+			/*
+			 * Not cached so create a new page.
+			 */
+			page = page_cache_alloc_cold(mapping);
+			if (!page) {
+				error = -ENOMEM;
+				goto err;
+			}
+			error = add_to_page_cache_lru(page, mapping, index,
+						      GFP_KERNEL);
+			if (error) {
+				page_cache_release(page);
+				if (error == -EEXIST)
+					goto find_page;
+				else
+					goto err;
+			} else {
+				goto readpage;
+			}
+		}
+	}
+	if (PageReadahead(page))
+		page_cache_async_readahead(mapping, ra, filp, page,
+					   index, last_index - index);
+	if (!PageUptodate(page)) {
+		if (inode->i_blkbits == PAGE_CACHE_SHIFT ||
+		    !mapping->a_ops->is_partially_uptodate)
+			goto page_not_up_to_date;
+		if (!trylock_page(page))
+			goto page_not_up_to_date;
+		/* Did it get truncated before we got the lock? */
+		if (!page->mapping)
+			goto page_not_up_to_date_locked;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+		if (!mapping->a_ops->is_partially_uptodate(page,
+						offset & ~PAGE_CACHE_MASK, len))
+#else
+		if (!mapping->a_ops->is_partially_uptodate(page, &desc,
+						offset & ~PAGE_CACHE_MASK))
+#endif
+			goto page_not_up_to_date_locked;
+		unlock_page(page);
+	}
+page_ok:
+	/*
+	 * i_size must be checked after we know the page is Uptodate.
+	 *
+	 * Checking i_size after the check allows us to calculate the correct
+	 * value for "nr", which means the zero-filled part of the page is not
+	 * accessed (unless another truncate extends the file - this is
+	 * desired though).
+	 */
+
+	isize = i_size_read(inode);
+	end_index = (isize - 1) >> PAGE_CACHE_SHIFT;
+	if (unlikely(isize == 0 || index > end_index)) {
+		page_cache_release(page);
+		goto eof;
+	}
+
+	/* nr is the maximum number of bytes to copy from this page */
+	if (index < end_index) {
+		nr = PAGE_CACHE_SIZE - (offset & ~PAGE_CACHE_MASK);
+	} else {
+		nr = ((isize - 1) & ~PAGE_CACHE_MASK) + 1 -
+			(offset & ~PAGE_CACHE_MASK);
+		if (nr <= 0) {
+			page_cache_release(page);
+			goto eof;
+		}
+	}
+
+	/*
+	 * If users can be writing to this page using arbitrary virtual
+	 * addresses, take care about potential aliasing before reading the
+	 * page on the kernel side.
+	 */
+	if (mapping_writably_mapped(mapping))
+		flush_dcache_page(page);
+
+	mark_page_accessed(page);
+
+	/* Ok, we have the page and it's up to date. */
+	*pageptr = page;
+	TRACE_EXIT_RES(nr);
+	return nr;
+eof:
+	TRACE_EXIT();
+	return 0;
+err:
+	TRACE_EXIT_RES(error);
+	return error;
+
+page_not_up_to_date:
+	/* Try to get exclusive access to the page. */
+	error = lock_page_killable(page);
+	if (unlikely(error != 0)) {
+		page_cache_release(page);
+		goto err;
+	}
+
+page_not_up_to_date_locked:
+	/* Did it get truncated before we got the lock? */
+	if (!page->mapping) {
+		unlock_page(page);
+		page_cache_release(page);
+		goto find_page;
+	}
+
+	/* Did somebody else fill it already? */
+	if (PageUptodate(page)) {
+		unlock_page(page);
+		goto page_ok;
+	}
+
+readpage:
+	/*
+	 * A previous I/O error may have been due to temporary
+	 * failures, eg. multipath errors.
+	 * PG_error will be set again if readpage fails.
+	 */
+	ClearPageError(page);
+	/* Start the actual read. The read will unlock the page. */
+	error = mapping->a_ops->readpage(filp, page);
+	if (unlikely(error)) {
+		if (error == AOP_TRUNCATED_PAGE) {
+			page_cache_release(page);
+			goto find_page;
+		}
+		WARN(error >= 0, "error = %d\n", error);
+		page_cache_release(page);
+		goto err;
+	}
+
+	if (!PageUptodate(page)) {
+		error = lock_page_killable(page);
+		if (unlikely(error != 0)) {
+			page_cache_release(page);
+			goto err;
+		}
+		if (!PageUptodate(page)) {
+			if (page->mapping == NULL) {
+				/*
+				 * invalidate_mapping_pages got it
+				 */
+				unlock_page(page);
+				page_cache_release(page);
+				goto find_page;
+			}
+			unlock_page(page);
+			page_cache_release(page);
+			error = -EIO;
+			goto err;
+		}
+		unlock_page(page);
+	}
+
+	goto page_ok;
+}
+
+/**
+ * prepare_read - Lock page cache pages corresponding to an sg vector
+ * @filp: file the sg vector applies to
+ * @sg: sg vector
+ * @sg_cnt: sg vector size
+ * @offset: file offset the first byte of the first sg element corresponds to
+ */
+static int prepare_read(struct file *filp, struct scatterlist *sg, int sg_cnt,
+			pgoff_t offset)
+{
+	struct page *page = NULL;
+	int i, res;
+	loff_t off, last = ((offset + sg_cnt - 1) << PAGE_SHIFT) +
+		sg[sg_cnt - 1].offset + sg[sg_cnt - 1].length;
+
+	TRACE_ENTRY();
+
+	for (i = 0; i < sg_cnt; ++i) {
+		off = (offset + i) << PAGE_SHIFT | sg[i].offset;
+		res = prepare_read_page(filp, sg[i].length, off, last, &page);
+		if (res <= 0)
+			goto err;
+		if (res < sg[i].length) {
+			page_cache_release(page);
+			goto err;
+		}
+		sg_assign_page(&sg[i], page);
+	}
+
+	file_accessed(filp);
+
+out:
+	TRACE_EXIT_RES(i);
+	return i;
+
+err:
+	finish_read(sg, i);
+	i = -EIO;
+	goto out;
+}
+
+/**
+ * commit_write - Commit a zero copy WRITE to the page cache.
+ * @filp: file to write to
+ * @sg: sg vector with the written data, one full page per element
+ * @sg_cnt: sg vector size
+ * @pos: page aligned file offset of the first page
+ * @sync: whether to write the range to the disk
+ * @p_donated: pointer to an int where number of donated pages will be written
+ *
+ * Each page is donated to the page cache, if the page cache doesn't have
+ * a page at that index yet. Otherwise the data are copied into the cached
+ * page. Either way the page then goes through ->write_begin() and
+ * ->write_end(), so the filesystem allocates blocks and dirties the page as
+ * for any other buffered write. Must be called in thread context.
+ */
+static int commit_write(struct file *filp, struct scatterlist *sg, int sg_cnt,
+			loff_t pos, bool sync, int *p_donated)
+{
+	struct address_space *mapping = filp->f_mapping;
+	struct inode *inode = mapping->host;
+	struct page *page, *pc_page;
+	void *fsdata;
+	loff_t start = pos;
+	int i, res = 0, donated = 0;
+	bool inserted;
+
+	TRACE_ENTRY();
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 6, 0)
+	sb_start_write(inode->i_sb);
+#endif
+	inode_lock(inode);
+	file_update_time(filp);
+
+	for (i = 0; i < sg_cnt; i++, pos += PAGE_SIZE) {
+		page = sg_page(&sg[i]);
+
+		/*
+		 * The page is complete, so it's up to date. It must be
+		 * unlocked before ->write_begin(), which locks it again.
+		 */
+		inserted = (add_to_page_cache_lru(page, mapping,
+				pos >> PAGE_SHIFT, GFP_KERNEL) == 0);
+		if (inserted) {
+			SetPageUptodate(page);
+			unlock_page(page);
+		}
+
+		res = pagecache_write_begin(filp, mapping, pos, PAGE_SIZE, 0,
+					    &pc_page, &fsdata);
+		if (res != 0) {
+			/* Don't leave not written data in the page cache */
+			if (inserted)
+				invalidate_inode_pages2_range(mapping,
+					pos >> PAGE_SHIFT, pos >> PAGE_SHIFT);
+			break;
+		}
+
+		if (pc_page == page) {
+			donated++;
+		} else {
+			if (mapping_writably_mapped(mapping))
+				flush_dcache_page(pc_page);
+			copy_highpage(pc_page, page);
+			flush_dcache_page(pc_page);
+		}
+
+		res = pagecache_write_end(filp, mapping, pos, PAGE_SIZE,
+					  PAGE_SIZE, pc_page, fsdata);
+		if (res != PAGE_SIZE) {
+			if (res >= 0)
+				res = -EIO;
+			break;
+		}
+		res = 0;
+
+		balance_dirty_pages_ratelimited(mapping);
+	}
+
+	inode_unlock(inode);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 6, 0)
+	sb_end_write(inode->i_sb);
+#endif
+
+	if ((res == 0) && sync)
+		res = vfs_fsync_range(filp, start, pos - 1, 1);
+
+	*p_donated = donated;
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/**
+ * alloc_sg - Allocate an SG vector.
+ * @size: number of bytes that will be stored in the pages of the sg vector
+ * @off: first page data offset
+ * @gfp_mask: allocation flags for dynamic sg vector allocation
+ * @small_sg: pointer to a candidate sg vector
+ * @small_sg_size: size of @small_sg
+ * @p_sg_cnt: pointer to an int where the sg vector size will be written
+ */
+static struct scatterlist *alloc_sg(size_t size, unsigned off, gfp_t gfp_mask,
+				    struct scatterlist *small_sg,
+				    int small_sg_size, int *p_sg_cnt)
+{
+	struct scatterlist *sg;
+	int i, sg_cnt, remaining_sz, sg_sz, sg_off;
+
+	TRACE_ENTRY();
+
+	sg_cnt = PAGE_ALIGN(size + off) >> PAGE_SHIFT;
+	sg = sg_cnt <= small_sg_size ? small_sg :
+		kmalloc_array(sg_cnt, sizeof(*sg), gfp_mask);
+	if (!sg)
+		goto out;
+
+	sg_init_table(sg, sg_cnt);
+	remaining_sz = size;
+	sg_off = off;
+	for (i = 0; i < sg_cnt; ++i) {
+		sg_sz = min_t(int, PAGE_SIZE - sg_off, remaining_sz);
+		sg_set_page(&sg[i], NULL, sg_sz, sg_off);
+		remaining_sz -= sg_sz;
+		sg_off = 0;
+	}
+	*p_sg_cnt = sg_cnt;
+
+out:
+	TRACE_EXIT();
+	return sg;
+}
+
+/*
+ * Zero copy WRITE: receive the data into fresh pages, which commit_write()
+ * then donates to the page cache. Only full page WRITEs qualify. Returns 0
+ * on success, otherwise the command must be served the usual way.
+ */
+static int prepare_write(struct scst_cmd *cmd, struct vdisk_cmd_params *p)
+{
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct address_space *mapping;
+	struct scatterlist *sg;
+	struct page *page;
+	int i, sg_cnt, res = -EINVAL;
+
+	TRACE_ENTRY();
+
+	if ((virt_dev->fd == NULL) || virt_dev->zero_detect ||
+	    ((p->loff | cmd->bufflen) & ~PAGE_MASK) ||
+	    (cmd->bufflen != cmd->data_len))
+		goto out;
+
+	mapping = virt_dev->fd->f_mapping;
+	if (!mapping->a_ops->write_begin || !mapping->a_ops->write_end)
+		goto out;
+
+	res = -ENOMEM;
+	sg = alloc_sg(cmd->bufflen, 0, GFP_KERNEL, p->small_sg,
+		      ARRAY_SIZE(p->small_sg), &sg_cnt);
+	if (!sg)
+		goto out;
+
+	for (i = 0; i < sg_cnt; i++) {
+		page = page_cache_alloc(mapping);
+		if (!page) {
+			/* finish_read() just releases the pages */
+			finish_read(sg, i);
+			if (sg != p->small_sg)
+				kfree(sg);
+			goto out;
+		}
+		sg_assign_page(&sg[i], page);
+	}
+
+	scst_cmd_set_dh_data_buff_alloced(cmd);
+	cmd->sg = sg;
+	cmd->sg_cnt = sg_cnt;
+	res = 0;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static int fileio_alloc_data_buf(struct scst_cmd *cmd)
+{
+	struct vdisk_cmd_params *p;
+	struct scst_vdisk_dev *virt_dev;
+	int sg_cnt, nr;
+	const gfp_t gfp_mask = GFP_KERNEL;
+	struct scatterlist *sg;
+
+	TRACE_ENTRY();
+
+	p = cmd->dh_priv;
+	EXTRACHECKS_BUG_ON(!p);
+	virt_dev = cmd->dev->dh_priv;
+	/*
+	 * If the target driver (e.g. scst_local) allocates the sg vector
+	 * itself or the command is a bidi command, don't use zero copy.
+	 */
+	if (cmd->tgt_i_data_buf_alloced ||
+	    (cmd->data_direction == SCST_DATA_BIDI)) {
+		p->use_zero_copy = false;
+	} else if (cmd->data_direction == SCST_DATA_WRITE) {
+		if (p->use_zero_copy && (prepare_write(cmd, p) != 0))
+			p->use_zero_copy = false;
+		goto out;
+	} else if (virt_dev->fd && !virt_dev->fd->f_mapping->a_ops->readpage) {
+		p->use_zero_copy = false;
+	}
+	if (!p->use_zero_copy)
+		goto out;
+
+	EXTRACHECKS_BUG_ON(!(cmd->data_direction & SCST_DATA_READ));
+
+	scst_cmd_set_dh_data_buff_alloced(cmd);
+
+	cmd->sg = alloc_sg(cmd->bufflen, p->loff & ~PAGE_MASK, gfp_mask,
+			   p->small_sg, ARRAY_SIZE(p->small_sg), &cmd->sg_cnt);
+	if (!cmd->sg) {
+		PRINT_ERROR("sg allocation failed (bufflen = %d, off = %lld)\n",
+			    cmd->bufflen, p->loff & ~PAGE_MASK);
+		goto enomem;
+	}
+	sg_cnt = scst_cmd_get_sg_cnt(cmd);
+	sg = cmd->sg;
+	nr = prepare_read(virt_dev->fd, sg, sg_cnt, p->loff >> PAGE_SHIFT);
+	if (nr < 0) {
+		PRINT_ERROR("prepare_read() failed: %d", nr);
+		goto out_free_sg;
+	}
+out:
+	TRACE_EXIT();
+	return SCST_CMD_STATE_DEFAULT;
+
+out_free_sg:
+	kfree(cmd->sg);
+	cmd->sg = NULL;
+	cmd->sg_cnt = 0;
+
+enomem:
+	scst_set_busy(cmd);
+	TRACE_EXIT_RES(-ENOMEM);
+	return scst_get_cmd_abnormal_done_state(cmd);
+}
+
+/*
+ * Zero copy READ for vdisk_ramdisk: point the sg vector directly to the RAM
+ * disk chunks. Not allocated ranges are served from ZERO_PAGE.
+ */
+static int ramdisk_alloc_data_buf(struct scst_cmd *cmd)
+{
+	struct vdisk_cmd_params *p;
+	struct scst_vdisk_dev *virt_dev;
+	const gfp_t gfp_mask = GFP_KERNEL;
+	struct scatterlist *sg;
+	struct page *part = NULL, *page;
+	loff_t off, part_start = 0, part_end = 0;
+	size_t psize;
+	int i;
+
+	TRACE_ENTRY();
+
+	p = cmd->dh_priv;
+	EXTRACHECKS_BUG_ON(!p);
+	virt_dev = cmd->dev->dh_priv;
+
+	if (cmd->tgt_i_data_buf_alloced ||
+	    (cmd->data_direction & SCST_DATA_READ) == 0)
+		p->use_zero_copy = false;
+	if (!p->use_zero_copy)
+		goto out;
+
+	scst_cmd_set_dh_data_buff_alloced(cmd);
+
+	cmd->sg = alloc_sg(cmd->bufflen, p->loff & ~PAGE_MASK, gfp_mask,
+			   p->small_sg, ARRAY_SIZE(p->small_sg), &cmd->sg_cnt);
+	if (!cmd->sg) {
+		PRINT_ERROR("sg allocation failed (bufflen = %d, off = %lld)\n",
+			    cmd->bufflen, p->loff & ~PAGE_MASK);
+		goto enomem;
+	}
+
+	off = p->loff & PAGE_MASK;
+	for_each_sg(cmd->sg, sg, cmd->sg_cnt, i) {
+		if (off >= part_end) {
+			part = vdisk_ramdisk_get_page(virt_dev, off, false, 0);
+			psize = (part != NULL) ? vdisk_ramdisk_page_size(part) :
+					VDISK_RAMDISK_CHUNK_SIZE;
+			part_start = off & ~((loff_t)psize - 1);
+			part_end = part_start + psize;
+		} else if (part != NULL) {
+			/* Each sg entry holds its own reference */
+			get_page(part);
+		}
+
+		if (part != NULL)
+			page = nth_page(part, (off - part_start) >> PAGE_SHIFT);
+		else
+			page = ZERO_PAGE(0);
+
+		sg_set_page(sg, page, sg->length, sg->offset);
+		off += PAGE_SIZE;
+	}
+
+out:
+	TRACE_EXIT();
+	return SCST_CMD_STATE_DEFAULT;
+
+enomem:
+	scst_set_busy(cmd);
+	TRACE_EXIT_RES(-ENOMEM);
+	return scst_get_cmd_abnormal_done_state(cmd);
+}
+
+/* Release the chunk references taken by ramdisk_alloc_data_buf() */
+static void ramdisk_finish_read(struct scatterlist *sg, int sg_cnt)
+{
+	struct page *page;
+	int i;
+
+	TRACE_ENTRY();
+
+	for (i = 0; i < sg_cnt; ++i) {
+		page = sg_page(&sg[i]);
+		if (page != ZERO_PAGE(0))
+			put_page(compound_head(page));
+	}
+
+	TRACE_EXIT();
+	return;
+}
+#else
+static int fileio_alloc_data_buf(struct scst_cmd *cmd)
+{
+	struct vdisk_cmd_params *p;
+
+	TRACE_ENTRY();
+
+	p = cmd->dh_priv;
+	EXTRACHECKS_BUG_ON(!p);
+	p->use_zero_copy = false;
+
+	TRACE_EXIT();
+	return SCST_CMD_STATE_DEFAULT;
+}
+
+static int ramdisk_alloc_data_buf(struct scst_cmd *cmd)
+{
+	return fileio_alloc_data_buf(cmd);
+}
+
+static void finish_read(struct scatterlist *sg, int sg_cnt)
+{
+}
+
+static void ramdisk_finish_read(struct scatterlist *sg, int sg_cnt)
+{
+}
+
+static int commit_write(struct file *filp, struct scatterlist *sg, int sg_cnt,
+			loff_t pos, bool sync, int *p_donated)
+{
+	sBUG();
+	return -EINVAL;
+}
+#endif
+
+static int vdev_do_job(struct scst_cmd *cmd, const vdisk_op_fn *ops)
+{
+	int res;
+	uint8_t *cdb = cmd->cdb;
+	int opcode = cdb[0];
+	struct vdisk_cmd_params *p = cmd->dh_priv;
+	struct scst_vdisk_dev *virt_dev;
+	vdisk_op_fn op = ops[opcode];
+	enum compl_status_e s;
+
+	TRACE_ENTRY();
+
+	EXTRACHECKS_BUG_ON(!p);
+
+	virt_dev = cmd->dev->dh_priv;
+
+	EXTRACHECKS_BUG_ON(p->cmd != cmd);
+	EXTRACHECKS_BUG_ON(ops != blockio_ops && ops != fileio_ops &&
+			   ops != nullio_ops && ops != ramdisk_ops);
+
+	/*
+	 * No need to make it volatile, because at worst we will have a couple
+	 * of extra commands refused after formatting actually finished, which
+	 * is acceptable.
+	 */
+	if (unlikely(virt_dev->format_active)) {
+		switch (cmd->cdb[0]) {
+		case INQUIRY:
+		case REPORT_LUNS:
+		case REQUEST_SENSE:
+			break;
+		default:
+			scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_format_in_progress));
+			goto out_compl;
+		}
+	}
+
+	s = op(p);
+	if (s == CMD_SUCCEEDED)
+		;
+	else if (s == RUNNING_ASYNC)
+		goto out_thr;
+	else if (s == CMD_FAILED)
+		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_hardw_error));
+	else if (s == INVALID_OPCODE)
+		goto out_invalid_opcode;
+	else
+		WARN_ON(true);
+
+out_compl:
+	cmd->completed = 1;
+	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
+
+out_thr:
+	res = SCST_EXEC_COMPLETED;
+
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_invalid_opcode:
+	TRACE_DBG("Invalid opcode %s", scst_get_opcode_name(cmd));
+	scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_invalid_opcode));
+	goto out_compl;
+}
+
+static int fileio_exec(struct scst_cmd *cmd)
+{
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	const vdisk_op_fn *ops = virt_dev->vdev_devt->devt_priv;
+
+	EXTRACHECKS_BUG_ON(!ops);
+	return vdev_do_job(cmd, ops);
+}
+
+static void fileio_on_free_cmd(struct scst_cmd *cmd)
+{
+	struct vdisk_cmd_params *p = cmd->dh_priv;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	if (!p)
+		goto out;
+
+	virt_dev = cmd->dev->dh_priv;
+
+	if (p->use_zero_copy) {
+		/*
+		 * For WRITEs finish_read() drops our references of the pages.
+		 * They stay in the page cache, if commit_write() donated them.
+		 */
+		if (virt_dev->ramdisk)
+			ramdisk_finish_read(cmd->sg, cmd->sg_cnt);
+		else
+			finish_read(cmd->sg, cmd->sg_cnt);
+		if (cmd->sg != p->small_sg)
+			kfree(cmd->sg);
+		cmd->sg_cnt = 0;
+		cmd->sg = NULL;
+		cmd->bufflen = 0;
+		cmd->data_len = 0;
+	}
+
+	if (p->iv != p->small_iv)
+		kfree(p->iv);
+
+	kmem_cache_free(vdisk_cmd_param_cachep, p);
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Functionally identical to scst_tg_accept_standby(), but separated, because,
+ * generally, they are checking for different things. Better to keep different
+ * things separately.
+ */
+static bool vdisk_no_fd_allowed_commands(const struct scst_cmd *cmd)
+{
+	bool res;
+
+	TRACE_ENTRY();
+
+	switch (cmd->cdb[0]) {
+	case TEST_UNIT_READY:
+	case GET_EVENT_STATUS_NOTIFICATION:
+	case INQUIRY:
+	case MODE_SENSE:
+	case MODE_SENSE_10:
+	case READ_CAPACITY:
+	case REPORT_LUNS:
+	case REQUEST_SENSE:
+	case RELEASE:
+	case RELEASE_10:
+	case RESERVE:
+	case RESERVE_10:
+	case READ_BUFFER:
+	case WRITE_BUFFER:
+	case MODE_SELECT:
+	case MODE_SELECT_10:
+	case LOG_SELECT:
+	case LOG_SENSE:
+	case RECEIVE_DIAGNOSTIC:
+	case SEND_DIAGNOSTIC:
+	case PERSISTENT_RESERVE_IN:
+	case PERSISTENT_RESERVE_OUT:
+		res = true;
+		goto out;
+	case SERVICE_ACTION_IN_16:
+		switch (cmd->cdb[1] & 0x1f) {
+		case SAI_READ_CAPACITY_16:
+			res = true;
+			goto out;
+		}
+		break;
+	case MAINTENANCE_IN:
+		switch (cmd->cdb[1] & 0x1f) {
+		case MI_REPORT_TARGET_PGS:
+			res = true;
+			goto out;
+		}
+		break;
+	case MAINTENANCE_OUT:
+		switch (cmd->cdb[1] & 0x1f) {
+		case MO_SET_TARGET_PGS:
+			res = true;
+			goto out;
+		}
+		break;
+	}
+
+	res = false;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static int blockio_exec(struct scst_cmd *cmd)
+{
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	const vdisk_op_fn *ops = virt_dev->vdev_devt->devt_priv;
+	/* Set by blockio_alloc_data_buf() for READs served from readahead */
+	struct vdisk_ra_extent *ra_ext = cmd->dh_priv;
+	struct vdisk_cmd_params p;
+	int res;
+
+	EXTRACHECKS_BUG_ON(!ops);
+
+	memset(&p, 0, sizeof(p));
+	p.ra_ext = ra_ext;
+	if (unlikely(!vdisk_parse_offset(&p, cmd)))
+		goto err;
+
+	if (unlikely(virt_dev->fd == NULL)) {
+		if (!vdisk_no_fd_allowed_commands(cmd)) {
+			/* We should not get here */
+			PRINT_WARNING("Closed FD on exec. Secondary DRBD or not "
+				"blocked dev before ALUA state change? "
+				"(cmd %p, op %s, dev %s)", cmd, cmd->op_name,
+				cmd->dev->virt_name);
+			scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_no_medium));
+			goto err;
+		}
+	}
+
+	if ((virt_dev->ra != NULL) && (cmd->op_flags & SCST_WRITE_MEDIUM))
+		vdisk_ra_invalidate_cmd(virt_dev, cmd);
+
+	cmd->dh_priv = &p;
+	res = vdev_do_job(cmd, ops);
+	/* blockio_exec_read() could have moved cmd to another extent */
+	cmd->dh_priv = p.ra_ext;
+
+out:
+	return res;
+
+err:
+	res = SCST_EXEC_COMPLETED;
+	cmd->completed = 1;
+	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
+	goto out;
+}
+
+static int nullio_exec(struct scst_cmd *cmd)
+{
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	const vdisk_op_fn *ops = virt_dev->vdev_devt->devt_priv;
+	struct vdisk_cmd_params p;
+	int res;
+
+	EXTRACHECKS_BUG_ON(!ops);
+
+	memset(&p, 0, sizeof(p));
+	if (unlikely(!vdisk_parse_offset(&p, cmd)))
+		goto err;
+
+	cmd->dh_priv = &p;
+	res = vdev_do_job(cmd, ops);
+	/* Freed by nullio_on_free_cmd() */
+	cmd->dh_priv = p.nullio_timer;
+
+out:
+	return res;
+
+err:
+	res = SCST_EXEC_COMPLETED;
+	cmd->completed = 1;
+	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
+	goto out;
+}
+
+static int vcdrom_exec(struct scst_cmd *cmd)
+{
+	int res = SCST_EXEC_COMPLETED;
+	int opcode = cmd->cdb[0];
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+
+	TRACE_ENTRY();
+
+	cmd->status = 0;
+	cmd->msg_status = 0;
+	cmd->host_status = DID_OK;
+	cmd->driver_status = 0;
+
+	if (virt_dev->cdrom_empty && (opcode != INQUIRY)) {
+		TRACE_DBG("%s", "CDROM empty");
+		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_no_medium));
+		goto out_done;
+	}
+
+	if (virt_dev->media_changed && ((cmd->op_flags & SCST_SKIP_UA) == 0)) {
+		spin_lock(&virt_dev->flags_lock);
+		if (virt_dev->media_changed) {
+			virt_dev->media_changed = 0;
+			TRACE_DBG("%s", "Reporting media changed");
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_medium_changed_UA));
+			spin_unlock(&virt_dev->flags_lock);
+			goto out_done;
+		}
+		spin_unlock(&virt_dev->flags_lock);
+	}
+
+	res = vdev_do_job(cmd, virt_dev->blockio ? blockio_ops : fileio_ops);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_done:
+	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
+	goto out;
+}
+
+static uint64_t vdisk_gen_dev_id_num(const char *virt_dev_name)
+{
+	uint32_t dev_id_num;
+
+	dev_id_num = crc32c(0, virt_dev_name, strlen(virt_dev_name)+1);
+
+#ifdef CONFIG_SCST_PROC
+	return ((uint64_t)scst_vdisk_ID << 32) | dev_id_num;
+#else
+	return ((uint64_t)scst_get_setup_id() << 32) | dev_id_num;
+#endif
+}
+
+static int vdisk_unmap_file_range(struct scst_cmd *cmd,
+	struct scst_vdisk_dev *virt_dev, loff_t off, loff_t len,
+	struct file *fd)
+{
+	int res;
+
+	TRACE_ENTRY();
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
+	TRACE_DBG("Fallocating range %lld, len %lld",
+		(unsigned long long)off, (unsigned long long)len);
+
+	res = fd->f_op->fallocate(fd,
+		FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+	if (unlikely(res != 0)) {
+		PRINT_ERROR("fallocate() for %lld, len %lld "
+			"failed: %d", (unsigned long long)off,
+			(unsigned long long)len, res);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_write_error));
+		res = -EIO;
+	}
+#else
+	res = 0;
+#endif
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 27)
+static int vdisk_blockio_discard(struct block_device *bdev,
+	sector_t start_sector, sector_t nr_sects, gfp_t gfp)
+{
+	int res;
+
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 31)
+	res = blkdev_issue_discard(bdev, start_sector, nr_sects, gfp);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 35)       \
+      && !(LINUX_VERSION_CODE == KERNEL_VERSION(2, 6, 34) \
+           && defined(CONFIG_SUSE_KERNEL))
+	res = blkdev_issue_discard(bdev, start_sector, nr_sects,
+			gfp, DISCARD_FL_WAIT);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 37)
+	res = blkdev_issue_discard(bdev, start_sector, nr_sects,
+			gfp, BLKDEV_IFL_WAIT);
+#else
+	res = blkdev_issue_discard(bdev, start_sector, nr_sects, gfp, 0);
+#endif
+	return res;
+}
+
+/*
+ * Discards bytes [off, off + len) of striped device @virt_dev. Such range
+ * maps to a contiguous range on each member, so it takes at most one discard
+ * per member.
+ */
+static int vdisk_stripe_discard(struct scst_vdisk_dev *virt_dev,
+	loff_t off, loff_t len, gfp_t gfp)
+{
+	const int shift = virt_dev->stripe_shift;
+	loff_t first_off, last_off, chunk_left, start, end;
+	u64 first_row, last_row;
+	int first, last, i, rc, res = 0;
+
+	TRACE_ENTRY();
+
+	first = vdisk_stripe_map(virt_dev, off, &first_off, &chunk_left);
+	last = vdisk_stripe_map(virt_dev, off + len - 1, &last_off,
+			&chunk_left);
+	first_row = first_off >> shift;
+	last_row = last_off >> shift;
+
+	for (i = 0; i < virt_dev->stripe_cnt; i++) {
+		if (i == first)
+			start = first_off;
+		else if (i > first)
+			start = first_row << shift;
+		else
+			start = (first_row + 1) << shift;
+
+		if (i == last)
+			end = last_off + 1;
+		else if (i < last)
+			end = (last_row + 1) << shift;
+		else
+			end = last_row << shift;
+
+		if (start >= end)
+			continue;
 
-static const struct scst_opcode_descriptor scst_op_descr_write_verify16 = {
-	.od_opcode = WRITE_VERIFY_16,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 16,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { WRITE_VERIFY_16, VDEV_DEF_WRPROTECT | 0x16,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
-			       SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+		TRACE_DBG("Discarding %lld bytes at %lld on member %s",
+			(long long)(end - start), (long long)start,
+			virt_dev->stripe[i].filename);
 
-static const struct scst_opcode_descriptor scst_op_descr_write_verify32 = {
-	.od_opcode = VARIABLE_LENGTH_CMD,
-	.od_serv_action = SUBCODE_WRITE_VERIFY_32,
-	.od_serv_action_valid = 1,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 32,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { VARIABLE_LENGTH_CMD, SCST_OD_DEFAULT_CONTROL_BYTE,
-			       0, 0, 0, 0, VDEF_DEF_GROUP_NUM, 0x18, 0,
-			       SUBCODE_WRITE_VERIFY_32, VDEV_DEF_WRPROTECT | 0x16, 0,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF },
-};
+		rc = vdisk_blockio_discard(virt_dev->stripe[i].bdev, start >> 9,
+			(end - start) >> 9, gfp);
+		if (rc != 0)
+			res = rc;
+	}
 
-static const struct scst_opcode_descriptor scst_op_descr_write_same10 = {
-	.od_opcode = WRITE_SAME,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 10,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { WRITE_SAME, VDEV_DEF_WRPROTECT | 0x8,
-			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
-			       0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	TRACE_EXIT_RES(res);
+	return res;
+}
+#endif
 
-static const struct scst_opcode_descriptor scst_op_descr_write_same16 = {
-	.od_opcode = WRITE_SAME_16,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 16,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { WRITE_SAME_16, VDEV_DEF_WRPROTECT | 0x8,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF, VDEF_DEF_GROUP_NUM,
-			       SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+static int vdisk_unmap_range(struct scst_cmd *cmd,
+	struct scst_vdisk_dev *virt_dev, uint64_t start_lba, uint32_t blocks)
+{
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 27)
+	int res, err;
+#else
+	int res;
+#endif
+	struct file *fd = virt_dev->fd;
 
-static const struct scst_opcode_descriptor scst_op_descr_write_same32 = {
-	.od_opcode = VARIABLE_LENGTH_CMD,
-	.od_serv_action = SUBCODE_WRITE_SAME_32,
-	.od_serv_action_valid = 1,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 32,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { VARIABLE_LENGTH_CMD, SCST_OD_DEFAULT_CONTROL_BYTE,
-			       0, 0, 0, 0, VDEF_DEF_GROUP_NUM, 0x18, 0,
-			       SUBCODE_WRITE_SAME_32, VDEV_DEF_WRPROTECT | 0x8, 0,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-			       0xFF, 0xFF, 0xFF, 0xFF },
-};
+	TRACE_ENTRY();
 
-static const struct scst_opcode_descriptor scst_op_descr_read_toc = {
-	.od_opcode = READ_TOC,
-	.od_support = 3, /* supported as in the standard */
-	.od_cdb_size = 10,
-	.od_nominal_timeout = SCST_DEFAULT_NOMINAL_TIMEOUT_SEC,
-	.od_recommended_timeout = SCST_GENERIC_DISK_REG_TIMEOUT/HZ,
-	.od_cdb_usage_bits = { READ_TOC, 0, 0xF, 0, 0, 0, 0xFF,
-			       0xFF, 0xFF, SCST_OD_DEFAULT_CONTROL_BYTE },
-};
+	if (blocks == 0)
+		goto success;
 
-#define SHARED_OPS							\
-	[SYNCHRONIZE_CACHE] = vdisk_synchronize_cache,			\
-	[SYNCHRONIZE_CACHE_16] = vdisk_synchronize_cache,		\
-	[MODE_SENSE] = vdisk_exec_mode_sense,				\
-	[MODE_SENSE_10] = vdisk_exec_mode_sense,			\
-	[MODE_SELECT] = vdisk_exec_mode_select,				\
-	[MODE_SELECT_10] = vdisk_exec_mode_select,			\
-	[LOG_SELECT] = vdisk_exec_log,					\
-	[LOG_SENSE] = vdisk_exec_log,					\
-	[ALLOW_MEDIUM_REMOVAL] = vdisk_exec_prevent_allow_medium_removal, \
-	[READ_TOC] = vdisk_exec_read_toc,				\
-	[START_STOP] = vdisk_exec_start_stop,				\
-	[RESERVE] = vdisk_nop,						\
-	[RESERVE_10] = vdisk_nop,					\
-	[RELEASE] = vdisk_nop,						\
-	[RELEASE_10] = vdisk_nop,					\
-	[TEST_UNIT_READY] = vdisk_nop,					\
-	[INQUIRY] = vdisk_exec_inquiry,					\
-	[REQUEST_SENSE] = vdisk_exec_request_sense,			\
-	[READ_CAPACITY] = vdisk_exec_read_capacity,			\
-	[SERVICE_ACTION_IN_16] = vdisk_exec_sai_16,			\
-	[UNMAP] = vdisk_exec_unmap,					\
-	[WRITE_SAME] = vdisk_exec_write_same,				\
-	[WRITE_SAME_16] = vdisk_exec_write_same,			\
-	[MAINTENANCE_IN] = vdisk_exec_maintenance_in,			\
-	[MAINTENANCE_OUT] = vdisk_exec_maintenance_out,			\
-	[SEND_DIAGNOSTIC] = vdisk_exec_send_diagnostic,			\
-	[FORMAT_UNIT] = vdisk_exec_format_unit,
+	if ((start_lba > virt_dev->nblocks) ||
+	    ((start_lba + blocks) > virt_dev->nblocks)) {
+		PRINT_ERROR("Device %s: attempt to write beyond max "
+			"size", virt_dev->name);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_block_out_range_error));
+		res = -EINVAL;
+		goto out;
+	}
 
-#define SHARED_OPCODE_DESCRIPTORS					\
-	&scst_op_descr_sync_cache10,					\
-	&scst_op_descr_sync_cache16,					\
-	&scst_op_descr_mode_sense6,					\
-	&scst_op_descr_mode_sense10,					\
-	&scst_op_descr_mode_select6,					\
-	&scst_op_descr_mode_select10,					\
-	&scst_op_descr_log_select,					\
-	&scst_op_descr_log_sense,					\
-	&scst_op_descr_start_stop_unit,					\
-	&scst_op_descr_read_capacity,					\
-	&scst_op_descr_send_diagnostic,					\
-	&scst_op_descr_rtpg,						\
-	&scst_op_descr_read6,						\
-	&scst_op_descr_read10,						\
-	&scst_op_descr_read12,						\
-	&scst_op_descr_read16,						\
-	&scst_op_descr_write6,						\
-	&scst_op_descr_write10,						\
-	&scst_op_descr_write12,						\
-	&scst_op_descr_write16,						\
-	&scst_op_descr_write_verify10,					\
-	&scst_op_descr_write_verify12,					\
-	&scst_op_descr_write_verify16,					\
-	&scst_op_descr_verify10,					\
-	&scst_op_descr_verify12,					\
-	&scst_op_descr_verify16,
+	TRACE_DBG("Unmapping lba %lld (blocks %lld)",
+		(unsigned long long)start_lba, (unsigned long long)blocks);
 
-static const vdisk_op_fn blockio_var_len_ops[] = {
-	[SUBCODE_READ_32] = blockio_exec_read,
-	[SUBCODE_WRITE_32] = blockio_exec_write,
-	[SUBCODE_WRITE_VERIFY_32] = blockio_exec_write_verify,
-	[SUBCODE_VERIFY_32] = vdev_exec_verify,
-	[SUBCODE_WRITE_SAME_32] = vdisk_exec_write_same,
-};
+	if (virt_dev->blockio) {
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 27)
+		sector_t start_sector = start_lba << (cmd->dev->block_shift - 9);
+		sector_t nr_sects = blocks << (cmd->dev->block_shift - 9);
+		gfp_t gfp = cmd->cmd_gfp_mask;
 
-static vdisk_op_fn blockio_ops[256] = {
-	[READ_6] = blockio_exec_read,
-	[READ_10] = blockio_exec_read,
-	[READ_12] = blockio_exec_read,
-	[READ_16] = blockio_exec_read,
-	[WRITE_6] = blockio_exec_write,
-	[WRITE_10] = blockio_exec_write,
-	[WRITE_12] = blockio_exec_write,
-	[WRITE_16] = blockio_exec_write,
-	[WRITE_VERIFY] = blockio_exec_write_verify,
-	[WRITE_VERIFY_12] = blockio_exec_write_verify,
-	[WRITE_VERIFY_16] = blockio_exec_write_verify,
-	[VARIABLE_LENGTH_CMD] = blockio_exec_var_len_cmd,
-	[VERIFY] = vdev_exec_verify,
-	[VERIFY_12] = vdev_exec_verify,
-	[VERIFY_16] = vdev_exec_verify,
-	SHARED_OPS
-};
+		if (virt_dev->stripe_cnt != 0)
+			err = vdisk_stripe_discard(virt_dev,
+				start_lba << cmd->dev->block_shift,
+				(u64)blocks << cmd->dev->block_shift, gfp);
+		else
+			err = vdisk_blockio_discard(file_inode(fd)->i_bdev,
+				start_sector, nr_sects, gfp);
+		if (unlikely(err != 0)) {
+			PRINT_ERROR("blkdev_issue_discard() for "
+				"LBA %lld, blocks %d failed: %d",
+				(unsigned long long)start_lba, blocks, err);
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
+			res = -EIO;
+			goto out;
+		}
+#else
+		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_invalid_opcode));
+		res = -EIO;
+		goto out;
+#endif
+	} else if (virt_dev->ramdisk) {
+		vdisk_ramdisk_unmap(virt_dev, start_lba << cmd->dev->block_shift,
+			(u64)blocks << cmd->dev->block_shift);
+	} else if (virt_dev->cow) {
+		res = vdisk_cow_unmap(cmd, virt_dev,
+			start_lba << cmd->dev->block_shift,
+			(u64)blocks << cmd->dev->block_shift);
+		if (unlikely(res != 0))
+			goto out;
+	} else if (virt_dev->cache != NULL) {
+		res = vdisk_cache_unmap(cmd, virt_dev,
+			start_lba << cmd->dev->block_shift,
+			(u64)blocks << cmd->dev->block_shift);
+		if (unlikely(res != 0))
+			goto out;
+	} else {
+		loff_t off = start_lba << cmd->dev->block_shift;
+		loff_t len = (u64)blocks << cmd->dev->block_shift;
 
-static const vdisk_op_fn fileio_var_len_ops[] = {
-	[SUBCODE_READ_32] = fileio_exec_read,
-	[SUBCODE_WRITE_32] = fileio_exec_write,
-	[SUBCODE_WRITE_VERIFY_32] = fileio_exec_write_verify,
-	[SUBCODE_VERIFY_32] = vdev_exec_verify,
-	[SUBCODE_WRITE_SAME_32] = vdisk_exec_write_same,
-};
+		res = vdisk_unmap_file_range(cmd, virt_dev, off, len, fd);
+		if (unlikely(res != 0))
+			goto out;
+	}
+
+	if (virt_dev->dif_fd != NULL) {
+		res = vdisk_format_dif(cmd, start_lba, blocks);
+		if (unlikely(res != 0))
+			goto out;
+	}
+
+success:
+	res = 0;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static void vdisk_exec_write_same_unmap(struct vdisk_cmd_params *p)
+{
+	int rc;
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+
+	TRACE_ENTRY();
+
+	if (unlikely(!virt_dev->thin_provisioned)) {
+		TRACE_DBG("%s", "Device not thin provisioned");
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_invalid_opcode));
+		goto out;
+	}
+
+	if (unlikely((uint64_t)cmd->data_len > cmd->dev->max_write_same_len)) {
+		PRINT_WARNING("Invalid WRITE SAME data len %lld (max allowed "
+			"%lld)", (long long)cmd->data_len,
+			(long long)cmd->dev->max_write_same_len);
+		scst_set_invalid_field_in_cdb(cmd, cmd->len_off, 0);
+		goto out;
+	}
 
-static vdisk_op_fn fileio_ops[256] = {
-	[READ_6] = fileio_exec_read,
-	[READ_10] = fileio_exec_read,
-	[READ_12] = fileio_exec_read,
-	[READ_16] = fileio_exec_read,
-	[WRITE_6] = fileio_exec_write,
-	[WRITE_10] = fileio_exec_write,
-	[WRITE_12] = fileio_exec_write,
-	[WRITE_16] = fileio_exec_write,
-	[WRITE_VERIFY] = fileio_exec_write_verify,
-	[WRITE_VERIFY_12] = fileio_exec_write_verify,
-	[WRITE_VERIFY_16] = fileio_exec_write_verify,
-	[VARIABLE_LENGTH_CMD] = fileio_exec_var_len_cmd,
-	[VERIFY] = vdev_exec_verify,
-	[VERIFY_12] = vdev_exec_verify,
-	[VERIFY_16] = vdev_exec_verify,
-	SHARED_OPS
-};
+	rc = vdisk_unmap_range(cmd, virt_dev, cmd->lba,
+		cmd->data_len >> dev->block_shift);
+	if (rc != 0)
+		goto out;
 
-static const vdisk_op_fn nullio_var_len_ops[] = {
-	[SUBCODE_READ_32] = nullio_exec_read,
-	[SUBCODE_WRITE_32] = nullio_exec_write,
-	[SUBCODE_WRITE_VERIFY_32] = nullio_exec_write_verify,
-	[SUBCODE_WRITE_SAME_32] = vdisk_exec_write_same,
-};
+out:
+	TRACE_EXIT();
+	return;
+}
 
-static vdisk_op_fn nullio_ops[256] = {
-	[READ_6] = nullio_exec_read,
-	[READ_10] = nullio_exec_read,
-	[READ_12] = nullio_exec_read,
-	[READ_16] = nullio_exec_read,
-	[WRITE_6] = nullio_exec_write,
-	[WRITE_10] = nullio_exec_write,
-	[WRITE_12] = nullio_exec_write,
-	[WRITE_16] = nullio_exec_write,
-	[WRITE_VERIFY] = nullio_exec_write_verify,
-	[WRITE_VERIFY_12] = nullio_exec_write_verify,
-	[WRITE_VERIFY_16] = nullio_exec_write_verify,
-	[VARIABLE_LENGTH_CMD] = nullio_exec_var_len_cmd,
-	[VERIFY] = nullio_exec_verify,
-	[VERIFY_12] = nullio_exec_verify,
-	[VERIFY_16] = nullio_exec_verify,
-	SHARED_OPS
-};
+/*
+ * Returns true if the single data block of a WRITE SAME command consists of
+ * zeroes only, so the command can be served by zeroing the LBA range
+ * directly in the backend instead of replicating the block through
+ * internal WRITE commands.
+ */
+static bool vdisk_ws_data_is_zero(struct scst_cmd *cmd)
+{
+	struct scatterlist *sg = cmd->sg;
+	bool res;
+	uint8_t *buf;
 
-#define VDISK_OPCODE_DESCRIPTORS					\
-	/* &scst_op_descr_get_lba_status, */				\
-	&scst_op_descr_read_capacity16,					\
-	&scst_op_descr_write_same10,					\
-	&scst_op_descr_write_same16,					\
-	&scst_op_descr_unmap,						\
-	&scst_op_descr_format_unit,					\
-	&scst_op_descr_extended_copy,					\
-	&scst_op_descr_cwr,
+	if ((cmd->sg_cnt != 1) || (sg->length < cmd->bufflen))
+		return false;
 
-static const struct scst_opcode_descriptor *vdisk_opcode_descriptors[] = {
-	SHARED_OPCODE_DESCRIPTORS
-	VDISK_OPCODE_DESCRIPTORS
-	SCST_OPCODE_DESCRIPTORS
-	&scst_op_descr_stpg, /* must be last, see vdisk_get_supported_opcodes()! */
-};
+	if (cmd->dev->dev_dif_mode != SCST_DIF_MODE_NONE)
+		return false;
 
-static const struct scst_opcode_descriptor *vdisk_opcode_descriptors_type2[] = {
-	SHARED_OPCODE_DESCRIPTORS
-	VDISK_OPCODE_DESCRIPTORS
-	&scst_op_descr_read32,
-	&scst_op_descr_write32,
-	&scst_op_descr_verify32,
-	&scst_op_descr_write_verify32,
-	&scst_op_descr_write_same32,
-	SCST_OPCODE_DESCRIPTORS
-	&scst_op_descr_stpg, /* must be last, see vdisk_get_supported_opcodes()! */
-};
+	buf = kmap(sg_page(sg));
+	res = memchr_inv(buf + sg->offset, 0, cmd->bufflen) == NULL;
+	kunmap(sg_page(sg));
 
-static const struct scst_opcode_descriptor *vcdrom_opcode_descriptors[] = {
-	SHARED_OPCODE_DESCRIPTORS
-	&scst_op_descr_allow_medium_removal,
-	&scst_op_descr_read_toc,
-	SCST_OPCODE_DESCRIPTORS
-};
+	return res;
+}
 
-static int vdisk_get_supported_opcodes(struct scst_cmd *cmd,
-	const struct scst_opcode_descriptor ***out_supp_opcodes,
-	int *out_supp_opcodes_cnt)
+/*
+ * Zeroes blocks [start_lba, start_lba + blocks) without moving the data
+ * through the SGV pools. Returns 0 on success, -EOPNOTSUPP if the backend
+ * can't do that, so the caller should fall back to regular writes, or other
+ * error code with sense set in cmd.
+ */
+static int vdisk_zero_range(struct scst_cmd *cmd,
+	struct scst_vdisk_dev *virt_dev, uint64_t start_lba, uint64_t blocks)
 {
+	int res;
 	struct scst_device *dev = cmd->dev;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
 
-	if (cmd->dev->dev_dif_type != 2) {
-		*out_supp_opcodes = vdisk_opcode_descriptors;
-		*out_supp_opcodes_cnt = ARRAY_SIZE(vdisk_opcode_descriptors);
+	TRACE_ENTRY();
+
+	TRACE_DBG("Zeroing lba %lld (blocks %lld)",
+		(unsigned long long)start_lba, (unsigned long long)blocks);
+
+	if (virt_dev->ramdisk) {
+		vdisk_ramdisk_unmap(virt_dev, start_lba << dev->block_shift,
+			blocks << dev->block_shift);
+		res = 0;
+		goto out;
+	}
+
+	if (virt_dev->cow) {
+		/*
+		 * vdisk_cow_unmap() sets sense itself, so return its error as
+		 * is. Only -EOPNOTSUPP must not leak out: the caller would then
+		 * fall back to writes with sense already set.
+		 */
+		res = vdisk_cow_unmap(cmd, virt_dev,
+			start_lba << dev->block_shift, blocks << dev->block_shift);
+		if (unlikely(res == -EOPNOTSUPP))
+			res = -EIO;
+		goto out;
+	}
+
+	if (virt_dev->nullio) {
+		res = 0;
+		goto out;
+	}
+
+	if (virt_dev->stripe_cnt != 0) {
+		/* Regular striped WRITEs will do it */
+		res = -EOPNOTSUPP;
+		goto out;
+	}
+
+	if (virt_dev->cache != NULL) {
+		/* Regular WRITEs through the cache will do it */
+		res = -EOPNOTSUPP;
+		goto out;
+	}
+
+	if (virt_dev->blockio) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+		sector_t start_sector = start_lba << (dev->block_shift - 9);
+		sector_t nr_sects = blocks << (dev->block_shift - 9);
+		gfp_t gfp = cmd->cmd_gfp_mask;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 37)
+		res = blkdev_issue_zeroout(virt_dev->bdev, start_sector,
+				nr_sects, gfp, BLKDEV_IFL_WAIT);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(3, 19, 0)
+		res = blkdev_issue_zeroout(virt_dev->bdev, start_sector,
+				nr_sects, gfp);
+#else
+		res = blkdev_issue_zeroout(virt_dev->bdev, start_sector,
+				nr_sects, gfp, virt_dev->thin_provisioned &&
+				virt_dev->discard_zeroes_data);
+#endif
+		if ((res == 0) && virt_dev->wt_flag && !virt_dev->nv_cache)
+			res = vdisk_blockio_flush(virt_dev->bdev, gfp, true,
+					NULL, false);
+#else
+		res = -EOPNOTSUPP;
+#endif
 	} else {
-		*out_supp_opcodes = vdisk_opcode_descriptors_type2;
-		*out_supp_opcodes_cnt = ARRAY_SIZE(vdisk_opcode_descriptors_type2);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+		struct file *fd = virt_dev->fd;
+		loff_t off = start_lba << dev->block_shift;
+		loff_t len = blocks << dev->block_shift;
+
+		if (fd->f_op->fallocate == NULL) {
+			res = -EOPNOTSUPP;
+			goto out;
+		}
+
+		res = fd->f_op->fallocate(fd,
+			FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, off, len);
+		/* fallocate() doesn't honor O_DSYNC, which is used for WT */
+		if ((res == 0) && virt_dev->wt_flag && !virt_dev->nv_cache)
+			res = vfs_fsync_range(fd, off, off + len - 1, 1);
+#else
+		res = -EOPNOTSUPP;
+#endif
 	}
-	if (!virt_dev->expl_alua) {
-		(*out_supp_opcodes_cnt)--;
-		sBUG_ON((*out_supp_opcodes)[*out_supp_opcodes_cnt]->od_serv_action != MO_SET_TARGET_PGS);
+
+	if (res == -EOPNOTSUPP) {
+		TRACE_DBG("Zeroing not supported by dev %s, falling back to "
+			"writes", virt_dev->name);
+	} else if (unlikely(res != 0)) {
+		PRINT_ERROR("Zeroing lba %lld (blocks %lld) failed: %d "
+			"(dev %s)", (unsigned long long)start_lba,
+			(unsigned long long)blocks, res, virt_dev->name);
+		if (res == -ENOMEM)
+			scst_set_busy(cmd);
+		else
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
 	}
-	return 0;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
 }
 
-static int vcdrom_get_supported_opcodes(struct scst_cmd *cmd,
-	const struct scst_opcode_descriptor ***out_supp_opcodes,
-	int *out_supp_opcodes_cnt)
+/*
+ * Copy a zero-terminated string into a fixed-size byte array and fill the
+ * trailing bytes with @fill_byte.
+ */
+static void scst_copy_and_fill_b(char *dst, const char *src, int len,
+				 uint8_t fill_byte)
 {
-	*out_supp_opcodes = vcdrom_opcode_descriptors;
-	*out_supp_opcodes_cnt = ARRAY_SIZE(vcdrom_opcode_descriptors);
-	return 0;
+	int cpy_len = min_t(int, strlen(src), len);
+
+	memcpy(dst, src, cpy_len);
+	memset(dst + cpy_len, fill_byte, len - cpy_len);
 }
 
-static bool vdisk_use_zero_copy(const struct scst_cmd *cmd)
+/*
+ * Copy a zero-terminated string into a fixed-size char array and fill the
+ * trailing characters with spaces.
+ */
+static void scst_copy_and_fill(char *dst, const char *src, int len)
+{
+	scst_copy_and_fill_b(dst, src, len, ' ');
+}
+
+static enum compl_status_e vdisk_exec_write_same(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	enum compl_status_e res = CMD_SUCCEEDED;
+	uint8_t ctrl_offs = (cmd->cdb_len < 32) ? 1 : 10;
+
+	TRACE_ENTRY();
+
+	if (unlikely(cmd->cdb[ctrl_offs] & 0x10)) {
+		TRACE_DBG("%s", "ANCHOR not supported");
+		scst_set_invalid_field_in_cdb(cmd, ctrl_offs,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 4);
+		goto out;
+	}
+
+	if (unlikely(cmd->data_len <= 0)) {
+		PRINT_ERROR("WRITE SAME: refused data_len = %#llx",
+			    cmd->data_len);
+		scst_set_invalid_field_in_cdb(cmd, cmd->len_off, 0);
+		goto out;
+	}
+
+	if (cmd->cdb[ctrl_offs] & 0x8) {
+		vdisk_exec_write_same_unmap(p);
+		goto out;
+	}
+
+	if (((cmd->cdb[ctrl_offs] & 0x6) == 0) &&
+	    ((uint64_t)cmd->data_len <= cmd->dev->max_write_same_len) &&
+	    vdisk_ws_data_is_zero(cmd)) {
+		int rc = vdisk_zero_range(cmd, cmd->dev->dh_priv, cmd->lba,
+				cmd->data_len >> cmd->dev->block_shift);
+		if (rc != -EOPNOTSUPP)
+			goto out;
+	}
+
+	scst_write_same(cmd, NULL);
+	res = RUNNING_ASYNC;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static enum compl_status_e vdisk_exec_unmap(struct vdisk_cmd_params *p)
 {
+	struct scst_cmd *cmd = p->cmd;
 	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct scst_data_descriptor *pd = cmd->cmd_data_descriptors;
+	int i, cnt = cmd->cmd_data_descriptors_cnt;
+	uint32_t blocks_to_unmap;
+
+	TRACE_ENTRY();
+
+	if (unlikely(!virt_dev->thin_provisioned)) {
+		TRACE_DBG("%s", "Device not thin provisioned");
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_invalid_opcode));
+		goto out;
+	}
+
+	if (unlikely(cmd->cdb[1] & 1)) {
+		TRACE_DBG("%s", "ANCHOR not supported");
+		scst_set_invalid_field_in_cdb(cmd, 1,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
+		goto out;
+	}
+
+	if (pd == NULL)
+		goto out;
+
+	/* Sanity check to avoid too long latencies */
+	blocks_to_unmap = 0;
+	for (i = 0; i < cnt; i++) {
+		blocks_to_unmap += pd[i].sdd_blocks;
+		if (blocks_to_unmap > virt_dev->unmap_max_lba_cnt) {
+			PRINT_WARNING("Too many UNMAP LBAs %u (max allowed %u, "
+				"dev %s)", blocks_to_unmap,
+				virt_dev->unmap_max_lba_cnt,
+				virt_dev->dev->virt_name);
+			scst_set_invalid_field_in_parm_list(cmd, 0, 0);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < cnt; i++) {
+		int rc;
 
-	if (!virt_dev->zero_copy)
-		return false;
+		if (unlikely(test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags))) {
+			TRACE_MGMT_DBG("ABORTED set, aborting cmd %p", cmd);
+			goto out;
+		}
 
-	switch (cmd->cdb[0]) {
-	case VARIABLE_LENGTH_CMD:
-		if (cmd->cdb[9] != SUBCODE_READ_32)
-			break;
-		/* else go througth */
-	case READ_6:
-	case READ_10:
-	case READ_12:
-	case READ_16:
-		return true;
+		rc = vdisk_unmap_range(cmd, virt_dev, pd[i].sdd_lba,
+			pd[i].sdd_blocks);
+		if (rc != 0)
+			goto out;
 	}
 
-	return false;
+out:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
 }
 
-/*
- * Compute p->loff and p->fua.
- * Returns true for success or false otherwise and set error in the commeand.
- */
-static bool vdisk_parse_offset(struct vdisk_cmd_params *p, struct scst_cmd *cmd)
+/* Supported VPD Pages VPD page (00h). */
+static int vdisk_sup_vpd(uint8_t *buf, struct scst_cmd *cmd,
+			 struct scst_vdisk_dev *virt_dev)
 {
-	uint64_t lba_start;
-	int64_t data_len;
-	uint8_t *cdb = cmd->cdb;
-	int opcode = cdb[0];
-	loff_t loff;
-	struct scst_device *dev = cmd->dev;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
-	bool res;
-	int fua = 0;
-
-	TRACE_ENTRY();
+	char *page_list = &buf[4], *p = page_list;
 
-	if (unlikely(!(cmd->op_flags & SCST_INFO_VALID))) {
-		TRACE(TRACE_MINOR, "Unknown opcode %s", scst_get_opcode_name(cmd));
-		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_invalid_opcode));
-		res = false;
-		goto out;
+	*p++ = 0x0; /* this page */
+	*p++ = 0x80; /* unit serial number */
+	*p++ = 0x83; /* device identification */
+	*p++ = 0x86; /* extended inquiry */
+	if (cmd->dev->type == TYPE_DISK) {
+		*p++ = 0xB0; /* block limits */
+		*p++ = 0xB1; /* block device characteristics */
+		if (virt_dev->thin_provisioned)
+			*p++ = 0xB2; /* thin provisioning */
 	}
+	buf[3] = p - page_list; /* page length */
 
-	p->cmd = cmd;
+	return buf[3] + 4;
+}
 
-	cmd->status = 0;
-	cmd->msg_status = 0;
-	cmd->host_status = DID_OK;
-	cmd->driver_status = 0;
+/* Unit Serial Number VPD page (80h) */
+static int vdisk_usn_vpd(uint8_t *buf, struct scst_cmd *cmd,
+			 struct scst_vdisk_dev *virt_dev)
+{
+	buf[1] = 0x80;
+	if (cmd->tgtt->get_serial) {
+		buf[3] = cmd->tgtt->get_serial(cmd->tgt_dev, &buf[4],
+					       INQ_BUF_SZ - 4);
+	} else {
+		int usn_len;
 
-	switch (cmd->queue_type) {
-	case SCST_CMD_QUEUE_ORDERED:
-		TRACE(TRACE_ORDER, "ORDERED cmd %p (op %s)", cmd,
-			scst_get_opcode_name(cmd));
-		break;
-	case SCST_CMD_QUEUE_HEAD_OF_QUEUE:
-		TRACE(TRACE_ORDER, "HQ cmd %p (op %s)", cmd,
-			scst_get_opcode_name(cmd));
-		break;
-	default:
-		break;
+		read_lock(&vdisk_serial_rwlock);
+		usn_len = strlen(virt_dev->usn);
+		buf[3] = usn_len;
+		strncpy(&buf[4], virt_dev->usn, usn_len);
+		read_unlock(&vdisk_serial_rwlock);
 	}
+	return buf[3] + 4;
+}
 
-	lba_start = scst_cmd_get_lba(cmd);
-	data_len = scst_cmd_get_data_len(cmd);
+/* Device Identification VPD page (83h) */
+static int vdisk_dev_id_vpd(uint8_t *buf, struct scst_cmd *cmd,
+			    struct scst_vdisk_dev *virt_dev)
+{
+	int i, eui64_len = 0, naa_len = 0, resp_len, num = 4;
+	uint16_t tg_id;
+	u8 *eui64_id = NULL, *naa_id = NULL;
 
-	loff = (loff_t)lba_start << dev->block_shift;
-	TRACE_DBG("cmd %p, lba_start %lld, loff %lld, data_len %lld", cmd,
-		  (unsigned long long int)lba_start,
-		  (unsigned long long int)loff,
-		  (unsigned long long int)data_len);
+	buf[1] = 0x83;
 
-	EXTRACHECKS_BUG_ON((loff < 0) || unlikely(data_len < 0));
+	read_lock(&vdisk_serial_rwlock);
+	i = strlen(virt_dev->scsi_device_name);
+	if (i > 0) {
+		/* SCSI target device name */
+		buf[num + 0] = 0x3;	/* ASCII */
+		buf[num + 1] = 0x20 | 0x8; /* Target device SCSI name */
+		i += 4 - i % 4; /* align to required 4 bytes */
+		scst_copy_and_fill_b(&buf[num + 4], virt_dev->scsi_device_name,
+				     i, '\0');
 
-	if (unlikely((loff + data_len) > virt_dev->file_size) &&
-	    (!(cmd->op_flags & SCST_LBA_NOT_VALID))) {
-		if (virt_dev->cdrom_empty) {
-			TRACE_DBG("%s", "CDROM empty");
-			scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_no_medium));
-		} else {
-			PRINT_INFO("Access beyond the end of device %s "
-				"(%lld of %lld, data len %lld)", virt_dev->name,
-				(unsigned long long int)loff,
-				(unsigned long long int)virt_dev->file_size,
-				(unsigned long long int)data_len);
-			scst_set_cmd_error(cmd, SCST_LOAD_SENSE(
-					scst_sense_block_out_range_error));
-		}
-		res = false;
-		goto out;
-	}
+		buf[num + 3] = i;
+		num += buf[num + 3];
 
-	switch (opcode) {
-	case VARIABLE_LENGTH_CMD:
-		if (cmd->cdb[9] == SUBCODE_WRITE_32) {
-			fua = (cdb[10] & 0x8);
-			if (fua)
-				TRACE(TRACE_ORDER, "FUA: loff=%lld, data_len=%lld",
-					(unsigned long long)loff,
-					(unsigned long long)data_len);
-		}
-		break;
-	case WRITE_10:
-	case WRITE_12:
-	case WRITE_16:
-		fua = (cdb[1] & 0x8);
-		if (fua) {
-			TRACE(TRACE_ORDER, "FUA: loff=%lld, "
-				"data_len=%lld", (unsigned long long int)loff,
-				(unsigned long long int)data_len);
-		}
-		break;
+		num += 4;
 	}
+	read_unlock(&vdisk_serial_rwlock);
 
-	p->loff = loff;
-	p->fua = fua;
-	p->use_zero_copy = vdisk_use_zero_copy(cmd);
+	/* T10 vendor identifier field format (faked) */
+	buf[num + 0] = 0x2;	/* ASCII */
+	buf[num + 1] = 0x1;	/* Vendor ID */
+	read_lock(&vdisk_serial_rwlock);
+	scst_copy_and_fill(&buf[num + 4], virt_dev->t10_vend_id, 8);
+	i = strlen(virt_dev->vend_specific_id);
+	memcpy(&buf[num + 12], virt_dev->vend_specific_id, i);
+	read_unlock(&vdisk_serial_rwlock);
 
-	res = true;
+	buf[num + 3] = 8 + i;
+	num += buf[num + 3];
 
-out:
-	TRACE_EXIT_RES(res);
-	return res;
-}
+	num += 4;
 
-static int fileio_alloc_and_parse(struct scst_cmd *cmd)
-{
-	struct vdisk_cmd_params *p;
-	int res = SCST_CMD_STATE_DEFAULT;
+	/*
+	 * Relative target port identifier
+	 */
+	buf[num + 0] = 0x01; /* binary */
+	/* Relative target port id */
+	buf[num + 1] = 0x10 | 0x04;
 
-	TRACE_ENTRY();
+	put_unaligned_be16(cmd->tgt->rel_tgt_id, &buf[num + 4 + 2]);
 
-	p = kmem_cache_zalloc(vdisk_cmd_param_cachep, cmd->cmd_gfp_mask);
-	if (!p) {
-		scst_set_busy(cmd);
-		goto out_err;
-	}
+	buf[num + 3] = 4;
+	num += buf[num + 3];
 
-	if (unlikely(!vdisk_parse_offset(p, cmd)))
-		goto out_err_free_cmd_params;
+	num += 4;
 
-	cmd->dh_priv = p;
+	tg_id = scst_lookup_tg_id(cmd->dev, cmd->tgt);
+	if (tg_id) {
+		/*
+		 * Target port group designator
+		 */
+		buf[num + 0] = 0x01; /* binary */
+		/* Target port group id */
+		buf[num + 1] = 0x10 | 0x05;
 
-out:
-	TRACE_EXIT_RES(res);
-	return res;
+		put_unaligned_be16(tg_id, &buf[num + 4 + 2]);
 
-out_err_free_cmd_params:
-	kmem_cache_free(vdisk_cmd_param_cachep, p);
+		buf[num + 3] = 4;
+		num += 4 + buf[num + 3];
+	}
+
+	read_lock(&vdisk_serial_rwlock);
+
+	if (virt_dev->eui64_id_len == 0 && virt_dev->naa_id_len == 0) {
+		/*
+		 * Compatibility mode: export the first eight bytes of the
+		 * t10_dev_id as an EUI-64 ID. This is not entirely standards
+		 * compliant since t10_dev_id contains an ASCII string and the
+		 * first three bytes of an eight-byte EUI-64 ID are a OUI.
+		 */
+		eui64_len = 8;
+		eui64_id  = virt_dev->t10_dev_id;
+	} else {
+		if (virt_dev->eui64_id_len) {
+			eui64_len = virt_dev->eui64_id_len;
+			eui64_id  = virt_dev->eui64_id;
+		}
+		if (virt_dev->naa_id_len) {
+			naa_len = virt_dev->naa_id_len;
+			naa_id  = virt_dev->naa_id;
+		}
+	}
+	if (eui64_len) {
+		buf[num + 0] = 0x01; /* binary */
+		buf[num + 1] = 0x02; /* EUI-64 */
+		buf[num + 2] = 0x00; /* reserved */
+		buf[num + 3] = eui64_len;
+		memcpy(&buf[num + 4], eui64_id, eui64_len);
+		num += 4 + eui64_len;
+	}
+	if (naa_len) {
+		buf[num + 0] = 0x01; /* binary */
+		buf[num + 1] = 0x03; /* NAA */
+		buf[num + 2] = 0x00; /* reserved */
+		buf[num + 3] = naa_len;
+		memcpy(&buf[num + 4], naa_id, naa_len);
+		num += 4 + naa_len;
+	}
 
-out_err:
-	res = scst_get_cmd_abnormal_done_state(cmd);
-	goto out;
-}
+	read_unlock(&vdisk_serial_rwlock);
 
-static int vdisk_parse(struct scst_cmd *cmd)
-{
-	int res, rc;
+	resp_len = num - 4;
 
-	rc = scst_sbc_generic_parse(cmd);
-	if (rc != 0) {
-		res = scst_get_cmd_abnormal_done_state(cmd);
-		goto out;
-	}
+	put_unaligned_be16(resp_len, &buf[2]);
+	resp_len += 4;
 
-	res = fileio_alloc_and_parse(cmd);
-out:
-	return res;
+	return resp_len;
 }
 
-static int vcdrom_parse(struct scst_cmd *cmd)
+/* Extended INQUIRY Data (86h) */
+static int vdisk_ext_inq(uint8_t *buf, struct scst_cmd *cmd,
+			 struct scst_vdisk_dev *virt_dev)
 {
-	int res, rc;
+	struct scst_device *dev = cmd->dev;
 
-	rc = scst_cdrom_generic_parse(cmd);
-	if (rc != 0) {
-		res = scst_get_cmd_abnormal_done_state(cmd);
-		goto out;
+	buf[1] = 0x86;
+	buf[3] = 0x3C;
+	if (dev->dev_dif_mode != SCST_DIF_MODE_NONE) {
+		switch (dev->dev_dif_type) {
+		case 1:
+			buf[4] = 0; /* SPT=0, type 1 only supported */
+			break;
+		case 2:
+			buf[4] = 0x10; /* SPT=010, type 2 only supported */
+			break;
+		case 3:
+			buf[4] = 0x20; /* SPT=100, type 3 only supported */
+			break;
+		default:
+			sBUG_ON(1);
+			break;
+		}
+		buf[4] |= 4; /* GRD_CHK */
+		if (dev->dif_app_chk)
+			buf[4] |= 2; /* APP_CHK */
+		if (dev->dif_ref_chk)
+			buf[4] |= 1; /* REF_CHK */
 	}
-
-	res = fileio_alloc_and_parse(cmd);
-out:
-	return res;
+	buf[5] = 7; /* HEADSUP=1, ORDSUP=1, SIMPSUP=1 */
+	buf[6] = (virt_dev->wt_flag || virt_dev->nv_cache) ? 0 : 1; /* V_SUP */
+	buf[7] = 1; /* LUICLR=1 */
+	return buf[3] + 4;
 }
 
-/* blockio and nullio */
-static int non_fileio_parse(struct scst_cmd *cmd)
+/* Block Limits VPD page (B0h) */
+static int vdisk_block_limits(uint8_t *buf, struct scst_cmd *cmd,
+			      struct scst_vdisk_dev *virt_dev)
 {
-	int res = SCST_CMD_STATE_DEFAULT, rc;
+	struct scst_device *dev = cmd->dev;
+	int max_transfer;
 
-	rc = scst_sbc_generic_parse(cmd);
-	if (rc != 0) {
-		res = scst_get_cmd_abnormal_done_state(cmd);
-		goto out;
-	}
-out:
-	return res;
-}
+	buf[1] = 0xB0;
+	buf[3] = 0x3C;
+	buf[4] = 1; /* WSNZ set */
+	buf[5] = 0xFF; /* No MAXIMUM COMPARE AND WRITE LENGTH limit */
+	/* Optimal transfer granuality is PAGE_SIZE */
+	put_unaligned_be16(max_t(int, PAGE_SIZE / dev->block_size, 1), &buf[6]);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)
-/**
- * finish_read - Release the pages referenced by prepare_read().
- */
-static void finish_read(struct scatterlist *sg, int sg_cnt)
-{
-	struct page *page;
-	int i;
+	/* Max transfer len is min of sg limit and 8M */
+	max_transfer = min_t(int, cmd->tgt_dev->max_sg_cnt << PAGE_SHIFT,
+			     8*1024*1024) / dev->block_size;
+	put_unaligned_be32(max_transfer, &buf[8]);
 
-	TRACE_ENTRY();
+	/*
+	 * Let's have optimal transfer len 512KB. Better to not
+	 * set it at all, because we don't have such limit,
+	 * but some initiators may not understand that (?).
+	 * From other side, too big transfers  are not optimal,
+	 * because SGV cache supports only <4M buffers.
+	 */
+	put_unaligned_be32(min_t(int, max_transfer, 512*1024 / dev->block_size),
+			   &buf[12]);
 
-	for (i = 0; i < sg_cnt; ++i) {
-		page = sg_page(&sg[i]);
-		EXTRACHECKS_BUG_ON(!page);
-		page_cache_release(page);
+	if (virt_dev->thin_provisioned) {
+		/* MAXIMUM UNMAP BLOCK DESCRIPTOR COUNT is UNLIMITED */
+		put_unaligned_be32(0xFFFFFFFF, &buf[24]);
+		/*
+		 * MAXIMUM UNMAP LBA COUNT, OPTIMAL UNMAP
+		 * GRANULARITY and ALIGNMENT
+		 */
+		put_unaligned_be32(virt_dev->unmap_max_lba_cnt, &buf[20]);
+		put_unaligned_be32(virt_dev->unmap_opt_gran, &buf[28]);
+		if (virt_dev->unmap_align != 0) {
+			put_unaligned_be32(virt_dev->unmap_align, &buf[32]);
+			buf[32] |= 0x80;
+		}
 	}
 
-	TRACE_EXIT();
-	return;
+	/* MAXIMUM WRITE SAME LENGTH (measured in blocks) */
+	put_unaligned_be64(dev->max_write_same_len >> dev->block_shift,
+			   &buf[36]);
+
+	return buf[3] + 4;
 }
 
-/**
- * prepare_read_page - Bring a single page into the page cache.
- *
- * @filp: file pointer
- * @len: number of bytes to read from the file
- * @offset: offset of first byte to read (from start of file)
- * @last: offset of first byte that will not be read - used for readahead
- * @pageptr: page pointer output variable.
- *
- * Returns a negative number if an error occurred, zero upon EOF or a positive
- * number - the number of bytes that can be read from the file via the returned
- * page. If a positive number is returned, it is the responsibility of the
- * caller to release the returned page.
- *
- * Based on do_generic_file_read().
- */
-static int prepare_read_page(struct file *filp, int len,
-			     loff_t offset, loff_t last, struct page **pageptr)
+/* Block Device Characteristics VPD Page (B1h) */
+static int vdisk_bdev_char(uint8_t *buf, struct scst_cmd *cmd,
+			   struct scst_vdisk_dev *virt_dev)
 {
-	struct address_space *mapping = filp->f_mapping;
-	struct inode *inode = mapping->host;
-	struct file_ra_state *ra = &filp->f_ra;
-	struct page *page;
-	unsigned long index, last_index;
-	long end_index, nr;
-	loff_t isize;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 15, 0)
-	read_descriptor_t desc = { .count = len };
-#endif
-	int error;
-
-	TRACE_ENTRY();
+	buf[1] = 0xB1;
+	buf[3] = 0x3C;
+	if (virt_dev->rotational) {
+		/* 15K RPM */
+		put_unaligned_be16(0x3A98, &buf[4]);
+	} else
+		put_unaligned_be16(1, &buf[4]);
+	return buf[3] + 4;
+}
 
-	WARN((offset & ~PAGE_CACHE_MASK) + len > PAGE_CACHE_SIZE,
-	     "offset = %lld + %lld, len = %d\n", offset & PAGE_CACHE_MASK,
-	     offset & ~PAGE_CACHE_MASK, len);
-	sBUG_ON(!mapping->a_ops);
+/* Logical Block Provisioning a.k.a. Thin Provisioning VPD page (B2h) */
+static int vdisk_tp_vpd(uint8_t *buf, struct scst_cmd *cmd,
+			struct scst_vdisk_dev *virt_dev)
+{
+	buf[1] = 0xB2;
+	buf[3] = 4;
+	buf[5] = 0xE0;
+	if (virt_dev->discard_zeroes_data)
+		buf[5] |= 0x4; /* LBPRZ */
+	buf[6] = 2; /* thin provisioned */
+	return buf[3] + 4;
+}
 
-	index = offset >> PAGE_CACHE_SHIFT;
-	last_index = (last + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+/* Standard INQUIRY response */
+static int vdisk_inq(uint8_t *buf, struct scst_cmd *cmd,
+		     struct scst_vdisk_dev *virt_dev)
+{
+	int num;
 
-find_page:
-	page = find_get_page(mapping, index);
-	if (!page) {
-		page_cache_sync_readahead(mapping, ra, filp, index,
-					  last_index - index);
-		page = find_get_page(mapping, index);
-		if (unlikely(!page)) {
-			/*
-			 * Not cached so create a new page.
-			 */
-			page = page_cache_alloc_cold(mapping);
-			if (!page) {
-				error = -ENOMEM;
-				goto err;
-			}
-			error = add_to_page_cache_lru(page, mapping, index,
-						      GFP_KERNEL);
-			if (error) {
-				page_cache_release(page);
-				if (error == -EEXIST)
-					goto find_page;
-				else
-					goto err;
-			} else {
-				goto readpage;
-			}
-		}
-	}
-	if (PageReadahead(page))
-		page_cache_async_readahead(mapping, ra, filp, page,
-					   index, last_index - index);
-	if (!PageUptodate(page)) {
-		if (inode->i_blkbits == PAGE_CACHE_SHIFT ||
-		    !mapping->a_ops->is_partially_uptodate)
-			goto page_not_up_to_date;
-		if (!trylock_page(page))
-			goto page_not_up_to_date;
-		/* Did it get truncated before we got the lock? */
-		if (!page->mapping)
-			goto page_not_up_to_date_locked;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
-		if (!mapping->a_ops->is_partially_uptodate(page,
-						offset & ~PAGE_CACHE_MASK, len))
-#else
-		if (!mapping->a_ops->is_partially_uptodate(page, &desc,
-						offset & ~PAGE_CACHE_MASK))
-#endif
-			goto page_not_up_to_date_locked;
-		unlock_page(page);
+	if (virt_dev->removable)
+		buf[1] = 0x80;      /* removable */
+	buf[2] = 6; /* Device complies to SPC-4 */
+	buf[3] = 0x02;	/* Data in format specified in SPC */
+	if (cmd->tgtt->fake_aca)
+		buf[3] |= 0x20;
+	buf[4] = 31;/* n - 4 = 35 - 4 = 31 for full 36 byte data */
+	if (cmd->dev->dev_dif_mode != SCST_DIF_MODE_NONE)
+		buf[5] |= 1; /* PROTECT */
+	if (scst_alua_configured(cmd->dev)) {
+		buf[5] |= SCST_INQ_TPGS_MODE_IMPLICIT;
+		if (virt_dev->expl_alua)
+			buf[5] |= SCST_INQ_TPGS_MODE_EXPLICIT;
 	}
-page_ok:
+	buf[5] |= 8; /* 3PC */
+	buf[6] = 0x10; /* MultiP 1 */
+	buf[7] = 2; /* CMDQUE 1, BQue 0 => commands queuing supported */
+
+	read_lock(&vdisk_serial_rwlock);
+
 	/*
-	 * i_size must be checked after we know the page is Uptodate.
-	 *
-	 * Checking i_size after the check allows us to calculate the correct
-	 * value for "nr", which means the zero-filled part of the page is not
-	 * accessed (unless another truncate extends the file - this is
-	 * desired though).
+	 * 8 byte ASCII Vendor Identification of the target
+	 * - left aligned.
 	 */
+	scst_copy_and_fill(&buf[8], virt_dev->t10_vend_id, 8);
 
-	isize = i_size_read(inode);
-	end_index = (isize - 1) >> PAGE_CACHE_SHIFT;
-	if (unlikely(isize == 0 || index > end_index)) {
-		page_cache_release(page);
-		goto eof;
-	}
-
-	/* nr is the maximum number of bytes to copy from this page */
-	if (index < end_index) {
-		nr = PAGE_CACHE_SIZE - (offset & ~PAGE_CACHE_MASK);
-	} else {
-		nr = ((isize - 1) & ~PAGE_CACHE_MASK) + 1 -
-			(offset & ~PAGE_CACHE_MASK);
-		if (nr <= 0) {
-			page_cache_release(page);
-			goto eof;
-		}
-	}
+	/*
+	 * 16 byte ASCII Product Identification of the target - left
+	 * aligned.
+	 */
+	scst_copy_and_fill(&buf[16], virt_dev->prod_id, 16);
 
 	/*
-	 * If users can be writing to this page using arbitrary virtual
-	 * addresses, take care about potential aliasing before reading the
-	 * page on the kernel side.
+	 * 4 byte ASCII Product Revision Level of the target - left
+	 * aligned.
 	 */
-	if (mapping_writably_mapped(mapping))
-		flush_dcache_page(page);
+	scst_copy_and_fill(&buf[32], virt_dev->prod_rev_lvl, 4);
 
-	mark_page_accessed(page);
+	/* Vendor specific information. */
+	if (virt_dev->inq_vend_specific_len <= 20)
+		memcpy(&buf[36], virt_dev->inq_vend_specific,
+		       virt_dev->inq_vend_specific_len);
 
-	/* Ok, we have the page and it's up to date. */
-	*pageptr = page;
-	TRACE_EXIT_RES(nr);
-	return nr;
-eof:
-	TRACE_EXIT();
-	return 0;
-err:
-	TRACE_EXIT_RES(error);
-	return error;
+	/** Version descriptors **/
 
-page_not_up_to_date:
-	/* Try to get exclusive access to the page. */
-	error = lock_page_killable(page);
-	if (unlikely(error != 0)) {
-		page_cache_release(page);
-		goto err;
-	}
+	buf[4] += 58 - 36;
+	num = 0;
 
-page_not_up_to_date_locked:
-	/* Did it get truncated before we got the lock? */
-	if (!page->mapping) {
-		unlock_page(page);
-		page_cache_release(page);
-		goto find_page;
+	/* SAM-4 T10/1683-D revision 14 */
+	buf[58 + num] = 0x0;
+	buf[58 + num + 1] = 0x8B;
+	num += 2;
+
+	/* Physical transport */
+	if (cmd->tgtt->get_phys_transport_version != NULL) {
+		uint16_t v = cmd->tgtt->get_phys_transport_version(cmd->tgt);
+
+		if (v != 0) {
+			put_unaligned_be16(v, &buf[58 + num]);
+			num += 2;
+		}
 	}
 
-	/* Did somebody else fill it already? */
-	if (PageUptodate(page)) {
-		unlock_page(page);
-		goto page_ok;
+	/* SCSI transport */
+	if (cmd->tgtt->get_scsi_transport_version != NULL) {
+		put_unaligned_be16(
+			cmd->tgtt->get_scsi_transport_version(cmd->tgt),
+			&buf[58 + num]);
+		num += 2;
 	}
 
-readpage:
-	/*
-	 * A previous I/O error may have been due to temporary
-	 * failures, eg. multipath errors.
-	 * PG_error will be set again if readpage fails.
-	 */
-	ClearPageError(page);
-	/* Start the actual read. The read will unlock the page. */
-	error = mapping->a_ops->readpage(filp, page);
-	if (unlikely(error)) {
-		if (error == AOP_TRUNCATED_PAGE) {
-			page_cache_release(page);
-			goto find_page;
-		}
-		WARN(error >= 0, "error = %d\n", error);
-		page_cache_release(page);
-		goto err;
+	/* SPC-4 T10/1731-D revision 23 */
+	buf[58 + num] = 0x4;
+	buf[58 + num + 1] = 0x63;
+	num += 2;
+
+	/* Device command set */
+	if (virt_dev->command_set_version != 0) {
+		put_unaligned_be16(virt_dev->command_set_version,
+				   &buf[58 + num]);
+		num += 2;
 	}
 
-	if (!PageUptodate(page)) {
-		error = lock_page_killable(page);
-		if (unlikely(error != 0)) {
-			page_cache_release(page);
-			goto err;
-		}
-		if (!PageUptodate(page)) {
-			if (page->mapping == NULL) {
-				/*
-				 * invalidate_mapping_pages got it
-				 */
-				unlock_page(page);
-				page_cache_release(page);
-				goto find_page;
-			}
-			unlock_page(page);
-			page_cache_release(page);
-			error = -EIO;
-			goto err;
-		}
-		unlock_page(page);
+	/* Vendor specific information. */
+	if (virt_dev->inq_vend_specific_len > 20) {
+		memcpy(&buf[96], virt_dev->inq_vend_specific,
+		       virt_dev->inq_vend_specific_len);
+		num = 96 - 58 + virt_dev->inq_vend_specific_len;
 	}
 
-	goto page_ok;
+	read_unlock(&vdisk_serial_rwlock);
+
+	buf[4] += num;
+	return buf[4] + 5;
 }
 
-/**
- * prepare_read - Lock page cache pages corresponding to an sg vector
- * @filp: file the sg vector applies to
- * @sg: sg vector
- * @sg_cnt: sg vector size
- * @offset: file offset the first byte of the first sg element corresponds to
- */
-static int prepare_read(struct file *filp, struct scatterlist *sg, int sg_cnt,
-			pgoff_t offset)
+static enum compl_status_e vdisk_exec_inquiry(struct vdisk_cmd_params *p)
 {
-	struct page *page = NULL;
-	int i, res;
-	loff_t off, last = ((offset + sg_cnt - 1) << PAGE_SHIFT) +
-		sg[sg_cnt - 1].offset + sg[sg_cnt - 1].length;
+	struct scst_cmd *cmd = p->cmd;
+	int32_t length, resp_len;
+	uint8_t *address;
+	uint8_t *buf;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
 
 	TRACE_ENTRY();
 
-	for (i = 0; i < sg_cnt; ++i) {
-		off = (offset + i) << PAGE_SHIFT | sg[i].offset;
-		res = prepare_read_page(filp, sg[i].length, off, last, &page);
-		if (res <= 0)
-			goto err;
-		if (res < sg[i].length) {
-			page_cache_release(page);
-			goto err;
-		}
-		sg_assign_page(&sg[i], page);
+	buf = kzalloc(INQ_BUF_SZ, cmd->cmd_gfp_mask);
+	if (buf == NULL) {
+		scst_set_busy(cmd);
+		goto out;
 	}
 
-	file_accessed(filp);
-
-out:
-	TRACE_EXIT_RES(i);
-	return i;
+	length = scst_get_buf_full_sense(cmd, &address);
+	TRACE_DBG("length %d", length);
+	if (unlikely(length <= 0))
+		goto out_free;
 
-err:
-	finish_read(sg, i);
-	i = -EIO;
-	goto out;
-}
+	if (cmd->cdb[1] & CMDDT) {
+		TRACE_DBG("%s", "INQUIRY: CMDDT is unsupported");
+		scst_set_invalid_field_in_cdb(cmd, 1,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 1);
+		goto out_put;
+	}
 
-/**
- * alloc_sg - Allocate an SG vector.
- * @size: number of bytes that will be stored in the pages of the sg vector
- * @off: first page data offset
- * @gfp_mask: allocation flags for dynamic sg vector allocation
- * @small_sg: pointer to a candidate sg vector
- * @small_sg_size: size of @small_sg
- * @p_sg_cnt: pointer to an int where the sg vector size will be written
- */
-static struct scatterlist *alloc_sg(size_t size, unsigned off, gfp_t gfp_mask,
-				    struct scatterlist *small_sg,
-				    int small_sg_size, int *p_sg_cnt)
-{
-	struct scatterlist *sg;
-	int i, sg_cnt, remaining_sz, sg_sz, sg_off;
+	buf[0] = virt_dev->dummy ? SCSI_INQ_PQ_NOT_CON << 5 | 0x1f :
+		 SCSI_INQ_PQ_CON << 5 | dev->type;
+	/* Vital Product */
+	if (cmd->cdb[1] & EVPD) {
+		if (cmd->cdb[2] == 0) {
+			resp_len = vdisk_sup_vpd(buf, cmd, virt_dev);
+		} else if (cmd->cdb[2] == 0x80) {
+			resp_len = vdisk_usn_vpd(buf, cmd, virt_dev);
+		} else if (cmd->cdb[2] == 0x83) {
+			resp_len = vdisk_dev_id_vpd(buf, cmd, virt_dev);
+		} else if (cmd->cdb[2] == 0x86) {
+			resp_len = vdisk_ext_inq(buf, cmd, virt_dev);
+		} else if (cmd->cdb[2] == 0xB0 && dev->type == TYPE_DISK) {
+			resp_len = vdisk_block_limits(buf, cmd, virt_dev);
+		} else if (cmd->cdb[2] == 0xB1 && dev->type == TYPE_DISK) {
+			resp_len = vdisk_bdev_char(buf, cmd, virt_dev);
+		} else if (cmd->cdb[2] == 0xB2 && dev->type == TYPE_DISK &&
+			   virt_dev->thin_provisioned) {
+			resp_len = vdisk_tp_vpd(buf, cmd, virt_dev);
+		} else {
+			TRACE_DBG("INQUIRY: Unsupported EVPD page %x", cmd->cdb[2]);
+			scst_set_invalid_field_in_cdb(cmd, 2, 0);
+			goto out_put;
+		}
+	} else {
+		if (cmd->cdb[2] != 0) {
+			TRACE_DBG("INQUIRY: Unsupported page %x", cmd->cdb[2]);
+			scst_set_invalid_field_in_cdb(cmd, 2, 0);
+			goto out_put;
+		}
+		resp_len = vdisk_inq(buf, cmd, virt_dev);
+	}
 
-	TRACE_ENTRY();
+	sBUG_ON(resp_len > INQ_BUF_SZ);
 
-	sg_cnt = PAGE_ALIGN(size + off) >> PAGE_SHIFT;
-	sg = sg_cnt <= small_sg_size ? small_sg :
-		kmalloc_array(sg_cnt, sizeof(*sg), gfp_mask);
-	if (!sg)
-		goto out;
+	if (length > resp_len)
+		length = resp_len;
+	memcpy(address, buf, length);
 
-	sg_init_table(sg, sg_cnt);
-	remaining_sz = size;
-	sg_off = off;
-	for (i = 0; i < sg_cnt; ++i) {
-		sg_sz = min_t(int, PAGE_SIZE - sg_off, remaining_sz);
-		sg_set_page(&sg[i], NULL, sg_sz, sg_off);
-		remaining_sz -= sg_sz;
-		sg_off = 0;
-	}
-	*p_sg_cnt = sg_cnt;
+out_put:
+	scst_put_buf_full(cmd, address);
+	if (length < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, length);
+
+out_free:
+	kfree(buf);
 
 out:
 	TRACE_EXIT();
-	return sg;
+	return CMD_SUCCEEDED;
 }
 
-static int fileio_alloc_data_buf(struct scst_cmd *cmd)
+static enum compl_status_e vdisk_exec_request_sense(struct vdisk_cmd_params *p)
 {
-	struct vdisk_cmd_params *p;
-	struct scst_vdisk_dev *virt_dev;
-	int sg_cnt, nr;
-	const gfp_t gfp_mask = GFP_KERNEL;
-	struct scatterlist *sg;
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	int32_t length, sl;
+	uint8_t *address;
+	uint8_t b[SCST_STANDARD_SENSE_LEN];
 
 	TRACE_ENTRY();
 
-	p = cmd->dh_priv;
-	EXTRACHECKS_BUG_ON(!p);
-	virt_dev = cmd->dev->dh_priv;
 	/*
-	 * If the target driver (e.g. scst_local) allocates the sg vector
-	 * itself or the command is a write or bidi command, don't use zero
-	 * copy.
+	 * No need to make it volatile, because at worst we will have a couple
+	 * of extra commands refused after formatting actually finished, which
+	 * is acceptable.
 	 */
-	if (cmd->tgt_i_data_buf_alloced ||
-	    (cmd->data_direction & SCST_DATA_READ) == 0 ||
-	    (virt_dev->fd && !virt_dev->fd->f_mapping->a_ops->readpage)) {
-		p->use_zero_copy = false;
-	}
-	if (!p->use_zero_copy)
+	if (virt_dev->format_active) {
+		uint64_t d, div;
+		uint16_t v;
+
+		div = virt_dev->format_progress_to_do >> 16;
+		d = virt_dev->format_progress_done;
+		do_div(d, div);
+		v = d;
+
+		TRACE_DBG("Format progress %d", v);
+
+		sl = scst_set_sense(b, sizeof(b), dev->d_sense,
+			SCST_LOAD_SENSE(scst_sense_format_in_progress));
+
+		BUILD_BUG_ON(SCST_STANDARD_SENSE_LEN < 18);
+		if (dev->d_sense) {
+			uint8_t *p = &b[7];
+			int o = 8;
+			*p += 8;
+			b[o] = 2;
+			b[o+1] = 6;
+			b[o+4] = 0x80;
+			put_unaligned_be16(v, &b[o+5]);
+		} else {
+			b[15] = 0x80;
+			put_unaligned_be16(v, &b[16]);
+		}
+		TRACE_BUFF_FLAG(TRACE_DEBUG, "Format sense", b, sizeof(b));
+	} else
+		sl = scst_set_sense(b, sizeof(b), cmd->dev->d_sense,
+			SCST_LOAD_SENSE(scst_sense_no_sense));
+
+	length = scst_get_buf_full_sense(cmd, &address);
+	TRACE_DBG("length %d", length);
+	if (length <= 0)
 		goto out;
 
-	EXTRACHECKS_BUG_ON(!(cmd->data_direction & SCST_DATA_READ));
+	length = min(sl, length);
+	memcpy(address, b, length);
+	scst_set_resp_data_len(cmd, length);
 
-	scst_cmd_set_dh_data_buff_alloced(cmd);
+	scst_put_buf_full(cmd, address);
 
-	cmd->sg = alloc_sg(cmd->bufflen, p->loff & ~PAGE_MASK, gfp_mask,
-			   p->small_sg, ARRAY_SIZE(p->small_sg), &cmd->sg_cnt);
-	if (!cmd->sg) {
-		PRINT_ERROR("sg allocation failed (bufflen = %d, off = %lld)\n",
-			    cmd->bufflen, p->loff & ~PAGE_MASK);
-		goto enomem;
-	}
-	sg_cnt = scst_cmd_get_sg_cnt(cmd);
-	sg = cmd->sg;
-	nr = prepare_read(virt_dev->fd, sg, sg_cnt, p->loff >> PAGE_SHIFT);
-	if (nr < 0) {
-		PRINT_ERROR("prepare_read() failed: %d", nr);
-		goto out_free_sg;
-	}
 out:
 	TRACE_EXIT();
-	return SCST_CMD_STATE_DEFAULT;
+	return CMD_SUCCEEDED;
+}
 
-out_free_sg:
-	kfree(cmd->sg);
-	cmd->sg = NULL;
-	cmd->sg_cnt = 0;
+static int vdisk_err_recov_pg(unsigned char *p, int pcontrol,
+			       struct scst_vdisk_dev *virt_dev)
+{	/* Read-Write Error Recovery page for mode_sense */
+	const unsigned char err_recov_pg[] = {0x1, 0xa, 0xc0, 1, 0, 0, 0, 0,
+					      1, 0, 0xff, 0xff};
 
-enomem:
-	scst_set_busy(cmd);
-	TRACE_EXIT_RES(-ENOMEM);
-	return scst_get_cmd_abnormal_done_state(cmd);
+	memcpy(p, err_recov_pg, sizeof(err_recov_pg));
+	if (pcontrol == 1)
+		memset(p + 2, 0, sizeof(err_recov_pg) - 2);
+	return sizeof(err_recov_pg);
 }
-#else
-static int fileio_alloc_data_buf(struct scst_cmd *cmd)
-{
-	struct vdisk_cmd_params *p;
-
-	TRACE_ENTRY();
 
-	p = cmd->dh_priv;
-	EXTRACHECKS_BUG_ON(!p);
-	p->use_zero_copy = false;
+static int vdisk_disconnect_pg(unsigned char *p, int pcontrol,
+				struct scst_vdisk_dev *virt_dev)
+{	/* Disconnect-Reconnect page for mode_sense */
+	const unsigned char disconnect_pg[] = {0x2, 0xe, 128, 128, 0, 10, 0, 0,
+					       0, 0, 0, 0, 0, 0, 0, 0};
 
-	TRACE_EXIT();
-	return SCST_CMD_STATE_DEFAULT;
+	memcpy(p, disconnect_pg, sizeof(disconnect_pg));
+	if (pcontrol == 1)
+		memset(p + 2, 0, sizeof(disconnect_pg) - 2);
+	return sizeof(disconnect_pg);
 }
 
-static void finish_read(struct scatterlist *sg, int sg_cnt)
+static int vdisk_rigid_geo_pg(unsigned char *p, int pcontrol,
+	struct scst_vdisk_dev *virt_dev)
 {
-}
-#endif
+	unsigned char geo_m_pg[] = {0x04, 0x16, 0, 0, 0, DEF_HEADS, 0, 0,
+				    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+				    0x3a, 0x98/* 15K RPM */, 0, 0};
+	int32_t ncyl, n, rem;
+	uint64_t dividend;
 
-static int vdev_do_job(struct scst_cmd *cmd, const vdisk_op_fn *ops)
-{
-	int res;
-	uint8_t *cdb = cmd->cdb;
-	int opcode = cdb[0];
-	struct vdisk_cmd_params *p = cmd->dh_priv;
-	struct scst_vdisk_dev *virt_dev;
-	vdisk_op_fn op = ops[opcode];
-	enum compl_status_e s;
+	memcpy(p, geo_m_pg, sizeof(geo_m_pg));
+	/*
+	 * Divide virt_dev->nblocks by (DEF_HEADS * DEF_SECTORS) and store
+	 * the quotient in ncyl and the remainder in rem.
+	 */
+	dividend = virt_dev->nblocks;
+	rem = do_div(dividend, DEF_HEADS * DEF_SECTORS);
+	ncyl = dividend;
+	if (rem != 0)
+		ncyl++;
+	memcpy(&n, p + 2, sizeof(u32));
+	n = n | ((__force u32)cpu_to_be32(ncyl) >> 8);
+	memcpy(p + 2, &n, sizeof(u32));
+	if (pcontrol == 1)
+		memset(p + 2, 0, sizeof(geo_m_pg) - 2);
+	return sizeof(geo_m_pg);
+}
 
-	TRACE_ENTRY();
+static int vdisk_format_pg(unsigned char *p, int pcontrol,
+			    struct scst_vdisk_dev *virt_dev)
+{       /* Format device page for mode_sense */
+	const unsigned char format_pg[] = {0x3, 0x16, 0, 0, 0, 0, 0, 0,
+					   0, 0, 0, 0, 0, 0, 0, 0,
+					   0, 0, 0, 0, 0x40, 0, 0, 0};
 
-	EXTRACHECKS_BUG_ON(!p);
+	memcpy(p, format_pg, sizeof(format_pg));
+	put_unaligned_be16(DEF_SECTORS, &p[10]);
+	put_unaligned_be16(virt_dev->dev->block_size, &p[12]);
+	if (pcontrol == 1)
+		memset(p + 2, 0, sizeof(format_pg) - 2);
+	return sizeof(format_pg);
+}
 
-	virt_dev = cmd->dev->dh_priv;
+static int vdisk_caching_pg(unsigned char *p, int pcontrol,
+			     struct scst_vdisk_dev *virt_dev)
+{
+	/* Caching page for mode_sense */
+	static const unsigned char caching_pg[] = {
+		0x8, 0x12, 0x0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0x80, 0x14, 0, 0,
+		0, 0, 0, 0
+	};
 
-	EXTRACHECKS_BUG_ON(p->cmd != cmd);
-	EXTRACHECKS_BUG_ON(ops != blockio_ops && ops != fileio_ops && ops != nullio_ops);
+	memcpy(p, caching_pg, sizeof(caching_pg));
 
-	/*
-	 * No need to make it volatile, because at worst we will have a couple
-	 * of extra commands refused after formatting actually finished, which
-	 * is acceptable.
-	 */
-	if (unlikely(virt_dev->format_active)) {
-		switch (cmd->cdb[0]) {
-		case INQUIRY:
-		case REPORT_LUNS:
-		case REQUEST_SENSE:
-			break;
-		default:
-			scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_format_in_progress));
-			goto out_compl;
-		}
-	}
+	if (!virt_dev->nv_cache && vdev_saved_mode_pages_enabled)
+		p[0] |= 0x80;
 
-	s = op(p);
-	if (s == CMD_SUCCEEDED)
-		;
-	else if (s == RUNNING_ASYNC)
-		goto out_thr;
-	else if (s == CMD_FAILED)
-		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_hardw_error));
-	else if (s == INVALID_OPCODE)
-		goto out_invalid_opcode;
-	else
-		WARN_ON(true);
+	switch (pcontrol) {
+	case 0: /* current */
+		p[2] |= (virt_dev->wt_flag || virt_dev->nv_cache) ? 0 : WCE;
+		break;
+	case 1: /* changeable */
+		memset(p + 2, 0, sizeof(caching_pg) - 2);
+		if (!virt_dev->nv_cache)
+			p[2] |= WCE;
+		break;
+	case 2: /* default */
+		p[2] |= (DEF_WRITE_THROUGH || virt_dev->nv_cache) ? 0 : WCE;
+		break;
+	case 3: /* saved */
+		p[2] |= (virt_dev->wt_flag_saved || virt_dev->nv_cache) ? 0 : WCE;
+		break;
+	default:
+		sBUG();
+		break;
+	}
 
-out_compl:
-	cmd->completed = 1;
-	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
+	return sizeof(caching_pg);
+}
 
-out_thr:
-	res = SCST_EXEC_COMPLETED;
+static int vdisk_ctrl_m_pg(unsigned char *p, int pcontrol,
+			    struct scst_vdisk_dev *virt_dev)
+{	/* Control mode page for mode_sense */
+	unsigned char ctrl_m_pg[] = {0xa, 0xa, 0, 0, 0, 0, 0, 0,
+					   0, 0, 0x2, 0x4b};
 
-	TRACE_EXIT_RES(res);
-	return res;
+	if (vdev_saved_mode_pages_enabled)
+		ctrl_m_pg[0] |= 0x80;
 
-out_invalid_opcode:
-	TRACE_DBG("Invalid opcode %s", scst_get_opcode_name(cmd));
-	scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_invalid_opcode));
-	goto out_compl;
+	memcpy(p, ctrl_m_pg, sizeof(ctrl_m_pg));
+	switch (pcontrol) {
+	case 0: /* current */
+		p[2] |= virt_dev->dev->tst << 5;
+		p[2] |= virt_dev->dev->d_sense << 2;
+		p[2] |= virt_dev->dev->dpicz << 3;
+		p[2] |= virt_dev->dev->tmf_only << 4;
+		p[3] |= virt_dev->dev->queue_alg << 4;
+		p[3] |= virt_dev->dev->qerr << 1;
+		p[4] |= virt_dev->dev->swp << 3;
+		p[5] |= virt_dev->dev->tas << 6;
+		p[5] |= virt_dev->dev->ato << 7;
+		break;
+	case 1: /* changeable */
+		memset(p + 2, 0, sizeof(ctrl_m_pg) - 2);
+#if 0	/*
+	 * See comment in struct scst_device definition.
+	 *
+	 * If enable it, fix the default and saved cases below!
+	 */
+		p[2] |= 7 << 5;		/* TST */
+#endif
+		if (!virt_dev->dev->cluster_mode) {
+			p[2] |= 1 << 2;		/* D_SENSE */
+			p[2] |= 1 << 3;		/* DPICZ */
+			p[2] |= 1 << 4;		/* TMF_ONLY */
+			p[3] |= 0xF << 4;	/* QUEUE ALGORITHM MODIFIER */
+			p[3] |= 3 << 1;		/* QErr */
+			p[4] |= 1 << 3;		/* SWP */
+			p[5] |= 1 << 6;		/* TAS */
+			p[5] |= 0 << 7;		/* ATO */
+		}
+		break;
+	case 2: /* default */
+		p[2] |= virt_dev->tst << 5;
+		p[2] |= virt_dev->dev->d_sense_default << 2;
+		p[2] |= virt_dev->dev->dpicz_default << 3;
+		p[2] |= virt_dev->dev->tmf_only_default << 4;
+		p[3] |= virt_dev->dev->queue_alg_default << 4;
+		p[3] |= virt_dev->dev->qerr_default << 1;
+		p[4] |= virt_dev->dev->swp_default << 3;
+		p[5] |= virt_dev->dev->tas_default << 6;
+		p[5] |= virt_dev->dev->ato << 7;
+		break;
+	case 3: /* saved */
+		p[2] |= virt_dev->dev->tst << 5;
+		p[2] |= virt_dev->dev->d_sense_saved << 2;
+		p[2] |= virt_dev->dev->dpicz_saved << 3;
+		p[2] |= virt_dev->dev->tmf_only_default << 4;
+		p[3] |= virt_dev->dev->queue_alg_saved << 4;
+		p[3] |= virt_dev->dev->qerr_saved << 1;
+		p[4] |= virt_dev->dev->swp_saved << 3;
+		p[5] |= virt_dev->dev->tas_saved << 6;
+		p[5] |= virt_dev->dev->ato << 7;
+		break;
+	default:
+		sBUG();
+	}
+	return sizeof(ctrl_m_pg);
 }
 
-static int fileio_exec(struct scst_cmd *cmd)
-{
-	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
-	const vdisk_op_fn *ops = virt_dev->vdev_devt->devt_priv;
-
-	EXTRACHECKS_BUG_ON(!ops);
-	return vdev_do_job(cmd, ops);
+static int vdisk_iec_m_pg(unsigned char *p, int pcontrol,
+			   struct scst_vdisk_dev *virt_dev)
+{	/* Informational Exceptions control mode page for mode_sense */
+	const unsigned char iec_m_pg[] = {0x1c, 0xa, 0x08, 0, 0, 0, 0, 0,
+					  0, 0, 0x0, 0x0};
+	memcpy(p, iec_m_pg, sizeof(iec_m_pg));
+	if (pcontrol == 1)
+		memset(p + 2, 0, sizeof(iec_m_pg) - 2);
+	return sizeof(iec_m_pg);
 }
 
-static void fileio_on_free_cmd(struct scst_cmd *cmd)
+static enum compl_status_e vdisk_exec_mode_sense(struct vdisk_cmd_params *p)
 {
-	struct vdisk_cmd_params *p = cmd->dh_priv;
+	struct scst_cmd *cmd = p->cmd;
+	int32_t length;
+	uint8_t *address;
+	uint8_t *buf;
 	struct scst_vdisk_dev *virt_dev;
+	uint32_t blocksize;
+	uint64_t nblocks;
+	unsigned char dbd, type;
+	int pcontrol, pcode, subpcode;
+	unsigned char dev_spec;
+	int msense_6, offset = 0, len;
+	unsigned char *bp;
 
 	TRACE_ENTRY();
 
-	if (!p)
+	buf = kzalloc(MSENSE_BUF_SZ, cmd->cmd_gfp_mask);
+	if (buf == NULL) {
+		scst_set_busy(cmd);
 		goto out;
+	}
 
 	virt_dev = cmd->dev->dh_priv;
+	blocksize = cmd->dev->block_size;
+	nblocks = virt_dev->nblocks;
 
-	if (p->use_zero_copy) {
-		if ((cmd->data_direction & SCST_DATA_READ) &&
-		    virt_dev->zero_copy)
-			finish_read(cmd->sg, cmd->sg_cnt);
-		if (cmd->sg != p->small_sg)
-			kfree(cmd->sg);
-		cmd->sg_cnt = 0;
-		cmd->sg = NULL;
-		cmd->bufflen = 0;
-		cmd->data_len = 0;
+	type = cmd->dev->type;
+	dbd = cmd->cdb[1] & DBD;
+	pcontrol = (cmd->cdb[2] & 0xc0) >> 6;
+	pcode = cmd->cdb[2] & 0x3f;
+	subpcode = cmd->cdb[3];
+	msense_6 = (cmd->cdb[0] == MODE_SENSE);
+	dev_spec = cmd->tgt_dev->tgt_dev_rd_only ? WP : 0;
+
+	if (type != TYPE_ROM)
+		dev_spec |= DPOFUA;
+
+	length = scst_get_buf_full_sense(cmd, &address);
+	if (unlikely(length <= 0))
+		goto out_free;
+
+	if (!vdev_saved_mode_pages_enabled && (pcontrol == 0x3)) {
+		TRACE_DBG("%s", "MODE SENSE: Saving values not supported");
+		scst_set_cmd_error(cmd,
+		    SCST_LOAD_SENSE(scst_sense_saving_params_unsup));
+		goto out_put;
 	}
 
-	if (p->iv != p->small_iv)
-		kfree(p->iv);
+	if (msense_6) {
+		buf[1] = type;
+		buf[2] = dev_spec;
+		offset = 4;
+	} else {
+		buf[2] = type;
+		buf[3] = dev_spec;
+		offset = 8;
+	}
 
-	kmem_cache_free(vdisk_cmd_param_cachep, p);
+	if (subpcode != 0) {
+		/* TODO: Control Extension page */
+		TRACE_DBG("%s", "MODE SENSE: Only subpage 0 is supported");
+		scst_set_invalid_field_in_cdb(cmd, 3, 0);
+		goto out_put;
+	}
 
-out:
-	TRACE_EXIT();
-	return;
-}
+	if (!dbd) {
+		/* Create block descriptor */
+		buf[offset - 1] = 0x08;		/* block descriptor length */
+		put_unaligned_be32(nblocks >> 32 ? 0xffffffffU : nblocks,
+				   &buf[offset]);
+		buf[offset + 4] = 0;			/* density code */
+		put_unaligned_be24(blocksize, &buf[offset + 5]); /* blklen */
 
-/*
- * Functionally identical to scst_tg_accept_standby(), but separated, because,
- * generally, they are checking for different things. Better to keep different
- * things separately.
- */
-static bool vdisk_no_fd_allowed_commands(const struct scst_cmd *cmd)
-{
-	bool res;
+		offset += 8;			/* increment offset */
+	}
 
-	TRACE_ENTRY();
+	bp = buf + offset;
 
-	switch (cmd->cdb[0]) {
-	case TEST_UNIT_READY:
-	case GET_EVENT_STATUS_NOTIFICATION:
-	case INQUIRY:
-	case MODE_SENSE:
-	case MODE_SENSE_10:
-	case READ_CAPACITY:
-	case REPORT_LUNS:
-	case REQUEST_SENSE:
-	case RELEASE:
-	case RELEASE_10:
-	case RESERVE:
-	case RESERVE_10:
-	case READ_BUFFER:
-	case WRITE_BUFFER:
-	case MODE_SELECT:
-	case MODE_SELECT_10:
-	case LOG_SELECT:
-	case LOG_SENSE:
-	case RECEIVE_DIAGNOSTIC:
-	case SEND_DIAGNOSTIC:
-	case PERSISTENT_RESERVE_IN:
-	case PERSISTENT_RESERVE_OUT:
-		res = true;
-		goto out;
-	case SERVICE_ACTION_IN_16:
-		switch (cmd->cdb[1] & 0x1f) {
-		case SAI_READ_CAPACITY_16:
-			res = true;
-			goto out;
-		}
+	switch (pcode) {
+	case 0x1:	/* Read-Write error recovery page, direct access */
+		len = vdisk_err_recov_pg(bp, pcontrol, virt_dev);
 		break;
-	case MAINTENANCE_IN:
-		switch (cmd->cdb[1] & 0x1f) {
-		case MI_REPORT_TARGET_PGS:
-			res = true;
-			goto out;
-		}
+	case 0x2:	/* Disconnect-Reconnect page, all devices */
+		if (type == TYPE_ROM)
+			goto out_not_sup;
+		len = vdisk_disconnect_pg(bp, pcontrol, virt_dev);
+		break;
+	case 0x3:       /* Format device page, direct access */
+		if (type == TYPE_ROM)
+			goto out_not_sup;
+		len = vdisk_format_pg(bp, pcontrol, virt_dev);
+		break;
+	case 0x4:	/* Rigid disk geometry */
+		if (type == TYPE_ROM)
+			goto out_not_sup;
+		len = vdisk_rigid_geo_pg(bp, pcontrol, virt_dev);
+		break;
+	case 0x8:	/* Caching page, direct access */
+		if (type == TYPE_ROM)
+			goto out_not_sup;
+		len = vdisk_caching_pg(bp, pcontrol, virt_dev);
+		break;
+	case 0xa:	/* Control Mode page, all devices */
+		len = vdisk_ctrl_m_pg(bp, pcontrol, virt_dev);
 		break;
-	case MAINTENANCE_OUT:
-		switch (cmd->cdb[1] & 0x1f) {
-		case MO_SET_TARGET_PGS:
-			res = true;
-			goto out;
+	case 0x1c:	/* Informational Exceptions Mode page, all devices */
+		len = vdisk_iec_m_pg(bp, pcontrol, virt_dev);
+		break;
+	case 0x3f:	/* Read all Mode pages */
+		if (type == TYPE_ROM) {
+			len = vdisk_err_recov_pg(bp, pcontrol, virt_dev);
+			len += vdisk_ctrl_m_pg(bp + len, pcontrol, virt_dev);
+			len += vdisk_iec_m_pg(bp + len, pcontrol, virt_dev);
+		} else {
+			len = vdisk_err_recov_pg(bp, pcontrol, virt_dev);
+			len += vdisk_disconnect_pg(bp + len, pcontrol, virt_dev);
+			len += vdisk_format_pg(bp + len, pcontrol, virt_dev);
+			len += vdisk_caching_pg(bp + len, pcontrol, virt_dev);
+			len += vdisk_ctrl_m_pg(bp + len, pcontrol, virt_dev);
+			len += vdisk_iec_m_pg(bp + len, pcontrol, virt_dev);
+			len += vdisk_rigid_geo_pg(bp + len, pcontrol, virt_dev);
 		}
 		break;
+	default:
+		goto out_not_sup;
 	}
 
-	res = false;
+	offset += len;
+
+	if (msense_6)
+		buf[0] = offset - 1;
+	else
+		put_unaligned_be16(offset - 2, &buf[0]);
+
+	if (offset > length)
+		offset = length;
+	memcpy(address, buf, offset);
+
+out_put:
+	scst_put_buf_full(cmd, address);
+	if (offset < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, offset);
+
+out_free:
+	kfree(buf);
 
 out:
-	TRACE_EXIT_RES(res);
-	return res;
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
+
+out_not_sup:
+	TRACE(TRACE_MINOR, "MODE SENSE: Unsupported page %x", pcode);
+	scst_set_invalid_field_in_cdb(cmd, 2, SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
+	goto out_put;
 }
 
-static int blockio_exec(struct scst_cmd *cmd)
+static int vdisk_set_wt(struct scst_vdisk_dev *virt_dev, int wt, bool read_only)
 {
-	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
-	const vdisk_op_fn *ops = virt_dev->vdev_devt->devt_priv;
-	struct vdisk_cmd_params p;
-	int res;
+	int res = 0;
+	struct file *fd, *dif_fd = NULL;
+	bool old_wt = virt_dev->wt_flag;
 
-	EXTRACHECKS_BUG_ON(!ops);
+	TRACE_ENTRY();
 
-	memset(&p, 0, sizeof(p));
-	if (unlikely(!vdisk_parse_offset(&p, cmd)))
-		goto err;
+	if ((virt_dev->wt_flag == wt) || virt_dev->nullio || virt_dev->nv_cache)
+		goto out;
 
-	if (unlikely(virt_dev->fd == NULL)) {
-		if (!vdisk_no_fd_allowed_commands(cmd)) {
-			/* We should not get here */
-			PRINT_WARNING("Closed FD on exec. Secondary DRBD or not "
-				"blocked dev before ALUA state change? "
-				"(cmd %p, op %s, dev %s)", cmd, cmd->op_name,
-				cmd->dev->virt_name);
-			scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_no_medium));
-			goto err;
+	spin_lock(&virt_dev->flags_lock);
+	virt_dev->wt_flag = wt;
+	spin_unlock(&virt_dev->flags_lock);
+
+	/*
+	 * Members of striped devices are accessed only by bios, for which
+	 * the open flags don't matter.
+	 */
+	if ((virt_dev->fd == NULL) || (virt_dev->stripe_cnt != 0))
+		goto out;
+
+	/*
+	 * MODE SELECT is strictly serialized command, so it's safe here
+	 * to reopen fd.
+	 */
+
+	fd = vdev_open_fd(virt_dev, virt_dev->filename, read_only);
+	if (IS_ERR(fd)) {
+		res = PTR_ERR(fd);
+		goto out_err;
+	}
+
+	if (virt_dev->dif_filename != NULL) {
+		dif_fd = vdev_open_fd(virt_dev, virt_dev->dif_filename, read_only);
+		if (IS_ERR(dif_fd)) {
+			res = PTR_ERR(dif_fd);
+			goto out_err_close_fd;
 		}
 	}
 
-	cmd->dh_priv = &p;
-	res = vdev_do_job(cmd, ops);
-	cmd->dh_priv = NULL;
+	if (virt_dev->cow_img != NULL)
+		vdisk_cow_set_fd(virt_dev->cow_img, fd);
+	if (virt_dev->cache != NULL)
+		vdisk_cache_set_origin_fd(virt_dev->cache, fd);
+
+	filp_close(virt_dev->fd, NULL);
+	if (virt_dev->dif_fd)
+		filp_close(virt_dev->dif_fd, NULL);
+
+	virt_dev->fd = fd;
+	virt_dev->dif_fd = dif_fd;
 
 out:
+	TRACE_EXIT_RES(res);
 	return res;
 
-err:
-	res = SCST_EXEC_COMPLETED;
-	cmd->completed = 1;
-	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
+out_err_close_fd:
+	filp_close(fd, NULL);
+
+out_err:
+	spin_lock(&virt_dev->flags_lock);
+	virt_dev->wt_flag = old_wt;
+	spin_unlock(&virt_dev->flags_lock);
 	goto out;
 }
 
-static int nullio_exec(struct scst_cmd *cmd)
+static void vdisk_ctrl_m_pg_select(unsigned char *p,
+	struct scst_vdisk_dev *virt_dev, struct scst_cmd *cmd, bool save,
+	int param_offset)
 {
-	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
-	const vdisk_op_fn *ops = virt_dev->vdev_devt->devt_priv;
-	struct vdisk_cmd_params p;
-	int res;
+	struct scst_device *dev = virt_dev->dev;
+	int old_swp = dev->swp, old_tas = dev->tas, old_dsense = dev->d_sense;
+	int old_queue_alg = dev->queue_alg, old_dpicz = dev->dpicz;
+	int rc, old_tmf_only = dev->tmf_only, old_qerr = dev->qerr;
+	int queue_alg, swp, tas, tmf_only, qerr, d_sense, dpicz;
 
-	EXTRACHECKS_BUG_ON(!ops);
+	TRACE_ENTRY();
 
-	memset(&p, 0, sizeof(p));
-	if (unlikely(!vdisk_parse_offset(&p, cmd)))
-		goto err;
+	if (save && !vdev_saved_mode_pages_enabled) {
+		TRACE(TRACE_MINOR|TRACE_SCSI, "MODE SELECT: saved control page "
+			"not supported");
+		scst_set_invalid_field_in_cdb(cmd, 2,
+				SCST_INVAL_FIELD_BIT_OFFS_VALID | 1);
+		goto out;
+	}
 
-	cmd->dh_priv = &p;
-	res = vdev_do_job(cmd, ops);
-	cmd->dh_priv = NULL;
+	/*
+	 * MODE SELECT is a strictly serialized cmd, so it is safe to
+	 * perform direct assignment here.
+	 */
 
-out:
-	return res;
+#if 0 /* Not implemented yet, see comment in struct scst_device */
+	dev->tst = (p[2] >> 5) & 7;
+	/* ToDo: check validity of the new value */
+#else
+	if (dev->tst != ((p[2] >> 5) & 7)) {
+		TRACE(TRACE_MINOR|TRACE_SCSI, "%s", "MODE SELECT: Changing of "
+			"TST not supported");
+		scst_set_invalid_field_in_parm_list(cmd, param_offset + 2,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 5);
+		goto out;
+	}
+#endif
 
-err:
-	res = SCST_EXEC_COMPLETED;
-	cmd->completed = 1;
-	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
-	goto out;
-}
+	queue_alg = p[3] >> 4;
+	if ((queue_alg != SCST_QUEUE_ALG_0_RESTRICTED_REORDER) &&
+	    (queue_alg != SCST_QUEUE_ALG_1_UNRESTRICTED_REORDER)) {
+		PRINT_WARNING("Attempt to set invalid Control mode page QUEUE "
+			"ALGORITHM MODIFIER value %d (initiator %s, dev %s)",
+			queue_alg, cmd->sess->initiator_name, dev->virt_name);
+		scst_set_invalid_field_in_parm_list(cmd, param_offset + 3,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 4);
+		goto out;
+	}
 
-static int vcdrom_exec(struct scst_cmd *cmd)
-{
-	int res = SCST_EXEC_COMPLETED;
-	int opcode = cmd->cdb[0];
-	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	swp = (p[4] & 0x8) >> 3;
+	if (swp > 1) {
+		PRINT_WARNING("Attempt to set invalid Control mode page SWP "
+			"value %d (initiator %s, dev %s)", swp,
+			cmd->sess->initiator_name, dev->virt_name);
+		scst_set_invalid_field_in_parm_list(cmd, param_offset + 4,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 3);
+		goto out;
+	}
+
+	tas = (p[5] & 0x40) >> 6;
+	if (tas > 1) {
+		PRINT_WARNING("Attempt to set invalid Control mode page TAS "
+			"value %d (initiator %s, dev %s)", tas,
+			cmd->sess->initiator_name, dev->virt_name);
+		scst_set_invalid_field_in_parm_list(cmd, param_offset + 5,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 6);
+		goto out;
+	}
+
+	tmf_only = (p[2] & 0x10) >> 4;
+	if (tmf_only > 1) {
+		PRINT_WARNING("Attempt to set invalid Control mode page "
+			"TMF_ONLY value %d (initiator %s, dev %s)", tmf_only,
+			cmd->sess->initiator_name, dev->virt_name);
+		scst_set_invalid_field_in_parm_list(cmd, param_offset + 2,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 4);
+		goto out;
+	}
+
+	dpicz = (p[2] & 0x8) >> 3;
+	if (dpicz > 1) {
+		PRINT_WARNING("Attempt to set invalid Control mode page "
+			"dpicz value %d (initiator %s, dev %s)", dpicz,
+			cmd->sess->initiator_name, dev->virt_name);
+		scst_set_invalid_field_in_parm_list(cmd, param_offset + 2,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 3);
+		goto out;
+	}
+
+	qerr = (p[3] & 0x6) >> 1;
+	if ((qerr == SCST_QERR_2_RESERVED) ||
+	    (qerr > SCST_QERR_3_ABORT_THIS_NEXUS_ONLY)) {
+		PRINT_WARNING("Attempt to set invalid Control mode page QErr "
+			"value %d (initiator %s, dev %s)", qerr,
+			cmd->sess->initiator_name, dev->virt_name);
+		scst_set_invalid_field_in_parm_list(cmd, param_offset + 3,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 1);
+		goto out;
+	}
+
+	d_sense = (p[2] & 0x4) >> 2;
+	if (d_sense > 1) {
+		PRINT_WARNING("Attempt to set invalid Control mode page D_SENSE "
+			"value %d (initiator %s, dev %s)", d_sense,
+			cmd->sess->initiator_name, dev->virt_name);
+		scst_set_invalid_field_in_parm_list(cmd, param_offset + 2,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 2);
+		goto out;
+	}
+
+	dev->queue_alg = queue_alg;
+	dev->swp = swp;
+	dev->tas = tas;
+	dev->tmf_only = tmf_only;
+	dev->dpicz = dpicz;
+	dev->qerr = qerr;
+	dev->d_sense = d_sense;
 
-	TRACE_ENTRY();
+	if ((dev->swp == old_swp) && (dev->tas == old_tas) &&
+	    (dev->d_sense == old_dsense) && (dev->queue_alg == old_queue_alg) &&
+	    (dev->qerr == old_qerr) && (dev->tmf_only == old_tmf_only) &&
+	    (dev->dpicz == old_dpicz))
+		goto out;
 
-	cmd->status = 0;
-	cmd->msg_status = 0;
-	cmd->host_status = DID_OK;
-	cmd->driver_status = 0;
+	if (!save)
+		goto out_ok;
 
-	if (virt_dev->cdrom_empty && (opcode != INQUIRY)) {
-		TRACE_DBG("%s", "CDROM empty");
-		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_no_medium));
-		goto out_done;
+	rc = vdev_save_mode_pages(virt_dev);
+	if (rc != 0) {
+		dev->swp = old_swp;
+		dev->tas = old_tas;
+		dev->d_sense = old_dsense;
+		dev->queue_alg = old_queue_alg;
+		dev->tmf_only = old_tmf_only;
+		dev->qerr = old_qerr;
+		dev->dpicz = old_dpicz;
+		/* Hopefully, the error is temporary */
+		scst_set_busy(cmd);
+		goto out;
 	}
 
-	if (virt_dev->media_changed && ((cmd->op_flags & SCST_SKIP_UA) == 0)) {
-		spin_lock(&virt_dev->flags_lock);
-		if (virt_dev->media_changed) {
-			virt_dev->media_changed = 0;
-			TRACE_DBG("%s", "Reporting media changed");
-			scst_set_cmd_error(cmd,
-				SCST_LOAD_SENSE(scst_sense_medium_changed_UA));
-			spin_unlock(&virt_dev->flags_lock);
-			goto out_done;
-		}
-		spin_unlock(&virt_dev->flags_lock);
-	}
+	dev->swp_saved = dev->swp;
+	dev->tas_saved = dev->tas;
+	dev->d_sense_saved = dev->d_sense;
+	dev->queue_alg_saved = dev->queue_alg;
+	dev->tmf_only_saved = dev->tmf_only;
+	dev->qerr_saved = dev->qerr;
+	dev->dpicz_saved = dev->dpicz;
 
-	res = vdev_do_job(cmd, virt_dev->blockio ? blockio_ops : fileio_ops);
+out_ok:
+	PRINT_INFO("Device %s: new control mode page parameters: SWP %x "
+		"(was %x), TAS %x (was %x), TMF_ONLY %d (was %x), QErr %x "
+		"(was %x), D_SENSE %d (was %d), QUEUE ALG %d (was %d), "
+		"DPICZ %d (was %d)", virt_dev->name, dev->swp, old_swp,
+		dev->tas, old_tas, dev->tmf_only, old_tmf_only, dev->qerr,
+		old_qerr, dev->d_sense, old_dsense, dev->queue_alg,
+		old_queue_alg, dev->dpicz, old_dpicz);
 
 out:
-	TRACE_EXIT_RES(res);
-	return res;
-
-out_done:
-	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
-	goto out;
+	TRACE_EXIT();
+	return;
 }
 
-static uint64_t vdisk_gen_dev_id_num(const char *virt_dev_name)
+static void vdisk_caching_m_pg_select(unsigned char *p,
+	struct scst_vdisk_dev *virt_dev, struct scst_cmd *cmd, bool save,
+	bool read_only)
 {
-	uint32_t dev_id_num;
+	int old_wt = virt_dev->wt_flag, new_wt, rc;
 
-	dev_id_num = crc32c(0, virt_dev_name, strlen(virt_dev_name)+1);
+	TRACE_ENTRY();
 
-#ifdef CONFIG_SCST_PROC
-	return ((uint64_t)scst_vdisk_ID << 32) | dev_id_num;
-#else
-	return ((uint64_t)scst_get_setup_id() << 32) | dev_id_num;
-#endif
-}
+	if (save && (!vdev_saved_mode_pages_enabled || virt_dev->nv_cache)) {
+		TRACE(TRACE_MINOR|TRACE_SCSI, "MODE SELECT: saved cache page "
+			"not supported");
+		scst_set_invalid_field_in_cdb(cmd, 1,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
+		goto out;
+	}
 
-static int vdisk_unmap_file_range(struct scst_cmd *cmd,
-	struct scst_vdisk_dev *virt_dev, loff_t off, loff_t len,
-	struct file *fd)
-{
-	int res;
+	new_wt = (p[2] & WCE) ? 0 : 1;
 
-	TRACE_ENTRY();
+	if (new_wt == old_wt)
+		goto out;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
-	TRACE_DBG("Fallocating range %lld, len %lld",
-		(unsigned long long)off, (unsigned long long)len);
+	if (vdisk_set_wt(virt_dev, new_wt, read_only) != 0) {
+		scst_set_busy(cmd);
+		goto out;
+	}
 
-	res = fd->f_op->fallocate(fd,
-		FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
-	if (unlikely(res != 0)) {
-		PRINT_ERROR("fallocate() for %lld, len %lld "
-			"failed: %d", (unsigned long long)off,
-			(unsigned long long)len, res);
-		scst_set_cmd_error(cmd,
-			SCST_LOAD_SENSE(scst_sense_write_error));
-		res = -EIO;
+	if (!save)
+		goto out_ok;
+
+	rc = vdev_save_mode_pages(virt_dev);
+	if (rc != 0) {
+		vdisk_set_wt(virt_dev, old_wt, read_only);
+		/* Hopefully, the error is temporary */
+		scst_set_busy(cmd);
+		goto out;
 	}
-#else
-	res = 0;
-#endif
 
-	TRACE_EXIT_RES(res);
-	return res;
+	virt_dev->wt_flag_saved = virt_dev->wt_flag;
+
+out_ok:
+	PRINT_INFO("Device %s: new wt_flag: %x (was %x)", virt_dev->name,
+		virt_dev->wt_flag, old_wt);
+
+out:
+	TRACE_EXIT();
+	return;
 }
 
-static int vdisk_unmap_range(struct scst_cmd *cmd,
-	struct scst_vdisk_dev *virt_dev, uint64_t start_lba, uint32_t blocks)
+static enum compl_status_e vdisk_exec_mode_select(struct vdisk_cmd_params *p)
 {
-#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 27)
-	int res, err;
-#else
-	int res;
-#endif
-	struct file *fd = virt_dev->fd;
+	struct scst_cmd *cmd = p->cmd;
+	int32_t length;
+	uint8_t *address;
+	struct scst_vdisk_dev *virt_dev;
+	int mselect_6, offset, bdl, type;
 
 	TRACE_ENTRY();
 
-	if (blocks == 0)
-		goto success;
-
-	if ((start_lba > virt_dev->nblocks) ||
-	    ((start_lba + blocks) > virt_dev->nblocks)) {
-		PRINT_ERROR("Device %s: attempt to write beyond max "
-			"size", virt_dev->name);
+	virt_dev = cmd->dev->dh_priv;
+	if (cmd->dev->cluster_mode) {
+		PRINT_ERROR("MODE SELECT: not supported in cluster mode\n");
 		scst_set_cmd_error(cmd,
-			SCST_LOAD_SENSE(scst_sense_block_out_range_error));
-		res = -EINVAL;
+			SCST_LOAD_SENSE(scst_sense_invalid_field_in_cdb));
 		goto out;
 	}
 
-	TRACE_DBG("Unmapping lba %lld (blocks %lld)",
-		(unsigned long long)start_lba, (unsigned long long)blocks);
-
-	if (virt_dev->blockio) {
-#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 27)
-		sector_t start_sector = start_lba << (cmd->dev->block_shift - 9);
-		sector_t nr_sects = blocks << (cmd->dev->block_shift - 9);
-		struct inode *inode = file_inode(fd);
-		gfp_t gfp = cmd->cmd_gfp_mask;
+	mselect_6 = (cmd->cdb[0] == MODE_SELECT);
+	type = cmd->dev->type;
 
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 31)
-		err = blkdev_issue_discard(inode->i_bdev, start_sector, nr_sects, gfp);
-#elif LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 35)       \
-      && !(LINUX_VERSION_CODE == KERNEL_VERSION(2, 6, 34) \
-           && defined(CONFIG_SUSE_KERNEL))
-		err = blkdev_issue_discard(inode->i_bdev, start_sector, nr_sects,
-				gfp, DISCARD_FL_WAIT);
-#elif LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 37)
-		err = blkdev_issue_discard(inode->i_bdev, start_sector, nr_sects,
-				gfp, BLKDEV_IFL_WAIT);
-#else
-		err = blkdev_issue_discard(inode->i_bdev, start_sector, nr_sects, gfp, 0);
-#endif
-		if (unlikely(err != 0)) {
-			PRINT_ERROR("blkdev_issue_discard() for "
-				"LBA %lld, blocks %d failed: %d",
-				(unsigned long long)start_lba, blocks, err);
-			scst_set_cmd_error(cmd,
-				SCST_LOAD_SENSE(scst_sense_write_error));
-			res = -EIO;
-			goto out;
-		}
-#else
-		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_invalid_opcode));
-		res = -EIO;
+	length = scst_get_buf_full_sense(cmd, &address);
+	if (unlikely(length <= 0))
 		goto out;
-#endif
+
+	if (!(cmd->cdb[1] & PF)) {
+		TRACE(TRACE_MINOR|TRACE_SCSI, "MODE SELECT: Unsupported "
+			"PF bit zero (cdb[1]=%x)", cmd->cdb[1]);
+		scst_set_invalid_field_in_cdb(cmd, 1, 0);
+		goto out_put;
+	}
+
+	if (mselect_6) {
+		bdl = address[3];
+		offset = 4;
 	} else {
-		loff_t off = start_lba << cmd->dev->block_shift;
-		loff_t len = (u64)blocks << cmd->dev->block_shift;
+		bdl = get_unaligned_be16(&address[6]);
+		offset = 8;
+	}
 
-		res = vdisk_unmap_file_range(cmd, virt_dev, off, len, fd);
-		if (unlikely(res != 0))
-			goto out;
+	if (bdl == 8)
+		offset += 8;
+	else if (bdl != 0) {
+		PRINT_ERROR("%s", "MODE SELECT: Wrong parameters list length");
+		scst_set_invalid_field_in_parm_list(cmd, offset-1, 0);
+		goto out_put;
 	}
 
-	if (virt_dev->dif_fd != NULL) {
-		res = vdisk_format_dif(cmd, start_lba, blocks);
-		if (unlikely(res != 0))
-			goto out;
+	while (length > offset + 2) {
+		if (address[offset] & PS) {
+			PRINT_ERROR("%s", "MODE SELECT: Illegal PS bit");
+			scst_set_invalid_field_in_parm_list(cmd, offset,
+				SCST_INVAL_FIELD_BIT_OFFS_VALID | 7);
+			goto out_put;
+		}
+		if (((address[offset] & 0x3f) == 0x8) && (type != TYPE_ROM)) {
+			/* Caching page */
+			if (address[offset + 1] != 18) {
+				PRINT_ERROR("%s", "MODE SELECT: Invalid "
+					"caching page request");
+				scst_set_invalid_field_in_parm_list(cmd, offset+1, 0);
+				goto out_put;
+			}
+			vdisk_caching_m_pg_select(&address[offset], virt_dev,
+				cmd, cmd->cdb[1] & SP, cmd->tgt_dev->tgt_dev_rd_only);
+			break;
+		} else if ((address[offset] & 0x3f) == 0xA) {
+			/* Control page */
+			if (address[offset + 1] != 0xA) {
+				PRINT_ERROR("%s", "MODE SELECT: Invalid "
+					"control page request");
+				scst_set_invalid_field_in_parm_list(cmd, offset+1, 0);
+				goto out_put;
+			}
+			vdisk_ctrl_m_pg_select(&address[offset], virt_dev, cmd,
+				cmd->cdb[1] & SP, offset);
+		} else {
+			TRACE(TRACE_MINOR, "MODE SELECT: Invalid request %x",
+				address[offset] & 0x3f);
+			scst_set_invalid_field_in_parm_list(cmd, offset,
+				SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
+			goto out_put;
+		}
+		offset += address[offset + 1];
 	}
 
-success:
-	res = 0;
+out_put:
+	scst_put_buf_full(cmd, address);
 
 out:
-	TRACE_EXIT_RES(res);
-	return res;
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
 }
 
-static void vdisk_exec_write_same_unmap(struct vdisk_cmd_params *p)
+static enum compl_status_e vdisk_exec_log(struct vdisk_cmd_params *p)
 {
-	int rc;
 	struct scst_cmd *cmd = p->cmd;
-	struct scst_device *dev = cmd->dev;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
 
 	TRACE_ENTRY();
 
-	if (unlikely(!virt_dev->thin_provisioned)) {
-		TRACE_DBG("%s", "Device not thin provisioned");
-		scst_set_cmd_error(cmd,
-			SCST_LOAD_SENSE(scst_sense_invalid_opcode));
-		goto out;
-	}
-
-	if (unlikely((uint64_t)cmd->data_len > cmd->dev->max_write_same_len)) {
-		PRINT_WARNING("Invalid WRITE SAME data len %lld (max allowed "
-			"%lld)", (long long)cmd->data_len,
-			(long long)cmd->dev->max_write_same_len);
-		scst_set_invalid_field_in_cdb(cmd, cmd->len_off, 0);
-		goto out;
-	}
-
-	rc = vdisk_unmap_range(cmd, virt_dev, cmd->lba,
-		cmd->data_len >> dev->block_shift);
-	if (rc != 0)
-		goto out;
+	/* No log pages are supported */
+	scst_set_invalid_field_in_cdb(cmd, 2, SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
 
-out:
 	TRACE_EXIT();
-	return;
-}
-
-/*
- * Copy a zero-terminated string into a fixed-size byte array and fill the
- * trailing bytes with @fill_byte.
- */
-static void scst_copy_and_fill_b(char *dst, const char *src, int len,
-				 uint8_t fill_byte)
-{
-	int cpy_len = min_t(int, strlen(src), len);
-
-	memcpy(dst, src, cpy_len);
-	memset(dst + cpy_len, fill_byte, len - cpy_len);
-}
-
-/*
- * Copy a zero-terminated string into a fixed-size char array and fill the
- * trailing characters with spaces.
- */
-static void scst_copy_and_fill(char *dst, const char *src, int len)
-{
-	scst_copy_and_fill_b(dst, src, len, ' ');
+	return CMD_SUCCEEDED;
 }
 
-static enum compl_status_e vdisk_exec_write_same(struct vdisk_cmd_params *p)
+static enum compl_status_e vdisk_exec_read_capacity(struct vdisk_cmd_params *p)
 {
 	struct scst_cmd *cmd = p->cmd;
-	enum compl_status_e res = CMD_SUCCEEDED;
-	uint8_t ctrl_offs = (cmd->cdb_len < 32) ? 1 : 10;
+	int32_t length;
+	uint8_t *address;
+	struct scst_vdisk_dev *virt_dev;
+	uint32_t blocksize;
+	uint64_t nblocks;
+	uint8_t buffer[8];
 
 	TRACE_ENTRY();
 
-	if (unlikely(cmd->cdb[ctrl_offs] & 0x10)) {
-		TRACE_DBG("%s", "ANCHOR not supported");
-		scst_set_invalid_field_in_cdb(cmd, ctrl_offs,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 4);
-		goto out;
+	virt_dev = cmd->dev->dh_priv;
+	blocksize = cmd->dev->block_size;
+	nblocks = virt_dev->nblocks;
+
+	if ((cmd->cdb[8] & 1) == 0) {
+		uint32_t lba = get_unaligned_be32(&cmd->cdb[2]);
+
+		if (lba != 0) {
+			TRACE_DBG("PMI zero and LBA not zero (cmd %p)", cmd);
+			scst_set_invalid_field_in_cdb(cmd, 2, 0);
+			goto out;
+		}
 	}
 
-	if (unlikely(cmd->data_len <= 0)) {
-		PRINT_ERROR("WRITE SAME: refused data_len = %#llx",
-			    cmd->data_len);
-		scst_set_invalid_field_in_cdb(cmd, cmd->len_off, 0);
+	memset(buffer, 0, sizeof(buffer));
+
+	/* Last block on the virt_dev is (nblocks-1) */
+#if 0 /* we don't need this workaround anymore */
+	/*
+	 * If we are thinly provisioned, we must ensure that the initiator
+	 * issues a READ_CAPACITY(16) so we can return the LBPME bit. By
+	 * returning 0xFFFFFFFF we do that.
+	 */
+	put_unaligned_be32(nblocks >> 32 || virt_dev->thin_provisioned ?
+			   0xffffffffU : nblocks - 1, &buffer[0]);
+#else
+	put_unaligned_be32((nblocks >> 32) ? 0xffffffffU : nblocks - 1, &buffer[0]);
+#endif
+
+	put_unaligned_be32(blocksize, &buffer[4]);
+
+	length = scst_get_buf_full_sense(cmd, &address);
+	if (unlikely(length <= 0))
 		goto out;
-	}
 
-	if (cmd->cdb[ctrl_offs] & 0x8)
-		vdisk_exec_write_same_unmap(p);
-	else {
-		scst_write_same(cmd, NULL);
-		res = RUNNING_ASYNC;
-	}
+	length = min_t(int, length, sizeof(buffer));
+
+	memcpy(address, buffer, length);
+
+	scst_put_buf_full(cmd, address);
+
+	if (length < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, length);
 
 out:
-	TRACE_EXIT_RES(res);
-	return res;
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
 }
 
-static enum compl_status_e vdisk_exec_unmap(struct vdisk_cmd_params *p)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 31)
+/*
+ * See also patch "block: Export I/O topology for block devices and partitions"
+ * (commit ID c72758f33784).
+ */
+static inline unsigned int queue_physical_block_size(struct request_queue *q)
+{
+	return 4096;
+}
+#endif
+
+static enum compl_status_e vdisk_exec_read_capacity16(struct vdisk_cmd_params *p)
 {
 	struct scst_cmd *cmd = p->cmd;
-	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
-	struct scst_data_descriptor *pd = cmd->cmd_data_descriptors;
-	int i, cnt = cmd->cmd_data_descriptors_cnt;
-	uint32_t blocks_to_unmap;
+	int32_t length;
+	uint8_t *address;
+	struct scst_vdisk_dev *virt_dev;
+	struct block_device *bdev;
+	struct request_queue *q;
+	uint32_t blocksize, physical_blocksize;
+	uint64_t nblocks;
+	uint8_t buffer[32];
 
 	TRACE_ENTRY();
 
-	if (unlikely(!virt_dev->thin_provisioned)) {
-		TRACE_DBG("%s", "Device not thin provisioned");
-		scst_set_cmd_error(cmd,
-			SCST_LOAD_SENSE(scst_sense_invalid_opcode));
-		goto out;
-	}
-
-	if (unlikely(cmd->cdb[1] & 1)) {
-		TRACE_DBG("%s", "ANCHOR not supported");
-		scst_set_invalid_field_in_cdb(cmd, 1,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
-		goto out;
-	}
+	virt_dev = cmd->dev->dh_priv;
+	bdev = virt_dev->bdev;
+	q = bdev ? bdev_get_queue(bdev) : NULL;
+	blocksize = cmd->dev->block_size;
+	nblocks = virt_dev->nblocks - 1;
 
-	if (pd == NULL)
-		goto out;
+	if ((cmd->cdb[14] & 1) == 0) {
+		uint32_t lba = get_unaligned_be32(&cmd->cdb[2]);
 
-	/* Sanity check to avoid too long latencies */
-	blocks_to_unmap = 0;
-	for (i = 0; i < cnt; i++) {
-		blocks_to_unmap += pd[i].sdd_blocks;
-		if (blocks_to_unmap > virt_dev->unmap_max_lba_cnt) {
-			PRINT_WARNING("Too many UNMAP LBAs %u (max allowed %u, "
-				"dev %s)", blocks_to_unmap,
-				virt_dev->unmap_max_lba_cnt,
-				virt_dev->dev->virt_name);
-			scst_set_invalid_field_in_parm_list(cmd, 0, 0);
+		if (lba != 0) {
+			TRACE_DBG("PMI zero and LBA not zero (cmd %p)", cmd);
+			scst_set_invalid_field_in_cdb(cmd, 2, 0);
 			goto out;
 		}
 	}
 
-	for (i = 0; i < cnt; i++) {
-		int rc;
+	memset(buffer, 0, sizeof(buffer));
 
-		if (unlikely(test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags))) {
-			TRACE_MGMT_DBG("ABORTED set, aborting cmd %p", cmd);
-			goto out;
+	put_unaligned_be64(nblocks, &buffer[0]);
+	put_unaligned_be32(blocksize, &buffer[8]);
+
+	if (cmd->dev->dev_dif_mode != SCST_DIF_MODE_NONE) {
+		switch (cmd->dev->dev_dif_type) {
+		case 1:
+			buffer[12] = 1;
+			break;
+		case 2:
+			buffer[12] = 3;
+			break;
+		case 3:
+			buffer[12] = 5;
+			break;
+		default:
+			sBUG_ON(1);
+			break;
 		}
+	}
 
-		rc = vdisk_unmap_range(cmd, virt_dev, pd[i].sdd_lba,
-			pd[i].sdd_blocks);
-		if (rc != 0)
-			goto out;
+	/* LOGICAL BLOCKS PER PHYSICAL BLOCK EXPONENT */
+	physical_blocksize = q ? queue_physical_block_size(q) : 4096;
+	buffer[13] = max(ilog2(physical_blocksize) - ilog2(blocksize), 0);
+
+	if (virt_dev->thin_provisioned) {
+		buffer[14] |= 0x80;     /* LBPME */
+		if (virt_dev->discard_zeroes_data)
+			buffer[14] |= 0x40;     /* LBPRZ */
 	}
 
-out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
-}
+	length = scst_get_buf_full_sense(cmd, &address);
+	if (unlikely(length <= 0))
+		goto out;
 
-/* Supported VPD Pages VPD page (00h). */
-static int vdisk_sup_vpd(uint8_t *buf, struct scst_cmd *cmd,
-			 struct scst_vdisk_dev *virt_dev)
-{
-	char *page_list = &buf[4], *p = page_list;
+	length = min_t(int, length, sizeof(buffer));
 
-	*p++ = 0x0; /* this page */
-	*p++ = 0x80; /* unit serial number */
-	*p++ = 0x83; /* device identification */
-	*p++ = 0x86; /* extended inquiry */
-	if (cmd->dev->type == TYPE_DISK) {
-		*p++ = 0xB0; /* block limits */
-		*p++ = 0xB1; /* block device characteristics */
-		if (virt_dev->thin_provisioned)
-			*p++ = 0xB2; /* thin provisioning */
-	}
-	buf[3] = p - page_list; /* page length */
+	memcpy(address, buffer, length);
+
+	scst_put_buf_full(cmd, address);
+
+	if (length < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, length);
 
-	return buf[3] + 4;
+out:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
 }
 
-/* Unit Serial Number VPD page (80h) */
-static int vdisk_usn_vpd(uint8_t *buf, struct scst_cmd *cmd,
-			 struct scst_vdisk_dev *virt_dev)
+/*
+ * SBC-3 GET LBA STATUS command. Only COW devices know which blocks are
+ * deallocated, all other devices report everything as mapped.
+ */
+static enum compl_status_e vdisk_exec_get_lba_status(struct vdisk_cmd_params *p)
 {
-	buf[1] = 0x80;
-	if (cmd->tgtt->get_serial) {
-		buf[3] = cmd->tgtt->get_serial(cmd->tgt_dev, &buf[4],
-					       INQ_BUF_SZ - 4);
-	} else {
-		int usn_len;
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	uint64_t lba = cmd->lba, blocks;
+	int32_t length;
+	uint8_t *address, *buf;
+	int buf_len, descr_cnt = 0, status;
 
-		read_lock(&vdisk_serial_rwlock);
-		usn_len = strlen(virt_dev->usn);
-		buf[3] = usn_len;
-		strncpy(&buf[4], virt_dev->usn, usn_len);
-		read_unlock(&vdisk_serial_rwlock);
+	TRACE_ENTRY();
+
+	if (lba >= virt_dev->nblocks) {
+		TRACE_DBG("GET LBA STATUS: lba %lld beyond the end of dev %s",
+			(long long)lba, virt_dev->name);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_block_out_range_error));
+		goto out;
 	}
-	return buf[3] + 4;
-}
 
-/* Device Identification VPD page (83h) */
-static int vdisk_dev_id_vpd(uint8_t *buf, struct scst_cmd *cmd,
-			    struct scst_vdisk_dev *virt_dev)
-{
-	int i, eui64_len = 0, naa_len = 0, resp_len, num = 4;
-	uint16_t tg_id;
-	u8 *eui64_id = NULL, *naa_id = NULL;
+	length = scst_get_buf_full_sense(cmd, &address);
+	if (unlikely(length <= 0))
+		goto out;
 
-	buf[1] = 0x83;
+	/* Header and at least one descriptor, the rest is truncated */
+	buf_len = max_t(int, 24, 8 + ((length - 8) & ~15));
+	buf = kzalloc(buf_len, cmd->cmd_gfp_mask);
+	if (buf == NULL) {
+		scst_set_busy(cmd);
+		goto out_put;
+	}
 
-	read_lock(&vdisk_serial_rwlock);
-	i = strlen(virt_dev->scsi_device_name);
-	if (i > 0) {
-		/* SCSI target device name */
-		buf[num + 0] = 0x3;	/* ASCII */
-		buf[num + 1] = 0x20 | 0x8; /* Target device SCSI name */
-		i += 4 - i % 4; /* align to required 4 bytes */
-		scst_copy_and_fill_b(&buf[num + 4], virt_dev->scsi_device_name,
-				     i, '\0');
+	do {
+		uint8_t *d = &buf[8 + descr_cnt * 16];
 
-		buf[num + 3] = i;
-		num += buf[num + 3];
+		if (virt_dev->cow_img != NULL) {
+			status = vdisk_cow_lba_status(virt_dev, lba, &blocks);
+			if (status < 0) {
+				PRINT_ERROR("GET LBA STATUS for COW device %s "
+					"failed: %d", virt_dev->name, status);
+				scst_set_cmd_error(cmd,
+					SCST_LOAD_SENSE(scst_sense_read_error));
+				goto out_free;
+			}
+		} else {
+			status = VDISK_LBA_MAPPED;
+			blocks = virt_dev->nblocks - lba;
+		}
+		blocks = min_t(uint64_t, blocks, UINT_MAX);
 
-		num += 4;
-	}
-	read_unlock(&vdisk_serial_rwlock);
+		put_unaligned_be64(lba, &d[0]);
+		put_unaligned_be32(blocks, &d[8]);
+		d[12] = status;
 
-	/* T10 vendor identifier field format (faked) */
-	buf[num + 0] = 0x2;	/* ASCII */
-	buf[num + 1] = 0x1;	/* Vendor ID */
-	read_lock(&vdisk_serial_rwlock);
-	scst_copy_and_fill(&buf[num + 4], virt_dev->t10_vend_id, 8);
-	i = strlen(virt_dev->vend_specific_id);
-	memcpy(&buf[num + 12], virt_dev->vend_specific_id, i);
-	read_unlock(&vdisk_serial_rwlock);
+		descr_cnt++;
+		lba += blocks;
+	} while ((lba < virt_dev->nblocks) && (8 + (descr_cnt + 1) * 16 <= buf_len));
 
-	buf[num + 3] = 8 + i;
-	num += buf[num + 3];
+	put_unaligned_be32(4 + descr_cnt * 16, &buf[0]);
 
-	num += 4;
+	length = min_t(int, length, 8 + descr_cnt * 16);
+	memcpy(address, buf, length);
 
-	/*
-	 * Relative target port identifier
-	 */
-	buf[num + 0] = 0x01; /* binary */
-	/* Relative target port id */
-	buf[num + 1] = 0x10 | 0x04;
+	if (length < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, length);
 
-	put_unaligned_be16(cmd->tgt->rel_tgt_id, &buf[num + 4 + 2]);
+out_free:
+	kfree(buf);
 
-	buf[num + 3] = 4;
-	num += buf[num + 3];
+out_put:
+	scst_put_buf_full(cmd, address);
 
-	num += 4;
+out:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
+}
 
-	tg_id = scst_lookup_tg_id(cmd->dev, cmd->tgt);
-	if (tg_id) {
-		/*
-		 * Target port group designator
-		 */
-		buf[num + 0] = 0x01; /* binary */
-		/* Target port group id */
-		buf[num + 1] = 0x10 | 0x05;
+/* SPC-4 REPORT TARGET PORT GROUPS command */
+static enum compl_status_e vdisk_exec_report_tpgs(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_device *dev;
+	uint8_t *address;
+	void *buf;
+	int32_t buf_len;
+	uint32_t data_length, length;
+	uint8_t data_format;
+	int res;
 
-		put_unaligned_be16(tg_id, &buf[num + 4 + 2]);
+	TRACE_ENTRY();
 
-		buf[num + 3] = 4;
-		num += 4 + buf[num + 3];
-	}
+	buf_len = scst_get_buf_full_sense(cmd, &address);
+	if (buf_len <= 0)
+		goto out;
 
-	read_lock(&vdisk_serial_rwlock);
+	dev = cmd->dev;
+	data_format = cmd->cdb[1] >> 5;
 
-	if (virt_dev->eui64_id_len == 0 && virt_dev->naa_id_len == 0) {
-		/*
-		 * Compatibility mode: export the first eight bytes of the
-		 * t10_dev_id as an EUI-64 ID. This is not entirely standards
-		 * compliant since t10_dev_id contains an ASCII string and the
-		 * first three bytes of an eight-byte EUI-64 ID are a OUI.
-		 */
-		eui64_len = 8;
-		eui64_id  = virt_dev->t10_dev_id;
-	} else {
-		if (virt_dev->eui64_id_len) {
-			eui64_len = virt_dev->eui64_id_len;
-			eui64_id  = virt_dev->eui64_id;
-		}
-		if (virt_dev->naa_id_len) {
-			naa_len = virt_dev->naa_id_len;
-			naa_id  = virt_dev->naa_id;
-		}
-	}
-	if (eui64_len) {
-		buf[num + 0] = 0x01; /* binary */
-		buf[num + 1] = 0x02; /* EUI-64 */
-		buf[num + 2] = 0x00; /* reserved */
-		buf[num + 3] = eui64_len;
-		memcpy(&buf[num + 4], eui64_id, eui64_len);
-		num += 4 + eui64_len;
-	}
-	if (naa_len) {
-		buf[num + 0] = 0x01; /* binary */
-		buf[num + 1] = 0x03; /* NAA */
-		buf[num + 2] = 0x00; /* reserved */
-		buf[num + 3] = naa_len;
-		memcpy(&buf[num + 4], naa_id, naa_len);
-		num += 4 + naa_len;
+	res = scst_tg_get_group_info(&buf, &data_length, dev, data_format);
+	if (res == -ENOMEM) {
+		scst_set_busy(cmd);
+		goto out_put;
+	} else if (res < 0) {
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_invalid_field_in_cdb));
+		goto out_put;
 	}
 
-	read_unlock(&vdisk_serial_rwlock);
-
-	resp_len = num - 4;
+	length = min_t(uint32_t, data_length, buf_len);
+	memcpy(address, buf, length);
+	kfree(buf);
+	if (length < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, length);
 
-	put_unaligned_be16(resp_len, &buf[2]);
-	resp_len += 4;
+out_put:
+	scst_put_buf_full(cmd, address);
 
-	return resp_len;
+out:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
 }
 
-/* Extended INQUIRY Data (86h) */
-static int vdisk_ext_inq(uint8_t *buf, struct scst_cmd *cmd,
-			 struct scst_vdisk_dev *virt_dev)
+/* SPC-4 SET TARGET PORT GROUPS command */
+static enum compl_status_e vdisk_exec_set_tpgs(struct vdisk_cmd_params *p)
 {
+	struct scst_cmd *cmd = p->cmd;
 	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	int res = CMD_SUCCEEDED, rc;
 
-	buf[1] = 0x86;
-	buf[3] = 0x3C;
-	if (dev->dev_dif_mode != SCST_DIF_MODE_NONE) {
-		switch (dev->dev_dif_type) {
-		case 1:
-			buf[4] = 0; /* SPT=0, type 1 only supported */
-			break;
-		case 2:
-			buf[4] = 0x10; /* SPT=010, type 2 only supported */
-			break;
-		case 3:
-			buf[4] = 0x20; /* SPT=100, type 3 only supported */
-			break;
-		default:
-			sBUG_ON(1);
-			break;
-		}
-		buf[4] |= 4; /* GRD_CHK */
-		if (dev->dif_app_chk)
-			buf[4] |= 2; /* APP_CHK */
-		if (dev->dif_ref_chk)
-			buf[4] |= 1; /* REF_CHK */
+	TRACE_ENTRY();
+
+	if (!virt_dev->expl_alua) {
+		PRINT_ERROR("SET TARGET PORT GROUPS: not explicit ALUA mode "
+			"(dev %s)", dev->virt_name);
+		/* Invalid opcode, i.e. SA field */
+		scst_set_invalid_field_in_cdb(cmd, 1,
+			0 | SCST_INVAL_FIELD_BIT_OFFS_VALID);
+		goto out;
 	}
-	buf[5] = 7; /* HEADSUP=1, ORDSUP=1, SIMPSUP=1 */
-	buf[6] = (virt_dev->wt_flag || virt_dev->nv_cache) ? 0 : 1; /* V_SUP */
-	buf[7] = 1; /* LUICLR=1 */
-	return buf[3] + 4;
+
+	rc = scst_tg_set_group_info(cmd);
+	if (rc == 0)
+		res = RUNNING_ASYNC;
+	else
+		scst_stpg_del_unblock_next(cmd);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
 }
 
-/* Block Limits VPD page (B0h) */
-static int vdisk_block_limits(uint8_t *buf, struct scst_cmd *cmd,
-			      struct scst_vdisk_dev *virt_dev)
-{
-	struct scst_device *dev = cmd->dev;
-	int max_transfer;
+static enum compl_status_e vdisk_exec_read_toc(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	int32_t length, off = 0;
+	uint8_t *address;
+	struct scst_vdisk_dev *virt_dev;
+	uint32_t nblocks;
+	uint8_t buffer[4+8+8] = { 0x00, 0x0a, 0x01, 0x01, 0x00, 0x14,
+				  0x01, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+	TRACE_ENTRY();
+
+	if (cmd->dev->type != TYPE_ROM) {
+		PRINT_ERROR("%s", "READ TOC for non-CDROM device");
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_invalid_opcode));
+		goto out;
+	}
+
+	if (cmd->cdb[2] & 0x0e/*Format*/) {
+		PRINT_ERROR("%s", "READ TOC: invalid requested data format");
+		scst_set_invalid_field_in_cdb(cmd, 2,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 5);
+		goto out;
+	}
 
-	buf[1] = 0xB0;
-	buf[3] = 0x3C;
-	buf[4] = 1; /* WSNZ set */
-	buf[5] = 0xFF; /* No MAXIMUM COMPARE AND WRITE LENGTH limit */
-	/* Optimal transfer granuality is PAGE_SIZE */
-	put_unaligned_be16(max_t(int, PAGE_SIZE / dev->block_size, 1), &buf[6]);
+	if ((cmd->cdb[6] != 0 && (cmd->cdb[2] & 0x01)) ||
+	    (cmd->cdb[6] > 1 && cmd->cdb[6] != 0xAA)) {
+		PRINT_ERROR("READ TOC: invalid requested track number %x",
+			cmd->cdb[6]);
+		scst_set_invalid_field_in_cdb(cmd, 6, 0);
+		goto out;
+	}
 
-	/* Max transfer len is min of sg limit and 8M */
-	max_transfer = min_t(int, cmd->tgt_dev->max_sg_cnt << PAGE_SHIFT,
-			     8*1024*1024) / dev->block_size;
-	put_unaligned_be32(max_transfer, &buf[8]);
+	length = scst_get_buf_full_sense(cmd, &address);
+	if (unlikely(length <= 0))
+		goto out;
 
-	/*
-	 * Let's have optimal transfer len 512KB. Better to not
-	 * set it at all, because we don't have such limit,
-	 * but some initiators may not understand that (?).
-	 * From other side, too big transfers  are not optimal,
-	 * because SGV cache supports only <4M buffers.
-	 */
-	put_unaligned_be32(min_t(int, max_transfer, 512*1024 / dev->block_size),
-			   &buf[12]);
+	virt_dev = cmd->dev->dh_priv;
+	/* ToDo when you have > 8TB ROM device. */
+	nblocks = (uint32_t)virt_dev->nblocks;
 
-	if (virt_dev->thin_provisioned) {
-		/* MAXIMUM UNMAP BLOCK DESCRIPTOR COUNT is UNLIMITED */
-		put_unaligned_be32(0xFFFFFFFF, &buf[24]);
+	/* Header */
+	memset(buffer, 0, sizeof(buffer));
+	buffer[2] = 0x01;    /* First Track/Session */
+	buffer[3] = 0x01;    /* Last Track/Session */
+	off = 4;
+	if (cmd->cdb[6] <= 1) {
+		/* Fistr TOC Track Descriptor */
 		/*
-		 * MAXIMUM UNMAP LBA COUNT, OPTIMAL UNMAP
-		 * GRANULARITY and ALIGNMENT
+		 * ADDR    0x10 - Q Sub-channel encodes current position data
+		 * CONTROL 0x04 - Data track, recoreded uninterrupted
 		 */
-		put_unaligned_be32(virt_dev->unmap_max_lba_cnt, &buf[20]);
-		put_unaligned_be32(virt_dev->unmap_opt_gran, &buf[28]);
-		if (virt_dev->unmap_align != 0) {
-			put_unaligned_be32(virt_dev->unmap_align, &buf[32]);
-			buf[32] |= 0x80;
-		}
+		buffer[off+1] = 0x14;
+		/* Track Number */
+		buffer[off+2] = 0x01;
+		off += 8;
+	}
+	if (!(cmd->cdb[2] & 0x01)) {
+		/* Lead-out area TOC Track Descriptor */
+		buffer[off+1] = 0x14;
+		/* Track Number */
+		buffer[off+2] = 0xAA;
+		/* Track Start Address */
+		put_unaligned_be32(nblocks, &buffer[off + 4]);
+		off += 8;
 	}
 
-	/* MAXIMUM WRITE SAME LENGTH (measured in blocks) */
-	put_unaligned_be64(dev->max_write_same_len >> dev->block_shift,
-			   &buf[36]);
+	buffer[1] = off - 2;    /* Data  Length */
 
-	return buf[3] + 4;
-}
+	if (off > length)
+		off = length;
+	memcpy(address, buffer, off);
 
-/* Block Device Characteristics VPD Page (B1h) */
-static int vdisk_bdev_char(uint8_t *buf, struct scst_cmd *cmd,
-			   struct scst_vdisk_dev *virt_dev)
-{
-	buf[1] = 0xB1;
-	buf[3] = 0x3C;
-	if (virt_dev->rotational) {
-		/* 15K RPM */
-		put_unaligned_be16(0x3A98, &buf[4]);
-	} else
-		put_unaligned_be16(1, &buf[4]);
-	return buf[3] + 4;
-}
+	scst_put_buf_full(cmd, address);
 
-/* Logical Block Provisioning a.k.a. Thin Provisioning VPD page (B2h) */
-static int vdisk_tp_vpd(uint8_t *buf, struct scst_cmd *cmd,
-			struct scst_vdisk_dev *virt_dev)
-{
-	buf[1] = 0xB2;
-	buf[3] = 4;
-	buf[5] = 0xE0;
-	if (virt_dev->discard_zeroes_data)
-		buf[5] |= 0x4; /* LBPRZ */
-	buf[6] = 2; /* thin provisioned */
-	return buf[3] + 4;
+	if (off < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, off);
+
+out:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
 }
 
-/* Standard INQUIRY response */
-static int vdisk_inq(uint8_t *buf, struct scst_cmd *cmd,
-		     struct scst_vdisk_dev *virt_dev)
+static enum compl_status_e vdisk_exec_prevent_allow_medium_removal(struct vdisk_cmd_params *p)
 {
-	int num;
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
 
-	if (virt_dev->removable)
-		buf[1] = 0x80;      /* removable */
-	buf[2] = 6; /* Device complies to SPC-4 */
-	buf[3] = 0x02;	/* Data in format specified in SPC */
-	if (cmd->tgtt->fake_aca)
-		buf[3] |= 0x20;
-	buf[4] = 31;/* n - 4 = 35 - 4 = 31 for full 36 byte data */
-	if (cmd->dev->dev_dif_mode != SCST_DIF_MODE_NONE)
-		buf[5] |= 1; /* PROTECT */
-	if (scst_alua_configured(cmd->dev)) {
-		buf[5] |= SCST_INQ_TPGS_MODE_IMPLICIT;
-		if (virt_dev->expl_alua)
-			buf[5] |= SCST_INQ_TPGS_MODE_EXPLICIT;
-	}
-	buf[5] |= 8; /* 3PC */
-	buf[6] = 0x10; /* MultiP 1 */
-	buf[7] = 2; /* CMDQUE 1, BQue 0 => commands queuing supported */
+	TRACE_DBG("PERSIST/PREVENT 0x%02x", cmd->cdb[4]);
 
-	read_lock(&vdisk_serial_rwlock);
+	spin_lock(&virt_dev->flags_lock);
+	virt_dev->prevent_allow_medium_removal = cmd->cdb[4] & 0x01 ? 1 : 0;
+	spin_unlock(&virt_dev->flags_lock);
 
-	/*
-	 * 8 byte ASCII Vendor Identification of the target
-	 * - left aligned.
-	 */
-	scst_copy_and_fill(&buf[8], virt_dev->t10_vend_id, 8);
+	return CMD_SUCCEEDED;
+}
 
-	/*
-	 * 16 byte ASCII Product Identification of the target - left
-	 * aligned.
-	 */
-	scst_copy_and_fill(&buf[16], virt_dev->prod_id, 16);
+static int __vdisk_fsync_fileio(loff_t loff,
+	loff_t len, struct scst_device *dev, struct scst_cmd *cmd,
+	struct file *file)
+{
+	int res;
 
-	/*
-	 * 4 byte ASCII Product Revision Level of the target - left
-	 * aligned.
-	 */
-	scst_copy_and_fill(&buf[32], virt_dev->prod_rev_lvl, 4);
+	TRACE_ENTRY();
 
-	/* Vendor specific information. */
-	if (virt_dev->inq_vend_specific_len <= 20)
-		memcpy(&buf[36], virt_dev->inq_vend_specific,
-		       virt_dev->inq_vend_specific_len);
+	/**
+	 ** !!! CAUTION !!!: cmd can be NULL here! Don't use it for
+	 ** anything without checking for NULL at first !!!
+	 **/
 
-	/** Version descriptors **/
+	/* BLOCKIO can be here for DIF tags fsync */
 
-	buf[4] += 58 - 36;
-	num = 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 32)
+	res = sync_page_range(file_inode(file), file->f_mapping, loff, len);
+#else
+#if 0	/* For sparse files we might need to sync metadata as well */
+	res = generic_write_sync(file, loff, len);
+#else
+	res = filemap_write_and_wait_range(file->f_mapping, loff, len);
+#endif
+#endif
+	if (unlikely(res != 0)) {
+		PRINT_ERROR("sync range failed (%d)", res);
+		if (cmd != NULL) {
+			if (res == -ENOMEM)
+				scst_set_busy(cmd);
+			else
+				scst_set_cmd_error(cmd,
+					SCST_LOAD_SENSE(scst_sense_write_error));
+		}
+	}
 
-	/* SAM-4 T10/1683-D revision 14 */
-	buf[58 + num] = 0x0;
-	buf[58 + num + 1] = 0x8B;
-	num += 2;
+	TRACE_EXIT_RES(res);
+	return res;
+}
 
-	/* Physical transport */
-	if (cmd->tgtt->get_phys_transport_version != NULL) {
-		uint16_t v = cmd->tgtt->get_phys_transport_version(cmd->tgt);
+static int vdisk_fsync_blockio(loff_t loff,
+	loff_t len, struct scst_device *dev, gfp_t gfp_flags,
+	struct scst_cmd *cmd, bool async)
+{
+	int res;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
 
-		if (v != 0) {
-			put_unaligned_be16(v, &buf[58 + num]);
-			num += 2;
-		}
-	}
+	TRACE_ENTRY();
 
-	/* SCSI transport */
-	if (cmd->tgtt->get_scsi_transport_version != NULL) {
-		put_unaligned_be16(
-			cmd->tgtt->get_scsi_transport_version(cmd->tgt),
-			&buf[58 + num]);
-		num += 2;
-	}
+	/**
+	 ** !!! CAUTION !!!: cmd can be NULL here! Don't use it for
+	 ** anything without checking for NULL at first !!!
+	 **/
 
-	/* SPC-4 T10/1731-D revision 23 */
-	buf[58 + num] = 0x4;
-	buf[58 + num + 1] = 0x63;
-	num += 2;
+	EXTRACHECKS_BUG_ON(!virt_dev->blockio);
 
-	/* Device command set */
-	if (virt_dev->command_set_version != 0) {
-		put_unaligned_be16(virt_dev->command_set_version,
-				   &buf[58 + num]);
-		num += 2;
+	/* Must be first, because vdisk_blockio_flush() can call scst_cmd_done()! */
+	if (virt_dev->dif_fd != NULL) {
+		loff = (loff >> dev->block_shift) << SCST_DIF_TAG_SHIFT;
+		len = (len >> dev->block_shift) << SCST_DIF_TAG_SHIFT;
+		res = __vdisk_fsync_fileio(loff, len, dev, cmd,
+			virt_dev->dif_fd);
+		if (unlikely(res != 0))
+			goto out;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+	if (async && (cmd != NULL)) {
+		vdisk_blockio_flush_coalesced(virt_dev, gfp_flags, cmd);
+		res = 0;
+		goto out;
 	}
+#endif
 
-	/* Vendor specific information. */
-	if (virt_dev->inq_vend_specific_len > 20) {
-		memcpy(&buf[96], virt_dev->inq_vend_specific,
-		       virt_dev->inq_vend_specific_len);
-		num = 96 - 58 + virt_dev->inq_vend_specific_len;
+	if (virt_dev->stripe_cnt != 0) {
+		res = vdisk_stripe_flush(virt_dev, gfp_flags);
+		if (cmd != NULL) {
+			if (res != 0)
+				scst_set_cmd_error(cmd,
+					SCST_LOAD_SENSE(scst_sense_write_error));
+			if (async) {
+				cmd->completed = 1;
+				cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
+					scst_estimate_context());
+			}
+		}
+		goto out;
 	}
 
-	read_unlock(&vdisk_serial_rwlock);
+	res = vdisk_blockio_flush(virt_dev->bdev, gfp_flags, true,
+		cmd, async);
 
-	buf[4] += num;
-	return buf[4] + 5;
+out:
+	TRACE_EXIT_RES(res);
+	return res;
 }
 
-static enum compl_status_e vdisk_exec_inquiry(struct vdisk_cmd_params *p)
+/*
+ * Group commit of FILEIO fsyncs. If an fsync of the file is already
+ * running, the caller waits for it to finish and then, if no fsync
+ * started after the caller came has finished meanwhile, runs one fsync
+ * covering the ranges of all callers came since the previous one started.
+ * So, any number of simultaneous SYNCHRONIZE CACHE cmds costs at most two
+ * fsyncs of the backend file.
+ */
+static int vdisk_fsync_fileio_coalesced(loff_t loff, loff_t len,
+	struct scst_device *dev, struct scst_cmd *cmd)
 {
-	struct scst_cmd *cmd = p->cmd;
-	int32_t length, resp_len;
-	uint8_t *address;
-	uint8_t *buf;
-	struct scst_device *dev = cmd->dev;
 	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	uint64_t gen;
+	loff_t start, end;
+	int res;
 
 	TRACE_ENTRY();
 
-	buf = kzalloc(INQ_BUF_SZ, cmd->cmd_gfp_mask);
-	if (buf == NULL) {
-		scst_set_busy(cmd);
-		goto out;
-	}
+	spin_lock(&virt_dev->flags_lock);
+	/* The first fsync started after this point covers us */
+	gen = virt_dev->fsync_gen_started + 1;
+	virt_dev->fsync_start = min(virt_dev->fsync_start, loff);
+	if (len == 0)
+		virt_dev->fsync_end = LLONG_MAX;
+	else
+		virt_dev->fsync_end = max(virt_dev->fsync_end, loff + len - 1);
+	spin_unlock(&virt_dev->flags_lock);
 
-	length = scst_get_buf_full_sense(cmd, &address);
-	TRACE_DBG("length %d", length);
-	if (unlikely(length <= 0))
-		goto out_free;
+	mutex_lock(&virt_dev->fsync_mutex);
 
-	if (cmd->cdb[1] & CMDDT) {
-		TRACE_DBG("%s", "INQUIRY: CMDDT is unsupported");
-		scst_set_invalid_field_in_cdb(cmd, 1,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 1);
-		goto out_put;
+	if (virt_dev->fsync_gen_done >= gen) {
+		TRACE_DBG("Dev %s: fsync coalesced (gen %lld)", dev->virt_name,
+			(long long)gen);
+		res = virt_dev->fsync_res;
+		goto out_unlock;
 	}
 
-	buf[0] = virt_dev->dummy ? SCSI_INQ_PQ_NOT_CON << 5 | 0x1f :
-		 SCSI_INQ_PQ_CON << 5 | dev->type;
-	/* Vital Product */
-	if (cmd->cdb[1] & EVPD) {
-		if (cmd->cdb[2] == 0) {
-			resp_len = vdisk_sup_vpd(buf, cmd, virt_dev);
-		} else if (cmd->cdb[2] == 0x80) {
-			resp_len = vdisk_usn_vpd(buf, cmd, virt_dev);
-		} else if (cmd->cdb[2] == 0x83) {
-			resp_len = vdisk_dev_id_vpd(buf, cmd, virt_dev);
-		} else if (cmd->cdb[2] == 0x86) {
-			resp_len = vdisk_ext_inq(buf, cmd, virt_dev);
-		} else if (cmd->cdb[2] == 0xB0 && dev->type == TYPE_DISK) {
-			resp_len = vdisk_block_limits(buf, cmd, virt_dev);
-		} else if (cmd->cdb[2] == 0xB1 && dev->type == TYPE_DISK) {
-			resp_len = vdisk_bdev_char(buf, cmd, virt_dev);
-		} else if (cmd->cdb[2] == 0xB2 && dev->type == TYPE_DISK &&
-			   virt_dev->thin_provisioned) {
-			resp_len = vdisk_tp_vpd(buf, cmd, virt_dev);
-		} else {
-			TRACE_DBG("INQUIRY: Unsupported EVPD page %x", cmd->cdb[2]);
-			scst_set_invalid_field_in_cdb(cmd, 2, 0);
-			goto out_put;
-		}
-	} else {
-		if (cmd->cdb[2] != 0) {
-			TRACE_DBG("INQUIRY: Unsupported page %x", cmd->cdb[2]);
-			scst_set_invalid_field_in_cdb(cmd, 2, 0);
-			goto out_put;
-		}
-		resp_len = vdisk_inq(buf, cmd, virt_dev);
-	}
+	spin_lock(&virt_dev->flags_lock);
+	gen = ++virt_dev->fsync_gen_started;
+	start = virt_dev->fsync_start;
+	end = virt_dev->fsync_end;
+	virt_dev->fsync_start = LLONG_MAX;
+	virt_dev->fsync_end = 0;
+	spin_unlock(&virt_dev->flags_lock);
 
-	sBUG_ON(resp_len > INQ_BUF_SZ);
+	res = __vdisk_fsync_fileio(start,
+		(end == LLONG_MAX) ? LLONG_MAX - start : end - start + 1, dev,
+		NULL, virt_dev->fd);
 
-	if (length > resp_len)
-		length = resp_len;
-	memcpy(address, buf, length);
+	virt_dev->fsync_gen_done = gen;
+	virt_dev->fsync_res = res;
 
-out_put:
-	scst_put_buf_full(cmd, address);
-	if (length < cmd->resp_data_len)
-		scst_set_resp_data_len(cmd, length);
+out_unlock:
+	mutex_unlock(&virt_dev->fsync_mutex);
 
-out_free:
-	kfree(buf);
+	if (unlikely(res != 0) && (cmd != NULL)) {
+		if (res == -ENOMEM)
+			scst_set_busy(cmd);
+		else
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
+	}
 
-out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	TRACE_EXIT_RES(res);
+	return res;
 }
 
-static enum compl_status_e vdisk_exec_request_sense(struct vdisk_cmd_params *p)
+static int vdisk_fsync_fileio(loff_t loff,
+	loff_t len, struct scst_device *dev, struct scst_cmd *cmd, bool async)
 {
-	struct scst_cmd *cmd = p->cmd;
-	struct scst_device *dev = cmd->dev;
+	int res;
 	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
-	int32_t length, sl;
-	uint8_t *address;
-	uint8_t b[SCST_STANDARD_SENSE_LEN];
 
 	TRACE_ENTRY();
 
-	/*
-	 * No need to make it volatile, because at worst we will have a couple
-	 * of extra commands refused after formatting actually finished, which
-	 * is acceptable.
-	 */
-	if (virt_dev->format_active) {
-		uint64_t d, div;
-		uint16_t v;
-
-		div = virt_dev->format_progress_to_do >> 16;
-		d = virt_dev->format_progress_done;
-		do_div(d, div);
-		v = d;
-
-		TRACE_DBG("Format progress %d", v);
-
-		sl = scst_set_sense(b, sizeof(b), dev->d_sense,
-			SCST_LOAD_SENSE(scst_sense_format_in_progress));
+	/**
+	 ** !!! CAUTION !!!: cmd can be NULL here! Don't use it for
+	 ** anything without checking for NULL at first !!!
+	 **/
 
-		BUILD_BUG_ON(SCST_STANDARD_SENSE_LEN < 18);
-		if (dev->d_sense) {
-			uint8_t *p = &b[7];
-			int o = 8;
-			*p += 8;
-			b[o] = 2;
-			b[o+1] = 6;
-			b[o+4] = 0x80;
-			put_unaligned_be16(v, &b[o+5]);
-		} else {
-			b[15] = 0x80;
-			put_unaligned_be16(v, &b[16]);
+	if (virt_dev->cow) {
+		/* Offsets in the image don't match the LBAs, so sync it all */
+		res = vdisk_cow_flush(virt_dev->cow_img);
+		if (unlikely(res != 0) && (cmd != NULL)) {
+			if (res == -ENOMEM)
+				scst_set_busy(cmd);
+			else
+				scst_set_cmd_error(cmd,
+					SCST_LOAD_SENSE(scst_sense_write_error));
+		}
+	} else if (virt_dev->cache != NULL) {
+		/* Writes, which bypassed the cache, went to the file */
+		res = __vdisk_fsync_fileio(loff, len, dev, cmd, virt_dev->fd);
+		if (res == 0) {
+			res = vdisk_cache_commit(virt_dev->cache);
+			if (unlikely(res != 0) && (cmd != NULL))
+				scst_set_cmd_error(cmd,
+					SCST_LOAD_SENSE(scst_sense_write_error));
 		}
-		TRACE_BUFF_FLAG(TRACE_DEBUG, "Format sense", b, sizeof(b));
 	} else
-		sl = scst_set_sense(b, sizeof(b), cmd->dev->d_sense,
-			SCST_LOAD_SENSE(scst_sense_no_sense));
-
-	length = scst_get_buf_full_sense(cmd, &address);
-	TRACE_DBG("length %d", length);
-	if (length <= 0)
-		goto out;
+		res = vdisk_fsync_fileio_coalesced(loff, len, dev, cmd);
+	if (unlikely(res != 0))
+		goto done;
 
-	length = min(sl, length);
-	memcpy(address, b, length);
-	scst_set_resp_data_len(cmd, length);
+	if (virt_dev->dif_fd != NULL) {
+		loff = (loff >> dev->block_shift) << SCST_DIF_TAG_SHIFT;
+		len = (len >> dev->block_shift) << SCST_DIF_TAG_SHIFT;
+		res = __vdisk_fsync_fileio(loff, len, dev, cmd,
+			virt_dev->dif_fd);
+	}
 
-	scst_put_buf_full(cmd, address);
+done:
+	if (async) {
+		if (cmd != NULL) {
+			cmd->completed = 1;
+			cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
+				scst_estimate_context());
+		}
+	}
 
-out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	TRACE_EXIT_RES(res);
+	return res;
 }
 
-static int vdisk_err_recov_pg(unsigned char *p, int pcontrol,
-			       struct scst_vdisk_dev *virt_dev)
-{	/* Read-Write Error Recovery page for mode_sense */
-	const unsigned char err_recov_pg[] = {0x1, 0xa, 0xc0, 1, 0, 0, 0, 0,
-					      1, 0, 0xff, 0xff};
-
-	memcpy(p, err_recov_pg, sizeof(err_recov_pg));
-	if (pcontrol == 1)
-		memset(p + 2, 0, sizeof(err_recov_pg) - 2);
-	return sizeof(err_recov_pg);
-}
+static int vdisk_fsync(loff_t loff,
+	loff_t len, struct scst_device *dev, gfp_t gfp_flags,
+	struct scst_cmd *cmd, bool async)
+{
+	int res = 0;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
 
-static int vdisk_disconnect_pg(unsigned char *p, int pcontrol,
-				struct scst_vdisk_dev *virt_dev)
-{	/* Disconnect-Reconnect page for mode_sense */
-	const unsigned char disconnect_pg[] = {0x2, 0xe, 128, 128, 0, 10, 0, 0,
-					       0, 0, 0, 0, 0, 0, 0, 0};
+	TRACE_ENTRY();
 
-	memcpy(p, disconnect_pg, sizeof(disconnect_pg));
-	if (pcontrol == 1)
-		memset(p + 2, 0, sizeof(disconnect_pg) - 2);
-	return sizeof(disconnect_pg);
-}
+	/**
+	 ** !!! CAUTION !!!: cmd can be NULL here! Don't use it for
+	 ** anything without checking for NULL at first !!!
+	 **/
 
-static int vdisk_rigid_geo_pg(unsigned char *p, int pcontrol,
-	struct scst_vdisk_dev *virt_dev)
-{
-	unsigned char geo_m_pg[] = {0x04, 0x16, 0, 0, 0, DEF_HEADS, 0, 0,
-				    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-				    0x3a, 0x98/* 15K RPM */, 0, 0};
-	int32_t ncyl, n, rem;
-	uint64_t dividend;
+	/* It should be generated by compiler as a single comparison */
+	if (virt_dev->nv_cache || virt_dev->wt_flag ||
+	    virt_dev->o_direct_flag || virt_dev->nullio) {
+		if (async) {
+			cmd->completed = 1;
+			cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
+				scst_estimate_context());
+		}
+		goto out;
+	}
 
-	memcpy(p, geo_m_pg, sizeof(geo_m_pg));
-	/*
-	 * Divide virt_dev->nblocks by (DEF_HEADS * DEF_SECTORS) and store
-	 * the quotient in ncyl and the remainder in rem.
-	 */
-	dividend = virt_dev->nblocks;
-	rem = do_div(dividend, DEF_HEADS * DEF_SECTORS);
-	ncyl = dividend;
-	if (rem != 0)
-		ncyl++;
-	memcpy(&n, p + 2, sizeof(u32));
-	n = n | ((__force u32)cpu_to_be32(ncyl) >> 8);
-	memcpy(p + 2, &n, sizeof(u32));
-	if (pcontrol == 1)
-		memset(p + 2, 0, sizeof(geo_m_pg) - 2);
-	return sizeof(geo_m_pg);
+	if (virt_dev->nullio)
+		;
+	else if (virt_dev->blockio)
+		res = vdisk_fsync_blockio(loff, len, dev, gfp_flags, cmd, async);
+	else
+		res = vdisk_fsync_fileio(loff, len, dev, cmd, async);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
 }
 
-static int vdisk_format_pg(unsigned char *p, int pcontrol,
-			    struct scst_vdisk_dev *virt_dev)
-{       /* Format device page for mode_sense */
-	const unsigned char format_pg[] = {0x3, 0x16, 0, 0, 0, 0, 0, 0,
-					   0, 0, 0, 0, 0, 0, 0, 0,
-					   0, 0, 0, 0, 0x40, 0, 0, 0};
+static struct iovec *vdisk_alloc_iv(struct scst_cmd *cmd,
+				    struct vdisk_cmd_params *p)
+{
+	int iv_count;
 
-	memcpy(p, format_pg, sizeof(format_pg));
-	put_unaligned_be16(DEF_SECTORS, &p[10]);
-	put_unaligned_be16(virt_dev->dev->block_size, &p[12]);
-	if (pcontrol == 1)
-		memset(p + 2, 0, sizeof(format_pg) - 2);
-	return sizeof(format_pg);
+	iv_count = min_t(int, scst_get_buf_count(cmd), UIO_MAXIOV);
+	if (iv_count > p->iv_count) {
+		if (p->iv != p->small_iv)
+			kfree(p->iv);
+		p->iv_count = 0;
+		/* It can't be called in atomic context */
+		p->iv = (iv_count <= ARRAY_SIZE(p->small_iv)) ? p->small_iv :
+			kmalloc_array(iv_count, sizeof(*p->iv),
+				      cmd->cmd_gfp_mask);
+		if (p->iv == NULL) {
+			PRINT_ERROR("Unable to allocate iv (%d)", iv_count);
+			goto out;
+		}
+		p->iv_count = iv_count;
+	}
+
+out:
+	return p->iv;
 }
 
-static int vdisk_caching_pg(unsigned char *p, int pcontrol,
-			     struct scst_vdisk_dev *virt_dev)
-{
-	/* Caching page for mode_sense */
-	static const unsigned char caching_pg[] = {
-		0x8, 0x12, 0x0, 0, 0, 0, 0, 0,
-		0, 0, 0, 0, 0x80, 0x14, 0, 0,
-		0, 0, 0, 0
-	};
+/*
+ * vdisk_nullio completion delay and error injection
+ *
+ * To model a real backend, a vdisk_nullio READ, WRITE or VERIFY can be
+ * completed asynchronously from an hrtimer: after delay_us plus a random
+ * jitter of delay_dist distribution scaled by delay_jitter_us, and, if bw_mb
+ * is set, not before its data could have passed a link of bw_mb MB/s shared
+ * by all commands of the device. Each error_interval'th command fails with
+ * MEDIUM ERROR. The jitter comes from a per device pseudo random sequence, so
+ * the same workload gets the same delays each run.
+ */
 
-	memcpy(p, caching_pg, sizeof(caching_pg));
+struct vdisk_nullio_timer {
+	struct hrtimer timer;
+	struct scst_cmd *cmd;
+};
 
-	if (!virt_dev->nv_cache && vdev_saved_mode_pages_enabled)
-		p[0] |= 0x80;
+/* nullio_lock supposed to be held */
+static u32 nullio_random(struct scst_vdisk_dev *virt_dev)
+{
+	u32 x = virt_dev->nullio_rnd;
+
+	/* xorshift32 */
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	virt_dev->nullio_rnd = x;
+	return x;
+}
 
-	switch (pcontrol) {
-	case 0: /* current */
-		p[2] |= (virt_dev->wt_flag || virt_dev->nv_cache) ? 0 : WCE;
-		break;
-	case 1: /* changeable */
-		memset(p + 2, 0, sizeof(caching_pg) - 2);
-		if (!virt_dev->nv_cache)
-			p[2] |= WCE;
-		break;
-	case 2: /* default */
-		p[2] |= (DEF_WRITE_THROUGH || virt_dev->nv_cache) ? 0 : WCE;
+/*
+ * Returns the random delay jitter in us, nullio_lock supposed to be held.
+ * With @scale being delay_jitter_us, the jitter is:
+ *  - VDISK_NULLIO_DIST_UNIFORM: uniformly distributed from 0 to scale;
+ *  - VDISK_NULLIO_DIST_EXP: exponentially distributed with mean scale, which
+ *    models the long tail of a loaded device. -ln() of a uniform number is
+ *    computed from its binary logarithm with the mantissa linearly
+ *    approximated, which is good enough here and caps the jitter at ~22
+ *    times scale;
+ *  - VDISK_NULLIO_DIST_NORMAL: approximately normally distributed around 6
+ *    times scale with standard deviation scale, as the sum of 12 uniform
+ *    numbers from 0 to scale. Subtract 6 * scale from delay_us to get it
+ *    centered around delay_us.
+ */
+static u64 nullio_jitter(struct scst_vdisk_dev *virt_dev, unsigned int scale,
+	unsigned int dist)
+{
+	u64 res = 0;
+	u32 x, frac;
+	int i, k;
+
+	switch (dist) {
+	case VDISK_NULLIO_DIST_EXP:
+		x = nullio_random(virt_dev);
+		k = ilog2(x);
+		/* Fraction of log2(x) in Q16 */
+		frac = (u32)(((u64)x << (31 - k)) & 0x7fffffff) >> 15;
+		/* -log2(x / 2^32) in Q16 multiplied by ln(2) in Q16 */
+		res = (((u64)(32 - k) << 16) - frac) * 45426;
+		res = (res * scale) >> 32;
 		break;
-	case 3: /* saved */
-		p[2] |= (virt_dev->wt_flag_saved || virt_dev->nv_cache) ? 0 : WCE;
+	case VDISK_NULLIO_DIST_NORMAL:
+		for (i = 0; i < 12; i++)
+			res += nullio_random(virt_dev) % (scale + 1);
 		break;
 	default:
-		sBUG();
+		res = nullio_random(virt_dev) % (scale + 1);
 		break;
 	}
 
-	return sizeof(caching_pg);
+	return res;
 }
 
-static int vdisk_ctrl_m_pg(unsigned char *p, int pcontrol,
-			    struct scst_vdisk_dev *virt_dev)
-{	/* Control mode page for mode_sense */
-	unsigned char ctrl_m_pg[] = {0xa, 0xa, 0, 0, 0, 0, 0, 0,
-					   0, 0, 0x2, 0x4b};
-
-	if (vdev_saved_mode_pages_enabled)
-		ctrl_m_pg[0] |= 0x80;
+static enum hrtimer_restart nullio_timer_fn(struct hrtimer *timer)
+{
+	struct vdisk_nullio_timer *t = container_of(timer,
+					struct vdisk_nullio_timer, timer);
+	struct scst_cmd *cmd = t->cmd;
 
-	memcpy(p, ctrl_m_pg, sizeof(ctrl_m_pg));
-	switch (pcontrol) {
-	case 0: /* current */
-		p[2] |= virt_dev->dev->tst << 5;
-		p[2] |= virt_dev->dev->d_sense << 2;
-		p[2] |= virt_dev->dev->dpicz << 3;
-		p[2] |= virt_dev->dev->tmf_only << 4;
-		p[3] |= virt_dev->dev->queue_alg << 4;
-		p[3] |= virt_dev->dev->qerr << 1;
-		p[4] |= virt_dev->dev->swp << 3;
-		p[5] |= virt_dev->dev->tas << 6;
-		p[5] |= virt_dev->dev->ato << 7;
-		break;
-	case 1: /* changeable */
-		memset(p + 2, 0, sizeof(ctrl_m_pg) - 2);
-#if 0	/*
-	 * See comment in struct scst_device definition.
-	 *
-	 * If enable it, fix the default and saved cases below!
-	 */
-		p[2] |= 7 << 5;		/* TST */
-#endif
-		if (!virt_dev->dev->cluster_mode) {
-			p[2] |= 1 << 2;		/* D_SENSE */
-			p[2] |= 1 << 3;		/* DPICZ */
-			p[2] |= 1 << 4;		/* TMF_ONLY */
-			p[3] |= 0xF << 4;	/* QUEUE ALGORITHM MODIFIER */
-			p[3] |= 3 << 1;		/* QErr */
-			p[4] |= 1 << 3;		/* SWP */
-			p[5] |= 1 << 6;		/* TAS */
-			p[5] |= 0 << 7;		/* ATO */
-		}
-		break;
-	case 2: /* default */
-		p[2] |= virt_dev->tst << 5;
-		p[2] |= virt_dev->dev->d_sense_default << 2;
-		p[2] |= virt_dev->dev->dpicz_default << 3;
-		p[2] |= virt_dev->dev->tmf_only_default << 4;
-		p[3] |= virt_dev->dev->queue_alg_default << 4;
-		p[3] |= virt_dev->dev->qerr_default << 1;
-		p[4] |= virt_dev->dev->swp_default << 3;
-		p[5] |= virt_dev->dev->tas_default << 6;
-		p[5] |= virt_dev->dev->ato << 7;
-		break;
-	case 3: /* saved */
-		p[2] |= virt_dev->dev->tst << 5;
-		p[2] |= virt_dev->dev->d_sense_saved << 2;
-		p[2] |= virt_dev->dev->dpicz_saved << 3;
-		p[2] |= virt_dev->dev->tmf_only_default << 4;
-		p[3] |= virt_dev->dev->queue_alg_saved << 4;
-		p[3] |= virt_dev->dev->qerr_saved << 1;
-		p[4] |= virt_dev->dev->swp_saved << 3;
-		p[5] |= virt_dev->dev->tas_saved << 6;
-		p[5] |= virt_dev->dev->ato << 7;
-		break;
-	default:
-		sBUG();
-	}
-	return sizeof(ctrl_m_pg);
-}
+	TRACE_DBG("Delayed completion of cmd %p", cmd);
 
-static int vdisk_iec_m_pg(unsigned char *p, int pcontrol,
-			   struct scst_vdisk_dev *virt_dev)
-{	/* Informational Exceptions control mode page for mode_sense */
-	const unsigned char iec_m_pg[] = {0x1c, 0xa, 0x08, 0, 0, 0, 0, 0,
-					  0, 0, 0x0, 0x0};
-	memcpy(p, iec_m_pg, sizeof(iec_m_pg));
-	if (pcontrol == 1)
-		memset(p + 2, 0, sizeof(iec_m_pg) - 2);
-	return sizeof(iec_m_pg);
+	/* t is freed by nullio_on_free_cmd() */
+	cmd->completed = 1;
+	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
+		scst_estimate_context());
+	return HRTIMER_NORESTART;
 }
 
-static enum compl_status_e vdisk_exec_mode_sense(struct vdisk_cmd_params *p)
+/*
+ * Called at the end of vdisk_nullio READs, WRITEs and VERIFYs. Returns what
+ * the op function should return.
+ */
+static enum compl_status_e nullio_complete(struct vdisk_cmd_params *p,
+	bool write)
 {
 	struct scst_cmd *cmd = p->cmd;
-	int32_t length;
-	uint8_t *address;
-	uint8_t *buf;
-	struct scst_vdisk_dev *virt_dev;
-	uint32_t blocksize;
-	uint64_t nblocks;
-	unsigned char dbd, type;
-	int pcontrol, pcode, subpcode;
-	unsigned char dev_spec;
-	int msense_6, offset = 0, len;
-	unsigned char *bp;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	unsigned int delay_us = ACCESS_ONCE(virt_dev->nullio_delay_us);
+	unsigned int jitter_us = ACCESS_ONCE(virt_dev->nullio_jitter_us);
+	unsigned int dist = ACCESS_ONCE(virt_dev->nullio_delay_dist);
+	unsigned int bw_mb = ACCESS_ONCE(virt_dev->nullio_bw_mb);
+	unsigned int interval = ACCESS_ONCE(virt_dev->nullio_error_interval);
+	struct vdisk_nullio_timer *t;
+	bool inject = false;
+	u64 now, expires;
 
 	TRACE_ENTRY();
 
-	buf = kzalloc(MSENSE_BUF_SZ, cmd->cmd_gfp_mask);
-	if (buf == NULL) {
-		scst_set_busy(cmd);
-		goto out;
-	}
-
-	virt_dev = cmd->dev->dh_priv;
-	blocksize = cmd->dev->block_size;
-	nblocks = virt_dev->nblocks;
+	if ((delay_us | jitter_us | bw_mb | interval) == 0)
+		goto out_compl;
 
-	type = cmd->dev->type;
-	dbd = cmd->cdb[1] & DBD;
-	pcontrol = (cmd->cdb[2] & 0xc0) >> 6;
-	pcode = cmd->cdb[2] & 0x3f;
-	subpcode = cmd->cdb[3];
-	msense_6 = (cmd->cdb[0] == MODE_SENSE);
-	dev_spec = cmd->tgt_dev->tgt_dev_rd_only ? WP : 0;
+	now = ktime_to_ns(ktime_get());
+	expires = now;
 
-	if (type != TYPE_ROM)
-		dev_spec |= DPOFUA;
+	spin_lock(&virt_dev->nullio_lock);
+	if ((interval != 0) && (++virt_dev->nullio_cmd_cnt >= interval)) {
+		virt_dev->nullio_cmd_cnt = 0;
+		virt_dev->nullio_stats.injected++;
+		inject = true;
+	}
+	if (bw_mb != 0) {
+		/* 1 MB/s is 1 byte per 1000 ns */
+		u64 xfer_ns = (u64)cmd->bufflen * 1000;
 
-	length = scst_get_buf_full_sense(cmd, &address);
-	if (unlikely(length <= 0))
-		goto out_free;
+		do_div(xfer_ns, bw_mb);
+		expires = max(now, virt_dev->nullio_bw_next) + xfer_ns;
+		virt_dev->nullio_bw_next = expires;
+	}
+	expires += (u64)delay_us * NSEC_PER_USEC;
+	if (jitter_us != 0)
+		expires += nullio_jitter(virt_dev, jitter_us, dist) *
+				NSEC_PER_USEC;
+	if (expires > now)
+		virt_dev->nullio_stats.delayed++;
+	spin_unlock(&virt_dev->nullio_lock);
 
-	if (!vdev_saved_mode_pages_enabled && (pcontrol == 0x3)) {
-		TRACE_DBG("%s", "MODE SENSE: Saving values not supported");
-		scst_set_cmd_error(cmd,
-		    SCST_LOAD_SENSE(scst_sense_saving_params_unsup));
-		goto out_put;
+	if (inject) {
+		TRACE_DBG("Injecting error into cmd %p (op %s)", cmd,
+			scst_get_opcode_name(cmd));
+		if (write)
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
+		else
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_read_error));
 	}
 
-	if (msense_6) {
-		buf[1] = type;
-		buf[2] = dev_spec;
-		offset = 4;
-	} else {
-		buf[2] = type;
-		buf[3] = dev_spec;
-		offset = 8;
+	if (expires <= now)
+		goto out_compl;
+
+	t = kmem_cache_alloc(nullio_timer_cachep, cmd->cmd_gfp_mask);
+	if (t == NULL) {
+		TRACE(TRACE_OUT_OF_MEM, "Unable to allocate NULLIO timer, "
+			"completing cmd %p without delay", cmd);
+		goto out_compl;
 	}
 
-	if (subpcode != 0) {
-		/* TODO: Control Extension page */
-		TRACE_DBG("%s", "MODE SENSE: Only subpage 0 is supported");
-		scst_set_invalid_field_in_cdb(cmd, 3, 0);
-		goto out_put;
+	t->cmd = cmd;
+	p->nullio_timer = t;
+	hrtimer_init(&t->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	t->timer.function = nullio_timer_fn;
+	hrtimer_start(&t->timer, ns_to_ktime(expires), HRTIMER_MODE_ABS);
+
+	TRACE_EXIT();
+	return RUNNING_ASYNC;
+
+out_compl:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
+}
+
+static void nullio_on_free_cmd(struct scst_cmd *cmd)
+{
+	struct vdisk_nullio_timer *t = cmd->dh_priv;
+
+	TRACE_ENTRY();
+
+	if (t == NULL)
+		goto out;
+
+	/* The timer callback can still be returning on another CPU */
+	hrtimer_cancel(&t->timer);
+	kmem_cache_free(nullio_timer_cachep, t);
+	cmd->dh_priv = NULL;
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Fills the data buffer of @cmd with the vdisk_nullio data pattern, or checks
+ * it against the pattern, if @check is set. In the pattern each 8 bytes
+ * aligned word contains its own big endian offset on the device. Returns
+ * false, if the check failed.
+ */
+static bool nullio_pattern(struct scst_cmd *cmd, loff_t off, bool check)
+{
+	uint8_t *address;
+	int length, i, n;
+	bool res = true;
+
+	length = scst_get_buf_first(cmd, &address);
+	while (length > 0) {
+		for (i = 0; i < length; i += n, off += n) {
+			__be64 w = cpu_to_be64(off & ~7LL);
+			int o = off & 7;
+
+			n = min(8 - o, length - i);
+			if (!check)
+				memcpy(address + i, (uint8_t *)&w + o, n);
+			else if (memcmp(address + i, (uint8_t *)&w + o, n) != 0) {
+				TRACE_DBG("Pattern mismatch at %lld (cmd %p)",
+					(long long)off, cmd);
+				res = false;
+				break;
+			}
+		}
+		scst_put_buf(cmd, address);
+		if (!res)
+			break;
+		length = scst_get_buf_next(cmd, &address);
 	}
 
-	if (!dbd) {
-		/* Create block descriptor */
-		buf[offset - 1] = 0x08;		/* block descriptor length */
-		put_unaligned_be32(nblocks >> 32 ? 0xffffffffU : nblocks,
-				   &buf[offset]);
-		buf[offset + 4] = 0;			/* density code */
-		put_unaligned_be24(blocksize, &buf[offset + 5]); /* blklen */
+	return res;
+}
 
-		offset += 8;			/* increment offset */
-	}
+/* Checks the data of a vdisk_nullio WRITE against the pattern, if enabled */
+static void nullio_check_pattern(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
 
-	bp = buf + offset;
+	if (!virt_dev->nullio_pattern || nullio_pattern(cmd, p->loff, true))
+		return;
 
-	switch (pcode) {
-	case 0x1:	/* Read-Write error recovery page, direct access */
-		len = vdisk_err_recov_pg(bp, pcontrol, virt_dev);
-		break;
-	case 0x2:	/* Disconnect-Reconnect page, all devices */
-		if (type == TYPE_ROM)
-			goto out_not_sup;
-		len = vdisk_disconnect_pg(bp, pcontrol, virt_dev);
-		break;
-	case 0x3:       /* Format device page, direct access */
-		if (type == TYPE_ROM)
-			goto out_not_sup;
-		len = vdisk_format_pg(bp, pcontrol, virt_dev);
-		break;
-	case 0x4:	/* Rigid disk geometry */
-		if (type == TYPE_ROM)
-			goto out_not_sup;
-		len = vdisk_rigid_geo_pg(bp, pcontrol, virt_dev);
-		break;
-	case 0x8:	/* Caching page, direct access */
-		if (type == TYPE_ROM)
-			goto out_not_sup;
-		len = vdisk_caching_pg(bp, pcontrol, virt_dev);
-		break;
-	case 0xa:	/* Control Mode page, all devices */
-		len = vdisk_ctrl_m_pg(bp, pcontrol, virt_dev);
-		break;
-	case 0x1c:	/* Informational Exceptions Mode page, all devices */
-		len = vdisk_iec_m_pg(bp, pcontrol, virt_dev);
-		break;
-	case 0x3f:	/* Read all Mode pages */
-		if (type == TYPE_ROM) {
-			len = vdisk_err_recov_pg(bp, pcontrol, virt_dev);
-			len += vdisk_ctrl_m_pg(bp + len, pcontrol, virt_dev);
-			len += vdisk_iec_m_pg(bp + len, pcontrol, virt_dev);
-		} else {
-			len = vdisk_err_recov_pg(bp, pcontrol, virt_dev);
-			len += vdisk_disconnect_pg(bp + len, pcontrol, virt_dev);
-			len += vdisk_format_pg(bp + len, pcontrol, virt_dev);
-			len += vdisk_caching_pg(bp + len, pcontrol, virt_dev);
-			len += vdisk_ctrl_m_pg(bp + len, pcontrol, virt_dev);
-			len += vdisk_iec_m_pg(bp + len, pcontrol, virt_dev);
-			len += vdisk_rigid_geo_pg(bp + len, pcontrol, virt_dev);
+	spin_lock(&virt_dev->nullio_lock);
+	virt_dev->nullio_stats.miscompares++;
+	spin_unlock(&virt_dev->nullio_lock);
+
+	scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_miscompare_error));
+	return;
+}
+
+static enum compl_status_e nullio_exec_read(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+
+	TRACE_ENTRY();
+
+	if (virt_dev->nullio_pattern) {
+		nullio_pattern(cmd, p->loff, false);
+	} else if (virt_dev->read_zero) {
+		struct scatterlist *sge;
+		struct page *page;
+		int i;
+		void *p;
+
+		for_each_sg(cmd->sg, sge, cmd->sg_cnt, i) {
+			page = sg_page(sge);
+			p = kmap(page);
+			if (sge->offset == 0 && sge->length == PAGE_SIZE)
+				clear_page(p);
+			else
+				memset(p + sge->offset, 0, sge->length);
+			kunmap(page);
 		}
-		break;
-	default:
-		goto out_not_sup;
 	}
 
-	offset += len;
+	scst_dif_process_read(p->cmd);
 
-	if (msense_6)
-		buf[0] = offset - 1;
-	else
-		put_unaligned_be16(offset - 2, &buf[0]);
+	TRACE_EXIT();
+	return nullio_complete(p, false);
+}
 
-	if (offset > length)
-		offset = length;
-	memcpy(address, buf, offset);
+static enum compl_status_e ramdisk_exec_read(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	loff_t loff = p->loff;
+	uint8_t *address;
+	int length, rc;
 
-out_put:
-	scst_put_buf_full(cmd, address);
-	if (offset < cmd->resp_data_len)
-		scst_set_resp_data_len(cmd, offset);
+	TRACE_ENTRY();
 
-out_free:
-	kfree(buf);
+	/* The data are already in place */
+	if (p->use_zero_copy)
+		goto out;
+
+	length = scst_get_buf_first(cmd, &address);
+	while (length > 0) {
+		rc = vdisk_ramdisk_rw(virt_dev, address, length, loff, false,
+				cmd->cmd_gfp_mask);
+		scst_put_buf(cmd, address);
+		if (unlikely(rc != 0)) {
+			vdisk_ramdisk_set_error(cmd, rc);
+			goto out;
+		}
+		loff += length;
+		length = scst_get_buf_next(cmd, &address);
+	}
+
+	if (unlikely(length < 0)) {
+		PRINT_ERROR("scst_get_buf_() failed: %d", length);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_internal_failure));
+	}
 
 out:
 	TRACE_EXIT();
 	return CMD_SUCCEEDED;
-
-out_not_sup:
-	TRACE(TRACE_MINOR, "MODE SENSE: Unsupported page %x", pcode);
-	scst_set_invalid_field_in_cdb(cmd, 2, SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
-	goto out_put;
 }
 
-static int vdisk_set_wt(struct scst_vdisk_dev *virt_dev, int wt, bool read_only)
+static int vdev_read_dif_tags(struct vdisk_cmd_params *p)
 {
 	int res = 0;
-	struct file *fd, *dif_fd = NULL;
-	bool old_wt = virt_dev->wt_flag;
+	struct scst_cmd *cmd = p->cmd;
+	loff_t loff;
+	mm_segment_t old_fs;
+	loff_t err = 0;
+	ssize_t length, full_len;
+	uint8_t *address;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct file *fd = virt_dev->dif_fd;
+	struct iovec *iv;
+	int iv_count, max_iv_count, i;
+	bool finished = false;
+	int tags_num, l;
+	struct scatterlist *tags_sg;
+	bool free_iv = false;
 
 	TRACE_ENTRY();
 
-	if ((virt_dev->wt_flag == wt) || virt_dev->nullio || virt_dev->nv_cache)
+	/*
+	 * !! Data for this cmd can be read simultaneously !!
+	 */
+
+	EXTRACHECKS_BUG_ON(virt_dev->nullio);
+
+#if 0 /* no zero-copy (yet) */
+	if (p->use_zero_copy)
 		goto out;
+#endif
 
-	spin_lock(&virt_dev->flags_lock);
-	virt_dev->wt_flag = wt;
-	spin_unlock(&virt_dev->flags_lock);
+	EXTRACHECKS_BUG_ON(!(cmd->dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) ||
+	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) == SCST_DIF_ACTION_NONE));
 
-	if (virt_dev->fd == NULL)
+	tags_num = (cmd->bufflen >> cmd->dev->block_shift);
+	if (unlikely(tags_num == 0))
 		goto out;
 
-	/*
-	 * MODE SELECT is strictly serialized command, so it's safe here
-	 * to reopen fd.
-	 */
+	iv = p->iv;
+	if (iv == NULL) {
+		iv = vdisk_alloc_iv(cmd, p);
+		if (iv == NULL) {
+			unsigned long flags;
 
-	fd = vdev_open_fd(virt_dev, virt_dev->filename, read_only);
-	if (IS_ERR(fd)) {
-		res = PTR_ERR(fd);
-		goto out_err;
+			/* To protect sense setting against blockio data reads */
+			spin_lock_irqsave(&vdev_err_lock, flags);
+			scst_set_busy(cmd);
+			spin_unlock_irqrestore(&vdev_err_lock, flags);
+			res = -ENOMEM;
+			goto out;
+		}
+		free_iv = true;
 	}
+	max_iv_count = p->iv_count;
 
-	if (virt_dev->dif_filename != NULL) {
-		dif_fd = vdev_open_fd(virt_dev, virt_dev->dif_filename, read_only);
-		if (IS_ERR(dif_fd)) {
-			res = PTR_ERR(dif_fd);
-			goto out_err_close_fd;
+	old_fs = get_fs();
+	set_fs(get_ds());
+
+	tags_sg = NULL;
+	loff = (p->loff >> cmd->dev->block_shift) << SCST_DIF_TAG_SHIFT;
+	while (1) {
+		iv_count = 0;
+		full_len = 0;
+		i = -1;
+		address = scst_get_dif_buf(cmd, &tags_sg, &l);
+		length = l;
+		EXTRACHECKS_BUG_ON(length <= 0);
+		while (1) {
+			full_len += length;
+			i++;
+			iv_count++;
+			iv[i].iov_base = (uint8_t __force __user *)address;
+			iv[i].iov_len = length;
+			tags_num -= length >> SCST_DIF_TAG_SHIFT;
+			EXTRACHECKS_BUG_ON(tags_num < 0);
+			if ((iv_count == max_iv_count) || (tags_num == 0))
+				break;
+			address = scst_get_dif_buf(cmd, &tags_sg, &l);
+			length = l;
+			EXTRACHECKS_BUG_ON(length <= 0);
 		}
-	}
+		if (tags_num == 0)
+			finished = true;
 
-	filp_close(virt_dev->fd, NULL);
-	if (virt_dev->dif_fd)
-		filp_close(virt_dev->dif_fd, NULL);
+		TRACE_DBG("Reading DIF iv_count %d, full_len %zd, loff %lld",
+			iv_count, full_len, (long long)loff);
 
-	virt_dev->fd = fd;
-	virt_dev->dif_fd = dif_fd;
+		/* READ */
+		err = vfs_readv(fd, (struct iovec __force __user *)iv, iv_count,
+				&loff);
+		if ((err < 0) || (err < full_len)) {
+			unsigned long flags;
+
+			PRINT_ERROR("DIF readv() returned %lld from %zd "
+				"(offs %lld, dev %s)", (long long)err,
+				full_len, (long long)loff, cmd->dev->virt_name);
+			/* To protect sense setting with blockio */
+			spin_lock_irqsave(&vdev_err_lock, flags);
+			if (err == -EAGAIN)
+				scst_set_busy(cmd);
+			else {
+				scst_set_cmd_error(cmd,
+				    SCST_LOAD_SENSE(scst_sense_read_error));
+			}
+			spin_unlock_irqrestore(&vdev_err_lock, flags);
+			res = err;
+			goto out_set_fs;
+		}
+
+		for (i = 0; i < iv_count; i++)
+			scst_put_dif_buf(cmd, (void __force *)(iv[i].iov_base));
+
+		if (finished)
+			break;
+	};
+
+	set_fs(old_fs);
+
+out_free_iv:
+	if (free_iv && (iv != p->small_iv))
+		kfree(p->iv);
 
 out:
 	TRACE_EXIT_RES(res);
 	return res;
 
-out_err_close_fd:
-	filp_close(fd, NULL);
-
-out_err:
-	spin_lock(&virt_dev->flags_lock);
-	virt_dev->wt_flag = old_wt;
-	spin_unlock(&virt_dev->flags_lock);
-	goto out;
+out_set_fs:
+	set_fs(old_fs);
+	for (i = 0; i < iv_count; i++)
+		scst_put_dif_buf(cmd, (void __force *)(iv[i].iov_base));
+	goto out_free_iv;
 }
 
-static void vdisk_ctrl_m_pg_select(unsigned char *p,
-	struct scst_vdisk_dev *virt_dev, struct scst_cmd *cmd, bool save,
-	int param_offset)
+static int vdev_write_dif_tags(struct vdisk_cmd_params *p)
 {
-	struct scst_device *dev = virt_dev->dev;
-	int old_swp = dev->swp, old_tas = dev->tas, old_dsense = dev->d_sense;
-	int old_queue_alg = dev->queue_alg, old_dpicz = dev->dpicz;
-	int rc, old_tmf_only = dev->tmf_only, old_qerr = dev->qerr;
-	int queue_alg, swp, tas, tmf_only, qerr, d_sense, dpicz;
+	int res = 0;
+	struct scst_cmd *cmd = p->cmd;
+	loff_t loff;
+	mm_segment_t old_fs;
+	loff_t err = 0;
+	ssize_t length, full_len;
+	uint8_t *address;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct file *fd = virt_dev->dif_fd;
+	struct iovec *iv, *eiv;
+	int iv_count, eiv_count, max_iv_count, i;
+	bool finished = false;
+	int tags_num, l;
+	struct scatterlist *tags_sg;
+	bool free_iv = false;
 
 	TRACE_ENTRY();
 
-	if (save && !vdev_saved_mode_pages_enabled) {
-		TRACE(TRACE_MINOR|TRACE_SCSI, "MODE SELECT: saved control page "
-			"not supported");
-		scst_set_invalid_field_in_cdb(cmd, 2,
-				SCST_INVAL_FIELD_BIT_OFFS_VALID | 1);
-		goto out;
-	}
-
 	/*
-	 * MODE SELECT is a strictly serialized cmd, so it is safe to
-	 * perform direct assignment here.
+	 * !! Data for this cmd can be written simultaneously !!
 	 */
 
-#if 0 /* Not implemented yet, see comment in struct scst_device */
-	dev->tst = (p[2] >> 5) & 7;
-	/* ToDo: check validity of the new value */
-#else
-	if (dev->tst != ((p[2] >> 5) & 7)) {
-		TRACE(TRACE_MINOR|TRACE_SCSI, "%s", "MODE SELECT: Changing of "
-			"TST not supported");
-		scst_set_invalid_field_in_parm_list(cmd, param_offset + 2,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 5);
+	EXTRACHECKS_BUG_ON(virt_dev->nullio);
+
+#if 0 /* no zero-copy (yet) */
+	if (p->use_zero_copy)
 		goto out;
-	}
 #endif
 
-	queue_alg = p[3] >> 4;
-	if ((queue_alg != SCST_QUEUE_ALG_0_RESTRICTED_REORDER) &&
-	    (queue_alg != SCST_QUEUE_ALG_1_UNRESTRICTED_REORDER)) {
-		PRINT_WARNING("Attempt to set invalid Control mode page QUEUE "
-			"ALGORITHM MODIFIER value %d (initiator %s, dev %s)",
-			queue_alg, cmd->sess->initiator_name, dev->virt_name);
-		scst_set_invalid_field_in_parm_list(cmd, param_offset + 3,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 4);
-		goto out;
-	}
+	EXTRACHECKS_BUG_ON(!(cmd->dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) ||
+	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) == SCST_DIF_ACTION_NONE));
 
-	swp = (p[4] & 0x8) >> 3;
-	if (swp > 1) {
-		PRINT_WARNING("Attempt to set invalid Control mode page SWP "
-			"value %d (initiator %s, dev %s)", swp,
-			cmd->sess->initiator_name, dev->virt_name);
-		scst_set_invalid_field_in_parm_list(cmd, param_offset + 4,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 3);
+	tags_num = (cmd->bufflen >> cmd->dev->block_shift);
+	if (unlikely(tags_num == 0))
 		goto out;
-	}
 
-	tas = (p[5] & 0x40) >> 6;
-	if (tas > 1) {
-		PRINT_WARNING("Attempt to set invalid Control mode page TAS "
-			"value %d (initiator %s, dev %s)", tas,
-			cmd->sess->initiator_name, dev->virt_name);
-		scst_set_invalid_field_in_parm_list(cmd, param_offset + 5,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 6);
-		goto out;
-	}
+	iv = p->iv;
+	if (iv == NULL) {
+		iv = vdisk_alloc_iv(cmd, p);
+		if (iv == NULL) {
+			unsigned long flags;
 
-	tmf_only = (p[2] & 0x10) >> 4;
-	if (tmf_only > 1) {
-		PRINT_WARNING("Attempt to set invalid Control mode page "
-			"TMF_ONLY value %d (initiator %s, dev %s)", tmf_only,
-			cmd->sess->initiator_name, dev->virt_name);
-		scst_set_invalid_field_in_parm_list(cmd, param_offset + 2,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 4);
-		goto out;
+			/* To protect sense setting against blockio data writes */
+			spin_lock_irqsave(&vdev_err_lock, flags);
+			scst_set_busy(cmd);
+			spin_unlock_irqrestore(&vdev_err_lock, flags);
+			res = -ENOMEM;
+			goto out;
+		}
+		free_iv = true;
 	}
+	max_iv_count = p->iv_count;
 
-	dpicz = (p[2] & 0x8) >> 3;
-	if (dpicz > 1) {
-		PRINT_WARNING("Attempt to set invalid Control mode page "
-			"dpicz value %d (initiator %s, dev %s)", dpicz,
-			cmd->sess->initiator_name, dev->virt_name);
-		scst_set_invalid_field_in_parm_list(cmd, param_offset + 2,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 3);
-		goto out;
-	}
+	old_fs = get_fs();
+	set_fs(get_ds());
 
-	qerr = (p[3] & 0x6) >> 1;
-	if ((qerr == SCST_QERR_2_RESERVED) ||
-	    (qerr > SCST_QERR_3_ABORT_THIS_NEXUS_ONLY)) {
-		PRINT_WARNING("Attempt to set invalid Control mode page QErr "
-			"value %d (initiator %s, dev %s)", qerr,
-			cmd->sess->initiator_name, dev->virt_name);
-		scst_set_invalid_field_in_parm_list(cmd, param_offset + 3,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 1);
-		goto out;
-	}
+	tags_sg = NULL;
+	loff = (p->loff >> cmd->dev->block_shift) << SCST_DIF_TAG_SHIFT;
+	while (1) {
+		iv_count = 0;
+		full_len = 0;
+		i = -1;
+		address = scst_get_dif_buf(cmd, &tags_sg, &l);
+		length = l;
+		EXTRACHECKS_BUG_ON(length <= 0);
+		while (1) {
+			full_len += length;
+			i++;
+			iv_count++;
+			iv[i].iov_base = (uint8_t __force __user *)address;
+			iv[i].iov_len = length;
+			tags_num -= length >> SCST_DIF_TAG_SHIFT;
+			EXTRACHECKS_BUG_ON(tags_num < 0);
+			if ((iv_count == max_iv_count) || (tags_num == 0))
+				break;
+			address = scst_get_dif_buf(cmd, &tags_sg, &l);
+			length = l;
+			EXTRACHECKS_BUG_ON(length <= 0);
+		}
+		if (tags_num == 0)
+			finished = true;
 
-	d_sense = (p[2] & 0x4) >> 2;
-	if (d_sense > 1) {
-		PRINT_WARNING("Attempt to set invalid Control mode page D_SENSE "
-			"value %d (initiator %s, dev %s)", d_sense,
-			cmd->sess->initiator_name, dev->virt_name);
-		scst_set_invalid_field_in_parm_list(cmd, param_offset + 2,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 2);
-		goto out;
-	}
+		eiv = iv;
+		eiv_count = iv_count;
+restart:
+		TRACE_DBG("Writing DIF: eiv_count %d, full_len %zd", eiv_count, full_len);
 
-	dev->queue_alg = queue_alg;
-	dev->swp = swp;
-	dev->tas = tas;
-	dev->tmf_only = tmf_only;
-	dev->dpicz = dpicz;
-	dev->qerr = qerr;
-	dev->d_sense = d_sense;
+		/* WRITE */
+		err = vfs_writev(fd, (struct iovec __force __user *)eiv, eiv_count,
+				 &loff);
+		if (err < 0) {
+			unsigned long flags;
+
+			PRINT_ERROR("DIF write() returned %lld from %zd",
+				(long long)err, full_len);
+			/* To protect sense setting with blockio */
+			spin_lock_irqsave(&vdev_err_lock, flags);
+			if (err == -EAGAIN)
+				scst_set_busy(cmd);
+			else {
+				scst_set_cmd_error(cmd,
+				    SCST_LOAD_SENSE(scst_sense_write_error));
+			}
+			spin_unlock_irqrestore(&vdev_err_lock, flags);
+			res = err;
+			goto out_set_fs;
+		} else if (err < full_len) {
+			/*
+			 * Probably that's wrong, but sometimes write() returns
+			 * value less, than requested. Let's restart.
+			 */
+			int e = eiv_count;
+
+			TRACE_MGMT_DBG("DIF write() returned %d from %zd "
+				"(iv_count=%d)", (int)err, full_len,
+				eiv_count);
+			if (err == 0) {
+				PRINT_INFO("Suspicious: DIF write() returned 0 from "
+					"%zd (iv_count=%d)", full_len, eiv_count);
+			}
+			full_len -= err;
+			for (i = 0; i < e; i++) {
+				if ((long long)eiv->iov_len < err) {
+					err -= eiv->iov_len;
+					eiv++;
+					eiv_count--;
+				} else {
+					eiv->iov_base =
+					    (uint8_t __force __user *)eiv->iov_base + err;
+					eiv->iov_len -= err;
+					break;
+				}
+			}
+			goto restart;
+		}
+
+		for (i = 0; i < iv_count; i++)
+			scst_put_dif_buf(cmd, (void __force *)(iv[i].iov_base));
+
+		if (finished)
+			break;
+	};
+
+	set_fs(old_fs);
+
+out_free_iv:
+	if (free_iv && (iv != p->small_iv))
+		kfree(iv);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_set_fs:
+	set_fs(old_fs);
+	for (i = 0; i < iv_count; i++)
+		scst_put_dif_buf(cmd, (void __force *)(iv[i].iov_base));
+	goto out_free_iv;
+}
 
-	if ((dev->swp == old_swp) && (dev->tas == old_tas) &&
-	    (dev->d_sense == old_dsense) && (dev->queue_alg == old_queue_alg) &&
-	    (dev->qerr == old_qerr) && (dev->tmf_only == old_tmf_only) &&
-	    (dev->dpicz == old_dpicz))
-		goto out;
+static enum compl_status_e blockio_exec_read(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	/* cmd can be already dead after blockio_exec_rw() */
+	loff_t loff = p->loff;
+	unsigned int len = cmd->bufflen;
 
-	if (!save)
-		goto out_ok;
+	if (p->ra_ext != NULL) {
+		struct vdisk_ra_extent *ext;
 
-	rc = vdev_save_mode_pages(virt_dev);
-	if (rc != 0) {
-		dev->swp = old_swp;
-		dev->tas = old_tas;
-		dev->d_sense = old_dsense;
-		dev->queue_alg = old_queue_alg;
-		dev->tmf_only = old_tmf_only;
-		dev->qerr = old_qerr;
-		dev->dpicz = old_dpicz;
-		/* Hopefully, the error is temporary */
-		scst_set_busy(cmd);
-		goto out;
+		if (likely(!vdisk_ra_extent_stale(p->ra_ext))) {
+			/* The data are already in the sg vector */
+			vdisk_ra_read(virt_dev, loff, len, true);
+			return CMD_SUCCEEDED;
+		}
+		/*
+		 * A WRITE invalidated the extent after the buffer was
+		 * allocated. Other READs can still be sending its pages, so
+		 * reread the data into pages of a new extent.
+		 */
+		TRACE_DBG("Readahead extent %p of cmd %p is stale", p->ra_ext,
+			cmd);
+		ext = vdisk_ra_rebind(cmd, p->ra_ext);
+		if (ext == NULL) {
+			scst_set_busy(cmd);
+			return CMD_SUCCEEDED;
+		}
+		p->ra_ext = ext;
 	}
 
-	dev->swp_saved = dev->swp;
-	dev->tas_saved = dev->tas;
-	dev->d_sense_saved = dev->d_sense;
-	dev->queue_alg_saved = dev->queue_alg;
-	dev->tmf_only_saved = dev->tmf_only;
-	dev->qerr_saved = dev->qerr;
-	dev->dpicz_saved = dev->dpicz;
+	blockio_exec_rw(p, false, false);
 
-out_ok:
-	PRINT_INFO("Device %s: new control mode page parameters: SWP %x "
-		"(was %x), TAS %x (was %x), TMF_ONLY %d (was %x), QErr %x "
-		"(was %x), D_SENSE %d (was %d), QUEUE ALG %d (was %d), "
-		"DPICZ %d (was %d)", virt_dev->name, dev->swp, old_swp,
-		dev->tas, old_tas, dev->tmf_only, old_tmf_only, dev->qerr,
-		old_qerr, dev->d_sense, old_dsense, dev->queue_alg,
-		old_queue_alg, dev->dpicz, old_dpicz);
+	if (virt_dev->ra != NULL)
+		vdisk_ra_read(virt_dev, loff, len, false);
 
-out:
-	TRACE_EXIT();
-	return;
+	return RUNNING_ASYNC;
 }
 
-static void vdisk_caching_m_pg_select(unsigned char *p,
-	struct scst_vdisk_dev *virt_dev, struct scst_cmd *cmd, bool save,
-	bool read_only)
+static enum compl_status_e fileio_exec_read(struct vdisk_cmd_params *p)
 {
-	int old_wt = virt_dev->wt_flag, new_wt, rc;
+	struct scst_cmd *cmd = p->cmd;
+	loff_t loff = p->loff;
+	mm_segment_t old_fs;
+	loff_t err = 0;
+	ssize_t length, full_len;
+	uint8_t __user *address;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	struct file *fd = virt_dev->fd;
+	struct iovec *iv;
+	int iv_count, i, max_iv_count;
+	bool finished = false;
 
 	TRACE_ENTRY();
 
-	if (save && (!vdev_saved_mode_pages_enabled || virt_dev->nv_cache)) {
-		TRACE(TRACE_MINOR|TRACE_SCSI, "MODE SELECT: saved cache page "
-			"not supported");
-		scst_set_invalid_field_in_cdb(cmd, 1,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
-		goto out;
-	}
+	EXTRACHECKS_BUG_ON(virt_dev->nullio);
 
-	new_wt = (p[2] & WCE) ? 0 : 1;
+	if (p->use_zero_copy)
+		goto out_dif;
 
-	if (new_wt == old_wt)
-		goto out;
+	if (virt_dev->cow) {
+		if (vdisk_cow_exec_rw(p, false) != 0)
+			goto out;
+		goto read_dif_tags;
+	}
 
-	if (vdisk_set_wt(virt_dev, new_wt, read_only) != 0) {
-		scst_set_busy(cmd);
-		goto out;
+	if (virt_dev->cache != NULL) {
+		if (vdisk_cache_exec_rw(p, false) != 0)
+			goto out;
+		goto read_dif_tags;
 	}
 
-	if (!save)
-		goto out_ok;
+	iv = vdisk_alloc_iv(cmd, p);
+	if (iv == NULL)
+		goto out_nomem;
 
-	rc = vdev_save_mode_pages(virt_dev);
-	if (rc != 0) {
-		vdisk_set_wt(virt_dev, old_wt, read_only);
-		/* Hopefully, the error is temporary */
-		scst_set_busy(cmd);
+	max_iv_count = p->iv_count;
+
+	length = scst_get_buf_first(cmd, (uint8_t __force **)&address);
+	if (unlikely(length < 0)) {
+		PRINT_ERROR("scst_get_buf_first() failed: %zd", length);
+		scst_set_cmd_error(cmd,
+		    SCST_LOAD_SENSE(scst_sense_internal_failure));
 		goto out;
 	}
 
-	virt_dev->wt_flag_saved = virt_dev->wt_flag;
+	old_fs = get_fs();
+	set_fs(get_ds());
 
-out_ok:
-	PRINT_INFO("Device %s: new wt_flag: %x (was %x)", virt_dev->name,
-		virt_dev->wt_flag, old_wt);
+	while (1) {
+		iv_count = 0;
+		full_len = 0;
+		i = -1;
+		while (length > 0) {
+			full_len += length;
+			i++;
+			iv_count++;
+			iv[i].iov_base = address;
+			iv[i].iov_len = length;
+			if (iv_count == max_iv_count)
+				break;
+			length = scst_get_buf_next(cmd,
+				(uint8_t __force **)&address);
+		}
+		if (length == 0) {
+			finished = true;
+			if (unlikely(iv_count == 0))
+				break;
+		} else if (unlikely(length < 0)) {
+			PRINT_ERROR("scst_get_buf_next() failed: %zd", length);
+			scst_set_cmd_error(cmd,
+			    SCST_LOAD_SENSE(scst_sense_internal_failure));
+			goto out_set_fs;
+		}
 
-out:
-	TRACE_EXIT();
-	return;
-}
+		TRACE_DBG("Reading iv_count %d, full_len %zd", iv_count, full_len);
 
-static enum compl_status_e vdisk_exec_mode_select(struct vdisk_cmd_params *p)
-{
-	struct scst_cmd *cmd = p->cmd;
-	int32_t length;
-	uint8_t *address;
-	struct scst_vdisk_dev *virt_dev;
-	int mselect_6, offset, bdl, type;
+		/* READ */
+		err = vfs_readv(fd, (struct iovec __force __user *)iv, iv_count,
+				&loff);
+		if ((err < 0) || (err < full_len)) {
+			PRINT_ERROR("readv() returned %lld from %zd",
+				    (unsigned long long int)err,
+				    full_len);
+			if (err == -EAGAIN)
+				scst_set_busy(cmd);
+			else {
+				scst_set_cmd_error(cmd,
+				    SCST_LOAD_SENSE(scst_sense_read_error));
+			}
+			goto out_set_fs;
+		}
 
-	TRACE_ENTRY();
+		for (i = 0; i < iv_count; i++)
+			scst_put_buf(cmd, (void __force *)(iv[i].iov_base));
 
-	virt_dev = cmd->dev->dh_priv;
-	if (cmd->dev->cluster_mode) {
-		PRINT_ERROR("MODE SELECT: not supported in cluster mode\n");
-		scst_set_cmd_error(cmd,
-			SCST_LOAD_SENSE(scst_sense_invalid_field_in_cdb));
-		goto out;
-	}
+		if (finished)
+			break;
 
-	mselect_6 = (cmd->cdb[0] == MODE_SELECT);
-	type = cmd->dev->type;
+		length = scst_get_buf_next(cmd, (uint8_t __force **)&address);
+	};
 
-	length = scst_get_buf_full_sense(cmd, &address);
-	if (unlikely(length <= 0))
-		goto out;
+	set_fs(old_fs);
 
-	if (!(cmd->cdb[1] & PF)) {
-		TRACE(TRACE_MINOR|TRACE_SCSI, "MODE SELECT: Unsupported "
-			"PF bit zero (cdb[1]=%x)", cmd->cdb[1]);
-		scst_set_invalid_field_in_cdb(cmd, 1, 0);
-		goto out_put;
+read_dif_tags:
+	if ((dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) &&
+	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) != SCST_DIF_ACTION_NONE)) {
+		err = vdev_read_dif_tags(p);
+		if (err != 0)
+			goto out;
 	}
 
-	if (mselect_6) {
-		bdl = address[3];
-		offset = 4;
-	} else {
-		bdl = get_unaligned_be16(&address[6]);
-		offset = 8;
-	}
+out_dif:
+	scst_dif_process_read(cmd);
 
-	if (bdl == 8)
-		offset += 8;
-	else if (bdl != 0) {
-		PRINT_ERROR("%s", "MODE SELECT: Wrong parameters list length");
-		scst_set_invalid_field_in_parm_list(cmd, offset-1, 0);
-		goto out_put;
-	}
+out:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
 
-	while (length > offset + 2) {
-		if (address[offset] & PS) {
-			PRINT_ERROR("%s", "MODE SELECT: Illegal PS bit");
-			scst_set_invalid_field_in_parm_list(cmd, offset,
-				SCST_INVAL_FIELD_BIT_OFFS_VALID | 7);
-			goto out_put;
-		}
-		if (((address[offset] & 0x3f) == 0x8) && (type != TYPE_ROM)) {
-			/* Caching page */
-			if (address[offset + 1] != 18) {
-				PRINT_ERROR("%s", "MODE SELECT: Invalid "
-					"caching page request");
-				scst_set_invalid_field_in_parm_list(cmd, offset+1, 0);
-				goto out_put;
-			}
-			vdisk_caching_m_pg_select(&address[offset], virt_dev,
-				cmd, cmd->cdb[1] & SP, cmd->tgt_dev->tgt_dev_rd_only);
-			break;
-		} else if ((address[offset] & 0x3f) == 0xA) {
-			/* Control page */
-			if (address[offset + 1] != 0xA) {
-				PRINT_ERROR("%s", "MODE SELECT: Invalid "
-					"control page request");
-				scst_set_invalid_field_in_parm_list(cmd, offset+1, 0);
-				goto out_put;
-			}
-			vdisk_ctrl_m_pg_select(&address[offset], virt_dev, cmd,
-				cmd->cdb[1] & SP, offset);
-		} else {
-			TRACE(TRACE_MINOR, "MODE SELECT: Invalid request %x",
-				address[offset] & 0x3f);
-			scst_set_invalid_field_in_parm_list(cmd, offset,
-				SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
-			goto out_put;
-		}
-		offset += address[offset + 1];
-	}
+out_set_fs:
+	set_fs(old_fs);
+	for (i = 0; i < iv_count; i++)
+		scst_put_buf(cmd, (void __force *)(iv[i].iov_base));
+	goto out;
 
-out_put:
-	scst_put_buf_full(cmd, address);
+out_nomem:
+	scst_set_busy(cmd);
+	err = 0;
+	goto out;
+}
 
-out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+static enum compl_status_e nullio_exec_write(struct vdisk_cmd_params *p)
+{
+	if (scst_dif_process_write(p->cmd) == 0)
+		nullio_check_pattern(p);
+	return nullio_complete(p, true);
 }
 
-static enum compl_status_e vdisk_exec_log(struct vdisk_cmd_params *p)
+static enum compl_status_e ramdisk_exec_write(struct vdisk_cmd_params *p)
 {
 	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	loff_t loff = p->loff;
+	uint8_t *address;
+	int length, rc;
 
 	TRACE_ENTRY();
 
-	/* No log pages are supported */
-	scst_set_invalid_field_in_cdb(cmd, 2, SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
+	/* FUA and write through are no-ops: there is no cache to flush */
+	length = scst_get_buf_first(cmd, &address);
+	while (length > 0) {
+		rc = vdisk_ramdisk_rw(virt_dev, address, length, loff, true,
+				cmd->cmd_gfp_mask);
+		scst_put_buf(cmd, address);
+		if (unlikely(rc != 0)) {
+			PRINT_WARNING("Unable to allocate memory for RAM disk "
+				"%s: %d", virt_dev->name, rc);
+			vdisk_ramdisk_set_error(cmd, rc);
+			goto out;
+		}
+		loff += length;
+		length = scst_get_buf_next(cmd, &address);
+	}
+
+	if (unlikely(length < 0)) {
+		PRINT_ERROR("scst_get_buf_() failed: %d", length);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_internal_failure));
+	}
 
+out:
 	TRACE_EXIT();
 	return CMD_SUCCEEDED;
 }
 
-static enum compl_status_e vdisk_exec_read_capacity(struct vdisk_cmd_params *p)
+static enum compl_status_e blockio_exec_write(struct vdisk_cmd_params *p)
 {
 	struct scst_cmd *cmd = p->cmd;
-	int32_t length;
-	uint8_t *address;
-	struct scst_vdisk_dev *virt_dev;
-	uint32_t blocksize;
-	uint64_t nblocks;
-	uint8_t buffer[8];
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	struct vdisk_zero_map zero_map;
+	int res, rc;
 
 	TRACE_ENTRY();
 
-	virt_dev = cmd->dev->dh_priv;
-	blocksize = cmd->dev->block_size;
-	nblocks = virt_dev->nblocks;
-
-	if ((cmd->cdb[8] & 1) == 0) {
-		uint32_t lba = get_unaligned_be32(&cmd->cdb[2]);
+	rc = scst_dif_process_write(cmd);
+	if (unlikely(rc != 0)) {
+		res = CMD_SUCCEEDED;
+		goto out;
+	}
 
-		if (lba != 0) {
-			TRACE_DBG("PMI zero and LBA not zero (cmd %p)", cmd);
-			scst_set_invalid_field_in_cdb(cmd, 2, 0);
+	rc = vdisk_zero_detect(p, &zero_map);
+	if (rc != 0) {
+		res = CMD_SUCCEEDED;
+		if (rc < 0)
+			goto out;
+		if (zero_map.cnt == rc) {
+			/* Everything is deallocated */
+			kfree(zero_map.bits);
 			goto out;
 		}
+		p->zero_map = &zero_map;
 	}
 
-	memset(buffer, 0, sizeof(buffer));
-
-	/* Last block on the virt_dev is (nblocks-1) */
-#if 0 /* we don't need this workaround anymore */
-	/*
-	 * If we are thinly provisioned, we must ensure that the initiator
-	 * issues a READ_CAPACITY(16) so we can return the LBPME bit. By
-	 * returning 0xFFFFFFFF we do that.
-	 */
-	put_unaligned_be32(nblocks >> 32 || virt_dev->thin_provisioned ?
-			   0xffffffffU : nblocks - 1, &buffer[0]);
-#else
-	put_unaligned_be32((nblocks >> 32) ? 0xffffffffU : nblocks - 1, &buffer[0]);
-#endif
-
-	put_unaligned_be32(blocksize, &buffer[4]);
+	blockio_exec_rw(p, true, p->fua || virt_dev->wt_flag);
+	res = RUNNING_ASYNC;
 
-	length = scst_get_buf_full_sense(cmd, &address);
-	if (unlikely(length <= 0))
-		goto out;
+	if (rc > 0) {
+		p->zero_map = NULL;
+		kfree(zero_map.bits);
+	}
 
-	length = min_t(int, length, sizeof(buffer));
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
 
-	memcpy(address, buffer, length);
+static enum compl_status_e blockio_exec_var_len_cmd(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	int res;
 
-	scst_put_buf_full(cmd, address);
+	TRACE_ENTRY();
 
-	if (length < cmd->resp_data_len)
-		scst_set_resp_data_len(cmd, length);
+	res = blockio_var_len_ops[cmd->cdb[9]](p);
 
-out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	TRACE_EXIT_RES(res);
+	return res;
 }
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 31)
-/*
- * See also patch "block: Export I/O topology for block devices and partitions"
- * (commit ID c72758f33784).
- */
-static inline unsigned int queue_physical_block_size(struct request_queue *q)
+static enum compl_status_e nullio_exec_var_len_cmd(struct vdisk_cmd_params *p)
 {
-	return 4096;
+	struct scst_cmd *cmd = p->cmd;
+	int res;
+
+	TRACE_ENTRY();
+
+	res = nullio_var_len_ops[cmd->cdb[9]](p);
+
+	TRACE_EXIT_RES(res);
+	return res;
 }
-#endif
 
-static enum compl_status_e vdisk_exec_read_capacity16(struct vdisk_cmd_params *p)
+static enum compl_status_e ramdisk_exec_var_len_cmd(struct vdisk_cmd_params *p)
 {
 	struct scst_cmd *cmd = p->cmd;
-	int32_t length;
-	uint8_t *address;
-	struct scst_vdisk_dev *virt_dev;
-	struct block_device *bdev;
-	struct request_queue *q;
-	uint32_t blocksize, physical_blocksize;
-	uint64_t nblocks;
-	uint8_t buffer[32];
+	int res;
 
 	TRACE_ENTRY();
 
-	virt_dev = cmd->dev->dh_priv;
-	bdev = virt_dev->bdev;
-	q = bdev ? bdev_get_queue(bdev) : NULL;
-	blocksize = cmd->dev->block_size;
-	nblocks = virt_dev->nblocks - 1;
-
-	if ((cmd->cdb[14] & 1) == 0) {
-		uint32_t lba = get_unaligned_be32(&cmd->cdb[2]);
+	res = ramdisk_var_len_ops[cmd->cdb[9]](p);
 
-		if (lba != 0) {
-			TRACE_DBG("PMI zero and LBA not zero (cmd %p)", cmd);
-			scst_set_invalid_field_in_cdb(cmd, 2, 0);
-			goto out;
-		}
-	}
+	TRACE_EXIT_RES(res);
+	return res;
+}
 
-	memset(buffer, 0, sizeof(buffer));
+static enum compl_status_e fileio_exec_var_len_cmd(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	int res;
 
-	put_unaligned_be64(nblocks, &buffer[0]);
-	put_unaligned_be32(blocksize, &buffer[8]);
+	TRACE_ENTRY();
 
-	if (cmd->dev->dev_dif_mode != SCST_DIF_MODE_NONE) {
-		switch (cmd->dev->dev_dif_type) {
-		case 1:
-			buffer[12] = 1;
-			break;
-		case 2:
-			buffer[12] = 3;
-			break;
-		case 3:
-			buffer[12] = 5;
-			break;
-		default:
-			sBUG_ON(1);
-			break;
-		}
-	}
+	res = fileio_var_len_ops[cmd->cdb[9]](p);
 
-	/* LOGICAL BLOCKS PER PHYSICAL BLOCK EXPONENT */
-	physical_blocksize = q ? queue_physical_block_size(q) : 4096;
-	buffer[13] = max(ilog2(physical_blocksize) - ilog2(blocksize), 0);
+	TRACE_EXIT_RES(res);
+	return res;
+}
 
-	if (virt_dev->thin_provisioned) {
-		buffer[14] |= 0x80;     /* LBPME */
-		if (virt_dev->discard_zeroes_data)
-			buffer[14] |= 0x40;     /* LBPRZ */
-	}
+/*
+ * Zero detection. On thin provisioned devices with zero_detect set, the
+ * granules of WRITEs containing only zeroes are deallocated instead of
+ * written. Granules are aligned on the device and at least a page large.
+ */
+struct vdisk_zero_map {
+	unsigned long *bits;	/* set for the deallocated granules */
+	int shift;
+	u64 first;		/* number of the first granule on the device */
+	unsigned int cnt;
+};
 
-	length = scst_get_buf_full_sense(cmd, &address);
-	if (unlikely(length <= 0))
-		goto out;
+/* Returns granule shift for zero detection or 0, if it isn't possible */
+static int vdisk_zero_detect_shift(const struct scst_vdisk_dev *virt_dev)
+{
+	unsigned long gran;
 
-	length = min_t(int, length, sizeof(buffer));
+	if (!virt_dev->zero_detect || !virt_dev->thin_provisioned ||
+	    (virt_dev->unmap_align != 0))
+		return 0;
 
-	memcpy(address, buffer, length);
+	if (virt_dev->blockio) {
+		/* Reads of discarded blocks must return zeroes */
+		if (!virt_dev->discard_zeroes_data || virt_dev->blk_integrity)
+			return 0;
+	} else if (virt_dev->nullio || virt_dev->cow ||
+		   (virt_dev->cache != NULL)) {
+		return 0;
+	}
+
+	gran = max_t(unsigned long, PAGE_SIZE,
+		(unsigned long)virt_dev->unmap_opt_gran <<
+			virt_dev->dev->block_shift);
+	return ilog2(roundup_pow_of_two(gran));
+}
 
-	scst_put_buf_full(cmd, address);
+/*
+ * Returns true if @len bytes at @buf are zero. The kernel can't use SIMD
+ * registers without saving the FPU state, so compares 8 words per
+ * iteration instead.
+ */
+static bool vdisk_is_zero(const void *buf, size_t len)
+{
+	const unsigned long *w = buf;
+	const u8 *b;
 
-	if (length < cmd->resp_data_len)
-		scst_set_resp_data_len(cmd, length);
+	if (((unsigned long)buf & (sizeof(*w) - 1)) == 0) {
+		for (; len >= 8 * sizeof(*w); len -= 8 * sizeof(*w), w += 8) {
+			if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7])
+				return false;
+		}
+		for (; len >= sizeof(*w); len -= sizeof(*w), w++) {
+			if (*w != 0)
+				return false;
+		}
+	}
 
-out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	for (b = (const u8 *)w; len > 0; len--, b++) {
+		if (*b != 0)
+			return false;
+	}
+	return true;
 }
 
-static enum compl_status_e vdisk_exec_get_lba_status(struct vdisk_cmd_params *p)
+static bool vdisk_zero_map_test(const struct vdisk_zero_map *map, loff_t off)
 {
-	/* Changing it don't forget to add it to vdisk_opcode_descriptors! */
-	scst_set_invalid_field_in_cdb(p->cmd, 1,
-			0 | SCST_INVAL_FIELD_BIT_OFFS_VALID);
-	return CMD_SUCCEEDED;
+	u64 i = (off >> map->shift) - map->first;
+
+	return (i < map->cnt) && test_bit(i, map->bits);
 }
 
-/* SPC-4 REPORT TARGET PORT GROUPS command */
-static enum compl_status_e vdisk_exec_report_tpgs(struct vdisk_cmd_params *p)
+/*
+ * Finds the zero granules of WRITE @p, deallocates them and fills @map.
+ * Returns the number of deallocated granules, 0 if there are none, or
+ * negative error code with sense set. If the result is positive, the caller
+ * must write the rest of the data and kfree(map->bits).
+ */
+static int vdisk_zero_detect(struct vdisk_cmd_params *p,
+	struct vdisk_zero_map *map)
 {
 	struct scst_cmd *cmd = p->cmd;
-	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	int block_shift = cmd->dev->block_shift;
+	loff_t off = p->loff, len = scst_cmd_get_data_len(cmd);
+	unsigned int i, run, zero_cnt = 0;
 	uint8_t *address;
-	void *buf;
-	int32_t buf_len;
-	uint32_t data_length, length;
-	uint8_t data_format;
-	int res;
+	int length, res = 0;
+	bool zero = true;
 
 	TRACE_ENTRY();
 
-	buf_len = scst_get_buf_full_sense(cmd, &address);
-	if (buf_len <= 0)
+	map->shift = vdisk_zero_detect_shift(virt_dev);
+	if ((map->shift == 0) || (len < (1 << map->shift)))
 		goto out;
 
-	dev = cmd->dev;
-	data_format = cmd->cdb[1] >> 5;
-
-	res = scst_tg_get_group_info(&buf, &data_length, dev, data_format);
-	if (res == -ENOMEM) {
-		scst_set_busy(cmd);
-		goto out_put;
-	} else if (res < 0) {
-		scst_set_cmd_error(cmd,
-			SCST_LOAD_SENSE(scst_sense_invalid_field_in_cdb));
-		goto out_put;
-	}
-
-	length = min_t(uint32_t, data_length, buf_len);
-	memcpy(address, buf, length);
-	kfree(buf);
-	if (length < cmd->resp_data_len)
-		scst_set_resp_data_len(cmd, length);
-
-out_put:
-	scst_put_buf_full(cmd, address);
-
-out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
-}
+	map->first = off >> map->shift;
+	map->cnt = ((off + len - 1) >> map->shift) - map->first + 1;
+	map->bits = kzalloc(BITS_TO_LONGS(map->cnt) * sizeof(long),
+			cmd->cmd_gfp_mask);
+	if (map->bits == NULL)
+		goto out;
 
-/* SPC-4 SET TARGET PORT GROUPS command */
-static enum compl_status_e vdisk_exec_set_tpgs(struct vdisk_cmd_params *p)
-{
-	struct scst_cmd *cmd = p->cmd;
-	struct scst_device *dev = cmd->dev;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
-	int res = CMD_SUCCEEDED, rc;
+	length = scst_get_buf_first(cmd, &address);
+	while (length > 0) {
+		uint8_t *a = address;
+		int left = length;
+
+		while (left > 0) {
+			loff_t end = ((off >> map->shift) + 1) << map->shift;
+			int n = min_t(loff_t, left, end - off);
+
+			/* Nothing to check once a non-zero byte is found */
+			if (zero)
+				zero = vdisk_is_zero(a, n);
+			a += n;
+			off += n;
+			left -= n;
+			if (off != end)
+				continue;
+			/* The first granule can be only partially written */
+			if (zero && (end - (1 << map->shift) >= p->loff)) {
+				__set_bit((off >> map->shift) - 1 - map->first,
+					map->bits);
+				zero_cnt++;
+			}
+			zero = true;
+		}
 
-	TRACE_ENTRY();
+		scst_put_buf(cmd, address);
+		length = scst_get_buf_next(cmd, &address);
+	}
+	if (unlikely(length < 0) || (zero_cnt == 0))
+		goto out_free;
 
-	if (!virt_dev->expl_alua) {
-		PRINT_ERROR("SET TARGET PORT GROUPS: not explicit ALUA mode "
-			"(dev %s)", dev->virt_name);
-		/* Invalid opcode, i.e. SA field */
-		scst_set_invalid_field_in_cdb(cmd, 1,
-			0 | SCST_INVAL_FIELD_BIT_OFFS_VALID);
-		goto out;
+	/* Deallocates the runs of zero granules */
+	for (i = find_first_bit(map->bits, map->cnt); i < map->cnt;
+	     i = find_next_bit(map->bits, map->cnt, i + run)) {
+		run = find_next_zero_bit(map->bits, map->cnt, i) - i;
+		res = vdisk_unmap_range(cmd, virt_dev,
+			(map->first + i) << (map->shift - block_shift),
+			run << (map->shift - block_shift));
+		if (res != 0)
+			goto out_free;
 	}
 
-	rc = scst_tg_set_group_info(cmd);
-	if (rc == 0)
-		res = RUNNING_ASYNC;
-	else
-		scst_stpg_del_unblock_next(cmd);
+	spin_lock(&virt_dev->flags_lock);
+	virt_dev->zero_bytes_saved += (u64)zero_cnt << map->shift;
+	spin_unlock(&virt_dev->flags_lock);
+
+	TRACE_DBG("Deallocated %u zero granules of cmd %p", zero_cnt, cmd);
+	res = zero_cnt;
 
 out:
 	TRACE_EXIT_RES(res);
 	return res;
+
+out_free:
+	kfree(map->bits);
+	map->bits = NULL;
+	goto out;
 }
 
-static enum compl_status_e vdisk_exec_read_toc(struct vdisk_cmd_params *p)
+/*
+ * Writes the not deallocated data of WRITE @p to a plain file. Returns 0
+ * on success or error code with sense set.
+ */
+static int fileio_write_nonzero(struct vdisk_cmd_params *p,
+	const struct vdisk_zero_map *map)
 {
 	struct scst_cmd *cmd = p->cmd;
-	int32_t length, off = 0;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	loff_t off = p->loff;
 	uint8_t *address;
-	struct scst_vdisk_dev *virt_dev;
-	uint32_t nblocks;
-	uint8_t buffer[4+8+8] = { 0x00, 0x0a, 0x01, 0x01, 0x00, 0x14,
-				  0x01, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	int length, res = 0;
 
 	TRACE_ENTRY();
 
-	if (cmd->dev->type != TYPE_ROM) {
-		PRINT_ERROR("%s", "READ TOC for non-CDROM device");
-		scst_set_cmd_error(cmd,
-			SCST_LOAD_SENSE(scst_sense_invalid_opcode));
-		goto out;
-	}
+	length = scst_get_buf_first(cmd, &address);
+	while (length > 0) {
+		uint8_t *a = address, *start = NULL;
+		loff_t start_off = 0;
+		int left = length;
+
+		/* Contiguous not zero pieces are written at once */
+		while (left > 0) {
+			loff_t end = ((off >> map->shift) + 1) << map->shift;
+			int n = min_t(loff_t, left, end - off);
+
+			if (vdisk_zero_map_test(map, off)) {
+				if (start != NULL) {
+					res = vdisk_file_rw_sync(virt_dev->fd,
+						start, a - start, start_off, true);
+					if (res != 0)
+						break;
+					start = NULL;
+				}
+			} else if (start == NULL) {
+				start = a;
+				start_off = off;
+			}
+			a += n;
+			off += n;
+			left -= n;
+		}
+		if ((res == 0) && (start != NULL))
+			res = vdisk_file_rw_sync(virt_dev->fd, start, a - start,
+				start_off, true);
 
-	if (cmd->cdb[2] & 0x0e/*Format*/) {
-		PRINT_ERROR("%s", "READ TOC: invalid requested data format");
-		scst_set_invalid_field_in_cdb(cmd, 2,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 5);
-		goto out;
+		scst_put_buf(cmd, address);
+		if (res != 0)
+			break;
+		length = scst_get_buf_next(cmd, &address);
 	}
 
-	if ((cmd->cdb[6] != 0 && (cmd->cdb[2] & 0x01)) ||
-	    (cmd->cdb[6] > 1 && cmd->cdb[6] != 0xAA)) {
-		PRINT_ERROR("READ TOC: invalid requested track number %x",
-			cmd->cdb[6]);
-		scst_set_invalid_field_in_cdb(cmd, 6, 0);
-		goto out;
+	if (unlikely(length < 0)) {
+		PRINT_ERROR("scst_get_buf_() failed: %d", length);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_internal_failure));
+		res = length;
+	} else if (unlikely(res != 0)) {
+		PRINT_ERROR("Writing to %s at %lld failed: %d",
+			virt_dev->filename, (long long)off, res);
+		if (res == -EAGAIN)
+			scst_set_busy(cmd);
+		else
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
 	}
 
-	length = scst_get_buf_full_sense(cmd, &address);
-	if (unlikely(length <= 0))
-		goto out;
+	TRACE_EXIT_RES(res);
+	return res;
+}
 
-	virt_dev = cmd->dev->dh_priv;
-	/* ToDo when you have > 8TB ROM device. */
-	nblocks = (uint32_t)virt_dev->nblocks;
+static enum compl_status_e fileio_exec_write(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_device *dev = cmd->dev;
+	loff_t loff = p->loff;
+	mm_segment_t old_fs;
+	loff_t err = 0;
+	ssize_t length, full_len;
+	uint8_t *address;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct file *fd = virt_dev->fd;
+	struct iovec *iv, *eiv;
+	struct vdisk_zero_map zero_map;
+	int rc, i, iv_count, eiv_count, max_iv_count;
+	bool finished = false;
 
-	/* Header */
-	memset(buffer, 0, sizeof(buffer));
-	buffer[2] = 0x01;    /* First Track/Session */
-	buffer[3] = 0x01;    /* Last Track/Session */
-	off = 4;
-	if (cmd->cdb[6] <= 1) {
-		/* Fistr TOC Track Descriptor */
-		/*
-		 * ADDR    0x10 - Q Sub-channel encodes current position data
-		 * CONTROL 0x04 - Data track, recoreded uninterrupted
-		 */
-		buffer[off+1] = 0x14;
-		/* Track Number */
-		buffer[off+2] = 0x01;
-		off += 8;
-	}
-	if (!(cmd->cdb[2] & 0x01)) {
-		/* Lead-out area TOC Track Descriptor */
-		buffer[off+1] = 0x14;
-		/* Track Number */
-		buffer[off+2] = 0xAA;
-		/* Track Start Address */
-		put_unaligned_be32(nblocks, &buffer[off + 4]);
-		off += 8;
-	}
+	TRACE_ENTRY();
 
-	buffer[1] = off - 2;    /* Data  Length */
+	EXTRACHECKS_BUG_ON(virt_dev->nullio);
 
-	if (off > length)
-		off = length;
-	memcpy(address, buffer, off);
+	rc = scst_dif_process_write(cmd);
+	if (unlikely(rc != 0))
+		goto out;
 
-	scst_put_buf_full(cmd, address);
+	/* If not all data were received, write them the usual way */
+	if (p->use_zero_copy && (cmd->write_len == cmd->bufflen)) {
+		int donated;
 
-	if (off < cmd->resp_data_len)
-		scst_set_resp_data_len(cmd, off);
+		/* Writing to the page cache directly doesn't honor O_DSYNC */
+		rc = commit_write(fd, cmd->sg, cmd->sg_cnt, loff,
+			virt_dev->wt_flag && !virt_dev->nv_cache && !p->fua,
+			&donated);
+		if (rc != 0) {
+			PRINT_ERROR("Zero copy write to %s at %lld failed: %d",
+				virt_dev->filename, (long long)loff, rc);
+			if (rc == -ENOSPC)
+				scst_set_cmd_error(cmd,
+				  SCST_LOAD_SENSE(scst_sense_space_alloc_failed));
+			else
+				scst_set_cmd_error(cmd,
+				  SCST_LOAD_SENSE(scst_sense_write_error));
+			goto out;
+		}
+		TRACE_DBG("%d of %d pages donated to the page cache (cmd %p)",
+			donated, cmd->sg_cnt, cmd);
+		goto write_dif_tags;
+	}
 
-out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
-}
+	rc = vdisk_zero_detect(p, &zero_map);
+	if (rc != 0) {
+		if (rc > 0) {
+			rc = fileio_write_nonzero(p, &zero_map);
+			kfree(zero_map.bits);
+		}
+		if (rc != 0)
+			goto out;
+		goto write_dif_tags;
+	}
 
-static enum compl_status_e vdisk_exec_prevent_allow_medium_removal(struct vdisk_cmd_params *p)
-{
-	struct scst_cmd *cmd = p->cmd;
-	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	if (virt_dev->cow) {
+		if (vdisk_cow_exec_rw(p, true) != 0)
+			goto out;
+		goto write_dif_tags;
+	}
 
-	TRACE_DBG("PERSIST/PREVENT 0x%02x", cmd->cdb[4]);
+	if (virt_dev->cache != NULL) {
+		if (vdisk_cache_exec_rw(p, true) != 0)
+			goto out;
+		goto write_dif_tags;
+	}
 
-	spin_lock(&virt_dev->flags_lock);
-	virt_dev->prevent_allow_medium_removal = cmd->cdb[4] & 0x01 ? 1 : 0;
-	spin_unlock(&virt_dev->flags_lock);
+	iv = vdisk_alloc_iv(cmd, p);
+	if (iv == NULL)
+		goto out_nomem;
 
-	return CMD_SUCCEEDED;
-}
+	max_iv_count = p->iv_count;
 
-static int __vdisk_fsync_fileio(loff_t loff,
-	loff_t len, struct scst_device *dev, struct scst_cmd *cmd,
-	struct file *file)
-{
-	int res;
+	length = scst_get_buf_first(cmd, &address);
+	if (unlikely(length < 0)) {
+		PRINT_ERROR("scst_get_buf_first() failed: %zd", length);
+		scst_set_cmd_error(cmd,
+		    SCST_LOAD_SENSE(scst_sense_internal_failure));
+		goto out;
+	}
 
-	TRACE_ENTRY();
+	old_fs = get_fs();
+	set_fs(get_ds());
 
-	/**
-	 ** !!! CAUTION !!!: cmd can be NULL here! Don't use it for
-	 ** anything without checking for NULL at first !!!
-	 **/
+	while (1) {
+		iv_count = 0;
+		full_len = 0;
+		i = -1;
+		while (length > 0) {
+			full_len += length;
+			i++;
+			iv_count++;
+			iv[i].iov_base = (uint8_t __force __user *)address;
+			iv[i].iov_len = length;
+			if (iv_count == max_iv_count)
+				break;
+			length = scst_get_buf_next(cmd, &address);
+		}
+		if (length == 0) {
+			finished = true;
+			if (unlikely(iv_count == 0))
+				break;
+		} else if (unlikely(length < 0)) {
+			PRINT_ERROR("scst_get_buf_next() failed: %zd", length);
+			scst_set_cmd_error(cmd,
+			    SCST_LOAD_SENSE(scst_sense_internal_failure));
+			goto out_set_fs;
+		}
 
-	/* BLOCKIO can be here for DIF tags fsync */
+		eiv = iv;
+		eiv_count = iv_count;
+restart:
+		TRACE_DBG("Writing: eiv_count %d, full_len %zd", eiv_count, full_len);
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 32)
-	res = sync_page_range(file_inode(file), file->f_mapping, loff, len);
-#else
-#if 0	/* For sparse files we might need to sync metadata as well */
-	res = generic_write_sync(file, loff, len);
-#else
-	res = filemap_write_and_wait_range(file->f_mapping, loff, len);
-#endif
-#endif
-	if (unlikely(res != 0)) {
-		PRINT_ERROR("sync range failed (%d)", res);
-		if (cmd != NULL) {
-			if (res == -ENOMEM)
+		/* WRITE */
+		err = vfs_writev(fd, (struct iovec __force __user *)eiv, eiv_count,
+				 &loff);
+		if (err < 0) {
+			PRINT_ERROR("write() returned %lld from %zd",
+				    (unsigned long long int)err,
+				    full_len);
+			if (err == -EAGAIN)
 				scst_set_busy(cmd);
-			else
+			else {
 				scst_set_cmd_error(cmd,
-					SCST_LOAD_SENSE(scst_sense_write_error));
+				    SCST_LOAD_SENSE(scst_sense_write_error));
+			}
+			goto out_set_fs;
+		} else if (err < full_len) {
+			/*
+			 * Probably that's wrong, but sometimes write() returns
+			 * value less, than requested. Let's restart.
+			 */
+			int e = eiv_count;
+
+			TRACE_MGMT_DBG("write() returned %d from %zd "
+				"(iv_count=%d)", (int)err, full_len,
+				eiv_count);
+			if (err == 0) {
+				PRINT_INFO("Suspicious: write() returned 0 from "
+					"%zd (iv_count=%d)", full_len, eiv_count);
+			}
+			full_len -= err;
+			for (i = 0; i < e; i++) {
+				if ((long long)eiv->iov_len < err) {
+					err -= eiv->iov_len;
+					eiv++;
+					eiv_count--;
+				} else {
+					eiv->iov_base += err;
+					eiv->iov_len -= err;
+					break;
+				}
+			}
+			goto restart;
 		}
-	}
-
-	TRACE_EXIT_RES(res);
-	return res;
-}
 
-static int vdisk_fsync_blockio(loff_t loff,
-	loff_t len, struct scst_device *dev, gfp_t gfp_flags,
-	struct scst_cmd *cmd, bool async)
-{
-	int res;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+		for (i = 0; i < iv_count; i++)
+			scst_put_buf(cmd, (void __force *)(iv[i].iov_base));
 
-	TRACE_ENTRY();
+		if (finished)
+			break;
 
-	/**
-	 ** !!! CAUTION !!!: cmd can be NULL here! Don't use it for
-	 ** anything without checking for NULL at first !!!
-	 **/
+		length = scst_get_buf_next(cmd, &address);
+	}
 
-	EXTRACHECKS_BUG_ON(!virt_dev->blockio);
+	set_fs(old_fs);
 
-	/* Must be first, because vdisk_blockio_flush() can call scst_cmd_done()! */
-	if (virt_dev->dif_fd != NULL) {
-		loff = (loff >> dev->block_shift) << SCST_DIF_TAG_SHIFT;
-		len = (len >> dev->block_shift) << SCST_DIF_TAG_SHIFT;
-		res = __vdisk_fsync_fileio(loff, len, dev, cmd,
-			virt_dev->dif_fd);
-		if (unlikely(res != 0))
+write_dif_tags:
+	if ((dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) &&
+	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) != SCST_DIF_ACTION_NONE)) {
+		err = vdev_write_dif_tags(p);
+		if (err != 0)
 			goto out;
 	}
 
-	res = vdisk_blockio_flush(virt_dev->bdev, gfp_flags, true,
-		cmd, async);
-
+out_sync:
+	/* O_DSYNC flag is used for WT devices */
+	if (p->fua)
+		vdisk_fsync(loff, scst_cmd_get_data_len(cmd), cmd->dev,
+			    cmd->cmd_gfp_mask, cmd, false);
 out:
-	TRACE_EXIT_RES(res);
-	return res;
-}
-
-static int vdisk_fsync_fileio(loff_t loff,
-	loff_t len, struct scst_device *dev, struct scst_cmd *cmd, bool async)
-{
-	int res;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
-
-	TRACE_ENTRY();
-
-	/**
-	 ** !!! CAUTION !!!: cmd can be NULL here! Don't use it for
-	 ** anything without checking for NULL at first !!!
-	 **/
-
-	res = __vdisk_fsync_fileio(loff, len, dev, cmd, virt_dev->fd);
-	if (unlikely(res != 0))
-		goto done;
-
-	if (virt_dev->dif_fd != NULL) {
-		loff = (loff >> dev->block_shift) << SCST_DIF_TAG_SHIFT;
-		len = (len >> dev->block_shift) << SCST_DIF_TAG_SHIFT;
-		res = __vdisk_fsync_fileio(loff, len, dev, cmd,
-			virt_dev->dif_fd);
-	}
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
 
-done:
-	if (async) {
-		if (cmd != NULL) {
-			cmd->completed = 1;
-			cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
-				scst_estimate_context());
-		}
-	}
+out_set_fs:
+	set_fs(old_fs);
+	for (i = 0; i < iv_count; i++)
+		scst_put_buf(cmd, (void __force *)(iv[i].iov_base));
+	goto out_sync;
 
-	TRACE_EXIT_RES(res);
-	return res;
+out_nomem:
+	scst_set_busy(cmd);
+	err = 0;
+	goto out;
 }
 
-static int vdisk_fsync(loff_t loff,
-	loff_t len, struct scst_device *dev, gfp_t gfp_flags,
-	struct scst_cmd *cmd, bool async)
+struct scst_blockio_work {
+	atomic_t bios_inflight;
+	struct scst_cmd *cmd;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)) && (LINUX_VERSION_CODE <= KERNEL_VERSION(3, 6, 0))
+	/* just to avoid extra dereferences */
+	struct bio_set *bioset;
+#endif
+};
+
+static inline void blockio_check_finish(struct scst_blockio_work *blockio_work)
 {
-	int res = 0;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	/* Decrement the bios in processing, and if zero signal completion */
+	if (atomic_dec_and_test(&blockio_work->bios_inflight)) {
+		struct scst_cmd *cmd = blockio_work->cmd;
 
-	TRACE_ENTRY();
+		if ((cmd->data_direction & SCST_DATA_READ) &&
+		    likely(cmd->status == SAM_STAT_GOOD)) {
+			/*
+			 * We, most likely, on interrupt, so defer DIF
+			 * checking to later stage in thread context
+			 */
+			cmd->deferred_dif_read_check = 1;
+		}
 
-	/**
-	 ** !!! CAUTION !!!: cmd can be NULL here! Don't use it for
-	 ** anything without checking for NULL at first !!!
-	 **/
+		blockio_work->cmd->completed = 1;
+		blockio_work->cmd->scst_cmd_done(cmd,
+			SCST_CMD_STATE_DEFAULT, scst_estimate_context());
 
-	/* It should be generated by compiler as a single comparison */
-	if (virt_dev->nv_cache || virt_dev->wt_flag ||
-	    virt_dev->o_direct_flag || virt_dev->nullio) {
-		if (async) {
-			cmd->completed = 1;
-			cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
-				scst_estimate_context());
-		}
-		goto out;
+		kmem_cache_free(blockio_work_cachep, blockio_work);
 	}
+	return;
+}
 
-	if (virt_dev->nullio)
-		;
-	else if (virt_dev->blockio)
-		res = vdisk_fsync_blockio(loff, len, dev, gfp_flags, cmd, async);
-	else
-		res = vdisk_fsync_fileio(loff, len, dev, cmd, async);
-
-out:
-	TRACE_EXIT_RES(res);
-	return res;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)) && (LINUX_VERSION_CODE <= KERNEL_VERSION(3, 6, 0))
+static void blockio_bio_destructor(struct bio *bio)
+{
+	struct scst_blockio_work *blockio_work = bio->bi_private;
+	bio_free(bio, blockio_work->bioset);
+	blockio_check_finish(blockio_work);
 }
+#endif
 
-static struct iovec *vdisk_alloc_iv(struct scst_cmd *cmd,
-				    struct vdisk_cmd_params *p)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
+static int blockio_endio(struct bio *bio, unsigned int bytes_done, int error)
 {
-	int iv_count;
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+static void blockio_endio(struct bio *bio, int error)
+{
+#else
+static void blockio_endio(struct bio *bio)
+{
+	int error = bio->bi_error;
+#endif
+	struct scst_blockio_work *blockio_work = bio->bi_private;
 
-	iv_count = min_t(int, scst_get_buf_count(cmd), UIO_MAXIOV);
-	if (iv_count > p->iv_count) {
-		if (p->iv != p->small_iv)
-			kfree(p->iv);
-		p->iv_count = 0;
-		/* It can't be called in atomic context */
-		p->iv = (iv_count <= ARRAY_SIZE(p->small_iv)) ? p->small_iv :
-			kmalloc_array(iv_count, sizeof(*p->iv),
-				      cmd->cmd_gfp_mask);
-		if (p->iv == NULL) {
-			PRINT_ERROR("Unable to allocate iv (%d)", iv_count);
-			goto out;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
+	if (bio->bi_size)
+		return 1;
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+	if (unlikely(!bio_flagged(bio, BIO_UPTODATE))) {
+		if (error == 0) {
+			PRINT_ERROR("Not up to date bio with error 0 for "
+				"cmd %p, returning -EIO", blockio_work->cmd);
+			error = -EIO;
 		}
-		p->iv_count = iv_count;
 	}
+#endif
 
-out:
-	return p->iv;
-}
+	if (unlikely(error != 0)) {
+		unsigned long flags;
 
-static enum compl_status_e nullio_exec_read(struct vdisk_cmd_params *p)
-{
-	struct scst_cmd *cmd = p->cmd;
-	struct scst_device *dev = cmd->dev;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+		PRINT_ERROR("BLOCKIO for cmd %p finished with error %d",
+			blockio_work->cmd, error);
 
-	TRACE_ENTRY();
+		/*
+		 * To protect from several bios finishing simultaneously +
+		 * unsuccessful DIF tags reading/writing
+		 */
+		spin_lock_irqsave(&vdev_err_lock, flags);
 
-	if (virt_dev->read_zero) {
-		struct scatterlist *sge;
-		struct page *page;
-		int i;
-		void *p;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
+		if (bio->bi_rw & (1 << BIO_RW))
+#else
+		if (bio->bi_rw & REQ_WRITE)
+#endif
+			scst_set_cmd_error(blockio_work->cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
+		else
+			scst_set_cmd_error(blockio_work->cmd,
+				SCST_LOAD_SENSE(scst_sense_read_error));
 
-		for_each_sg(cmd->sg, sge, cmd->sg_cnt, i) {
-			page = sg_page(sge);
-			p = kmap(page);
-			if (sge->offset == 0 && sge->length == PAGE_SIZE)
-				clear_page(p);
-			else
-				memset(p + sge->offset, 0, sge->length);
-			kunmap(page);
-		}
+		spin_unlock_irqrestore(&vdev_err_lock, flags);
 	}
 
-	scst_dif_process_read(p->cmd);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 30)) || (LINUX_VERSION_CODE > KERNEL_VERSION(3, 6, 0))
+	blockio_check_finish(blockio_work);
+#endif
 
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	bio_put(bio);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
+	return 0;
+#else
+	return;
+#endif
+}
+
+static void vdisk_bio_set_failfast(struct bio *bio)
+{
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 27)
+	bio->bi_rw |= (1 << BIO_RW_FAILFAST);
+#elif LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 35)
+	bio->bi_rw |= (1 << BIO_RW_FAILFAST_DEV) |
+		      (1 << BIO_RW_FAILFAST_TRANSPORT) |
+		      (1 << BIO_RW_FAILFAST_DRIVER);
+#else
+	bio->bi_rw |= REQ_FAILFAST_DEV |
+		      REQ_FAILFAST_TRANSPORT |
+		      REQ_FAILFAST_DRIVER;
+#endif
 }
 
-static int vdev_read_dif_tags(struct vdisk_cmd_params *p)
+static void vdisk_bio_set_hoq(struct bio *bio)
 {
-	int res = 0;
-	struct scst_cmd *cmd = p->cmd;
-	loff_t loff;
-	mm_segment_t old_fs;
-	loff_t err = 0;
-	ssize_t length, full_len;
-	uint8_t *address;
-	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
-	struct file *fd = virt_dev->dif_fd;
-	struct iovec *iv;
-	int iv_count, max_iv_count, i;
-	bool finished = false;
-	int tags_num, l;
-	struct scatterlist *tags_sg;
-	bool free_iv = false;
-
-	TRACE_ENTRY();
-
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36) ||			\
+	(defined(RHEL_MAJOR) &&						\
+	 (RHEL_MAJOR -0 > 6 || RHEL_MAJOR -0 == 6 && RHEL_MINOR -0 > 0))
+	bio->bi_rw |= REQ_SYNC;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 29)
+	bio->bi_rw |= 1 << BIO_RW_SYNCIO;
+#else
+	bio->bi_rw |= 1 << BIO_RW_SYNC;
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36) ||			\
+	(defined(RHEL_MAJOR) &&						\
+	 (RHEL_MAJOR -0 > 6 || RHEL_MAJOR -0 == 6 && RHEL_MINOR -0 > 0))
+	bio->bi_rw |= REQ_META;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
 	/*
-	 * !! Data for this cmd can be read simultaneously !!
+	 * Priority boosting was separated from REQ_META in commit 65299a3b
+	 * (kernel 3.1.0).
 	 */
-
-	EXTRACHECKS_BUG_ON(virt_dev->nullio);
-
-#if 0 /* no zero-copy (yet) */
-	if (p->use_zero_copy)
-		goto out;
+	bio->bi_rw |= REQ_PRIO;
+#endif
+#elif !defined(RHEL_MAJOR) || RHEL_MAJOR -0 >= 6
+	/*
+	 * BIO_* and REQ_* flags were unified in commit 7b6d91da (kernel
+	 * 2.6.36).
+	 */
+	bio->bi_rw |= BIO_RW_META;
 #endif
+}
 
-	EXTRACHECKS_BUG_ON(!(cmd->dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) ||
-	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) == SCST_DIF_ACTION_NONE));
+#if defined(CONFIG_BLK_DEV_INTEGRITY)
+static void vdisk_blk_add_dif(struct bio *bio, gfp_t gfp_mask,
+	const struct scst_device *dev, struct scatterlist **pdsg,
+	int *pdsg_offs, int *pdsg_len, bool last)
+{
+	int block_shift = dev->block_shift;
+	struct scatterlist *orig_dsg = *pdsg;
+	struct scatterlist *sg;
+	int sg_offs = *pdsg_offs, sg_len = *pdsg_len;
+	int pages, left, len, tags_len, rc;
+	struct bio_integrity_payload *bip;
 
-	tags_num = (cmd->bufflen >> cmd->dev->block_shift);
-	if (unlikely(tags_num == 0))
-		goto out;
+	TRACE_ENTRY();
 
-	iv = p->iv;
-	if (iv == NULL) {
-		iv = vdisk_alloc_iv(cmd, p);
-		if (iv == NULL) {
-			unsigned long flags;
+	tags_len = ((bio_sectors(bio) << 9) >> block_shift) << SCST_DIF_TAG_SHIFT;
 
-			/* To protect sense setting against blockio data reads */
-			spin_lock_irqsave(&vdev_err_lock, flags);
-			scst_set_busy(cmd);
-			spin_unlock_irqrestore(&vdev_err_lock, flags);
-			res = -ENOMEM;
-			goto out;
+	TRACE_DBG("bio %p, tags_len %d, pdsg %p, pdsg_offs %d, pdsg_len %d, "
+		"last %d", bio, tags_len, *pdsg, *pdsg_offs, *pdsg_len, last);
+
+	pages = 0;
+	left = tags_len;
+	sg = orig_dsg;
+	len = sg->length;
+	while (1) {
+		pages++;
+		left -= len;
+		if (left <= 0) {
+			if (!last) {
+				left = -left;
+				sg = __sg_next_inline(sg);
+				*pdsg = sg;
+				*pdsg_offs = sg->offset + left;
+				*pdsg_len = sg->length - left;
+				TRACE_DBG("left %d, pdsg %p, pdsg_offs %d, pdsg_len %d",
+					left, *pdsg, *pdsg_offs, *pdsg_len);
+			}
+			break;
 		}
-		free_iv = true;
+		sg = __sg_next_inline(sg);
+		len = sg->length;
 	}
-	max_iv_count = p->iv_count;
 
-	old_fs = get_fs();
-	set_fs(get_ds());
+	bip = bio_integrity_alloc(bio, gfp_mask, pages);
+	if (unlikely(bip == NULL)) {
+		PRINT_WARNING("Allocation of %d pages for DIF tags "
+			"failed! (dev %s)", pages, dev->virt_name);
+		goto out; /* proceed without integrity */
+	}
 
-	tags_sg = NULL;
-	loff = (p->loff >> cmd->dev->block_shift) << SCST_DIF_TAG_SHIFT;
-	while (1) {
-		iv_count = 0;
-		full_len = 0;
-		i = -1;
-		address = scst_get_dif_buf(cmd, &tags_sg, &l);
-		length = l;
-		EXTRACHECKS_BUG_ON(length <= 0);
-		while (1) {
-			full_len += length;
-			i++;
-			iv_count++;
-			iv[i].iov_base = (uint8_t __force __user *)address;
-			iv[i].iov_len = length;
-			tags_num -= length >> SCST_DIF_TAG_SHIFT;
-			EXTRACHECKS_BUG_ON(tags_num < 0);
-			if ((iv_count == max_iv_count) || (tags_num == 0))
-				break;
-			address = scst_get_dif_buf(cmd, &tags_sg, &l);
-			length = l;
-			EXTRACHECKS_BUG_ON(length <= 0);
-		}
-		if (tags_num == 0)
-			finished = true;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
+	bip->bip_iter.bi_size = tags_len;
+	bip->bip_iter.bi_sector = bio->bi_iter.bi_sector;
+#else
+	bip->bip_size = tags_len;
+	bip->bip_sector = bio->bi_sector;
+#endif
 
-		TRACE_DBG("Reading DIF iv_count %d, full_len %zd, loff %lld",
-			iv_count, full_len, (long long)loff);
+	left = tags_len;
+	sg = orig_dsg;
+	while (1) {
+		TRACE_DBG("page %p (buf %p), sg_len %d, sg_offs %d",
+			sg_page(sg), page_address(sg_page(sg)),
+			sg_len, sg_offs);
 
-		/* READ */
-		err = vfs_readv(fd, (struct iovec __force __user *)iv, iv_count,
-				&loff);
-		if ((err < 0) || (err < full_len)) {
-			unsigned long flags;
+		rc = bio_integrity_add_page(bio, sg_page(sg), sg_len, sg_offs);
+		if (rc != sg_len) {
+			PRINT_WARNING("Can not add DIF tags page! "
+				"(dev %s)", dev->virt_name);
+			/* bio_integrity_free() will be called as part of bio_free() */
+			goto out; /* proceed without integrity */
+		}
 
-			PRINT_ERROR("DIF readv() returned %lld from %zd "
-				"(offs %lld, dev %s)", (long long)err,
-				full_len, (long long)loff, cmd->dev->virt_name);
-			/* To protect sense setting with blockio */
-			spin_lock_irqsave(&vdev_err_lock, flags);
-			if (err == -EAGAIN)
-				scst_set_busy(cmd);
-			else {
-				scst_set_cmd_error(cmd,
-				    SCST_LOAD_SENSE(scst_sense_read_error));
-			}
-			spin_unlock_irqrestore(&vdev_err_lock, flags);
-			res = err;
-			goto out_set_fs;
+		if (left < sg_len) {
+			TRACE_DBG("left %d, sg_len %d, sg_offs %d",
+				left, sg_len, sg_offs);
+			break;
 		}
 
-		for (i = 0; i < iv_count; i++)
-			scst_put_dif_buf(cmd, (void __force *)(iv[i].iov_base));
+		left -= sg_len;
+		EXTRACHECKS_BUG_ON(left < 0);
 
-		if (finished)
-			break;
-	};
+		TRACE_DBG("left %d", left);
 
-	set_fs(old_fs);
+		if (left == 0)
+			break;
 
-out_free_iv:
-	if (free_iv && (iv != p->small_iv))
-		kfree(p->iv);
+		sg = __sg_next_inline(sg);
+		sg_len = sg->length;
+		sg_offs = sg->offset;
+	}
 
 out:
-	TRACE_EXIT_RES(res);
-	return res;
-
-out_set_fs:
-	set_fs(old_fs);
-	for (i = 0; i < iv_count; i++)
-		scst_put_dif_buf(cmd, (void __force *)(iv[i].iov_base));
-	goto out_free_iv;
+	TRACE_EXIT();
+	return;
 }
-
-static int vdev_write_dif_tags(struct vdisk_cmd_params *p)
+#else /* defined(CONFIG_BLK_DEV_INTEGRITY) */
+static void vdisk_blk_add_dif(struct bio *bio, gfp_t gfp_mask,
+	const struct scst_device *dev, struct scatterlist **pdsg,
+	int *pdsg_offs, int *pdsg_len, bool last)
 {
-	int res = 0;
-	struct scst_cmd *cmd = p->cmd;
-	loff_t loff;
-	mm_segment_t old_fs;
-	loff_t err = 0;
-	ssize_t length, full_len;
-	uint8_t *address;
-	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
-	struct file *fd = virt_dev->dif_fd;
-	struct iovec *iv, *eiv;
-	int iv_count, eiv_count, max_iv_count, i;
-	bool finished = false;
-	int tags_num, l;
-	struct scatterlist *tags_sg;
-	bool free_iv = false;
-
-	TRACE_ENTRY();
+	BUG();
+}
+#endif /* defined(CONFIG_BLK_DEV_INTEGRITY) */
 
-	/*
-	 * !! Data for this cmd can be written simultaneously !!
-	 */
+/*
+ * vdisk_blockio readahead
+ *
+ * BLOCKIO submits exactly what the initiator asks for, so sequential streams
+ * of small READs run at the backstorage latency. The readahead engine tracks
+ * up to VDISK_RA_STREAMS sequential streams by LBA and, once a stream made
+ * VDISK_RA_MIN_SEQ sequential READs, asynchronously reads VDISK_RA_WINDOW
+ * extents ahead of it into pages from vdisk_ra_pool. READs fully inside a
+ * read extent are then served from its pages without any copying: the sg
+ * vector of the command points to them. The cache is bounded by ra_cache_mb
+ * and evicts the least recently used extents. Writes invalidate the extents
+ * they overlap both on exec and on completion, so that readahead racing with
+ * a write can't leave stale data behind. Since a READ is bound to its extent
+ * already on the buffer allocation, invalidation also marks the extent stale.
+ * Such READs are then moved to a private extent with new pages, because other
+ * READs can still be sending the old ones, and executed as usual.
+ *
+ * Cached extents are aligned on VDISK_RA_EXTENT_SIZE and indexed by their
+ * number in a radix tree. The LRU list is used only for eviction.
+ *
+ * Extents are freed only in thread context by vdisk_ra_reap(), after they
+ * were removed from the cache and neither bios nor READs use them anymore,
+ * because on_free_cmd() and bio completion can be called in IRQ context.
+ */
 
-	EXTRACHECKS_BUG_ON(virt_dev->nullio);
+struct vdisk_ra_extent {
+	/* Entry in lru_list or dead_list, only the former are in the tree */
+	struct list_head entry;
+	loff_t off;
+	unsigned int len;
+	/* Commands, which sg vectors point to the pages */
+	atomic_t users;
+	/* Bios in flight, +1 until all of them submitted */
+	atomic_t bios;
+	/* Set before bios reach 0 */
+	bool error;
+	/* Protected by ra->lock */
+	bool used;
+	/* The pages might not match the medium anymore, protected by ra->lock */
+	bool stale;
+	struct vdisk_ra *ra;
+	struct sgv_pool_obj *sgv;
+	struct scatterlist *sg;
+	int sg_cnt;
+};
 
-#if 0 /* no zero-copy (yet) */
-	if (p->use_zero_copy)
-		goto out;
-#endif
+struct vdisk_ra_stream {
+	/* Expected offset of the next READ */
+	loff_t next;
+	/* Readahead issued up to here */
+	loff_t ra_end;
+	unsigned int seq;
+	unsigned long last_access;
+};
 
-	EXTRACHECKS_BUG_ON(!(cmd->dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) ||
-	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) == SCST_DIF_ACTION_NONE));
+struct vdisk_ra {
+	struct scst_vdisk_dev *virt_dev;
+	/* Protects all below as well as the stats */
+	spinlock_t lock;
+	/* Cached extents indexed by off >> VDISK_RA_EXTENT_SHIFT */
+	struct radix_tree_root tree;
+	/* Cached extents, most recently used first */
+	struct list_head lru_list;
+	/* Evicted or invalidated extents, waiting to be freed */
+	struct list_head dead_list;
+	/* Woken up when the last bio of an extent completes */
+	wait_queue_head_t bios_waitq;
+	int nr_extents, max_extents;
+	struct vdisk_ra_stream streams[VDISK_RA_STREAMS];
+	struct vdisk_ra_stats *stats;
+	struct scst_mem_lim mem_lim;
+};
 
-	tags_num = (cmd->bufflen >> cmd->dev->block_shift);
-	if (unlikely(tags_num == 0))
-		goto out;
+static struct sgv_pool *vdisk_ra_pool;
 
-	iv = p->iv;
-	if (iv == NULL) {
-		iv = vdisk_alloc_iv(cmd, p);
-		if (iv == NULL) {
-			unsigned long flags;
+static inline bool vdisk_ra_extent_ready(const struct vdisk_ra_extent *ext)
+{
+	if (atomic_read(&ext->bios) != 0)
+		return false;
+	smp_rmb();
+	return !ext->error;
+}
 
-			/* To protect sense setting against blockio data writes */
-			spin_lock_irqsave(&vdev_err_lock, flags);
-			scst_set_busy(cmd);
-			spin_unlock_irqrestore(&vdev_err_lock, flags);
-			res = -ENOMEM;
-			goto out;
-		}
-		free_iv = true;
-	}
-	max_iv_count = p->iv_count;
+static bool vdisk_ra_extent_stale(struct vdisk_ra_extent *ext)
+{
+	struct vdisk_ra *ra = ext->ra;
+	unsigned long flags;
+	bool res;
 
-	old_fs = get_fs();
-	set_fs(get_ds());
+	spin_lock_irqsave(&ra->lock, flags);
+	res = ext->stale;
+	spin_unlock_irqrestore(&ra->lock, flags);
 
-	tags_sg = NULL;
-	loff = (p->loff >> cmd->dev->block_shift) << SCST_DIF_TAG_SHIFT;
-	while (1) {
-		iv_count = 0;
-		full_len = 0;
-		i = -1;
-		address = scst_get_dif_buf(cmd, &tags_sg, &l);
-		length = l;
-		EXTRACHECKS_BUG_ON(length <= 0);
-		while (1) {
-			full_len += length;
-			i++;
-			iv_count++;
-			iv[i].iov_base = (uint8_t __force __user *)address;
-			iv[i].iov_len = length;
-			tags_num -= length >> SCST_DIF_TAG_SHIFT;
-			EXTRACHECKS_BUG_ON(tags_num < 0);
-			if ((iv_count == max_iv_count) || (tags_num == 0))
-				break;
-			address = scst_get_dif_buf(cmd, &tags_sg, &l);
-			length = l;
-			EXTRACHECKS_BUG_ON(length <= 0);
-		}
-		if (tags_num == 0)
-			finished = true;
+	return res;
+}
 
-		eiv = iv;
-		eiv_count = iv_count;
-restart:
-		TRACE_DBG("Writing DIF: eiv_count %d, full_len %zd", eiv_count, full_len);
+/* ra->lock supposed to be held. Returns the extent containing the range. */
+static struct vdisk_ra_extent *vdisk_ra_find(struct vdisk_ra *ra, loff_t off,
+	unsigned int len)
+{
+	struct vdisk_ra_extent *ext;
 
-		/* WRITE */
-		err = vfs_writev(fd, (struct iovec __force __user *)eiv, eiv_count,
-				 &loff);
-		if (err < 0) {
-			unsigned long flags;
+	ext = radix_tree_lookup(&ra->tree, off >> VDISK_RA_EXTENT_SHIFT);
+	if ((ext != NULL) && (off + len <= ext->off + ext->len))
+		return ext;
+	return NULL;
+}
 
-			PRINT_ERROR("DIF write() returned %lld from %zd",
-				(long long)err, full_len);
-			/* To protect sense setting with blockio */
-			spin_lock_irqsave(&vdev_err_lock, flags);
-			if (err == -EAGAIN)
-				scst_set_busy(cmd);
-			else {
-				scst_set_cmd_error(cmd,
-				    SCST_LOAD_SENSE(scst_sense_write_error));
-			}
-			spin_unlock_irqrestore(&vdev_err_lock, flags);
-			res = err;
-			goto out_set_fs;
-		} else if (err < full_len) {
-			/*
-			 * Probably that's wrong, but sometimes write() returns
-			 * value less, than requested. Let's restart.
-			 */
-			int e = eiv_count;
+/* ra->lock supposed to be held */
+static void vdisk_ra_kill(struct vdisk_ra *ra, struct vdisk_ra_extent *ext)
+{
+	radix_tree_delete(&ra->tree, ext->off >> VDISK_RA_EXTENT_SHIFT);
+	list_move(&ext->entry, &ra->dead_list);
+	ra->nr_extents--;
+	if (!ext->used)
+		ra->stats->unused++;
+	return;
+}
 
-			TRACE_MGMT_DBG("DIF write() returned %d from %zd "
-				"(iv_count=%d)", (int)err, full_len,
-				eiv_count);
-			if (err == 0) {
-				PRINT_INFO("Suspicious: DIF write() returned 0 from "
-					"%zd (iv_count=%d)", full_len, eiv_count);
-			}
-			full_len -= err;
-			for (i = 0; i < e; i++) {
-				if ((long long)eiv->iov_len < err) {
-					err -= eiv->iov_len;
-					eiv++;
-					eiv_count--;
-				} else {
-					eiv->iov_base =
-					    (uint8_t __force __user *)eiv->iov_base + err;
-					eiv->iov_len -= err;
-					break;
-				}
-			}
-			goto restart;
-		}
+static void vdisk_ra_free_extent(struct vdisk_ra *ra,
+	struct vdisk_ra_extent *ext)
+{
+	TRACE_DBG("Freeing readahead extent %p (off %lld)", ext,
+		(long long)ext->off);
+	sgv_pool_free(ext->sgv, &ra->mem_lim);
+	kfree(ext);
+	return;
+}
 
-		for (i = 0; i < iv_count; i++)
-			scst_put_dif_buf(cmd, (void __force *)(iv[i].iov_base));
+/* Frees dead extents nobody uses anymore. Must be called in thread context. */
+static void vdisk_ra_reap(struct vdisk_ra *ra)
+{
+	struct vdisk_ra_extent *ext, *t;
+	LIST_HEAD(free_list);
 
-		if (finished)
-			break;
-	};
+	if (list_empty(&ra->dead_list))
+		goto out;
 
-	set_fs(old_fs);
+	spin_lock_irq(&ra->lock);
+	list_for_each_entry_safe(ext, t, &ra->dead_list, entry) {
+		if ((atomic_read(&ext->users) == 0) &&
+		    (atomic_read(&ext->bios) == 0))
+			list_move(&ext->entry, &free_list);
+	}
+	spin_unlock_irq(&ra->lock);
 
-out_free_iv:
-	if (free_iv && (iv != p->small_iv))
-		kfree(iv);
+	list_for_each_entry_safe(ext, t, &free_list, entry)
+		vdisk_ra_free_extent(ra, ext);
 
 out:
-	TRACE_EXIT_RES(res);
-	return res;
-
-out_set_fs:
-	set_fs(old_fs);
-	for (i = 0; i < iv_count; i++)
-		scst_put_dif_buf(cmd, (void __force *)(iv[i].iov_base));
-	goto out_free_iv;
+	return;
 }
 
-static enum compl_status_e blockio_exec_read(struct vdisk_cmd_params *p)
+static void vdisk_ra_bio_done(struct vdisk_ra_extent *ext)
 {
-	blockio_exec_rw(p, false, false);
-	return RUNNING_ASYNC;
+	struct vdisk_ra *ra = ext->ra;
+
+	/* Make ext->error visible before bios reach 0 */
+	smp_wmb();
+	/* atomic_dec_and_test() implies a full barrier for waitqueue_active() */
+	if (atomic_dec_and_test(&ext->bios) && waitqueue_active(&ra->bios_waitq))
+		wake_up(&ra->bios_waitq);
+	return;
 }
 
-static enum compl_status_e fileio_exec_read(struct vdisk_cmd_params *p)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
+static int vdisk_ra_endio(struct bio *bio, unsigned int bytes_done, int error)
 {
-	struct scst_cmd *cmd = p->cmd;
-	loff_t loff = p->loff;
-	mm_segment_t old_fs;
-	loff_t err = 0;
-	ssize_t length, full_len;
-	uint8_t __user *address;
-	struct scst_device *dev = cmd->dev;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
-	struct file *fd = virt_dev->fd;
-	struct iovec *iv;
-	int iv_count, i, max_iv_count;
-	bool finished = false;
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+static void vdisk_ra_endio(struct bio *bio, int error)
+{
+#else
+static void vdisk_ra_endio(struct bio *bio)
+{
+	int error = bio->bi_error;
+#endif
+	struct vdisk_ra_extent *ext = bio->bi_private;
 
-	TRACE_ENTRY();
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
+	if (bio->bi_size)
+		return 1;
+#endif
 
-	EXTRACHECKS_BUG_ON(virt_dev->nullio);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+	if (!bio_flagged(bio, BIO_UPTODATE) && (error == 0))
+		error = -EIO;
+#endif
 
-	if (p->use_zero_copy)
-		goto out_dif;
+	if (unlikely(error != 0)) {
+		TRACE(TRACE_MINOR, "Readahead of %lld failed: %d",
+			(long long)ext->off, error);
+		ext->error = true;
+	}
 
-	iv = vdisk_alloc_iv(cmd, p);
-	if (iv == NULL)
-		goto out_nomem;
+	vdisk_ra_bio_done(ext);
 
-	max_iv_count = p->iv_count;
+	bio_put(bio);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
+	return 0;
+#else
+	return;
+#endif
+}
 
-	length = scst_get_buf_first(cmd, (uint8_t __force **)&address);
-	if (unlikely(length < 0)) {
-		PRINT_ERROR("scst_get_buf_first() failed: %zd", length);
-		scst_set_cmd_error(cmd,
-		    SCST_LOAD_SENSE(scst_sense_internal_failure));
-		goto out;
-	}
+static void vdisk_ra_submit_bio(struct vdisk_ra_extent *ext, struct bio *bio)
+{
+	atomic_inc(&ext->bios);
+	submit_bio(READ, bio);
+	return;
+}
 
-	old_fs = get_fs();
-	set_fs(get_ds());
+/* Reads the extent from the backstorage asynchronously */
+static void vdisk_ra_submit(struct scst_vdisk_dev *virt_dev,
+	struct vdisk_ra_extent *ext)
+{
+	struct block_device *bdev = virt_dev->bdev;
+	struct bio *bio = NULL;
+	loff_t pos = ext->off, end = ext->off + ext->len;
+	loff_t chunk_left = LLONG_MAX;
+	int i = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	struct blk_plug plug;
+#endif
 
-	while (1) {
-		iv_count = 0;
-		full_len = 0;
-		i = -1;
-		while (length > 0) {
-			full_len += length;
-			i++;
-			iv_count++;
-			iv[i].iov_base = address;
-			iv[i].iov_len = length;
-			if (iv_count == max_iv_count)
-				break;
-			length = scst_get_buf_next(cmd,
-				(uint8_t __force **)&address);
-		}
-		if (length == 0) {
-			finished = true;
-			if (unlikely(iv_count == 0))
-				break;
-		} else if (unlikely(length < 0)) {
-			PRINT_ERROR("scst_get_buf_next() failed: %zd", length);
-			scst_set_cmd_error(cmd,
-			    SCST_LOAD_SENSE(scst_sense_internal_failure));
-			goto out_set_fs;
-		}
+	TRACE_ENTRY();
 
-		TRACE_DBG("Reading iv_count %d, full_len %zd", iv_count, full_len);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	blk_start_plug(&plug);
+#endif
 
-		/* READ */
-		err = vfs_readv(fd, (struct iovec __force __user *)iv, iv_count,
-				&loff);
-		if ((err < 0) || (err < full_len)) {
-			PRINT_ERROR("readv() returned %lld from %zd",
-				    (unsigned long long int)err,
-				    full_len);
-			if (err == -EAGAIN)
-				scst_set_busy(cmd);
-			else {
-				scst_set_cmd_error(cmd,
-				    SCST_LOAD_SENSE(scst_sense_read_error));
-			}
-			goto out_set_fs;
-		}
+	while (pos < end) {
+		unsigned int bytes = min_t(loff_t, PAGE_SIZE, end - pos);
+
+		if (bio == NULL) {
+			loff_t dev_off = pos;
+			int max_nr_vecs;
 
-		for (i = 0; i < iv_count; i++)
-			scst_put_buf(cmd, (void __force *)(iv[i].iov_base));
+			if (virt_dev->stripe_cnt != 0) {
+				int s = vdisk_stripe_map(virt_dev, pos,
+						&dev_off, &chunk_left);
 
-		if (finished)
-			break;
+				bdev = virt_dev->stripe[s].bdev;
+			}
 
-		length = scst_get_buf_next(cmd, (uint8_t __force **)&address);
-	};
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
+			max_nr_vecs = BIO_MAX_PAGES;
+#else
+			max_nr_vecs = min(bio_get_nr_vecs(bdev), BIO_MAX_PAGES);
+#endif
+			bio = bio_alloc(GFP_KERNEL | __GFP_NOWARN, max_nr_vecs);
+			if (bio == NULL) {
+				ext->error = true;
+				break;
+			}
 
-	set_fs(old_fs);
+			bio->bi_end_io = vdisk_ra_endio;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
+			bio->bi_iter.bi_sector = dev_off >> 9;
+#else
+			bio->bi_sector = dev_off >> 9;
+#endif
+			bio->bi_bdev = bdev;
+			bio->bi_private = ext;
+			vdisk_bio_set_failfast(bio);
+		}
 
-	if ((dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) &&
-	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) != SCST_DIF_ACTION_NONE)) {
-		err = vdev_read_dif_tags(p);
-		if (err != 0)
-			goto out;
-	}
+		/*
+		 * Extents are aligned on their size, so a page never crosses
+		 * a stripe chunk boundary.
+		 */
+		if (bio_add_page(bio, sg_page(&ext->sg[i]), bytes, 0) < bytes) {
+			if (bio->bi_vcnt == 0) {
+				bio_put(bio);
+				ext->error = true;
+				bio = NULL;
+				break;
+			}
+			vdisk_ra_submit_bio(ext, bio);
+			bio = NULL;
+			continue;
+		}
 
-out_dif:
-	scst_dif_process_read(cmd);
+		pos += bytes;
+		i++;
+		chunk_left -= bytes;
+		if (chunk_left == 0) {
+			vdisk_ra_submit_bio(ext, bio);
+			bio = NULL;
+		}
+	}
 
-out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	if (bio != NULL)
+		vdisk_ra_submit_bio(ext, bio);
 
-out_set_fs:
-	set_fs(old_fs);
-	for (i = 0; i < iv_count; i++)
-		scst_put_buf(cmd, (void __force *)(iv[i].iov_base));
-	goto out;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	blk_finish_plug(&plug);
+#endif
 
-out_nomem:
-	scst_set_busy(cmd);
-	err = 0;
-	goto out;
-}
+	/* Drop the submission reference */
+	vdisk_ra_bio_done(ext);
 
-static enum compl_status_e nullio_exec_write(struct vdisk_cmd_params *p)
-{
-	scst_dif_process_write(p->cmd);
-	return CMD_SUCCEEDED;
+	TRACE_EXIT();
+	return;
 }
 
-static enum compl_status_e blockio_exec_write(struct vdisk_cmd_params *p)
+static struct vdisk_ra_extent *vdisk_ra_alloc_extent(struct vdisk_ra *ra,
+	loff_t off, unsigned int len)
 {
-	struct scst_cmd *cmd = p->cmd;
-	struct scst_device *dev = cmd->dev;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
-	int res, rc;
+	struct vdisk_ra_extent *ext;
+	int cnt;
 
-	TRACE_ENTRY();
+	ext = kzalloc(sizeof(*ext), GFP_KERNEL | __GFP_NOWARN);
+	if (ext == NULL)
+		goto out;
 
-	rc = scst_dif_process_write(cmd);
-	if (unlikely(rc != 0)) {
-		res = CMD_SUCCEEDED;
+	ext->ra = ra;
+	ext->off = off;
+	ext->len = len;
+	atomic_set(&ext->bios, 1);
+
+	ext->sg = sgv_pool_alloc(vdisk_ra_pool, ext->len,
+			GFP_KERNEL | __GFP_NOWARN, 0, &cnt, &ext->sgv,
+			&ra->mem_lim, NULL);
+	if (ext->sg == NULL) {
+		TRACE(TRACE_OUT_OF_MEM, "Unable to allocate readahead extent "
+			"(off %lld, len %d)", (long long)off, ext->len);
+		kfree(ext);
+		ext = NULL;
 		goto out;
 	}
-
-	blockio_exec_rw(p, true, p->fua || virt_dev->wt_flag);
-	res = RUNNING_ASYNC;
+	ext->sg_cnt = cnt;
 
 out:
-	TRACE_EXIT_RES(res);
-	return res;
+	return ext;
 }
 
-static enum compl_status_e blockio_exec_var_len_cmd(struct vdisk_cmd_params *p)
+/*
+ * Adds the extent to the cache evicting the least recently used completed
+ * extents if needed. Returns false, if there is no room or the range is
+ * already cached.
+ */
+static bool vdisk_ra_insert(struct vdisk_ra *ra, struct vdisk_ra_extent *ext)
 {
-	struct scst_cmd *cmd = p->cmd;
-	int res;
+	struct vdisk_ra_extent *e, *t;
+	unsigned long idx = ext->off >> VDISK_RA_EXTENT_SHIFT;
+	bool res = false;
+	int rc;
 
-	TRACE_ENTRY();
+	if (radix_tree_preload(GFP_KERNEL | __GFP_NOWARN) != 0)
+		goto out;
 
-	res = blockio_var_len_ops[cmd->cdb[9]](p);
+	spin_lock_irq(&ra->lock);
 
-	TRACE_EXIT_RES(res);
-	return res;
-}
+	if (radix_tree_lookup(&ra->tree, idx) != NULL)
+		goto out_unlock;
 
-static enum compl_status_e nullio_exec_var_len_cmd(struct vdisk_cmd_params *p)
-{
-	struct scst_cmd *cmd = p->cmd;
-	int res;
+	list_for_each_entry_safe_reverse(e, t, &ra->lru_list, entry) {
+		if (ra->nr_extents < ra->max_extents)
+			break;
+		if (atomic_read(&e->bios) == 0)
+			vdisk_ra_kill(ra, e);
+	}
+	if (ra->nr_extents >= ra->max_extents)
+		goto out_unlock;
 
-	TRACE_ENTRY();
+	rc = radix_tree_insert(&ra->tree, idx, ext);
+	sBUG_ON(rc != 0);
+	list_add(&ext->entry, &ra->lru_list);
+	ra->nr_extents++;
+	ra->stats->extents++;
+	res = true;
 
-	res = nullio_var_len_ops[cmd->cdb[9]](p);
+out_unlock:
+	spin_unlock_irq(&ra->lock);
+	radix_tree_preload_end();
 
-	TRACE_EXIT_RES(res);
+out:
 	return res;
 }
 
-static enum compl_status_e fileio_exec_var_len_cmd(struct vdisk_cmd_params *p)
+/*
+ * Called for each BLOCKIO READ in thread context after it was submitted or
+ * served from the cache. Tracks the stream the READ belongs to and reads
+ * ahead of it, if it is sequential.
+ */
+static void vdisk_ra_read(struct scst_vdisk_dev *virt_dev, loff_t off,
+	unsigned int len, bool hit)
 {
-	struct scst_cmd *cmd = p->cmd;
-	int res;
+	struct vdisk_ra *ra = virt_dev->ra;
+	struct vdisk_ra_stream *s, *lru = NULL;
+	loff_t offs[VDISK_RA_WINDOW], eoff, end;
+	int i, n = 0;
 
 	TRACE_ENTRY();
 
-	res = fileio_var_len_ops[cmd->cdb[9]](p);
-
-	TRACE_EXIT_RES(res);
-	return res;
-}
+	vdisk_ra_reap(ra);
 
-static enum compl_status_e fileio_exec_write(struct vdisk_cmd_params *p)
-{
-	struct scst_cmd *cmd = p->cmd;
-	struct scst_device *dev = cmd->dev;
-	loff_t loff = p->loff;
-	mm_segment_t old_fs;
-	loff_t err = 0;
-	ssize_t length, full_len;
-	uint8_t *address;
-	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
-	struct file *fd = virt_dev->fd;
-	struct iovec *iv, *eiv;
-	int rc, i, iv_count, eiv_count, max_iv_count;
-	bool finished = false;
+	spin_lock_irq(&ra->lock);
 
-	TRACE_ENTRY();
+	if (hit)
+		ra->stats->hits++;
+	else
+		ra->stats->misses++;
 
-	EXTRACHECKS_BUG_ON(virt_dev->nullio);
+	for (i = 0; i < VDISK_RA_STREAMS; i++) {
+		s = &ra->streams[i];
+		if (s->next == off)
+			goto found;
+		if ((lru == NULL) ||
+		    time_before(s->last_access, lru->last_access))
+			lru = s;
+	}
 
-	rc = scst_dif_process_write(cmd);
-	if (unlikely(rc != 0))
-		goto out;
+	/* A new stream replaces the least recently used one */
+	s = lru;
+	s->seq = 0;
+	s->ra_end = 0;
 
-	if (p->use_zero_copy)
-		goto out_sync;
+found:
+	s->seq++;
+	s->next = off + len;
+	s->last_access = jiffies;
 
-	iv = vdisk_alloc_iv(cmd, p);
-	if (iv == NULL)
-		goto out_nomem;
+	if (s->seq < VDISK_RA_MIN_SEQ)
+		goto out_unlock;
 
-	max_iv_count = p->iv_count;
+	/* Keep at least a half of the window ahead of the stream */
+	if (s->ra_end - s->next >= (VDISK_RA_WINDOW / 2) * VDISK_RA_EXTENT_SIZE)
+		goto out_unlock;
 
-	length = scst_get_buf_first(cmd, &address);
-	if (unlikely(length < 0)) {
-		PRINT_ERROR("scst_get_buf_first() failed: %zd", length);
-		scst_set_cmd_error(cmd,
-		    SCST_LOAD_SENSE(scst_sense_internal_failure));
-		goto out;
+	/* ra_end is extent aligned, see vdisk_ra_invalidate() */
+	eoff = max(s->next & ~((loff_t)VDISK_RA_EXTENT_SIZE - 1), s->ra_end);
+	end = min((s->next & ~((loff_t)VDISK_RA_EXTENT_SIZE - 1)) +
+		VDISK_RA_WINDOW * VDISK_RA_EXTENT_SIZE, virt_dev->file_size);
+	for (; eoff < end; eoff += VDISK_RA_EXTENT_SIZE) {
+		if (vdisk_ra_find(ra, eoff, 1) == NULL)
+			offs[n++] = eoff;
 	}
+	s->ra_end = max(s->ra_end, end);
 
-	old_fs = get_fs();
-	set_fs(get_ds());
+out_unlock:
+	spin_unlock_irq(&ra->lock);
 
-	while (1) {
-		iv_count = 0;
-		full_len = 0;
-		i = -1;
-		while (length > 0) {
-			full_len += length;
-			i++;
-			iv_count++;
-			iv[i].iov_base = (uint8_t __force __user *)address;
-			iv[i].iov_len = length;
-			if (iv_count == max_iv_count)
-				break;
-			length = scst_get_buf_next(cmd, &address);
-		}
-		if (length == 0) {
-			finished = true;
-			if (unlikely(iv_count == 0))
-				break;
-		} else if (unlikely(length < 0)) {
-			PRINT_ERROR("scst_get_buf_next() failed: %zd", length);
-			scst_set_cmd_error(cmd,
-			    SCST_LOAD_SENSE(scst_sense_internal_failure));
-			goto out_set_fs;
+	for (i = 0; i < n; i++) {
+		struct vdisk_ra_extent *ext;
+
+		ext = vdisk_ra_alloc_extent(ra, offs[i],
+			min_t(loff_t, VDISK_RA_EXTENT_SIZE,
+				virt_dev->file_size - offs[i]));
+		if (ext == NULL)
+			break;
+
+		if (!vdisk_ra_insert(ra, ext)) {
+			vdisk_ra_free_extent(ra, ext);
+			break;
 		}
 
-		eiv = iv;
-		eiv_count = iv_count;
-restart:
-		TRACE_DBG("Writing: eiv_count %d, full_len %zd", eiv_count, full_len);
+		TRACE_DBG("Reading ahead %d bytes at %lld (dev %s)", ext->len,
+			(long long)ext->off, virt_dev->name);
+		vdisk_ra_submit(virt_dev, ext);
+	}
 
-		/* WRITE */
-		err = vfs_writev(fd, (struct iovec __force __user *)eiv, eiv_count,
-				 &loff);
-		if (err < 0) {
-			PRINT_ERROR("write() returned %lld from %zd",
-				    (unsigned long long int)err,
-				    full_len);
-			if (err == -EAGAIN)
-				scst_set_busy(cmd);
-			else {
-				scst_set_cmd_error(cmd,
-				    SCST_LOAD_SENSE(scst_sense_write_error));
-			}
-			goto out_set_fs;
-		} else if (err < full_len) {
-			/*
-			 * Probably that's wrong, but sometimes write() returns
-			 * value less, than requested. Let's restart.
-			 */
-			int e = eiv_count;
+	TRACE_EXIT();
+	return;
+}
 
-			TRACE_MGMT_DBG("write() returned %d from %zd "
-				"(iv_count=%d)", (int)err, full_len,
-				eiv_count);
-			if (err == 0) {
-				PRINT_INFO("Suspicious: write() returned 0 from "
-					"%zd (iv_count=%d)", full_len, eiv_count);
-			}
-			full_len -= err;
-			for (i = 0; i < e; i++) {
-				if ((long long)eiv->iov_len < err) {
-					err -= eiv->iov_len;
-					eiv++;
-					eiv_count--;
-				} else {
-					eiv->iov_base += err;
-					eiv->iov_len -= err;
-					break;
-				}
-			}
-			goto restart;
-		}
+/*
+ * Moves a READ bound to the stale extent @ext to a new private extent with
+ * the same geometry, so that the READ can be reread into its pages without
+ * touching the pages other READs of @ext may still be sending. The new
+ * extent is never cached and is freed by vdisk_ra_reap() once the READ is
+ * done. Must be called in thread context. Returns the new extent or NULL,
+ * if it couldn't be allocated.
+ */
+static struct vdisk_ra_extent *vdisk_ra_rebind(struct scst_cmd *cmd,
+	struct vdisk_ra_extent *ext)
+{
+	struct vdisk_ra *ra = ext->ra;
+	struct vdisk_ra_extent *new_ext;
+	loff_t off = cmd->lba << cmd->dev->block_shift;
+	int i, first = (off - ext->off) >> PAGE_SHIFT;
 
-		for (i = 0; i < iv_count; i++)
-			scst_put_buf(cmd, (void __force *)(iv[i].iov_base));
+	TRACE_ENTRY();
 
-		if (finished)
-			break;
+	new_ext = vdisk_ra_alloc_extent(ra, ext->off, ext->len);
+	if (new_ext == NULL)
+		goto out;
 
-		length = scst_get_buf_next(cmd, &address);
-	}
+	/* No readahead bios, the READ itself fills the pages */
+	atomic_set(&new_ext->bios, 0);
+	atomic_set(&new_ext->users, 1);
+	new_ext->used = true;
+	new_ext->stale = true;
 
-	set_fs(old_fs);
+	for (i = 0; i < cmd->sg_cnt; i++)
+		sg_set_page(&cmd->sg[i], sg_page(&new_ext->sg[first + i]),
+			cmd->sg[i].length, cmd->sg[i].offset);
 
-	if ((dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) &&
-	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) != SCST_DIF_ACTION_NONE)) {
-		err = vdev_write_dif_tags(p);
-		if (err != 0)
-			goto out;
-	}
+	spin_lock_irq(&ra->lock);
+	list_add_tail(&new_ext->entry, &ra->dead_list);
+	spin_unlock_irq(&ra->lock);
 
-out_sync:
-	/* O_DSYNC flag is used for WT devices */
-	if (p->fua)
-		vdisk_fsync(loff, scst_cmd_get_data_len(cmd), cmd->dev,
-			    cmd->cmd_gfp_mask, cmd, false);
-out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	/* The old extent will be freed by vdisk_ra_reap() */
+	atomic_dec(&ext->users);
 
-out_set_fs:
-	set_fs(old_fs);
-	for (i = 0; i < iv_count; i++)
-		scst_put_buf(cmd, (void __force *)(iv[i].iov_base));
-	goto out_sync;
+	TRACE_DBG("Moved cmd %p from stale readahead extent %p to %p", cmd,
+		ext, new_ext);
 
-out_nomem:
-	scst_set_busy(cmd);
-	err = 0;
-	goto out;
+out:
+	TRACE_EXIT();
+	return new_ext;
 }
 
-struct scst_blockio_work {
-	atomic_t bios_inflight;
-	struct scst_cmd *cmd;
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)) && (LINUX_VERSION_CODE <= KERNEL_VERSION(3, 6, 0))
-	/* just to avoid extra dereferences */
-	struct bio_set *bioset;
-#endif
-};
+#define VDISK_RA_LOOKUP_BATCH	16
 
-static inline void blockio_check_finish(struct scst_blockio_work *blockio_work)
+/* Can be called in any context */
+static void vdisk_ra_invalidate(struct vdisk_ra *ra, loff_t off, loff_t len)
 {
-	/* Decrement the bios in processing, and if zero signal completion */
-	if (atomic_dec_and_test(&blockio_work->bios_inflight)) {
-		struct scst_cmd *cmd = blockio_work->cmd;
-
-		if ((cmd->data_direction & SCST_DATA_READ) &&
-		    likely(cmd->status == SAM_STAT_GOOD)) {
-			/*
-			 * We, most likely, on interrupt, so defer DIF
-			 * checking to later stage in thread context
-			 */
-			cmd->deferred_dif_read_check = 1;
+	struct vdisk_ra_extent *exts[VDISK_RA_LOOKUP_BATCH];
+	unsigned long idx = off >> VDISK_RA_EXTENT_SHIFT;
+	unsigned long last = (off + len - 1) >> VDISK_RA_EXTENT_SHIFT;
+	unsigned long flags;
+	int i, nr;
+
+	spin_lock_irqsave(&ra->lock, flags);
+
+	do {
+		nr = radix_tree_gang_lookup(&ra->tree, (void **)exts, idx,
+				ARRAY_SIZE(exts));
+		for (i = 0; i < nr; i++) {
+			idx = exts[i]->off >> VDISK_RA_EXTENT_SHIFT;
+			if (idx > last)
+				goto out_streams;
+			exts[i]->stale = true;
+			vdisk_ra_kill(ra, exts[i]);
+			ra->stats->invalidated++;
 		}
+		idx++;
+	} while (nr == ARRAY_SIZE(exts));
 
-		blockio_work->cmd->completed = 1;
-		blockio_work->cmd->scst_cmd_done(cmd,
-			SCST_CMD_STATE_DEFAULT, scst_estimate_context());
+out_streams:
+	/* Let the streams read the invalidated range ahead again */
+	for (i = 0; i < VDISK_RA_STREAMS; i++) {
+		struct vdisk_ra_stream *s = &ra->streams[i];
 
-		kmem_cache_free(blockio_work_cachep, blockio_work);
+		if (s->ra_end > off)
+			s->ra_end = off & ~((loff_t)VDISK_RA_EXTENT_SIZE - 1);
 	}
+
+	spin_unlock_irqrestore(&ra->lock, flags);
 	return;
 }
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)) && (LINUX_VERSION_CODE <= KERNEL_VERSION(3, 6, 0))
-static void blockio_bio_destructor(struct bio *bio)
+static void vdisk_ra_invalidate_cmd(struct scst_vdisk_dev *virt_dev,
+	struct scst_cmd *cmd)
 {
-	struct scst_blockio_work *blockio_work = bio->bi_private;
-	bio_free(bio, blockio_work->bioset);
-	blockio_check_finish(blockio_work);
+	loff_t off = 0, len = LLONG_MAX;
+
+	switch (cmd->cdb[0]) {
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_12:
+	case WRITE_VERIFY_16:
+		off = cmd->lba << cmd->dev->block_shift;
+		len = cmd->data_len;
+		break;
+	default:
+		/* WRITE SAME, UNMAP, FORMAT UNIT, etc. Drop everything. */
+		break;
+	}
+
+	TRACE_DBG("Invalidating readahead of %lld bytes at %lld (cmd %p)",
+		(long long)len, (long long)off, cmd);
+
+	vdisk_ra_invalidate(virt_dev->ra, off, len);
+	return;
 }
-#endif
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
-static int blockio_endio(struct bio *bio, unsigned int bytes_done, int error)
-{
-#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
-static void blockio_endio(struct bio *bio, int error)
+static int vdisk_ra_create(struct scst_vdisk_dev *virt_dev)
 {
-#else
-static void blockio_endio(struct bio *bio)
-{
-	int error = bio->bi_error;
-#endif
-	struct scst_blockio_work *blockio_work = bio->bi_private;
+	struct vdisk_ra *ra;
+	int res = 0;
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
-	if (bio->bi_size)
-		return 1;
-#endif
+	TRACE_ENTRY();
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
-	if (unlikely(!bio_flagged(bio, BIO_UPTODATE))) {
-		if (error == 0) {
-			PRINT_ERROR("Not up to date bio with error 0 for "
-				"cmd %p, returning -EIO", blockio_work->cmd);
-			error = -EIO;
-		}
+	if (virt_dev->ra_cache_mb == 0)
+		goto out;
+
+	ra = kzalloc(sizeof(*ra), GFP_KERNEL);
+	if (ra == NULL) {
+		PRINT_ERROR("Unable to allocate readahead cache (device %s)",
+			virt_dev->name);
+		res = -ENOMEM;
+		goto out;
 	}
-#endif
 
-	if (unlikely(error != 0)) {
-		unsigned long flags;
+	ra->virt_dev = virt_dev;
+	spin_lock_init(&ra->lock);
+	INIT_RADIX_TREE(&ra->tree, GFP_ATOMIC);
+	INIT_LIST_HEAD(&ra->lru_list);
+	INIT_LIST_HEAD(&ra->dead_list);
+	init_waitqueue_head(&ra->bios_waitq);
+	ra->max_extents = ((u64)virt_dev->ra_cache_mb << 20) >>
+				VDISK_RA_EXTENT_SHIFT;
+	ra->stats = &virt_dev->ra_stats;
+	scst_init_mem_lim(&ra->mem_lim);
+	ra->mem_lim.max_allowed_pages =
+		(u64)virt_dev->ra_cache_mb << (20 - PAGE_SHIFT);
 
-		PRINT_ERROR("BLOCKIO for cmd %p finished with error %d",
-			blockio_work->cmd, error);
+	virt_dev->ra = ra;
 
-		/*
-		 * To protect from several bios finishing simultaneously +
-		 * unsuccessful DIF tags reading/writing
-		 */
-		spin_lock_irqsave(&vdev_err_lock, flags);
+	TRACE_DBG("Readahead cache of %d extents (device %s)",
+		ra->max_extents, virt_dev->name);
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
-		if (bio->bi_rw & (1 << BIO_RW))
-#else
-		if (bio->bi_rw & REQ_WRITE)
-#endif
-			scst_set_cmd_error(blockio_work->cmd,
-				SCST_LOAD_SENSE(scst_sense_write_error));
-		else
-			scst_set_cmd_error(blockio_work->cmd,
-				SCST_LOAD_SENSE(scst_sense_read_error));
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
 
-		spin_unlock_irqrestore(&vdev_err_lock, flags);
-	}
+/* Returns true, if no dead extent has bios in flight */
+static bool vdisk_ra_dead_idle(struct vdisk_ra *ra)
+{
+	struct vdisk_ra_extent *ext;
+	bool res = true;
 
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 30)) || (LINUX_VERSION_CODE > KERNEL_VERSION(3, 6, 0))
-	blockio_check_finish(blockio_work);
-#endif
+	spin_lock_irq(&ra->lock);
+	list_for_each_entry(ext, &ra->dead_list, entry) {
+		if (atomic_read(&ext->bios) != 0) {
+			res = false;
+			break;
+		}
+	}
+	spin_unlock_irq(&ra->lock);
 
-	bio_put(bio);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
-	return 0;
-#else
-	return;
-#endif
+	return res;
 }
 
-static void vdisk_bio_set_failfast(struct bio *bio)
+/*
+ * Drops all the cached extents and waits for the readahead bios. Called
+ * before the backstorage is closed, must be called in thread context.
+ * READs, which are already served from the cache, can still be waiting for
+ * their execution, e.g. during ALUA state change, so they keep their extents,
+ * but, because the backstorage can be changed, the extents are marked stale.
+ */
+static void vdisk_ra_flush(struct vdisk_ra *ra)
 {
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 27)
-	bio->bi_rw |= (1 << BIO_RW_FAILFAST);
-#elif LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 35)
-	bio->bi_rw |= (1 << BIO_RW_FAILFAST_DEV) |
-		      (1 << BIO_RW_FAILFAST_TRANSPORT) |
-		      (1 << BIO_RW_FAILFAST_DRIVER);
-#else
-	bio->bi_rw |= REQ_FAILFAST_DEV |
-		      REQ_FAILFAST_TRANSPORT |
-		      REQ_FAILFAST_DRIVER;
-#endif
+	struct vdisk_ra_extent *ext, *t;
+	int i;
+
+	TRACE_ENTRY();
+
+	spin_lock_irq(&ra->lock);
+	list_for_each_entry_safe(ext, t, &ra->lru_list, entry) {
+		ext->stale = true;
+		vdisk_ra_kill(ra, ext);
+	}
+	for (i = 0; i < VDISK_RA_STREAMS; i++)
+		memset(&ra->streams[i], 0, sizeof(ra->streams[i]));
+	spin_unlock_irq(&ra->lock);
+
+	wait_event(ra->bios_waitq, vdisk_ra_dead_idle(ra));
+
+	vdisk_ra_reap(ra);
+
+	TRACE_EXIT();
+	return;
 }
 
-static void vdisk_bio_set_hoq(struct bio *bio)
+/* Must be called in thread context with no commands on the device */
+static void vdisk_ra_destroy(struct vdisk_ra *ra)
 {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36) ||			\
-	(defined(RHEL_MAJOR) &&						\
-	 (RHEL_MAJOR -0 > 6 || RHEL_MAJOR -0 == 6 && RHEL_MINOR -0 > 0))
-	bio->bi_rw |= REQ_SYNC;
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 29)
-	bio->bi_rw |= 1 << BIO_RW_SYNCIO;
-#else
-	bio->bi_rw |= 1 << BIO_RW_SYNC;
-#endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36) ||			\
-	(defined(RHEL_MAJOR) &&						\
-	 (RHEL_MAJOR -0 > 6 || RHEL_MAJOR -0 == 6 && RHEL_MINOR -0 > 0))
-	bio->bi_rw |= REQ_META;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
-	/*
-	 * Priority boosting was separated from REQ_META in commit 65299a3b
-	 * (kernel 3.1.0).
-	 */
-	bio->bi_rw |= REQ_PRIO;
-#endif
-#elif !defined(RHEL_MAJOR) || RHEL_MAJOR -0 >= 6
-	/*
-	 * BIO_* and REQ_* flags were unified in commit 7b6d91da (kernel
-	 * 2.6.36).
-	 */
-	bio->bi_rw |= BIO_RW_META;
-#endif
+	TRACE_ENTRY();
+
+	vdisk_ra_flush(ra);
+
+	sBUG_ON(!list_empty(&ra->dead_list));
+	kfree(ra);
+
+	TRACE_EXIT();
+	return;
 }
 
-#if defined(CONFIG_BLK_DEV_INTEGRITY)
-static void vdisk_blk_add_dif(struct bio *bio, gfp_t gfp_mask,
-	const struct scst_device *dev, struct scatterlist **pdsg,
-	int *pdsg_offs, int *pdsg_len, bool last)
+/*
+ * Zero copy READ from the readahead cache: if the READ is fully inside a
+ * read extent, point the sg vector of the command to its pages.
+ */
+static int blockio_alloc_data_buf(struct scst_cmd *cmd)
 {
-	int block_shift = dev->block_shift;
-	struct scatterlist *orig_dsg = *pdsg;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct vdisk_ra *ra = virt_dev->ra;
+	struct vdisk_ra_extent *ext;
 	struct scatterlist *sg;
-	int sg_offs = *pdsg_offs, sg_len = *pdsg_len;
-	int pages, left, len, tags_len, rc;
-	struct bio_integrity_payload *bip;
+	loff_t off;
+	unsigned int len = cmd->bufflen, o;
+	unsigned long flags;
+	int i, first, cnt;
 
 	TRACE_ENTRY();
 
-	tags_len = ((bio_sectors(bio) << 9) >> block_shift) << SCST_DIF_TAG_SHIFT;
-
-	TRACE_DBG("bio %p, tags_len %d, pdsg %p, pdsg_offs %d, pdsg_len %d, "
-		"last %d", bio, tags_len, *pdsg, *pdsg_offs, *pdsg_len, last);
+	if ((ra == NULL) || cmd->tgt_i_data_buf_alloced ||
+	    (cmd->data_direction != SCST_DATA_READ) || (len == 0) ||
+	    (cmd->dev->dev_dif_mode != SCST_DIF_MODE_NONE))
+		goto out;
 
-	pages = 0;
-	left = tags_len;
-	sg = orig_dsg;
-	len = sg->length;
-	while (1) {
-		pages++;
-		left -= len;
-		if (left <= 0) {
-			if (!last) {
-				left = -left;
-				sg = __sg_next_inline(sg);
-				*pdsg = sg;
-				*pdsg_offs = sg->offset + left;
-				*pdsg_len = sg->length - left;
-				TRACE_DBG("left %d, pdsg %p, pdsg_offs %d, pdsg_len %d",
-					left, *pdsg, *pdsg_offs, *pdsg_len);
-			}
-			break;
-		}
-		sg = __sg_next_inline(sg);
-		len = sg->length;
+	switch (cmd->cdb[0]) {
+	case READ_6:
+		break;
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		/* FUA READs must be served from the medium */
+		if (cmd->cdb[1] & 0x08)
+			goto out;
+		break;
+	default:
+		goto out;
 	}
 
-	bip = bio_integrity_alloc(bio, gfp_mask, pages);
-	if (unlikely(bip == NULL)) {
-		PRINT_WARNING("Allocation of %d pages for DIF tags "
-			"failed! (dev %s)", pages, dev->virt_name);
-		goto out; /* proceed without integrity */
+	off = cmd->lba << cmd->dev->block_shift;
+	cnt = PFN_UP((off & ~PAGE_MASK) + len);
+
+	sg = kmalloc_array(cnt, sizeof(*sg),
+		scst_cmd_atomic(cmd) ? GFP_ATOMIC : GFP_KERNEL);
+	if (sg == NULL)
+		goto out;
+
+	/* Can be called in atomic context via dev_alloc_data_buf_atomic */
+	spin_lock_irqsave(&ra->lock, flags);
+	ext = vdisk_ra_find(ra, off, len);
+	if ((ext == NULL) || !vdisk_ra_extent_ready(ext)) {
+		/* Let the range be read ahead again */
+		if ((ext != NULL) && (atomic_read(&ext->bios) == 0))
+			vdisk_ra_kill(ra, ext);
+		spin_unlock_irqrestore(&ra->lock, flags);
+		kfree(sg);
+		goto out;
 	}
+	atomic_inc(&ext->users);
+	ext->used = true;
+	list_move(&ext->entry, &ra->lru_list);
+	spin_unlock_irqrestore(&ra->lock, flags);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
-	bip->bip_iter.bi_size = tags_len;
-	bip->bip_iter.bi_sector = bio->bi_iter.bi_sector;
-#else
-	bip->bip_size = tags_len;
-	bip->bip_sector = bio->bi_sector;
-#endif
+	TRACE_DBG("Serving cmd %p (off %lld, len %d) from readahead extent %p",
+		cmd, (long long)off, len, ext);
 
-	left = tags_len;
-	sg = orig_dsg;
-	while (1) {
-		TRACE_DBG("page %p (buf %p), sg_len %d, sg_offs %d",
-			sg_page(sg), page_address(sg_page(sg)),
-			sg_len, sg_offs);
+	sg_init_table(sg, cnt);
+	first = (off - ext->off) >> PAGE_SHIFT;
+	o = off & ~PAGE_MASK;
+	for (i = 0; i < cnt; i++) {
+		unsigned int bytes = min_t(unsigned int, PAGE_SIZE - o, len);
 
-		rc = bio_integrity_add_page(bio, sg_page(sg), sg_len, sg_offs);
-		if (rc != sg_len) {
-			PRINT_WARNING("Can not add DIF tags page! "
-				"(dev %s)", dev->virt_name);
-			/* bio_integrity_free() will be called as part of bio_free() */
-			goto out; /* proceed without integrity */
-		}
+		sg_set_page(&sg[i], sg_page(&ext->sg[first + i]), bytes, o);
+		len -= bytes;
+		o = 0;
+	}
+
+	scst_cmd_set_dh_data_buff_alloced(cmd);
+	cmd->sg = sg;
+	cmd->sg_cnt = cnt;
+	/* Kept until on_free_cmd(), see blockio_exec() */
+	cmd->dh_priv = ext;
+
+out:
+	TRACE_EXIT();
+	return SCST_CMD_STATE_DEFAULT;
+}
 
-		if (left < sg_len) {
-			TRACE_DBG("left %d, sg_len %d, sg_offs %d",
-				left, sg_len, sg_offs);
-			break;
-		}
+static int blockio_dev_done(struct scst_cmd *cmd)
+{
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
 
-		left -= sg_len;
-		EXTRACHECKS_BUG_ON(left < 0);
+	/* Drop what readahead could have read before the data hit the disk */
+	if ((virt_dev->ra != NULL) && (cmd->op_flags & SCST_WRITE_MEDIUM))
+		vdisk_ra_invalidate_cmd(virt_dev, cmd);
 
-		TRACE_DBG("left %d", left);
+	return SCST_CMD_STATE_DEFAULT;
+}
 
-		if (left == 0)
-			break;
+static void blockio_on_free_cmd(struct scst_cmd *cmd)
+{
+	struct vdisk_ra_extent *ext = cmd->dh_priv;
 
-		sg = __sg_next_inline(sg);
-		sg_len = sg->length;
-		sg_offs = sg->offset;
-	}
+	TRACE_ENTRY();
+
+	if (ext == NULL)
+		goto out;
+
+	kfree(cmd->sg);
+	cmd->sg = NULL;
+	cmd->sg_cnt = 0;
+	cmd->bufflen = 0;
+	cmd->data_len = 0;
+	cmd->dh_priv = NULL;
+
+	/* The extent will be freed by vdisk_ra_reap() */
+	atomic_dec(&ext->users);
 
 out:
 	TRACE_EXIT();
 	return;
 }
-#else /* defined(CONFIG_BLK_DEV_INTEGRITY) */
-static void vdisk_blk_add_dif(struct bio *bio, gfp_t gfp_mask,
-	const struct scst_device *dev, struct scatterlist **pdsg,
-	int *pdsg_offs, int *pdsg_len, bool last)
-{
-	BUG();
-}
-#endif /* defined(CONFIG_BLK_DEV_INTEGRITY) */
 
 static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua)
 {
@@ -6688,6 +12640,9 @@ static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua)
 	int dsg_offs, dsg_len;
 	bool dif = virt_dev->blk_integrity &&
 		   (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) != SCST_DIF_ACTION_NONE);
+	/* Bytes left in the current stripe chunk */
+	loff_t chunk_left = LLONG_MAX;
+	const struct vdisk_zero_map *zmap = p->zero_map;
 
 	TRACE_ENTRY();
 
@@ -6759,9 +12714,42 @@ static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua)
 		lba_start0 = lba_start;
 
 		while (len > 0) {
+			loff_t zend = LLONG_MAX;
 			int rc;
 
+			if (zmap != NULL) {
+				loff_t pos = (lba_start0 << block_shift) + thislen;
+
+				zend = ((pos >> zmap->shift) + 1) << zmap->shift;
+				if (vdisk_zero_map_test(zmap, pos)) {
+					/* Already deallocated, skip it */
+					bytes = min_t(unsigned int, len,
+						PAGE_SIZE - off);
+					bytes = min_t(loff_t, bytes, zend - pos);
+					len -= bytes;
+					off += bytes;
+					if (off == PAGE_SIZE) {
+						pg++;
+						off = 0;
+					}
+					need_new_bio = 1;
+					lba_start0 += (thislen + bytes) >> block_shift;
+					thislen = 0;
+					continue;
+				}
+				zend -= pos;
+			}
+
 			if (need_new_bio) {
+				loff_t bio_off = lba_start0 << block_shift;
+
+				if (virt_dev->stripe_cnt != 0) {
+					int i = vdisk_stripe_map(virt_dev,
+						bio_off, &bio_off, &chunk_left);
+
+					bdev = virt_dev->stripe[i].bdev;
+				}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)
 				bio = bio_alloc_bioset(gfp_mask, max_nr_vecs, bs);
 #else
@@ -6780,9 +12768,9 @@ static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua)
 				need_new_bio = 0;
 				bio->bi_end_io = blockio_endio;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
-				bio->bi_iter.bi_sector = lba_start0 << (block_shift - 9);
+				bio->bi_iter.bi_sector = bio_off >> 9;
 #else
-				bio->bi_sector = lba_start0 << (block_shift - 9);
+				bio->bi_sector = bio_off >> 9;
 #endif
 				bio->bi_bdev = bdev;
 				bio->bi_private = blockio_work;
@@ -6811,6 +12799,9 @@ static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua)
 			}
 
 			bytes = min_t(unsigned int, len, PAGE_SIZE - off);
+			bytes = min_t(loff_t, bytes, chunk_left);
+			/* Not into the next granule, it can be deallocated */
+			bytes = min_t(loff_t, bytes, zend);
 
 			rc = bio_add_page(bio, pg, bytes, off);
 			if (rc < bytes) {
@@ -6824,10 +12815,21 @@ static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua)
 				continue;
 			}
 
-			pg++;
 			thislen += bytes;
 			len -= bytes;
-			off = 0;
+			off += bytes;
+			if (off == PAGE_SIZE) {
+				pg++;
+				off = 0;
+			}
+
+			chunk_left -= bytes;
+			if (chunk_left == 0) {
+				/* The rest goes to the next stripe member */
+				need_new_bio = 1;
+				lba_start0 += thislen >> block_shift;
+				thislen = 0;
+			}
 		}
 
 		lba_start += length >> block_shift;
@@ -6858,6 +12860,17 @@ static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
 	blk_finish_plug(&plug);
 #else
+	if (virt_dev->stripe_cnt != 0) {
+		int i;
+
+		for (i = 1; i < virt_dev->stripe_cnt; i++) {
+			struct request_queue *mq =
+				bdev_get_queue(virt_dev->stripe[i].bdev);
+
+			if (mq && mq->unplug_fn)
+				mq->unplug_fn(mq);
+		}
+	}
 	if (q && q->unplug_fn)
 		q->unplug_fn(q);
 #endif
@@ -6925,6 +12938,168 @@ out_put:
 }
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+static void vdisk_blockio_submit_flush(struct scst_vdisk_dev *virt_dev,
+	gfp_t gfp_mask);
+
+/* Completes all cmds waiting for the just finished coalesced FLUSH */
+static void vdisk_blockio_flush_done(struct scst_vdisk_dev *virt_dev,
+	int error)
+{
+	struct scst_cmd *cmd, *t;
+	unsigned long flags;
+	bool next;
+	LIST_HEAD(cmds);
+
+	TRACE_ENTRY();
+
+	spin_lock_irqsave(&virt_dev->flush_lock, flags);
+	list_splice_init(&virt_dev->flush_cmds, &cmds);
+	next = !list_empty(&virt_dev->flush_next_cmds);
+	if (!next)
+		virt_dev->flush_running = false;
+	spin_unlock_irqrestore(&virt_dev->flush_lock, flags);
+
+	/*
+	 * If !next, virt_dev must not be touched after this point, because
+	 * the device can be already destroyed once its last cmd is done.
+	 */
+	list_for_each_entry_safe(cmd, t, &cmds, cmd_list_entry) {
+		list_del(&cmd->cmd_list_entry);
+		if (unlikely(error != 0)) {
+			if (error == -ENOMEM)
+				scst_set_busy(cmd);
+			else
+				scst_set_cmd_error(cmd,
+					SCST_LOAD_SENSE(scst_sense_write_error));
+		}
+		cmd->completed = 1;
+		cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
+			scst_estimate_context());
+	}
+
+	if (next)
+		vdisk_blockio_submit_flush(virt_dev, GFP_ATOMIC);
+
+	TRACE_EXIT();
+	return;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+static void vdev_coalesced_flush_end_io(struct bio *bio, int error)
+{
+#else
+static void vdev_coalesced_flush_end_io(struct bio *bio)
+{
+	int error = bio->bi_error;
+#endif
+	struct scst_vdisk_dev *virt_dev = bio->bi_private;
+
+	TRACE_ENTRY();
+
+	if (unlikely(error != 0)) {
+		PRINT_ERROR("FLUSH bio failed: %d (dev %s)", error,
+			virt_dev->name);
+		virt_dev->flush_error = error;
+	}
+
+	bio_put(bio);
+
+	/* Striped devices are flushed once all their members are */
+	if (atomic_dec_and_test(&virt_dev->flush_bios_inflight))
+		vdisk_blockio_flush_done(virt_dev, virt_dev->flush_error);
+
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Submits FLUSH covering all cmds on flush_next_cmds. flush_running must be
+ * set by the caller.
+ */
+static void vdisk_blockio_submit_flush(struct scst_vdisk_dev *virt_dev,
+	gfp_t gfp_mask)
+{
+	struct bio *bios[VDISK_STRIPE_MAX_MEMBERS];
+	int i, cnt = max(virt_dev->stripe_cnt, 1);
+	unsigned long flags;
+
+	TRACE_ENTRY();
+
+	for (i = 0; i < cnt; i++) {
+		bios[i] = bio_alloc(gfp_mask, 0);
+		if (bios[i] == NULL)
+			break;
+	}
+
+	spin_lock_irqsave(&virt_dev->flush_lock, flags);
+	EXTRACHECKS_BUG_ON(!virt_dev->flush_running);
+	EXTRACHECKS_BUG_ON(!list_empty(&virt_dev->flush_cmds));
+	list_splice_init(&virt_dev->flush_next_cmds, &virt_dev->flush_cmds);
+	spin_unlock_irqrestore(&virt_dev->flush_lock, flags);
+
+	if (i < cnt) {
+		PRINT_ERROR("Unable to alloc FLUSH bio (dev %s)",
+			virt_dev->name);
+		while (--i >= 0)
+			bio_put(bios[i]);
+		vdisk_blockio_flush_done(virt_dev, -ENOMEM);
+		goto out;
+	}
+
+	virt_dev->flush_error = 0;
+	atomic_set(&virt_dev->flush_bios_inflight, cnt);
+
+	for (i = 0; i < cnt; i++) {
+		struct bio *bio = bios[i];
+
+		bio->bi_end_io = vdev_coalesced_flush_end_io;
+		bio->bi_private = virt_dev;
+		bio->bi_bdev = (virt_dev->stripe_cnt != 0) ?
+			virt_dev->stripe[i].bdev : virt_dev->bdev;
+		submit_bio(WRITE_FLUSH, bio);
+	}
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Group commit of cache flushes. If a FLUSH is already running on the
+ * device, cmd waits for the next one, which is submitted as soon as the
+ * running one finished and covers all cmds arrived meanwhile. So, any
+ * number of simultaneous SYNCHRONIZE CACHE cmds costs at most two
+ * backend flushes.
+ *
+ * While waiting, cmd->cmd_list_entry is used to queue cmd, it isn't used
+ * by SCST core during cmd's execution.
+ */
+static void vdisk_blockio_flush_coalesced(struct scst_vdisk_dev *virt_dev,
+	gfp_t gfp_mask, struct scst_cmd *cmd)
+{
+	unsigned long flags;
+	bool submit;
+
+	TRACE_ENTRY();
+
+	spin_lock_irqsave(&virt_dev->flush_lock, flags);
+	list_add_tail(&cmd->cmd_list_entry, &virt_dev->flush_next_cmds);
+	submit = !virt_dev->flush_running;
+	virt_dev->flush_running = true;
+	spin_unlock_irqrestore(&virt_dev->flush_lock, flags);
+
+	if (submit)
+		vdisk_blockio_submit_flush(virt_dev, gfp_mask);
+	else
+		TRACE_DBG("Cmd %p waits for the next FLUSH of dev %s", cmd,
+			virt_dev->name);
+
+	TRACE_EXIT();
+	return;
+}
+#endif
+
 static int vdisk_blockio_flush(struct block_device *bdev, gfp_t gfp_mask,
 	bool report_error, struct scst_cmd *cmd, bool async)
 {
@@ -7063,10 +13238,21 @@ static ssize_t blockio_rw_sync(struct scst_vdisk_dev *virt_dev, void *buf,
 	int max_nr_vecs, rc;
 	unsigned bytes, off;
 	ssize_t ret = -ENOMEM;
+	loff_t dev_off = *loff;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)) && (LINUX_VERSION_CODE <= KERNEL_VERSION(3, 6, 0))
 	bool submitted = false;
 #endif
 
+	if (virt_dev->stripe_cnt != 0) {
+		loff_t chunk_left;
+		int i = vdisk_stripe_map(virt_dev, *loff, &dev_off,
+				&chunk_left);
+
+		/* The caller will continue on the next member */
+		bdev = virt_dev->stripe[i].bdev;
+		len = min_t(loff_t, len, chunk_left);
+	}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
 	max_nr_vecs = BIO_MAX_PAGES;
 #else
@@ -7090,9 +13276,9 @@ static ssize_t blockio_rw_sync(struct scst_vdisk_dev *virt_dev, void *buf,
 	bio->bi_destructor = blockio_bio_destructor_sync;
 #endif
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-	bio->bi_sector = *loff >> 9;
+	bio->bi_sector = dev_off >> 9;
 #else
-	bio->bi_iter.bi_sector = *loff >> 9;
+	bio->bi_iter.bi_sector = dev_off >> 9;
 #endif
 	for (p = buf; p < buf + len; p += bytes) {
 		off = offset_in_page(p);
@@ -7152,7 +13338,14 @@ static ssize_t vdev_read_sync(struct scst_vdisk_dev *virt_dev, void *buf,
 {
 	ssize_t read, res;
 
-	if (virt_dev->nullio) {
+	if (virt_dev->ramdisk) {
+		res = vdisk_ramdisk_rw(virt_dev, buf, len, *loff, false,
+				GFP_KERNEL);
+		if (res < 0)
+			return res;
+		*loff += len;
+		return len;
+	} else if (virt_dev->nullio) {
 		return len;
 	} else if (virt_dev->blockio) {
 		for (read = 0; read < len; read += res) {
@@ -7162,6 +13355,23 @@ static ssize_t vdev_read_sync(struct scst_vdisk_dev *virt_dev, void *buf,
 				return res;
 		}
 		return read;
+	} else if (virt_dev->cow) {
+		res = vdisk_cow_read(virt_dev->cow_img, buf, len, *loff);
+		if (res < 0)
+			return res;
+		*loff += len;
+		return len;
+	} else if (virt_dev->cache != NULL) {
+		void *bounce = NULL;
+
+		/* Not worth promoting */
+		res = vdisk_cache_rw(virt_dev->cache, buf, len, *loff, false,
+			true, &bounce);
+		vfree(bounce);
+		if (res < 0)
+			return res;
+		*loff += len;
+		return len;
 	} else {
 		return fileio_read_sync(virt_dev->fd, buf, len, loff);
 	}
@@ -7286,12 +13496,19 @@ static enum compl_status_e fileio_exec_write_verify(struct vdisk_cmd_params *p)
 
 static enum compl_status_e nullio_exec_write_verify(struct vdisk_cmd_params *p)
 {
-	scst_dif_process_write(p->cmd);
-	return CMD_SUCCEEDED;
+	return nullio_exec_write(p);
 }
 
 static enum compl_status_e nullio_exec_verify(struct vdisk_cmd_params *p)
 {
+	return nullio_complete(p, false);
+}
+
+static enum compl_status_e ramdisk_exec_write_verify(struct vdisk_cmd_params *p)
+{
+	ramdisk_exec_write(p);
+	if (scsi_status_is_good(p->cmd->status))
+		vdev_exec_verify(p);
 	return CMD_SUCCEEDED;
 }
 
@@ -7502,10 +13719,22 @@ static void vdisk_report_registering(const struct scst_vdisk_dev *virt_dev)
 		i += snprintf(&buf[i], buf_size - i, "%sO_DIRECT",
 			(j == i) ? "(" : ", ");
 
-	if (virt_dev->nullio)
+	if (virt_dev->ramdisk)
+		i += snprintf(&buf[i], buf_size - i, "%sRAMDISK",
+			(j == i) ? "(" : ", ");
+	else if (virt_dev->nullio)
 		i += snprintf(&buf[i], buf_size - i, "%sNULLIO",
 			(j == i) ? "(" : ", ");
 
+	if (virt_dev->ramdisk_max_chunks != 0)
+		i += snprintf(&buf[i], buf_size - i, "%sMEM LIMIT %luMB",
+			(j == i) ? "(" : ", ", virt_dev->ramdisk_max_chunks <<
+			(VDISK_RAMDISK_CHUNK_SHIFT - 20));
+
+	if (virt_dev->ramdisk && (virt_dev->ramdisk_numa_node != NUMA_NO_NODE))
+		i += snprintf(&buf[i], buf_size - i, "%sNUMA NODE %d",
+			(j == i) ? "(" : ", ", virt_dev->ramdisk_numa_node);
+
 	if (virt_dev->blockio)
 		i += snprintf(&buf[i], buf_size - i, "%sBLOCKIO",
 			(j == i) ? "(" : ", ");
@@ -7542,6 +13771,19 @@ static void vdisk_report_registering(const struct scst_vdisk_dev *virt_dev)
 		i += snprintf(&buf[i], buf_size - i, "%sZERO_COPY",
 			(j == i) ? "(" : ", ");
 
+	if (virt_dev->cow)
+		i += snprintf(&buf[i], buf_size - i, "%sCOW",
+			(j == i) ? "(" : ", ");
+
+	if (virt_dev->cache_filename != NULL)
+		i += snprintf(&buf[i], buf_size - i, "%sCACHE",
+			(j == i) ? "(" : ", ");
+
+	if (virt_dev->stripe_cnt != 0)
+		i += snprintf(&buf[i], buf_size - i, "%sSTRIPED %d x %dKB",
+			(j == i) ? "(" : ", ", virt_dev->stripe_cnt,
+			1 << (virt_dev->stripe_shift - 10));
+
 	if (virt_dev->dummy)
 		i += snprintf(&buf[i], buf_size - i, "%sDUMMY",
 			(j == i) ? "(" : ", ");
@@ -7566,8 +13808,13 @@ static int vdisk_resync_size(struct scst_vdisk_dev *virt_dev)
 		goto out;
 	}
 
-	res = vdisk_get_file_size(virt_dev->filename,
-			virt_dev->blockio, &file_size);
+	if (virt_dev->cow)
+		res = vdisk_cow_get_size(virt_dev->filename, false, &file_size);
+	else if (virt_dev->stripe_cnt != 0)
+		res = vdisk_stripe_get_size(virt_dev, &file_size);
+	else
+		res = vdisk_get_file_size(virt_dev->filename,
+				virt_dev->blockio, &file_size);
 	if (res != 0)
 		goto out;
 
@@ -7671,6 +13918,19 @@ static int vdev_create(struct scst_dev_type *devt,
 	}
 
 	spin_lock_init(&virt_dev->flags_lock);
+	mutex_init(&virt_dev->fsync_mutex);
+	virt_dev->fsync_start = LLONG_MAX;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+	spin_lock_init(&virt_dev->flush_lock);
+	INIT_LIST_HEAD(&virt_dev->flush_cmds);
+	INIT_LIST_HEAD(&virt_dev->flush_next_cmds);
+#endif
+	spin_lock_init(&virt_dev->ramdisk_lock);
+	INIT_RADIX_TREE(&virt_dev->ramdisk_chunks, GFP_ATOMIC);
+	virt_dev->ramdisk_numa_node = NUMA_NO_NODE;
+	spin_lock_init(&virt_dev->nullio_lock);
+	/* Any not 0 seed, the same for all devices to be reproducible */
+	virt_dev->nullio_rnd = 0x2545F491;
 
 	virt_dev->vdev_devt = devt;
 
@@ -7746,8 +14006,19 @@ static void vdev_destroy(struct scst_vdisk_dev *virt_dev)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)
 	vdisk_free_bioset(virt_dev);
 #endif
+	if (virt_dev->ramdisk)
+		vdisk_ramdisk_free_all(virt_dev);
+	if (virt_dev->stripe != NULL) {
+		int i;
+
+		for (i = 0; i < virt_dev->stripe_cnt; i++)
+			kfree(virt_dev->stripe[i].filename);
+		kfree(virt_dev->stripe);
+	}
 	kfree(virt_dev->filename);
 	kfree(virt_dev->dif_filename);
+	kfree(virt_dev->cow_parent);
+	kfree(virt_dev->cache_filename);
 	kfree(virt_dev);
 	return;
 }
@@ -7853,6 +14124,54 @@ static int vdev_parse_add_dev_params(struct scst_vdisk_dev *virt_dev,
 			continue;
 		}
 
+		if (!strcasecmp("cow_parent", p)) {
+			if (virt_dev->cow_parent) {
+				PRINT_ERROR("%s specified more than once"
+					    " (device %s)", p, virt_dev->name);
+				res = -EINVAL;
+				goto out;
+			}
+			if (*pp != '/') {
+				PRINT_ERROR("COW parent %s must be global "
+					"(device %s)", pp, virt_dev->name);
+				res = -EINVAL;
+				goto out;
+			}
+
+			virt_dev->cow_parent = kstrdup(pp, GFP_KERNEL);
+			if (virt_dev->cow_parent == NULL) {
+				PRINT_ERROR("Unable to duplicate COW parent %s "
+					"(device %s)", pp, virt_dev->name);
+				res = -ENOMEM;
+				goto out;
+			}
+			continue;
+		}
+
+		if (!strcasecmp("cache_filename", p)) {
+			if (virt_dev->cache_filename) {
+				PRINT_ERROR("%s specified more than once"
+					    " (device %s)", p, virt_dev->name);
+				res = -EINVAL;
+				goto out;
+			}
+			if (*pp != '/') {
+				PRINT_ERROR("Cache file name %s must be global "
+					"(device %s)", pp, virt_dev->name);
+				res = -EINVAL;
+				goto out;
+			}
+
+			virt_dev->cache_filename = kstrdup(pp, GFP_KERNEL);
+			if (virt_dev->cache_filename == NULL) {
+				PRINT_ERROR("Unable to duplicate cache file name "
+					"%s (device %s)", pp, virt_dev->name);
+				res = -ENOMEM;
+				goto out;
+			}
+			continue;
+		}
+
 		if (!strcasecmp("dif_mode", p)) {
 			char *d = pp;
 
@@ -7944,10 +14263,105 @@ static int vdev_parse_add_dev_params(struct scst_vdisk_dev *virt_dev,
 				virt_dev->thin_provisioned);
 		} else if (!strcasecmp("zero_copy", p)) {
 			virt_dev->zero_copy = !!val;
+		} else if (!strcasecmp("zero_detect", p)) {
+			virt_dev->zero_detect = !!val;
+			TRACE_DBG("ZERO DETECT %d", virt_dev->zero_detect);
+		} else if (!strcasecmp("cow", p)) {
+			virt_dev->cow = !!val;
+			TRACE_DBG("COW %d", virt_dev->cow);
+		} else if (!strcasecmp("stripe_chunk_kb", p)) {
+			if ((val < 4) || (val > 1024 * 1024) ||
+			    !is_power_of_2(val)) {
+				PRINT_ERROR("Invalid stripe chunk size %lld KB "
+					"(device %s)", val, virt_dev->name);
+				res = -EINVAL;
+				goto out;
+			}
+			virt_dev->stripe_shift = ilog2(val) + 10;
+			TRACE_DBG("STRIPE CHUNK %lld KB", val);
+		} else if (!strcasecmp("cache_block_kb", p)) {
+			if ((val < 4) || (val > 4096) || !is_power_of_2(val)) {
+				PRINT_ERROR("Invalid cache block size %lld KB "
+					"(device %s)", val, virt_dev->name);
+				res = -EINVAL;
+				goto out;
+			}
+			virt_dev->cache_block_shift = ilog2(val) + 10;
+			TRACE_DBG("CACHE BLOCK %lld KB", val);
+		} else if (!strcasecmp("cache_seq_cutoff_kb", p)) {
+			if (val > UINT_MAX) {
+				res = -EINVAL;
+				goto out;
+			}
+			virt_dev->cache_seq_cutoff_kb = val;
+			TRACE_DBG("CACHE SEQ CUTOFF %lld KB", val);
+		} else if (!strcasecmp("delay_us", p) ||
+			   !strcasecmp("delay_jitter_us", p)) {
+			if (val > VDISK_NULLIO_MAX_DELAY_US) {
+				PRINT_ERROR("Invalid %s %lld (device %s)", p,
+					val, virt_dev->name);
+				res = -EINVAL;
+				goto out;
+			}
+			if (!strcasecmp("delay_us", p))
+				virt_dev->nullio_delay_us = val;
+			else
+				virt_dev->nullio_jitter_us = val;
+			TRACE_DBG("%s %lld", p, val);
+		} else if (!strcasecmp("bw_mb", p)) {
+			if (val > UINT_MAX) {
+				res = -EINVAL;
+				goto out;
+			}
+			virt_dev->nullio_bw_mb = val;
+			TRACE_DBG("BW %lld MB/s", val);
+		} else if (!strcasecmp("error_interval", p)) {
+			if (val > UINT_MAX) {
+				res = -EINVAL;
+				goto out;
+			}
+			virt_dev->nullio_error_interval = val;
+			TRACE_DBG("ERROR INTERVAL %lld", val);
+		} else if (!strcasecmp("delay_dist", p)) {
+			if (val > VDISK_NULLIO_DIST_NORMAL) {
+				PRINT_ERROR("Invalid delay_dist %lld (device "
+					"%s)", val, virt_dev->name);
+				res = -EINVAL;
+				goto out;
+			}
+			virt_dev->nullio_delay_dist = val;
+			TRACE_DBG("DELAY DIST %lld", val);
+		} else if (!strcasecmp("pattern", p)) {
+			virt_dev->nullio_pattern = !!val;
+			TRACE_DBG("PATTERN %d", virt_dev->nullio_pattern);
+		} else if (!strcasecmp("ra_cache_mb", p)) {
+			if (val > VDISK_RA_MAX_CACHE_MB) {
+				PRINT_ERROR("Invalid readahead cache size %lld MB "
+					"(device %s)", val, virt_dev->name);
+				res = -EINVAL;
+				goto out;
+			}
+			virt_dev->ra_cache_mb = val;
+			TRACE_DBG("RA CACHE %lld MB", val);
 		} else if (!strcasecmp("size", p)) {
 			virt_dev->file_size = val;
 		} else if (!strcasecmp("size_mb", p)) {
 			virt_dev->file_size = val * 1024 * 1024;
+		} else if (!strcasecmp("mem_limit_mb", p)) {
+			/* Rounded up to the whole chunks */
+			virt_dev->ramdisk_max_chunks = DIV_ROUND_UP(val,
+				VDISK_RAMDISK_CHUNK_SIZE >> 20);
+			TRACE_DBG("MEM LIMIT %lld MB (%lu chunks)", val,
+				virt_dev->ramdisk_max_chunks);
+		} else if (!strcasecmp("numa_node", p)) {
+			if ((val >= MAX_NUMNODES) || !node_online(val)) {
+				PRINT_ERROR("Invalid NUMA node %lld (device %s)",
+					val, virt_dev->name);
+				res = -EINVAL;
+				goto out;
+			}
+			virt_dev->ramdisk_numa_node = val;
+			TRACE_DBG("NUMA NODE %d", virt_dev->ramdisk_numa_node);
 		} else if (!strcasecmp("cluster_mode", p)) {
 			virt_dev->initial_cluster_mode = val;
 			TRACE_DBG("CLUSTER_MODE %d",
@@ -7975,12 +14389,57 @@ static int vdev_parse_add_dev_params(struct scst_vdisk_dev *virt_dev,
 		}
 	}
 
-	if ((virt_dev->file_size & ((1 << virt_dev->blk_shift) - 1)) != 0) {
-		PRINT_ERROR("Device size %lld is not a multiple of the block"
-			    " size %d", virt_dev->file_size,
-			    1 << virt_dev->blk_shift);
+	if ((virt_dev->file_size & ((1 << virt_dev->blk_shift) - 1)) != 0) {
+		PRINT_ERROR("Device size %lld is not a multiple of the block"
+			    " size %d", virt_dev->file_size,
+			    1 << virt_dev->blk_shift);
+		res = -EINVAL;
+	}
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * Creates the COW image of a new vdisk_fileio device, if it doesn't exist yet.
+ * An existing image is used as is.
+ */
+static int vdev_fileio_prepare_cow(struct scst_vdisk_dev *virt_dev)
+{
+	struct file *fd;
+	int res = 0;
+
+	TRACE_ENTRY();
+
+	fd = filp_open(virt_dev->filename, O_LARGEFILE | O_RDONLY, 0600);
+	if (!IS_ERR(fd)) {
+		filp_close(fd, NULL);
+		if ((virt_dev->cow_parent != NULL) || (virt_dev->file_size != 0)) {
+			PRINT_ERROR("COW image %s already exists, cow_parent "
+				"and size can't be specified (device %s)",
+				virt_dev->filename, virt_dev->name);
+			res = -EEXIST;
+		}
+		goto out;
+	}
+
+	res = PTR_ERR(fd);
+	if (res != -ENOENT) {
+		PRINT_ERROR("filp_open(%s) failed: %d (device %s)",
+			virt_dev->filename, res, virt_dev->name);
+		goto out;
+	}
+
+	if (virt_dev->rd_only) {
+		PRINT_ERROR("Unable to create COW image %s of read only "
+			"device %s", virt_dev->filename, virt_dev->name);
 		res = -EINVAL;
+		goto out;
 	}
+
+	res = vdisk_cow_create_image(virt_dev->filename, virt_dev->file_size,
+		virt_dev->cow_parent);
+
 out:
 	TRACE_EXIT_RES(res);
 	return res;
@@ -8003,6 +14462,7 @@ static int vdev_fileio_add_device(const char *device_name, char *params)
 	virt_dev->wt_flag = DEF_WRITE_THROUGH;
 	virt_dev->nv_cache = DEF_NV_CACHE;
 	virt_dev->o_direct_flag = DEF_O_DIRECT;
+	virt_dev->cache_seq_cutoff_kb = DEF_CACHE_SEQ_CUTOFF_KB;
 
 	res = vdev_parse_add_dev_params(virt_dev, params, NULL);
 	if (res != 0)
@@ -8021,6 +14481,37 @@ static int vdev_fileio_add_device(const char *device_name, char *params)
 		goto out_destroy;
 	}
 
+	if (virt_dev->cow) {
+		res = vdev_fileio_prepare_cow(virt_dev);
+		if (res != 0)
+			goto out_destroy;
+	} else if (virt_dev->cow_parent != NULL) {
+		PRINT_ERROR("cow_parent requires cow (device %s)",
+			virt_dev->name);
+		res = -EINVAL;
+		goto out_destroy;
+	}
+
+	if (virt_dev->cache_filename != NULL) {
+		if (virt_dev->cow || virt_dev->rd_only ||
+		    !strcmp(virt_dev->cache_filename, virt_dev->filename)) {
+			PRINT_ERROR("Cache %s can't be used with COW, read only "
+				"or its own file (device %s)",
+				virt_dev->cache_filename, virt_dev->name);
+			res = -EINVAL;
+			goto out_destroy;
+		}
+		if (virt_dev->cache_block_shift == 0)
+			virt_dev->cache_block_shift =
+				ilog2(DEF_CACHE_BLOCK_KB) + 10;
+	} else if ((virt_dev->cache_block_shift != 0) ||
+		   (virt_dev->cache_seq_cutoff_kb != DEF_CACHE_SEQ_CUTOFF_KB)) {
+		PRINT_ERROR("cache_block_kb and cache_seq_cutoff_kb require "
+			"cache_filename (device %s)", virt_dev->name);
+		res = -EINVAL;
+		goto out_destroy;
+	}
+
 	list_add_tail(&virt_dev->vdev_list_entry, &vdev_list);
 
 	vdisk_report_registering(virt_dev);
@@ -8056,7 +14547,8 @@ static int vdev_blockio_add_device(const char *device_name, char *params)
 					 "rotational", "cluster_mode",
 					 "thin_provisioned", "tst",
 					 "dif_mode", "dif_type", "dif_static_app_tag",
-					 "dif_filename", NULL };
+					 "dif_filename", "stripe_chunk_kb",
+					 "zero_detect", "ra_cache_mb", NULL };
 	struct scst_vdisk_dev *virt_dev;
 
 	TRACE_ENTRY();
@@ -8082,6 +14574,27 @@ static int vdev_blockio_add_device(const char *device_name, char *params)
 		goto out_destroy;
 	}
 
+	if ((virt_dev->ra_cache_mb != 0) &&
+	    (virt_dev->dif_mode != SCST_DIF_MODE_NONE)) {
+		PRINT_ERROR("ra_cache_mb can't be used together with DIF "
+			"(device %s)", virt_dev->name);
+		res = -EINVAL;
+		goto out_destroy;
+	}
+
+	if (strchr(virt_dev->filename, ',') != NULL) {
+		if (virt_dev->stripe_shift == 0)
+			virt_dev->stripe_shift = ilog2(DEF_STRIPE_CHUNK_KB) + 10;
+		res = vdisk_stripe_init(virt_dev);
+		if (res != 0)
+			goto out_destroy;
+	} else if (virt_dev->stripe_shift != 0) {
+		PRINT_ERROR("stripe_chunk_kb requires several comma separated "
+			"file names (device %s)", virt_dev->name);
+		res = -EINVAL;
+		goto out_destroy;
+	}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)
 	res = vdisk_create_bioset(virt_dev);
 	if (res != 0)
@@ -8121,7 +14634,8 @@ static int vdev_nullio_add_device(const char *device_name, char *params)
 	static const char *const allowed_params[] = {
 		"read_only", "dummy", "removable", "blocksize", "rotational",
 		"dif_mode", "dif_type", "dif_static_app_tag",
-		"size", "size_mb", "tst", NULL
+		"size", "size_mb", "tst", "delay_us", "delay_jitter_us",
+		"delay_dist", "bw_mb", "error_interval", "pattern", NULL
 	};
 	struct scst_vdisk_dev *virt_dev;
 
@@ -8166,6 +14680,66 @@ out_destroy:
 	goto out;
 }
 
+/* scst_vdisk_mutex supposed to be held */
+static int vdev_ramdisk_add_device(const char *device_name, char *params)
+{
+	int res = 0;
+	static const char *const allowed_params[] = {
+		"read_only", "removable", "blocksize", "rotational",
+		"size", "size_mb", "tst", "thin_provisioned", "zero_copy",
+		"mem_limit_mb", "numa_node", NULL
+	};
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	res = vdev_create(&vdisk_ramdisk_devtype, device_name, &virt_dev);
+	if (res != 0)
+		goto out;
+
+	virt_dev->command_set_version = 0x04C0; /* SBC-3 */
+
+	virt_dev->nullio = 1;
+	virt_dev->ramdisk = 1;
+	virt_dev->rotational = 0;
+	virt_dev->zero_copy = 1;
+
+	res = vdev_parse_add_dev_params(virt_dev, params, allowed_params);
+	if (res != 0)
+		goto out_destroy;
+
+	if (virt_dev->file_size == 0) {
+		PRINT_ERROR("Size of RAM disk %s not specified", virt_dev->name);
+		res = -EINVAL;
+		goto out_destroy;
+	}
+
+	list_add_tail(&virt_dev->vdev_list_entry, &vdev_list);
+
+	vdisk_report_registering(virt_dev);
+
+	virt_dev->virt_id = scst_register_virtual_device(virt_dev->vdev_devt,
+					virt_dev->name);
+	if (virt_dev->virt_id < 0) {
+		res = virt_dev->virt_id;
+		goto out_del;
+	}
+
+	TRACE_DBG("Registered virt_dev %s with id %d", virt_dev->name,
+		virt_dev->virt_id);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_del:
+	list_del(&virt_dev->vdev_list_entry);
+
+out_destroy:
+	vdev_destroy(virt_dev);
+	goto out;
+}
+
 static ssize_t vdisk_add_fileio_device(const char *device_name, char *params)
 {
 	int res;
@@ -8225,6 +14799,25 @@ out:
 
 }
 
+static ssize_t vdisk_add_ramdisk_device(const char *device_name, char *params)
+{
+	int res;
+
+	TRACE_ENTRY();
+
+	res = mutex_lock_interruptible(&scst_vdisk_mutex);
+	if (res)
+		goto out;
+
+	res = vdev_ramdisk_add_device(device_name, params);
+
+	mutex_unlock(&scst_vdisk_mutex);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 #endif /* CONFIG_SCST_PROC */
 
 /* scst_vdisk_mutex supposed to be held */
@@ -8520,12 +15113,18 @@ static ssize_t vdisk_sysfs_sync_store(struct kobject *kobj,
 
 	if (virt_dev->nullio)
 		res = 0;
+	else if (virt_dev->stripe_cnt != 0)
+		res = virt_dev->fd ? vdisk_stripe_flush(virt_dev, GFP_KERNEL) : 0;
 	else if (virt_dev->blockio)
 		res = vdisk_blockio_flush(virt_dev->bdev, GFP_KERNEL, false,
 					  NULL, false);
+	else if (virt_dev->cow)
+		res = virt_dev->cow_img ? vdisk_cow_flush(virt_dev->cow_img) : 0;
 	else
 		res = __vdisk_fsync_fileio(0, i_size_read(file_inode(virt_dev->fd)),
 					   dev, NULL, virt_dev->fd);
+	if ((res == 0) && (virt_dev->cache != NULL))
+		res = vdisk_cache_sync(virt_dev->cache);
 
 	return res ? : count;
 }
@@ -8593,6 +15192,161 @@ out_free:
 	goto out;
 }
 
+/*
+ * Freezes the current COW image of the device and redirects all further
+ * writes to a new empty COW image @work->buf on top of it.
+ */
+static int vdisk_sysfs_process_snapshot_store(struct scst_sysfs_work_item *work)
+{
+	struct scst_device *dev = work->dev;
+	struct scst_vdisk_dev *virt_dev;
+	struct vdisk_cow_image *new_img = NULL;
+	struct file *new_fd = NULL;
+	char *p, *new_fn, *old_fn;
+	int res;
+
+	TRACE_ENTRY();
+
+	/* It's safe, since we taken dev_kobj and dh_priv NULLed in attach() */
+	virt_dev = dev->dh_priv;
+
+	p = work->buf;
+	while (isspace(*p) && (*p != '\0'))
+		p++;
+	new_fn = p;
+	while (!isspace(*p) && (*p != '\0'))
+		p++;
+	*p = '\0';
+
+	if (*new_fn != '/') {
+		PRINT_ERROR("File path \"%s\" is not absolute", new_fn);
+		res = -EINVAL;
+		goto out_put;
+	}
+
+	if (!virt_dev->cow) {
+		PRINT_ERROR("Device %s is not a COW device", virt_dev->name);
+		res = -EINVAL;
+		goto out_put;
+	}
+
+	if (virt_dev->rd_only) {
+		PRINT_ERROR("Unable to snapshot read only device %s",
+			virt_dev->name);
+		res = -EINVAL;
+		goto out_put;
+	}
+
+	new_fn = kstrdup(new_fn, GFP_KERNEL);
+	if (new_fn == NULL) {
+		PRINT_ERROR("%s", "Allocation of filename failed");
+		res = -ENOMEM;
+		goto out_put;
+	}
+
+	res = scst_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
+	if (res != 0)
+		goto out_free;
+
+	/* To sync with detach*() functions */
+	mutex_lock(&scst_mutex);
+
+	if (virt_dev->cow_img != NULL) {
+		res = vdisk_cow_flush(virt_dev->cow_img);
+		if (res != 0)
+			goto out_unlock;
+	}
+
+	res = vdisk_cow_create_image(new_fn, virt_dev->file_size,
+		virt_dev->filename);
+	if (res != 0)
+		goto out_unlock;
+
+	if (virt_dev->fd != NULL) {
+		new_fd = vdev_open_fd(virt_dev, new_fn, dev->dev_rd_only);
+		if (IS_ERR(new_fd)) {
+			res = PTR_ERR(new_fd);
+			goto out_unlock;
+		}
+		new_img = vdisk_cow_open_image(new_fn, new_fd,
+				dev->dev_rd_only, 0);
+		if (IS_ERR(new_img)) {
+			res = PTR_ERR(new_img);
+			filp_close(new_fd, NULL);
+			goto out_unlock;
+		}
+
+		vdisk_cow_close_image(virt_dev->cow_img);
+		filp_close(virt_dev->fd, NULL);
+		virt_dev->cow_img = new_img;
+		virt_dev->fd = new_fd;
+	}
+
+	old_fn = virt_dev->filename;
+	virt_dev->filename = new_fn;
+	new_fn = old_fn;
+
+	PRINT_INFO("Device %s: COW image %s frozen, new image %s",
+		virt_dev->name, old_fn, virt_dev->filename);
+
+out_unlock:
+	mutex_unlock(&scst_mutex);
+	scst_resume_activity();
+
+out_free:
+	kfree(new_fn);
+
+out_put:
+	kobject_put(&dev->dev_kobj);
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static ssize_t vdisk_sysfs_snapshot_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	char *i_buf;
+	struct scst_sysfs_work_item *work;
+	struct scst_device *dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	i_buf = kasprintf(GFP_KERNEL, "%.*s", (int)count, buf);
+	if (i_buf == NULL) {
+		PRINT_ERROR("Unable to alloc intermediate buffer with size %zd",
+			count+1);
+		res = -ENOMEM;
+		goto out;
+	}
+
+	res = scst_alloc_sysfs_work(vdisk_sysfs_process_snapshot_store,
+					false, &work);
+	if (res != 0)
+		goto out_free;
+
+	work->buf = i_buf;
+	work->dev = dev;
+
+	SCST_SET_DEP_MAP(work, &scst_dev_dep_map);
+	kobject_get(&dev->dev_kobj);
+
+	res = scst_sysfs_queue_wait_work(work);
+	if (res == 0)
+		res = count;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_free:
+	kfree(i_buf);
+	goto out;
+}
+
 static int vdev_size_process_store(struct scst_sysfs_work_item *work)
 {
 	struct scst_device *dev = work->dev;
@@ -8621,6 +15375,9 @@ static int vdev_size_process_store(struct scst_sysfs_work_item *work)
 	queue_ua = (virt_dev->fd != NULL);
 
 	if ((new_size & ((1 << virt_dev->blk_shift) - 1)) == 0) {
+		if (virt_dev->ramdisk && (new_size < virt_dev->file_size))
+			vdisk_ramdisk_unmap(virt_dev, new_size,
+				virt_dev->file_size - new_size);
 		virt_dev->file_size = new_size;
 		virt_dev->nblocks = virt_dev->file_size >> dev->block_shift;
 		virt_dev->size_key = 1;
@@ -8909,35 +15666,110 @@ static ssize_t vdev_sysfs_rz_show(struct kobject *kobj,
 {
 	struct scst_device *dev = container_of(kobj, struct scst_device,
 					       dev_kobj);
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
-	bool read_zero = virt_dev->read_zero;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	bool read_zero = virt_dev->read_zero;
+
+	return sprintf(buf, "%d\n%s", read_zero, read_zero != DEF_READ_ZERO ?
+		       SCST_SYSFS_KEY_MARK "\n" : "");
+}
+
+static ssize_t vdev_sysfs_rz_store(struct kobject *kobj,
+				   struct kobj_attribute *attr, const char *buf,
+				   size_t count)
+{
+	struct scst_device *dev = container_of(kobj, struct scst_device,
+					       dev_kobj);
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	long read_zero;
+	int res;
+	char ch[16];
+
+	sprintf(ch, "%.*s", min_t(int, sizeof(ch) - 1, count), buf);
+	res = kstrtol(ch, 0, &read_zero);
+	if (res)
+		goto out;
+	res = -EINVAL;
+	if (read_zero != 0 && read_zero != 1)
+		goto out;
+
+	spin_lock(&virt_dev->flags_lock);
+	virt_dev->read_zero = read_zero;
+	spin_unlock(&virt_dev->flags_lock);
+
+	res = count;
+
+out:
+	return res;
+}
+
+/* Returns the vdisk_nullio setting of @attr and its max value */
+static unsigned int *vdev_nullio_attr_val(struct scst_vdisk_dev *virt_dev,
+	struct kobj_attribute *attr, unsigned int *max)
+{
+	*max = UINT_MAX;
+	if (attr == &vdev_nullio_delay_us_attr) {
+		*max = VDISK_NULLIO_MAX_DELAY_US;
+		return &virt_dev->nullio_delay_us;
+	} else if (attr == &vdev_nullio_delay_jitter_us_attr) {
+		*max = VDISK_NULLIO_MAX_DELAY_US;
+		return &virt_dev->nullio_jitter_us;
+	} else if (attr == &vdev_nullio_delay_dist_attr) {
+		*max = VDISK_NULLIO_DIST_NORMAL;
+		return &virt_dev->nullio_delay_dist;
+	} else if (attr == &vdev_nullio_bw_mb_attr) {
+		return &virt_dev->nullio_bw_mb;
+	} else if (attr == &vdev_nullio_error_interval_attr) {
+		return &virt_dev->nullio_error_interval;
+	}
+
+	sBUG_ON(attr != &vdev_nullio_pattern_attr);
+	*max = 1;
+	return &virt_dev->nullio_pattern;
+}
+
+static ssize_t vdev_sysfs_nullio_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev = container_of(kobj, struct scst_device,
+					       dev_kobj);
+	unsigned int max, val;
 
-	return sprintf(buf, "%d\n%s", read_zero, read_zero != DEF_READ_ZERO ?
-		       SCST_SYSFS_KEY_MARK "\n" : "");
+	val = *vdev_nullio_attr_val(dev->dh_priv, attr, &max);
+
+	return sprintf(buf, "%u\n%s", val,
+		       (val != 0) ? SCST_SYSFS_KEY_MARK "\n" : "");
 }
 
-static ssize_t vdev_sysfs_rz_store(struct kobject *kobj,
-				   struct kobj_attribute *attr, const char *buf,
-				   size_t count)
+static ssize_t vdev_sysfs_nullio_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
 {
 	struct scst_device *dev = container_of(kobj, struct scst_device,
 					       dev_kobj);
 	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
-	long read_zero;
+	unsigned int *pval, max;
+	unsigned long val;
 	int res;
 	char ch[16];
 
 	sprintf(ch, "%.*s", min_t(int, sizeof(ch) - 1, count), buf);
-	res = kstrtol(ch, 0, &read_zero);
+	res = kstrtoul(ch, 0, &val);
 	if (res)
 		goto out;
+
+	pval = vdev_nullio_attr_val(virt_dev, attr, &max);
 	res = -EINVAL;
-	if (read_zero != 0 && read_zero != 1)
+	if (val > max)
 		goto out;
 
-	spin_lock(&virt_dev->flags_lock);
-	virt_dev->read_zero = read_zero;
-	spin_unlock(&virt_dev->flags_lock);
+	spin_lock(&virt_dev->nullio_lock);
+	*pval = val;
+	/* Start from an idle link and interval */
+	virt_dev->nullio_bw_next = 0;
+	virt_dev->nullio_cmd_cnt = 0;
+	spin_unlock(&virt_dev->nullio_lock);
+
+	PRINT_INFO("%s of dev %s changed to %lu", attr->attr.name,
+		virt_dev->name, val);
 
 	res = count;
 
@@ -8945,6 +15777,24 @@ out:
 	return res;
 }
 
+static ssize_t vdev_sysfs_nullio_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev = container_of(kobj, struct scst_device,
+					       dev_kobj);
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	struct vdisk_nullio_stats s;
+
+	spin_lock(&virt_dev->nullio_lock);
+	s = virt_dev->nullio_stats;
+	spin_unlock(&virt_dev->nullio_lock);
+
+	return sprintf(buf, "%-20s %llu\n%-20s %llu\n%-20s %llu\n",
+		"Delayed cmds", (unsigned long long)s.delayed,
+		"Injected errors", (unsigned long long)s.injected,
+		"Pattern miscompares", (unsigned long long)s.miscompares);
+}
+
 static ssize_t vdisk_sysfs_removable_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf)
 {
@@ -9915,6 +16765,66 @@ static ssize_t vdev_zero_copy_show(struct kobject *kobj,
 	return pos;
 }
 
+static ssize_t vdev_ramdisk_mem_used_mb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	pos = sprintf(buf, "%lu\n", ACCESS_ONCE(virt_dev->ramdisk_chunks_cnt) <<
+		(VDISK_RAMDISK_CHUNK_SHIFT - 20));
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdev_ramdisk_mem_limit_mb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	pos = sprintf(buf, "%lu\n%s", virt_dev->ramdisk_max_chunks <<
+		(VDISK_RAMDISK_CHUNK_SHIFT - 20),
+		(virt_dev->ramdisk_max_chunks != 0) ?
+			SCST_SYSFS_KEY_MARK "\n" : "");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdev_ramdisk_numa_node_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	pos = sprintf(buf, "%d\n%s", virt_dev->ramdisk_numa_node,
+		(virt_dev->ramdisk_numa_node != NUMA_NO_NODE) ?
+			SCST_SYSFS_KEY_MARK "\n" : "");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
 static ssize_t vdev_dif_filename_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf)
 {
@@ -9934,6 +16844,228 @@ static ssize_t vdev_dif_filename_show(struct kobject *kobj,
 	return pos;
 }
 
+static ssize_t vdisk_sysfs_cow_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	pos = sprintf(buf, "%d\n%s", virt_dev->cow,
+		virt_dev->cow ? SCST_SYSFS_KEY_MARK "\n" : "");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_sysfs_stripe_chunk_kb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	if (virt_dev->stripe_cnt != 0)
+		pos = sprintf(buf, "%d\n%s", 1 << (virt_dev->stripe_shift - 10),
+			(virt_dev->stripe_shift != ilog2(DEF_STRIPE_CHUNK_KB) + 10) ?
+				SCST_SYSFS_KEY_MARK "\n" : "");
+	else
+		pos = sprintf(buf, "0\n");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_sysfs_cache_filename_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	pos = sprintf(buf, "%s\n%s", virt_dev->cache_filename,
+		(virt_dev->cache_filename != NULL) ? SCST_SYSFS_KEY_MARK "\n" : "");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_sysfs_cache_block_kb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	pos = sprintf(buf, "%d\n%s", 1 << (virt_dev->cache_block_shift - 10),
+		(virt_dev->cache_block_shift != ilog2(DEF_CACHE_BLOCK_KB) + 10) ?
+			SCST_SYSFS_KEY_MARK "\n" : "");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_sysfs_cache_seq_cutoff_kb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	pos = sprintf(buf, "%u\n%s", virt_dev->cache_seq_cutoff_kb,
+		(virt_dev->cache_seq_cutoff_kb != DEF_CACHE_SEQ_CUTOFF_KB) ?
+			SCST_SYSFS_KEY_MARK "\n" : "");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_sysfs_cache_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct vdisk_cache_stats *s;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	s = &((struct scst_vdisk_dev *)dev->dh_priv)->cache_stats;
+
+	pos = sprintf(buf, "%-20s %u\n%-20s %u\n%-20s %u\n"
+		"%-20s %llu\n%-20s %llu\n%-20s %llu\n%-20s %llu\n"
+		"%-20s %llu\n%-20s %llu\n",
+		"Blocks", s->blocks, "Used blocks", s->used_blocks,
+		"Dirty blocks", s->dirty_blocks,
+		"Read hits", (unsigned long long)s->read_hits,
+		"Read misses", (unsigned long long)s->read_misses,
+		"Write hits", (unsigned long long)s->write_hits,
+		"Write misses", (unsigned long long)s->write_misses,
+		"Bypassed cmds", (unsigned long long)s->bypassed,
+		"Destaged blocks", (unsigned long long)s->destaged);
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_sysfs_zero_detect_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	pos = sprintf(buf, "%d\n%s", virt_dev->zero_detect,
+		virt_dev->zero_detect ? SCST_SYSFS_KEY_MARK "\n" : "");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_sysfs_zero_bytes_saved_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+	u64 saved;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	spin_lock(&virt_dev->flags_lock);
+	saved = virt_dev->zero_bytes_saved;
+	spin_unlock(&virt_dev->flags_lock);
+
+	pos = sprintf(buf, "%llu\n", (unsigned long long)saved);
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_sysfs_ra_cache_mb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	pos = sprintf(buf, "%u\n%s", virt_dev->ra_cache_mb,
+		(virt_dev->ra_cache_mb != 0) ? SCST_SYSFS_KEY_MARK "\n" : "");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_sysfs_ra_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+	struct vdisk_ra_stats s;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	if (virt_dev->ra != NULL) {
+		spin_lock_irq(&virt_dev->ra->lock);
+		s = virt_dev->ra_stats;
+		spin_unlock_irq(&virt_dev->ra->lock);
+	} else
+		memset(&s, 0, sizeof(s));
+
+	pos = sprintf(buf, "%-20s %llu\n%-20s %llu\n%-20s %llu\n"
+		"%-20s %llu\n%-20s %llu\n",
+		"Hits", (unsigned long long)s.hits,
+		"Misses", (unsigned long long)s.misses,
+		"Extents read ahead", (unsigned long long)s.extents,
+		"Unused extents", (unsigned long long)s.unused,
+		"Invalidated extents", (unsigned long long)s.invalidated);
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
 #else /* CONFIG_SCST_PROC */
 
 /*
@@ -10702,6 +17834,7 @@ static int __init init_scst_vdisk_driver(void)
 	init_ops(fileio_ops, ARRAY_SIZE(fileio_ops));
 	init_ops(blockio_ops, ARRAY_SIZE(blockio_ops));
 	init_ops(nullio_ops, ARRAY_SIZE(nullio_ops));
+	init_ops(ramdisk_ops, ARRAY_SIZE(ramdisk_ops));
 
 	res = vdev_check_mode_pages_path();
 	if (res != 0)
@@ -10721,6 +17854,24 @@ static int __init init_scst_vdisk_driver(void)
 		goto out_free_vdisk_cache;
 	}
 
+	nullio_timer_cachep = KMEM_CACHE(vdisk_nullio_timer,
+				SCST_SLAB_FLAGS|SLAB_HWCACHE_ALIGN);
+	if (nullio_timer_cachep == NULL) {
+		res = -ENOMEM;
+		goto out_free_slab;
+	}
+
+	/*
+	 * Readahead extents must not be clustered: blockio_alloc_data_buf()
+	 * expects one page per sg entry.
+	 */
+	vdisk_ra_pool = sgv_pool_create("vdisk-ra", sgv_no_clustering,
+			VDISK_RA_EXTENT_SIZE >> PAGE_SHIFT, false, 0);
+	if (vdisk_ra_pool == NULL) {
+		res = -ENOMEM;
+		goto out_free_nullio_slab;
+	}
+
 	if (num_threads < 1) {
 		PRINT_ERROR("num_threads can not be less than 1, use "
 			"default %d", DEF_NUM_THREADS);
@@ -10732,7 +17883,7 @@ static int __init init_scst_vdisk_driver(void)
 
 	res = init_scst_vdisk(&vdisk_file_devtype);
 	if (res != 0)
-		goto out_free_slab;
+		goto out_free_ra_pool;
 
 	res = init_scst_vdisk(&vdisk_blk_devtype);
 	if (res != 0)
@@ -10742,13 +17893,20 @@ static int __init init_scst_vdisk_driver(void)
 	if (res != 0)
 		goto out_free_blk;
 
-	res = init_scst_vdisk(&vcdrom_devtype);
+	res = init_scst_vdisk(&vdisk_ramdisk_devtype);
 	if (res != 0)
 		goto out_free_null;
 
+	res = init_scst_vdisk(&vcdrom_devtype);
+	if (res != 0)
+		goto out_free_ramdisk;
+
 out:
 	return res;
 
+out_free_ramdisk:
+	exit_scst_vdisk(&vdisk_ramdisk_devtype);
+
 out_free_null:
 	exit_scst_vdisk(&vdisk_null_devtype);
 
@@ -10758,6 +17916,12 @@ out_free_blk:
 out_free_vdisk:
 	exit_scst_vdisk(&vdisk_file_devtype);
 
+out_free_ra_pool:
+	sgv_pool_del(vdisk_ra_pool);
+
+out_free_nullio_slab:
+	kmem_cache_destroy(nullio_timer_cachep);
+
 out_free_slab:
 	kmem_cache_destroy(blockio_work_cachep);
 
@@ -10768,11 +17932,14 @@ out_free_vdisk_cache:
 
 static void __exit exit_scst_vdisk_driver(void)
 {
+	exit_scst_vdisk(&vdisk_ramdisk_devtype);
 	exit_scst_vdisk(&vdisk_null_devtype);
 	exit_scst_vdisk(&vdisk_blk_devtype);
 	exit_scst_vdisk(&vdisk_file_devtype);
 	exit_scst_vdisk(&vcdrom_devtype);
 
+	sgv_pool_del(vdisk_ra_pool);
+	kmem_cache_destroy(nullio_timer_cachep);
 	kmem_cache_destroy(blockio_work_cachep);
 	kmem_cache_destroy(vdisk_cmd_param_cachep);
 }
@@ -0,0 +1,355 @@
+/*
+ *  scst_aqd.c
+ *
+ *  Adaptive queue depth of devices.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/jiffies.h>
+#include <linux/timer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#ifdef INSIDE_KERNEL_TREE
+#include <scst/scst.h>
+#else
+#include "scst.h"
+#endif
+#include "scst_priv.h"
+
+/*
+ * Each SCST_AQD_PERIOD the average latency of the device's commands, i.e.
+ * time from sending them to the device until they are done, is compared
+ * with the target latency. If it's bigger, the depth limit is halved, down
+ * to aqd_min_depth. Otherwise, if the limit was reached during the period,
+ * it is incremented by 1, up to aqd_max_depth. Periods are ended by command
+ * completions and rejections as well as by aqd_timer, so, if no commands
+ * finished during the whole period while there are ones in SCST, the
+ * latency is taken as at least the period length and a stuck device also
+ * shrinks the limit. A period, which was idle for too long, is just
+ * restarted.
+ *
+ * New commands over the limit are rejected in __scst_init_cmd() by
+ * scst_set_busy(), i.e. with TASK SET FULL status, so the initiators
+ * reduce their queue depth before their commands start timing out.
+ */
+
+#define SCST_AQD_PERIOD			(HZ / 10)
+
+#define SCST_AQD_DEF_MIN_DEPTH		4
+#define SCST_AQD_DEF_MAX_DEPTH		256
+
+/* aqd_lock supposed to be held */
+static void scst_aqd_adjust(struct scst_device *dev, unsigned long now)
+{
+	struct scst_aqd *aqd = &dev->dev_aqd;
+	unsigned long elapsed = now - aqd->aqd_period_start;
+	unsigned int elapsed_ms, lat;
+	int depth = aqd->aqd_depth;
+
+	if ((aqd->aqd_period_cmds == 0) && (elapsed >= 2 * SCST_AQD_PERIOD))
+		goto out_restart;
+
+	elapsed_ms = max_t(unsigned int, jiffies_to_msecs(elapsed), 1);
+
+	if (aqd->aqd_period_cmds > 0)
+		lat = div_u64(aqd->aqd_period_lat_us, aqd->aqd_period_cmds);
+	else if (atomic_read(&aqd->aqd_cmd_count) > 0)
+		lat = elapsed_ms * USEC_PER_MSEC;
+	else
+		lat = 0;
+
+	if (lat > aqd->aqd_target_lat_us)
+		depth = max_t(int, depth / 2, aqd->aqd_min_depth);
+	else if (aqd->aqd_limited)
+		depth = min_t(int, depth + 1, aqd->aqd_max_depth);
+
+	if (depth != aqd->aqd_depth) {
+		TRACE(TRACE_FLOW_CONTROL, "Dev %s: queue depth %d -> %d "
+			"(latency %u us, target %u us)", dev->virt_name,
+			aqd->aqd_depth, depth, lat, aqd->aqd_target_lat_us);
+		aqd->aqd_depth = depth;
+	}
+
+	aqd->aqd_last_lat_us = lat;
+	aqd->aqd_last_rejected_rate = aqd->aqd_period_rejected *
+					MSEC_PER_SEC / elapsed_ms;
+
+out_restart:
+	aqd->aqd_period_start = now;
+	aqd->aqd_period_lat_us = 0;
+	aqd->aqd_period_cmds = 0;
+	aqd->aqd_period_rejected = 0;
+	aqd->aqd_limited = false;
+	return;
+}
+
+/* aqd_lock supposed to be held */
+static inline void scst_aqd_check_period(struct scst_device *dev)
+{
+	unsigned long now = jiffies;
+
+	if (time_after_eq(now, dev->dev_aqd.aqd_period_start + SCST_AQD_PERIOD))
+		scst_aqd_adjust(dev, now);
+	return;
+}
+
+static void scst_aqd_timer_fn(unsigned long arg)
+{
+	struct scst_aqd *aqd = (struct scst_aqd *)arg;
+	struct scst_device *dev = container_of(aqd, struct scst_device,
+					       dev_aqd);
+	unsigned long flags;
+
+	TRACE_ENTRY();
+
+	spin_lock_irqsave(&aqd->aqd_lock, flags);
+	if (aqd->aqd_target_lat_us != 0) {
+		scst_aqd_check_period(dev);
+		mod_timer(&aqd->aqd_timer,
+			aqd->aqd_period_start + SCST_AQD_PERIOD);
+	}
+	spin_unlock_irqrestore(&aqd->aqd_lock, flags);
+
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * No locks, but might be on IRQ. Returns true if cmd is over the depth
+ * limit and must be rejected.
+ */
+bool __scst_aqd_check(struct scst_cmd *cmd)
+{
+	struct scst_device *dev = cmd->dev;
+	struct scst_aqd *aqd = &dev->dev_aqd;
+	int cnt, depth = ACCESS_ONCE(aqd->aqd_depth);
+	unsigned long flags;
+	bool res = false;
+
+	TRACE_ENTRY();
+
+	cnt = atomic_inc_return(&aqd->aqd_cmd_count);
+	cmd->aqd_counted = 1;
+
+	if (likely(cnt < depth))
+		goto out;
+
+	if (!aqd->aqd_limited)
+		aqd->aqd_limited = true;
+
+	if ((cnt == depth) ||
+	    (cmd->queue_type == SCST_CMD_QUEUE_HEAD_OF_QUEUE))
+		goto out;
+
+	spin_lock_irqsave(&aqd->aqd_lock, flags);
+	aqd->aqd_period_rejected++;
+	aqd->aqd_rejected_cmds++;
+	if (aqd->aqd_target_lat_us != 0)
+		scst_aqd_check_period(dev);
+	spin_unlock_irqrestore(&aqd->aqd_lock, flags);
+
+	TRACE(TRACE_FLOW_CONTROL, "Too many pending device commands (%d, "
+		"adaptive depth %d), returning BUSY to initiator \"%s\"", cnt,
+		depth, (cmd->sess->initiator_name[0] == '\0') ?
+			"Anonymous" : cmd->sess->initiator_name);
+	res = true;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * No locks. Called when an aqd_counted cmd, which was sent to the device,
+ * is done.
+ */
+void __scst_aqd_done(struct scst_cmd *cmd)
+{
+	struct scst_device *dev = cmd->dev;
+	struct scst_aqd *aqd = &dev->dev_aqd;
+	unsigned long flags;
+	uint64_t lat_us;
+
+	TRACE_ENTRY();
+
+	lat_us = div_u64(ktime_to_ns(ktime_sub(ktime_get(),
+				cmd->aqd_exec_start)), NSEC_PER_USEC);
+	cmd->aqd_exec_start = ktime_set(0, 0);
+
+	spin_lock_irqsave(&aqd->aqd_lock, flags);
+	if (aqd->aqd_target_lat_us != 0) {
+		aqd->aqd_period_lat_us += lat_us;
+		aqd->aqd_period_cmds++;
+		scst_aqd_check_period(dev);
+	}
+	spin_unlock_irqrestore(&aqd->aqd_lock, flags);
+
+	TRACE_EXIT();
+	return;
+}
+
+void scst_aqd_init(struct scst_aqd *aqd)
+{
+	spin_lock_init(&aqd->aqd_lock);
+	atomic_set(&aqd->aqd_cmd_count, 0);
+	aqd->aqd_min_depth = SCST_AQD_DEF_MIN_DEPTH;
+	aqd->aqd_max_depth = SCST_AQD_DEF_MAX_DEPTH;
+	aqd->aqd_depth = SCST_AQD_DEF_MAX_DEPTH;
+	init_timer(&aqd->aqd_timer);
+	aqd->aqd_timer.data = (unsigned long)aqd;
+	aqd->aqd_timer.function = scst_aqd_timer_fn;
+	return;
+}
+
+/* No commands supposed to be alive on the device */
+void scst_aqd_cleanup(struct scst_aqd *aqd)
+{
+	unsigned long flags;
+
+	/* Don't let the timer rearm itself */
+	spin_lock_irqsave(&aqd->aqd_lock, flags);
+	aqd->aqd_target_lat_us = 0;
+	spin_unlock_irqrestore(&aqd->aqd_lock, flags);
+
+	del_timer_sync(&aqd->aqd_timer);
+	return;
+}
+
+/**
+ * scst_aqd_show() - show the adaptive queue depth settings of @dev
+ *
+ * Returns number of bytes written to @buf, which is SCST_SYSFS_BLOCK_SIZE
+ * long.
+ */
+ssize_t scst_aqd_show(struct scst_device *dev, char *buf)
+{
+	struct scst_aqd *aqd = &dev->dev_aqd;
+	unsigned int lat, min_depth, max_depth;
+	unsigned long flags;
+
+	spin_lock_irqsave(&aqd->aqd_lock, flags);
+	lat = aqd->aqd_target_lat_us;
+	min_depth = aqd->aqd_min_depth;
+	max_depth = aqd->aqd_max_depth;
+	spin_unlock_irqrestore(&aqd->aqd_lock, flags);
+
+	return scnprintf(buf, SCST_SYSFS_BLOCK_SIZE,
+		"latency_us=%u min_depth=%u max_depth=%u\n%s",
+		lat, min_depth, max_depth,
+		((lat != 0) || (min_depth != SCST_AQD_DEF_MIN_DEPTH) ||
+		 (max_depth != SCST_AQD_DEF_MAX_DEPTH)) ?
+			SCST_SYSFS_KEY_MARK "\n" : "");
+}
+
+/**
+ * scst_aqd_store() - change the adaptive queue depth settings of @dev
+ *
+ * @buf contains space or ';' separated "name=value" pairs, where name is
+ * one of latency_us, min_depth or max_depth. Not mentioned settings stay
+ * unchanged. Enabling restarts the depth limit from max_depth.
+ */
+int scst_aqd_store(struct scst_device *dev, const char *buf, size_t count)
+{
+	static const char *const names[] = {
+		"latency_us", "min_depth", "max_depth", NULL
+	};
+	struct scst_aqd *aqd = &dev->dev_aqd;
+	unsigned int vals[3], lat, min_depth, max_depth;
+	unsigned long flags;
+	int res;
+
+	TRACE_ENTRY();
+
+	spin_lock_irqsave(&aqd->aqd_lock, flags);
+	vals[0] = aqd->aqd_target_lat_us;
+	vals[1] = aqd->aqd_min_depth;
+	vals[2] = aqd->aqd_max_depth;
+	spin_unlock_irqrestore(&aqd->aqd_lock, flags);
+
+	res = scst_parse_uint_params(buf, count, names, vals, dev->virt_name);
+	if (res != 0)
+		goto out;
+
+	lat = vals[0];
+	min_depth = vals[1];
+	max_depth = vals[2];
+
+	if ((min_depth == 0) || (min_depth > max_depth) ||
+	    (max_depth > INT_MAX)) {
+		PRINT_ERROR("Dev %s: invalid depth range %u-%u",
+			dev->virt_name, min_depth, max_depth);
+		res = -EINVAL;
+		goto out;
+	}
+
+	spin_lock_irqsave(&aqd->aqd_lock, flags);
+
+	if ((aqd->aqd_target_lat_us == 0) && (lat != 0)) {
+		aqd->aqd_depth = max_depth;
+		aqd->aqd_period_start = jiffies;
+		aqd->aqd_period_lat_us = 0;
+		aqd->aqd_period_cmds = 0;
+		aqd->aqd_period_rejected = 0;
+		aqd->aqd_limited = false;
+		mod_timer(&aqd->aqd_timer, jiffies + SCST_AQD_PERIOD);
+	} else
+		aqd->aqd_depth = clamp_t(int, aqd->aqd_depth, min_depth,
+					 max_depth);
+
+	aqd->aqd_min_depth = min_depth;
+	aqd->aqd_max_depth = max_depth;
+	aqd->aqd_target_lat_us = lat;
+
+	spin_unlock_irqrestore(&aqd->aqd_lock, flags);
+
+	PRINT_INFO("Dev %s: adaptive queue depth latency %u us, depth %u-%u",
+		dev->virt_name, lat, min_depth, max_depth);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+ssize_t scst_aqd_stats_show(struct scst_device *dev, char *buf)
+{
+	struct scst_aqd *aqd = &dev->dev_aqd;
+	unsigned int lat, rate;
+	uint64_t rejected;
+	unsigned long flags;
+	int depth;
+
+	spin_lock_irqsave(&aqd->aqd_lock, flags);
+	depth = aqd->aqd_depth;
+	lat = aqd->aqd_last_lat_us;
+	rate = aqd->aqd_last_rejected_rate;
+	rejected = aqd->aqd_rejected_cmds;
+	spin_unlock_irqrestore(&aqd->aqd_lock, flags);
+
+	return scnprintf(buf, SCST_SYSFS_BLOCK_SIZE,
+		"depth %d\nactive_cmds %d\nlatency_us %u\n"
+		"rejected_cmds %llu\nrejected_per_sec %u\n",
+		depth, atomic_read(&aqd->aqd_cmd_count), lat,
+		(unsigned long long)rejected, rate);
+}
+
+void scst_aqd_stats_reset(struct scst_device *dev)
+{
+	struct scst_aqd *aqd = &dev->dev_aqd;
+	unsigned long flags;
+
+	spin_lock_irqsave(&aqd->aqd_lock, flags);
+	aqd->aqd_rejected_cmds = 0;
+	aqd->aqd_last_rejected_rate = 0;
+	spin_unlock_irqrestore(&aqd->aqd_lock, flags);
+	return;
+}
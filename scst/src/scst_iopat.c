@@ -0,0 +1,527 @@
+/*
+ *  scst_iopat.c
+ *
+ *  I/O pattern statistics of devices: LBA heat map, sequential vs random
+ *  commands per initiator and commands size histograms.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
+#include <linux/log2.h>
+#ifdef INSIDE_KERNEL_TREE
+#include <scst/scst.h>
+#else
+#include "scst.h"
+#endif
+#include "scst_priv.h"
+
+/*
+ * The hot path only increments per-CPU counters of the device, so there
+ * is no shared cache lines bouncing except the initiator's stream position
+ * in its tgt_dev. Per-CPU counters are merged on read.
+ *
+ * The LBA heat map is decayed each half life period by a work, which adds
+ * the accesses since the previous period to the halved heat counters. Raw
+ * per-CPU access counters are never reset, but only compared with their
+ * sum at the previous period, so they are allowed to wrap around.
+ */
+
+#define SCST_IOPAT_DEF_BUCKET_MB	1024
+#define SCST_IOPAT_DEF_HALF_LIFE_S	60
+/* Limited by the max per-CPU allocation size */
+#define SCST_IOPAT_MAX_BUCKETS		4096
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 34)
+
+struct scst_iopat_cpu {
+	uint64_t iopat_read_cmds;
+	uint64_t iopat_write_cmds;
+	uint64_t iopat_read_size_hist[SCST_IOPAT_SIZE_BUCKETS];
+	uint64_t iopat_write_size_hist[SCST_IOPAT_SIZE_BUCKETS];
+
+	/* Not decayed number of accesses of each LBA bucket */
+	uint32_t iopat_lba_hits[0];
+};
+
+struct scst_iopat {
+	struct scst_device *iopat_dev;
+
+	unsigned int iopat_buckets;
+	unsigned int iopat_bucket_shift; /* log2 of bucket size in bytes */
+	unsigned int iopat_half_life_s;
+
+	struct scst_iopat_cpu __percpu *iopat_cpu;
+
+	/* Protects iopat_heat and iopat_last_hits */
+	spinlock_t iopat_heat_lock;
+
+	uint64_t *iopat_heat;
+
+	/* Sums of iopat_lba_hits at the last decay */
+	uint32_t *iopat_last_hits;
+
+	struct delayed_work iopat_decay_work;
+};
+
+static inline int scst_iopat_size_bucket(int64_t len)
+{
+	int i;
+
+	if (len < 1024)
+		return 0;
+	i = ilog2(len) - 9;
+	return min(i, SCST_IOPAT_SIZE_BUCKETS - 1);
+}
+
+/* Called under rcu_read_lock() */
+static void scst_iopat_do_account(struct scst_iopat *iopat,
+	struct scst_cmd *cmd)
+{
+	struct scst_tgt_dev *tgt_dev = cmd->tgt_dev;
+	int shift = cmd->dev->block_shift;
+	uint64_t b, next_lba;
+	int sb = scst_iopat_size_bucket(cmd->data_len);
+
+	b = ((uint64_t)cmd->lba << shift) >> iopat->iopat_bucket_shift;
+	if (b >= iopat->iopat_buckets)
+		b = iopat->iopat_buckets - 1;
+
+	this_cpu_inc(iopat->iopat_cpu->iopat_lba_hits[b]);
+	if (cmd->op_flags & SCST_WRITE_MEDIUM) {
+		this_cpu_inc(iopat->iopat_cpu->iopat_write_cmds);
+		this_cpu_inc(iopat->iopat_cpu->iopat_write_size_hist[sb]);
+	} else {
+		this_cpu_inc(iopat->iopat_cpu->iopat_read_cmds);
+		this_cpu_inc(iopat->iopat_cpu->iopat_read_size_hist[sb]);
+	}
+
+	/* Stream position of the initiator, races only make it approximate */
+	next_lba = cmd->lba + (cmd->data_len >> shift);
+	if (ACCESS_ONCE(tgt_dev->iopat_next_lba) == cmd->lba)
+		tgt_dev->iopat_seq_cmds++;
+	else
+		tgt_dev->iopat_rand_cmds++;
+	tgt_dev->iopat_next_lba = next_lba;
+	return;
+}
+
+/* No locks. Called when cmd is sent to the device. */
+void __scst_iopat_account(struct scst_cmd *cmd)
+{
+	struct scst_iopat *iopat;
+
+	if ((cmd->op_flags & SCST_LBA_NOT_VALID) || (cmd->data_len <= 0))
+		return;
+
+	rcu_read_lock();
+	iopat = rcu_dereference(cmd->dev->dev_iopat);
+	if (iopat != NULL)
+		scst_iopat_do_account(iopat, cmd);
+	rcu_read_unlock();
+	return;
+}
+
+/*
+ * iopat_heat_lock supposed to be held. Returns in @hits accesses of each
+ * LBA bucket since the last decay.
+ */
+static void scst_iopat_new_hits(struct scst_iopat *iopat, uint32_t *hits)
+{
+	int cpu, i;
+
+	memset(hits, 0, iopat->iopat_buckets * sizeof(*hits));
+	for_each_possible_cpu(cpu) {
+		struct scst_iopat_cpu *c = per_cpu_ptr(iopat->iopat_cpu, cpu);
+
+		for (i = 0; i < iopat->iopat_buckets; i++)
+			hits[i] += ACCESS_ONCE(c->iopat_lba_hits[i]);
+	}
+	for (i = 0; i < iopat->iopat_buckets; i++)
+		hits[i] -= iopat->iopat_last_hits[i];
+	return;
+}
+
+static void scst_iopat_decay_work_fn(struct work_struct *work)
+{
+	struct scst_iopat *iopat = container_of(to_delayed_work(work),
+				struct scst_iopat, iopat_decay_work);
+	uint32_t *hits;
+	int i;
+
+	TRACE_ENTRY();
+
+	hits = kmalloc_array(iopat->iopat_buckets, sizeof(*hits), GFP_KERNEL);
+	if (hits == NULL) {
+		PRINT_ERROR("Dev %s: unable to decay I/O pattern heat map",
+			iopat->iopat_dev->virt_name);
+		goto out_resched;
+	}
+
+	spin_lock(&iopat->iopat_heat_lock);
+	scst_iopat_new_hits(iopat, hits);
+	for (i = 0; i < iopat->iopat_buckets; i++) {
+		iopat->iopat_heat[i] = (iopat->iopat_heat[i] >> 1) + hits[i];
+		iopat->iopat_last_hits[i] += hits[i];
+	}
+	spin_unlock(&iopat->iopat_heat_lock);
+
+	kfree(hits);
+
+out_resched:
+	schedule_delayed_work(&iopat->iopat_decay_work,
+		iopat->iopat_half_life_s * HZ);
+
+	TRACE_EXIT();
+	return;
+}
+
+static void scst_iopat_free(struct scst_iopat *iopat)
+{
+	if (iopat == NULL)
+		return;
+
+	cancel_delayed_work_sync(&iopat->iopat_decay_work);
+	free_percpu(iopat->iopat_cpu);
+	kfree(iopat->iopat_heat);
+	kfree(iopat->iopat_last_hits);
+	kfree(iopat);
+	return;
+}
+
+static struct scst_iopat *scst_iopat_alloc(struct scst_device *dev,
+	unsigned int buckets, unsigned int bucket_mb, unsigned int half_life_s)
+{
+	struct scst_iopat *iopat;
+
+	iopat = kzalloc(sizeof(*iopat), GFP_KERNEL);
+	if (iopat == NULL)
+		goto out;
+
+	iopat->iopat_dev = dev;
+	iopat->iopat_buckets = buckets;
+	iopat->iopat_bucket_shift = ilog2(bucket_mb) + 20;
+	iopat->iopat_half_life_s = half_life_s;
+	spin_lock_init(&iopat->iopat_heat_lock);
+	INIT_DELAYED_WORK(&iopat->iopat_decay_work, scst_iopat_decay_work_fn);
+
+	iopat->iopat_cpu = __alloc_percpu(sizeof(struct scst_iopat_cpu) +
+			buckets * sizeof(uint32_t), __alignof__(uint64_t));
+	iopat->iopat_heat = kcalloc(buckets, sizeof(*iopat->iopat_heat),
+				GFP_KERNEL);
+	iopat->iopat_last_hits = kcalloc(buckets,
+				sizeof(*iopat->iopat_last_hits), GFP_KERNEL);
+	if ((iopat->iopat_cpu == NULL) || (iopat->iopat_heat == NULL) ||
+	    (iopat->iopat_last_hits == NULL)) {
+		scst_iopat_free(iopat);
+		iopat = NULL;
+	}
+
+out:
+	return iopat;
+}
+
+/* dev_iopat_mutex supposed to be held */
+static void scst_iopat_replace(struct scst_device *dev,
+	struct scst_iopat *iopat)
+{
+	struct scst_iopat *old = dev->dev_iopat;
+	struct scst_tgt_dev *tgt_dev;
+
+	if (iopat != NULL) {
+		spin_lock_bh(&dev->dev_lock);
+		list_for_each_entry(tgt_dev, &dev->dev_tgt_dev_list,
+				dev_tgt_dev_list_entry) {
+			tgt_dev->iopat_next_lba = 0;
+			tgt_dev->iopat_seq_cmds = 0;
+			tgt_dev->iopat_rand_cmds = 0;
+		}
+		spin_unlock_bh(&dev->dev_lock);
+
+		schedule_delayed_work(&iopat->iopat_decay_work,
+			iopat->iopat_half_life_s * HZ);
+	}
+
+	rcu_assign_pointer(dev->dev_iopat, iopat);
+	synchronize_rcu();
+
+	scst_iopat_free(old);
+	return;
+}
+
+/* dev_iopat_mutex supposed to be held */
+static int scst_iopat_make_snap(struct scst_device *dev)
+{
+	struct scst_iopat *iopat = dev->dev_iopat;
+	struct scst_iopat_hdr *hdr;
+	struct scst_iopat_initiator *ini;
+	struct scst_tgt_dev *tgt_dev;
+	uint64_t *heat;
+	uint32_t *hits;
+	size_t len;
+	int res = 0, n = 0, max_n = 0, cpu, i;
+
+	TRACE_ENTRY();
+
+	vfree(dev->dev_iopat_snap);
+	dev->dev_iopat_snap = NULL;
+	dev->dev_iopat_snap_len = 0;
+
+	if (iopat == NULL)
+		goto out;
+
+	spin_lock_bh(&dev->dev_lock);
+	list_for_each_entry(tgt_dev, &dev->dev_tgt_dev_list,
+			dev_tgt_dev_list_entry)
+		max_n++;
+	spin_unlock_bh(&dev->dev_lock);
+
+	len = sizeof(*hdr) + iopat->iopat_buckets * sizeof(*heat) +
+		max_n * sizeof(*ini);
+	hdr = vzalloc(len);
+	hits = kmalloc_array(iopat->iopat_buckets, sizeof(*hits), GFP_KERNEL);
+	if ((hdr == NULL) || (hits == NULL)) {
+		vfree(hdr);
+		kfree(hits);
+		res = -ENOMEM;
+		goto out;
+	}
+
+	heat = (uint64_t *)(hdr + 1);
+	ini = (struct scst_iopat_initiator *)(heat + iopat->iopat_buckets);
+
+	hdr->magic = SCST_IOPAT_MAGIC;
+	hdr->version = SCST_IOPAT_VERSION;
+	hdr->hdr_len = sizeof(*hdr);
+	hdr->lba_buckets = iopat->iopat_buckets;
+	hdr->half_life_s = iopat->iopat_half_life_s;
+	hdr->lba_bucket_size = 1ULL << iopat->iopat_bucket_shift;
+
+	for_each_possible_cpu(cpu) {
+		struct scst_iopat_cpu *c = per_cpu_ptr(iopat->iopat_cpu, cpu);
+
+		hdr->read_cmds += c->iopat_read_cmds;
+		hdr->write_cmds += c->iopat_write_cmds;
+		for (i = 0; i < SCST_IOPAT_SIZE_BUCKETS; i++) {
+			hdr->read_size_hist[i] += c->iopat_read_size_hist[i];
+			hdr->write_size_hist[i] += c->iopat_write_size_hist[i];
+		}
+	}
+
+	spin_lock(&iopat->iopat_heat_lock);
+	scst_iopat_new_hits(iopat, hits);
+	for (i = 0; i < iopat->iopat_buckets; i++)
+		heat[i] = iopat->iopat_heat[i] + hits[i];
+	spin_unlock(&iopat->iopat_heat_lock);
+
+	kfree(hits);
+
+	spin_lock_bh(&dev->dev_lock);
+	list_for_each_entry(tgt_dev, &dev->dev_tgt_dev_list,
+			dev_tgt_dev_list_entry) {
+		if (n == max_n)
+			break;
+		strlcpy(ini[n].initiator_name, tgt_dev->sess->initiator_name,
+			sizeof(ini[n].initiator_name));
+		ini[n].lun = tgt_dev->lun;
+		ini[n].seq_cmds = tgt_dev->iopat_seq_cmds;
+		ini[n].rand_cmds = tgt_dev->iopat_rand_cmds;
+		n++;
+	}
+	spin_unlock_bh(&dev->dev_lock);
+
+	hdr->initiators = n;
+
+	dev->dev_iopat_snap = hdr;
+	dev->dev_iopat_snap_len = (uint8_t *)&ini[n] - (uint8_t *)hdr;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+#else /* LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 34) */
+
+struct scst_iopat {
+	unsigned int iopat_buckets;
+	unsigned int iopat_bucket_shift;
+	unsigned int iopat_half_life_s;
+};
+
+void __scst_iopat_account(struct scst_cmd *cmd)
+{
+	return;
+}
+
+static void scst_iopat_free(struct scst_iopat *iopat)
+{
+	return;
+}
+
+static struct scst_iopat *scst_iopat_alloc(struct scst_device *dev,
+	unsigned int buckets, unsigned int bucket_mb, unsigned int half_life_s)
+{
+	PRINT_ERROR("I/O pattern statistics require kernel 2.6.34 or later");
+	return NULL;
+}
+
+static void scst_iopat_replace(struct scst_device *dev,
+	struct scst_iopat *iopat)
+{
+	return;
+}
+
+static int scst_iopat_make_snap(struct scst_device *dev)
+{
+	return 0;
+}
+
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 34) */
+
+void scst_iopat_init(struct scst_device *dev)
+{
+	mutex_init(&dev->dev_iopat_mutex);
+	return;
+}
+
+/* No commands supposed to be alive on the device */
+void scst_iopat_cleanup(struct scst_device *dev)
+{
+	scst_iopat_free(dev->dev_iopat);
+	dev->dev_iopat = NULL;
+	vfree(dev->dev_iopat_snap);
+	dev->dev_iopat_snap = NULL;
+	return;
+}
+
+/**
+ * scst_iopat_show() - show the I/O pattern statistics settings of @dev
+ *
+ * Returns number of bytes written to @buf, which is SCST_SYSFS_BLOCK_SIZE
+ * long.
+ */
+ssize_t scst_iopat_show(struct scst_device *dev, char *buf)
+{
+	struct scst_iopat *iopat;
+	ssize_t res;
+
+	mutex_lock(&dev->dev_iopat_mutex);
+	iopat = dev->dev_iopat;
+	if (iopat == NULL)
+		res = scnprintf(buf, SCST_SYSFS_BLOCK_SIZE, "buckets=0\n");
+	else
+		res = scnprintf(buf, SCST_SYSFS_BLOCK_SIZE,
+			"buckets=%u bucket_mb=%u half_life_s=%u\n%s",
+			iopat->iopat_buckets,
+			1 << (iopat->iopat_bucket_shift - 20),
+			iopat->iopat_half_life_s, SCST_SYSFS_KEY_MARK "\n");
+	mutex_unlock(&dev->dev_iopat_mutex);
+
+	return res;
+}
+
+/**
+ * scst_iopat_store() - enable, disable or reconfigure the I/O pattern
+ * statistics of @dev
+ *
+ * @buf contains space or ';' separated "name=value" pairs, where name is
+ * one of buckets, bucket_mb or half_life_s. buckets=0 disables the
+ * statistics. Any change restarts them from zero.
+ */
+int scst_iopat_store(struct scst_device *dev, const char *buf, size_t count)
+{
+	static const char *const names[] = {
+		"buckets", "bucket_mb", "half_life_s", NULL
+	};
+	unsigned int vals[3] = {
+		0, SCST_IOPAT_DEF_BUCKET_MB, SCST_IOPAT_DEF_HALF_LIFE_S
+	};
+	unsigned int buckets, bucket_mb, half_life_s;
+	struct scst_iopat *iopat = NULL;
+	int res;
+
+	TRACE_ENTRY();
+
+	res = scst_parse_uint_params(buf, count, names, vals, dev->virt_name);
+	if (res != 0)
+		goto out;
+
+	buckets = vals[0];
+	bucket_mb = vals[1];
+	half_life_s = vals[2];
+
+	if ((buckets > SCST_IOPAT_MAX_BUCKETS) || (bucket_mb == 0) ||
+	    !is_power_of_2(bucket_mb) || (bucket_mb > (1 << 20)) ||
+	    (half_life_s == 0) || (half_life_s > 24 * 3600)) {
+		PRINT_ERROR("Dev %s: invalid I/O pattern statistics parameters "
+			"(buckets %u, max %d; bucket_mb %u, must be power of 2; "
+			"half_life_s %u)", dev->virt_name, buckets,
+			SCST_IOPAT_MAX_BUCKETS, bucket_mb, half_life_s);
+		res = -EINVAL;
+		goto out;
+	}
+
+	if (buckets != 0) {
+		iopat = scst_iopat_alloc(dev, buckets, bucket_mb, half_life_s);
+		if (iopat == NULL) {
+			res = -ENOMEM;
+			goto out;
+		}
+	}
+
+	mutex_lock(&dev->dev_iopat_mutex);
+	scst_iopat_replace(dev, iopat);
+	mutex_unlock(&dev->dev_iopat_mutex);
+
+	PRINT_INFO("Dev %s: I/O pattern statistics %s (buckets %u, bucket "
+		"%u MB, half life %u s)", dev->virt_name,
+		(iopat != NULL) ? "enabled" : "disabled", buckets, bucket_mb,
+		half_life_s);
+
+	res = 0;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * Reads from offset 0 take a new snapshot of the statistics, reads from
+ * other offsets continue reading the current one.
+ */
+ssize_t scst_iopat_data_read(struct scst_device *dev, char *buf, loff_t off,
+	size_t count)
+{
+	ssize_t res;
+
+	TRACE_ENTRY();
+
+	mutex_lock(&dev->dev_iopat_mutex);
+
+	if (off == 0) {
+		res = scst_iopat_make_snap(dev);
+		if (res != 0)
+			goto out_unlock;
+	}
+
+	res = memory_read_from_buffer(buf, count, &off, dev->dev_iopat_snap,
+		dev->dev_iopat_snap_len);
+
+out_unlock:
+	mutex_unlock(&dev->dev_iopat_mutex);
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
@@ -1684,6 +1684,8 @@ static void scst_clear_reservation(struct scst_tgt_dev *tgt_dev);
 static int scst_alloc_add_tgt_dev(struct scst_session *sess,
 	struct scst_acg_dev *acg_dev, struct scst_tgt_dev **out_tgt_dev);
 static void scst_tgt_retry_timer_fn(unsigned long arg);
+static void scst_free_sess_cmd(struct scst_session *sess,
+	struct scst_cmd *cmd);
 
 #ifdef CONFIG_SCST_DEBUG_TM
 static void tm_dbg_init_tgt_dev(struct scst_tgt_dev *tgt_dev);
@@ -3849,12 +3851,13 @@ EXPORT_SYMBOL_GPL(scst_update_hw_pending_start);
 
 /*
  * Supposed to be called under sess_list_lock, but can release/reacquire it.
- * Returns 0 to continue, >0 to restart, <0 to break.
+ * Returns 0 to continue, >0 to restart, <0 to break. *next is set to the
+ * time the work should run next, if it's earlier than the current value.
  */
 static int scst_check_hw_pending_cmd(struct scst_cmd *cmd,
 	unsigned long cur_time, unsigned long max_time,
 	struct scst_session *sess, unsigned long *flags,
-	struct scst_tgt_template *tgtt)
+	struct scst_tgt_template *tgtt, unsigned long *next)
 {
 	int res = -1; /* break */
 
@@ -3864,7 +3867,12 @@ static int scst_check_hw_pending_cmd(struct scst_cmd *cmd,
 		(long)(cur_time - cmd->hw_pending_start) / HZ);
 
 	if (time_before(cur_time, cmd->start_time + max_time)) {
-		/* Cmds are ordered, so no need to check more */
+		/*
+		 * Cmds are ordered by start_time and hw_pending_start can't be
+		 * before it, so no need to check more.
+		 */
+		if (time_before(cmd->start_time + max_time, *next))
+			*next = cmd->start_time + max_time;
 		goto out;
 	}
 
@@ -3874,6 +3882,8 @@ static int scst_check_hw_pending_cmd(struct scst_cmd *cmd,
 	}
 
 	if (time_before(cur_time, cmd->hw_pending_start + max_time)) {
+		if (time_before(cmd->hw_pending_start + max_time, *next))
+			*next = cmd->hw_pending_start + max_time;
 		res = 0; /* continue */
 		goto out;
 	}
@@ -3912,6 +3922,7 @@ static void scst_hw_pending_work_fn(struct work_struct *work)
 	unsigned long cur_time = jiffies;
 	unsigned long flags;
 	unsigned long max_time = tgtt->max_hw_pending_time * HZ;
+	unsigned long next;
 
 	TRACE_ENTRY();
 
@@ -3921,12 +3932,19 @@ static void scst_hw_pending_work_fn(struct work_struct *work)
 
 	spin_lock_irqsave(&sess->sess_list_lock, flags);
 
+	/*
+	 * Only cmds started more than max_time ago are looked at, so this
+	 * work doesn't depend on the total number of cmds in the session. A
+	 * restart after a timed out cmd rescans only that old prefix, where
+	 * the already handled cmds have cmd_hw_pending cleared.
+	 */
 restart:
+	next = cur_time + max_time;
 	list_for_each_entry(cmd, &sess->sess_cmd_list, sess_cmd_list_entry) {
 		int rc;
 
 		rc = scst_check_hw_pending_cmd(cmd, cur_time, max_time, sess,
-					&flags, tgtt);
+					&flags, tgtt, &next);
 		if (rc < 0)
 			break;
 		else if (rc == 0)
@@ -3936,15 +3954,15 @@ restart:
 	}
 
 	if (!list_empty(&sess->sess_cmd_list)) {
-		/*
-		 * For stuck cmds if there is no activity we might need to have
-		 * one more run to release them, so reschedule once again.
-		 */
-		TRACE_DBG("Sched HW pending work for sess %p (max time %d)",
-			sess, tgtt->max_hw_pending_time);
+		long delay = (long)(next - jiffies);
+
+		/* Run again when the oldest cmd can expire */
+		if (delay <= 0)
+			delay = 1;
+		TRACE_DBG("Sched HW pending work for sess %p (delay %ld)",
+			sess, delay);
 		set_bit(SCST_SESS_HW_PENDING_WORK_SCHEDULED, &sess->sess_aflags);
-		schedule_delayed_work(&sess->hw_pending_work,
-				tgtt->max_hw_pending_time * HZ);
+		schedule_delayed_work(&sess->hw_pending_work, delay);
 	}
 
 	spin_unlock_irqrestore(&sess->sess_list_lock, flags);
@@ -4158,6 +4176,9 @@ int scst_alloc_device(gfp_t gfp_mask, struct scst_device **out_dev)
 	scst_init_mem_lim(&dev->dev_mem_lim);
 	spin_lock_init(&dev->dev_lock);
 	INIT_LIST_HEAD(&dev->dev_exec_cmd_list);
+#ifdef SCST_EXEC_LBA_TREE
+	dev->dev_exec_lba_tree = RB_ROOT;
+#endif
 	INIT_LIST_HEAD(&dev->blocked_cmd_list);
 	INIT_LIST_HEAD(&dev->dev_tgt_dev_list);
 	INIT_LIST_HEAD(&dev->dev_acg_dev_list);
@@ -4179,6 +4200,11 @@ int scst_alloc_device(gfp_t gfp_mask, struct scst_device **out_dev)
 
 	scst_init_order_data(&dev->dev_order_data);
 
+	scst_qos_init(&dev->dev_qos);
+	scst_sched_dev_init(dev);
+	scst_aqd_init(&dev->dev_aqd);
+	scst_iopat_init(dev);
+
 	scst_init_threads(&dev->dev_cmd_threads);
 
 	*out_dev = dev;
@@ -4194,6 +4220,9 @@ void scst_free_device(struct scst_device *dev)
 
 	EXTRACHECKS_BUG_ON(dev->dev_scsi_atomic_cmd_active != 0);
 	EXTRACHECKS_BUG_ON(!list_empty(&dev->dev_exec_cmd_list));
+#ifdef SCST_EXEC_LBA_TREE
+	EXTRACHECKS_BUG_ON(!RB_EMPTY_ROOT(&dev->dev_exec_lba_tree));
+#endif
 
 #ifdef CONFIG_SCST_EXTRACHECKS
 	if (!list_empty(&dev->dev_tgt_dev_list) ||
@@ -4209,6 +4238,10 @@ void scst_free_device(struct scst_device *dev)
 
 	scst_deinit_threads(&dev->dev_cmd_threads);
 
+	scst_qos_cleanup(&dev->dev_qos);
+	scst_aqd_cleanup(&dev->dev_aqd);
+	scst_iopat_cleanup(dev);
+
 	scst_pr_cleanup(dev);
 
 	kfree(dev->virt_name);
@@ -5167,6 +5200,8 @@ static int scst_alloc_add_tgt_dev(struct scst_session *sess,
 
 	tgt_dev->sess = sess;
 	atomic_set(&tgt_dev->tgt_dev_cmd_count, 0);
+	scst_qos_init(&tgt_dev->tgt_dev_qos);
+	scst_sched_tgt_dev_init(tgt_dev);
 	if (acg_dev->acg->acg_black_hole_type != SCST_ACG_BLACK_HOLE_NONE)
 		set_bit(SCST_TGT_DEV_BLACK_HOLE, &tgt_dev->tgt_dev_flags);
 	else
@@ -5200,6 +5235,7 @@ static int scst_alloc_add_tgt_dev(struct scst_session *sess,
 
 	spin_lock_init(&tgt_dev->tgt_dev_lock);
 	INIT_LIST_HEAD(&tgt_dev->UA_list);
+	INIT_LIST_HEAD(&tgt_dev->tgt_dev_cmd_list);
 
 	scst_init_order_data(&tgt_dev->tgt_dev_order_data);
 	if (dev->tst == SCST_TST_1_SEP_TASK_SETS)
@@ -5331,6 +5367,8 @@ static void scst_free_tgt_dev(struct scst_tgt_dev *tgt_dev)
 
 	list_del(&tgt_dev->sess_tgt_dev_list_entry);
 
+	EXTRACHECKS_BUG_ON(!list_empty(&tgt_dev->tgt_dev_cmd_list));
+
 	scst_tgt_dev_sysfs_del(tgt_dev);
 
 	if (tgtt->get_initiator_port_transport_id == NULL)
@@ -5349,6 +5387,9 @@ static void scst_free_tgt_dev(struct scst_tgt_dev *tgt_dev)
 
 	scst_tgt_dev_stop_threads(tgt_dev);
 
+	scst_qos_cleanup(&tgt_dev->tgt_dev_qos);
+	scst_sched_tgt_dev_cleanup(tgt_dev);
+
 	kmem_cache_free(scst_tgtd_cachep, tgt_dev);
 
 	TRACE_EXIT();
@@ -5587,6 +5628,8 @@ struct scst_cmd *__scst_create_prepare_internal_cmd(const uint8_t *cdb,
 		 */
 		spin_lock_irqsave(&res->sess->sess_list_lock, flags);
 		list_add_tail(&res->sess_cmd_list_entry, &res->sess->sess_cmd_list);
+		list_add_tail(&res->tgt_dev_cmd_list_entry,
+			&tgt_dev->tgt_dev_cmd_list);
 		spin_unlock_irqrestore(&res->sess->sess_list_lock, flags);
 	}
 
@@ -5640,6 +5683,7 @@ static void scst_prelim_finish_internal_cmd(struct scst_cmd *cmd)
 
 	spin_lock_irqsave(&cmd->sess->sess_list_lock, flags);
 	list_del(&cmd->sess_cmd_list_entry);
+	list_del_init(&cmd->tgt_dev_cmd_list_entry);
 	spin_unlock_irqrestore(&cmd->sess->sess_list_lock, flags);
 
 	__scst_cmd_put(cmd);
@@ -6640,6 +6684,7 @@ int scst_finish_internal_cmd(struct scst_cmd *cmd)
 
 	spin_lock_irqsave(&cmd->sess->sess_list_lock, flags);
 	list_del(&cmd->sess_cmd_list_entry);
+	list_del_init(&cmd->tgt_dev_cmd_list_entry);
 	cmd->done = 1;
 	cmd->finished = 1;
 	spin_unlock_irqrestore(&cmd->sess->sess_list_lock, flags);
@@ -6761,6 +6806,8 @@ struct scst_session *scst_alloc_session(struct scst_tgt *tgt, gfp_t gfp_mask,
 	}
 	spin_lock_init(&sess->sess_list_lock);
 	INIT_LIST_HEAD(&sess->sess_cmd_list);
+	INIT_LIST_HEAD(&sess->sess_no_tgt_dev_cmd_list);
+	scst_qos_init(&sess->sess_qos);
 	sess->tgt = tgt;
 	INIT_LIST_HEAD(&sess->init_deferred_cmd_list);
 	INIT_LIST_HEAD(&sess->init_deferred_mcmd_list);
@@ -6779,6 +6826,9 @@ struct scst_session *scst_alloc_session(struct scst_tgt *tgt, gfp_t gfp_mask,
 	spin_lock_init(&sess->lat_lock);
 #endif
 
+	INIT_LIST_HEAD(&sess->sess_cmd_pool_list);
+	spin_lock_init(&sess->sess_cmd_pool_lock);
+
 	sess->initiator_name = kstrdup(initiator_name, gfp_mask);
 	if (sess->initiator_name == NULL) {
 		PRINT_ERROR("%s", "Unable to dup sess->initiator_name");
@@ -6795,6 +6845,58 @@ out_free:
 	goto out;
 }
 
+/*
+ * Preallocates tgtt->sess_cmd_pool_size cmds for sess. Called on the
+ * session registration from process context, so, unlike the session
+ * itself, which can be allocated in atomic context, the pool is always
+ * allocated with GFP_KERNEL.
+ */
+int scst_alloc_sess_cmd_pool(struct scst_session *sess)
+{
+	struct scst_tgt_template *tgtt = sess->tgt->tgtt;
+	struct scst_cmd *cmd;
+	int res = 0, i;
+
+	TRACE_ENTRY();
+
+	for (i = 0; i < tgtt->sess_cmd_pool_size; i++) {
+		cmd = kzalloc(sizeof(*cmd) + tgtt->cmd_priv_size, GFP_KERNEL);
+		if (cmd == NULL) {
+			PRINT_ERROR("Unable to preallocate cmd %d for "
+				"session %s (pool size %d)", i,
+				sess->initiator_name, tgtt->sess_cmd_pool_size);
+			res = -ENOMEM;
+			goto out;
+		}
+		spin_lock_irq(&sess->sess_cmd_pool_lock);
+		list_add_tail(&cmd->cmd_list_entry, &sess->sess_cmd_pool_list);
+		spin_unlock_irq(&sess->sess_cmd_pool_lock);
+	}
+
+	TRACE_MGMT_DBG("Preallocated %d cmds for sess %p", i, sess);
+
+out:
+	/* On failure the pool is freed by scst_free_session() */
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static void scst_free_sess_cmd_pool(struct scst_session *sess)
+{
+	struct scst_cmd *cmd, *t;
+
+	TRACE_ENTRY();
+
+	list_for_each_entry_safe(cmd, t, &sess->sess_cmd_pool_list,
+				 cmd_list_entry) {
+		list_del(&cmd->cmd_list_entry);
+		kfree(cmd);
+	}
+
+	TRACE_EXIT();
+	return;
+}
+
 void scst_free_session(struct scst_session *sess)
 {
 	TRACE_ENTRY();
@@ -6839,6 +6941,10 @@ void scst_free_session(struct scst_session *sess)
 	if (sess->sess_name != sess->initiator_name)
 		kfree(sess->sess_name);
 
+	scst_free_sess_cmd_pool(sess);
+
+	scst_qos_cleanup(&sess->sess_qos);
+
 	kmem_cache_free(scst_sess_cachep, sess);
 
 	TRACE_EXIT();
@@ -6986,6 +7092,7 @@ int scst_pre_init_cmd(struct scst_cmd *cmd, const uint8_t *cdb,
 	cmd->cmd_threads = &scst_main_cmd_threads;
 	cmd->cmd_gfp_mask = GFP_KERNEL;
 	INIT_LIST_HEAD(&cmd->mgmt_cmd_list);
+	INIT_LIST_HEAD(&cmd->tgt_dev_cmd_list_entry);
 	cmd->cdb = cmd->cdb_buf;
 	cmd->queue_type = SCST_CMD_QUEUE_SIMPLE;
 	cmd->timeout = SCST_DEFAULT_TIMEOUT;
@@ -7064,16 +7171,106 @@ out_free:
 	goto out;
 }
 
+/*
+ * Slow path of scst_alloc_sess_cmd(): sess's pool is exhausted or the
+ * target driver doesn't use it.
+ */
+static noinline struct scst_cmd *scst_alloc_sess_cmd_slow(
+	struct scst_session *sess, gfp_t gfp_mask)
+{
+	struct scst_tgt_template *tgtt = sess->tgt->tgtt;
+	struct scst_cmd *cmd;
+
+	if (tgtt->cmd_priv_size != 0) {
+		cmd = kzalloc(sizeof(*cmd) + tgtt->cmd_priv_size, gfp_mask);
+		if (cmd != NULL)
+			cmd->cmd_kmalloced = 1;
+	} else
+		cmd = kmem_cache_zalloc(scst_cmd_cachep, gfp_mask);
+
+	if (cmd == NULL)
+		TRACE(TRACE_OUT_OF_MEM, "%s", "Allocation of scst_cmd failed");
+	else if (tgtt->sess_cmd_pool_size != 0)
+		TRACE_DBG("sess %p: cmds pool exhausted", sess);
+
+	return cmd;
+}
+
+/*
+ * Allocates new cmd for sess. Takes it from sess's pool of preallocated
+ * cmds, if there is any free one, or allocates it otherwise. In both cases
+ * the cmd has the target driver's private area of tgtt->cmd_priv_size bytes
+ * right after it.
+ */
+struct scst_cmd *scst_alloc_sess_cmd(struct scst_session *sess,
+	const uint8_t *cdb, unsigned int cdb_len, gfp_t gfp_mask)
+{
+	struct scst_cmd *cmd = NULL;
+	unsigned long flags;
+	int rc;
+
+	TRACE_ENTRY();
+
+	if (likely(sess->tgt->tgtt->sess_cmd_pool_size != 0)) {
+		spin_lock_irqsave(&sess->sess_cmd_pool_lock, flags);
+		if (likely(!list_empty(&sess->sess_cmd_pool_list))) {
+			cmd = list_first_entry(&sess->sess_cmd_pool_list,
+					typeof(*cmd), cmd_list_entry);
+			list_del(&cmd->cmd_list_entry);
+		}
+		spin_unlock_irqrestore(&sess->sess_cmd_pool_lock, flags);
+	}
+
+	if (likely(cmd != NULL)) {
+		memset(cmd, 0, sizeof(*cmd) + sess->tgt->tgtt->cmd_priv_size);
+		cmd->sess_pooled = 1;
+	} else {
+		cmd = scst_alloc_sess_cmd_slow(sess, gfp_mask);
+		if (cmd == NULL)
+			goto out;
+	}
+	cmd->has_tgt_priv_area = (sess->tgt->tgtt->cmd_priv_size != 0);
+
+	rc = scst_pre_init_cmd(cmd, cdb, cdb_len, gfp_mask);
+	if (unlikely(rc != 0))
+		goto out_free;
+
+out:
+	TRACE_EXIT();
+	return cmd;
+
+out_free:
+	scst_free_sess_cmd(sess, cmd);
+	cmd = NULL;
+	goto out;
+}
+
+/* Frees cmd allocated by scst_alloc_sess_cmd() or scst_alloc_cmd() */
+static void scst_free_sess_cmd(struct scst_session *sess,
+	struct scst_cmd *cmd)
+{
+	unsigned long flags;
+
+	if (cmd->sess_pooled) {
+		spin_lock_irqsave(&sess->sess_cmd_pool_lock, flags);
+		list_add(&cmd->cmd_list_entry, &sess->sess_cmd_pool_list);
+		spin_unlock_irqrestore(&sess->sess_cmd_pool_lock, flags);
+	} else if (cmd->cmd_kmalloced)
+		kfree(cmd);
+	else
+		kmem_cache_free(scst_cmd_cachep, cmd);
+	return;
+}
+
 static void scst_destroy_cmd(struct scst_cmd *cmd)
 {
+	struct scst_session *sess = cmd->sess;
 	bool pre_alloced = cmd->pre_alloced;
 
 	TRACE_ENTRY();
 
 	TRACE_DBG("Destroying cmd %p", cmd);
 
-	scst_sess_put(cmd->sess);
-
 	/*
 	 * At this point tgt_dev can be dead, but the pointer remains non-NULL
 	 */
@@ -7091,7 +7288,10 @@ static void scst_destroy_cmd(struct scst_cmd *cmd)
 	/* At this point cmd can be already freed! */
 
 	if (!pre_alloced)
-		kmem_cache_free(scst_cmd_cachep, cmd);
+		scst_free_sess_cmd(sess, cmd);
+
+	/* Pooled cmds must be returned before the session can go away */
+	scst_sess_put(sess);
 
 	TRACE_EXIT();
 	return;
@@ -7165,7 +7365,9 @@ void scst_free_cmd(struct scst_cmd *cmd)
 		TRACE_MGMT_DBG("Freeing aborted cmd %p", cmd);
 
 	EXTRACHECKS_BUG_ON(cmd->unblock_dev || cmd->dec_on_dev_needed ||
-			   cmd->on_dev_exec_list);
+			   cmd->on_dev_exec_list || cmd->on_dev_exec_lba_tree ||
+			   cmd->sched_counted || cmd->aqd_counted);
+	EXTRACHECKS_BUG_ON(!list_empty(&cmd->tgt_dev_cmd_list_entry));
 
 	/*
 	 * Target driver can already free sg buffer before calling
@@ -10568,7 +10770,12 @@ static int get_cdb_info_serv_act_in(struct scst_cmd *cmd,
 		cmd->bufflen = get_unaligned_be32(&cmd->cdb[10]);
 		if (unlikely(cmd->bufflen & SCST_MAX_VALID_BUFFLEN_MASK))
 			goto out_inval_bufflen10;
-		cmd->op_flags |= SCST_WRITE_EXCL_ALLOWED;
+		/*
+		 * The LBA is only the starting point of the returned status,
+		 * data_len is not a number of blocks, so there's no LBA range
+		 * to check or to serialize against.
+		 */
+		cmd->op_flags |= SCST_WRITE_EXCL_ALLOWED | SCST_LBA_NOT_VALID;
 		break;
 	default:
 		cmd->op_flags |= SCST_UNKNOWN_LENGTH | SCST_LBA_NOT_VALID;
@@ -12376,17 +12583,23 @@ void scst_process_reset(struct scst_device *dev,
 
 		spin_lock_irq(&sess->sess_list_lock);
 
-		TRACE_DBG("Searching in sess cmd list (sess=%p)", sess);
-		list_for_each_entry(cmd, &sess->sess_cmd_list,
-					sess_cmd_list_entry) {
+		scst_sort_sess_cmds(sess);
+
+		TRACE_DBG("Searching in tgt_dev cmd list (tgt_dev=%p)",
+			tgt_dev);
+		list_for_each_entry(cmd, &tgt_dev->tgt_dev_cmd_list,
+					tgt_dev_cmd_list_entry) {
 			if (cmd == exclude_cmd)
 				continue;
-			if ((cmd->tgt_dev == tgt_dev) ||
-			    ((cmd->tgt_dev == NULL) &&
-			     (cmd->lun == tgt_dev->lun))) {
+			scst_abort_cmd(cmd, mcmd,
+				(tgt_dev->sess != originator), 0);
+		}
+		list_for_each_entry(cmd, &sess->sess_no_tgt_dev_cmd_list,
+					tgt_dev_cmd_list_entry) {
+			if ((cmd != exclude_cmd) &&
+			    (cmd->lun == tgt_dev->lun))
 				scst_abort_cmd(cmd, mcmd,
 					(tgt_dev->sess != originator), 0);
-			}
 		}
 		spin_unlock_irq(&sess->sess_list_lock);
 	}
@@ -13272,14 +13485,18 @@ static void scst_abort_cmds_tgt_dev(struct scst_tgt_dev *tgt_dev,
 
 	spin_lock_irq(&sess->sess_list_lock);
 
-	list_for_each_entry(cmd, &sess->sess_cmd_list, sess_cmd_list_entry) {
+	scst_sort_sess_cmds(sess);
+
+	list_for_each_entry(cmd, &tgt_dev->tgt_dev_cmd_list,
+			tgt_dev_cmd_list_entry) {
 		if (cmd == exclude_cmd)
 			continue;
-		if ((cmd->tgt_dev == tgt_dev) ||
-		    ((cmd->tgt_dev == NULL) &&
-		     (cmd->lun == tgt_dev->lun))) {
+		scst_abort_cmd(cmd, NULL, (tgt_dev != exclude_cmd->tgt_dev), 0);
+	}
+	list_for_each_entry(cmd, &sess->sess_no_tgt_dev_cmd_list,
+			tgt_dev_cmd_list_entry) {
+		if (cmd->lun == tgt_dev->lun)
 			scst_abort_cmd(cmd, NULL, (tgt_dev != exclude_cmd->tgt_dev), 0);
-		}
 	}
 	spin_unlock_irq(&sess->sess_list_lock);
 
@@ -13645,6 +13862,78 @@ char *scst_get_next_token_str(char **input_str)
 }
 EXPORT_SYMBOL_GPL(scst_get_next_token_str);
 
+/**
+ * scst_parse_uint_params() - parse "name=value" pairs of unsigned ints
+ * @buf:	string to parse, not necessarily '\0' terminated
+ * @count:	length of @buf
+ * @names:	NULL terminated array of the allowed names
+ * @vals:	values of @names, which are set if mentioned in @buf
+ * @prefix:	prefix of the error messages, e.g. the object name
+ *
+ * Parses space or ';' separated "name=value" pairs, as accepted by writes
+ * to the qos, adaptive_queue_depth or io_pattern sysfs attributes. Values
+ * not mentioned in @buf stay unchanged. Returns 0 on success or negative
+ * error code.
+ */
+int scst_parse_uint_params(const char *buf, size_t count,
+	const char *const names[], unsigned int vals[], const char *prefix)
+{
+	char *p, *pp, *name, *val;
+	int i, res;
+
+	TRACE_ENTRY();
+
+	p = kasprintf(GFP_KERNEL, "%.*s", (int)count, buf);
+	if (p == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	pp = p;
+	while ((name = strsep(&pp, " \t\n;")) != NULL) {
+		unsigned long v;
+
+		if (*name == '\0')
+			continue;
+
+		val = strchr(name, '=');
+		if (val == NULL) {
+			PRINT_ERROR("%s: value expected for %s", prefix, name);
+			res = -EINVAL;
+			goto out_free;
+		}
+		*val++ = '\0';
+
+		res = kstrtoul(val, 0, &v);
+		if ((res != 0) || (v > UINT_MAX)) {
+			PRINT_ERROR("%s: invalid value %s for %s", prefix, val,
+				name);
+			res = -EINVAL;
+			goto out_free;
+		}
+
+		for (i = 0; names[i] != NULL; i++) {
+			if (strcasecmp(name, names[i]) == 0)
+				break;
+		}
+		if (names[i] == NULL) {
+			PRINT_ERROR("%s: unknown parameter %s", prefix, name);
+			res = -EINVAL;
+			goto out_free;
+		}
+		vals[i] = v;
+	}
+
+	res = 0;
+
+out_free:
+	kfree(p);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 static int scst_parse_unmap_descriptors(struct scst_cmd *cmd)
 {
 	int res = 0;
@@ -174,6 +174,7 @@ cpumask_t default_cpu_mask;
 
 static unsigned int scst_max_cmd_mem;
 unsigned int scst_max_dev_cmd_mem;
+static int scst_sgv_max_page_kb;
 int scst_forcibly_close_sessions;
 
 module_param_named(scst_threads, scst_threads, int, 0);
@@ -187,6 +188,11 @@ module_param_named(scst_max_dev_cmd_mem, scst_max_dev_cmd_mem, int, S_IRUGO);
 MODULE_PARM_DESC(scst_max_dev_cmd_mem, "Maximum memory allowed to be consumed "
 	"by all SCSI commands of a device at any given time in MB");
 
+module_param_named(scst_sgv_max_page_kb, scst_sgv_max_page_kb, int, S_IRUGO);
+MODULE_PARM_DESC(scst_sgv_max_page_kb, "Max size in KB of physically "
+	"contiguous blocks of pages the clustered SGV pool allocates at once "
+	"(0 - only single pages, otherwise a power of 2 from 64 to 2048)");
+
 module_param_named(forcibly_close_sessions, scst_forcibly_close_sessions, int,
 		   S_IWUSR | S_IRUGO);
 MODULE_PARM_DESC(forcibly_close_sessions,
@@ -2647,7 +2653,8 @@ static int __init init_scst(void)
 		scst_max_dev_cmd_mem = scst_max_cmd_mem * 2 / 5;
 
 	res = scst_sgv_pools_init(
-		((uint64_t)scst_max_cmd_mem << 10) >> (PAGE_SHIFT - 10), 0);
+		((uint64_t)scst_max_cmd_mem << 10) >> (PAGE_SHIFT - 10), 0,
+		scst_sgv_max_page_kb);
 	if (res != 0)
 		goto out_sysfs_cleanup;
 
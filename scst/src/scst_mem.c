@@ -23,6 +23,7 @@
 #include <linux/slab.h>
 #include <linux/sched.h>
 #include <linux/mm.h>
+#include <linux/log2.h>
 #include <linux/unistd.h>
 #include <linux/string.h>
 
@@ -620,16 +621,63 @@ static struct page *sgv_alloc_sys_pages(struct scatterlist *sg,
 	return page;
 }
 
-static int sgv_alloc_sg_entries(struct scatterlist *sg, int pages,
-	gfp_t gfp_mask, enum sgv_clustering_types clustering_type,
+/*
+ * Tries to allocate 2^*order contiguous pages, falling back to smaller orders
+ * down to 1 if memory is fragmented. On success *order is set to the order of
+ * the allocated block. If nothing could be allocated, NULL returned and *order
+ * set to 0, so the caller should fall back to single pages.
+ *
+ * The block is split, so the pages are freed one by one by
+ * sgv_free_sys_sg_entries() and each of them has its own reference counter
+ * like pages allocated by sgv_alloc_sys_pages(). It matters for target
+ * drivers, which get and put individual pages of the SG vector.
+ */
+static struct page *sgv_alloc_sys_large_pages(struct sgv_pool *pool,
+	struct scatterlist *sg, gfp_t gfp_mask, int *order)
+{
+	struct page *page = NULL;
+	int o;
+
+	gfp_mask |= __GFP_NOWARN | __GFP_NORETRY;
+	gfp_mask &= ~__GFP_NOFAIL;
+
+	for (o = *order; o > 0; o--) {
+		page = alloc_pages(gfp_mask, o);
+		if (page != NULL)
+			break;
+		atomic_inc(&pool->large_fallback);
+	}
+
+	TRACE_MEM("page=%p, sg=%p, order %d (requested %d)", page, sg, o,
+		*order);
+
+	*order = o;
+	if (page == NULL)
+		goto out;
+
+	split_page(page, o);
+	sg_set_page(sg, page, PAGE_SIZE << o, 0);
+
+	atomic_inc(&pool->large_alloc);
+	atomic_add(1 << o, &pool->large_pages);
+
+out:
+	return page;
+}
+
+/* pool can be NULL, then only single pages are allocated */
+static int sgv_alloc_sg_entries(struct sgv_pool *pool, struct scatterlist *sg,
+	int pages, gfp_t gfp_mask, enum sgv_clustering_types clustering_type,
 	struct trans_tbl_ent *trans_tbl,
 	const struct sgv_pool_alloc_fns *alloc_fns, void *priv)
 {
 	int sg_count = 0;
-	int pg, i, j;
+	int pg, i, j, order;
 	int merged = -1;
+	int max_order = (pool != NULL) ? ACCESS_ONCE(pool->max_page_order) : 0;
 
-	TRACE_MEM("pages=%d, clustering_type=%d", pages, clustering_type);
+	TRACE_MEM("pages=%d, clustering_type=%d, max_order=%d", pages,
+		clustering_type, max_order);
 
 #if 0
 	gfp_mask |= __GFP_COLD;
@@ -638,18 +686,30 @@ static int sgv_alloc_sg_entries(struct scatterlist *sg, int pages,
 	gfp_mask |= __GFP_ZERO;
 #endif
 
-	for (pg = 0; pg < pages; pg++) {
-		void *rc;
+	for (pg = 0; pg < pages; pg += 1 << order) {
+		void *rc = NULL;
+
+		order = 0;
+		if ((max_order > 0) && ((pages - pg) > 1)) {
+			order = min_t(int, max_order, ilog2(pages - pg));
+			rc = sgv_alloc_sys_large_pages(pool, &sg[sg_count],
+				gfp_mask, &order);
+			/* Don't retry the orders, which have just failed */
+			max_order = order;
+		}
+
+		if (rc == NULL) {
 #ifdef CONFIG_SCST_DEBUG_OOM
-		if (((gfp_mask & __GFP_NOFAIL) != __GFP_NOFAIL) &&
-		    ((scst_random() % 10000) == 55))
-			rc = NULL;
-		else
+			if (((gfp_mask & __GFP_NOFAIL) != __GFP_NOFAIL) &&
+			    ((scst_random() % 10000) == 55))
+				rc = NULL;
+			else
 #endif
-			rc = alloc_fns->alloc_pages_fn(&sg[sg_count], gfp_mask,
-				priv);
-		if (rc == NULL)
-			goto out_no_mem;
+				rc = alloc_fns->alloc_pages_fn(&sg[sg_count],
+					gfp_mask, priv);
+			if (rc == NULL)
+				goto out_no_mem;
+		}
 
 		/*
 		 * This code allows compiler to see full body of the clustering
@@ -673,7 +733,7 @@ static int sgv_alloc_sg_entries(struct scatterlist *sg, int pages,
 
 	if ((clustering_type != sgv_no_clustering) && (trans_tbl != NULL)) {
 		pg = 0;
-		for (i = 0; i < pages; i++) {
+		for (i = 0; i < sg_count; i++) {
 			int n = PAGE_ALIGN(sg[i].length) >> PAGE_SHIFT;
 
 			trans_tbl[i].pg_count = pg;
@@ -1098,7 +1158,7 @@ struct scatterlist *sgv_pool_alloc(struct sgv_pool *pool, unsigned int size,
 		TRACE_MEM("Big or no_cached obj %p (size %d)", obj, sz);
 	}
 
-	obj->sg_count = sgv_alloc_sg_entries(obj->sg_entries,
+	obj->sg_count = sgv_alloc_sg_entries(pool, obj->sg_entries,
 		pages_to_alloc, gfp_mask, pool->clustering_type,
 		obj->trans_tbl, &pool->alloc_fns, priv);
 	if (unlikely(obj->sg_count <= 0)) {
@@ -1346,8 +1406,8 @@ struct scatterlist *scst_alloc_sg(int size, gfp_t gfp_mask, int *count)
 	 * scst_free_sg() to figure out how many pages are in the SG vector.
 	 * So, let's always don't use clustering.
 	 */
-	cnt = sgv_alloc_sg_entries(res, pages, gfp_mask, sgv_no_clustering,
-			NULL, &sys_alloc_fns, NULL);
+	cnt = sgv_alloc_sg_entries(NULL, res, pages, gfp_mask,
+			sgv_no_clustering, NULL, &sys_alloc_fns, NULL);
 	if (cnt <= 0)
 		goto out_free;
 
@@ -1464,6 +1524,9 @@ static int sgv_pool_init(struct sgv_pool *pool, const char *name,
 	atomic_set(&pool->other_alloc, 0);
 	atomic_set(&pool->other_pages, 0);
 	atomic_set(&pool->other_merged, 0);
+	atomic_set(&pool->large_alloc, 0);
+	atomic_set(&pool->large_pages, 0);
+	atomic_set(&pool->large_fallback, 0);
 
 	pool->clustering_type = clustering_type;
 	pool->single_alloc_pages = single_alloc_pages;
@@ -1648,10 +1711,65 @@ void sgv_pool_set_allocator(struct sgv_pool *pool,
 {
 	pool->alloc_fns.alloc_pages_fn = alloc_pages_fn;
 	pool->alloc_fns.free_pages_fn = free_pages_fn;
+	/* Large pages are supported only by the system allocator */
+	pool->max_page_order = 0;
 	return;
 }
 EXPORT_SYMBOL_GPL(sgv_pool_set_allocator);
 
+/**
+ * sgv_pool_set_max_page_kb - set max size of physically contiguous blocks
+ * @pool:	the cache
+ * @max_page_kb: max size in KB of a block of pages allocated at once or 0,
+ *		if only single pages should be allocated
+ *
+ * Description:
+ *    Allows a clustered SGV pool using the system pages allocator to back
+ *    its SG vectors by high order pages, so big buffers need much fewer
+ *    SG entries. If the memory is too fragmented for the requested order,
+ *    the pool falls back to smaller orders down to single pages.
+ *    max_page_kb must be a power of 2 between 64 and 2048. Returns 0 on
+ *    success or negative error code otherwise.
+ */
+int sgv_pool_set_max_page_kb(struct sgv_pool *pool, int max_page_kb)
+{
+	int res = 0, order = 0;
+
+	TRACE_ENTRY();
+
+	if (max_page_kb == 0)
+		goto out_set;
+
+	if (!sgv_pool_clustered(pool) ||
+	    (pool->alloc_fns.alloc_pages_fn != sgv_alloc_sys_pages)) {
+		PRINT_ERROR("SGV pool %s doesn't support large pages",
+			pool->name);
+		res = -EINVAL;
+		goto out;
+	}
+
+	if ((max_page_kb < 64) || (max_page_kb > 2048) ||
+	    !is_power_of_2(max_page_kb)) {
+		PRINT_ERROR("Invalid max page size %d KB for SGV pool %s",
+			max_page_kb, pool->name);
+		res = -EINVAL;
+		goto out;
+	}
+
+	order = min_t(int, get_order(max_page_kb << 10), MAX_ORDER - 1);
+
+out_set:
+	pool->max_page_order = order;
+
+	PRINT_INFO("Max page size of SGV pool %s set to %lu KB", pool->name,
+		(PAGE_SIZE << order) >> 10);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+EXPORT_SYMBOL_GPL(sgv_pool_set_max_page_kb);
+
 /**
  * sgv_pool_create - creates and initializes an SGV pool
  * @name:	the name of the SGV pool
@@ -1780,8 +1898,9 @@ void sgv_pool_del(struct sgv_pool *pool)
 }
 EXPORT_SYMBOL_GPL(sgv_pool_del);
 
-/* Both parameters in pages */
-int scst_sgv_pools_init(unsigned long mem_hwmark, unsigned long mem_lwmark)
+/* Both watermarks in pages */
+int scst_sgv_pools_init(unsigned long mem_hwmark, unsigned long mem_lwmark,
+	int max_page_kb)
 {
 	int res = 0;
 
@@ -1805,6 +1924,11 @@ int scst_sgv_pools_init(unsigned long mem_hwmark, unsigned long mem_lwmark)
 	if (sgv_norm_clust_pool == NULL)
 		goto out_free_norm;
 
+	if ((max_page_kb != 0) &&
+	    (sgv_pool_set_max_page_kb(sgv_norm_clust_pool, max_page_kb) != 0))
+		PRINT_WARNING("Large pages for SGV pool %s disabled",
+			sgv_norm_clust_pool->name);
+
 	sgv_dma_pool = sgv_pool_create("sgv-dma", sgv_no_clustering, 0,
 				false, 0);
 	if (sgv_dma_pool == NULL)
@@ -1861,12 +1985,29 @@ void scst_sgv_pools_deinit(void)
 	return;
 }
 
+/*
+ * Returns how many SG entries there are per 1 MB of the allocated pages with
+ * the given number of merged pages, i.e. how many entries the target driver
+ * and the dev handler have to walk for each MB of data.
+ */
+static int sgv_sg_per_mb(int pages, int merged)
+{
+	u64 n;
+
+	if (pages <= 0)
+		return 0;
+
+	n = (u64)(pages - merged) << (20 - PAGE_SHIFT);
+	do_div(n, pages);
+	return n;
+}
+
 #ifdef CONFIG_SCST_PROC
 
 static void sgv_do_proc_read(struct seq_file *seq, const struct sgv_pool *pool)
 {
 	int i, total = 0, hit = 0, merged = 0, allocated = 0;
-	int oa, om;
+	int oa, om, tp, tm;
 
 	for (i = 0; i < pool->max_caches; i++) {
 		int t;
@@ -1883,6 +2024,9 @@ static void sgv_do_proc_read(struct seq_file *seq, const struct sgv_pool *pool)
 		merged += atomic_read(&pool->cache_acc[i].merged);
 	}
 
+	tp = allocated;
+	tm = merged;
+
 	seq_printf(seq, "\n%-30s %-11d %-11d %-11d %d/%d/%d\n", pool->name,
 		hit, total, (allocated != 0) ? merged*100/allocated : 0,
 		pool->cached_pages, pool->inactive_cached_pages,
@@ -1914,6 +2058,16 @@ static void sgv_do_proc_read(struct seq_file *seq, const struct sgv_pool *pool)
 		(allocated != 0) ? merged*100/allocated : 0,
 		(oa != 0) ? om/oa : 0);
 
+	tp += allocated + oa;
+	tm += merged + om;
+
+	seq_printf(seq, "  %-40s %d/%d/%d\n", "large allocs/pages/fallbacks",
+		atomic_read(&pool->large_alloc),
+		atomic_read(&pool->large_pages),
+		atomic_read(&pool->large_fallback));
+	seq_printf(seq, "  %-40s %d\n", "SG entries per MB",
+		sgv_sg_per_mb(tp, tm));
+
 	return;
 }
 
@@ -1962,7 +2116,7 @@ static ssize_t sgv_sysfs_stat_show(struct kobject *kobj,
 {
 	struct sgv_pool *pool;
 	int i, total = 0, hit = 0, merged = 0, allocated = 0;
-	int oa, om, res;
+	int oa, om, tp, tm, res;
 
 	pool = container_of(kobj, struct sgv_pool, sgv_kobj);
 
@@ -1978,6 +2132,9 @@ static ssize_t sgv_sysfs_stat_show(struct kobject *kobj,
 		merged += atomic_read(&pool->cache_acc[i].merged);
 	}
 
+	tp = allocated;
+	tm = merged;
+
 	res = sprintf(buf, "%-30s %-11s %-11s %-11s %-11s", "Name", "Hit", "Total",
 		"% merged", "Cached (P/I/O)");
 
@@ -2010,6 +2167,17 @@ static ssize_t sgv_sysfs_stat_show(struct kobject *kobj,
 		(allocated != 0) ? merged*100/allocated : 0,
 		(oa != 0) ? om/oa : 0);
 
+	tp += allocated + oa;
+	tm += merged + om;
+
+	res += sprintf(&buf[res], "  %-40s %d/%d/%d\n",
+		"large allocs/pages/fallbacks",
+		atomic_read(&pool->large_alloc),
+		atomic_read(&pool->large_pages),
+		atomic_read(&pool->large_fallback));
+	res += sprintf(&buf[res], "  %-40s %d\n", "SG entries per MB",
+		sgv_sg_per_mb(tp, tm));
+
 	return res;
 }
 
@@ -2034,6 +2202,9 @@ static ssize_t sgv_sysfs_stat_reset(struct kobject *kobj,
 	atomic_set(&pool->big_alloc, 0);
 	atomic_set(&pool->other_pages, 0);
 	atomic_set(&pool->other_merged, 0);
+	atomic_set(&pool->large_alloc, 0);
+	atomic_set(&pool->large_pages, 0);
+	atomic_set(&pool->large_fallback, 0);
 	atomic_set(&pool->other_alloc, 0);
 
 	PRINT_INFO("Statistics for SGV pool %s reset", pool->name);
@@ -2086,12 +2257,59 @@ static ssize_t sgv_sysfs_global_stat_reset(struct kobject *kobj,
 	return count;
 }
 
+static ssize_t sgv_sysfs_max_page_kb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct sgv_pool *pool;
+	int order;
+
+	pool = container_of(kobj, struct sgv_pool, sgv_kobj);
+	order = ACCESS_ONCE(pool->max_page_order);
+
+	return sprintf(buf, "%lu\n",
+		(order != 0) ? (PAGE_SIZE << order) >> 10 : 0);
+}
+
+static ssize_t sgv_sysfs_max_page_kb_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct sgv_pool *pool;
+	unsigned long val;
+	int res;
+
+	TRACE_ENTRY();
+
+	pool = container_of(kobj, struct sgv_pool, sgv_kobj);
+
+	res = kstrtoul(buf, 0, &val);
+	if (res != 0) {
+		PRINT_ERROR("kstrtoul() for %s failed: %d", buf, res);
+		goto out;
+	}
+
+	res = sgv_pool_set_max_page_kb(pool, min_t(unsigned long, val,
+						INT_MAX));
+	if (res != 0)
+		goto out;
+
+	res = count;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 static struct kobj_attribute sgv_stat_attr =
 	__ATTR(stats, S_IRUGO | S_IWUSR, sgv_sysfs_stat_show,
 		sgv_sysfs_stat_reset);
 
+static struct kobj_attribute sgv_max_page_kb_attr =
+	__ATTR(max_page_kb, S_IRUGO | S_IWUSR, sgv_sysfs_max_page_kb_show,
+		sgv_sysfs_max_page_kb_store);
+
 static struct attribute *sgv_attrs[] = {
 	&sgv_stat_attr.attr,
+	&sgv_max_page_kb_attr.attr,
 	NULL,
 };
 
@@ -84,6 +84,12 @@ struct sgv_pool {
 	int single_alloc_pages;
 	int max_cached_pages;
 
+	/*
+	 * Max order of the pages allocated at once from the system
+	 * allocator. 0 means that only single pages are allocated.
+	 */
+	int max_page_order;
+
 	struct sgv_pool_alloc_fns alloc_fns;
 
 	/* <=4K, <=8, <=16, <=32, <=64, <=128, <=256, <=512, <=1024, <=2048 */
@@ -119,6 +125,9 @@ struct sgv_pool {
 	atomic_t big_alloc, big_pages, big_merged;
 	atomic_t other_alloc, other_pages, other_merged;
 
+	/* High order allocations: done, pages in them and failed attempts */
+	atomic_t large_alloc, large_pages, large_fallback;
+
 	atomic_t sgv_pool_ref;
 
 	int max_caches;
@@ -142,7 +151,8 @@ static inline struct scatterlist *sgv_pool_sg(struct sgv_pool_obj *obj)
 	return obj->sg_entries;
 }
 
-int scst_sgv_pools_init(unsigned long mem_hwmark, unsigned long mem_lwmark);
+int scst_sgv_pools_init(unsigned long mem_hwmark, unsigned long mem_lwmark,
+	int max_page_kb);
 void scst_sgv_pools_deinit(void);
 
 #ifdef CONFIG_SCST_PROC
@@ -691,6 +691,7 @@ int scst_set_pending_UA(struct scst_cmd *cmd, uint8_t *buf, int *size);
 
 void scst_report_luns_changed(struct scst_acg *acg);
 
+void scst_sort_sess_cmds(struct scst_session *sess);
 void scst_abort_cmd(struct scst_cmd *cmd, struct scst_mgmt_cmd *mcmd,
 	bool other_ini, bool call_dev_task_mgmt_fn);
 void scst_process_reset(struct scst_device *dev,
@@ -721,6 +722,141 @@ void scst_block_dev(struct scst_device *dev);
 void scst_unblock_dev(struct scst_device *dev);
 bool scst_do_check_blocked_dev(struct scst_cmd *cmd);
 bool __scst_check_blocked_dev(struct scst_cmd *cmd);
+
+int scst_parse_uint_params(const char *buf, size_t count,
+	const char *const names[], unsigned int vals[], const char *prefix);
+
+void scst_qos_init(struct scst_qos *qos);
+void scst_qos_cleanup(struct scst_qos *qos);
+bool __scst_qos_throttle(struct scst_cmd *cmd);
+void scst_qos_abort_cmd(struct scst_cmd *cmd);
+ssize_t scst_qos_show(struct scst_qos *qos, char *buf);
+int scst_qos_store(struct scst_qos *qos, const char *buf, size_t count);
+ssize_t scst_qos_stats_show(struct scst_qos *qos, char *buf);
+void scst_qos_stats_reset(struct scst_qos *qos);
+
+/*
+ * Returns true if cmd deferred because of QoS limits, hence stop processing
+ * it and go to the next command.
+ */
+static inline bool scst_qos_throttle(struct scst_cmd *cmd)
+{
+	if (likely(!cmd->dev->dev_qos.qos_enabled &&
+		   !cmd->tgt_dev->tgt_dev_qos.qos_enabled &&
+		   !cmd->sess->sess_qos.qos_enabled))
+		return false;
+	return __scst_qos_throttle(cmd);
+}
+
+#define SCST_SCHED_DEF_WEIGHT	100
+#define SCST_SCHED_MAX_WEIGHT	10000
+#define SCST_SCHED_MAX_DEPTH	4096
+
+void scst_sched_dev_init(struct scst_device *dev);
+void scst_sched_tgt_dev_init(struct scst_tgt_dev *tgt_dev);
+void scst_sched_tgt_dev_cleanup(struct scst_tgt_dev *tgt_dev);
+bool __scst_sched_queue(struct scst_cmd *cmd);
+void __scst_sched_done(struct scst_cmd *cmd);
+void scst_sched_set_depth(struct scst_device *dev, int depth);
+void scst_sched_set_weight(struct scst_tgt_dev *tgt_dev, unsigned int weight);
+ssize_t scst_sched_stats_show(struct scst_tgt_dev *tgt_dev, char *buf);
+void scst_sched_stats_reset(struct scst_tgt_dev *tgt_dev);
+
+/*
+ * Returns true if cmd queued by the device scheduler, hence stop processing
+ * it and go to the next command.
+ */
+static inline bool scst_sched_queue(struct scst_cmd *cmd)
+{
+	if (likely(ACCESS_ONCE(cmd->dev->sched_depth) == 0))
+		return false;
+	return __scst_sched_queue(cmd);
+}
+
+/* Must be called when cmd finished on the device */
+static inline void scst_sched_done(struct scst_cmd *cmd)
+{
+	if (unlikely(cmd->sched_counted))
+		__scst_sched_done(cmd);
+}
+
+/*
+ * Returns true if cmd deferred by the QoS limits or queued by the device
+ * scheduler, hence stop processing it and go to the next command. Cmds,
+ * which already passed both, e.g. dispatched by the scheduler or unblocked
+ * after scst_check_blocked_dev(), aren't checked and charged again.
+ */
+static inline bool scst_exec_admit_defer(struct scst_cmd *cmd)
+{
+	if (cmd->exec_admitted)
+		return false;
+	if (unlikely(scst_qos_throttle(cmd)))
+		return true;
+	if (unlikely(scst_sched_queue(cmd)))
+		return true;
+	cmd->exec_admitted = 1;
+	return false;
+}
+
+void scst_aqd_init(struct scst_aqd *aqd);
+void scst_aqd_cleanup(struct scst_aqd *aqd);
+bool __scst_aqd_check(struct scst_cmd *cmd);
+void __scst_aqd_done(struct scst_cmd *cmd);
+ssize_t scst_aqd_show(struct scst_device *dev, char *buf);
+int scst_aqd_store(struct scst_device *dev, const char *buf, size_t count);
+ssize_t scst_aqd_stats_show(struct scst_device *dev, char *buf);
+void scst_aqd_stats_reset(struct scst_device *dev);
+
+/*
+ * No locks, but might be on IRQ. Returns true if cmd is over the adaptive
+ * queue depth of its device and must be rejected.
+ */
+static inline bool scst_aqd_check(struct scst_cmd *cmd)
+{
+	if (likely(ACCESS_ONCE(cmd->dev->dev_aqd.aqd_target_lat_us) == 0))
+		return false;
+	return __scst_aqd_check(cmd);
+}
+
+/* Must be called when cmd is sent to the device */
+static inline void scst_aqd_exec_start(struct scst_cmd *cmd)
+{
+	if (unlikely(cmd->aqd_counted))
+		cmd->aqd_exec_start = ktime_get();
+}
+
+/* Must be called when cmd finished on the device */
+static inline void scst_aqd_done(struct scst_cmd *cmd)
+{
+	if (unlikely(cmd->aqd_counted) &&
+	    (ktime_to_ns(cmd->aqd_exec_start) != 0))
+		__scst_aqd_done(cmd);
+}
+
+/* Must be called when cmd leaves SCST's processing */
+static inline void scst_aqd_put(struct scst_cmd *cmd)
+{
+	if (unlikely(cmd->aqd_counted)) {
+		atomic_dec(&cmd->dev->dev_aqd.aqd_cmd_count);
+		cmd->aqd_counted = 0;
+	}
+}
+
+void scst_iopat_init(struct scst_device *dev);
+void scst_iopat_cleanup(struct scst_device *dev);
+void __scst_iopat_account(struct scst_cmd *cmd);
+ssize_t scst_iopat_show(struct scst_device *dev, char *buf);
+int scst_iopat_store(struct scst_device *dev, const char *buf, size_t count);
+ssize_t scst_iopat_data_read(struct scst_device *dev, char *buf, loff_t off,
+	size_t count);
+
+/* Must be called when cmd is sent to the device */
+static inline void scst_iopat_account(struct scst_cmd *cmd)
+{
+	if (unlikely(ACCESS_ONCE(cmd->dev->dev_iopat) != NULL))
+		__scst_iopat_account(cmd);
+}
+
 void __scst_check_unblock_dev(struct scst_cmd *cmd);
 void scst_check_unblock_dev(struct scst_cmd *cmd);
 
@@ -795,6 +931,9 @@ static inline void scst_sess_put(struct scst_session *sess)
 
 struct scst_cmd *scst_alloc_cmd(const uint8_t *cdb,
 	unsigned int cdb_len, gfp_t gfp_mask);
+struct scst_cmd *scst_alloc_sess_cmd(struct scst_session *sess,
+	const uint8_t *cdb, unsigned int cdb_len, gfp_t gfp_mask);
+int scst_alloc_sess_cmd_pool(struct scst_session *sess);
 int scst_pre_init_cmd(struct scst_cmd *cmd, const uint8_t *cdb,
 	unsigned int cdb_len, gfp_t gfp_mask);
 void scst_free_cmd(struct scst_cmd *cmd);
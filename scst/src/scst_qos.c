@@ -0,0 +1,452 @@
+/*
+ *  scst_qos.c
+ *
+ *  IOPS and bandwidth limits (QoS) of sessions, tgt_devs and devices.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/ctype.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#ifdef INSIDE_KERNEL_TREE
+#include <scst/scst.h>
+#else
+#include "scst.h"
+#endif
+#include "scst_priv.h"
+
+/*
+ * Each of the session, tgt_dev and device has its own IOPS and bandwidth
+ * token buckets. A command is executed only if it conforms to all of them,
+ * then it is charged to all of them. A command, which doesn't conform, is
+ * put on the throttled list of the first bucket owner it doesn't conform
+ * to, and the owner's hrtimer is armed for the moment the head of the list
+ * becomes conforming. When the timer fires, it charges and puts back to the
+ * active cmd list in EXEC_CHECK_BLOCKING state only the commands from the
+ * head of the list, which conform, and rearms itself for the next one. The
+ * released commands are then rechecked only by the other owners.
+ *
+ * Aborted commands are not throttled. If a command is aborted while being
+ * throttled, scst_qos_abort_cmd() fires the timers at once and they release
+ * all aborted commands regardless of the tokens, so TM functions and the
+ * session unregistration don't wait for the buckets.
+ *
+ * Commands larger than the burst are allowed, the bucket then goes into
+ * debt, which delays the following commands.
+ */
+
+/* Max burst in ms, used, if no burst set */
+#define SCST_QOS_DEF_BURST_MS	100
+
+/* qos_lock supposed to be held */
+static void scst_qos_bucket_set(struct scst_qos_bucket *b, uint64_t rate,
+	uint64_t burst)
+{
+	b->rate = rate;
+	if (rate == 0) {
+		b->tau = 0;
+		return;
+	}
+
+	if (burst == 0)
+		b->tau = SCST_QOS_DEF_BURST_MS * NSEC_PER_MSEC;
+	else
+		b->tau = div64_u64(burst * NSEC_PER_SEC, rate);
+	return;
+}
+
+/*
+ * qos_lock supposed to be held. Returns 0, if the next command conforms to
+ * bucket @b, otherwise number of ns to wait.
+ */
+static uint64_t scst_qos_bucket_delay(const struct scst_qos_bucket *b,
+	uint64_t now)
+{
+	if ((b->rate == 0) || (b->tat <= now + b->tau))
+		return 0;
+	return b->tat - b->tau - now;
+}
+
+/* qos_lock supposed to be held */
+static void scst_qos_bucket_charge(struct scst_qos_bucket *b, uint64_t cost,
+	uint64_t now)
+{
+	if (b->rate == 0)
+		return;
+	if (b->tat < now)
+		b->tat = now;
+	b->tat += div64_u64(cost * NSEC_PER_SEC, b->rate);
+	return;
+}
+
+static inline uint64_t scst_qos_cmd_bytes(const struct scst_cmd *cmd)
+{
+	return (uint64_t)cmd->bufflen + cmd->out_bufflen;
+}
+
+/* Levels of the bucket owners, in order of checking */
+enum {
+	SCST_QOS_DEV = 0,
+	SCST_QOS_TGT_DEV,
+	SCST_QOS_SESS,
+	SCST_QOS_LEVELS,
+};
+
+static inline struct scst_qos *scst_qos_get(struct scst_cmd *cmd, int level)
+{
+	switch (level) {
+	case SCST_QOS_DEV:
+		return &cmd->dev->dev_qos;
+	case SCST_QOS_TGT_DEV:
+		return &cmd->tgt_dev->tgt_dev_qos;
+	default:
+		return &cmd->sess->sess_qos;
+	}
+}
+
+static enum hrtimer_restart scst_qos_timer_fn(struct hrtimer *timer)
+{
+	struct scst_qos *qos = container_of(timer, struct scst_qos, qos_timer);
+	struct scst_cmd *cmd, *tcmd;
+	unsigned long flags;
+	ktime_t now_kt = ktime_get();
+	uint64_t now = ktime_to_ns(now_kt);
+	LIST_HEAD(cmd_list);
+
+	TRACE_ENTRY();
+
+	spin_lock_irqsave(&qos->qos_lock, flags);
+
+	if (unlikely(qos->qos_abort_pending)) {
+		qos->qos_abort_pending = false;
+		list_for_each_entry_safe(cmd, tcmd,
+				&qos->qos_throttled_cmd_list, qos_list_entry) {
+			if (!test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags))
+				continue;
+			TRACE_MGMT_DBG("Releasing aborted throttled cmd %p "
+				"(tag %llu)", cmd, (unsigned long long)cmd->tag);
+			list_move_tail(&cmd->qos_list_entry, &cmd_list);
+			qos->qos_throttled_ns += ktime_to_ns(ktime_sub(now_kt,
+						cmd->qos_throttle_start));
+		}
+	}
+
+	while (!list_empty(&qos->qos_throttled_cmd_list)) {
+		uint64_t delay;
+		int level;
+
+		cmd = list_first_entry(&qos->qos_throttled_cmd_list,
+				struct scst_cmd, qos_list_entry);
+
+		delay = max(scst_qos_bucket_delay(&qos->qos_iops_bucket, now),
+			    scst_qos_bucket_delay(&qos->qos_bw_bucket, now));
+		if (delay != 0) {
+			/* Called from the callback, it is allowed */
+			hrtimer_start(&qos->qos_timer, ns_to_ktime(delay),
+				HRTIMER_MODE_REL);
+			break;
+		}
+
+		list_move_tail(&cmd->qos_list_entry, &cmd_list);
+		qos->qos_throttled_ns += ktime_to_ns(ktime_sub(now_kt,
+						cmd->qos_throttle_start));
+
+		/* Charge now, so the next cmds see it */
+		scst_qos_bucket_charge(&qos->qos_iops_bucket, 1, now);
+		scst_qos_bucket_charge(&qos->qos_bw_bucket,
+			scst_qos_cmd_bytes(cmd), now);
+		for (level = 0; level < SCST_QOS_LEVELS; level++) {
+			if (scst_qos_get(cmd, level) == qos) {
+				cmd->qos_charged |= 1 << level;
+				break;
+			}
+		}
+	}
+	spin_unlock_irqrestore(&qos->qos_lock, flags);
+
+	/* cmd_list is private, so no locking needed for it */
+	list_for_each_entry_safe(cmd, tcmd, &cmd_list, qos_list_entry) {
+		struct scst_cmd_threads *cmd_threads = cmd->cmd_threads;
+
+		list_del(&cmd->qos_list_entry);
+
+		TRACE_DBG("Adding throttled cmd %p to active cmd list", cmd);
+		spin_lock_irqsave(&cmd_threads->cmd_list_lock, flags);
+		list_add_tail(&cmd->cmd_list_entry,
+			&cmd_threads->active_cmd_list);
+		wake_up(&cmd_threads->cmd_list_waitQ);
+		spin_unlock_irqrestore(&cmd_threads->cmd_list_lock, flags);
+		/* !! cmd can be already dead here !! */
+	}
+
+	TRACE_EXIT();
+	return HRTIMER_NORESTART;
+}
+
+/* qos_lock supposed to be held */
+static void scst_qos_defer(struct scst_qos *qos, struct scst_cmd *cmd,
+	uint64_t delay)
+{
+	cmd->qos_throttle_start = ktime_get();
+	list_add_tail(&cmd->qos_list_entry, &qos->qos_throttled_cmd_list);
+	qos->qos_throttled_cmds++;
+
+	/*
+	 * If the timer callback is running now, it will rearm the timer for
+	 * the head of the list after it gets qos_lock.
+	 */
+	if (!hrtimer_is_queued(&qos->qos_timer))
+		hrtimer_start(&qos->qos_timer, ns_to_ktime(delay),
+			HRTIMER_MODE_REL);
+	return;
+}
+
+/*
+ * Returns true if cmd deferred, hence stop processing it and go to the next
+ * command. Owners, whose timer released cmd, have already charged it, so
+ * they are skipped.
+ */
+bool __scst_qos_throttle(struct scst_cmd *cmd)
+{
+	uint64_t now, bytes = scst_qos_cmd_bytes(cmd);
+	unsigned long flags;
+	bool res = false;
+	int i;
+
+	TRACE_ENTRY();
+
+	/* Let aborted and internal cmds and HQ cmds go as fast as possible */
+	if (unlikely(test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags)) ||
+	    cmd->internal ||
+	    (cmd->queue_type == SCST_CMD_QUEUE_HEAD_OF_QUEUE))
+		goto out;
+
+	now = ktime_to_ns(ktime_get());
+
+	for (i = 0; i < SCST_QOS_LEVELS; i++) {
+		struct scst_qos *qos = scst_qos_get(cmd, i);
+		uint64_t delay;
+
+		if (!qos->qos_enabled || (cmd->qos_charged & (1 << i)))
+			continue;
+
+		spin_lock_irqsave(&qos->qos_lock, flags);
+		delay = max(scst_qos_bucket_delay(&qos->qos_iops_bucket, now),
+			    scst_qos_bucket_delay(&qos->qos_bw_bucket, now));
+		/* Keep FIFO order with already throttled cmds */
+		if ((delay != 0) ||
+		    !list_empty(&qos->qos_throttled_cmd_list)) {
+			/* Sync with scst_qos_abort_cmd() under qos_lock */
+			if (unlikely(test_bit(SCST_CMD_ABORTED,
+					&cmd->cmd_flags))) {
+				spin_unlock_irqrestore(&qos->qos_lock, flags);
+				goto out;
+			}
+			TRACE_DBG("Throttling cmd %p (tag %llu, delay %lld ns)",
+				cmd, (unsigned long long)cmd->tag,
+				(long long)delay);
+			scst_qos_defer(qos, cmd, delay);
+			res = true;
+		}
+		spin_unlock_irqrestore(&qos->qos_lock, flags);
+
+		if (res)
+			goto out;
+	}
+
+	for (i = 0; i < SCST_QOS_LEVELS; i++) {
+		struct scst_qos *qos = scst_qos_get(cmd, i);
+
+		if (!qos->qos_enabled || (cmd->qos_charged & (1 << i)))
+			continue;
+
+		spin_lock_irqsave(&qos->qos_lock, flags);
+		scst_qos_bucket_charge(&qos->qos_iops_bucket, 1, now);
+		scst_qos_bucket_charge(&qos->qos_bw_bucket, bytes, now);
+		spin_unlock_irqrestore(&qos->qos_lock, flags);
+	}
+	cmd->qos_charged = 0;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * Called by scst_abort_cmd() after SCST_CMD_ABORTED was set. If cmd might be
+ * throttled, makes the timers of its bucket owners release it now.
+ */
+void scst_qos_abort_cmd(struct scst_cmd *cmd)
+{
+	unsigned long flags;
+	int i;
+
+	TRACE_ENTRY();
+
+	/* Not translated yet cmds can't be throttled */
+	if (cmd->tgt_dev == NULL)
+		goto out;
+
+	for (i = 0; i < SCST_QOS_LEVELS; i++) {
+		struct scst_qos *qos = scst_qos_get(cmd, i);
+
+		if (!qos->qos_enabled &&
+		    list_empty(&qos->qos_throttled_cmd_list))
+			continue;
+
+		spin_lock_irqsave(&qos->qos_lock, flags);
+		if (!list_empty(&qos->qos_throttled_cmd_list)) {
+			qos->qos_abort_pending = true;
+			hrtimer_start(&qos->qos_timer, ktime_set(0, 0),
+				HRTIMER_MODE_REL);
+		}
+		spin_unlock_irqrestore(&qos->qos_lock, flags);
+	}
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+void scst_qos_init(struct scst_qos *qos)
+{
+	spin_lock_init(&qos->qos_lock);
+	INIT_LIST_HEAD(&qos->qos_throttled_cmd_list);
+	hrtimer_init(&qos->qos_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	qos->qos_timer.function = scst_qos_timer_fn;
+	return;
+}
+
+/* No commands supposed to be alive on the qos owner */
+void scst_qos_cleanup(struct scst_qos *qos)
+{
+	hrtimer_cancel(&qos->qos_timer);
+	WARN_ON_ONCE(!list_empty(&qos->qos_throttled_cmd_list));
+	return;
+}
+
+/**
+ * scst_qos_show() - show the limits of @qos
+ *
+ * Returns number of bytes written to @buf, which is SCST_SYSFS_BLOCK_SIZE
+ * long.
+ */
+ssize_t scst_qos_show(struct scst_qos *qos, char *buf)
+{
+	unsigned int iops, iops_burst, bw_mb, bw_burst_mb;
+	unsigned long flags;
+	bool key;
+
+	spin_lock_irqsave(&qos->qos_lock, flags);
+	iops = qos->qos_iops;
+	iops_burst = qos->qos_iops_burst;
+	bw_mb = qos->qos_bw_mb;
+	bw_burst_mb = qos->qos_bw_burst_mb;
+	spin_unlock_irqrestore(&qos->qos_lock, flags);
+
+	key = (iops | iops_burst | bw_mb | bw_burst_mb) != 0;
+
+	return scnprintf(buf, SCST_SYSFS_BLOCK_SIZE,
+		"iops=%u iops_burst=%u bw_mb=%u bw_burst_mb=%u\n%s",
+		iops, iops_burst, bw_mb, bw_burst_mb,
+		key ? SCST_SYSFS_KEY_MARK "\n" : "");
+}
+
+/**
+ * scst_qos_store() - change the limits of @qos
+ *
+ * @buf contains space or ';' separated "name=value" pairs, where name is
+ * one of iops, iops_burst, bw_mb or bw_burst_mb. Not mentioned limits stay
+ * unchanged. Can be called at any time, commands throttled with the old
+ * limits are rechecked at once.
+ */
+int scst_qos_store(struct scst_qos *qos, const char *buf, size_t count)
+{
+	static const char *const names[] = {
+		"iops", "iops_burst", "bw_mb", "bw_burst_mb", NULL
+	};
+	unsigned int vals[4], iops, iops_burst, bw_mb, bw_burst_mb;
+	unsigned long flags;
+	int res;
+
+	TRACE_ENTRY();
+
+	spin_lock_irqsave(&qos->qos_lock, flags);
+	vals[0] = qos->qos_iops;
+	vals[1] = qos->qos_iops_burst;
+	vals[2] = qos->qos_bw_mb;
+	vals[3] = qos->qos_bw_burst_mb;
+	spin_unlock_irqrestore(&qos->qos_lock, flags);
+
+	res = scst_parse_uint_params(buf, count, names, vals, "QoS");
+	if (res != 0)
+		goto out;
+
+	iops = vals[0];
+	iops_burst = vals[1];
+	bw_mb = vals[2];
+	bw_burst_mb = vals[3];
+
+	spin_lock_irqsave(&qos->qos_lock, flags);
+
+	qos->qos_iops = iops;
+	qos->qos_iops_burst = iops_burst;
+	qos->qos_bw_mb = bw_mb;
+	qos->qos_bw_burst_mb = bw_burst_mb;
+	scst_qos_bucket_set(&qos->qos_iops_bucket, iops, iops_burst);
+	scst_qos_bucket_set(&qos->qos_bw_bucket, (uint64_t)bw_mb << 20,
+		(uint64_t)bw_burst_mb << 20);
+	qos->qos_enabled = (iops != 0) || (bw_mb != 0);
+
+	/* Recheck the throttled cmds with the new limits */
+	if (!list_empty(&qos->qos_throttled_cmd_list))
+		hrtimer_start(&qos->qos_timer, ktime_set(0, 0),
+			HRTIMER_MODE_REL);
+
+	spin_unlock_irqrestore(&qos->qos_lock, flags);
+
+	TRACE_MGMT_DBG("QoS %p limits set: iops %u (burst %u), bw %u MB/s "
+		"(burst %u MB)", qos, iops, iops_burst, bw_mb, bw_burst_mb);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+ssize_t scst_qos_stats_show(struct scst_qos *qos, char *buf)
+{
+	uint64_t cmds, ns;
+	unsigned long flags;
+
+	spin_lock_irqsave(&qos->qos_lock, flags);
+	cmds = qos->qos_throttled_cmds;
+	ns = qos->qos_throttled_ns;
+	spin_unlock_irqrestore(&qos->qos_lock, flags);
+
+	return scnprintf(buf, SCST_SYSFS_BLOCK_SIZE,
+		"throttled_cmds %llu\nthrottled_time_us %llu\n",
+		(unsigned long long)cmds,
+		(unsigned long long)div_u64(ns, NSEC_PER_USEC));
+}
+
+void scst_qos_stats_reset(struct scst_qos *qos)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&qos->qos_lock, flags);
+	qos->qos_throttled_cmds = 0;
+	qos->qos_throttled_ns = 0;
+	spin_unlock_irqrestore(&qos->qos_lock, flags);
+	return;
+}
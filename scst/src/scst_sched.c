@@ -0,0 +1,344 @@
+/*
+ *  scst_sched.c
+ *
+ *  Fair, priority aware per-device commands scheduler.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#ifdef INSIDE_KERNEL_TREE
+#include <scst/scst.h>
+#else
+#include "scst.h"
+#endif
+#include "scst_priv.h"
+
+/*
+ * The scheduler limits the number of commands, dispatched to the device at
+ * once, to dev->sched_depth. Commands over this limit are queued on their
+ * tgt_dev's per lane list. When a dispatched command finishes, the next
+ * command is taken from the highest non-empty lane and, inside the lane,
+ * from the tgt_dev with the smallest virtual start time (start-time fair
+ * queuing), so each tgt_dev gets the device's time in proportion to its
+ * weight regardless of its queue depth.
+ *
+ * Commands come here after scst_exec_check_sn(), i.e. when SN ordering
+ * already allows them to be executed, so any reordering between them is
+ * allowed. Queued commands delay scst_post_exec_sn() for their order data,
+ * hence the following ORDERED commands of the same I_T nexus, exactly as
+ * if the device were slow.
+ */
+
+/* Cost of a command in addition to its data transfer length, bytes */
+#define SCST_SCHED_CMD_COST	(64 * 1024)
+
+static int scst_sched_lane(const struct scst_cmd *cmd)
+{
+	/*
+	 * ORDERED and ACA cmds hold all following cmds of their I_T nexus,
+	 * so don't let them wait behind other nexuses.
+	 */
+	if ((cmd->queue_type == SCST_CMD_QUEUE_ORDERED) ||
+	    (cmd->queue_type == SCST_CMD_QUEUE_ACA))
+		return SCST_SCHED_LANE_HIGH;
+
+	if (cmd->cmd_prio == 0)
+		return SCST_SCHED_LANE_NORMAL;
+	else if (cmd->cmd_prio <= 4)
+		return SCST_SCHED_LANE_HIGH;
+	else if (cmd->cmd_prio <= 10)
+		return SCST_SCHED_LANE_NORMAL;
+	else
+		return SCST_SCHED_LANE_LOW;
+}
+
+/* sched_lock supposed to be held */
+static void scst_sched_enqueue(struct scst_cmd *cmd)
+{
+	struct scst_device *dev = cmd->dev;
+	struct scst_tgt_dev *tgt_dev = cmd->tgt_dev;
+	int lane = scst_sched_lane(cmd);
+	struct scst_sched_queue *q = &tgt_dev->sched_queues[lane];
+	uint64_t cost = SCST_SCHED_CMD_COST + cmd->bufflen + cmd->out_bufflen;
+
+	/* A tgt_dev can't save up virtual time while it's idle */
+	cmd->sched_vstart = max(dev->sched_vtime[lane], q->sched_vfinish);
+	q->sched_vfinish = cmd->sched_vstart +
+		div64_u64(cost * SCST_SCHED_DEF_WEIGHT, tgt_dev->sched_weight);
+
+	if (list_empty(&q->sched_cmd_list))
+		list_add_tail(&q->sched_flow_list_entry,
+			&dev->sched_flow_list[lane]);
+	list_add_tail(&cmd->sched_list_entry, &q->sched_cmd_list);
+
+	cmd->sched_queue_start = ktime_get();
+	dev->sched_queued++;
+
+	TRACE_DBG("Queued cmd %p (tag %llu, lane %d, vstart %llu), "
+		"queued %d", cmd, (unsigned long long)cmd->tag, lane,
+		(unsigned long long)cmd->sched_vstart, dev->sched_queued);
+	return;
+}
+
+/* sched_lock supposed to be held and dev->sched_queued > 0 */
+static struct scst_cmd *scst_sched_dequeue(struct scst_device *dev)
+{
+	struct scst_sched_queue *q, *best = NULL;
+	struct scst_tgt_dev *tgt_dev;
+	struct scst_cmd *cmd = NULL, *c;
+	int lane;
+	uint64_t wait;
+
+	for (lane = 0; lane < SCST_SCHED_LANES; lane++) {
+		list_for_each_entry(q, &dev->sched_flow_list[lane],
+				sched_flow_list_entry) {
+			c = list_first_entry(&q->sched_cmd_list,
+				struct scst_cmd, sched_list_entry);
+			if ((cmd == NULL) ||
+			    (c->sched_vstart < cmd->sched_vstart)) {
+				cmd = c;
+				best = q;
+			}
+		}
+		if (cmd != NULL)
+			break;
+	}
+
+	sBUG_ON(cmd == NULL);
+
+	list_del(&cmd->sched_list_entry);
+	if (list_empty(&best->sched_cmd_list))
+		list_del(&best->sched_flow_list_entry);
+
+	dev->sched_vtime[lane] = cmd->sched_vstart;
+	dev->sched_queued--;
+
+	tgt_dev = best->sched_tgt_dev;
+	wait = ktime_to_ns(ktime_sub(ktime_get(), cmd->sched_queue_start));
+	tgt_dev->sched_queued_cmds++;
+	tgt_dev->sched_wait_ns += wait;
+	if (wait > tgt_dev->sched_max_wait_ns)
+		tgt_dev->sched_max_wait_ns = wait;
+
+	return cmd;
+}
+
+/*
+ * sched_lock supposed to be held. Moves cmds, which can be dispatched now,
+ * to cmd_list.
+ */
+static void scst_sched_dispatch(struct scst_device *dev,
+	struct list_head *cmd_list)
+{
+	while ((dev->sched_queued > 0) &&
+	       ((dev->sched_depth == 0) ||
+		(dev->sched_dispatched < dev->sched_depth))) {
+		struct scst_cmd *cmd = scst_sched_dequeue(dev);
+
+		cmd->sched_counted = 1;
+		cmd->exec_admitted = 1;
+		dev->sched_dispatched++;
+		list_add_tail(&cmd->sched_list_entry, cmd_list);
+	}
+	return;
+}
+
+/* No locks */
+static void scst_sched_activate(struct list_head *cmd_list)
+{
+	struct scst_cmd *cmd, *tcmd;
+	unsigned long flags;
+
+	/* cmd_list is private, so no locking needed for it */
+	list_for_each_entry_safe(cmd, tcmd, cmd_list, sched_list_entry) {
+		struct scst_cmd_threads *cmd_threads = cmd->cmd_threads;
+
+		list_del(&cmd->sched_list_entry);
+
+		TRACE_DBG("Adding scheduled cmd %p to active cmd list", cmd);
+		spin_lock_irqsave(&cmd_threads->cmd_list_lock, flags);
+		list_add_tail(&cmd->cmd_list_entry,
+			&cmd_threads->active_cmd_list);
+		wake_up(&cmd_threads->cmd_list_waitQ);
+		spin_unlock_irqrestore(&cmd_threads->cmd_list_lock, flags);
+		/* !! cmd can be already dead here !! */
+	}
+	return;
+}
+
+/*
+ * Returns true if cmd queued, hence stop processing it and go to the next
+ * command.
+ */
+bool __scst_sched_queue(struct scst_cmd *cmd)
+{
+	struct scst_device *dev = cmd->dev;
+	unsigned long flags;
+	bool res = false;
+
+	TRACE_ENTRY();
+
+	/* Let aborted and internal cmds and HQ cmds go as fast as possible */
+	if (unlikely(test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags)) ||
+	    cmd->internal ||
+	    (cmd->queue_type == SCST_CMD_QUEUE_HEAD_OF_QUEUE))
+		goto out;
+
+	spin_lock_irqsave(&dev->sched_lock, flags);
+
+	if (unlikely(dev->sched_depth == 0))
+		goto out_unlock;
+
+	if ((dev->sched_queued == 0) &&
+	    (dev->sched_dispatched < dev->sched_depth)) {
+		cmd->sched_counted = 1;
+		dev->sched_dispatched++;
+		goto out_unlock;
+	}
+
+	scst_sched_enqueue(cmd);
+	res = true;
+
+out_unlock:
+	spin_unlock_irqrestore(&dev->sched_lock, flags);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* No locks. Called when a dispatched cmd finished on the device. */
+void __scst_sched_done(struct scst_cmd *cmd)
+{
+	struct scst_device *dev = cmd->dev;
+	unsigned long flags;
+	LIST_HEAD(cmd_list);
+
+	TRACE_ENTRY();
+
+	spin_lock_irqsave(&dev->sched_lock, flags);
+	cmd->sched_counted = 0;
+	dev->sched_dispatched--;
+	EXTRACHECKS_BUG_ON(dev->sched_dispatched < 0);
+	scst_sched_dispatch(dev, &cmd_list);
+	spin_unlock_irqrestore(&dev->sched_lock, flags);
+
+	scst_sched_activate(&cmd_list);
+
+	TRACE_EXIT();
+	return;
+}
+
+void scst_sched_dev_init(struct scst_device *dev)
+{
+	int i;
+
+	spin_lock_init(&dev->sched_lock);
+	for (i = 0; i < SCST_SCHED_LANES; i++)
+		INIT_LIST_HEAD(&dev->sched_flow_list[i]);
+	return;
+}
+
+void scst_sched_tgt_dev_init(struct scst_tgt_dev *tgt_dev)
+{
+	int i;
+
+	tgt_dev->sched_weight = SCST_SCHED_DEF_WEIGHT;
+	for (i = 0; i < SCST_SCHED_LANES; i++) {
+		INIT_LIST_HEAD(&tgt_dev->sched_queues[i].sched_cmd_list);
+		tgt_dev->sched_queues[i].sched_tgt_dev = tgt_dev;
+	}
+	return;
+}
+
+/* No commands supposed to be alive on the tgt_dev */
+void scst_sched_tgt_dev_cleanup(struct scst_tgt_dev *tgt_dev)
+{
+	int i;
+
+	for (i = 0; i < SCST_SCHED_LANES; i++) {
+		struct scst_sched_queue *q = &tgt_dev->sched_queues[i];
+
+		WARN_ON_ONCE(!list_empty(&q->sched_cmd_list));
+	}
+	return;
+}
+
+/*
+ * Sets the max number of dispatched cmds of dev. Can be called at any time,
+ * 0 disables the scheduler and dispatches all queued cmds.
+ */
+void scst_sched_set_depth(struct scst_device *dev, int depth)
+{
+	unsigned long flags;
+	LIST_HEAD(cmd_list);
+
+	TRACE_ENTRY();
+
+	spin_lock_irqsave(&dev->sched_lock, flags);
+	dev->sched_depth = depth;
+	scst_sched_dispatch(dev, &cmd_list);
+	spin_unlock_irqrestore(&dev->sched_lock, flags);
+
+	scst_sched_activate(&cmd_list);
+
+	TRACE_MGMT_DBG("Dev %s: scheduler depth set to %d", dev->virt_name,
+		depth);
+
+	TRACE_EXIT();
+	return;
+}
+
+/* Takes effect for the cmds queued after this call */
+void scst_sched_set_weight(struct scst_tgt_dev *tgt_dev, unsigned int weight)
+{
+	struct scst_device *dev = tgt_dev->dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->sched_lock, flags);
+	tgt_dev->sched_weight = weight;
+	spin_unlock_irqrestore(&dev->sched_lock, flags);
+	return;
+}
+
+ssize_t scst_sched_stats_show(struct scst_tgt_dev *tgt_dev, char *buf)
+{
+	struct scst_device *dev = tgt_dev->dev;
+	uint64_t cmds, ns, max_ns;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->sched_lock, flags);
+	cmds = tgt_dev->sched_queued_cmds;
+	ns = tgt_dev->sched_wait_ns;
+	max_ns = tgt_dev->sched_max_wait_ns;
+	spin_unlock_irqrestore(&dev->sched_lock, flags);
+
+	return scnprintf(buf, SCST_SYSFS_BLOCK_SIZE,
+		"queued_cmds %llu\nwait_time_us %llu\nmax_wait_time_us %llu\n",
+		(unsigned long long)cmds,
+		(unsigned long long)div_u64(ns, NSEC_PER_USEC),
+		(unsigned long long)div_u64(max_ns, NSEC_PER_USEC));
+}
+
+void scst_sched_stats_reset(struct scst_tgt_dev *tgt_dev)
+{
+	struct scst_device *dev = tgt_dev->dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->sched_lock, flags);
+	tgt_dev->sched_queued_cmds = 0;
+	tgt_dev->sched_wait_ns = 0;
+	tgt_dev->sched_max_wait_ns = 0;
+	spin_unlock_irqrestore(&dev->sched_lock, flags);
+	return;
+}
@@ -3480,6 +3480,279 @@ static struct kobj_attribute dev_threads_pool_type_attr =
 		scst_dev_sysfs_threads_pool_type_show,
 		scst_dev_sysfs_threads_pool_type_store);
 
+/*
+ * Defines the "qos" and "qos_stats" attributes for the struct scst_qos
+ * member qos_member of type, which contains kobject kobj_member.
+ */
+#define SCST_QOS_SYSFS_ATTRS(prefix, type, kobj_member, qos_member)	\
+static ssize_t scst_##prefix##_qos_show(struct kobject *kobj,		\
+	struct kobj_attribute *attr, char *buf)				\
+{									\
+	type *p = container_of(kobj, type, kobj_member);		\
+									\
+	return scst_qos_show(&p->qos_member, buf);			\
+}									\
+									\
+static ssize_t scst_##prefix##_qos_store(struct kobject *kobj,		\
+	struct kobj_attribute *attr, const char *buf, size_t count)	\
+{									\
+	type *p = container_of(kobj, type, kobj_member);		\
+	int res;							\
+									\
+	res = scst_qos_store(&p->qos_member, buf, count);		\
+	return (res == 0) ? count : res;				\
+}									\
+									\
+static ssize_t scst_##prefix##_qos_stats_show(struct kobject *kobj,	\
+	struct kobj_attribute *attr, char *buf)				\
+{									\
+	type *p = container_of(kobj, type, kobj_member);		\
+									\
+	return scst_qos_stats_show(&p->qos_member, buf);		\
+}									\
+									\
+static ssize_t scst_##prefix##_qos_stats_store(struct kobject *kobj,	\
+	struct kobj_attribute *attr, const char *buf, size_t count)	\
+{									\
+	type *p = container_of(kobj, type, kobj_member);		\
+									\
+	scst_qos_stats_reset(&p->qos_member);				\
+	return count;							\
+}									\
+									\
+static struct kobj_attribute prefix##_qos_attr =			\
+	__ATTR(qos, S_IRUGO | S_IWUSR, scst_##prefix##_qos_show,	\
+		scst_##prefix##_qos_store);				\
+									\
+static struct kobj_attribute prefix##_qos_stats_attr =			\
+	__ATTR(qos_stats, S_IRUGO | S_IWUSR,				\
+		scst_##prefix##_qos_stats_show,				\
+		scst_##prefix##_qos_stats_store)
+
+SCST_QOS_SYSFS_ATTRS(dev, struct scst_device, dev_kobj, dev_qos);
+SCST_QOS_SYSFS_ATTRS(tgt_dev, struct scst_tgt_dev, tgt_dev_kobj, tgt_dev_qos);
+SCST_QOS_SYSFS_ATTRS(session, struct scst_session, sess_kobj, sess_qos);
+
+static ssize_t scst_dev_sched_depth_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev;
+	int depth;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	depth = ACCESS_ONCE(dev->sched_depth);
+
+	return scnprintf(buf, SCST_SYSFS_BLOCK_SIZE, "%d\n%s", depth,
+		(depth != 0) ? SCST_SYSFS_KEY_MARK "\n" : "");
+}
+
+static ssize_t scst_dev_sched_depth_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	struct scst_device *dev;
+	unsigned long val;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	res = kstrtoul(buf, 0, &val);
+	if ((res != 0) || (val > SCST_SCHED_MAX_DEPTH)) {
+		PRINT_ERROR("Invalid scheduler depth %s (device %s, max %d)",
+			buf, dev->virt_name, SCST_SCHED_MAX_DEPTH);
+		res = -EINVAL;
+		goto out;
+	}
+
+	scst_sched_set_depth(dev, val);
+
+	res = count;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute dev_sched_depth_attr =
+	__ATTR(sched_depth, S_IRUGO | S_IWUSR, scst_dev_sched_depth_show,
+		scst_dev_sched_depth_store);
+
+static ssize_t scst_dev_aqd_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	return scst_aqd_show(dev, buf);
+}
+
+static ssize_t scst_dev_aqd_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct scst_device *dev;
+	int res;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	res = scst_aqd_store(dev, buf, count);
+	return (res == 0) ? count : res;
+}
+
+static struct kobj_attribute dev_aqd_attr =
+	__ATTR(adaptive_queue_depth, S_IRUGO | S_IWUSR, scst_dev_aqd_show,
+		scst_dev_aqd_store);
+
+static ssize_t scst_dev_aqd_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	return scst_aqd_stats_show(dev, buf);
+}
+
+static ssize_t scst_dev_aqd_stats_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct scst_device *dev;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	scst_aqd_stats_reset(dev);
+	return count;
+}
+
+static struct kobj_attribute dev_aqd_stats_attr =
+	__ATTR(adaptive_queue_depth_stats, S_IRUGO | S_IWUSR,
+		scst_dev_aqd_stats_show, scst_dev_aqd_stats_store);
+
+static ssize_t scst_dev_iopat_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	return scst_iopat_show(dev, buf);
+}
+
+static ssize_t scst_dev_iopat_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct scst_device *dev;
+	int res;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	res = scst_iopat_store(dev, buf, count);
+	return (res == 0) ? count : res;
+}
+
+static struct kobj_attribute dev_iopat_attr =
+	__ATTR(io_pattern, S_IRUGO | S_IWUSR, scst_dev_iopat_show,
+		scst_dev_iopat_store);
+
+static ssize_t
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 35) && \
+	(!defined(RHEL_RELEASE_CODE) || \
+	 RHEL_RELEASE_CODE -0 < RHEL_RELEASE_VERSION(6, 1))
+scst_dev_iopat_data_read(
+#else
+scst_dev_iopat_data_read(struct file *file,
+#endif
+	struct kobject *kobj, struct bin_attribute *bin_attr, char *buf,
+	loff_t off, size_t count)
+{
+	struct scst_device *dev;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	return scst_iopat_data_read(dev, buf, off, count);
+}
+
+static struct bin_attribute dev_iopat_data_attr = {
+	.attr = {
+		.name = "io_pattern_data",
+		.mode = S_IRUGO,
+	},
+	.size = 0,
+	.read = scst_dev_iopat_data_read,
+};
+
+static ssize_t scst_tgt_dev_sched_weight_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_tgt_dev *tgt_dev;
+	unsigned int weight;
+
+	tgt_dev = container_of(kobj, struct scst_tgt_dev, tgt_dev_kobj);
+	weight = ACCESS_ONCE(tgt_dev->sched_weight);
+
+	return scnprintf(buf, SCST_SYSFS_BLOCK_SIZE, "%u\n%s", weight,
+		(weight != SCST_SCHED_DEF_WEIGHT) ?
+			SCST_SYSFS_KEY_MARK "\n" : "");
+}
+
+static ssize_t scst_tgt_dev_sched_weight_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	struct scst_tgt_dev *tgt_dev;
+	unsigned long val;
+
+	TRACE_ENTRY();
+
+	tgt_dev = container_of(kobj, struct scst_tgt_dev, tgt_dev_kobj);
+
+	res = kstrtoul(buf, 0, &val);
+	if ((res != 0) || (val == 0) || (val > SCST_SCHED_MAX_WEIGHT)) {
+		PRINT_ERROR("Invalid scheduler weight %s (valid range 1-%d)",
+			buf, SCST_SCHED_MAX_WEIGHT);
+		res = -EINVAL;
+		goto out;
+	}
+
+	scst_sched_set_weight(tgt_dev, val);
+
+	res = count;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute tgt_dev_sched_weight_attr =
+	__ATTR(sched_weight, S_IRUGO | S_IWUSR, scst_tgt_dev_sched_weight_show,
+		scst_tgt_dev_sched_weight_store);
+
+static ssize_t scst_tgt_dev_sched_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_tgt_dev *tgt_dev;
+
+	tgt_dev = container_of(kobj, struct scst_tgt_dev, tgt_dev_kobj);
+
+	return scst_sched_stats_show(tgt_dev, buf);
+}
+
+static ssize_t scst_tgt_dev_sched_stats_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct scst_tgt_dev *tgt_dev;
+
+	tgt_dev = container_of(kobj, struct scst_tgt_dev, tgt_dev_kobj);
+
+	scst_sched_stats_reset(tgt_dev);
+	return count;
+}
+
+static struct kobj_attribute tgt_dev_sched_stats_attr =
+	__ATTR(sched_stats, S_IRUGO | S_IWUSR, scst_tgt_dev_sched_stats_show,
+		scst_tgt_dev_sched_stats_store);
+
 static ssize_t scst_dev_block_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf)
 {
@@ -3611,6 +3884,12 @@ static struct kobj_attribute dev_block_attr =
 static struct attribute *scst_dev_attrs[] = {
 	&dev_type_attr.attr,
 	&dev_block_attr.attr,
+	&dev_qos_attr.attr,
+	&dev_qos_stats_attr.attr,
+	&dev_sched_depth_attr.attr,
+	&dev_aqd_attr.attr,
+	&dev_aqd_stats_attr.attr,
+	&dev_iopat_attr.attr,
 	NULL,
 };
 
@@ -3800,6 +4079,13 @@ int scst_dev_sysfs_create(struct scst_device *dev)
 	}
 #endif
 
+	res = sysfs_create_bin_file(&dev->dev_kobj, &dev_iopat_data_attr);
+	if (res != 0) {
+		PRINT_ERROR("Can't create attr %s for dev %s",
+			dev_iopat_data_attr.attr.name, dev->virt_name);
+		goto out_del;
+	}
+
 out:
 	TRACE_EXIT_RES(res);
 	return res;
@@ -4200,6 +4486,10 @@ static struct kobj_attribute tgt_dev_dif_checks_failed_attr =
 static struct attribute *scst_tgt_dev_attrs[] = {
 	&tgt_dev_thread_pid_attr.attr,
 	&tgt_dev_active_commands_attr.attr,
+	&tgt_dev_qos_attr.attr,
+	&tgt_dev_qos_stats_attr.attr,
+	&tgt_dev_sched_weight_attr.attr,
+	&tgt_dev_sched_stats_attr.attr,
 #ifdef CONFIG_SCST_MEASURE_LATENCY
 	&tgt_dev_latency_attr.attr,
 #endif
@@ -4868,6 +5158,8 @@ static struct attribute *scst_session_attrs[] = {
 	&session_bidi_io_count_kb_attr.attr,
 	&session_bidi_unaligned_cmd_count_attr.attr,
 	&session_none_cmd_count_attr.attr,
+	&session_qos_attr.attr,
+	&session_qos_stats_attr.attr,
 #ifdef CONFIG_SCST_MEASURE_LATENCY
 	&session_latency_attr.attr,
 #endif /* CONFIG_SCST_MEASURE_LATENCY */
@@ -40,6 +40,10 @@
 #include "scst_priv.h"
 #include "scst_pres.h"
 
+#ifdef SCST_EXEC_LBA_TREE
+#include <linux/interval_tree_generic.h>
+#endif
+
 static void scst_cmd_set_sn(struct scst_cmd *cmd);
 static int __scst_init_cmd(struct scst_cmd *cmd);
 static struct scst_cmd *__scst_find_cmd_by_tag(struct scst_session *sess,
@@ -267,6 +271,119 @@ static bool scst_cmd_overlap(struct scst_cmd *chk_cmd, struct scst_cmd *cmd)
 	return res;
 }
 
+#ifdef SCST_EXEC_LBA_TREE
+
+#define SCST_EXEC_LBA_START(cmd)	((uint64_t)(cmd)->lba)
+#define SCST_EXEC_LBA_LAST(cmd)		((cmd)->dev_exec_lba_last)
+
+INTERVAL_TREE_DEFINE(struct scst_cmd, dev_exec_lba_node, uint64_t,
+	dev_exec_lba_subtree_last, SCST_EXEC_LBA_START, SCST_EXEC_LBA_LAST,
+	static, scst_exec_lba_tree)
+
+/*
+ * Returns number of blocks in the LBA range of cmd, if cmd can be tracked
+ * in dev_exec_lba_tree, or 0 otherwise.
+ */
+static inline int64_t scst_cmd_exec_lba_blocks(const struct scst_cmd *cmd)
+{
+	if (((cmd->op_flags & SCST_LBA_NOT_VALID) != 0) ||
+	    (cmd->dev->block_shift <= 0))
+		return 0;
+
+	return cmd->data_len >> cmd->dev->block_shift;
+}
+
+#endif /* SCST_EXEC_LBA_TREE */
+
+/* dev_lock supposed to be held and BH disabled */
+static void scst_add_dev_exec_cmd(struct scst_cmd *cmd)
+{
+	struct scst_device *dev = cmd->dev;
+#ifdef SCST_EXEC_LBA_TREE
+	int64_t blocks = scst_cmd_exec_lba_blocks(cmd);
+
+	if (blocks > 0) {
+		cmd->dev_exec_lba_last = cmd->lba + blocks - 1;
+		scst_exec_lba_tree_insert(cmd, &dev->dev_exec_lba_tree);
+		cmd->on_dev_exec_lba_tree = 1;
+		return;
+	}
+#endif
+
+	list_add_tail(&cmd->dev_exec_cmd_list_entry, &dev->dev_exec_cmd_list);
+	cmd->on_dev_exec_list = 1;
+}
+
+/* dev_lock supposed to be held and BH disabled */
+static void scst_del_dev_exec_cmd(struct scst_cmd *cmd)
+{
+	if (cmd->on_dev_exec_list) {
+		list_del(&cmd->dev_exec_cmd_list_entry);
+		cmd->on_dev_exec_list = 0;
+	}
+#ifdef SCST_EXEC_LBA_TREE
+	if (cmd->on_dev_exec_lba_tree) {
+		scst_exec_lba_tree_remove(cmd, &cmd->dev->dev_exec_lba_tree);
+		cmd->on_dev_exec_lba_tree = 0;
+	}
+#endif
+}
+
+/*
+ * dev_lock supposed to be held and BH disabled. If chk_cmd overlaps with
+ * cmd, makes chk_cmd wait for cmd. Returns 1 if chk_cmd blocked, 0 if not,
+ * or negative error code otherwise.
+ */
+static int scst_block_on_overlap(struct scst_cmd *chk_cmd,
+	struct scst_cmd *cmd)
+{
+	struct scst_cmd **p = cmd->scsi_atomic_blocked_cmds;
+
+	if ((chk_cmd == cmd) || !scst_cmd_overlap(chk_cmd, cmd))
+		return 0;
+
+	/*
+	 * kmalloc() allocates by at least 32 bytes increments,
+	 * hence krealloc() on 8 bytes increments, if not all
+	 * that space is used, does nothing.
+	 */
+	p = krealloc(p, sizeof(*p) * (cmd->scsi_atomic_blocked_cmds_count + 1),
+		GFP_ATOMIC);
+	if (p == NULL)
+		return -ENOMEM;
+	p[cmd->scsi_atomic_blocked_cmds_count] = chk_cmd;
+	cmd->scsi_atomic_blocked_cmds = p;
+	cmd->scsi_atomic_blocked_cmds_count++;
+
+	chk_cmd->scsi_atomic_blockers++;
+
+	TRACE_BLOCK("Delaying cmd %p (op %s, lba %lld, "
+		"len %lld, blockers %d) due to overlap with "
+		"cmd %p (op %s, lba %lld, len %lld, blocked "
+		"cmds %d)", chk_cmd, scst_get_opcode_name(chk_cmd),
+		(long long)chk_cmd->lba,
+		(long long)chk_cmd->data_len,
+		chk_cmd->scsi_atomic_blockers, cmd,
+		scst_get_opcode_name(cmd), (long long)cmd->lba,
+		(long long)cmd->data_len,
+		cmd->scsi_atomic_blocked_cmds_count);
+
+	return 1;
+}
+
+/* dev_lock supposed to be held and BH disabled */
+static void scst_undo_block_on_overlap(struct scst_cmd *chk_cmd,
+	struct scst_cmd *cmd)
+{
+	struct scst_cmd **p = cmd->scsi_atomic_blocked_cmds;
+
+	if ((p != NULL) && (cmd->scsi_atomic_blocked_cmds_count > 0) &&
+	    (p[cmd->scsi_atomic_blocked_cmds_count-1] == chk_cmd)) {
+		cmd->scsi_atomic_blocked_cmds_count--;
+		chk_cmd->scsi_atomic_blockers--;
+	}
+}
+
 /*
  * dev_lock supposed to be held and BH disabled. Returns true if cmd blocked,
  * hence stop processing it and go to the next command.
@@ -276,6 +393,10 @@ static bool scst_check_scsi_atomicity(struct scst_cmd *chk_cmd)
 	bool res = false;
 	struct scst_device *dev = chk_cmd->dev;
 	struct scst_cmd *cmd;
+	int rc;
+#ifdef SCST_EXEC_LBA_TREE
+	struct rb_node *rbn;
+#endif
 
 	TRACE_ENTRY();
 
@@ -288,39 +409,53 @@ static bool scst_check_scsi_atomicity(struct scst_cmd *chk_cmd)
 		chk_cmd, scst_get_opcode_name(chk_cmd), chk_cmd->internal,
 		(long long)chk_cmd->lba, (long long)chk_cmd->data_len);
 
-	list_for_each_entry(cmd, &dev->dev_exec_cmd_list, dev_exec_cmd_list_entry) {
-		if (chk_cmd == cmd)
-			continue;
-		if (scst_cmd_overlap(chk_cmd, cmd)) {
-			struct scst_cmd **p = cmd->scsi_atomic_blocked_cmds;
+#ifdef SCST_EXEC_LBA_TREE
+	if (chk_cmd->on_dev_exec_lba_tree) {
+		uint64_t start = chk_cmd->lba, last = chk_cmd->dev_exec_lba_last;
 
-			/*
-			 * kmalloc() allocates by at least 32 bytes increments,
-			 * hence krealloc() on 8 bytes increments, if not all
-			 * that space is used, does nothing.
-			 */
-			p = krealloc(p, sizeof(*p) * (cmd->scsi_atomic_blocked_cmds_count + 1),
-				GFP_ATOMIC);
-			if (p == NULL)
+		/*
+		 * Commands with LBA ranges can overlap only with commands with
+		 * intersecting LBA ranges, so look only for them.
+		 */
+		for (cmd = scst_exec_lba_tree_iter_first(&dev->dev_exec_lba_tree,
+						start, last);
+		     cmd != NULL;
+		     cmd = scst_exec_lba_tree_iter_next(cmd, start, last)) {
+			rc = scst_block_on_overlap(chk_cmd, cmd);
+			if (unlikely(rc < 0))
 				goto out_busy_undo;
-			p[cmd->scsi_atomic_blocked_cmds_count] = chk_cmd;
-			cmd->scsi_atomic_blocked_cmds = p;
-			cmd->scsi_atomic_blocked_cmds_count++;
-
-			chk_cmd->scsi_atomic_blockers++;
-
-			TRACE_BLOCK("Delaying cmd %p (op %s, lba %lld, "
-				"len %lld, blockers %d) due to overlap with "
-				"cmd %p (op %s, lba %lld, len %lld, blocked "
-				"cmds %d)", chk_cmd, scst_get_opcode_name(chk_cmd),
-				(long long)chk_cmd->lba,
-				(long long)chk_cmd->data_len,
-				chk_cmd->scsi_atomic_blockers, cmd,
-				scst_get_opcode_name(cmd), (long long)cmd->lba,
-				(long long)cmd->data_len,
-				cmd->scsi_atomic_blocked_cmds_count);
-			res = true;
+			if (rc > 0)
+				res = true;
 		}
+
+		/*
+		 * Not SCSI atomic commands can overlap only with SCSI atomic
+		 * ones. SCSI atomic commands without LBA range (RESERVEs)
+		 * overlap only with COMPARE AND WRITE, which is SCSI atomic
+		 * as well. Zero length COMPARE AND WRITE doesn't access any
+		 * blocks.
+		 */
+		if ((chk_cmd->op_flags & SCST_SCSI_ATOMIC) == 0)
+			goto out;
+	} else {
+		for (rbn = rb_first(&dev->dev_exec_lba_tree); rbn != NULL;
+		     rbn = rb_next(rbn)) {
+			cmd = rb_entry(rbn, struct scst_cmd, dev_exec_lba_node);
+			rc = scst_block_on_overlap(chk_cmd, cmd);
+			if (unlikely(rc < 0))
+				goto out_busy_undo;
+			if (rc > 0)
+				res = true;
+		}
+	}
+#endif
+
+	list_for_each_entry(cmd, &dev->dev_exec_cmd_list, dev_exec_cmd_list_entry) {
+		rc = scst_block_on_overlap(chk_cmd, cmd);
+		if (unlikely(rc < 0))
+			goto out_busy_undo;
+		if (rc > 0)
+			res = true;
 	}
 
 out:
@@ -328,14 +463,15 @@ out:
 	return res;
 
 out_busy_undo:
-	list_for_each_entry(cmd, &dev->dev_exec_cmd_list, dev_exec_cmd_list_entry) {
-		struct scst_cmd **p = cmd->scsi_atomic_blocked_cmds;
-
-		if ((p != NULL) && (p[cmd->scsi_atomic_blocked_cmds_count-1] == chk_cmd)) {
-			cmd->scsi_atomic_blocked_cmds_count--;
-			chk_cmd->scsi_atomic_blockers--;
-		}
+#ifdef SCST_EXEC_LBA_TREE
+	for (rbn = rb_first(&dev->dev_exec_lba_tree); rbn != NULL;
+	     rbn = rb_next(rbn)) {
+		cmd = rb_entry(rbn, struct scst_cmd, dev_exec_lba_node);
+		scst_undo_block_on_overlap(chk_cmd, cmd);
 	}
+#endif
+	list_for_each_entry(cmd, &dev->dev_exec_cmd_list, dev_exec_cmd_list_entry)
+		scst_undo_block_on_overlap(chk_cmd, cmd);
 	sBUG_ON(chk_cmd->scsi_atomic_blockers != 0);
 
 	scst_set_busy(chk_cmd);
@@ -372,10 +508,8 @@ bool scst_do_check_blocked_dev(struct scst_cmd *cmd)
 	 * as dev's SCSI atomic cmds counter incremented.
 	 */
 
-	if (likely(!cmd->on_dev_exec_list)) {
-		list_add_tail(&cmd->dev_exec_cmd_list_entry, &dev->dev_exec_cmd_list);
-		cmd->on_dev_exec_list = 1;
-	}
+	if (likely(!cmd->on_dev_exec_list && !cmd->on_dev_exec_lba_tree))
+		scst_add_dev_exec_cmd(cmd);
 
 	/*
 	 * After a cmd passed SCSI atomicy check, there's no need to recheck SCSI
@@ -513,10 +647,7 @@ void __scst_check_unblock_dev(struct scst_cmd *cmd)
 	 * restart of this cmd.
 	 */
 
-	if (likely(cmd->on_dev_exec_list)) {
-		list_del(&cmd->dev_exec_cmd_list_entry);
-		cmd->on_dev_exec_list = 0;
-	}
+	scst_del_dev_exec_cmd(cmd);
 
 	if (unlikely((cmd->op_flags & SCST_SCSI_ATOMIC) != 0)) {
 		if (likely(cmd->scsi_atomicity_checked)) {
@@ -683,7 +814,7 @@ struct scst_cmd *scst_rx_cmd(struct scst_session *sess,
 	}
 #endif
 
-	cmd = scst_alloc_cmd(cdb, cdb_len, gfp_mask);
+	cmd = scst_alloc_sess_cmd(sess, cdb, cdb_len, gfp_mask);
 	if (cmd == NULL) {
 		TRACE(TRACE_OUT_OF_MEM, "%s", "Allocation of scst_cmd failed");
 		goto out;
@@ -851,9 +982,12 @@ void scst_cmd_init_done(struct scst_cmd *cmd,
 		 * TM processing. This check is needed because there might be
 		 * old, i.e. deferred, commands and new, i.e. just coming, ones.
 		 */
-		if (cmd->sess_cmd_list_entry.next == NULL)
+		if (cmd->sess_cmd_list_entry.next == NULL) {
 			list_add_tail(&cmd->sess_cmd_list_entry,
 				&sess->sess_cmd_list);
+			list_add_tail(&cmd->tgt_dev_cmd_list_entry,
+				&sess->sess_no_tgt_dev_cmd_list);
+		}
 		switch (sess->init_phase) {
 		case SCST_SESS_IPH_SUCCESS:
 			break;
@@ -871,9 +1005,12 @@ void scst_cmd_init_done(struct scst_cmd *cmd,
 		default:
 			sBUG();
 		}
-	} else
+	} else {
 		list_add_tail(&cmd->sess_cmd_list_entry,
 			      &sess->sess_cmd_list);
+		list_add_tail(&cmd->tgt_dev_cmd_list_entry,
+			      &sess->sess_no_tgt_dev_cmd_list);
+	}
 
 	spin_unlock_irqrestore(&sess->sess_list_lock, flags);
 
@@ -1768,6 +1905,30 @@ void scst_restart_cmd(struct scst_cmd *cmd, int status,
 }
 EXPORT_SYMBOL(scst_restart_cmd);
 
+/*
+ * Marks cmd as being in rdy_to_xfer() or xmit_response(). No locks are
+ * taken here, scst_hw_pending_work_fn() finds such cmds in sess_cmd_list.
+ */
+static void scst_set_hw_pending(struct scst_cmd *cmd)
+{
+	struct scst_session *sess = cmd->sess;
+	struct scst_tgt_template *tgtt = cmd->tgtt;
+
+	cmd->hw_pending_start = jiffies;
+	cmd->cmd_hw_pending = 1;
+
+	if (!test_bit(SCST_SESS_HW_PENDING_WORK_SCHEDULED, &sess->sess_aflags)) {
+		TRACE_DBG("Sched HW pending work for sess %p "
+			"(max time %d)", sess,
+			tgtt->max_hw_pending_time);
+		set_bit(SCST_SESS_HW_PENDING_WORK_SCHEDULED,
+			&sess->sess_aflags);
+		schedule_delayed_work(&sess->hw_pending_work,
+			tgtt->max_hw_pending_time * HZ);
+	}
+	return;
+}
+
 static int scst_rdy_to_xfer(struct scst_cmd *cmd)
 {
 	int res, rc;
@@ -1808,21 +1969,8 @@ static int scst_rdy_to_xfer(struct scst_cmd *cmd)
 	res = SCST_CMD_STATE_RES_CONT_NEXT;
 	cmd->state = SCST_CMD_STATE_DATA_WAIT;
 
-	if (tgtt->on_hw_pending_cmd_timeout != NULL) {
-		struct scst_session *sess = cmd->sess;
-
-		cmd->hw_pending_start = jiffies;
-		cmd->cmd_hw_pending = 1;
-		if (!test_bit(SCST_SESS_HW_PENDING_WORK_SCHEDULED, &sess->sess_aflags)) {
-			TRACE_DBG("Sched HW pending work for sess %p "
-				"(max time %d)", sess,
-				tgtt->max_hw_pending_time);
-			set_bit(SCST_SESS_HW_PENDING_WORK_SCHEDULED,
-				&sess->sess_aflags);
-			schedule_delayed_work(&sess->hw_pending_work,
-				tgtt->max_hw_pending_time * HZ);
-		}
-	}
+	if (tgtt->on_hw_pending_cmd_timeout != NULL)
+		scst_set_hw_pending(cmd);
 
 	scst_set_cur_start(cmd);
 
@@ -3430,6 +3578,9 @@ static int scst_do_real_exec(struct scst_cmd *cmd)
 
 	cmd->state = SCST_CMD_STATE_EXEC_WAIT;
 
+	scst_aqd_exec_start(cmd);
+	scst_iopat_account(cmd);
+
 	if (devt->exec) {
 		TRACE_DBG("Calling dev handler %s exec(%p)",
 		      devt->name, cmd);
@@ -3692,6 +3843,9 @@ static int scst_exec_check_blocking(struct scst_cmd **active_cmd)
 	if (unlikely(scst_check_alua(cmd, &res)))
 		goto out;
 
+	if (unlikely(scst_exec_admit_defer(cmd)))
+		goto out;
+
 	if (unlikely(scst_check_blocked_dev(cmd)))
 		goto out;
 
@@ -3759,6 +3913,9 @@ done:
 		if (unlikely(scst_check_alua(cmd, &res)))
 			goto out;
 
+		if (unlikely(scst_exec_admit_defer(cmd)))
+			break;
+
 		if (unlikely(scst_check_blocked_dev(cmd)))
 			break;
 
@@ -4330,6 +4487,8 @@ static int scst_dev_done(struct scst_cmd *cmd)
 	}
 
 	scst_check_unblock_dev(cmd);
+	scst_sched_done(cmd);
+	scst_aqd_done(cmd);
 
 	if (cmd->inc_expected_sn_on_done && cmd->sent_for_exec && cmd->sn_set) {
 		bool rc = scst_inc_expected_sn(cmd);
@@ -4443,6 +4602,7 @@ static int scst_pre_xmit_response1(struct scst_cmd *cmd)
 #ifdef CONFIG_SCST_PER_DEVICE_CMD_COUNT_LIMIT
 		atomic_dec(&cmd->dev->dev_cmd_count);
 #endif
+		scst_aqd_put(cmd);
 		if (unlikely(cmd->queue_type == SCST_CMD_QUEUE_HEAD_OF_QUEUE))
 			scst_on_hq_cmd_response(cmd);
 		else if (unlikely(!cmd->sent_for_exec)) {
@@ -4520,21 +4680,8 @@ static int scst_xmit_response(struct scst_cmd *cmd)
 	}
 #endif
 
-	if (tgtt->on_hw_pending_cmd_timeout != NULL) {
-		struct scst_session *sess = cmd->sess;
-
-		cmd->hw_pending_start = jiffies;
-		cmd->cmd_hw_pending = 1;
-		if (!test_bit(SCST_SESS_HW_PENDING_WORK_SCHEDULED, &sess->sess_aflags)) {
-			TRACE_DBG("Sched HW pending work for sess %p "
-				"(max time %d)", sess,
-				tgtt->max_hw_pending_time);
-			set_bit(SCST_SESS_HW_PENDING_WORK_SCHEDULED,
-				&sess->sess_aflags);
-			schedule_delayed_work(&sess->hw_pending_work,
-				tgtt->max_hw_pending_time * HZ);
-		}
-	}
+	if (tgtt->on_hw_pending_cmd_timeout != NULL)
+		scst_set_hw_pending(cmd);
 
 	scst_set_cur_start(cmd);
 
@@ -4671,6 +4818,7 @@ static int scst_finish_cmd(struct scst_cmd *cmd)
 		stat->unaligned_cmd_count++;
 
 	list_del(&cmd->sess_cmd_list_entry);
+	list_del_init(&cmd->tgt_dev_cmd_list_entry);
 
 	/*
 	 * Done under sess_list_lock to sync with scst_abort_cmd() without
@@ -4930,7 +5078,6 @@ static int scst_translate_lun(struct scst_cmd *cmd)
 				cmd->cur_order_data = tgt_dev->curr_order_data;
 				cmd->dev = tgt_dev->dev;
 				cmd->devt = tgt_dev->dev->handler;
-
 				res = 0;
 			} else {
 				PRINT_INFO("Dev handler for device %lld is NULL, "
@@ -5005,6 +5152,9 @@ static int __scst_init_cmd(struct scst_cmd *cmd)
 		}
 #endif
 
+		if (unlikely(scst_aqd_check(cmd)))
+			failure = true;
+
 		if (unlikely(failure))
 			goto out_busy;
 
@@ -5821,6 +5971,32 @@ static inline int scst_is_strict_mgmt_fn(int mgmt_fn)
 	}
 }
 
+/*
+ * Moves cmds from sess_no_tgt_dev_cmd_list, which LUN has been translated
+ * meanwhile, to their tgt_dev_cmd_list. Done here, not in
+ * scst_translate_lun(), to keep sess_list_lock off the fast path. Cmds,
+ * which get translated concurrently, stay on sess_no_tgt_dev_cmd_list, so
+ * callers must still match cmds on it by LUN.
+ *
+ * Must be called under sess_list_lock.
+ */
+void scst_sort_sess_cmds(struct scst_session *sess)
+{
+	struct scst_cmd *cmd, *t;
+
+	lockdep_assert_held(&sess->sess_list_lock);
+
+	list_for_each_entry_safe(cmd, t, &sess->sess_no_tgt_dev_cmd_list,
+				 tgt_dev_cmd_list_entry) {
+		struct scst_tgt_dev *tgt_dev = ACCESS_ONCE(cmd->tgt_dev);
+
+		if (tgt_dev != NULL)
+			list_move_tail(&cmd->tgt_dev_cmd_list_entry,
+				       &tgt_dev->tgt_dev_cmd_list);
+	}
+	return;
+}
+
 /*
  * If mcmd != NULL, must be called under sess_list_lock to sync with "finished"
  * flag assignment in scst_finish_cmd()
@@ -5888,6 +6064,8 @@ void scst_abort_cmd(struct scst_cmd *cmd, struct scst_mgmt_cmd *mcmd,
 	if (cmd->cdb[0] == EXTENDED_COPY)
 		scst_cm_abort_ec_cmd(cmd);
 
+	scst_qos_abort_cmd(cmd);
+
 	if (cmd->tgt_dev == NULL) {
 		spin_lock_irqsave(&scst_init_lock, flags);
 		scst_init_poll_cnt++;
@@ -6147,6 +6325,23 @@ void scst_unblock_aborted_cmds(const struct scst_tgt *tgt,
 	return;
 }
 
+/* sess_list_lock supposed to be held */
+static void scst_abort_task_set_cmd(struct scst_mgmt_cmd *mcmd,
+	struct scst_cmd *cmd, bool other_ini)
+{
+	if ((mcmd->fn == SCST_PR_ABORT_ALL) &&
+	    (mcmd->origin_pr_cmd == cmd))
+		return;
+	if (mcmd->cmd_sn_set) {
+		sBUG_ON(!cmd->tgt_sn_set);
+		if (scst_sn_before(mcmd->cmd_sn, cmd->tgt_sn) ||
+		    (mcmd->cmd_sn == cmd->tgt_sn))
+			return;
+	}
+	scst_abort_cmd(cmd, mcmd, other_ini, 0);
+	return;
+}
+
 static void __scst_abort_task_set(struct scst_mgmt_cmd *mcmd,
 	struct scst_tgt_dev *tgt_dev)
 {
@@ -6164,23 +6359,17 @@ static void __scst_abort_task_set(struct scst_mgmt_cmd *mcmd,
 
 	spin_lock_irq(&sess->sess_list_lock);
 
-	TRACE_DBG("Searching in sess cmd list (sess=%p)", sess);
-	list_for_each_entry(cmd, &sess->sess_cmd_list,
-			    sess_cmd_list_entry) {
-		if ((mcmd->fn == SCST_PR_ABORT_ALL) &&
-		    (mcmd->origin_pr_cmd == cmd))
-			continue;
-		if ((cmd->tgt_dev == tgt_dev) ||
-		    ((cmd->tgt_dev == NULL) &&
-		     (cmd->lun == tgt_dev->lun))) {
-			if (mcmd->cmd_sn_set) {
-				sBUG_ON(!cmd->tgt_sn_set);
-				if (scst_sn_before(mcmd->cmd_sn, cmd->tgt_sn) ||
-				    (mcmd->cmd_sn == cmd->tgt_sn))
-					continue;
-			}
-			scst_abort_cmd(cmd, mcmd, other_ini, 0);
-		}
+	scst_sort_sess_cmds(sess);
+
+	TRACE_DBG("Searching in tgt_dev cmd list (tgt_dev=%p)", tgt_dev);
+	list_for_each_entry(cmd, &tgt_dev->tgt_dev_cmd_list,
+			    tgt_dev_cmd_list_entry)
+		scst_abort_task_set_cmd(mcmd, cmd, other_ini);
+
+	list_for_each_entry(cmd, &sess->sess_no_tgt_dev_cmd_list,
+			    tgt_dev_cmd_list_entry) {
+		if (cmd->lun == tgt_dev->lun)
+			scst_abort_task_set_cmd(mcmd, cmd, other_ini);
 	}
 	spin_unlock_irq(&sess->sess_list_lock);
 
@@ -6277,9 +6466,17 @@ static int scst_clear_task_set(struct scst_mgmt_cmd *mcmd)
 
 		spin_lock_irq(&sess->sess_list_lock);
 
-		TRACE_DBG("Searching in sess cmd list (sess=%p)", sess);
-		list_for_each_entry(cmd, &sess->sess_cmd_list,
-				    sess_cmd_list_entry) {
+		scst_sort_sess_cmds(sess);
+
+		TRACE_DBG("Searching in tgt_dev cmd list (tgt_dev=%p)",
+			tgt_dev);
+		list_for_each_entry(cmd, &tgt_dev->tgt_dev_cmd_list,
+				    tgt_dev_cmd_list_entry) {
+			scst_abort_cmd(cmd, mcmd, 1, 0);
+			aborted = 1;
+		}
+		list_for_each_entry(cmd, &sess->sess_no_tgt_dev_cmd_list,
+				    tgt_dev_cmd_list_entry) {
 			if ((cmd->dev == dev) ||
 			    ((cmd->dev == NULL) &&
 			     scst_is_cmd_belongs_to_dev(cmd, dev))) {
@@ -7679,6 +7876,10 @@ static int scst_init_session(struct scst_session *sess)
 	if (!sess->sess_name)
 		goto failed;
 
+	res = scst_alloc_sess_cmd_pool(sess);
+	if (res != 0)
+		goto failed;
+
 	res = scst_sess_sysfs_create(sess);
 	if (res != 0)
 		goto failed;
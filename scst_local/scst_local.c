@@ -29,6 +29,9 @@
 #include <scsi/scsi_cmnd.h>
 #include <scsi/scsi_host.h>
 #include <scsi/scsi_tcq.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+#include <linux/blk-mq.h>
+#endif
 
 #define LOG_PREFIX "scst_local"
 
@@ -106,6 +109,27 @@ module_param_named(add_default_tgt, scst_local_add_default_tgt, bool, S_IRUGO);
 MODULE_PARM_DESC(add_default_tgt, "add (default) or not on start default "
 	"target scst_local_tgt with default session scst_local_host");
 
+#define SCST_LOCAL_DEF_CAN_QUEUE	2048
+
+/*
+ * Number of SCST commands preallocated for each session. Commands over it
+ * are allocated on the fly.
+ */
+#define SCST_LOCAL_CMD_POOL_SIZE	256
+/* blk_mq_unique_tag() keeps only 16 bits for the per queue tag */
+#define SCST_LOCAL_MAX_CAN_QUEUE	0xFFFF
+
+static unsigned int scst_local_nr_hw_queues = 1;
+module_param_named(nr_hw_queues, scst_local_nr_hw_queues, uint,
+	S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(nr_hw_queues, "number of hardware queues of each new "
+	"SCSI host, 0 - one per CPU (default 1). Effective only with scsi-mq");
+
+static unsigned int scst_local_can_queue = SCST_LOCAL_DEF_CAN_QUEUE;
+module_param_named(can_queue, scst_local_can_queue, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(can_queue, "queue depth of each hardware queue of each "
+	"new SCSI host (default 2048)");
+
 static struct workqueue_struct *aen_workqueue;
 
 struct scst_aen_work_item {
@@ -176,15 +200,6 @@ struct scst_local_tgt_specific {
 	struct scatterlist sgl;
 };
 
-/*
- * We use a pool of objects maintaind by the kernel so that it is less
- * likely to have to allocate them when we are in the data path.
- *
- * Note, we only need this for kernels in which we are likely to get non
- * scatterlist requests.
- */
-static struct kmem_cache *tgt_specific_pool;
-
 #endif /* (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25)) */
 
 static atomic_t scst_local_sess_num = ATOMIC_INIT(0);
@@ -799,6 +814,31 @@ out_up:
 
 #endif /* CONFIG_SCST_PROC */
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+static inline bool scst_local_use_blk_mq(struct Scsi_Host *shost)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
+	return shost_use_blk_mq(shost);
+#else
+	return true;
+#endif
+}
+#endif
+
+/*
+ * With scsi-mq scsi_cmnd.tag is unique only inside its hardware queue, so
+ * with several hardware queues we use the blk-mq tag combined with the
+ * hardware queue index as SCST tag.
+ */
+static inline uint64_t scst_local_cmd_tag(struct scsi_cmnd *SCpnt)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+	if (scst_local_use_blk_mq(SCpnt->device->host))
+		return blk_mq_unique_tag(SCpnt->request);
+#endif
+	return SCpnt->tag;
+}
+
 static int scst_local_abort(struct scsi_cmnd *SCpnt)
 {
 	struct scst_local_sess *sess;
@@ -809,8 +849,9 @@ static int scst_local_abort(struct scsi_cmnd *SCpnt)
 
 	sess = to_scst_lcl_sess(scsi_get_device(SCpnt->device->host));
 
-	ret = scst_rx_mgmt_fn_tag(sess->scst_sess, SCST_ABORT_TASK, SCpnt->tag,
-				 false, &dev_reset_completion);
+	ret = scst_rx_mgmt_fn_tag(sess->scst_sess, SCST_ABORT_TASK,
+				 scst_local_cmd_tag(SCpnt), false,
+				 &dev_reset_completion);
 
 	/* Now wait for the completion ... */
 	wait_for_completion_interruptible(&dev_reset_completion);
@@ -977,21 +1018,6 @@ static int scst_local_queuecommand_lck(struct scsi_cmnd *SCpnt,
 
 	scsi_set_resid(SCpnt, 0);
 
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
-	/*
-	 * Allocate a tgt_specific_structure. We need this in case we need
-	 * to construct a single element SGL.
-	 */
-	tgt_specific = kmem_cache_alloc(tgt_specific_pool, GFP_ATOMIC);
-	if (!tgt_specific) {
-		PRINT_ERROR("Unable to create tgt_specific (size %zu)",
-			sizeof(*tgt_specific));
-		return SCSI_MLQUEUE_HOST_BUSY;
-	}
-	tgt_specific->cmnd = SCpnt;
-	tgt_specific->done = done;
-#endif
-
 	/*
 	 * Tell the target that we have a command ... but first we need
 	 * to get the LUN into a format that SCST understand
@@ -1008,7 +1034,17 @@ static int scst_local_queuecommand_lck(struct scsi_cmnd *SCpnt,
 		return SCSI_MLQUEUE_HOST_BUSY;
 	}
 
-	scst_cmd_set_tag(scst_cmd, SCpnt->tag);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
+	/*
+	 * tgt_specific is allocated by SCST together with scst_cmd. We need
+	 * it in case we need to construct a single element SGL.
+	 */
+	tgt_specific = scst_cmd_get_tgt_priv_area(scst_cmd);
+	tgt_specific->cmnd = SCpnt;
+	tgt_specific->done = done;
+#endif
+
+	scst_cmd_set_tag(scst_cmd, scst_local_cmd_tag(SCpnt));
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
 	if (SCpnt->device->tagged_supported && SCpnt->device->simple_tags)
 		scst_cmd_set_queue_type(scst_cmd, SCST_CMD_QUEUE_SIMPLE);
@@ -1232,6 +1268,19 @@ static int scst_local_slave_alloc(struct scsi_device *sdev)
 {
 #if !defined(RHEL_MAJOR) || RHEL_MAJOR -0 >= 6
 	queue_flag_set_unlocked(QUEUE_FLAG_BIDI, sdev->request_queue);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+	/*
+	 * Complete commands on the CPU that submitted them, not on the one
+	 * of the SCST thread that finished them, so the completion path
+	 * stays local to the submitter's hardware queue.
+	 */
+	if (scst_local_use_blk_mq(sdev->host)) {
+		queue_flag_set_unlocked(QUEUE_FLAG_SAME_COMP,
+					sdev->request_queue);
+		queue_flag_set_unlocked(QUEUE_FLAG_SAME_FORCE,
+					sdev->request_queue);
+	}
 #endif
 	return 0;
 }
@@ -1243,6 +1292,7 @@ static int scst_local_slave_configure(struct scsi_device *sdev)
 	TRACE_ENTRY();
 
 	mqd = scst_local_get_max_queue_depth(sdev);
+	mqd = min(mqd, sdev->host->can_queue);
 
 	PRINT_INFO("Configuring queue depth %d on sdev %p (tagged supported %d)",
 		mqd, sdev, sdev->tagged_supported);
@@ -1252,6 +1302,9 @@ static int scst_local_slave_configure(struct scsi_device *sdev)
 		scsi_activate_tcq(sdev, mqd);
 	else
 		scsi_deactivate_tcq(sdev, mqd);
+#else
+	/* Otherwise it stays at cmd_per_lun */
+	scsi_change_queue_depth(sdev, mqd);
 #endif
 
 	TRACE_EXIT();
@@ -1496,21 +1549,6 @@ static int scst_local_targ_xmit_response(struct scst_cmd *scst_cmd)
 	return SCST_TGT_RES_SUCCESS;
 }
 
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
-static void scst_local_targ_on_free_cmd(struct scst_cmd *scst_cmd)
-{
-	struct scst_local_tgt_specific *tgt_specific;
-
-	TRACE_ENTRY();
-
-	tgt_specific = scst_cmd_get_tgt_priv(scst_cmd);
-	kmem_cache_free(tgt_specific_pool, tgt_specific);
-
-	TRACE_EXIT();
-	return;
-}
-#endif
-
 static void scst_local_targ_task_mgmt_done(struct scst_mgmt_cmd *mgmt_cmd)
 {
 	struct completion *compl;
@@ -1561,6 +1599,10 @@ static struct scst_tgt_template scst_local_targ_tmpl = {
 #endif
 	.xmit_response_atomic	= 1,
 	.multithreaded_init_done = 1,
+	.sess_cmd_pool_size	= SCST_LOCAL_CMD_POOL_SIZE,
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
+	.cmd_priv_size		= sizeof(struct scst_local_tgt_specific),
+#endif
 #ifndef CONFIG_SCST_PROC
 	.enabled_attr_not_needed = 1,
 	.tgtt_attrs		= scst_local_tgtt_attrs,
@@ -1577,9 +1619,6 @@ static struct scst_tgt_template scst_local_targ_tmpl = {
 	.close_session		= scst_local_close_session,
 	.pre_exec		= scst_local_targ_pre_exec,
 	.xmit_response		= scst_local_targ_xmit_response,
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
-	.on_free_cmd		= scst_local_targ_on_free_cmd,
-#endif
 	.task_mgmt_fn_done	= scst_local_targ_task_mgmt_done,
 	.report_aen		= scst_local_report_aen,
 	.get_initiator_port_transport_id = scst_local_get_initiator_port_transport_id,
@@ -1627,7 +1666,7 @@ static struct scsi_host_template scst_lcl_ini_driver_template = {
     defined(CONFIG_SUSE_KERNEL) || \
     !(!defined(RHEL_RELEASE_CODE) || \
      RHEL_RELEASE_CODE -0 < RHEL_RELEASE_VERSION(6, 1))
-	.can_queue			= 2048,
+	.can_queue			= SCST_LOCAL_DEF_CAN_QUEUE,
 	/*
 	 * Set it low for the "Drop back to untagged" case in
 	 * scsi_track_queue_full(). We are adjusting it to a better
@@ -1675,6 +1714,20 @@ static int scst_local_driver_probe(struct device *dev)
 	hpnt->max_id = 1;        /* Don't want more than one id */
 	hpnt->max_lun = SCST_MAX_LUN + 1;
 
+	if (scst_local_can_queue != 0)
+		hpnt->can_queue = min_t(unsigned int, scst_local_can_queue,
+					SCST_LOCAL_MAX_CAN_QUEUE);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 17, 0)
+	/* blk-mq maps CPUs on the hardware queues evenly */
+	if (scst_local_nr_hw_queues == 0)
+		hpnt->nr_hw_queues = num_possible_cpus();
+	else
+		hpnt->nr_hw_queues = min(scst_local_nr_hw_queues,
+					 num_possible_cpus());
+	TRACE_DBG("sess %p: %d hw queues, can_queue %d", sess,
+		hpnt->nr_hw_queues, hpnt->can_queue);
+#endif
+
 	/*
 	 * Because of a change in the size of this field at 2.6.26
 	 * we use this check ... it allows us to work on earlier
@@ -2026,36 +2079,11 @@ static int __init scst_local_init(void)
 #endif
 #endif
 
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
-	/*
-	 * Allocate a pool of structures for tgt_specific structures.
-	 * We only need this if we could get non scatterlist requests
-	 */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 23)
-	tgt_specific_pool = kmem_cache_create("scst_tgt_specific",
-				      sizeof(struct scst_local_tgt_specific),
-				      0, SCST_SLAB_FLAGS, NULL);
-#else
-	tgt_specific_pool = kmem_cache_create("scst_tgt_specific",
-				      sizeof(struct scst_local_tgt_specific),
-				      0, SCST_SLAB_FLAGS, NULL, NULL);
-#endif
-	if (!tgt_specific_pool) {
-		PRINT_ERROR("%s", "Unable to initialize tgt_specific_pool");
-		ret = -ENOMEM;
-		goto out;
-	}
-#endif
-
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 29))
 	ret = device_register(&scst_local_root);
 	if (ret < 0) {
 		PRINT_ERROR("Root device_register() error: %d", ret);
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
-		goto destroy_kmem;
-#else
 		goto out;
-#endif
 	}
 #else
 	scst_local_root = root_device_register(SCST_LOCAL_NAME);
@@ -2137,11 +2165,6 @@ dev_unreg:
 #else
 	root_device_unregister(scst_local_root);
 #endif
-
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
-destroy_kmem:
-	kmem_cache_destroy(tgt_specific_pool);
-#endif
 	goto out;
 }
 
@@ -2173,12 +2196,6 @@ static void __exit scst_local_exit(void)
 	/* Now unregister the target template */
 	scst_unregister_target_template(&scst_local_targ_tmpl);
 
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
-	/* Free the non scatterlist pool we allocated */
-	if (tgt_specific_pool)
-		kmem_cache_destroy(tgt_specific_pool);
-#endif
-
 	/* To make lockdep happy */
 	up_write(&scst_local_exit_rwsem);
 
@@ -49,7 +49,7 @@ static void exec_write(struct vdisk_cmd *vcmd, loff_t loff);
 static void exec_verify(struct vdisk_cmd *vcmd, loff_t loff);
 static void exec_write_same(struct vdisk_cmd *vcmd);
 
-static int open_dev_fd(struct vdisk_dev *dev)
+int open_dev_fd(struct vdisk_dev *dev)
 {
 	int res;
 	int open_flags = O_LARGEFILE;
@@ -234,6 +234,7 @@ static int do_exec(struct vdisk_cmd *vcmd)
 
 	/* Must be reinitialized each time to avoid crash on stale value */
 	vcmd->may_need_to_free_pbuf = 0;
+	vcmd->queued = 0;
 
 	switch(cmd->queue_type) {
 	case SCST_CMD_QUEUE_ORDERED:
@@ -322,6 +323,11 @@ static int do_exec(struct vdisk_cmd *vcmd)
 	case READ_10:
 	case READ_12:
 	case READ_16:
+		if ((vcmd->submit_rw != NULL) &&
+		    vcmd->submit_rw(vcmd, loff, false, false)) {
+			vcmd->queued = 1;
+			break;
+		}
 		exec_read(vcmd, loff);
 		break;
 	case WRITE_6:
@@ -340,6 +346,12 @@ static int do_exec(struct vdisk_cmd *vcmd)
 				goto out;
 			}
 
+			if ((vcmd->submit_rw != NULL) &&
+			    vcmd->submit_rw(vcmd, loff, true, fua)) {
+				vcmd->queued = 1;
+				break;
+			}
+
 			exec_write(vcmd, loff);
 			/* O_DSYNC flag is used for WT devices */
 			if (fua)
@@ -508,7 +520,13 @@ static int do_cached_mem_free(struct vdisk_cmd *vcmd)
 	TRACE_MEM("Cached mem free (cmd %x, buf %"PRIx64")", cmd->cmd_h,
 		cmd->on_cached_mem_free.pbuf);
 
-	free((void *)(unsigned long)cmd->on_cached_mem_free.pbuf);
+	/*
+	 * Prealloced buffers are registered as io_uring fixed buffers,
+	 * which pin their pages, so they must stay mapped until exit.
+	 */
+	if ((uring_depth == 0) ||
+	    (find_prealloc_buf(vcmd->dev, cmd->on_cached_mem_free.pbuf, 1) < 0))
+		free((void *)(unsigned long)cmd->on_cached_mem_free.pbuf);
 
 	memset(reply, 0, sizeof(*reply));
 	reply->cmd_h = cmd->cmd_h;
@@ -694,7 +712,7 @@ reply:
 	return res;
 }
 
-static int process_cmd(struct vdisk_cmd *vcmd)
+int process_cmd(struct vdisk_cmd *vcmd)
 {
 	struct scst_user_get_cmd *cmd = vcmd->cmd;
 	struct scst_user_reply_cmd *reply = vcmd->reply;
@@ -712,7 +730,8 @@ static int process_cmd(struct vdisk_cmd *vcmd)
 				cmd->exec_cmd.bufflen);
 		}
 		res = do_exec(vcmd);
-		if ((reply->exec_reply.resp_data_len != 0) && (res != 150)) {
+		if ((reply->exec_reply.resp_data_len != 0) && (res != 150) &&
+		    !vcmd->queued) {
 			TRACE_BUFFER("Reply data",
 				(void *)(unsigned long)reply->exec_reply.pbuf,
 				reply->exec_reply.resp_data_len);
@@ -958,6 +977,31 @@ uint64_t gen_dev_id_num(const struct vdisk_dev *dev)
 	return ((uint64_t)vdisk_ID << 32) | dev_id_num;
 }
 
+/*
+ * Returns index of the prealloced buffer containing [pbuf, pbuf + len)
+ * or -1, if there is no such buffer.
+ */
+int find_prealloc_buf(const struct vdisk_dev *dev, uint64_t pbuf,
+	uint32_t len)
+{
+	int l = 0, r = dev->prealloc_bufs_cnt - 1;
+
+	while (l <= r) {
+		int m = (l + r) / 2;
+		uint64_t start = (unsigned long)dev->prealloc_bufs[m].iov_base;
+		uint64_t end = start + dev->prealloc_bufs[m].iov_len;
+
+		if (pbuf < start)
+			r = m - 1;
+		else if (pbuf >= end)
+			l = m + 1;
+		else
+			return (pbuf + len <= end) ? m : -1;
+	}
+
+	return -1;
+}
+
 static void exec_inquiry(struct vdisk_cmd *vcmd)
 {
 	struct vdisk_dev *dev = vcmd->dev;
@@ -1687,14 +1731,19 @@ static void exec_prevent_allow_medium_removal(struct vdisk_cmd *vcmd)
 	return;
 }
 
+bool fsync_needed(const struct vdisk_dev *dev)
+{
+	/* Hopefully, the compiler will generate the single comparison */
+	return !(dev->nv_cache || dev->wt_flag || dev->rd_only_flag ||
+		 dev->o_direct_flag || dev->nullio);
+}
+
 static int exec_fsync(struct vdisk_cmd *vcmd)
 {
 	int res = 0;
 	struct vdisk_dev *dev = vcmd->dev;
 
-	/* Hopefully, the compiler will generate the single comparison */
-	if (dev->nv_cache || dev->wt_flag || dev->rd_only_flag ||
-	    dev->o_direct_flag || dev->nullio)
+	if (!fsync_needed(dev))
 		goto out;
 
 	/* ToDo: use sync_file_range() instead */
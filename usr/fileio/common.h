@@ -18,6 +18,8 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #include <scst_user.h>
 
@@ -85,6 +87,13 @@ struct vdisk_dev {
 
 	struct vdisk_tgt_dev tgt_devs[64];
 
+	/*
+	 * Buffers passed to SCST by SCST_USER_PREALLOC_BUFFER, sorted by
+	 * address. Registered as fixed buffers in the io_uring engine.
+	 */
+	struct iovec *prealloc_bufs;
+	int prealloc_bufs_cnt;
+
 	char *name;		/* Name of virtual device,
 				   must be <= SCSI Model + 1 */
 	char *file_name;	/* File name */
@@ -98,8 +107,19 @@ struct vdisk_cmd
 	struct scst_user_get_cmd *cmd;
 	struct vdisk_dev *dev;
 	unsigned int may_need_to_free_pbuf:1;
+	/* Set, if READ/WRITE was submitted asynchronously, see uring.c */
+	unsigned int queued:1;
 	struct scst_user_reply_cmd *reply;
 	uint8_t sense[SCST_SENSE_BUFFERSIZE];
+
+	/*
+	 * If not NULL, called before the synchronous READ/WRITE execution.
+	 * Returns true, if the command was queued, so the reply will be
+	 * sent later, when the I/O completes.
+	 */
+	bool (*submit_rw)(struct vdisk_cmd *vcmd, loff_t loff, bool write,
+		bool fua);
+	void *priv;
 };
 
 /*
@@ -123,8 +143,18 @@ struct vdisk_cmd
 
 extern int vdisk_ID;
 extern bool use_multi;
+extern int uring_depth;
 
 uint32_t crc32buf(const char *buf, size_t len);
 
 uint64_t gen_dev_id_num(const struct vdisk_dev *dev);
 void *main_loop(void *arg);
+void *uring_main_loop(void *arg);
+
+int process_cmd(struct vdisk_cmd *vcmd);
+int open_dev_fd(struct vdisk_dev *dev);
+bool fsync_needed(const struct vdisk_dev *dev);
+void set_cmd_error(struct vdisk_cmd *vcmd, int key, int asc, int ascq);
+void set_busy(struct vdisk_cmd *vcmd);
+int find_prealloc_buf(const struct vdisk_dev *dev, uint64_t pbuf,
+	uint32_t len);
@@ -124,6 +124,7 @@ static struct option const long_options[] =
 	{"prealloc_buffers", required_argument, 0, 'R'},
 	{"prealloc_buffer_size", required_argument, 0, 'Z'},
 	{"multi_cmd", required_argument, 0, 'M'},
+	{"io_uring", required_argument, 0, 'U'},
 #if defined(DEBUG) || defined(TRACING)
 	{"debug", required_argument, 0, 'd'},
 #endif
@@ -163,6 +164,7 @@ static void usage(void)
 	printf("  -R, --prealloc_buffers=n Prealloc n buffers\n");
 	printf("  -Z, --prealloc_buffer_size=n Sets the size in KB of each prealloced buffer\n");
 	printf("  -M, --multi_cmd=v  Use or not multi-commands processing (default: 1)\n");
+	printf("  -U, --io_uring=depth Use io_uring I/O engine with depth commands per thread\n");
 #if defined(DEBUG) || defined(TRACING)
 	printf("  -d, --debug=level	Debug tracing level\n");
 #endif
@@ -258,10 +260,30 @@ out:
 	return;
 }
 
+static int prealloc_buf_cmp(const void *a, const void *b)
+{
+	const struct iovec *x = a, *y = b;
+
+	if (x->iov_base < y->iov_base)
+		return -1;
+	return x->iov_base > y->iov_base;
+}
+
 int prealloc_buffers(struct vdisk_dev *dev)
 {
 	int i, c, res = 0;
 
+	if (uring_depth > 0) {
+		dev->prealloc_bufs = calloc(prealloc_buffers_num * 2,
+					sizeof(*dev->prealloc_bufs));
+		if (dev->prealloc_bufs == NULL) {
+			res = ENOMEM;
+			PRINT_ERROR("%s", "Unable to allocate prealloced "
+				"buffers array");
+			goto out;
+		}
+	}
+
 	if (sgv_disable_clustered_pool)
 		c = 0;
 	else
@@ -292,11 +314,22 @@ int prealloc_buffers(struct vdisk_dev *dev)
 				goto out;
 			}
 			TRACE_MEM("Prealloced buffer cmd_h %x", pre.out.cmd_h);
+
+			if (dev->prealloc_bufs != NULL) {
+				struct iovec *iov;
+
+				iov = &dev->prealloc_bufs[dev->prealloc_bufs_cnt++];
+				iov->iov_base = (void *)(unsigned long)pre.in.pbuf;
+				iov->iov_len = prealloc_buffer_size;
+			}
 		}
 		c--;
 	} while (c >= 0);
 
 out:
+	if (dev->prealloc_bufs != NULL)
+		qsort(dev->prealloc_bufs, dev->prealloc_bufs_cnt,
+			sizeof(*dev->prealloc_bufs), prealloc_buf_cmp);
 	return res;
 }
 
@@ -329,7 +362,8 @@ int start(int argc, char **argv)
 		devs[i].nv_cache = nv_cache;
 		devs[i].o_direct_flag = o_direct_flag;
 		devs[i].nullio = nullio;
-		devs[i].non_blocking = non_blocking;
+		/* The io_uring engine waits for commands by POLL_ADD */
+		devs[i].non_blocking = non_blocking || (uring_depth > 0);
 #if defined(DEBUG_TM_IGNORE) || defined(DEBUG_TM_IGNORE_ALL)
 		devs[i].debug_tm_ignore = debug_tm_ignore;
 #endif
@@ -445,7 +479,9 @@ int start(int argc, char **argv)
 		}
 
 		for (j = 0; j < threads; j++) {
-			rc = pthread_create(&thread[i][j], NULL, main_loop, &devs[i]);
+			rc = pthread_create(&thread[i][j], NULL,
+				(uring_depth > 0) ? uring_main_loop : main_loop,
+				&devs[i]);
 			if (rc != 0) {
 				res = errno;
 				PRINT_ERROR("pthread_create() failed: %s",
@@ -480,6 +516,7 @@ int start(int argc, char **argv)
 			j++;
 		}
 		pthread_mutex_destroy(&devs[i].dev_mutex);
+		free(devs[i].prealloc_bufs);
 	}
 
 out_unreg:
@@ -517,7 +554,7 @@ int main(int argc, char **argv)
 
 	memset(devs, 0, sizeof(devs));
 
-	while ((ch = getopt_long(argc, argv, "+b:e:trongluF:I:cp:f:m:d:vsS:P:hDR:Z:M:",
+	while ((ch = getopt_long(argc, argv, "+b:e:trongluF:I:cp:f:m:d:vsS:P:hDR:Z:M:U:",
 			long_options, &longindex)) >= 0) {
 		switch (ch) {
 		case 'b':
@@ -592,6 +629,23 @@ int main(int argc, char **argv)
 		case 'M':
 			use_multi = atoi(optarg);
 			break;
+		case 'U':
+			uring_depth = atoi(optarg);
+			if ((uring_depth < 0) || (uring_depth > 4096)) {
+				PRINT_ERROR("Wrong io_uring depth %d (allowed "
+					"0-4096)", uring_depth);
+				res = -EINVAL;
+				goto out_usage;
+			}
+#ifndef HAVE_IO_URING
+			if (uring_depth > 0) {
+				PRINT_ERROR("%s", "io_uring support isn't "
+					"compiled in");
+				res = -EINVAL;
+				goto out_usage;
+			}
+#endif
+			break;
 		case 'm':
 			if (strncmp(optarg, "all", 3) == 0)
 				memory_reuse_type = SCST_USER_MEM_REUSE_ALL;
@@ -725,7 +779,10 @@ int main(int argc, char **argv)
 		alloc_fn = malloc;
 	}
 
-	if (!use_multi)
+	if (uring_depth > 0)
+		PRINT_INFO("	Using io_uring I/O engine with depth %d",
+			uring_depth);
+	else if (!use_multi)
 		PRINT_INFO("	%s", "Using SCST_USER_REPLY_AND_GET_CMD");
 
 #if defined(DEBUG_TM_IGNORE) || defined(DEBUG_TM_IGNORE_ALL)
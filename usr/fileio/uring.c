@@ -0,0 +1,723 @@
+/*
+ *  uring.c
+ *
+ *  io_uring based I/O engine for fileio_tgt
+ *
+ *  Copyright (C) 2007 - 2015 Vladislav Bolkhovitin <vst@vlnb.net>
+ *  Copyright (C) 2007 - 2015 SanDisk Corporation
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, version 2
+ *  of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ */
+
+/*
+ * Each engine thread owns an io_uring instance and a pool of uring_depth
+ * command slots. Commands are fetched by SCST_USER_REPLY_AND_GET_MULTI in
+ * batches, which size adapts to the load. READs and WRITEs are submitted
+ * to the ring, using fixed buffers, if the data buffer is one of the
+ * prealloced buffers, all other commands are executed synchronously by
+ * process_cmd(). Replies are collected as completions arrive and sent in
+ * batches with the next SCST_USER_REPLY_AND_GET_MULTI call. Readiness of
+ * the scst_user device is also watched through the ring by POLL_ADD, so
+ * the thread sleeps only in io_uring_enter().
+ *
+ * The raw io_uring system calls are used to not depend on liburing.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include <sys/ioctl.h>
+#include <sys/poll.h>
+
+#include <pthread.h>
+
+#include "common.h"
+
+int uring_depth;
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+/* New syscalls have the same numbers on all architectures */
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup	425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter	426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register	427
+#endif
+
+/* Max number of commands fetched by one SCST_USER_REPLY_AND_GET_MULTI */
+#define URING_MAX_FETCH		64
+
+/* user_data of the scst_user device POLL_ADD request */
+#define URING_POLL_DATA		0
+
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+struct uring {
+	int fd;
+	unsigned int sq_entries;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	/* Tail of the filled, but not yet published SQEs */
+	unsigned int sqe_tail;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+};
+
+struct uring_thread;
+
+struct uring_slot {
+	struct vdisk_cmd vcmd;
+	struct scst_user_get_cmd cmd;
+	struct scst_user_reply_cmd reply;
+	struct uring_thread *ut;
+
+	/* I/O state of the queued READ/WRITE */
+	struct iovec iov;
+	loff_t loff;
+	int32_t done;
+	int buf_index;
+	unsigned int write:1;
+	unsigned int fua:1;
+	unsigned int fsync:1;
+
+	struct uring_slot *next_free;
+};
+
+struct uring_thread {
+	struct vdisk_dev *dev;
+	struct uring ring;
+	int fd;
+	bool fixed_bufs;
+
+	struct uring_slot *slots;
+	struct uring_slot *free_slots;
+	int free_cnt;
+
+	/* Slots with ready replies, in the order of completion */
+	struct uring_slot **done;
+	int done_cnt;
+	struct scst_user_reply_cmd *replies;
+
+	/* Current number of commands to fetch at once */
+	int fetch;
+	int max_fetch;
+
+	struct {
+		struct scst_user_get_multi multi_cmd;
+		struct scst_user_get_cmd cmds[URING_MAX_FETCH];
+	} multi;
+};
+
+static int uring_setup(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	int res = 0;
+
+	TRACE_ENTRY();
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) {
+		res = -errno;
+		goto out;
+	}
+
+	ring->sq_entries = p.sq_entries;
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		res = -errno;
+		goto out_close;
+	}
+
+	ring->cq_ring_sz = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED) {
+		res = -errno;
+		goto out_unmap_sq;
+	}
+
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		res = -errno;
+		goto out_unmap_cq;
+	}
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->sqe_tail = *ring->sq_tail;
+
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+
+	TRACE_DBG("io_uring fd %d, sq_entries %d, cq_entries %d", ring->fd,
+		p.sq_entries, p.cq_entries);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_unmap_cq:
+	munmap(ring->cq_ring, ring->cq_ring_sz);
+
+out_unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+
+out_close:
+	close(ring->fd);
+	goto out;
+}
+
+static void uring_release(struct uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_sz);
+	munmap(ring->cq_ring, ring->cq_ring_sz);
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+	close(ring->fd);
+	return;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (ring->sqe_tail - load_acquire(ring->sq_head) >= ring->sq_entries)
+		return NULL;
+
+	idx = ring->sqe_tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	ring->sq_array[idx] = idx;
+	ring->sqe_tail++;
+
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/*
+ * Submits all filled SQEs and, if wait is set, waits for at least one
+ * completion. Returns 0 on success or negative errno.
+ */
+static int uring_enter(struct uring *ring, bool wait)
+{
+	unsigned int to_submit;
+	int res;
+
+	store_release(ring->sq_tail, ring->sqe_tail);
+	to_submit = ring->sqe_tail - load_acquire(ring->sq_head);
+
+	if ((to_submit == 0) && !wait)
+		return 0;
+
+	res = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait ? 1 : 0,
+		wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+	return (res < 0) ? -errno : 0;
+}
+
+static void uring_queue_poll(struct uring_thread *ut)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&ut->ring);
+	sBUG_ON(sqe == NULL);
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = ut->dev->scst_usr_fd;
+	sqe->poll_events = POLLIN;
+	sqe->user_data = URING_POLL_DATA;
+	return;
+}
+
+/*
+ * There is never more than one SQE per slot and one for the poll, so,
+ * since the ring has at least uring_depth + 1 entries, SQEs for the
+ * queued slots can't run out.
+ */
+static void uring_queue_slot(struct uring_thread *ut, struct uring_slot *slot)
+{
+	struct scst_user_scsi_cmd_exec *cmd = &slot->cmd.exec_cmd;
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&ut->ring);
+	sBUG_ON(sqe == NULL);
+
+	sqe->fd = ut->fd;
+	sqe->user_data = (unsigned long)slot;
+
+	if (slot->fsync) {
+		sqe->opcode = IORING_OP_FSYNC;
+		goto out;
+	}
+
+	sqe->off = slot->loff + slot->done;
+	if (slot->buf_index >= 0) {
+		sqe->opcode = slot->write ? IORING_OP_WRITE_FIXED :
+					    IORING_OP_READ_FIXED;
+		sqe->addr = cmd->pbuf + slot->done;
+		sqe->len = cmd->bufflen - slot->done;
+		sqe->buf_index = slot->buf_index;
+	} else {
+		slot->iov.iov_base = (void *)(unsigned long)(cmd->pbuf +
+								slot->done);
+		slot->iov.iov_len = cmd->bufflen - slot->done;
+		sqe->opcode = slot->write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (unsigned long)&slot->iov;
+		sqe->len = 1;
+	}
+
+	TRACE_DBG("Queued %s cmd %d, off %"PRId64", len %d, buf_index %d",
+		slot->write ? "write" : "read", slot->cmd.cmd_h,
+		(uint64_t)sqe->off, sqe->len, slot->buf_index);
+
+out:
+	return;
+}
+
+/* vdisk_cmd.submit_rw callback, called from do_exec() */
+static bool uring_submit_rw(struct vdisk_cmd *vcmd, loff_t loff, bool write,
+	bool fua)
+{
+	struct uring_slot *slot = vcmd->priv;
+	struct uring_thread *ut = slot->ut;
+	struct scst_user_scsi_cmd_exec *cmd = &vcmd->cmd->exec_cmd;
+
+	if (vcmd->dev->nullio || (cmd->bufflen == 0))
+		return false;
+
+	slot->loff = loff;
+	slot->done = 0;
+	slot->write = write;
+	slot->fua = fua && fsync_needed(vcmd->dev);
+	slot->fsync = 0;
+	slot->buf_index = ut->fixed_bufs ?
+		find_prealloc_buf(vcmd->dev, cmd->pbuf, cmd->bufflen) : -1;
+
+	uring_queue_slot(ut, slot);
+	return true;
+}
+
+static struct uring_slot *uring_get_slot(struct uring_thread *ut)
+{
+	struct uring_slot *slot = ut->free_slots;
+
+	ut->free_slots = slot->next_free;
+	ut->free_cnt--;
+	return slot;
+}
+
+static void uring_put_slot(struct uring_thread *ut, struct uring_slot *slot)
+{
+	slot->next_free = ut->free_slots;
+	ut->free_slots = slot;
+	ut->free_cnt++;
+	return;
+}
+
+static void uring_complete_slot(struct uring_thread *ut,
+	struct uring_slot *slot, int res)
+{
+	struct vdisk_cmd *vcmd = &slot->vcmd;
+	struct scst_user_scsi_cmd_exec *cmd = &slot->cmd.exec_cmd;
+
+	TRACE_ENTRY();
+
+	if (slot->fsync) {
+		/* Same as exec_fsync(), errors are ignored */
+		if (res < 0)
+			TRACE_DBG("fsync() returned %d", res);
+		goto done;
+	}
+
+	if (res < 0) {
+		PRINT_ERROR("%s returned %d from %d (cmd_h %x)",
+			slot->write ? "write" : "read", res,
+			cmd->bufflen - slot->done, slot->cmd.cmd_h);
+		if (res == -EAGAIN)
+			set_busy(vcmd);
+		else if (slot->write)
+			set_cmd_error(vcmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
+		else
+			set_cmd_error(vcmd,
+				SCST_LOAD_SENSE(scst_sense_read_error));
+		goto done;
+	}
+
+	slot->done += res;
+	if (slot->done < cmd->bufflen) {
+		if (res == 0) {
+			if (!slot->write) {
+				PRINT_ERROR("read() returned 0 from %d",
+					cmd->bufflen - slot->done);
+				set_cmd_error(vcmd,
+				    SCST_LOAD_SENSE(scst_sense_read_error));
+				goto done;
+			}
+			PRINT_INFO("Suspicious: write() returned 0 from %d",
+				cmd->bufflen - slot->done);
+		}
+		TRACE_MGMT_DBG("Short %s %d, restarting",
+			slot->write ? "write" : "read", res);
+		uring_queue_slot(ut, slot);
+		goto out;
+	}
+
+	if (slot->fua) {
+		slot->fsync = 1;
+		uring_queue_slot(ut, slot);
+		goto out;
+	}
+
+done:
+	ut->done[ut->done_cnt++] = slot;
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+/* Returns true, if the scst_user device became readable */
+static bool uring_reap(struct uring_thread *ut)
+{
+	struct uring *ring = &ut->ring;
+	unsigned int head = *ring->cq_head;
+	bool readable = false;
+
+	while (head != load_acquire(ring->cq_tail)) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+		if (cqe->user_data == URING_POLL_DATA)
+			readable = true;
+		else
+			uring_complete_slot(ut,
+				(struct uring_slot *)(unsigned long)cqe->user_data,
+				cqe->res);
+		head++;
+	}
+	store_release(ring->cq_head, head);
+
+	return readable;
+}
+
+/*
+ * Sends ready replies and fetches new commands. Returns 0 on success or
+ * error from process_cmd(). Sets *more, if more commands might be ready.
+ */
+static int uring_reply_and_get(struct uring_thread *ut, bool *more)
+{
+	struct scst_user_get_multi *multi_cmd = &ut->multi.multi_cmd;
+	int res = 0, rc, i, cnt, got, done;
+
+	TRACE_ENTRY();
+
+	cnt = min(ut->fetch, ut->free_cnt);
+
+	for (i = 0; i < ut->done_cnt; i++) {
+		ut->replies[i] = ut->done[i]->reply;
+		TRACE_BUFFER("Sending reply", &ut->replies[i],
+			sizeof(ut->replies[i]));
+	}
+
+	multi_cmd->preplies = (unsigned long)ut->replies;
+	multi_cmd->replies_cnt = ut->done_cnt;
+	multi_cmd->replies_done = 0;
+	multi_cmd->cmds_cnt = cnt;
+
+	TRACE_DBG("replies_cnt %d, cmds_cnt %d", ut->done_cnt, cnt);
+
+	rc = ioctl(ut->dev->scst_usr_fd, SCST_USER_REPLY_AND_GET_MULTI,
+		multi_cmd);
+	if (rc == 0) {
+		done = multi_cmd->replies_done;
+		got = multi_cmd->cmds_cnt;
+	} else {
+		rc = errno;
+		done = multi_cmd->replies_done;
+		got = 0;
+		switch (rc) {
+		case EAGAIN:
+			TRACE_DBG("SCST_USER returned EAGAIN (%d)", rc);
+			break;
+		case EINTR:
+			break;
+		case ESRCH:
+		case EBUSY:
+			TRACE_MGMT_DBG("SCST_USER returned %d (%s)", rc,
+				strerror(rc));
+			/* The failed reply is dropped, the same as in main_loop() */
+			done++;
+			break;
+		default:
+			PRINT_ERROR("SCST_USER failed: %s (%d)", strerror(rc),
+				rc);
+			done++;
+			break;
+		}
+		done = min(done, ut->done_cnt);
+	}
+
+	for (i = 0; i < done; i++)
+		uring_put_slot(ut, ut->done[i]);
+	ut->done_cnt -= done;
+	memmove(ut->done, &ut->done[done], ut->done_cnt * sizeof(*ut->done));
+
+	TRACE_DBG("cmds_cnt %d (requested %d)", got, cnt);
+
+	for (i = 0; i < got; i++) {
+		struct uring_slot *slot = uring_get_slot(ut);
+
+		slot->cmd = ut->multi.cmds[i];
+		slot->vcmd.queued = 0;
+		res = process_cmd(&slot->vcmd);
+#ifdef DEBUG_TM_IGNORE
+		if (res == 150) {
+			uring_put_slot(ut, slot);
+			res = 0;
+			continue;
+		}
+#endif
+		if (res != 0) {
+			uring_put_slot(ut, slot);
+			goto out;
+		}
+		if (!slot->vcmd.queued)
+			ut->done[ut->done_cnt++] = slot;
+	}
+
+	/*
+	 * Double the batch, if it was filled, halve it, if it was less
+	 * than half full, so under load few syscalls fetch many commands,
+	 * while under light load few slots are kept reserved.
+	 */
+	if (cnt != 0) {
+		if ((got == cnt) && (cnt == ut->fetch))
+			ut->fetch = min(ut->fetch * 2, ut->max_fetch);
+		else if (got < ut->fetch / 2)
+			ut->fetch = max(ut->fetch / 2, 1);
+		*more = (got == cnt);
+	}
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static int uring_thread_init(struct uring_thread *ut, struct vdisk_dev *dev)
+{
+	int res, i;
+
+	TRACE_ENTRY();
+
+	memset(ut, 0, sizeof(*ut));
+	ut->dev = dev;
+	ut->max_fetch = min(uring_depth, URING_MAX_FETCH);
+	ut->fetch = 1;
+
+	ut->fd = open_dev_fd(dev);
+	if (ut->fd < 0) {
+		res = -errno;
+		PRINT_ERROR("Unable to open file %s (%s)", dev->file_name,
+			strerror(-res));
+		goto out;
+	}
+
+	ut->slots = calloc(uring_depth, sizeof(*ut->slots));
+	ut->done = calloc(uring_depth, sizeof(*ut->done));
+	ut->replies = calloc(uring_depth, sizeof(*ut->replies));
+	if ((ut->slots == NULL) || (ut->done == NULL) || (ut->replies == NULL)) {
+		res = -ENOMEM;
+		PRINT_ERROR("Unable to allocate %d io_uring slots", uring_depth);
+		goto out_free;
+	}
+
+	for (i = 0; i < uring_depth; i++) {
+		struct uring_slot *slot = &ut->slots[i];
+
+		slot->ut = ut;
+		slot->vcmd.fd = ut->fd;
+		slot->vcmd.cmd = &slot->cmd;
+		slot->vcmd.dev = dev;
+		slot->vcmd.reply = &slot->reply;
+		slot->vcmd.submit_rw = uring_submit_rw;
+		slot->vcmd.priv = slot;
+		uring_put_slot(ut, slot);
+	}
+
+	res = uring_setup(&ut->ring, uring_depth + 1);
+	if (res != 0) {
+		PRINT_ERROR("io_uring_setup() failed: %s", strerror(-res));
+		goto out_free;
+	}
+
+	if (dev->prealloc_bufs_cnt > 0) {
+		res = syscall(__NR_io_uring_register, ut->ring.fd,
+			IORING_REGISTER_BUFFERS, dev->prealloc_bufs,
+			dev->prealloc_bufs_cnt);
+		if (res == 0)
+			ut->fixed_bufs = true;
+		else {
+			res = errno;
+			PRINT_INFO("Unable to register %d fixed buffers (%s), "
+				"not fixed ones will be used",
+				dev->prealloc_bufs_cnt, strerror(res));
+			res = 0;
+		}
+	}
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_free:
+	free(ut->replies);
+	free(ut->done);
+	free(ut->slots);
+	close(ut->fd);
+	goto out;
+}
+
+static void uring_thread_release(struct uring_thread *ut)
+{
+	uring_release(&ut->ring);
+	free(ut->replies);
+	free(ut->done);
+	free(ut->slots);
+	close(ut->fd);
+	return;
+}
+
+void *uring_main_loop(void *arg)
+{
+	int res;
+	struct vdisk_dev *dev = (struct vdisk_dev *)arg;
+	struct uring_thread *ut;
+	bool more = true, poll_queued = false;
+
+	TRACE_ENTRY();
+
+	ut = malloc(sizeof(*ut));
+	if (ut == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	res = uring_thread_init(ut, dev);
+	if (res != 0)
+		goto out_free;
+
+	PRINT_INFO("Thread %d uses io_uring with depth %d%s", gettid(),
+		uring_depth, ut->fixed_bufs ? " and fixed buffers" : "");
+
+	while (1) {
+		bool wait;
+
+		if ((ut->done_cnt > 0) || (more && (ut->free_cnt > 0))) {
+			res = uring_reply_and_get(ut, &more);
+			if (res != 0)
+				goto out_release;
+		}
+
+		if (!more && !poll_queued) {
+			uring_queue_poll(ut);
+			poll_queued = true;
+		}
+
+		/*
+		 * Sleep only if there is nothing to send and nothing can be
+		 * fetched, i.e. either the device isn't readable or all the
+		 * slots are busy with I/O.
+		 */
+		wait = (ut->done_cnt == 0) && (!more || (ut->free_cnt == 0));
+
+		res = uring_enter(&ut->ring, wait);
+		if (res != 0) {
+			switch (-res) {
+			case EINTR:
+			case EAGAIN:
+			case EBUSY:
+				break;
+			default:
+				PRINT_ERROR("io_uring_enter() failed: %s",
+					strerror(-res));
+				goto out_release;
+			}
+		}
+
+		if (uring_reap(ut)) {
+			more = true;
+			poll_queued = false;
+		}
+	}
+
+out_release:
+	uring_thread_release(ut);
+
+out_free:
+	free(ut);
+
+out:
+	PRINT_INFO("Thread %d exiting (res=%d)", gettid(), res);
+
+	TRACE_EXIT_RES(res);
+	return (void *)(long)res;
+}
+
+#else /* HAVE_IO_URING */
+
+void *uring_main_loop(void *arg)
+{
+	PRINT_ERROR("%s", "fileio_tgt was built without io_uring support");
+	return (void *)(long)-ENOSYS;
+}
+
+#endif /* HAVE_IO_URING */